@@ -17,6 +17,7 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -26,10 +27,14 @@
 #include <string.h>
 #include <errno.h>
 
+#include <shared/util.h>
+
 #include "libkmod.h"
 #include "libkmod-internal.h"
+#include "libkmod-index.h"
 
 #define MODULES_BUILTIN_MODINFO "modules.builtin.modinfo"
+#define MODULES_BUILTIN_MODINFO_BIN MODULES_BUILTIN_MODINFO ".bin"
 
 struct kmod_builtin_iter {
 	struct kmod_ctx *ctx;
@@ -260,9 +265,200 @@ fail:
 	return false;
 }
 
-/* array will be allocated with strings in a single malloc, just free *array */
-ssize_t kmod_builtin_get_modinfo(struct kmod_ctx *ctx, const char *modname,
-				char ***modinfo)
+/*
+ * modules.builtin.modinfo.bin and the modules.builtin.modinfo it points
+ * into, mapped together. The index is not used if it's older than the file.
+ */
+struct kmod_builtin_modinfo {
+	struct index_mm *idx;
+	unsigned long long idx_stamp;
+	const char *mem;
+	size_t size;
+	unsigned long long stamp;
+};
+
+int kmod_builtin_modinfo_open(struct kmod_ctx *ctx,
+					struct kmod_builtin_modinfo **pbm)
+{
+	const char *dirname = kmod_get_dirname(ctx);
+	struct kmod_builtin_modinfo *bm;
+	char path[PATH_MAX];
+	struct stat st;
+	void *mem;
+	int fd, err;
+
+	bm = calloc(1, sizeof(*bm));
+	if (bm == NULL)
+		return -ENOMEM;
+
+	snprintf(path, sizeof(path), "%s/%s", dirname,
+					MODULES_BUILTIN_MODINFO_BIN);
+	err = index_mm_open(ctx, path, &bm->idx_stamp, &bm->idx);
+	if (err < 0)
+		goto fail;
+
+	snprintf(path, sizeof(path), "%s/%s", dirname, MODULES_BUILTIN_MODINFO);
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		close(fd);
+		goto fail;
+	}
+
+	if (!kmod_index_is_current(ctx, MODULES_BUILTIN_MODINFO_BIN,
+					MODULES_BUILTIN_MODINFO, bm->idx_stamp)) {
+		close(fd);
+		err = -ESTALE;
+		goto fail;
+	}
+
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		err = -errno;
+		goto fail;
+	}
+	kmod_stat_add(ctx, KMOD_STAT_BYTES_MAPPED, st.st_size);
+
+	bm->mem = mem;
+	bm->size = st.st_size;
+	bm->stamp = stat_mstamp(&st);
+	*pbm = bm;
+	return 0;
+
+fail:
+	kmod_builtin_modinfo_close(bm);
+	return err;
+}
+
+void kmod_builtin_modinfo_close(struct kmod_builtin_modinfo *bm)
+{
+	if (bm->idx != NULL)
+		index_mm_close(bm->idx);
+	if (bm->mem != NULL)
+		munmap((void *) bm->mem, bm->size);
+	free(bm);
+}
+
+/* whether both files are still the ones that were mapped */
+bool kmod_builtin_modinfo_is_current(struct kmod_ctx *ctx,
+				     const struct kmod_builtin_modinfo *bm)
+{
+	const char *dirname = kmod_get_dirname(ctx);
+	char path[PATH_MAX];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s", dirname,
+					MODULES_BUILTIN_MODINFO_BIN);
+	if (stat(path, &st) < 0 || stat_mstamp(&st) != bm->idx_stamp)
+		return false;
+
+	snprintf(path, sizeof(path), "%s/%s", dirname, MODULES_BUILTIN_MODINFO);
+	if (stat(path, &st) < 0 || stat_mstamp(&st) != bm->stamp)
+		return false;
+
+	return true;
+}
+
+/*
+ * Find the byte range of @modname's records in modules.builtin.modinfo from
+ * the index depmod writes next to it.
+ */
+static int builtin_modinfo_index_lookup(const struct kmod_builtin_modinfo *bm,
+					const char *modname,
+					size_t *offset, size_t *len)
+{
+	char *value, *end;
+	int err;
+
+	value = index_mm_search(bm->idx, modname);
+	if (value == NULL)
+		return -ENOENT;
+
+	/* value: "offset length" */
+	err = -EINVAL;
+	errno = 0;
+	*offset = strtoull(value, &end, 10);
+	if (errno != 0 || *end != ' ')
+		goto out;
+
+	*len = strtoull(end + 1, &end, 10);
+	if (errno != 0 || *end != '\0')
+		goto out;
+
+	if (*len == 0 || *offset > bm->size || *len > bm->size - *offset)
+		goto out;
+
+	err = 0;
+out:
+	free(value);
+	return err;
+}
+
+/*
+ * Build the modinfo array straight from @modname's records, located through
+ * the index. Returns -ENOENT, or another error, when the scan must be used.
+ */
+static ssize_t builtin_modinfo_from_index(const struct kmod_builtin_modinfo *bm,
+					  const char *modname,
+					  char ***modinfo)
+{
+	size_t modlen = strlen(modname);
+	size_t offset, len, size;
+	const char *p, *end;
+	ssize_t count;
+	char *s;
+	int err;
+
+	err = builtin_modinfo_index_lookup(bm, modname, &offset, &len);
+	if (err < 0)
+		return err;
+
+	/*
+	 * Check every record is one of @modname's, as the index points to,
+	 * and count them
+	 */
+	count = 0;
+	p = bm->mem + offset;
+	end = p + len;
+	while (p < end) {
+		const char *nul = memchr(p, '\0', end - p);
+
+		if (nul == NULL || (size_t)(nul - p) <= modlen ||
+		    p[modlen] != '.' || memcmp(p, modname, modlen) != 0)
+			return -EINVAL;
+
+		count++;
+		p = nul + 1;
+	}
+
+	/* modinfo strings are the records without the "modname." prefix */
+	size = len - (modlen + 1) * count;
+	*modinfo = malloc(size + sizeof(char *) * (count + 1));
+	if (*modinfo == NULL)
+		return -errno;
+
+	s = (char *)(*modinfo + count + 1);
+	for (p = bm->mem + offset, count = 0; p < end; count++) {
+		size_t n = strlen(p) + 1;
+
+		memcpy(s, p + modlen + 1, n - modlen - 1);
+		(*modinfo)[count] = s;
+		s += n - modlen - 1;
+		p += n;
+	}
+	(*modinfo)[count] = NULL;
+
+	return count;
+}
+
+static ssize_t builtin_modinfo_scan(struct kmod_ctx *ctx, const char *modname,
+				   char ***modinfo)
 {
 	ssize_t count = 0;
 	char *s, *line = NULL;
@@ -328,3 +524,29 @@ fail:
 	kmod_builtin_iter_free(iter);
 	return count;
 }
+
+/* array will be allocated with strings in a single malloc, just free *array */
+ssize_t kmod_builtin_get_modinfo(struct kmod_ctx *ctx, const char *modname,
+				char ***modinfo)
+{
+	struct kmod_builtin_modinfo *bm = kmod_get_builtin_modinfo(ctx);
+	ssize_t count;
+
+	/* kept in @ctx by kmod_load_resources(), or only for this call */
+	if (bm != NULL) {
+		count = builtin_modinfo_from_index(bm, modname, modinfo);
+	} else {
+		count = kmod_builtin_modinfo_open(ctx, &bm);
+		if (count == 0) {
+			count = builtin_modinfo_from_index(bm, modname, modinfo);
+			kmod_builtin_modinfo_close(bm);
+		}
+	}
+	if (count >= 0)
+		return count;
+
+	DBG(ctx, "no usable index for builtin %s: %s\n", modname,
+	    strerror(-count));
+
+	return builtin_modinfo_scan(ctx, modname, modinfo);
+}
@@ -21,15 +21,21 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <shared/hash.h>
 #include <shared/util.h>
 
 #include "libkmod.h"
@@ -58,6 +64,18 @@ struct kmod_softdep {
 	unsigned int n_post;
 };
 
+/* softdep line as found in the configuration, parsed on first use */
+struct kmod_softdep_line {
+	char *line;
+	char modname[];
+};
+
+struct kmod_config_source {
+	unsigned long long stamp;
+	unsigned long long size;
+	char path[];
+};
+
 const char *kmod_blacklist_get_modname(const struct kmod_list *l)
 {
 	return l->data;
@@ -98,18 +116,24 @@ const char *kmod_softdep_get_name(const struct kmod_list *l) {
 	return dep->name;
 }
 
-const char * const *kmod_softdep_get_pre(const struct kmod_list *l, unsigned int *count) {
-	const struct kmod_softdep *dep = l->data;
+const char * const *kmod_softdep_pre(const struct kmod_softdep *dep, unsigned int *count) {
 	*count = dep->n_pre;
 	return dep->pre;
 }
 
-const char * const *kmod_softdep_get_post(const struct kmod_list *l, unsigned int *count) {
-	const struct kmod_softdep *dep = l->data;
+const char * const *kmod_softdep_post(const struct kmod_softdep *dep, unsigned int *count) {
 	*count = dep->n_post;
 	return dep->post;
 }
 
+const char * const *kmod_softdep_get_pre(const struct kmod_list *l, unsigned int *count) {
+	return kmod_softdep_pre(l->data, count);
+}
+
+const char * const *kmod_softdep_get_post(const struct kmod_list *l, unsigned int *count) {
+	return kmod_softdep_post(l->data, count);
+}
+
 static int kmod_config_add_command(struct kmod_config *config,
 						const char *modname,
 						const char *command,
@@ -255,11 +279,10 @@ static void kmod_config_free_blacklist(struct kmod_config *config,
 	config->blacklists = kmod_list_remove(l);
 }
 
-static int kmod_config_add_softdep(struct kmod_config *config,
-							const char *modname,
+/* Parse a softdep line into a single allocation, to be released with free() */
+struct kmod_softdep *kmod_softdep_new(struct kmod_ctx *ctx, const char *modname,
 							const char *line)
 {
-	struct kmod_list *list;
 	struct kmod_softdep *dep;
 	const char *s, *p;
 	char *itr;
@@ -269,7 +292,7 @@ static int kmod_config_add_softdep(struct kmod_config *config,
 	bool was_space = false;
 	enum { S_NONE, S_PRE, S_POST } mode = S_NONE;
 
-	DBG(config->ctx, "modname=%s\n", modname);
+	DBG(ctx, "modname=%s\n", modname);
 
 	/* analyze and count */
 	for (p = s = line; ; s++) {
@@ -312,15 +335,15 @@ static int kmod_config_add_softdep(struct kmod_config *config,
 			break;
 	}
 
-	DBG(config->ctx, "%u pre, %u post\n", n_pre, n_post);
+	DBG(ctx, "%u pre, %u post\n", n_pre, n_post);
 
 	dep = malloc(sizeof(struct kmod_softdep) + modnamelen +
 		     n_pre * sizeof(const char *) +
 		     n_post * sizeof(const char *) +
 		     buflen);
 	if (dep == NULL) {
-		ERR(config->ctx, "out-of-memory modname=%s\n", modname);
-		return -ENOMEM;
+		ERR(ctx, "out-of-memory modname=%s\n", modname);
+		return NULL;
 	}
 	dep->n_pre = n_pre;
 	dep->n_post = n_post;
@@ -382,6 +405,20 @@ static int kmod_config_add_softdep(struct kmod_config *config,
 			break;
 	}
 
+	return dep;
+}
+
+static int kmod_config_add_softdep(struct kmod_config *config,
+							const char *modname,
+							const char *line)
+{
+	struct kmod_list *list;
+	struct kmod_softdep *dep;
+
+	dep = kmod_softdep_new(config->ctx, modname, line);
+	if (dep == NULL)
+		return -ENOMEM;
+
 	list = kmod_list_append(config->softdeps, dep);
 	if (list == NULL) {
 		free(dep);
@@ -392,6 +429,50 @@ static int kmod_config_add_softdep(struct kmod_config *config,
 	return 0;
 }
 
+static int kmod_config_add_softdep_line(struct kmod_config *config,
+							const char *modname,
+							const char *line)
+{
+	struct kmod_softdep_line *sl;
+	struct kmod_list *list;
+	size_t modnamelen = strlen(modname) + 1;
+	size_t linelen = strlen(line) + 1;
+
+	sl = malloc(sizeof(*sl) + modnamelen + linelen);
+	if (sl == NULL)
+		return -ENOMEM;
+
+	sl->line = sl->modname + modnamelen;
+	memcpy(sl->modname, modname, modnamelen);
+	memcpy(sl->line, line, linelen);
+
+	list = kmod_list_append(config->softdep_lines, sl);
+	if (list == NULL) {
+		free(sl);
+		return -ENOMEM;
+	}
+	config->softdep_lines = list;
+
+	return 0;
+}
+
+static int kmod_config_parse_softdeps(struct kmod_config *config)
+{
+	while (config->softdep_lines != NULL) {
+		struct kmod_softdep_line *sl = config->softdep_lines->data;
+		int err;
+
+		err = kmod_config_add_softdep(config, sl->modname, sl->line);
+		if (err < 0)
+			return err;
+
+		free(sl);
+		config->softdep_lines = kmod_list_remove(config->softdep_lines);
+	}
+
+	return 0;
+}
+
 static char *softdep_to_char(struct kmod_softdep *dep) {
 	const size_t sz_preprefix = sizeof("pre: ") - 1;
 	const size_t sz_postprefix = sizeof("post: ") - 1;
@@ -631,28 +712,27 @@ static int kmod_config_parse(struct kmod_config *config, int fd,
 							const char *filename)
 {
 	struct kmod_ctx *ctx = config->ctx;
+	struct line_reader r;
 	char *line;
-	FILE *fp;
 	unsigned int linenum = 0;
 	int err;
 
-	fp = fdopen(fd, "r");
-	if (fp == NULL) {
-		err = -errno;
-		ERR(config->ctx, "fd %d: %m\n", fd);
+	err = line_reader_open(&r, fd);
+	if (err < 0) {
+		ERR(config->ctx, "fd %d: %s\n", fd, strerror(-err));
 		close(fd);
 		return err;
 	}
 
-	while ((line = freadline_wrapped(fp, &linenum)) != NULL) {
+	while ((line = line_reader_next(&r, &linenum)) != NULL) {
 		char *cmd, *saveptr;
 
 		if (line[0] == '\0' || line[0] == '#')
-			goto done_next;
+			continue;
 
 		cmd = strtok_r(line, "\t ", &saveptr);
 		if (cmd == NULL)
-			goto done_next;
+			continue;
 
 		if (streq(cmd, "alias")) {
 			char *alias = strtok_r(NULL, "\t ", &saveptr);
@@ -702,7 +782,7 @@ static int kmod_config_parse(struct kmod_config *config, int fd,
 			if (underscores(modname) < 0 || softdeps == NULL)
 				goto syntax_error;
 
-			kmod_config_add_softdep(config, modname, softdeps);
+			kmod_config_add_softdep_line(config, modname, softdeps);
 		} else if (streq(cmd, "include")
 				|| streq(cmd, "config")) {
 			ERR(ctx, "%s: command %s is deprecated and not parsed anymore\n",
@@ -712,17 +792,147 @@ syntax_error:
 			ERR(ctx, "%s line %u: ignoring bad line starting with '%s'\n",
 						filename, linenum, cmd);
 		}
+	}
 
-done_next:
-		free(line);
+	line_reader_close(&r);
+	close(fd);
+
+	return 0;
+}
+
+/* Entries of @type that came from configuration files, up to @end */
+static const struct kmod_list *config_get_list(
+					const struct kmod_config *config,
+					enum config_type type,
+					const struct kmod_list **end)
+{
+	*end = NULL;
+
+	switch (type) {
+	case CONFIG_TYPE_BLACKLIST:
+		*end = config->kcmdline_blacklists;
+		return config->blacklists;
+	case CONFIG_TYPE_INSTALL:
+		return config->install_commands;
+	case CONFIG_TYPE_REMOVE:
+		return config->remove_commands;
+	case CONFIG_TYPE_ALIAS:
+		return config->aliases;
+	case CONFIG_TYPE_OPTION:
+		*end = config->kcmdline_options;
+		return config->options;
+	case CONFIG_TYPE_SOFTDEP:
+		return config->softdeps;
+	case CONFIG_TYPE_COUNT:
+		break;
 	}
 
-	fclose(fp);
+	return NULL;
+}
 
+static const char *config_get_key(enum config_type type,
+						const struct kmod_list *l)
+{
+	switch (type) {
+	case CONFIG_TYPE_BLACKLIST:
+		return kmod_blacklist_get_modname(l);
+	case CONFIG_TYPE_INSTALL:
+	case CONFIG_TYPE_REMOVE:
+		return kmod_command_get_modname(l);
+	case CONFIG_TYPE_ALIAS:
+		return kmod_alias_get_name(l);
+	case CONFIG_TYPE_OPTION:
+		return kmod_option_get_modname(l);
+	case CONFIG_TYPE_SOFTDEP:
+		return kmod_softdep_get_name(l);
+	case CONFIG_TYPE_COUNT:
+		break;
+	}
+
+	return NULL;
+}
+
+/*
+ * Lookup table over the entries of one config type. Every entry is hashed by
+ * its key, chained to the later entries with the same key. Keys that are
+ * patterns for fnmatch() are also kept in @globs, which is the only part
+ * still matched linearly.
+ */
+struct config_index_entry {
+	const char *key;
+	const struct kmod_list *l;
+	const struct config_index_entry *next;
+	unsigned int pos;
+	bool is_glob;
+};
+
+struct kmod_config_index {
+	struct hash *keys;
+	const struct config_index_entry **globs;
+	unsigned int n_globs;
+	struct config_index_entry entries[];
+};
+
+static void kmod_config_index_free(struct kmod_config_index *idx)
+{
+	if (idx == NULL)
+		return;
+
+	hash_free(idx->keys);
+	free(idx->globs);
+	free(idx);
+}
+
+static int kmod_config_index_build(struct kmod_config *config,
+							enum config_type type)
+{
+	const struct kmod_list *list, *l, *end;
+	struct kmod_config_index *idx;
+	unsigned int n = 0, i;
+
+	list = config_get_list(config, type, &end);
+	kmod_list_foreach(l, list)
+		n++;
+
+	idx = calloc(1, sizeof(*idx) + n * sizeof(idx->entries[0]));
+	if (idx == NULL)
+		return -ENOMEM;
+
+	idx->keys = hash_new(n, NULL);
+	idx->globs = malloc(n * sizeof(idx->globs[0]));
+	if (idx->keys == NULL || (n > 0 && idx->globs == NULL))
+		goto fail;
+
+	i = 0;
+	kmod_list_foreach(l, list) {
+		struct config_index_entry *e = &idx->entries[i];
+
+		e->key = config_get_key(type, l);
+		e->l = l;
+		e->pos = i++;
+		e->is_glob = strpbrk(e->key, "*?[\\") != NULL;
+		if (e->is_glob)
+			idx->globs[idx->n_globs++] = e;
+	}
+
+	/* backwards, so each chain is in the same order as the list */
+	while (i-- > 0) {
+		struct config_index_entry *e = &idx->entries[i];
+
+		e->next = hash_find(idx->keys, e->key);
+		if (hash_add(idx->keys, e->key, e) < 0)
+			goto fail;
+	}
+
+	config->index[type] = idx;
 	return 0;
+
+fail:
+	kmod_config_index_free(idx);
+	return -ENOMEM;
 }
 
-void kmod_config_free(struct kmod_config *config)
+static void kmod_config_clear(struct kmod_config *config)
 {
 	while (config->aliases)
 		kmod_config_free_alias(config, config->aliases);
@@ -746,10 +956,29 @@ void kmod_config_free(struct kmod_config *config)
 	while (config->softdeps)
 		kmod_config_free_softdep(config, config->softdeps);
 
+	for (; config->softdep_lines != NULL; config->softdep_lines =
+				kmod_list_remove(config->softdep_lines))
+		free(config->softdep_lines->data);
+
 	for (; config->paths != NULL;
 				config->paths = kmod_list_remove(config->paths))
 		free(config->paths->data);
 
+	for (; config->sources != NULL;
+			config->sources = kmod_list_remove(config->sources))
+		free(config->sources->data);
+	config->n_source_paths = 0;
+}
+
+void kmod_config_free(struct kmod_config *config)
+{
+	enum config_type type;
+
+	for (type = CONFIG_TYPE_BLACKLIST; type < CONFIG_TYPE_COUNT; type++)
+		kmod_config_index_free(config->index[type]);
+
+	kmod_config_clear(config);
+	pthread_mutex_destroy(&config->lock);
 	free(config);
 }
 
@@ -842,23 +1071,19 @@ static int conf_files_insert_sorted(struct kmod_ctx *ctx,
  * Insert configuration files in @list, ignoring duplicates
  */
 static int conf_files_list(struct kmod_ctx *ctx, struct kmod_list **list,
-						const char *path,
-						unsigned long long *path_stamp)
+					const char *path, struct stat *st)
 {
 	DIR *d;
 	int err;
-	struct stat st;
 	struct dirent *dent;
 
-	if (stat(path, &st) != 0) {
+	if (stat(path, st) != 0) {
 		err = -errno;
 		DBG(ctx, "could not stat '%s': %m\n", path);
 		return err;
 	}
 
-	*path_stamp = stat_mstamp(&st);
-
-	if (!S_ISDIR(st.st_mode)) {
+	if (!S_ISDIR(st->st_mode)) {
 		conf_files_insert_sorted(ctx, list, path, NULL);
 		return 0;
 	}
@@ -880,54 +1105,356 @@ static int conf_files_list(struct kmod_ctx *ctx, struct kmod_list **list,
 	return 0;
 }
 
-int kmod_config_new(struct kmod_ctx *ctx, struct kmod_config **p_config,
+static int kmod_config_add_path(struct kmod_config *config, const char *path,
+						unsigned long long stamp)
+{
+	struct kmod_config_path *cf;
+	struct kmod_list *list;
+	size_t pathlen = strlen(path) + 1;
+
+	cf = malloc(sizeof(*cf) + pathlen);
+	if (cf == NULL)
+		return -ENOMEM;
+
+	cf->stamp = stamp;
+	memcpy(cf->path, path, pathlen);
+
+	list = kmod_list_append(config->paths, cf);
+	if (list == NULL) {
+		free(cf);
+		return -ENOMEM;
+	}
+	config->paths = list;
+	return 0;
+}
+
+/*
+ * Remember a source of the configuration, so a compiled cache can be checked
+ * against it. Missing sources are recorded with stamp 0.
+ */
+static int kmod_config_add_source(struct kmod_config *config, const char *path,
+						unsigned long long stamp,
+						unsigned long long size)
+{
+	struct kmod_config_source *src;
+	struct kmod_list *list;
+	size_t pathlen = strlen(path) + 1;
+
+	src = malloc(sizeof(*src) + pathlen);
+	if (src == NULL)
+		return -ENOMEM;
+
+	src->stamp = stamp;
+	src->size = size;
+	memcpy(src->path, path, pathlen);
+
+	list = kmod_list_append(config->sources, src);
+	if (list == NULL) {
+		free(src);
+		return -ENOMEM;
+	}
+	config->sources = list;
+	return 0;
+}
+
+/*
+ * Compiled configuration, KMOD_CONFIG_CACHE in the module directory. All
+ * integers are big endian and strings are NUL-terminated:
+ *
+ *   uint32_t magic, version
+ *   uint32_t n_paths, n_sources
+ *   n_sources times: uint64_t stamp, uint64_t size, char path[]
+ *     The first n_paths sources are the config_paths given to
+ *     kmod_config_new(), in order, followed by every file that was read.
+ *   Then, for each enum config_type in order:
+ *     uint32_t count
+ *     count times: char key[], char value[] (blacklists have no value)
+ *
+ * The cache is only used if it was compiled for the same config_paths and
+ * none of the sources changed. Options and blacklists given in the kernel
+ * command line are not cached, they are always parsed at runtime.
+ */
+#define KMOD_CONFIG_CACHE_MAGIC 0xB007C0F9
+#define KMOD_CONFIG_CACHE_VERSION 0x00010000
+
+struct config_cache_reader {
+	const char *p;
+	const char *end;
+};
+
+static bool cache_read_u32(struct config_cache_reader *r, uint32_t *v)
+{
+	uint32_t u;
+
+	if ((size_t)(r->end - r->p) < sizeof(u))
+		return false;
+
+	memcpy(&u, r->p, sizeof(u));
+	r->p += sizeof(u);
+	*v = ntohl(u);
+	return true;
+}
+
+static bool cache_read_u64(struct config_cache_reader *r,
+						unsigned long long *v)
+{
+	uint32_t hi, lo;
+
+	if (!cache_read_u32(r, &hi) || !cache_read_u32(r, &lo))
+		return false;
+
+	*v = (unsigned long long) hi << 32 | lo;
+	return true;
+}
+
+static const char *cache_read_str(struct config_cache_reader *r)
+{
+	const char *s = r->p;
+	const char *nul = memchr(s, '\0', r->end - s);
+
+	if (nul == NULL)
+		return NULL;
+
+	r->p = nul + 1;
+	return s;
+}
+
+static bool config_source_is_current(const char *path,
+						unsigned long long stamp,
+						unsigned long long size)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return stamp == 0;
+
+	return stamp == stat_mstamp(&st) &&
+				size == (unsigned long long) st.st_size;
+}
+
+static int config_cache_add(struct kmod_config *config, enum config_type type,
+					const char *key, const char *value)
+{
+	switch (type) {
+	case CONFIG_TYPE_BLACKLIST:
+		return kmod_config_add_blacklist(config, key);
+	case CONFIG_TYPE_INSTALL:
+		return kmod_config_add_command(config, key, value, "install",
+						&config->install_commands);
+	case CONFIG_TYPE_REMOVE:
+		return kmod_config_add_command(config, key, value, "remove",
+						&config->remove_commands);
+	case CONFIG_TYPE_ALIAS:
+		return kmod_config_add_alias(config, key, value);
+	case CONFIG_TYPE_OPTION:
+		return kmod_config_add_options(config, key, value);
+	case CONFIG_TYPE_SOFTDEP:
+		return kmod_config_add_softdep_line(config, key, value);
+	case CONFIG_TYPE_COUNT:
+		break;
+	}
+
+	return -EINVAL;
+}
+
+static int config_cache_parse(struct kmod_config *config,
+					struct config_cache_reader *r,
 					const char * const *config_paths)
 {
-	struct kmod_config *config;
+	struct kmod_ctx *ctx = config->ctx;
+	uint32_t magic, version, n_paths, n_sources, count, i;
+	enum config_type type;
+	int err;
+
+	if (!cache_read_u32(r, &magic) || magic != KMOD_CONFIG_CACHE_MAGIC ||
+			!cache_read_u32(r, &version) ||
+			version != KMOD_CONFIG_CACHE_VERSION ||
+			!cache_read_u32(r, &n_paths) ||
+			!cache_read_u32(r, &n_sources) || n_paths > n_sources)
+		return -EINVAL;
+
+	for (i = 0; i < n_sources; i++) {
+		unsigned long long stamp, size;
+		const char *path;
+
+		if (!cache_read_u64(r, &stamp) || !cache_read_u64(r, &size))
+			return -EINVAL;
+
+		path = cache_read_str(r);
+		if (path == NULL)
+			return -EINVAL;
+
+		if (i < n_paths && (config_paths[i] == NULL ||
+					!streq(config_paths[i], path))) {
+			DBG(ctx, "compiled for other config paths\n");
+			return -ESTALE;
+		}
+
+		if (!config_source_is_current(path, stamp, size)) {
+			DBG(ctx, "'%s' changed since it was compiled\n", path);
+			return -ESTALE;
+		}
+
+		err = kmod_config_add_source(config, path, stamp, size);
+		if (err < 0)
+			return err;
+		config->n_source_paths += i < n_paths;
+
+		if (i < n_paths && stamp != 0) {
+			err = kmod_config_add_path(config, path, stamp);
+			if (err < 0)
+				return err;
+		}
+	}
+
+	if (config_paths[n_paths] != NULL) {
+		DBG(ctx, "compiled for other config paths\n");
+		return -ESTALE;
+	}
+
+	for (type = CONFIG_TYPE_BLACKLIST; type < CONFIG_TYPE_COUNT; type++) {
+		if (!cache_read_u32(r, &count))
+			return -EINVAL;
+
+		for (i = 0; i < count; i++) {
+			const char *key, *value = NULL;
+
+			key = cache_read_str(r);
+			if (key == NULL)
+				return -EINVAL;
+
+			if (type != CONFIG_TYPE_BLACKLIST) {
+				value = cache_read_str(r);
+				if (value == NULL)
+					return -EINVAL;
+			}
+
+			err = config_cache_add(config, type, key, value);
+			if (err < 0)
+				return err;
+		}
+	}
+
+	return 0;
+}
+
+static int kmod_config_load_cache(struct kmod_config *config,
+					const char * const *config_paths)
+{
+	struct kmod_ctx *ctx = config->ctx;
+	struct config_cache_reader r;
+	char path[PATH_MAX];
+	struct stat st;
+	void *mm;
+	int fd, err;
+
+	snprintf(path, sizeof(path), "%s/" KMOD_CONFIG_CACHE,
+						kmod_get_dirname(ctx));
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	mm = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mm == MAP_FAILED)
+		return -errno;
+
+	r.p = mm;
+	r.end = r.p + st.st_size;
+
+	err = config_cache_parse(config, &r, config_paths);
+	munmap(mm, st.st_size);
+
+	if (err < 0) {
+		if (err == -EINVAL)
+			ERR(ctx, "ignoring corrupt %s\n", path);
+		else
+			DBG(ctx, "ignoring %s: %s\n", path, strerror(-err));
+
+		kmod_config_clear(config);
+		return err;
+	}
+
+	DBG(ctx, "using compiled configuration %s\n", path);
+	return 0;
+}
+
+/*
+ * Read the configuration files, or the compiled cache if it's still current.
+ * Called once, on the first access to any config type.
+ */
+static int kmod_config_load(struct kmod_config *config)
+{
+	struct kmod_ctx *ctx = config->ctx;
+	const char * const *config_paths = config->config_paths;
 	struct kmod_list *list = NULL;
-	struct kmod_list *path_list = NULL;
 	size_t i;
 
-	conf_files_insert_sorted(ctx, &list, kmod_get_dirname(ctx), "modules.softdep");
+	/*
+	 * The softdeps depmod extracted from the modules are looked up in
+	 * modules.softdep.bin when it's current, they are only parsed as
+	 * configuration otherwise. A compiled cache still matching
+	 * modules.softdep was made with the same choice.
+	 */
+	config->softdep_indexed = kmod_has_softdep_index(ctx);
+
+	if (kmod_config_load_cache(config, config_paths) == 0) {
+		config->from_cache = true;
+		return 0;
+	}
+
+	if (!config->softdep_indexed)
+		conf_files_insert_sorted(ctx, &list, kmod_get_dirname(ctx),
+							"modules.softdep");
 
 	for (i = 0; config_paths[i] != NULL; i++) {
 		const char *path = config_paths[i];
-		unsigned long long path_stamp = 0;
-		size_t pathlen;
-		struct kmod_list *tmp;
-		struct kmod_config_path *cf;
+		struct stat st;
 
-		if (conf_files_list(ctx, &list, path, &path_stamp) < 0)
+		if (conf_files_list(ctx, &list, path, &st) < 0) {
+			if (kmod_config_add_source(config, path, 0, 0) < 0)
+				goto oom;
 			continue;
+		}
 
-		pathlen = strlen(path) + 1;
-		cf = malloc(sizeof(*cf) + pathlen);
-		if (cf == NULL)
+		if (kmod_config_add_source(config, path, stat_mstamp(&st),
+							st.st_size) < 0)
 			goto oom;
 
-		cf->stamp = path_stamp;
-		memcpy(cf->path, path, pathlen);
-
-		tmp = kmod_list_append(path_list, cf);
-		if (tmp == NULL) {
-			free(cf);
+		if (kmod_config_add_path(config, path, stat_mstamp(&st)) < 0)
+			goto oom;
+	}
+	config->n_source_paths = i;
+
+	/* still a source: a compiled cache is stale if it's rewritten alone */
+	if (config->softdep_indexed) {
+		char path[PATH_MAX];
+		struct stat st;
+		int err;
+
+		snprintf(path, sizeof(path), "%s/modules.softdep",
+							kmod_get_dirname(ctx));
+		if (stat(path, &st) == 0)
+			err = kmod_config_add_source(config, path,
+						stat_mstamp(&st), st.st_size);
+		else
+			err = kmod_config_add_source(config, path, 0, 0);
+		if (err < 0)
 			goto oom;
-		}
-		path_list = tmp;
 	}
-
-	*p_config = config = calloc(1, sizeof(struct kmod_config));
-	if (config == NULL)
-		goto oom;
-
-	config->paths = path_list;
-	config->ctx = ctx;
 
 	for (; list != NULL; list = kmod_list_remove(list)) {
 		char buf[PATH_MAX];
 		const char *fn = buf;
 		struct conf_file *cf = list->data;
-		int fd;
+		struct stat st;
+		int fd, err;
 
 		if (cf->is_single) {
 			fn = cf->path;
@@ -942,43 +1469,379 @@ int kmod_config_new(struct kmod_ctx *ctx, struct kmod_config **p_config,
 		fd = open(fn, O_RDONLY|O_CLOEXEC);
 		DBG(ctx, "parsing file '%s' fd=%d\n", fn, fd);
 
+		if (fd >= 0 && fstat(fd, &st) == 0)
+			err = kmod_config_add_source(config, fn,
+						stat_mstamp(&st), st.st_size);
+		else
+			err = kmod_config_add_source(config, fn, 0, 0);
+
+		if (err < 0) {
+			if (fd >= 0)
+				close(fd);
+			goto oom;
+		}
+
 		if (fd >= 0)
 			kmod_config_parse(config, fd, fn);
 
 		free(cf);
 	}
 
-	kmod_config_parse_kcmdline(config);
-
 	return 0;
 
 oom:
 	for (; list != NULL; list = kmod_list_remove(list))
 		free(list->data);
 
-	for (; path_list != NULL; path_list = kmod_list_remove(path_list))
-		free(path_list->data);
-
+	kmod_config_clear(config);
 	return -ENOMEM;
 }
 
+/* Options and blacklists from the kernel command line go after the files' */
+static void kmod_config_load_kcmdline(struct kmod_config *config)
+{
+	const struct kmod_list *last_blacklist, *last_option;
+
+	last_blacklist = kmod_list_last(config->blacklists);
+	last_option = kmod_list_last(config->options);
+
+	kmod_config_parse_kcmdline(config);
+
+	config->kcmdline_blacklists = last_blacklist == NULL ?
+		config->blacklists :
+		kmod_list_next(config->blacklists, last_blacklist);
+	config->kcmdline_options = last_option == NULL ? config->options :
+		kmod_list_next(config->options, last_option);
+}
+
+/*
+ * Make the entries of @type available, doing only the work that type needs:
+ * the files are read on the first access to any type, the kernel command
+ * line only when blacklists or options are needed and the softdep lines only
+ * when softdeps are. Safe to call from any thread sharing the context.
+ */
+static int kmod_config_materialize(struct kmod_config *config,
+							enum config_type type)
+{
+	int err = 0;
+
+	if (init_done(&config->ready[type]))
+		return 0;
+
+	pthread_mutex_lock(&config->lock);
+
+	if (config->ready[type])
+		goto unlock;
+
+	if (!config->loaded) {
+		err = kmod_config_load(config);
+		if (err < 0)
+			goto unlock;
+		init_publish(&config->loaded);
+	}
+
+	if ((type == CONFIG_TYPE_BLACKLIST || type == CONFIG_TYPE_OPTION) &&
+						!config->kcmdline_parsed) {
+		kmod_config_load_kcmdline(config);
+		config->kcmdline_parsed = true;
+	}
+
+	if (type == CONFIG_TYPE_SOFTDEP) {
+		err = kmod_config_parse_softdeps(config);
+		if (err < 0)
+			goto unlock;
+	}
+
+	err = kmod_config_index_build(config, type);
+	if (err < 0)
+		goto unlock;
+
+	init_publish(&config->ready[type]);
+
+unlock:
+	pthread_mutex_unlock(&config->lock);
+
+	if (err < 0)
+		ERR(config->ctx, "could not load configuration: %s\n",
+							strerror(-err));
+	return err;
+}
+
+/*
+ * Nothing is read here: each config type is materialized on its first use,
+ * so tools that never look at the configuration don't pay for it.
+ */
+int kmod_config_new(struct kmod_ctx *ctx, struct kmod_config **p_config,
+					const char * const *config_paths)
+{
+	struct kmod_config *config;
+	size_t i, n, len = 0;
+	char *s;
+
+	for (n = 0; config_paths[n] != NULL; n++)
+		len += strlen(config_paths[n]) + 1;
+
+	*p_config = config = calloc(1, sizeof(struct kmod_config) +
+					(n + 1) * sizeof(char *) + len);
+	if (config == NULL)
+		return -ENOMEM;
+
+	config->ctx = ctx;
+	pthread_mutex_init(&config->lock, NULL);
+
+	/* keep a copy, the caller's array doesn't need to outlive ctx */
+	config->config_paths = (const char **)(config + 1);
+	s = (char *)(config->config_paths + n + 1);
+	for (i = 0; i < n; i++) {
+		size_t pathlen = strlen(config_paths[i]) + 1;
+
+		memcpy(s, config_paths[i], pathlen);
+		config->config_paths[i] = s;
+		s += pathlen;
+	}
+	config->config_paths[n] = NULL;
+
+	return 0;
+}
+
+/*
+ * Stamps of the config paths, to check if the configuration is still
+ * current. NULL while it wasn't read yet.
+ */
+const struct kmod_list *kmod_config_get_paths(const struct kmod_config *config)
+{
+	if (!init_done(&config->loaded))
+		return NULL;
+
+	return config->paths;
+}
+
+/*
+ * Find the next entry of @type whose key is @name, or matches it as a
+ * fnmatch() pattern if @glob is true, in the same order as in the
+ * configuration. @cursor must start at 0 and is advanced past the entry
+ * returned, so calling it again gives the next match.
+ */
+const struct kmod_list *kmod_config_match(const struct kmod_config *config,
+					enum config_type type, const char *name,
+					bool glob, unsigned int *cursor)
+{
+	const struct kmod_config_index *idx;
+	const struct config_index_entry *e, *match = NULL;
+	unsigned int i;
+
+	if (kmod_config_materialize((struct kmod_config *)config, type) < 0)
+		return NULL;
+
+	idx = config->index[type];
+
+	for (e = hash_find(idx->keys, name); e != NULL; e = e->next) {
+		if (e->pos < *cursor || (glob && e->is_glob))
+			continue;
+
+		match = e;
+		break;
+	}
+
+	for (i = 0; glob && i < idx->n_globs; i++) {
+		e = idx->globs[i];
+
+		if (match != NULL && e->pos > match->pos)
+			break;
+		if (e->pos < *cursor)
+			continue;
+
+		if (fnmatch(e->key, name, 0) == 0) {
+			match = e;
+			break;
+		}
+	}
+
+	if (match == NULL)
+		return NULL;
+
+	*cursor = match->pos + 1;
+	return match->l;
+}
+
+static void cache_write_u32(FILE *fp, uint32_t v)
+{
+	v = htonl(v);
+	fwrite(&v, sizeof(v), 1, fp);
+}
+
+static void cache_write_u64(FILE *fp, unsigned long long v)
+{
+	cache_write_u32(fp, v >> 32);
+	cache_write_u32(fp, v & 0xffffffff);
+}
+
+static void cache_write_str(FILE *fp, const char *s)
+{
+	fwrite(s, 1, strlen(s) + 1, fp);
+}
+
+static int config_cache_write_entry(FILE *fp, enum config_type type,
+						const struct kmod_list *l)
+{
+	char *s;
+
+	switch (type) {
+	case CONFIG_TYPE_BLACKLIST:
+		cache_write_str(fp, kmod_blacklist_get_modname(l));
+		break;
+	case CONFIG_TYPE_INSTALL:
+	case CONFIG_TYPE_REMOVE:
+		cache_write_str(fp, kmod_command_get_modname(l));
+		cache_write_str(fp, kmod_command_get_command(l));
+		break;
+	case CONFIG_TYPE_ALIAS:
+		cache_write_str(fp, kmod_alias_get_name(l));
+		cache_write_str(fp, kmod_alias_get_modname(l));
+		break;
+	case CONFIG_TYPE_OPTION:
+		cache_write_str(fp, kmod_option_get_modname(l));
+		cache_write_str(fp, kmod_option_get_options(l));
+		break;
+	case CONFIG_TYPE_SOFTDEP:
+		s = softdep_to_char(l->data);
+		if (s == NULL)
+			return -ENOMEM;
+		cache_write_str(fp, kmod_softdep_get_name(l));
+		cache_write_str(fp, s);
+		free(s);
+		break;
+	case CONFIG_TYPE_COUNT:
+		break;
+	}
+
+	return 0;
+}
+
+static int config_cache_write(const struct kmod_config *config, FILE *fp)
+{
+	const struct kmod_list *l;
+	enum config_type type;
+	uint32_t count = 0;
+
+	cache_write_u32(fp, KMOD_CONFIG_CACHE_MAGIC);
+	cache_write_u32(fp, KMOD_CONFIG_CACHE_VERSION);
+	cache_write_u32(fp, config->n_source_paths);
+
+	kmod_list_foreach(l, config->sources)
+		count++;
+	cache_write_u32(fp, count);
+
+	kmod_list_foreach(l, config->sources) {
+		const struct kmod_config_source *src = l->data;
+
+		cache_write_u64(fp, src->stamp);
+		cache_write_u64(fp, src->size);
+		cache_write_str(fp, src->path);
+	}
+
+	for (type = CONFIG_TYPE_BLACKLIST; type < CONFIG_TYPE_COUNT; type++) {
+		const struct kmod_list *list, *end;
+		int err;
+
+		list = config_get_list(config, type, &end);
+
+		count = 0;
+		for (l = list; l != end; l = kmod_list_next(list, l))
+			count++;
+		cache_write_u32(fp, count);
+
+		for (l = list; l != end; l = kmod_list_next(list, l)) {
+			err = config_cache_write_entry(fp, type, l);
+			if (err < 0)
+				return err;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Compile @config into KMOD_CONFIG_CACHE in the module directory, replacing
+ * the previous one atomically.
+ */
+int kmod_config_write_cache(const struct kmod_config *config)
+{
+	struct kmod_ctx *ctx = config->ctx;
+	const char *dirname = kmod_get_dirname(ctx);
+	enum config_type type;
+	char tmp[NAME_MAX];
+	FILE *fp;
+	int dfd, fd, err, ferr;
+
+	for (type = CONFIG_TYPE_BLACKLIST; type < CONFIG_TYPE_COUNT; type++) {
+		err = kmod_config_materialize((struct kmod_config *)config,
+									type);
+		if (err < 0)
+			return err;
+	}
+
+	dfd = open(dirname, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (dfd < 0) {
+		err = -errno;
+		ERR(ctx, "could not open directory %s: %m\n", dirname);
+		return err;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%i.tmp", KMOD_CONFIG_CACHE, getpid());
+
+	fd = openat(dfd, tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0) {
+		err = -errno;
+		ERR(ctx, "could not create %s/%s: %m\n", dirname, tmp);
+		goto finish;
+	}
+
+	fp = fdopen(fd, "wb");
+	if (fp == NULL) {
+		err = -errno;
+		ERR(ctx, "fdopen(%d=%s/%s): %m\n", fd, dirname, tmp);
+		close(fd);
+		goto fail;
+	}
+
+	err = config_cache_write(config, fp);
+	ferr = ferror(fp) | fclose(fp);
+	if (err == 0 && ferr)
+		err = -EIO;
+	if (err < 0) {
+		ERR(ctx, "could not write %s/%s: %s\n", dirname, tmp,
+							strerror(-err));
+		goto fail;
+	}
+
+	if (renameat(dfd, tmp, dfd, KMOD_CONFIG_CACHE) != 0) {
+		err = -errno;
+		ERR(ctx, "renameat(%s, %s, %s, %s): %m\n",
+				dirname, tmp, dirname, KMOD_CONFIG_CACHE);
+		goto fail;
+	}
+
+	goto finish;
+
+fail:
+	unlinkat(dfd, tmp, 0);
+finish:
+	close(dfd);
+	return err;
+}
+
 /**********************************************************************
  * struct kmod_config_iter functions
  **********************************************************************/
 
-enum config_type {
-	CONFIG_TYPE_BLACKLIST = 0,
-	CONFIG_TYPE_INSTALL,
-	CONFIG_TYPE_REMOVE,
-	CONFIG_TYPE_ALIAS,
-	CONFIG_TYPE_OPTION,
-	CONFIG_TYPE_SOFTDEP,
-};
-
 struct kmod_config_iter {
 	enum config_type type;
 	bool intermediate;
 	const struct kmod_list *list;
+	/* entries owned by the iterator, visited after @list */
+	struct kmod_list *extra;
+	const struct kmod_list *curr_list;
 	const struct kmod_list *curr;
 	void *data;
 	const char *(*get_key)(const struct kmod_list *l);
@@ -991,12 +1854,71 @@ static const char *softdep_get_plain_softdep(const struct kmod_list *l)
 	return s;
 }
 
+/*
+ * The softdeps of modules.softdep when they are looked up in its index
+ * instead of being part of the configuration, so they are still listed
+ */
+static struct kmod_list *config_read_indexed_softdeps(
+					const struct kmod_config *config)
+{
+	struct kmod_ctx *ctx = config->ctx;
+	struct kmod_list *list = NULL, *tmp;
+	unsigned int linenum = 0;
+	struct line_reader r;
+	char path[PATH_MAX];
+	char *line;
+	int fd, err;
+
+	snprintf(path, sizeof(path), "%s/modules.softdep",
+						kmod_get_dirname(ctx));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	err = line_reader_open(&r, fd);
+	close(fd);
+	if (err < 0)
+		return NULL;
+
+	while ((line = line_reader_next(&r, &linenum)) != NULL) {
+		char *cmd, *modname, *softdeps, *saveptr;
+		struct kmod_softdep *dep;
+
+		cmd = strtok_r(line, "\t ", &saveptr);
+		if (cmd == NULL || !streq(cmd, "softdep"))
+			continue;
+
+		modname = strtok_r(NULL, "\t ", &saveptr);
+		softdeps = strtok_r(NULL, "\0", &saveptr);
+		if (underscores(modname) < 0 || softdeps == NULL)
+			continue;
+
+		dep = kmod_softdep_new(ctx, modname, softdeps);
+		if (dep == NULL)
+			continue;
+
+		tmp = kmod_list_append(list, dep);
+		if (tmp == NULL)
+			free(dep);
+		else
+			list = tmp;
+	}
+
+	line_reader_close(&r);
+
+	return list;
+}
+
 static struct kmod_config_iter *kmod_config_iter_new(const struct kmod_ctx* ctx,
 							enum config_type type)
 {
-	struct kmod_config_iter *iter = calloc(1, sizeof(*iter));
+	struct kmod_config_iter *iter;
 	const struct kmod_config *config = kmod_get_config(ctx);
 
+	if (kmod_config_materialize((struct kmod_config *)config, type) < 0)
+		return NULL;
+
+	iter = calloc(1, sizeof(*iter));
 	if (iter == NULL)
 		return NULL;
 
@@ -1029,10 +1951,14 @@ static struct kmod_config_iter *kmod_config_iter_new(const struct kmod_ctx* ctx,
 		break;
 	case CONFIG_TYPE_SOFTDEP:
 		iter->list = config->softdeps;
+		if (config->softdep_indexed)
+			iter->extra = config_read_indexed_softdeps(config);
 		iter->get_key = kmod_softdep_get_name;
 		iter->get_value = softdep_get_plain_softdep;
 		iter->intermediate = true;
 		break;
+	case CONFIG_TYPE_COUNT:
+		break;
 	}
 
 	return iter;
@@ -1230,11 +2156,16 @@ KMOD_EXPORT bool kmod_config_iter_next(struct kmod_config_iter *iter)
 		return false;
 
 	if (iter->curr == NULL) {
+		iter->curr_list = iter->list;
 		iter->curr = iter->list;
-		return iter->curr != NULL;
+	} else {
+		iter->curr = kmod_list_next(iter->curr_list, iter->curr);
 	}
 
-	iter->curr = kmod_list_next(iter->list, iter->curr);
+	if (iter->curr == NULL && iter->curr_list != iter->extra) {
+		iter->curr_list = iter->extra;
+		iter->curr = iter->extra;
+	}
 
 	return iter->curr != NULL;
 }
@@ -1248,5 +2179,7 @@ KMOD_EXPORT bool kmod_config_iter_next(struct kmod_config_iter *iter)
 KMOD_EXPORT void kmod_config_iter_free_iter(struct kmod_config_iter *iter)
 {
 	free(iter->data);
+	for (; iter->extra != NULL; iter->extra = kmod_list_remove(iter->extra))
+		free(iter->extra->data);
 	free(iter);
 }
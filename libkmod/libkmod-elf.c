@@ -18,11 +18,14 @@
  */
 
 #include <assert.h>
+#include <byteswap.h>
 #include <elf.h>
+#include <endian.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <shared/hash.h>
 #include <shared/util.h>
 
 #include "libkmod.h"
@@ -46,11 +49,21 @@ struct kmod_modversion64 {
 	char name[64 - sizeof(uint64_t)];
 };
 
+/* one entry per section, sorted by name so it can be searched */
+struct kmod_elf_section {
+	uint64_t offset;
+	uint64_t size;
+	uint32_t nameoff;
+	uint16_t idx;
+};
+
 struct kmod_elf {
 	const uint8_t *memory;
 	uint8_t *changed;
+	bool writable; /* memory may be patched in place */
 	uint64_t size;
 	enum kmod_elf_class class;
+	bool swap; /* byte order differs from the host's */
 	struct kmod_elf_header {
 		struct {
 			uint64_t offset;
@@ -65,6 +78,12 @@ struct kmod_elf {
 		} strings;
 		uint16_t machine;
 	} header;
+	/* offsets, not pointers: memory moves once it's changed */
+	struct kmod_elf_section *sections;
+	uint16_t n_sections;
+	/* for images only partly in memory: makes a range of it readable */
+	int (*fill)(void *data, uint64_t offset, uint64_t size);
+	void *fill_data;
 };
 
 //#define ENABLE_ELFDBG 1
@@ -127,6 +146,21 @@ static int elf_identify(const void *memory, uint64_t size)
 	return class;
 }
 
+static inline uint16_t elf_fix16(const struct kmod_elf *elf, uint16_t v)
+{
+	return elf->swap ? bswap_16(v) : v;
+}
+
+static inline uint32_t elf_fix32(const struct kmod_elf *elf, uint32_t v)
+{
+	return elf->swap ? bswap_32(v) : v;
+}
+
+static inline uint64_t elf_fix64(const struct kmod_elf *elf, uint64_t v)
+{
+	return elf->swap ? bswap_64(v) : v;
+}
+
 static inline uint64_t elf_get_uint(const struct kmod_elf *elf, uint64_t offset, uint16_t size)
 {
 	const uint8_t *p;
@@ -141,13 +175,29 @@ static inline uint64_t elf_get_uint(const struct kmod_elf *elf, uint64_t offset,
 		return (uint64_t)-1;
 	}
 
+	/* sizes are constant once inlined: this leaves a single load */
 	p = elf->memory + offset;
-	if (elf->class & KMOD_ELF_MSB) {
-		for (i = 0; i < size; i++)
-			ret = (ret << 8) | p[i];
-	} else {
-		for (i = 1; i <= size; i++)
-			ret = (ret << 8) | p[size - i];
+	switch (size) {
+	case sizeof(uint8_t):
+		ret = *p;
+		break;
+	case sizeof(uint16_t):
+		ret = elf_fix16(elf, get_unaligned((const uint16_t *)p));
+		break;
+	case sizeof(uint32_t):
+		ret = elf_fix32(elf, get_unaligned((const uint32_t *)p));
+		break;
+	case sizeof(uint64_t):
+		ret = elf_fix64(elf, get_unaligned((const uint64_t *)p));
+		break;
+	default:
+		if (elf->class & KMOD_ELF_MSB) {
+			for (i = 0; i < size; i++)
+				ret = (ret << 8) | p[i];
+		} else {
+			for (i = 1; i <= size; i++)
+				ret = (ret << 8) | p[size - i];
+		}
 	}
 
 	ELFDBG(elf, "size=%"PRIu16" offset=%"PRIu64" value=%"PRIu64"\n",
@@ -156,6 +206,24 @@ static inline uint64_t elf_get_uint(const struct kmod_elf *elf, uint64_t offset,
 	return ret;
 }
 
+/* memory to write to: either the original one or, once, a full copy */
+static uint8_t *elf_get_writable_mem(struct kmod_elf *elf)
+{
+	if (elf->writable)
+		return (uint8_t *)elf->memory;
+
+	if (elf->changed == NULL) {
+		elf->changed = malloc(elf->size);
+		if (elf->changed == NULL)
+			return NULL;
+		memcpy(elf->changed, elf->memory, elf->size);
+		elf->memory = elf->changed;
+		ELFDBG(elf, "copied memory to allow writing.\n");
+	}
+
+	return elf->changed;
+}
+
 static inline int elf_set_uint(struct kmod_elf *elf, uint64_t offset, uint64_t size, uint64_t value)
 {
 	uint8_t *p;
@@ -172,16 +240,10 @@ static inline int elf_set_uint(struct kmod_elf *elf, uint64_t offset, uint64_t s
 		return -1;
 	}
 
-	if (elf->changed == NULL) {
-		elf->changed = malloc(elf->size);
-		if (elf->changed == NULL)
-			return -errno;
-		memcpy(elf->changed, elf->memory, elf->size);
-		elf->memory = elf->changed;
-		ELFDBG(elf, "copied memory to allow writing.\n");
-	}
-
-	p = elf->changed + offset;
+	p = elf_get_writable_mem(elf);
+	if (p == NULL)
+		return -errno;
+	p += offset;
 	if (elf->class & KMOD_ELF_MSB) {
 		for (i = 1; i <= size; i++) {
 			p[size - i] = value & 0xff;
@@ -208,6 +270,15 @@ static inline const void *elf_get_mem(const struct kmod_elf *elf, uint64_t offse
 	return elf->memory + offset;
 }
 
+static inline int elf_fill(const struct kmod_elf *elf, uint64_t offset,
+								uint64_t size)
+{
+	if (elf->fill == NULL || size == 0)
+		return 0;
+
+	return elf->fill(elf->fill_data, offset, size);
+}
+
 static inline const void *elf_get_section_header(const struct kmod_elf *elf, uint16_t idx)
 {
 	assert(idx != SHN_UNDEF);
@@ -269,12 +340,82 @@ static const char *elf_get_strings_section(const struct kmod_elf *elf, uint64_t
 	return elf_get_mem(elf, elf->header.strings.offset);
 }
 
-struct kmod_elf *kmod_elf_new(const void *memory, off_t size)
+struct elf_section_name {
+	const char *name;
+	struct kmod_elf_section section;
+};
+
+static int elf_section_name_cmp(const void *pa, const void *pb)
+{
+	const struct elf_section_name *a = pa, *b = pb;
+	int r = strcmp(a->name, b->name);
+
+	/* keep the order of duplicates: the first one is the one found */
+	if (r == 0)
+		r = (int)a->section.idx - (int)b->section.idx;
+	return r;
+}
+
+static int elf_load_sections(struct kmod_elf *elf)
+{
+	uint64_t nameslen;
+	const char *names = elf_get_strings_section(elf, &nameslen);
+	struct elf_section_name *sorted;
+	uint16_t i, n = 0;
+
+	elf->sections = NULL;
+	elf->n_sections = 0;
+
+	if (elf->header.section.count <= 1)
+		return 0;
+
+	sorted = malloc(sizeof(*sorted) * elf->header.section.count);
+	if (sorted == NULL)
+		return -ENOMEM;
+
+	for (i = 1; i < elf->header.section.count; i++) {
+		struct kmod_elf_section *s = &sorted[n].section;
+		int err = elf_get_section_info(elf, i, &s->offset, &s->size,
+								&s->nameoff);
+		if (err < 0)
+			continue;
+		if (s->nameoff >= nameslen)
+			continue;
+		s->idx = i;
+		sorted[n].name = names + s->nameoff;
+		n++;
+	}
+
+	if (n > 0) {
+		qsort(sorted, n, sizeof(*sorted), elf_section_name_cmp);
+
+		elf->sections = malloc(sizeof(*elf->sections) * n);
+		if (elf->sections == NULL) {
+			free(sorted);
+			return -ENOMEM;
+		}
+		for (i = 0; i < n; i++)
+			elf->sections[i] = sorted[i].section;
+		elf->n_sections = n;
+	}
+
+	free(sorted);
+	return 0;
+}
+
+/*
+ * Parse an image of which only the ranges given to @fill are read: the
+ * headers, the section names and then the sections looked up. The rest of
+ * @memory doesn't need to be there.
+ */
+struct kmod_elf *kmod_elf_new_partial(const void *memory, off_t size,
+			int (*fill)(void *data, uint64_t offset, uint64_t size),
+			void *data)
 {
 	struct kmod_elf *elf;
 	uint64_t min_size;
 	size_t shdrs_size, shdr_size;
-	int class;
+	int class, err;
 
 	assert_cc(sizeof(uint16_t) == sizeof(Elf32_Half));
 	assert_cc(sizeof(uint16_t) == sizeof(Elf64_Half));
@@ -286,6 +427,15 @@ struct kmod_elf *kmod_elf_new(const void *memory, off_t size)
 		return NULL;
 	}
 
+	if (fill != NULL) {
+		err = fill(data, 0, (uint64_t) size < sizeof(Elf64_Ehdr) ?
+					(uint64_t) size : sizeof(Elf64_Ehdr));
+		if (err < 0) {
+			errno = -err;
+			return NULL;
+		}
+	}
+
 	class = elf_identify(memory, size);
 	if (class < 0) {
 		errno = -class;
@@ -299,8 +449,16 @@ struct kmod_elf *kmod_elf_new(const void *memory, off_t size)
 
 	elf->memory = memory;
 	elf->changed = NULL;
+	elf->writable = false;
 	elf->size = size;
 	elf->class = class;
+	elf->fill = fill;
+	elf->fill_data = data;
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	elf->swap = (class & KMOD_ELF_MSB) != 0;
+#else
+	elf->swap = (class & KMOD_ELF_LSB) != 0;
+#endif
 
 #define READV(field) \
 	elf_get_uint(elf, offsetof(typeof(*hdr), field), sizeof(hdr->field))
@@ -341,6 +499,10 @@ struct kmod_elf *kmod_elf_new(const void *memory, off_t size)
 		goto invalid;
 	}
 
+	err = elf_fill(elf, elf->header.section.offset, shdrs_size);
+	if (err < 0)
+		goto fail;
+
 	if (elf_get_section_info(elf, elf->header.strings.section,
 					&elf->header.strings.offset,
 					&elf->header.strings.size,
@@ -349,85 +511,112 @@ struct kmod_elf *kmod_elf_new(const void *memory, off_t size)
 		goto invalid;
 	} else {
 		uint64_t slen;
-		const char *s = elf_get_strings_section(elf, &slen);
+		const char *s;
+
+		err = elf_fill(elf, elf->header.strings.offset,
+						elf->header.strings.size);
+		if (err < 0)
+			goto fail;
+
+		s = elf_get_strings_section(elf, &slen);
 		if (slen == 0 || s[slen - 1] != '\0') {
 			ELFDBG(elf, "strings section does not ends with \\0\n");
 			goto invalid;
 		}
 	}
 
+	if (elf_load_sections(elf) < 0) {
+		free(elf);
+		errno = ENOMEM;
+		return NULL;
+	}
+
 	return elf;
 
 invalid:
 	free(elf);
 	errno = EINVAL;
 	return NULL;
+
+fail:
+	free(elf);
+	errno = -err;
+	return NULL;
+}
+
+struct kmod_elf *kmod_elf_new(const void *memory, off_t size)
+{
+	return kmod_elf_new_partial(memory, size, NULL, NULL);
 }
 
 void kmod_elf_unref(struct kmod_elf *elf)
 {
+	free(elf->sections);
 	free(elf->changed);
 	free(elf);
 }
 
+/*
+ * The memory given to kmod_elf_new() can be changed by the strip functions
+ * from now on, instead of being copied on the first change.
+ */
+void kmod_elf_set_writable(struct kmod_elf *elf)
+{
+	elf->writable = true;
+}
+
 const void *kmod_elf_get_memory(const struct kmod_elf *elf)
 {
 	return elf->memory;
 }
 
-static int elf_find_section(const struct kmod_elf *elf, const char *section)
+static const struct kmod_elf_section *elf_find_section_entry(const struct kmod_elf *elf, const char *section)
 {
 	uint64_t nameslen;
 	const char *names = elf_get_strings_section(elf, &nameslen);
-	uint16_t i;
+	uint16_t lo = 0, hi = elf->n_sections;
 
-	for (i = 1; i < elf->header.section.count; i++) {
-		uint64_t off, size;
-		uint32_t nameoff;
-		const char *n;
-		int err = elf_get_section_info(elf, i, &off, &size, &nameoff);
-		if (err < 0)
-			continue;
-		if (nameoff >= nameslen)
-			continue;
-		n = names + nameoff;
-		if (!streq(section, n))
-			continue;
+	/* lower bound, so the first of sections sharing a name is found */
+	while (lo < hi) {
+		uint16_t mid = lo + (hi - lo) / 2;
 
-		return i;
+		if (strcmp(names + elf->sections[mid].nameoff, section) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	return -ENODATA;
+	if (lo < elf->n_sections &&
+			streq(names + elf->sections[lo].nameoff, section))
+		return &elf->sections[lo];
+
+	return NULL;
 }
 
-int kmod_elf_get_section(const struct kmod_elf *elf, const char *section, const void **buf, uint64_t *buf_size)
+static int elf_find_section(const struct kmod_elf *elf, const char *section)
 {
-	uint64_t nameslen;
-	const char *names = elf_get_strings_section(elf, &nameslen);
-	uint16_t i;
+	const struct kmod_elf_section *s = elf_find_section_entry(elf, section);
 
-	*buf = NULL;
-	*buf_size = 0;
+	if (s == NULL)
+		return -ENODATA;
 
-	for (i = 1; i < elf->header.section.count; i++) {
-		uint64_t off, size;
-		uint32_t nameoff;
-		const char *n;
-		int err = elf_get_section_info(elf, i, &off, &size, &nameoff);
-		if (err < 0)
-			continue;
-		if (nameoff >= nameslen)
-			continue;
-		n = names + nameoff;
-		if (!streq(section, n))
-			continue;
+	return s->idx;
+}
 
-		*buf = elf_get_mem(elf, off);
-		*buf_size = size;
-		return 0;
+int kmod_elf_get_section(const struct kmod_elf *elf, const char *section, const void **buf, uint64_t *buf_size)
+{
+	const struct kmod_elf_section *s = elf_find_section_entry(elf, section);
+	int err = -ENODATA;
+
+	if (s == NULL || (err = elf_fill(elf, s->offset, s->size)) < 0) {
+		*buf = NULL;
+		*buf_size = 0;
+		return err;
 	}
 
-	return -ENODATA;
+	*buf = elf_get_mem(elf, s->offset);
+	*buf_size = s->size;
+	return 0;
 }
 
 /* array will be allocated with strings in a single malloc, just free *array */
@@ -605,6 +794,7 @@ int kmod_elf_strip_vermagic(struct kmod_elf *elf)
 	uint64_t i, size;
 	const void *buf;
 	const char *strings;
+	uint8_t *p;
 	int err;
 
 	err = kmod_elf_get_section(elf, ".modinfo", &buf, &size);
@@ -640,20 +830,15 @@ int kmod_elf_strip_vermagic(struct kmod_elf *elf)
 			continue;
 		}
 		off = (const uint8_t *)s - elf->memory;
+		len = strlen(s);
 
-		if (elf->changed == NULL) {
-			elf->changed = malloc(elf->size);
-			if (elf->changed == NULL)
-				return -errno;
-			memcpy(elf->changed, elf->memory, elf->size);
-			elf->memory = elf->changed;
-			ELFDBG(elf, "copied memory to allow writing.\n");
-		}
+		p = elf_get_writable_mem(elf);
+		if (p == NULL)
+			return -errno;
 
-		len = strlen(s);
 		ELFDBG(elf, "clear .modinfo vermagic \"%s\" (%zd bytes)\n",
-		       s, len);
-		memset(elf->changed + off, '\0', len);
+		       p + off, len);
+		memset(p + off, '\0', len);
 		return 0;
 	}
 
@@ -662,13 +847,26 @@ int kmod_elf_strip_vermagic(struct kmod_elf *elf)
 }
 
 
+/* length of the string at @s, which may not be terminated before @max */
+static inline size_t elf_strlen(const char *s, size_t max)
+{
+	const char *nul = memchr(s, '\0', max);
+
+	return nul != NULL ? (size_t) (nul - s) : max;
+}
+
+/*
+ * The names in __ksymtab_strings are found with memchr(), which libc
+ * checks many bytes at a time for, rather than a byte at a time.
+ */
 static int kmod_elf_get_symbols_symtab(const struct kmod_elf *elf, struct kmod_modversion **array)
 {
-	uint64_t i, last, size;
+	uint64_t i, size;
 	const void *buf;
 	const char *strings;
 	char *itr;
 	struct kmod_modversion *a;
+	size_t len;
 	int count, err;
 
 	*array = NULL;
@@ -688,50 +886,28 @@ static int kmod_elf_get_symbols_symtab(const struct kmod_elf *elf, struct kmod_m
 	if (size <= 1)
 		return 0;
 
-	last = 0;
-	for (i = 0, count = 0; i < size; i++) {
-		if (strings[i] == '\0') {
-			if (last == i) {
-				last = i + 1;
-				continue;
-			}
+	for (i = 0, count = 0; i < size; i += len + 1) {
+		len = elf_strlen(strings + i, size - i);
+		if (len > 0)
 			count++;
-			last = i + 1;
-		}
 	}
-	if (strings[i - 1] != '\0')
-		count++;
 
 	*array = a = malloc(size + 1 + sizeof(struct kmod_modversion) * count);
 	if (*array == NULL)
 		return -errno;
 
 	itr = (char *)(a + count);
-	last = 0;
-	for (i = 0, count = 0; i < size; i++) {
-		if (strings[i] == '\0') {
-			size_t slen = i - last;
-			if (last == i) {
-				last = i + 1;
-				continue;
-			}
-			a[count].crc = 0;
-			a[count].bind = KMOD_SYMBOL_GLOBAL;
-			a[count].symbol = itr;
-			memcpy(itr, strings + last, slen);
-			itr[slen] = '\0';
-			itr += slen + 1;
-			count++;
-			last = i + 1;
-		}
-	}
-	if (strings[i - 1] != '\0') {
-		size_t slen = i - last;
+	for (i = 0, count = 0; i < size; i += len + 1) {
+		len = elf_strlen(strings + i, size - i);
+		if (len == 0)
+			continue;
+
 		a[count].crc = 0;
 		a[count].bind = KMOD_SYMBOL_GLOBAL;
 		a[count].symbol = itr;
-		memcpy(itr, strings + last, slen);
-		itr[slen] = '\0';
+		memcpy(itr, strings + i, len);
+		itr[len] = '\0';
+		itr += len + 1;
 		count++;
 	}
 
@@ -752,468 +928,497 @@ static inline uint8_t kmod_symbol_bind_from_elf(uint8_t elf_value)
 	}
 }
 
-static uint64_t kmod_elf_resolve_crc(const struct kmod_elf *elf, uint64_t crc, uint16_t shndx)
-{
-	int err;
-	uint64_t off, size;
-	uint32_t nameoff;
-
-	if (shndx == SHN_ABS || shndx == SHN_UNDEF)
-		return crc;
-
-	err = elf_get_section_info(elf, shndx, &off, &size, &nameoff);
-	if (err < 0) {
-		ELFDBG("Cound not find section index %"PRIu16" for crc", shndx);
-		return (uint64_t)-1;
-	}
-
-	if (crc > (size - sizeof(uint32_t))) {
-		ELFDBG("CRC offset %"PRIu64" is too big, section %"PRIu16" size is %"PRIu64"\n",
-		       crc, shndx, size);
-		return (uint64_t)-1;
-	}
+/* from module-init-tools:elfops_core.c */
+#ifndef STT_REGISTER
+#define STT_REGISTER    13              /* Global register reserved to app. */
+#endif
 
-	crc = elf_get_uint(elf, off + crc, sizeof(uint32_t));
-	return crc;
-}
+struct elf_symtab {
+	uint64_t str_off;
+	uint64_t strtablen;
+	uint64_t sym_off;
+	size_t symlen;
+	int count;
+};
 
-/* array will be allocated with strings in a single malloc, just free *array */
-int kmod_elf_get_symbols(const struct kmod_elf *elf, struct kmod_modversion **array)
+static int elf_get_symtab(const struct kmod_elf *elf, struct elf_symtab *tab)
 {
-	static const char crc_str[] = "__crc_";
-	static const size_t crc_strlen = sizeof(crc_str) - 1;
-	uint64_t strtablen, symtablen, str_off, sym_off;
+	uint64_t strtablen, symtablen;
 	const void *strtab, *symtab;
-	struct kmod_modversion *a;
-	char *itr;
-	size_t slen, symlen;
-	int i, count, symcount, err;
+	int err;
 
 	err = kmod_elf_get_section(elf, ".strtab", &strtab, &strtablen);
 	if (err < 0) {
 		ELFDBG(elf, "no .strtab found.\n");
-		goto fallback;
+		return err;
 	}
 
 	err = kmod_elf_get_section(elf, ".symtab", &symtab, &symtablen);
 	if (err < 0) {
 		ELFDBG(elf, "no .symtab found.\n");
-		goto fallback;
+		return err;
 	}
 
 	if (elf->class & KMOD_ELF_32)
-		symlen = sizeof(Elf32_Sym);
+		tab->symlen = sizeof(Elf32_Sym);
 	else
-		symlen = sizeof(Elf64_Sym);
+		tab->symlen = sizeof(Elf64_Sym);
 
-	if (symtablen % symlen != 0) {
-		ELFDBG(elf, "unexpected .symtab of length %"PRIu64", not multiple of %"PRIu64" as expected.\n", symtablen, symlen);
-		goto fallback;
+	if (symtablen % tab->symlen != 0) {
+		ELFDBG(elf, "unexpected .symtab of length %"PRIu64", not multiple of %"PRIu64" as expected.\n", symtablen, tab->symlen);
+		return -EINVAL;
 	}
 
-	symcount = symtablen / symlen;
-	count = 0;
-	slen = 0;
-	str_off = (const uint8_t *)strtab - elf->memory;
-	sym_off = (const uint8_t *)symtab - elf->memory + symlen;
-	for (i = 1; i < symcount; i++, sym_off += symlen) {
-		const char *name;
-		uint32_t name_off;
-
-#define READV(field)							\
-		elf_get_uint(elf, sym_off + offsetof(typeof(*s), field),\
-			     sizeof(s->field))
-		if (elf->class & KMOD_ELF_32) {
-			Elf32_Sym *s;
-			name_off = READV(st_name);
-		} else {
-			Elf64_Sym *s;
-			name_off = READV(st_name);
-		}
-#undef READV
-		if (name_off >= strtablen) {
-			ELFDBG(elf, ".strtab is %"PRIu64" bytes, but .symtab entry %d wants to access offset %"PRIu32".\n", strtablen, i, name_off);
-			goto fallback;
-		}
-
-		name = elf_get_mem(elf, str_off + name_off);
+	tab->str_off = (const uint8_t *)strtab - elf->memory;
+	tab->strtablen = strtablen;
+	tab->sym_off = (const uint8_t *)symtab - elf->memory;
+	tab->count = symtablen / tab->symlen;
 
-		if (strncmp(name, crc_str, crc_strlen) != 0)
-			continue;
-		slen += strlen(name + crc_strlen) + 1;
-		count++;
-	}
-
-	if (count == 0)
-		goto fallback;
+	return 0;
+}
 
-	*array = a = malloc(sizeof(struct kmod_modversion) * count + slen);
-	if (*array == NULL)
-		return -errno;
+struct elf_sym {
+	uint64_t value;
+	uint32_t name_off;
+	uint16_t shndx;
+	uint8_t bind;
+	uint8_t type;
+};
 
-	itr = (char *)(a + count);
-	count = 0;
-	str_off = (const uint8_t *)strtab - elf->memory;
-	sym_off = (const uint8_t *)symtab - elf->memory + symlen;
-	for (i = 1; i < symcount; i++, sym_off += symlen) {
-		const char *name;
-		uint32_t name_off;
-		uint64_t crc;
-		uint8_t info, bind;
-		uint16_t shndx;
-
-#define READV(field)							\
-		elf_get_uint(elf, sym_off + offsetof(typeof(*s), field),\
-			     sizeof(s->field))
-		if (elf->class & KMOD_ELF_32) {
-			Elf32_Sym *s;
-			name_off = READV(st_name);
-			crc = READV(st_value);
-			info = READV(st_info);
-			shndx = READV(st_shndx);
-		} else {
-			Elf64_Sym *s;
-			name_off = READV(st_name);
-			crc = READV(st_value);
-			info = READV(st_info);
-			shndx = READV(st_shndx);
-		}
-#undef READV
-		name = elf_get_mem(elf, str_off + name_off);
-		if (strncmp(name, crc_str, crc_strlen) != 0)
-			continue;
-		name += crc_strlen;
+static inline void elf_symtab_read(const struct kmod_elf *elf,
+				const struct elf_symtab *tab, int i,
+				struct elf_sym *sym)
+{
+	const uint8_t *p = elf->memory + tab->sym_off +
+						(uint64_t)i * tab->symlen;
+
+	/*
+	 * .symtab was checked to be within the file: load each entry at
+	 * once and only fix up the byte order of the fields used.
+	 */
+#define READ_SYM(bits)							\
+	do {								\
+		Elf##bits##_Sym s;					\
+		memcpy(&s, p, sizeof(s));				\
+		sym->name_off = elf_fix32(elf, s.st_name);		\
+		sym->value = elf_fix##bits(elf, s.st_value);		\
+		sym->shndx = elf_fix16(elf, s.st_shndx);		\
+		sym->bind = ELF##bits##_ST_BIND(s.st_info);		\
+		sym->type = ELF##bits##_ST_TYPE(s.st_info);		\
+	} while (0)
+	if (elf->class & KMOD_ELF_32)
+		READ_SYM(32);
+	else
+		READ_SYM(64);
+#undef READ_SYM
+}
 
-		if (elf->class & KMOD_ELF_32)
-			bind = ELF32_ST_BIND(info);
-		else
-			bind = ELF64_ST_BIND(info);
+struct elf_versions {
+	uint64_t off;
+	size_t verlen;
+	size_t crclen;
+	int count;
+	struct hash *names;	/* name -> index + 1 */
+	uint8_t *visited;
+};
 
-		a[count].crc = kmod_elf_resolve_crc(elf, crc, shndx);
-		a[count].bind = kmod_symbol_bind_from_elf(bind);
-		a[count].symbol = itr;
-		slen = strlen(name);
-		memcpy(itr, name, slen);
-		itr[slen] = '\0';
-		itr += slen + 1;
-		count++;
-	}
-	return count;
+static int elf_versions_load(const struct kmod_elf *elf, struct elf_versions *v)
+{
+	uint64_t versionslen;
+	const void *versions;
+	int i;
 
-fallback:
-	ELFDBG(elf, "Falling back to __ksymtab_strings!\n");
-	return kmod_elf_get_symbols_symtab(elf, array);
-}
+	memset(v, 0, sizeof(*v));
 
-static int kmod_elf_crc_find(const struct kmod_elf *elf, const void *versions, uint64_t versionslen, const char *name, uint64_t *crc)
-{
-	size_t verlen, crclen, off;
-	uint64_t i;
+	if (kmod_elf_get_section(elf, "__versions", &versions, &versionslen) < 0)
+		return 0;
 
 	if (elf->class & KMOD_ELF_32) {
 		struct kmod_modversion32 *mv;
-		verlen = sizeof(*mv);
-		crclen = sizeof(mv->crc);
+		v->verlen = sizeof(*mv);
+		v->crclen = sizeof(mv->crc);
 	} else {
 		struct kmod_modversion64 *mv;
-		verlen = sizeof(*mv);
-		crclen = sizeof(mv->crc);
+		v->verlen = sizeof(*mv);
+		v->crclen = sizeof(mv->crc);
+	}
+	if (versionslen % v->verlen != 0) {
+		ELFDBG(elf, "unexpected __versions of length %"PRIu64", not multiple of %zd as expected.\n", versionslen, v->verlen);
+		return 0;
 	}
+	if (versionslen == 0)
+		return 0;
 
-	off = (const uint8_t *)versions - elf->memory;
-	for (i = 0; i < versionslen; i += verlen) {
-		const char *symbol = elf_get_mem(elf, off + i + crclen);
-		if (!streq(name, symbol))
-			continue;
-		*crc = elf_get_uint(elf, off + i, crclen);
-		return i / verlen;
+	v->off = (const uint8_t *)versions - elf->memory;
+	v->count = versionslen / v->verlen;
+	v->visited = calloc(v->count, sizeof(uint8_t));
+	v->names = hash_new(v->count, NULL);
+	if (v->visited == NULL || v->names == NULL)
+		goto fail;
+
+	for (i = 0; i < v->count; i++) {
+		const char *name = elf_get_mem(elf, v->off + i * v->verlen +
+								v->crclen);
+		int err;
+
+		/* like a linear search would, the first entry wins */
+		err = hash_add_unique(v->names, name,
+						(void *)(uintptr_t)(i + 1));
+		if (err < 0 && err != -EEXIST)
+			goto fail;
 	}
 
-	ELFDBG(elf, "could not find crc for symbol '%s'\n", name);
-	*crc = 0;
-	return -1;
+	return 0;
+
+fail:
+	free(v->visited);
+	if (v->names != NULL)
+		hash_free(v->names);
+	return -ENOMEM;
 }
 
-/* from module-init-tools:elfops_core.c */
-#ifndef STT_REGISTER
-#define STT_REGISTER    13              /* Global register reserved to app. */
-#endif
+static void elf_versions_free(struct elf_versions *v)
+{
+	free(v->visited);
+	if (v->names != NULL)
+		hash_free(v->names);
+}
 
-/* array will be allocated with strings in a single malloc, just free *array */
-int kmod_elf_get_dependency_symbols(const struct kmod_elf *elf, struct kmod_modversion **array)
+static uint64_t elf_versions_find(const struct kmod_elf *elf,
+				struct elf_versions *v, const char *name)
 {
-	uint64_t versionslen, strtablen, symtablen, str_off, sym_off, ver_off;
-	const void *versions, *strtab, *symtab;
-	struct kmod_modversion *a;
-	char *itr;
-	size_t slen, verlen, symlen, crclen;
-	int i, count, symcount, vercount, err;
-	bool handle_register_symbols;
-	uint8_t *visited_versions;
-	uint64_t *symcrcs;
+	uintptr_t idx;
 
-	err = kmod_elf_get_section(elf, "__versions", &versions, &versionslen);
-	if (err < 0) {
-		versions = NULL;
-		versionslen = 0;
-		verlen = 0;
-		crclen = 0;
-	} else {
-		if (elf->class & KMOD_ELF_32) {
-			struct kmod_modversion32 *mv;
-			verlen = sizeof(*mv);
-			crclen = sizeof(mv->crc);
-		} else {
-			struct kmod_modversion64 *mv;
-			verlen = sizeof(*mv);
-			crclen = sizeof(mv->crc);
-		}
-		if (versionslen % verlen != 0) {
-			ELFDBG(elf, "unexpected __versions of length %"PRIu64", not multiple of %zd as expected.\n", versionslen, verlen);
-			versions = NULL;
-			versionslen = 0;
-		}
-	}
+	if (v->names == NULL)
+		return 0;
 
-	err = kmod_elf_get_section(elf, ".strtab", &strtab, &strtablen);
-	if (err < 0) {
-		ELFDBG(elf, "no .strtab found.\n");
-		return -EINVAL;
+	idx = (uintptr_t)hash_find(v->names, name);
+	if (idx == 0) {
+		ELFDBG(elf, "could not find crc for symbol '%s'\n", name);
+		return 0;
 	}
 
-	err = kmod_elf_get_section(elf, ".symtab", &symtab, &symtablen);
-	if (err < 0) {
-		ELFDBG(elf, "no .symtab found.\n");
-		return -EINVAL;
-	}
+	idx--;
+	v->visited[idx] = 1;
+	return elf_get_uint(elf, v->off + idx * v->verlen, v->crclen);
+}
 
-	if (elf->class & KMOD_ELF_32)
-		symlen = sizeof(Elf32_Sym);
-	else
-		symlen = sizeof(Elf64_Sym);
+static inline bool elf_sym_is_undefined(const struct kmod_elf *elf,
+					const struct elf_sym *sym)
+{
+	if (sym->shndx != SHN_UNDEF)
+		return false;
+
+	/* Not really undefined: sparc gcc 3.3 creates U references when
+	 * you have global asm variables, to avoid anyone else misusing
+	 * them.
+	 */
+	if ((elf->header.machine == EM_SPARC ||
+	     elf->header.machine == EM_SPARCV9) && sym->type == STT_REGISTER)
+		return false;
+
+	return true;
+}
 
-	if (symtablen % symlen != 0) {
-		ELFDBG(elf, "unexpected .symtab of length %"PRIu64", not multiple of %"PRIu64" as expected.\n", symtablen, symlen);
-		return -EINVAL;
+/* a symbol kmod_elf_get_symbol_tables() takes, found on its first walk */
+struct elf_sym_use {
+	uint64_t crc; /* of an undefined symbol, from __versions */
+	uint32_t idx;
+	uint32_t len; /* of its name */
+	bool export; /* a "__crc_" entry */
+	bool undef;
+};
+
+static inline bool elf_sym_is_crc(const char *name)
+{
+	/* most names don't even start with "__c": skip strncmp() for them */
+	return name[0] == '_' && name[1] == '_' && name[2] == 'c' &&
+		strncmp(name + 3, "rc_", 3) == 0;
+}
+
+/*
+ * The CRCs of a module are all in the same section, if not absolute:
+ * look up its header once, rather than for each symbol.
+ */
+struct elf_crc_section {
+	uint16_t shndx;
+	uint64_t off;
+	uint64_t size;
+	int err;
+};
+
+static uint64_t kmod_elf_resolve_crc(const struct kmod_elf *elf,
+				     struct elf_crc_section *sec,
+				     uint64_t crc, uint16_t shndx)
+{
+	uint32_t nameoff;
+
+	if (shndx == SHN_ABS || shndx == SHN_UNDEF)
+		return crc;
+
+	if (shndx != sec->shndx) {
+		sec->shndx = shndx;
+		sec->err = elf_get_section_info(elf, shndx, &sec->off,
+							&sec->size, &nameoff);
 	}
 
-	if (versionslen == 0) {
-		vercount = 0;
-		visited_versions = NULL;
-	} else {
-		vercount = versionslen / verlen;
-		visited_versions = calloc(vercount, sizeof(uint8_t));
-		if (visited_versions == NULL)
-			return -ENOMEM;
+	if (sec->err < 0) {
+		ELFDBG("Cound not find section index %"PRIu16" for crc", shndx);
+		return (uint64_t)-1;
 	}
 
-	handle_register_symbols = (elf->header.machine == EM_SPARC ||
-				   elf->header.machine == EM_SPARCV9);
+	if (crc > (sec->size - sizeof(uint32_t))) {
+		ELFDBG("CRC offset %"PRIu64" is too big, section %"PRIu16" size is %"PRIu64"\n",
+		       crc, shndx, sec->size);
+		return (uint64_t)-1;
+	}
 
-	symcount = symtablen / symlen;
-	count = 0;
-	slen = 0;
-	str_off = (const uint8_t *)strtab - elf->memory;
-	sym_off = (const uint8_t *)symtab - elf->memory + symlen;
+	if (elf_fill(elf, sec->off + crc, sizeof(uint32_t)) < 0)
+		return (uint64_t)-1;
 
-	symcrcs = calloc(symcount, sizeof(uint64_t));
-	if (symcrcs == NULL) {
-		free(visited_versions);
-		return -ENOMEM;
+	crc = elf_get_uint(elf, sec->off + crc, sizeof(uint32_t));
+	return crc;
+}
+
+/*
+ * Walk .symtab once for both the exported symbols (the "__crc_" entries,
+ * falling back to __ksymtab_strings) and the undefined symbols a module
+ * depends on, plus the __versions entries no symbol refers to. Either
+ * @symbols or @deps may be NULL if that table isn't wanted. The counts
+ * are what kmod_elf_get_symbols() and kmod_elf_get_dependency_symbols()
+ * return; arrays are allocated with their strings in a single malloc,
+ * just free them.
+ *
+ * Most of .symtab is local symbols neither table wants: the walk only
+ * keeps the few symbols that are, with their name lengths, and only
+ * those are read again to fill in the tables.
+ */
+void kmod_elf_get_symbol_tables(const struct kmod_elf *elf,
+				struct kmod_modversion **symbols, int *symcount,
+				struct kmod_modversion **deps, int *depcount)
+{
+	static const size_t crc_strlen = sizeof("__crc_") - 1;
+	struct elf_versions versions = { };
+	struct elf_crc_section crc_sec = { .shndx = SHN_UNDEF };
+	struct elf_symtab tab;
+	struct kmod_modversion *a = NULL, *d = NULL;
+	struct elf_sym_use *uses = NULL;
+	char *itr, *ditr;
+	size_t slen = 0, dslen = 0, nuses = 0, uses_alloc = 0, u;
+	int i, count = 0, dcount = 0, err;
+	bool want_syms = symbols != NULL;
+	bool want_deps = deps != NULL;
+	int dep_err = 0;
+
+	if (want_syms)
+		*symbols = NULL;
+	if (want_deps)
+		*deps = NULL;
+
+	if (elf_get_symtab(elf, &tab) < 0) {
+		want_syms = false;
+		dep_err = -EINVAL;
+		goto done;
+	}
+
+	if (want_deps) {
+		err = elf_versions_load(elf, &versions);
+		if (err < 0)
+			dep_err = -ENOMEM;
 	}
 
-	for (i = 1; i < symcount; i++, sym_off += symlen) {
+	for (i = 1; i < tab.count && (want_syms || (want_deps && dep_err == 0));
+									i++) {
+		struct elf_sym sym;
 		const char *name;
-		uint64_t crc;
-		uint32_t name_off;
-		uint16_t secidx;
-		uint8_t info;
-		int idx;
-
-#define READV(field)							\
-		elf_get_uint(elf, sym_off + offsetof(typeof(*s), field),\
-			     sizeof(s->field))
-		if (elf->class & KMOD_ELF_32) {
-			Elf32_Sym *s;
-			name_off = READV(st_name);
-			secidx = READV(st_shndx);
-			info = READV(st_info);
-		} else {
-			Elf64_Sym *s;
-			name_off = READV(st_name);
-			secidx = READV(st_shndx);
-			info = READV(st_info);
+		bool undef, export;
+
+		elf_symtab_read(elf, &tab, i, &sym);
+		undef = want_deps && dep_err == 0 &&
+					elf_sym_is_undefined(elf, &sym);
+
+		if (sym.name_off >= tab.strtablen) {
+			ELFDBG(elf, ".strtab is %"PRIu64" bytes, but .symtab entry %d wants to access offset %"PRIu32".\n", tab.strtablen, i, sym.name_off);
+			want_syms = false;
+			if (undef)
+				dep_err = -EINVAL;
+			continue;
 		}
-#undef READV
-		if (secidx != SHN_UNDEF)
+
+		if (!want_syms && !undef)
 			continue;
 
-		if (handle_register_symbols) {
-			uint8_t type;
-			if (elf->class & KMOD_ELF_32)
-				type = ELF32_ST_TYPE(info);
-			else
-				type = ELF64_ST_TYPE(info);
-
-			/* Not really undefined: sparc gcc 3.3 creates
-			 * U references when you have global asm
-			 * variables, to avoid anyone else misusing
-			 * them.
-			 */
-			if (type == STT_REGISTER)
-				continue;
-		}
+		name = elf_get_mem(elf, tab.str_off + sym.name_off);
+		export = want_syms && elf_sym_is_crc(name);
 
-		if (name_off >= strtablen) {
-			ELFDBG(elf, ".strtab is %"PRIu64" bytes, but .symtab entry %d wants to access offset %"PRIu32".\n", strtablen, i, name_off);
-			free(visited_versions);
-			free(symcrcs);
-			return -EINVAL;
+		if (undef && name[0] == '\0') {
+			ELFDBG(elf, "empty symbol name at index %d\n", i);
+			undef = false;
 		}
 
-		name = elf_get_mem(elf, str_off + name_off);
-		if (name[0] == '\0') {
-			ELFDBG(elf, "empty symbol name at index %"PRIu64"\n", i);
+		if (!export && !undef)
 			continue;
+
+		if (nuses == uses_alloc) {
+			struct elf_sym_use *tmp;
+
+			uses_alloc = uses_alloc ? uses_alloc * 2 : 64;
+			tmp = realloc(uses, uses_alloc * sizeof(*uses));
+			if (tmp == NULL) {
+				want_syms = false;
+				dep_err = -ENOMEM;
+				break;
+			}
+			uses = tmp;
 		}
 
-		slen += strlen(name) + 1;
-		count++;
+		uses[nuses].idx = i;
+		uses[nuses].len = strlen(name);
+		uses[nuses].export = export;
+		uses[nuses].undef = undef;
+		uses[nuses].crc = 0;
 
-		idx = kmod_elf_crc_find(elf, versions, versionslen, name, &crc);
-		if (idx >= 0 && visited_versions != NULL)
-			visited_versions[idx] = 1;
-		symcrcs[i] = crc;
-	}
+		if (export) {
+			slen += uses[nuses].len - crc_strlen + 1;
+			count++;
+		}
 
-	if (visited_versions != NULL) {
-		/* module_layout/struct_module are not visited, but needed */
-		ver_off = (const uint8_t *)versions - elf->memory;
-		for (i = 0; i < vercount; i++) {
-			if (visited_versions[i] == 0) {
-				const char *name;
-				name = elf_get_mem(elf, ver_off + i * verlen + crclen);
-				slen += strlen(name) + 1;
-
-				count++;
-			}
+		if (undef) {
+			dslen += uses[nuses].len + 1;
+			dcount++;
+			uses[nuses].crc = elf_versions_find(elf, &versions,
+									name);
 		}
-	}
 
-	if (count == 0) {
-		free(visited_versions);
-		free(symcrcs);
-		*array = NULL;
-		return 0;
+		nuses++;
 	}
 
-	*array = a = malloc(sizeof(struct kmod_modversion) * count + slen);
-	if (*array == NULL) {
-		free(visited_versions);
-		free(symcrcs);
-		return -errno;
+	if (want_syms && count > 0) {
+		a = malloc(sizeof(struct kmod_modversion) * count + slen);
+		if (a == NULL) {
+			*symcount = -errno;
+			symbols = NULL;
+		}
 	}
+	want_syms = a != NULL;
 
-	itr = (char *)(a + count);
-	count = 0;
-	str_off = (const uint8_t *)strtab - elf->memory;
-	sym_off = (const uint8_t *)symtab - elf->memory + symlen;
-	for (i = 1; i < symcount; i++, sym_off += symlen) {
-		const char *name;
-		uint64_t crc;
-		uint32_t name_off;
-		uint16_t secidx;
-		uint8_t info, bind;
-
-#define READV(field)							\
-		elf_get_uint(elf, sym_off + offsetof(typeof(*s), field),\
-			     sizeof(s->field))
-		if (elf->class & KMOD_ELF_32) {
-			Elf32_Sym *s;
-			name_off = READV(st_name);
-			secidx = READV(st_shndx);
-			info = READV(st_info);
-		} else {
-			Elf64_Sym *s;
-			name_off = READV(st_name);
-			secidx = READV(st_shndx);
-			info = READV(st_info);
-		}
-#undef READV
-		if (secidx != SHN_UNDEF)
-			continue;
+	if (want_deps && dep_err == 0) {
+		/* module_layout/struct_module are not visited, but needed */
+		for (i = 0; i < versions.count; i++) {
+			const char *name;
 
-		if (handle_register_symbols) {
-			uint8_t type;
-			if (elf->class & KMOD_ELF_32)
-				type = ELF32_ST_TYPE(info);
-			else
-				type = ELF64_ST_TYPE(info);
-
-			/* Not really undefined: sparc gcc 3.3 creates
-			 * U references when you have global asm
-			 * variables, to avoid anyone else misusing
-			 * them.
-			 */
-			if (type == STT_REGISTER)
+			if (versions.visited[i] != 0)
 				continue;
+
+			name = elf_get_mem(elf, versions.off +
+					i * versions.verlen + versions.crclen);
+			dslen += strlen(name) + 1;
+			dcount++;
 		}
 
-		name = elf_get_mem(elf, str_off + name_off);
-		if (name[0] == '\0') {
-			ELFDBG(elf, "empty symbol name at index %"PRIu64"\n", i);
-			continue;
+		if (dcount > 0) {
+			d = malloc(sizeof(struct kmod_modversion) * dcount +
+									dslen);
+			if (d == NULL)
+				dep_err = -errno;
 		}
+	}
 
-		if (elf->class & KMOD_ELF_32)
-			bind = ELF32_ST_BIND(info);
-		else
-			bind = ELF64_ST_BIND(info);
-		if (bind == STB_WEAK)
-			bind = KMOD_SYMBOL_WEAK;
-		else
-			bind = KMOD_SYMBOL_UNDEF;
+	if (!want_syms && d == NULL)
+		goto done;
 
-		slen = strlen(name);
-		crc = symcrcs[i];
+	itr = a != NULL ? (char *)(a + count) : NULL;
+	ditr = d != NULL ? (char *)(d + dcount) : NULL;
+	count = 0;
+	dcount = 0;
+	for (u = 0; u < nuses; u++) {
+		const struct elf_sym_use *use = &uses[u];
+		struct elf_sym sym;
+		const char *name;
+		size_t len;
 
-		a[count].crc = crc;
-		a[count].bind = bind;
-		a[count].symbol = itr;
-		memcpy(itr, name, slen);
-		itr[slen] = '\0';
-		itr += slen + 1;
+		elf_symtab_read(elf, &tab, use->idx, &sym);
+		name = elf_get_mem(elf, tab.str_off + sym.name_off);
 
-		count++;
-	}
+		if (want_syms && use->export) {
+			len = use->len - crc_strlen;
+			a[count].crc = kmod_elf_resolve_crc(elf, &crc_sec,
+							sym.value, sym.shndx);
+			a[count].bind = kmod_symbol_bind_from_elf(sym.bind);
+			a[count].symbol = itr;
+			memcpy(itr, name + crc_strlen, len);
+			itr[len] = '\0';
+			itr += len + 1;
+			count++;
+		}
 
-	free(symcrcs);
+		if (d == NULL || !use->undef)
+			continue;
 
-	if (visited_versions == NULL)
-		return count;
+		len = use->len;
+		d[dcount].crc = use->crc;
+		d[dcount].bind = sym.bind == STB_WEAK ? KMOD_SYMBOL_WEAK :
+							KMOD_SYMBOL_UNDEF;
+		d[dcount].symbol = ditr;
+		memcpy(ditr, name, len);
+		ditr[len] = '\0';
+		ditr += len + 1;
+		dcount++;
+	}
 
 	/* add unvisited (module_layout/struct_module) */
-	ver_off = (const uint8_t *)versions - elf->memory;
-	for (i = 0; i < vercount; i++) {
+	for (i = 0; d != NULL && i < versions.count; i++) {
+		uint64_t off = versions.off + i * versions.verlen;
 		const char *name;
-		uint64_t crc;
+		size_t len;
 
-		if (visited_versions[i] != 0)
+		if (versions.visited[i] != 0)
 			continue;
 
-		name = elf_get_mem(elf, ver_off + i * verlen + crclen);
-		slen = strlen(name);
-		crc = elf_get_uint(elf, ver_off + i * verlen, crclen);
+		name = elf_get_mem(elf, off + versions.crclen);
+		len = strlen(name);
 
-		a[count].crc = crc;
-		a[count].bind = KMOD_SYMBOL_UNDEF;
-		a[count].symbol = itr;
-		memcpy(itr, name, slen);
-		itr[slen] = '\0';
-		itr += slen + 1;
+		d[dcount].crc = elf_get_uint(elf, off, versions.crclen);
+		d[dcount].bind = KMOD_SYMBOL_UNDEF;
+		d[dcount].symbol = ditr;
+		memcpy(ditr, name, len);
+		ditr[len] = '\0';
+		ditr += len + 1;
+		dcount++;
+	}
 
-		count++;
+done:
+	if (want_syms) {
+		*symbols = a;
+		*symcount = count;
+	} else if (symbols != NULL) {
+		ELFDBG(elf, "Falling back to __ksymtab_strings!\n");
+		*symcount = kmod_elf_get_symbols_symtab(elf, symbols);
+	}
+
+	if (deps != NULL) {
+		*deps = d;
+		*depcount = dep_err < 0 ? dep_err : dcount;
 	}
-	free(visited_versions);
+
+	elf_versions_free(&versions);
+	free(uses);
+}
+
+/* array will be allocated with strings in a single malloc, just free *array */
+int kmod_elf_get_symbols(const struct kmod_elf *elf, struct kmod_modversion **array)
+{
+	int count;
+
+	kmod_elf_get_symbol_tables(elf, array, &count, NULL, NULL);
+	return count;
+}
+
+/* array will be allocated with strings in a single malloc, just free *array */
+int kmod_elf_get_dependency_symbols(const struct kmod_elf *elf, struct kmod_modversion **array)
+{
+	int count;
+
+	kmod_elf_get_symbol_tables(elf, NULL, NULL, array, &count);
 	return count;
 }
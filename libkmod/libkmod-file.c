@@ -17,8 +17,13 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -42,9 +47,40 @@
 #include "libkmod-internal.h"
 
 struct kmod_file;
+struct file_frame;
+struct file_frames;
 struct file_ops {
 	int (*load)(struct kmod_file *file);
 	void (*unload)(struct kmod_file *file);
+	/* for formats with frames that can be decompressed on their own */
+	int (*open_frames)(struct kmod_file *file, const uint8_t *src,
+				size_t src_size, struct file_frames **frames);
+	int (*load_frame)(struct kmod_file *file, const struct file_frame *f,
+								uint8_t *dst);
+};
+
+/*
+ * A seekable image, made of zstd frames or xz blocks: to read the ELF
+ * headers and a few sections, only the frames covering them are
+ * decompressed, into an image of the full size whose pages only get
+ * allocated once written.
+ */
+struct file_frame {
+	uint64_t offset;	/* in the compressed file */
+	uint64_t size;
+	uint64_t uoffset;	/* in the image */
+	uint64_t usize;
+	bool loaded;
+};
+
+struct file_frames {
+	pthread_mutex_t lock;
+	const uint8_t *src;
+	size_t src_size;
+	uint32_t check;		/* xz: integrity check of the blocks */
+	unsigned int n_loaded;
+	unsigned int count;
+	struct file_frame frame[];
 };
 
 struct kmod_file {
@@ -58,136 +94,236 @@ struct kmod_file {
 	gzFile gzf;
 #endif
 	int fd;
+	int memfd;
+	size_t memfd_size;
+	/* contents are mapped from the decompressed-module cache */
+	bool cached;
+	/* never read from nor written to that cache */
+	bool uncached;
 	enum kmod_file_compression_type compression;
 	off_t size;
 	void *memory;
 	const struct file_ops *ops;
 	const struct kmod_ctx *ctx;
 	struct kmod_elf *elf;
+	/* not NULL while memory only has the frames read so far */
+	struct file_frames *frames;
 };
 
-#ifdef ENABLE_ZSTD
-static int zstd_read_block(struct kmod_file *file, size_t block_size,
-			   ZSTD_inBuffer *input, size_t *input_capacity)
+static inline uint32_t le32_at(const uint8_t *p)
 {
-	ssize_t rdret;
-	int ret;
+	return le32toh(get_unaligned((const uint32_t *) p));
+}
 
-	if (*input_capacity < block_size) {
-		free((void *)input->src);
-		input->src = malloc(block_size);
-		if (input->src == NULL) {
-			ret = -errno;
-			ERR(file->ctx, "zstd: %m\n");
-			return ret;
-		}
-		*input_capacity = block_size;
-	}
+#if defined(ENABLE_ZSTD) || defined(ENABLE_XZ)
+static struct file_frames *file_frames_new(unsigned int count)
+{
+	struct file_frames *frames;
 
-	rdret = read(file->fd, (void *)input->src, block_size);
-	if (rdret < 0) {
-		ret = -errno;
-		ERR(file->ctx, "zstd: %m\n");
-		return ret;
-	}
+	frames = calloc(1, sizeof(*frames) + count * sizeof(frames->frame[0]));
+	if (frames == NULL)
+		return NULL;
+
+	pthread_mutex_init(&frames->lock, NULL);
+	frames->count = count;
+
+	return frames;
+}
+#endif
+
+static void file_frames_free(struct file_frames *frames)
+{
+	pthread_mutex_destroy(&frames->lock);
+	free(frames);
+}
+
+#if defined(ENABLE_ZSTD) || defined(ENABLE_XZ) || defined(ENABLE_ZLIB)
+/*
+ * Decompressed contents normally live on the heap. When they are meant for
+ * finit_module() they are written to a memfd instead, which the kernel then
+ * reads from directly: these helpers hide which one is in use.
+ */
+static void *file_buf_resize(struct kmod_file *file, void *p, size_t size)
+{
+	void *q;
+
+	if (file->memfd < 0)
+		return realloc(p, size);
+
+	if (ftruncate(file->memfd, size) < 0)
+		return NULL;
+
+	if (p == NULL)
+		q = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 file->memfd, 0);
+	else
+		q = mremap(p, file->memfd_size, size, MREMAP_MAYMOVE);
+	if (q == MAP_FAILED)
+		return NULL;
+
+	file->memfd_size = size;
+	return q;
+}
+
+/* the memfd must end where the contents do: finit_module() reads it all */
+static int file_buf_finish(struct kmod_file *file, size_t size)
+{
+	if (file->memfd >= 0 && ftruncate(file->memfd, size) < 0)
+		return -errno;
 
-	input->pos = 0;
-	input->size = rdret;
 	return 0;
 }
 
-static int zstd_ensure_outbuffer_space(ZSTD_outBuffer *buffer, size_t min_free)
+static void file_buf_free(struct kmod_file *file, void *p)
 {
-	uint8_t *old_buffer = buffer->dst;
-	int ret = 0;
+	if (file->memfd_size == 0) {
+		free(p);
+		return;
+	}
+
+	munmap(p, file->memfd_size);
+	file->memfd_size = 0;
+}
+#endif
+
+#ifdef ENABLE_ZSTD
+static int zstd_ensure_outbuffer_space(struct kmod_file *file,
+				       ZSTD_outBuffer *buffer, size_t min_free)
+{
+	void *tmp;
 
 	if (buffer->size - buffer->pos >= min_free)
 		return 0;
 
-	buffer->size += min_free;
-	buffer->dst = realloc(buffer->dst, buffer->size);
-	if (buffer->dst == NULL) {
-		ret = -errno;
-		free(old_buffer);
-	}
+	tmp = file_buf_resize(file, buffer->dst, buffer->size + min_free);
+	if (tmp == NULL)
+		return -errno;
 
-	return ret;
+	buffer->dst = tmp;
+	buffer->size += min_free;
+	return 0;
 }
 
-static int zstd_decompress_block(struct kmod_file *file, ZSTD_DStream *dstr,
-				 ZSTD_inBuffer *input, ZSTD_outBuffer *output,
-				 size_t *next_block_size)
+/* for frames that don't record their size: grow the output as needed */
+static int zstd_decompress_stream(struct kmod_file *file, const void *src,
+				  size_t src_size, ZSTD_outBuffer *output)
 {
 	size_t out_buf_min_size = ZSTD_DStreamOutSize();
+	ZSTD_inBuffer input = { src, src_size, 0 };
+	ZSTD_DStream *dstr;
 	int ret = 0;
 
+	dstr = ZSTD_createDStream();
+	if (dstr == NULL) {
+		ERR(file->ctx, "zstd: Failed to create decompression stream\n");
+		return -EINVAL;
+	}
+
+	ZSTD_initDStream(dstr);
+
 	do {
-		ssize_t dsret;
+		size_t dsret;
 
-		ret = zstd_ensure_outbuffer_space(output, out_buf_min_size);
+		ret = zstd_ensure_outbuffer_space(file, output,
+						  out_buf_min_size);
 		if (ret) {
 			ERR(file->ctx, "zstd: %s\n", strerror(-ret));
 			break;
 		}
 
-		dsret = ZSTD_decompressStream(dstr, output, input);
+		dsret = ZSTD_decompressStream(dstr, output, &input);
 		if (ZSTD_isError(dsret)) {
 			ret = -EINVAL;
 			ERR(file->ctx, "zstd: %s\n", ZSTD_getErrorName(dsret));
 			break;
 		}
-		if (dsret > 0)
-			*next_block_size = (size_t)dsret;
-	} while (input->pos < input->size
-		 || output->pos > output->size
+	} while (input.pos < input.size
 		 || output->size - output->pos < out_buf_min_size);
 
+	ZSTD_freeDStream(dstr);
 	return ret;
 }
 
 static int load_zstd(struct kmod_file *file)
 {
-	ZSTD_DStream *dstr;
-	size_t next_block_size;
-	size_t zst_inb_capacity = 0;
-	ZSTD_inBuffer zst_inb = { 0 };
 	ZSTD_outBuffer zst_outb = { 0 };
+	unsigned long long content_size;
+	struct stat st;
+	size_t src_size;
+	void *src;
 	int ret;
 
-	dstr = ZSTD_createDStream();
-	if (dstr == NULL) {
+	if (fstat(file->fd, &st) < 0) {
+		ret = -errno;
+		ERR(file->ctx, "zstd: %m\n");
+		return ret;
+	}
+
+	/* decompress straight from the page cache */
+	src_size = st.st_size;
+	src = mmap(NULL, src_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+	if (src == MAP_FAILED) {
+		ret = -errno;
+		ERR(file->ctx, "zstd: %m\n");
+		return ret;
+	}
+
+	/*
+	 * The kernel build records the decompressed size in the frame, so
+	 * the output is allocated once with nothing to grow or copy.
+	 */
+	content_size = ZSTD_getFrameContentSize(src, src_size);
+	if (content_size == ZSTD_CONTENTSIZE_ERROR) {
 		ret = -EINVAL;
-		ERR(file->ctx, "zstd: Failed to create decompression stream\n");
+		ERR(file->ctx, "zstd: not a valid zstd frame\n");
 		goto out;
 	}
 
-	next_block_size = ZSTD_initDStream(dstr);
+	if (content_size != ZSTD_CONTENTSIZE_UNKNOWN && content_size > 0 &&
+						content_size <= SIZE_MAX) {
+		size_t dsret;
 
-	while (true) {
-		ret = zstd_read_block(file, next_block_size, &zst_inb,
-				      &zst_inb_capacity);
-		if (ret != 0)
+		zst_outb.size = content_size;
+		zst_outb.dst = file_buf_resize(file, NULL, zst_outb.size);
+		if (zst_outb.dst == NULL) {
+			ret = -errno;
+			ERR(file->ctx, "zstd: %m\n");
 			goto out;
-		if (zst_inb.size == 0) /* EOF */
-			break;
+		}
 
-		ret = zstd_decompress_block(file, dstr, &zst_inb, &zst_outb,
-					    &next_block_size);
-		if (ret != 0)
-			goto out;
+		dsret = ZSTD_decompress(zst_outb.dst, zst_outb.size,
+							src, src_size);
+		if (!ZSTD_isError(dsret)) {
+			zst_outb.pos = dsret;
+			goto done;
+		}
+
+		/*
+		 * More than one frame, or a size that doesn't match: start
+		 * over with the stream, which also reports real errors.
+		 */
+		file_buf_free(file, zst_outb.dst);
+		zst_outb = (ZSTD_outBuffer) { 0 };
 	}
 
-	ZSTD_freeDStream(dstr);
-	free((void *)zst_inb.src);
+	ret = zstd_decompress_stream(file, src, src_size, &zst_outb);
+	if (ret != 0)
+		goto out;
+
+done:
+	ret = file_buf_finish(file, zst_outb.pos);
+	if (ret != 0) {
+		ERR(file->ctx, "zstd: %s\n", strerror(-ret));
+		goto out;
+	}
+	munmap(src, src_size);
 	file->zstd_used = true;
 	file->memory = zst_outb.dst;
 	file->size = zst_outb.pos;
 	return 0;
 out:
-	if (dstr != NULL)
-		ZSTD_freeDStream(dstr);
-	free((void *)zst_inb.src);
-	free((void *)zst_outb.dst);
+	munmap(src, src_size);
+	file_buf_free(file, zst_outb.dst);
 	return ret;
 }
 
@@ -195,7 +331,90 @@ static void unload_zstd(struct kmod_file *file)
 {
 	if (!file->zstd_used)
 		return;
-	free(file->memory);
+	file_buf_free(file, file->memory);
+}
+
+/*
+ * Seekable format: the sizes of the frames are in a skippable frame at the
+ * end, one entry of the compressed and decompressed size each, plus a
+ * checksum when flagged, then the number of frames, a descriptor and a
+ * magic of its own.
+ */
+#define ZSTD_SKIPPABLE_SEEK_MAGIC 0x184D2A5E
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+#define ZSTD_SEEK_FOOTER_SIZE 9
+#define ZSTD_SEEK_CHECKSUM_FLAG 0x80
+#define ZSTD_SEEK_RESERVED_BITS 0x7c
+
+static int open_frames_zstd(struct kmod_file *file, const uint8_t *src,
+				size_t src_size, struct file_frames **ret)
+{
+	const uint8_t *footer, *entry;
+	struct file_frames *frames;
+	uint64_t offset = 0, uoffset = 0;
+	uint32_t count, entry_size;
+	size_t table_size;
+	unsigned int i;
+
+	if (src_size < ZSTD_SEEK_FOOTER_SIZE + 8)
+		return -ENOTSUP;
+
+	footer = src + src_size - ZSTD_SEEK_FOOTER_SIZE;
+	if (le32_at(footer + 5) != ZSTD_SEEKABLE_MAGIC)
+		return -ENOTSUP;
+
+	if (footer[4] & ZSTD_SEEK_RESERVED_BITS)
+		return -EINVAL;
+
+	count = le32_at(footer);
+	entry_size = footer[4] & ZSTD_SEEK_CHECKSUM_FLAG ? 12 : 8;
+	if (count == 0 || count > (src_size - ZSTD_SEEK_FOOTER_SIZE - 8) /
+								entry_size)
+		return -EINVAL;
+
+	table_size = (size_t) count * entry_size + ZSTD_SEEK_FOOTER_SIZE;
+	entry = src + src_size - table_size;
+	if (le32_at(entry - 8) != ZSTD_SKIPPABLE_SEEK_MAGIC ||
+					le32_at(entry - 4) != table_size)
+		return -EINVAL;
+
+	frames = file_frames_new(count);
+	if (frames == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++, entry += entry_size) {
+		struct file_frame *f = &frames->frame[i];
+
+		f->offset = offset;
+		f->size = le32_at(entry);
+		f->uoffset = uoffset;
+		f->usize = le32_at(entry + 4);
+		offset += f->size;
+		uoffset += f->usize;
+	}
+
+	*ret = frames;
+	return 0;
+}
+
+static int load_frame_zstd(struct kmod_file *file, const struct file_frame *f,
+								uint8_t *dst)
+{
+	size_t dsret;
+
+	dsret = ZSTD_decompress(dst, f->usize, file->frames->src + f->offset,
+								f->size);
+	if (ZSTD_isError(dsret)) {
+		ERR(file->ctx, "zstd: %s\n", ZSTD_getErrorName(dsret));
+		return -EINVAL;
+	}
+
+	if (dsret != f->usize) {
+		ERR(file->ctx, "zstd: frame size does not match the seek table\n");
+		return -EINVAL;
+	}
+
+	return 0;
 }
 
 static const char magic_zstd[] = {0x28, 0xB5, 0x2F, 0xFD};
@@ -226,77 +445,122 @@ static void xz_uncompress_belch(struct kmod_file *file, lzma_ret ret)
 	}
 }
 
-static int xz_uncompress(lzma_stream *strm, struct kmod_file *file)
+static int xz_uncompress(lzma_stream *strm, struct kmod_file *file,
+			 const uint8_t *src, size_t src_size)
 {
-	uint8_t in_buf[BUFSIZ], out_buf[BUFSIZ];
-	lzma_action action = LZMA_RUN;
-	lzma_ret ret;
-	void *p = NULL;
-	size_t total = 0;
+	lzma_ret lzret;
+	uint8_t *p = NULL;
+	size_t capacity = 0;
+	int err;
 
-	strm->avail_in  = 0;
-	strm->next_out  = out_buf;
-	strm->avail_out = sizeof(out_buf);
+	strm->next_in = src;
+	strm->avail_in = src_size;
 
+	/* decode straight into the result, growing it as needed */
 	while (true) {
-		if (strm->avail_in == 0) {
-			ssize_t rdret = read(file->fd, in_buf, sizeof(in_buf));
-			if (rdret < 0) {
-				ret = -errno;
-				goto out;
-			}
-			strm->next_in  = in_buf;
-			strm->avail_in = rdret;
-			if (rdret == 0)
-				action = LZMA_FINISH;
-		}
-		ret = lzma_code(strm, action);
-		if (strm->avail_out == 0 || ret != LZMA_OK) {
-			size_t write_size = BUFSIZ - strm->avail_out;
-			char *tmp = realloc(p, total + write_size);
+		if (strm->avail_out == 0) {
+			size_t used = strm->total_out;
+			uint8_t *tmp;
+
+			if (capacity == 0)
+				capacity = src_size * 4 > BUFSIZ ?
+						src_size * 4 : BUFSIZ;
+			else
+				capacity *= 2;
+			tmp = file_buf_resize(file, p, capacity);
 			if (tmp == NULL) {
-				ret = -errno;
+				err = -errno;
 				goto out;
 			}
-			memcpy(tmp + total, out_buf, write_size);
-			total += write_size;
 			p = tmp;
-			strm->next_out = out_buf;
-			strm->avail_out = BUFSIZ;
+			strm->next_out = p + used;
+			strm->avail_out = capacity - used;
 		}
-		if (ret == LZMA_STREAM_END)
+
+		lzret = lzma_code(strm, LZMA_FINISH);
+		if (lzret == LZMA_STREAM_END)
 			break;
-		if (ret != LZMA_OK) {
-			xz_uncompress_belch(file, ret);
-			ret = -EINVAL;
+		if (lzret != LZMA_OK) {
+			xz_uncompress_belch(file, lzret);
+			err = -EINVAL;
 			goto out;
 		}
 	}
+
+	err = file_buf_finish(file, strm->total_out);
+	if (err < 0)
+		goto out;
+
 	file->xz_used = true;
 	file->memory = p;
-	file->size = total;
+	file->size = strm->total_out;
 	return 0;
  out:
-	free(p);
-	return ret;
+	file_buf_free(file, p);
+	return err;
+}
+
+static lzma_ret xz_decoder_init(lzma_stream *strm, struct kmod_file *file)
+{
+#if LZMA_VERSION >= UINT32_C(50040002)
+	unsigned int threads = kmod_get_decompress_threads(file->ctx);
+
+	if (threads == 0)
+		threads = lzma_cputhreads();
+
+	/*
+	 * Only streams with several blocks are decoded in parallel, others
+	 * go through a single thread as with lzma_stream_decoder().
+	 */
+	if (threads > 1) {
+		lzma_mt mt = {
+			.flags = LZMA_CONCATENATED,
+			.threads = threads,
+			.memlimit_threading = lzma_physmem() / 4,
+			.memlimit_stop = UINT64_MAX,
+		};
+
+		return lzma_stream_decoder_mt(strm, &mt);
+	}
+#endif
+
+	return lzma_stream_decoder(strm, UINT64_MAX, LZMA_CONCATENATED);
 }
 
 static int load_xz(struct kmod_file *file)
 {
 	lzma_stream strm = LZMA_STREAM_INIT;
 	lzma_ret lzret;
+	struct stat st;
+	void *src;
 	int ret;
 
-	lzret = lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
+	if (fstat(file->fd, &st) < 0) {
+		ret = -errno;
+		ERR(file->ctx, "xz: %m\n");
+		return ret;
+	}
+
+	src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+	if (src == MAP_FAILED) {
+		ret = -errno;
+		ERR(file->ctx, "xz: %m\n");
+		return ret;
+	}
+
+	lzret = xz_decoder_init(&strm, file);
 	if (lzret == LZMA_MEM_ERROR) {
 		ERR(file->ctx, "xz: %s\n", strerror(ENOMEM));
-		return -ENOMEM;
+		ret = -ENOMEM;
 	} else if (lzret != LZMA_OK) {
 		ERR(file->ctx, "xz: Internal error (bug)\n");
-		return -EINVAL;
+		ret = -EINVAL;
+	} else {
+		ret = xz_uncompress(&strm, file, src, st.st_size);
 	}
-	ret = xz_uncompress(&strm, file);
+
 	lzma_end(&strm);
+	munmap(src, st.st_size);
 	return ret;
 }
 
@@ -304,7 +568,115 @@ static void unload_xz(struct kmod_file *file)
 {
 	if (!file->xz_used)
 		return;
-	free(file->memory);
+	file_buf_free(file, file->memory);
+}
+
+/*
+ * A stream compressed in several blocks, as with xz --block-size: the
+ * index at the end has where each starts, in the file and in the image.
+ * Concatenated streams and padding are left to load_xz().
+ */
+static int open_frames_xz(struct kmod_file *file, const uint8_t *src,
+				size_t src_size, struct file_frames **ret)
+{
+	lzma_stream_flags header, footer;
+	uint64_t memlimit = UINT64_MAX;
+	struct file_frames *frames;
+	lzma_index *idx = NULL;
+	lzma_index_iter iter;
+	lzma_vli count;
+	unsigned int i = 0;
+	size_t pos;
+
+	if (src_size < 2 * LZMA_STREAM_HEADER_SIZE)
+		return -ENOTSUP;
+
+	if (lzma_stream_header_decode(&header, src) != LZMA_OK ||
+	    lzma_stream_footer_decode(&footer,
+			src + src_size - LZMA_STREAM_HEADER_SIZE) != LZMA_OK ||
+	    lzma_stream_flags_compare(&header, &footer) != LZMA_OK)
+		return -ENOTSUP;
+
+	if (footer.backward_size > src_size - 2 * LZMA_STREAM_HEADER_SIZE)
+		return -EINVAL;
+
+	pos = src_size - LZMA_STREAM_HEADER_SIZE - footer.backward_size;
+	if (lzma_index_buffer_decode(&idx, &memlimit, NULL, src, &pos,
+			src_size - LZMA_STREAM_HEADER_SIZE) != LZMA_OK)
+		return -EINVAL;
+
+	count = lzma_index_block_count(idx);
+	if (count == 0 || count > UINT_MAX) {
+		lzma_index_end(idx, NULL);
+		return -ENOTSUP;
+	}
+
+	frames = file_frames_new(count);
+	if (frames == NULL) {
+		lzma_index_end(idx, NULL);
+		return -ENOMEM;
+	}
+	frames->check = header.check;
+
+	lzma_index_iter_init(&iter, idx);
+	while (i < count && !lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+		struct file_frame *f = &frames->frame[i++];
+
+		f->offset = iter.block.compressed_file_offset;
+		f->size = iter.block.total_size;
+		f->uoffset = iter.block.uncompressed_file_offset;
+		f->usize = iter.block.uncompressed_size;
+	}
+	lzma_index_end(idx, NULL);
+
+	*ret = frames;
+	return 0;
+}
+
+static int load_frame_xz(struct kmod_file *file, const struct file_frame *f,
+								uint8_t *dst)
+{
+	const uint8_t *in = file->frames->src + f->offset;
+	lzma_filter filters[LZMA_FILTERS_MAX + 1];
+	lzma_block block = {
+		.version = 0,
+		.check = file->frames->check,
+		.filters = filters,
+	};
+	size_t in_pos, out_pos = 0;
+	lzma_ret lzret;
+	unsigned int i;
+
+	block.header_size = lzma_block_header_size_decode(in[0]);
+	if (in[0] == 0 || block.header_size > f->size) {
+		xz_uncompress_belch(file, LZMA_DATA_ERROR);
+		return -EINVAL;
+	}
+
+	lzret = lzma_block_header_decode(&block, NULL, in);
+	if (lzret != LZMA_OK) {
+		xz_uncompress_belch(file, lzret);
+		return -EINVAL;
+	}
+
+	in_pos = block.header_size;
+	lzret = lzma_block_buffer_decode(&block, NULL, in, &in_pos, f->size,
+						dst, &out_pos, f->usize);
+
+	for (i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++)
+		free(filters[i].options);
+
+	if (lzret != LZMA_OK) {
+		xz_uncompress_belch(file, lzret);
+		return -EINVAL;
+	}
+
+	if (out_pos != f->usize) {
+		ERR(file->ctx, "xz: block size does not match the index\n");
+		return -EINVAL;
+	}
+
+	return 0;
 }
 
 static const char magic_xz[] = {0xfd, '7', 'z', 'X', 'Z', 0};
@@ -316,7 +688,7 @@ static int load_zlib(struct kmod_file *file)
 {
 	int err = 0;
 	off_t did = 0, total = 0;
-	_cleanup_free_ unsigned char *p = NULL;
+	unsigned char *p = NULL;
 
 	errno = 0;
 	file->gzf = gzdopen(file->fd, "rb");
@@ -328,7 +700,7 @@ static int load_zlib(struct kmod_file *file)
 		int r;
 
 		if (did == total) {
-			void *tmp = realloc(p, total + READ_STEP);
+			void *tmp = file_buf_resize(file, p, total + READ_STEP);
 			if (tmp == NULL) {
 				err = -errno;
 				goto error;
@@ -353,12 +725,16 @@ static int load_zlib(struct kmod_file *file)
 		did += r;
 	}
 
+	err = file_buf_finish(file, did);
+	if (err < 0)
+		goto error;
+
 	file->memory = p;
 	file->size = did;
-	p = NULL;
 	return 0;
 
 error:
+	file_buf_free(file, p);
 	gzclose(file->gzf);
 	return err;
 }
@@ -367,7 +743,7 @@ static void unload_zlib(struct kmod_file *file)
 {
 	if (file->gzf == NULL)
 		return;
-	free(file->memory);
+	file_buf_free(file, file->memory);
 	gzclose(file->gzf); /* closes file->fd */
 }
 
@@ -381,10 +757,10 @@ static const struct comp_type {
 	const struct file_ops ops;
 } comp_types[] = {
 #ifdef ENABLE_ZSTD
-	{sizeof(magic_zstd),	KMOD_FILE_COMPRESSION_ZSTD, magic_zstd, {load_zstd, unload_zstd}},
+	{sizeof(magic_zstd),	KMOD_FILE_COMPRESSION_ZSTD, magic_zstd, {load_zstd, unload_zstd, open_frames_zstd, load_frame_zstd}},
 #endif
 #ifdef ENABLE_XZ
-	{sizeof(magic_xz),	KMOD_FILE_COMPRESSION_XZ, magic_xz, {load_xz, unload_xz}},
+	{sizeof(magic_xz),	KMOD_FILE_COMPRESSION_XZ, magic_xz, {load_xz, unload_xz, open_frames_xz, load_frame_xz}},
 #endif
 #ifdef ENABLE_ZLIB
 	{sizeof(magic_zlib),	KMOD_FILE_COMPRESSION_ZLIB, magic_zlib, {load_zlib, unload_zlib}},
@@ -405,6 +781,8 @@ static int load_reg(struct kmod_file *file)
 	if (file->memory == MAP_FAILED)
 		return -errno;
 
+	kmod_stat_add(file->ctx, KMOD_STAT_BYTES_MAPPED, file->size);
+
 	return 0;
 }
 
@@ -417,18 +795,171 @@ static const struct file_ops reg_ops = {
 	load_reg, unload_reg
 };
 
+/*
+ * List the frames of a seekable image and reserve the image, with nothing
+ * decompressed yet. Files that aren't seekable, or have a single frame,
+ * are decompressed whole as before, and so are they when the
+ * decompressed-module cache is used: it only stores complete images.
+ */
+static int file_frames_open(struct kmod_file *file)
+{
+	struct file_frames *frames;
+	struct stat st;
+	uint64_t usize = 0;
+	unsigned int i;
+	void *src, *mem;
+	int err;
+
+	if (file->ops->open_frames == NULL || kmod_file_uses_cache(file))
+		return -ENOTSUP;
+
+	if (fstat(file->fd, &st) < 0)
+		return -errno;
+
+	src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+	if (src == MAP_FAILED)
+		return -errno;
+
+	err = file->ops->open_frames(file, src, st.st_size, &frames);
+	if (err < 0)
+		goto fail_src;
+
+	for (i = 0; i < frames->count; i++) {
+		const struct file_frame *f = &frames->frame[i];
+		uint64_t end;
+
+		if (f->uoffset != usize || f->usize == 0 ||
+		    addu64_overflow(f->offset, f->size, &end) ||
+		    end > (uint64_t) st.st_size ||
+		    addu64_overflow(usize, f->usize, &usize)) {
+			err = -EINVAL;
+			goto fail_frames;
+		}
+	}
+
+	if (frames->count < 2 || usize > SIZE_MAX) {
+		err = -ENOTSUP;
+		goto fail_frames;
+	}
+
+	mem = mmap(NULL, usize, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		err = -errno;
+		goto fail_frames;
+	}
+
+	frames->src = src;
+	frames->src_size = st.st_size;
+	file->frames = frames;
+	file->memory = mem;
+	file->size = usize;
+
+	return 0;
+
+fail_frames:
+	file_frames_free(frames);
+fail_src:
+	munmap(src, st.st_size);
+	if (err != -ENOTSUP)
+		DBG(file->ctx, "bad seek table, decompressing it all: %s\n",
+							strerror(-err));
+	return err;
+}
+
+/* decompress the frames covering a range of the image, if not done yet */
+static int file_frames_fill(void *data, uint64_t offset, uint64_t size)
+{
+	struct kmod_file *file = data;
+	struct file_frames *frames = file->frames;
+	unsigned long long t0;
+	uint64_t bytes = 0;
+	unsigned int lo = 0, hi;
+	int err = 0;
+
+	if (offset >= (uint64_t) file->size || size == 0)
+		return 0;
+	if (size > (uint64_t) file->size - offset)
+		size = file->size - offset;
+
+	pthread_mutex_lock(&frames->lock);
+
+	if (frames->n_loaded == frames->count)
+		goto out;
+
+	/* the first frame ending past offset */
+	hi = frames->count;
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		const struct file_frame *f = &frames->frame[mid];
+
+		if (f->uoffset + f->usize <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	t0 = now_usec();
+	for (; lo < frames->count && frames->frame[lo].uoffset < offset + size;
+									lo++) {
+		struct file_frame *f = &frames->frame[lo];
+
+		if (f->loaded)
+			continue;
+
+		err = file->ops->load_frame(file, f,
+					(uint8_t *) file->memory + f->uoffset);
+		if (err < 0)
+			break;
+
+		f->loaded = true;
+		frames->n_loaded++;
+		bytes += f->usize;
+	}
+
+	if (bytes > 0) {
+		kmod_stat_add(file->ctx, KMOD_STAT_DECOMPRESS_USEC,
+							now_usec() - t0);
+		kmod_stat_add(file->ctx, KMOD_STAT_BYTES_DECOMPRESSED, bytes);
+	}
+
+out:
+	pthread_mutex_unlock(&frames->lock);
+	return err;
+}
+
+/*
+ * Make a range of the contents readable. Only seekable images can be
+ * partly in memory: for anything else, this is a no-op.
+ */
+int kmod_file_load_range(struct kmod_file *file, uint64_t offset,
+								uint64_t size)
+{
+	if (file->frames == NULL)
+		return 0;
+
+	return file_frames_fill(file, offset, size);
+}
+
 struct kmod_elf *kmod_file_get_elf(struct kmod_file *file)
 {
 	if (file->elf)
 		return file->elf;
 
+	/* only decompress what the lookups in the ELF read */
+	if (file->memory == NULL && file_frames_open(file) == 0) {
+		file->elf = kmod_elf_new_partial(file->memory, file->size,
+						file_frames_fill, file);
+		return file->elf;
+	}
+
 	kmod_file_load_contents(file);
 	file->elf = kmod_elf_new(file->memory, file->size);
 	return file->elf;
 }
 
-struct kmod_file *kmod_file_open(const struct kmod_ctx *ctx,
-						const char *filename)
+static struct kmod_file *file_open(const struct kmod_ctx *ctx,
+					const char *filename, bool uncached)
 {
 	struct kmod_file *file = calloc(1, sizeof(struct kmod_file));
 	const struct comp_type *itr;
@@ -438,6 +969,8 @@ struct kmod_file *kmod_file_open(const struct kmod_ctx *ctx,
 	if (file == NULL)
 		return NULL;
 
+	KMOD_PROBE1(file_open_entry, filename);
+	file->memfd = -1;
 	file->fd = open(filename, O_RDONLY|O_CLOEXEC);
 	if (file->fd < 0) {
 		err = -errno;
@@ -482,8 +1015,10 @@ struct kmod_file *kmod_file_open(const struct kmod_ctx *ctx,
 	}
 
 	file->ctx = ctx;
+	file->uncached = uncached;
 
 error:
+	KMOD_PROBE2(file_open_return, filename, err);
 	if (err < 0) {
 		if (file->fd >= 0)
 			close(file->fd);
@@ -495,16 +1030,210 @@ error:
 	return file;
 }
 
+struct kmod_file *kmod_file_open(const struct kmod_ctx *ctx,
+						const char *filename)
+{
+	return file_open(ctx, filename, false);
+}
+
 /*
- *  Callers should just check file->memory got updated
+ * The contents of this one never come from nor go to the decompressed-module
+ * cache: it's for the image handed to the kernel.
  */
-void kmod_file_load_contents(struct kmod_file *file)
+struct kmod_file *kmod_file_open_uncached(const struct kmod_ctx *ctx,
+						const char *filename)
 {
-	if (file->memory)
+	return file_open(ctx, filename, true);
+}
+
+bool kmod_file_uses_cache(const struct kmod_file *file)
+{
+	return !file->uncached && file->ops != &reg_ops &&
+				kmod_get_decompress_cache(file->ctx) != NULL;
+}
+
+/*
+ * Whoever can write to the cache decides what is read from it: only our
+ * own directories and entries, that no one else can write to, are used.
+ */
+static bool file_cache_trusted(const struct stat *st)
+{
+	return st->st_uid == geteuid() &&
+				!(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+/*
+ * Name of the cache entry for a compressed module: anything that changes
+ * when the module is replaced or rewritten is part of it.
+ */
+static char *file_cache_path(const struct kmod_file *file)
+{
+	const char *dir = kmod_get_decompress_cache(file->ctx);
+	struct stat st;
+	char *path;
+
+	if (!kmod_file_uses_cache(file))
+		return NULL;
+
+	if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode) ||
+						!file_cache_trusted(&st)) {
+		DBG(file->ctx, "not using decompressed-module cache %s\n", dir);
+		return NULL;
+	}
+
+	if (fstat(file->fd, &st) < 0)
+		return NULL;
+
+	if (asprintf(&path, "%s/%llx-%llx-%llx-%llx.ko", dir,
+		     (unsigned long long) st.st_dev,
+		     (unsigned long long) st.st_ino,
+		     (unsigned long long) st.st_size,
+		     stat_mstamp(&st)) < 0)
+		return NULL;
+
+	return path;
+}
+
+static int file_cache_load(struct kmod_file *file, const char *path)
+{
+	struct stat st;
+	void *p;
+	int fd, err = 0;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	if (!S_ISREG(st.st_mode) || !file_cache_trusted(&st)) {
+		DBG(file->ctx, "not using cache entry %s\n", path);
+		err = -EPERM;
+		goto out;
+	}
+
+	if (st.st_size == 0) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err = -errno;
+		goto out;
+	}
+
+	file->memory = p;
+	file->size = st.st_size;
+	file->cached = true;
+
+out:
+	close(fd);
+	return err;
+}
+
+/*
+ * Entries are written to a temporary file that is then renamed over, so
+ * concurrent readers either see a complete entry or none at all.
+ */
+static void file_cache_store(struct kmod_file *file, const char *path)
+{
+	_cleanup_free_ char *tmp = NULL;
+	ssize_t r;
+	int fd;
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+		return;
+
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0) {
+		DBG(file->ctx, "could not create cache entry %s: %m\n", tmp);
 		return;
+	}
 
-	/*  The load functions already log possible errors. */
-	file->ops->load(file);
+	r = write_str_safe(fd, file->memory, file->size);
+	if (r != file->size || fchmod(fd, 0644) < 0) {
+		close(fd);
+		goto fail;
+	}
+
+	if (close(fd) < 0 || rename(tmp, path) < 0)
+		goto fail;
+
+	return;
+
+fail:
+	DBG(file->ctx, "could not write cache entry %s\n", path);
+	unlink(tmp);
+}
+
+/* decompress the whole image, to the heap or to the memfd */
+static int file_decompress(struct kmod_file *file)
+{
+	unsigned long long t0 = now_usec();
+	int err;
+
+	KMOD_PROBE2(decompress_entry, file->fd, file->compression);
+	err = file->ops->load(file);
+	KMOD_PROBE2(decompress_return, file->fd, err);
+	if (err == 0) {
+		kmod_stat_add(file->ctx, KMOD_STAT_DECOMPRESS_USEC,
+						now_usec() - t0);
+		kmod_stat_add(file->ctx, KMOD_STAT_BYTES_DECOMPRESSED,
+							file->size);
+	}
+
+	return err;
+}
+
+/*
+ * Load all of the contents, completing a seekable image if only some of
+ * its frames were read. The load functions already log possible errors.
+ */
+int kmod_file_load_contents(struct kmod_file *file)
+{
+	_cleanup_free_ char *cache = NULL;
+	int err = 0;
+
+	if (file->frames != NULL)
+		return file_frames_fill(file, 0, file->size);
+
+	if (file->memory)
+		return 0;
+
+	cache = file_cache_path(file);
+	if (cache != NULL && file_cache_load(file, cache) == 0)
+		return 0;
+
+	if (file->ops == &reg_ops)
+		err = file->ops->load(file);
+	else
+		err = file_decompress(file);
+
+	if (cache != NULL && file->memory != NULL)
+		file_cache_store(file, cache);
+
+	return err;
+}
+
+/*
+ * Allow the contents to be patched in place. A file that is mapped stays a
+ * private mapping: only the pages written to get copied, instead of the
+ * whole image. Decompressed contents are already a private buffer.
+ */
+int kmod_file_make_writable(struct kmod_file *file)
+{
+	if (kmod_file_load_contents(file) < 0 || file->memory == NULL)
+		return -EINVAL;
+
+	if ((file->ops == &reg_ops || file->cached) &&
+	    mprotect(file->memory, file->size, PROT_READ | PROT_WRITE) < 0)
+		return -errno;
+
+	return 0;
 }
 
 void *kmod_file_get_contents(const struct kmod_file *file)
@@ -527,14 +1256,116 @@ int kmod_file_get_fd(const struct kmod_file *file)
 	return file->fd;
 }
 
+/*
+ * finit_module() refuses a file that is open for writing (-ETXTBSY), so the
+ * memfd is sealed and only a read-only descriptor of it is kept. The
+ * contents get mapped again privately, not to leave a writable mapping of
+ * the memfd, which would also prevent the seal.
+ */
+static int file_memfd_seal(struct kmod_file *file, int memfd)
+{
+	char path[32];
+	int fd;
+
+	/* decompressed into it: swap the shared mapping for a private one */
+	if (file->memfd_size != 0) {
+		void *p = mmap(NULL, file->size, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE, memfd, 0);
+		if (p == MAP_FAILED)
+			return -errno;
+
+		munmap(file->memory, file->memfd_size);
+		file->memory = p;
+		file->memfd_size = file->size;
+	}
+
+	if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SEAL | F_SEAL_SHRINK |
+					F_SEAL_GROW | F_SEAL_WRITE) < 0)
+		return -errno;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", memfd);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	return fd;
+}
+
+/*
+ * Return a read-only file descriptor with the decompressed contents, for
+ * finit_module() to use when the kernel can't decompress the module itself.
+ * If nothing was loaded yet the contents are decompressed straight into a
+ * memfd, otherwise what is already in memory gets copied there.
+ */
+int kmod_file_get_memfd(struct kmod_file *file)
+{
+	ssize_t r;
+	int err, fd, memfd;
+
+	if (file->ops == &reg_ops)
+		return file->fd;
+
+	if (file->memfd >= 0)
+		return file->memfd;
+
+	memfd = memfd_create("kmod", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0)
+		return -errno;
+
+	if (file->memory == NULL) {
+		/* for file_buf_resize() to decompress into it */
+		file->memfd = memfd;
+		err = file_decompress(file);
+		file->memfd = -1;
+		if (err < 0)
+			goto error;
+	} else {
+		err = kmod_file_load_contents(file);
+		if (err < 0)
+			goto error;
+
+		r = write_str_safe(memfd, file->memory, file->size);
+		if (r < 0) {
+			err = r;
+			goto error;
+		}
+		if (r != file->size) {
+			err = -EIO;
+			goto error;
+		}
+	}
+
+	fd = file_memfd_seal(file, memfd);
+	if (fd < 0) {
+		err = fd;
+		goto error;
+	}
+
+	close(memfd);
+	file->memfd = fd;
+	return fd;
+
+error:
+	close(memfd);
+	return err;
+}
+
 void kmod_file_unref(struct kmod_file *file)
 {
 	if (file->elf)
 		kmod_elf_unref(file->elf);
 
-	if (file->memory)
+	if (file->frames != NULL) {
+		munmap(file->memory, file->size);
+		munmap((void *) file->frames->src, file->frames->src_size);
+		file_frames_free(file->frames);
+	} else if (file->cached)
+		munmap(file->memory, file->size);
+	else if (file->memory)
 		file->ops->unload(file);
 
+	if (file->memfd >= 0)
+		close(file->memfd);
 	if (file->fd >= 0)
 		close(file->fd);
 	free(file);
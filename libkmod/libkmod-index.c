@@ -22,9 +22,13 @@
 #include <errno.h>
 #include <fnmatch.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef ENABLE_ZLIB
+#include <zlib.h>
+#endif
 
 #include <shared/macro.h>
 #include <shared/strbuf.h>
@@ -46,9 +50,30 @@
  * case we ever decide to have minor changes that are not incompatible.
  */
 #define INDEX_MAGIC 0xB007F457
-#define INDEX_VERSION_MAJOR 0x0002
+#define INDEX_VERSION_MAJOR 0x0003
 #define INDEX_VERSION_MINOR 0x0001
 #define INDEX_VERSION ((INDEX_VERSION_MAJOR<<16)|INDEX_VERSION_MINOR)
+#define INDEX_VERSION_MAJOR_V2 0x0002
+
+/* Magic of the trailer of v3 indexes, minor 1 and later */
+#define INDEX_FILTER_MAGIC 0xB007F45A
+#define INDEX_FILTER_LITERAL 0x1
+
+/* Magic of the modules.bin bundle, followed by its own version */
+#define INDEX_BUNDLE_MAGIC 0xB007F458
+#define INDEX_BUNDLE_VERSION 0x00010000
+
+/* Magic of modules.dep.ids.bin, followed by its own version */
+#define INDEX_MODDEP_MAGIC 0xB007F459
+#define INDEX_MODDEP_VERSION 0x00010000
+
+/* Magic of modules.symbols.hash.bin, followed by its own version */
+#define INDEX_SYMHASH_MAGIC 0xB007F45C
+#define INDEX_SYMHASH_VERSION 0x00010000
+
+/* Magic of the compressed indexes, followed by their own version */
+#define INDEX_BLOCKS_MAGIC 0xB007F45D
+#define INDEX_BLOCKS_VERSION 0x00010000
 
 /* The index file maps keys to values. Both keys and values are ASCII strings.
  * Each key can have multiple values. Values are sorted by an integer priority.
@@ -58,11 +83,13 @@
  * This feature is required for module aliases.
  */
 #define INDEX_CHILDMAX 128
+/* longer than most keys and values: searches and reads then don't allocate */
+#define INDEX_STRBUF_STACK 256
 
-/* Disk format:
+/* Disk format, version 2:
  *
  *  uint32_t magic = INDEX_MAGIC;
- *  uint32_t version = INDEX_VERSION;
+ *  uint32_t version = 0x00020001;
  *  uint32_t root_offset;
  *
  *  (node_offset & INDEX_NODE_MASK) specifies the file offset of nodes:
@@ -82,8 +109,170 @@
  *  (node_offset & INDEX_NODE_FLAGS) indicates which fields are present.
  *  Empty prefixes are omitted, leaf nodes omit the three child-related fields.
  *
- *  This could be optimised further by adding a sparse child format
- *  (indicated using a new flag).
+ *
+ * Disk format, version 3:
+ *
+ *  uint32_t magic = INDEX_MAGIC;
+ *  uint32_t version = INDEX_VERSION;
+ *  uint32_t root_offset;
+ *  uint32_t matcher_offset; // 0 if there's no matcher section
+ *
+ *  Value pool, one entry per node with values, in trie pre-order:
+ *
+ *       uint32_t value_count;
+ *       struct {
+ *           uint32_t priority;
+ *           char[] value; // nul terminated
+ *       } values[value_count];
+ *
+ *  Nodes, at plain file offsets:
+ *
+ *       uint8_t flags; // enum node_flags
+ *
+ *       char[] prefix; // nul terminated
+ *
+ *       uint32_t values_offset; // file offset of the pool entry
+ *
+ *       dense:
+ *           char first;
+ *           char last;
+ *           uintN_t children[last - first + 1];
+ *       sparse:
+ *           uint8_t child_count;
+ *           char chars[child_count]; // sorted
+ *           uintN_t children[child_count];
+ *
+ *  The flags byte tells which fields are present and how the child table
+ *  is encoded. Each child reference is the distance back from the parent's
+ *  own offset to the child (children are written first), stored MSB first
+ *  in N = 1, 2 or 4 bytes. A zero reference in a dense table marks a hole.
+ *  The writer picks whichever table encoding is smaller for each node, so
+ *  nodes with few, scattered children are looked up by binary search.
+ *
+ *  Matcher section, written for the alias indexes:
+ *
+ *       uint32_t literals_size; // power of 2, or 0
+ *       uint32_t globs_size; // power of 2, or 0
+ *       uint32_t lengths_len;
+ *       uint32_t lengths[lengths_len]; // ascending
+ *       struct {
+ *           uint32_t hash;
+ *           uint32_t entry; // file offset, 0 for empty buckets
+ *       } literals[literals_size], globs[globs_size];
+ *
+ *       literal entry:
+ *           char[] key; // nul terminated
+ *           uint32_t values_offset;
+ *       glob entry:
+ *           char[] prefix; // nul terminated
+ *           uint32_t pattern_count;
+ *           struct {
+ *               uint32_t values_offset;
+ *               char[] pattern; // nul terminated, after the prefix
+ *           } patterns[pattern_count];
+ *
+ *  Keys without wildcards go into the literals table. The other keys are
+ *  split before their first wildcard and grouped by that literal prefix in
+ *  the globs table, whose distinct prefix lengths are listed in lengths[].
+ *  Both tables are open addressed with linear probing, hashed with
+ *  fnv1a_32(). A wildcard search then costs one probe per listed length
+ *  that fits in the key, plus fnmatch() on the patterns sharing a prefix
+ *  with it, instead of walking every trie branch below a wildcard.
+ *
+ *  Filter section, written for the other indexes:
+ *
+ *       uint32_t flags; // INDEX_FILTER_LITERAL if no key has a wildcard
+ *       uint32_t block_count; // power of 2
+ *       padding to a multiple of 64 bytes in the file
+ *       uint8_t blocks[block_count][KEY_FILTER_BLOCK_BITS / 8];
+ *
+ *  A blocked Bloom filter of the keys, see key_filter_block(): when a
+ *  key's bits are not all set, it's not in the index and the trie isn't
+ *  walked. Wildcard searches only use it if the keys are all literal.
+ *
+ *  Trailer, since minor version 1:
+ *
+ *       uint32_t filter_offset; // 0 if there's no filter section
+ *       uint32_t magic = INDEX_FILTER_MAGIC;
+ *
+ *  Readers of minor version 0 ignore both sections.
+ *
+ *
+ * Bundle format (modules.bin):
+ *
+ *  uint32_t magic = INDEX_BUNDLE_MAGIC;
+ *  uint32_t version = INDEX_BUNDLE_VERSION;
+ *  uint32_t section_count;
+ *  struct {
+ *      uint32_t type; // enum kmod_index
+ *      uint32_t offset;
+ *      uint32_t size;
+ *  } sections[section_count];
+ *
+ *  Each section is a verbatim copy of the corresponding modules.*.bin
+ *  file, so all the offsets inside it are relative to the section start.
+ *  This lets libkmod map every index with a single open() and mmap().
+ *
+ *
+ * Module dependencies by number (modules.dep.ids.bin):
+ *
+ *  uint32_t magic = INDEX_MODDEP_MAGIC;
+ *  uint32_t version = INDEX_MODDEP_VERSION;
+ *  uint32_t module_count;
+ *  struct {
+ *      uint32_t name;      // offset of the module name
+ *      uint32_t path;      // offset of its path, as in modules.dep
+ *      uint32_t deps;      // offset of uint32_t ids[dep_count]
+ *      uint32_t dep_count;
+ *  } modules[module_count];
+ *  uint32_t ids[];         // dependencies, as indexes in modules[]
+ *  char strings[];         // '\0'-terminated names and paths
+ *
+ *  modules[] is sorted by name, so a module is found with a binary search
+ *  and its dependencies with an array walk. Each path is stored once, no
+ *  matter how many modules depend on it.
+ *
+ *
+ * Symbols by hash (modules.symbols.hash.bin):
+ *
+ *  uint32_t magic = INDEX_SYMHASH_MAGIC;
+ *  uint32_t version = INDEX_SYMHASH_VERSION;
+ *  uint32_t table_size; // power of 2, or 0
+ *  uint32_t symbol_count;
+ *  struct {
+ *      uint32_t hash;  // fnv1a_32() of the symbol name
+ *      uint32_t entry; // file offset, 0 for empty buckets
+ *  } table[table_size];
+ *  struct {
+ *      char name[];    // nul terminated
+ *      uint32_t owner; // offset of the name of the module exporting it
+ *      uint32_t crc_high;
+ *      uint32_t crc_low;
+ *  } entries[symbol_count];
+ *  char owners[];      // '\0'-terminated module names, each once
+ *
+ *  The same symbols as modules.symbols.bin, without their "symbol:"
+ *  prefix, so a symbol is resolved with one probe of an open addressed
+ *  table as the literals of the matcher section, and comes with its CRC.
+ *
+ *
+ * Compressed index (depmod --compress-indexes):
+ *
+ *  uint32_t magic = INDEX_BLOCKS_MAGIC;
+ *  uint32_t version = INDEX_BLOCKS_VERSION;
+ *  uint32_t size;        // of the version 3 index once inflated
+ *  uint32_t block_size;  // power of 2
+ *  uint32_t dict_size;
+ *  uint32_t block_count;
+ *  uint32_t blocks[block_count + 1]; // file offsets, the last one is the end
+ *  uint8_t dict[dict_size];
+ *  uint8_t data[]; // the blocks, raw deflate streams
+ *
+ *  A version 3 index without a matcher section, cut in blocks of
+ *  block_size bytes that are deflated one by one with dict as their preset
+ *  dictionary. Readers inflate a block the first time a lookup reads it
+ *  and keep a few of them. No node and no value list is bigger than a
+ *  block, so each is inflated along with at most the block after it.
  *
  *
  * Implementation is based on a radix tree, or "trie".
@@ -148,6 +337,16 @@ enum node_offset {
 	INDEX_NODE_MASK     = 0x0FFFFFFF, /* Offset value */
 };
 
+/* Flags byte heading each node of a v3 index file */
+enum node_flags {
+	INDEX_NODE3_PREFIX      = 0x01,
+	INDEX_NODE3_VALUES      = 0x02,
+	INDEX_NODE3_CHILDS      = 0x04,
+	INDEX_NODE3_SPARSE      = 0x08,
+	INDEX_NODE3_WIDTH_MASK  = 0x30, /* log2 of child reference size */
+	INDEX_NODE3_WIDTH_SHIFT = 4,
+};
+
 void index_values_free(struct index_value *values)
 {
 	while (values) {
@@ -221,11 +420,31 @@ static unsigned buf_freadchars(struct strbuf *buf, FILE *in)
 	return i;
 }
 
+static uint32_t read_ref(FILE *in, unsigned int width)
+{
+	uint32_t ref = 0;
+
+	while (width--)
+		ref = (ref << 8) | read_char(in);
+	return ref;
+}
+
+#ifdef ENABLE_ZLIB
+static FILE *index_blocks_fopen(const char *filename);
+#endif
+
 /*
  * Index file searching
  */
+struct index_file {
+	FILE *file;
+	uint32_t root_offset;
+	unsigned int major;
+};
+
 struct index_node_f {
 	FILE *file;
+	unsigned int major;
 	char *prefix;		/* path compression */
 	struct index_value *values;
 	unsigned char first;	/* range of child nodes */
@@ -233,6 +452,41 @@ struct index_node_f {
 	uint32_t children[0];
 };
 
+static void index_read_values(struct index_node_f *node)
+{
+	FILE *in = node->file;
+	int value_count;
+	char stack[INDEX_STRBUF_STACK];
+	struct strbuf buf;
+	const char *value;
+	unsigned int priority;
+
+	value_count = read_long(in);
+
+	strbuf_init_with_stack(&buf, stack, sizeof(stack));
+	while (value_count--) {
+		priority = read_long(in);
+		buf_freadchars(&buf, in);
+		value = strbuf_str(&buf);
+		add_value(&node->values, value, buf.used, priority);
+		strbuf_clear(&buf);
+	}
+	strbuf_release(&buf);
+}
+
+static char *index_read_prefix(FILE *in, bool present)
+{
+	char stack[INDEX_STRBUF_STACK];
+	struct strbuf buf;
+
+	if (!present)
+		return NOFAIL(strdup(""));
+
+	strbuf_init_with_stack(&buf, stack, sizeof(stack));
+	buf_freadchars(&buf, in);
+	return strbuf_steal(&buf);
+}
+
 static struct index_node_f *index_read(FILE *in, uint32_t offset)
 {
 	struct index_node_f *node;
@@ -245,13 +499,7 @@ static struct index_node_f *index_read(FILE *in, uint32_t offset)
 	if (fseek(in, offset & INDEX_NODE_MASK, SEEK_SET) < 0)
 		return NULL;
 
-	if (offset & INDEX_NODE_PREFIX) {
-		struct strbuf buf;
-		strbuf_init(&buf);
-		buf_freadchars(&buf, in);
-		prefix = strbuf_steal(&buf);
-	} else
-		prefix = NOFAIL(strdup(""));
+	prefix = index_read_prefix(in, offset & INDEX_NODE_PREFIX);
 
 	if (offset & INDEX_NODE_CHILDS) {
 		char first = read_char(in);
@@ -272,28 +520,90 @@ static struct index_node_f *index_read(FILE *in, uint32_t offset)
 		node->last = 0;
 	}
 
+	node->prefix = prefix;
+	node->file = in;
+	node->major = INDEX_VERSION_MAJOR_V2;
 	node->values = NULL;
-	if (offset & INDEX_NODE_VALUES) {
-		int value_count;
-		struct strbuf buf;
-		const char *value;
-		unsigned int priority;
-
-		value_count = read_long(in);
-
-		strbuf_init(&buf);
-		while (value_count--) {
-			priority = read_long(in);
-			buf_freadchars(&buf, in);
-			value = strbuf_str(&buf);
-			add_value(&node->values, value, buf.used, priority);
-			strbuf_clear(&buf);
+	if (offset & INDEX_NODE_VALUES)
+		index_read_values(node);
+
+	return node;
+}
+
+/*
+ * v3 nodes are expanded into the same dense, absolute-offset child table as
+ * v2 ones: the stdio reader is only used without loaded resources, so it
+ * trades memory for sharing the search code below.
+ */
+static struct index_node_f *index_read_v3(FILE *in, uint32_t offset)
+{
+	struct index_node_f *node;
+	uint32_t values_offset = 0;
+	char *prefix;
+	uint8_t flags;
+	int i;
+
+	if (offset == 0)
+		return NULL;
+
+	if (fseek(in, offset, SEEK_SET) < 0)
+		return NULL;
+
+	flags = read_char(in);
+	prefix = index_read_prefix(in, flags & INDEX_NODE3_PREFIX);
+
+	if (flags & INDEX_NODE3_VALUES)
+		values_offset = read_long(in);
+
+	if (flags & INDEX_NODE3_CHILDS) {
+		unsigned int width = 1U << ((flags & INDEX_NODE3_WIDTH_MASK) >>
+						INDEX_NODE3_WIDTH_SHIFT);
+		unsigned char chars[INDEX_CHILDMAX];
+		int first, last, child_count;
+
+		if (flags & INDEX_NODE3_SPARSE) {
+			child_count = read_char(in);
+			if (child_count == 0 || child_count > INDEX_CHILDMAX) {
+				free(prefix);
+				return NULL;
+			}
+			for (i = 0; i < child_count; i++)
+				chars[i] = read_char(in);
+			first = chars[0];
+			last = chars[child_count - 1];
+		} else {
+			first = read_char(in);
+			last = read_char(in);
+			child_count = last - first + 1;
 		}
-		strbuf_release(&buf);
+
+		node = NOFAIL(calloc(1, sizeof(struct index_node_f) +
+				     sizeof(uint32_t) * (last - first + 1)));
+		node->first = first;
+		node->last = last;
+
+		for (i = 0; i < child_count; i++) {
+			uint32_t ref = read_ref(in, width);
+			int ch = flags & INDEX_NODE3_SPARSE ? chars[i] : first + i;
+
+			if (ref != 0)
+				node->children[ch - first] = offset - ref;
+		}
+	} else {
+		node = NOFAIL(malloc(sizeof(struct index_node_f)));
+		node->first = INDEX_CHILDMAX;
+		node->last = 0;
 	}
 
 	node->prefix = prefix;
 	node->file = in;
+	node->major = INDEX_VERSION_MAJOR;
+	node->values = NULL;
+	if (flags & INDEX_NODE3_VALUES) {
+		if (fseek(in, values_offset, SEEK_SET) == 0)
+			index_read_values(node);
+	}
+
 	return node;
 }
 
@@ -304,11 +614,6 @@ static void index_close(struct index_node_f *node)
 	free(node);
 }
 
-struct index_file {
-	FILE *file;
-	uint32_t root_offset;
-};
-
 struct index_file *index_file_open(const char *filename)
 {
 	FILE *file;
@@ -321,19 +626,30 @@ struct index_file *index_file_open(const char *filename)
 	errno = EINVAL;
 
 	magic = read_long(file);
+#ifdef ENABLE_ZLIB
+	if (magic == INDEX_BLOCKS_MAGIC) {
+		fclose(file);
+		file = index_blocks_fopen(filename);
+		if (file == NULL)
+			return NULL;
+		magic = read_long(file);
+	}
+#endif
 	if (magic != INDEX_MAGIC) {
 		fclose(file);
 		return NULL;
 	}
 
 	version = read_long(file);
-	if (version >> 16 != INDEX_VERSION_MAJOR) {
+	if (version >> 16 != INDEX_VERSION_MAJOR &&
+	    version >> 16 != INDEX_VERSION_MAJOR_V2) {
 		fclose(file);
 		return NULL;
 	}
 
 	new = NOFAIL(malloc(sizeof(struct index_file)));
 	new->file = file;
+	new->major = version >> 16;
 	new->root_offset = read_long(new->file);
 
 	errno = 0;
@@ -348,18 +664,25 @@ void index_file_close(struct index_file *idx)
 
 static struct index_node_f *index_readroot(struct index_file *in)
 {
-	return index_read(in->file, in->root_offset);
+	if (in->major == INDEX_VERSION_MAJOR_V2)
+		return index_read(in->file, in->root_offset);
+
+	return index_read_v3(in->file, in->root_offset);
 }
 
 static struct index_node_f *index_readchild(const struct index_node_f *parent,
 					    int ch)
 {
-	if (parent->first <= ch && ch <= parent->last) {
-		return index_read(parent->file,
-		                       parent->children[ch - parent->first]);
-	}
+	uint32_t offset;
 
-	return NULL;
+	if (ch < parent->first || ch > parent->last)
+		return NULL;
+
+	offset = parent->children[ch - parent->first];
+	if (parent->major == INDEX_VERSION_MAJOR_V2)
+		return index_read(parent->file, offset);
+
+	return index_read_v3(parent->file, offset);
 }
 
 static void index_dump_node(struct index_node_f *node, struct strbuf *buf,
@@ -395,13 +718,14 @@ static void index_dump_node(struct index_node_f *node, struct strbuf *buf,
 void index_dump(struct index_file *in, int fd, const char *prefix)
 {
 	struct index_node_f *root;
+	char stack[INDEX_STRBUF_STACK];
 	struct strbuf buf;
 
 	root = index_readroot(in);
 	if (root == NULL)
 		return;
 
-	strbuf_init(&buf);
+	strbuf_init_with_stack(&buf, stack, sizeof(stack));
 	strbuf_pushchars(&buf, prefix);
 	index_dump_node(root, &buf, fd);
 	strbuf_release(&buf);
@@ -590,10 +914,11 @@ static void index_searchwild__node(struct index_node_f *node,
 struct index_value *index_searchwild(struct index_file *in, const char *key)
 {
 	struct index_node_f *root = index_readroot(in);
+	char stack[INDEX_STRBUF_STACK];
 	struct strbuf buf;
 	struct index_value *out = NULL;
 
-	strbuf_init(&buf);
+	strbuf_init_with_stack(&buf, stack, sizeof(stack));
 	index_searchwild__node(root, &buf, key, 0, &out);
 	strbuf_release(&buf);
 	return out;
@@ -610,364 +935,1472 @@ struct index_value *index_searchwild(struct index_file *in, const char *key)
 
 static const char _idx_empty_str[] = "";
 
+struct index_mm_matcher {
+	const void *literals; /* mmap'ed buckets[literals_size] */
+	const void *globs; /* mmap'ed buckets[globs_size] */
+	const void *lengths; /* mmap'ed uint32_t[lengths_len] */
+	uint32_t literals_size;
+	uint32_t globs_size;
+	uint32_t lengths_len;
+};
+
 struct index_mm {
 	const struct kmod_ctx *ctx;
 	void *mm;
 	uint32_t root_offset;
+	unsigned int major;
+	bool has_matcher;
+	struct index_mm_matcher matcher;
+	const uint8_t *filter; /* blocks of the filter section, or NULL */
+	uint32_t filter_blocks;
+	bool filter_literal;
 	size_t size;
+	void *map; /* mm, or the compressed index inflated into mm */
+	struct index_blocks *blocks; /* NULL if not compressed */
+	struct index_bundle *bundle; /* owner of map, NULL if it's our own */
 };
 
-struct index_mm_value {
-	unsigned int priority;
-	unsigned int len;
-	const char *value;
-};
-
-struct index_mm_value_array {
-	struct index_mm_value *values;
-	unsigned int len;
-};
-
+/*
+ * Nodes are decoded in place: prefix, child table and values all point
+ * straight into the mapped file, so a struct index_mm_node can live on the
+ * caller's stack and no allocation is needed while walking the trie.
+ */
 struct index_mm_node {
 	struct index_mm *idx;
-	const char *prefix; /* mmape'd value */
-	struct index_mm_value_array values;
+	const char *prefix; /* mmap'ed value */
+	const void *children; /* mmap'ed child references, width bytes each */
+	const char *chars; /* mmap'ed sorted child chars, NULL if dense */
+	const void *values; /* mmap'ed, first value after value_count */
+	uint32_t offset; /* file offset, base of v3 child references */
+	unsigned int values_len;
+	unsigned char children_len;
+	unsigned char width;
 	unsigned char first;
 	unsigned char last;
-	uint32_t children[];
 };
 
-static inline uint32_t read_long_mm(void **p)
+static inline uint32_t read_long_mm(const void **p)
 {
-	uint8_t *addr = *(uint8_t **)p;
+	const uint8_t *addr = *(const uint8_t **)p;
 	uint32_t v;
 
 	/* addr may be unalined to uint32_t */
-	v = get_unaligned((uint32_t *) addr);
+	v = get_unaligned((const uint32_t *) addr);
 
 	*p = addr + sizeof(uint32_t);
 	return ntohl(v);
 }
 
-static inline uint8_t read_char_mm(void **p)
+static inline uint8_t read_char_mm(const void **p)
 {
-	uint8_t *addr = *(uint8_t **)p;
+	const uint8_t *addr = *(const uint8_t **)p;
 	uint8_t v = *addr;
 	*p = addr + sizeof(uint8_t);
 	return v;
 }
 
-static inline char *read_chars_mm(void **p, unsigned *rlen)
+static inline const char *read_chars_mm(const void **p, unsigned *rlen)
 {
-	char *addr = *(char **)p;
+	const char *addr = *(const char **)p;
 	size_t len = *rlen = strlen(addr);
 	*p = addr + len + 1;
 	return addr;
 }
 
-static struct index_mm_node *index_mm_read_node(struct index_mm *idx,
-							uint32_t offset) {
-	void *p = idx->mm;
-	struct index_mm_node *node;
-	const char *prefix;
-	int i, child_count, value_count, children_padding;
-	uint32_t children[INDEX_CHILDMAX];
-	char first, last;
-
-	if ((offset & INDEX_NODE_MASK) == 0)
-		return NULL;
-
-	p = (char *)p + (offset & INDEX_NODE_MASK);
-
-	if (offset & INDEX_NODE_PREFIX) {
-		unsigned len;
-		prefix = read_chars_mm(&p, &len);
-	} else
-		prefix = _idx_empty_str;
+static inline uint32_t read_ref_mm(const void *p, unsigned int width)
+{
+	const uint8_t *addr = p;
 
-	if (offset & INDEX_NODE_CHILDS) {
-		first = read_char_mm(&p);
-		last = read_char_mm(&p);
-		child_count = last - first + 1;
-		for (i = 0; i < child_count; i++)
-			children[i] = read_long_mm(&p);
-	} else {
-		first = INDEX_CHILDMAX;
-		last = 0;
-		child_count = 0;
+	switch (width) {
+	case 1:
+		return addr[0];
+	case 2:
+		return (addr[0] << 8) | addr[1];
 	}
 
-	children_padding = (sizeof(struct index_mm_node) +
-			    (sizeof(uint32_t) * child_count)) % sizeof(void *);
-
-	if (offset & INDEX_NODE_VALUES)
-		value_count = read_long_mm(&p);
-	else
-		value_count = 0;
-
-	node = malloc(sizeof(struct index_mm_node)
-		      + sizeof(uint32_t) * child_count + children_padding
-		      + sizeof(struct index_mm_value) * value_count);
-	if (node == NULL)
-		return NULL;
-
-	node->idx = idx;
-	node->prefix = prefix;
-	if (value_count == 0)
-		node->values.values = NULL;
-	else {
-		node->values.values = (struct index_mm_value *)
-			((char *)node + sizeof(struct index_mm_node) +
-			 sizeof(uint32_t) * child_count + children_padding);
-	}
-	node->values.len = value_count;
-	node->first = first;
-	node->last = last;
-	memcpy(node->children, children, sizeof(uint32_t) * child_count);
+	return ntohl(get_unaligned((const uint32_t *) addr));
+}
 
-	for (i = 0; i < value_count; i++) {
-		struct index_mm_value *v = node->values.values + i;
-		v->priority = read_long_mm(&p);
-		v->value = read_chars_mm(&p, &v->len);
-	}
+/*
+ * Compressed indexes are inflated into a window as big as the whole index,
+ * from an anonymous mapping: blocks only take memory once a lookup reads
+ * them, and nodes are decoded in place in the window as in a mapped file.
+ * Blocks are inflated and dropped in units of at least a page. Between
+ * lookups, no more than INDEX_BLOCKS_CACHE_SIZE bytes are kept, the
+ * least recently used are dropped first; during lookups, the units they
+ * read are kept until they are all over, as their nodes point into them.
+ */
+#define INDEX_BLOCKS_CACHE_SIZE (256 * 1024)
 
-	return node;
-}
+/* the size of a node or value list to index_mm_get(): at most a block */
+#define INDEX_MM_OBJECT SIZE_MAX
 
-static void index_mm_free_node(struct index_mm_node *node)
-{
-	free(node);
-}
+#ifdef ENABLE_ZLIB
+struct index_blocks {
+	const struct kmod_ctx *ctx;
+	pthread_mutex_t lock;
+	const uint8_t *file; /* mmap'ed compressed index */
+	size_t file_size;
+	const void *offsets; /* mmap'ed uint32_t[block_count + 1] */
+	const uint8_t *dict; /* mmap'ed */
+	uint32_t dict_size;
+	uint32_t block_size;
+	uint32_t block_count;
+	uint8_t *window; /* unit_count * unit_size bytes */
+	size_t size; /* of the inflated index */
+	size_t unit_size;
+	uint32_t unit_count;
+	uint32_t *used; /* epoch of each unit's last use, 0 if dropped */
+	uint32_t resident;
+	uint32_t max_resident;
+	uint32_t epoch; /* of the lookups running, incremented between */
+	unsigned int active;
+	z_stream zs;
+};
 
-int index_mm_open(const struct kmod_ctx *ctx, const char *filename,
-		  unsigned long long *stamp, struct index_mm **pidx)
+static int index_blocks_new(const struct kmod_ctx *ctx, const void *file,
+			    size_t file_size, struct index_blocks **pb)
 {
-	int fd, err;
-	struct stat st;
-	struct index_mm *idx;
-	struct {
-		uint32_t magic;
-		uint32_t version;
-		uint32_t root_offset;
-	} hdr;
-	void *p;
-
-	assert(pidx != NULL);
+	size_t page = sysconf(_SC_PAGESIZE);
+	struct index_blocks *b;
+	uint32_t magic, version;
+	const void *p = file;
+	int err;
 
-	DBG(ctx, "file=%s\n", filename);
+	if (file_size < 6 * sizeof(uint32_t))
+		return -EINVAL;
 
-	idx = malloc(sizeof(*idx));
-	if (idx == NULL) {
-		ERR(ctx, "malloc: %m\n");
+	b = calloc(1, sizeof(*b));
+	if (b == NULL)
 		return -ENOMEM;
-	}
-
-	if ((fd = open(filename, O_RDONLY|O_CLOEXEC)) < 0) {
-		DBG(ctx, "open(%s, O_RDONLY|O_CLOEXEC): %m\n", filename);
-		err = -errno;
-		goto fail_open;
-	}
 
-	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(hdr)) {
+	magic = read_long_mm(&p);
+	version = read_long_mm(&p);
+	b->size = read_long_mm(&p);
+	b->block_size = read_long_mm(&p);
+	b->dict_size = read_long_mm(&p);
+	b->block_count = read_long_mm(&p);
+	b->offsets = p;
+
+	if (magic != INDEX_BLOCKS_MAGIC ||
+	    version >> 16 != INDEX_BLOCKS_VERSION >> 16) {
+		ERR(ctx, "compressed index version check fail: %x %u\n",
+							magic, version >> 16);
 		err = -EINVAL;
-		goto fail_nommap;
-	}
-
-	idx->mm = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (idx->mm == MAP_FAILED) {
-		ERR(ctx, "mmap(NULL, %"PRIu64", PROT_READ, %d, MAP_PRIVATE, 0): %m\n",
-							st.st_size, fd);
-		err = -errno;
-		goto fail_nommap;
+		goto fail;
 	}
 
-	p = idx->mm;
-	hdr.magic = read_long_mm(&p);
-	hdr.version = read_long_mm(&p);
-	hdr.root_offset = read_long_mm(&p);
-
-	if (hdr.magic != INDEX_MAGIC) {
-		ERR(ctx, "magic check fail: %x instead of %x\n", hdr.magic,
-								INDEX_MAGIC);
+	if (b->block_size < 1024 || b->block_size > (1U << 24) ||
+	    (b->block_size & (b->block_size - 1)) != 0 ||
+	    b->size < 4 * sizeof(uint32_t) ||
+	    b->block_count != (b->size - 1) / b->block_size + 1 ||
+	    b->block_count > file_size / sizeof(uint32_t) ||
+	    sizeof(uint32_t) * (7 + (size_t) b->block_count) > file_size ||
+	    b->dict_size > file_size - sizeof(uint32_t) * (7 + b->block_count)) {
 		err = -EINVAL;
 		goto fail;
 	}
 
-	if (hdr.version >> 16 != INDEX_VERSION_MAJOR) {
-		ERR(ctx, "major version check fail: %u instead of %u\n",
-					hdr.version >> 16, INDEX_VERSION_MAJOR);
-		err = -EINVAL;
+	b->ctx = ctx;
+	b->file = file;
+	b->file_size = file_size;
+	b->dict = (const uint8_t *) b->offsets +
+				sizeof(uint32_t) * (b->block_count + 1);
+	b->unit_size = b->block_size > page ? b->block_size : page;
+	b->unit_count = (b->size - 1) / b->unit_size + 1;
+	b->max_resident = INDEX_BLOCKS_CACHE_SIZE / b->unit_size;
+	if (b->max_resident < 2)
+		b->max_resident = 2;
+	b->epoch = 1;
+
+	b->used = calloc(b->unit_count, sizeof(uint32_t));
+	if (b->used == NULL) {
+		err = -ENOMEM;
 		goto fail;
 	}
 
-	idx->root_offset = hdr.root_offset;
-	idx->size = st.st_size;
-	idx->ctx = ctx;
-	close(fd);
+	b->window = mmap(NULL, b->unit_count * b->unit_size,
+			 PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (b->window == MAP_FAILED) {
+		err = -errno;
+		goto fail_window;
+	}
 
-	*stamp = stat_mstamp(&st);
-	*pidx = idx;
+	if (inflateInit2(&b->zs, -MAX_WBITS) != Z_OK) {
+		err = -ENOMEM;
+		goto fail_inflate;
+	}
+
+	pthread_mutex_init(&b->lock, NULL);
+	*pb = b;
 
 	return 0;
 
+fail_inflate:
+	munmap(b->window, b->unit_count * b->unit_size);
+fail_window:
+	free(b->used);
 fail:
-	munmap(idx->mm, st.st_size);
-fail_nommap:
-	close(fd);
-fail_open:
-	free(idx);
+	free(b);
 	return err;
 }
 
-void index_mm_close(struct index_mm *idx)
+static void index_blocks_free(struct index_blocks *b)
 {
-	munmap(idx->mm, idx->size);
-	free(idx);
+	inflateEnd(&b->zs);
+	pthread_mutex_destroy(&b->lock);
+	munmap(b->window, b->unit_count * b->unit_size);
+	free(b->used);
+	free(b);
 }
 
-static struct index_mm_node *index_mm_readroot(struct index_mm *idx)
+static bool index_blocks_inflate(struct index_blocks *b, uint32_t unit)
 {
-	return index_mm_read_node(idx, idx->root_offset);
-}
+	uint32_t i = unit * (b->unit_size / b->block_size);
+	size_t start = (size_t) unit * b->unit_size;
+
+	for (; i < b->block_count && (size_t) i * b->block_size <
+					start + b->unit_size; i++) {
+		const void *p = (const uint32_t *) b->offsets + i;
+		uint32_t begin = read_long_mm(&p);
+		uint32_t end = read_long_mm(&p);
+		size_t len = b->size - (size_t) i * b->block_size;
+
+		if (begin > end || end > b->file_size)
+			return false;
+
+		inflateReset(&b->zs);
+		if (b->dict_size > 0)
+			inflateSetDictionary(&b->zs, b->dict, b->dict_size);
+
+		b->zs.next_in = (uint8_t *) b->file + begin;
+		b->zs.avail_in = end - begin;
+		b->zs.next_out = b->window + (size_t) i * b->block_size;
+		b->zs.avail_out = len < b->block_size ? len : b->block_size;
+		if (inflate(&b->zs, Z_FINISH) != Z_STREAM_END ||
+						b->zs.avail_out != 0) {
+			ERR(b->ctx, "corrupt block %u of compressed index\n", i);
+			return false;
+		}
 
-static struct index_mm_node *index_mm_readchild(const struct index_mm_node *parent,
-									int ch)
-{
-	if (parent->first <= ch && ch <= parent->last) {
-		return index_mm_read_node(parent->idx,
-					parent->children[ch - parent->first]);
+		kmod_stat_add(b->ctx, KMOD_STAT_BYTES_DECOMPRESSED,
+				len < b->block_size ? len : b->block_size);
 	}
 
-	return NULL;
+	return true;
 }
 
-static void index_mm_dump_node(struct index_mm_node *node, struct strbuf *buf,
-								int fd)
+/*
+ * Drop the least recently used unit not used by a running lookup, nor in
+ * units @first to @last. Returns false if there's none. Called with the
+ * lock held.
+ */
+static bool index_blocks_evict(struct index_blocks *b, uint32_t first,
+							uint32_t last)
 {
-	struct index_mm_value *itr, *itr_end;
-	int ch, pushed;
-
-	pushed = strbuf_pushchars(buf, node->prefix);
+	uint32_t u, victim = UINT32_MAX, oldest = UINT32_MAX;
 
-	itr = node->values.values;
-	itr_end = itr + node->values.len;
-	for (; itr < itr_end; itr++) {
-		write_str_safe(fd, buf->bytes, buf->used);
-		write_str_safe(fd, " ", 1);
-		write_str_safe(fd, itr->value, itr->len);
-		write_str_safe(fd, "\n", 1);
+	for (u = 0; u < b->unit_count; u++) {
+		if (b->used[u] == 0 || (u >= first && u <= last))
+			continue;
+		if (b->active > 0 && b->used[u] == b->epoch)
+			continue;
+		if (b->used[u] < oldest) {
+			oldest = b->used[u];
+			victim = u;
+		}
 	}
 
-	for (ch = node->first; ch <= node->last; ch++) {
-		struct index_mm_node *child = index_mm_readchild(node, ch);
-
-		if (child == NULL)
-			continue;
+	if (victim == UINT32_MAX)
+		return false;
 
-		strbuf_pushchar(buf, ch);
-		index_mm_dump_node(child, buf, fd);
-		strbuf_popchar(buf);
-	}
+	madvise(b->window + (size_t) victim * b->unit_size, b->unit_size,
+							MADV_DONTNEED);
+	b->used[victim] = 0;
+	b->resident--;
 
-	strbuf_popchars(buf, pushed);
-	index_mm_free_node(node);
+	return true;
 }
 
-void index_mm_dump(struct index_mm *idx, int fd, const char *prefix)
+/*
+ * Inflated bytes @offset to @offset + @len of the index, NULL if they are
+ * out of it or can't be inflated.
+ */
+static const void *index_blocks_get(struct index_blocks *b, size_t offset,
+								size_t len)
 {
-	struct index_mm_node *root;
-	struct strbuf buf;
+	uint32_t u, first, last;
+	const void *p = b->window + offset;
 
-	root = index_mm_readroot(idx);
-	if (root == NULL)
-		return;
+	if (offset >= b->size)
+		return NULL;
+	if (len > b->block_size)
+		len = b->block_size;
+	if (len > b->size - offset)
+		len = b->size - offset;
+
+	first = offset / b->unit_size;
+	last = (offset + len - 1) / b->unit_size;
+
+	pthread_mutex_lock(&b->lock);
+
+	for (u = first; u <= last; u++) {
+		if (b->used[u] == 0) {
+			while (b->resident >= b->max_resident &&
+					index_blocks_evict(b, first, last))
+				;
+
+			if (!index_blocks_inflate(b, u)) {
+				madvise(b->window + (size_t) u * b->unit_size,
+						b->unit_size, MADV_DONTNEED);
+				p = NULL;
+				break;
+			}
+			b->resident++;
+		}
+		b->used[u] = b->epoch;
+	}
+
+	pthread_mutex_unlock(&b->lock);
+
+	return p;
+}
+
+/* Bracket a lookup, whose units can't be dropped until it's done */
+static void index_blocks_enter(struct index_blocks *b)
+{
+	pthread_mutex_lock(&b->lock);
+
+	if (b->active++ == 0 && ++b->epoch == 0) {
+		uint32_t u;
+
+		for (u = 0; u < b->unit_count; u++) {
+			if (b->used[u] != 0)
+				b->used[u] = 1;
+		}
+		b->epoch = 2;
+	}
+
+	pthread_mutex_unlock(&b->lock);
+}
+
+static void index_blocks_leave(struct index_blocks *b)
+{
+	pthread_mutex_lock(&b->lock);
+
+	if (--b->active == 0) {
+		while (b->resident > b->max_resident &&
+				index_blocks_evict(b, UINT32_MAX, 0))
+			;
+	}
+
+	pthread_mutex_unlock(&b->lock);
+}
+#endif
+
+/* Bytes @offset to @offset + @len of @idx, or NULL */
+static inline const void *index_mm_get(const struct index_mm *idx,
+						size_t offset, size_t len)
+{
+#ifdef ENABLE_ZLIB
+	if (idx->blocks != NULL)
+		return index_blocks_get(idx->blocks, offset, len);
+#endif
+	return (const char *) idx->mm + offset;
+}
+
+static inline void index_mm_enter(const struct index_mm *idx)
+{
+#ifdef ENABLE_ZLIB
+	if (idx->blocks != NULL)
+		index_blocks_enter(idx->blocks);
+#endif
+}
+
+static inline void index_mm_leave(const struct index_mm *idx)
+{
+#ifdef ENABLE_ZLIB
+	if (idx->blocks != NULL)
+		index_blocks_leave(idx->blocks);
+#endif
+}
+
+static bool index_mm_read_node_v2(struct index_mm *idx, uint32_t offset,
+						struct index_mm_node *node)
+{
+	const void *p = idx->mm;
+
+	if ((offset & INDEX_NODE_MASK) == 0)
+		return false;
+
+	p = (const char *)p + (offset & INDEX_NODE_MASK);
+
+	if (offset & INDEX_NODE_PREFIX) {
+		unsigned len;
+		node->prefix = read_chars_mm(&p, &len);
+	} else
+		node->prefix = _idx_empty_str;
+
+	node->chars = NULL;
+	node->width = sizeof(uint32_t);
+	if (offset & INDEX_NODE_CHILDS) {
+		node->first = read_char_mm(&p);
+		node->last = read_char_mm(&p);
+		node->children_len = node->last - node->first + 1;
+		node->children = p;
+		p = (const char *)p + sizeof(uint32_t) * node->children_len;
+	} else {
+		node->first = INDEX_CHILDMAX;
+		node->last = 0;
+		node->children_len = 0;
+		node->children = NULL;
+	}
+
+	if (offset & INDEX_NODE_VALUES)
+		node->values_len = read_long_mm(&p);
+	else
+		node->values_len = 0;
+
+	node->values = p;
+	node->offset = offset & INDEX_NODE_MASK;
+	node->idx = idx;
+
+	return true;
+}
+
+static bool index_mm_read_node_v3(struct index_mm *idx, uint32_t offset,
+						struct index_mm_node *node)
+{
+	const void *p;
+	uint8_t flags;
+
+	if (offset == 0)
+		return false;
+
+	p = index_mm_get(idx, offset, INDEX_MM_OBJECT);
+	if (p == NULL)
+		return false;
+	flags = read_char_mm(&p);
+
+	if (flags & INDEX_NODE3_PREFIX) {
+		unsigned len;
+		node->prefix = read_chars_mm(&p, &len);
+	} else
+		node->prefix = _idx_empty_str;
+
+	if (flags & INDEX_NODE3_VALUES) {
+		const void *v = index_mm_get(idx, read_long_mm(&p),
+							INDEX_MM_OBJECT);
+
+		if (v == NULL)
+			return false;
+		node->values_len = read_long_mm(&v);
+		node->values = v;
+	} else {
+		node->values_len = 0;
+		node->values = NULL;
+	}
+
+	if (flags & INDEX_NODE3_CHILDS) {
+		node->width = 1U << ((flags & INDEX_NODE3_WIDTH_MASK) >>
+						INDEX_NODE3_WIDTH_SHIFT);
+		if (flags & INDEX_NODE3_SPARSE) {
+			node->children_len = read_char_mm(&p);
+			node->chars = p;
+			node->first = node->chars[0];
+			node->last = node->chars[node->children_len - 1];
+			p = node->chars + node->children_len;
+		} else {
+			node->chars = NULL;
+			node->first = read_char_mm(&p);
+			node->last = read_char_mm(&p);
+			node->children_len = node->last - node->first + 1;
+		}
+		node->children = p;
+	} else {
+		node->first = INDEX_CHILDMAX;
+		node->last = 0;
+		node->children_len = 0;
+		node->width = 0;
+		node->children = NULL;
+		node->chars = NULL;
+	}
+
+	node->offset = offset;
+	node->idx = idx;
+
+	return true;
+}
+
+static inline bool index_mm_read_node(struct index_mm *idx, uint32_t offset,
+						struct index_mm_node *node)
+{
+	if (idx->major == INDEX_VERSION_MAJOR_V2)
+		return index_mm_read_node_v2(idx, offset, node);
+
+	return index_mm_read_node_v3(idx, offset, node);
+}
+
+/*
+ * Iterate over the values of @node. @p must point to node->values before the
+ * first call and is advanced past the value read.
+ */
+static inline const char *index_mm_node_next_value(const void **p,
+						   unsigned int *priority,
+						   unsigned int *len)
+{
+	*priority = read_long_mm(p);
+	return read_chars_mm(p, len);
+}
+
+static void index_mm_read_matcher(struct index_mm *idx, uint32_t offset)
+{
+	struct index_mm_matcher *m = &idx->matcher;
+	const void *p = (const char *)idx->mm + offset;
+
+	m->literals_size = read_long_mm(&p);
+	m->globs_size = read_long_mm(&p);
+	m->lengths_len = read_long_mm(&p);
+	m->lengths = p;
+	m->literals = (const uint32_t *)m->lengths + m->lengths_len;
+	m->globs = (const uint32_t *)m->literals + 2 * m->literals_size;
+
+	idx->has_matcher = true;
+}
+
+/*
+ * Look up the entry for @key[0..@keylen) in one of the matcher hash tables.
+ * Returns a pointer past the entry's key, or NULL if not found.
+ */
+static const void *index_mm_matcher_find(const struct index_mm *idx,
+					 const void *table, uint32_t size,
+					 uint32_t hash, const char *key,
+					 size_t keylen)
+{
+	uint32_t i, n;
+
+	for (i = hash & (size - 1), n = 0; n < size; i = (i + 1) & (size - 1), n++) {
+		const void *p = (const uint32_t *)table + 2 * i;
+		uint32_t h = read_long_mm(&p);
+		uint32_t entry = read_long_mm(&p);
+		const char *s;
+
+		if (entry == 0)
+			break;
+		if (h != hash)
+			continue;
+
+		s = (const char *)idx->mm + entry;
+		if (strncmp(s, key, keylen) == 0 && s[keylen] == '\0')
+			return s + keylen + 1;
+	}
+
+	return NULL;
+}
+
+static void index_mm_read_filter(struct index_mm *idx, uint32_t offset)
+{
+	const size_t block_size = KEY_FILTER_BLOCK_BITS / 8;
+	const void *p;
+	uint32_t flags, count;
+	size_t start;
+
+	/* the filter comes before the trailer */
+	if (offset > idx->size - 4 * sizeof(uint32_t))
+		return;
+
+	p = index_mm_get(idx, offset, 2 * sizeof(uint32_t));
+	if (p == NULL)
+		return;
+
+	flags = read_long_mm(&p);
+	count = read_long_mm(&p);
+	start = (offset + 2 * sizeof(uint32_t) + block_size - 1) /
+						block_size * block_size;
+	if (count == 0 || (count & (count - 1)) != 0 ||
+	    start > idx->size - 2 * sizeof(uint32_t) ||
+	    count > (idx->size - 2 * sizeof(uint32_t) - start) / block_size)
+		return;
+
+	idx->filter = (const uint8_t *)idx->mm + start;
+	idx->filter_blocks = count;
+	idx->filter_literal = flags & INDEX_FILTER_LITERAL;
+}
+
+/* true if @key is certainly not in @idx */
+static bool index_mm_filter_rejects(const struct index_mm *idx,
+							const char *key)
+{
+	const size_t block_size = KEY_FILTER_BLOCK_BITS / 8;
+	const uint8_t *b;
+	uint64_t h, bits;
+	unsigned int k;
+
+	if (idx->filter == NULL)
+		return false;
+
+	h = key_filter_hash(key, strlen(key));
+
+	b = index_mm_get(idx, idx->filter - (const uint8_t *) idx->mm +
+			 block_size * key_filter_block(h, idx->filter_blocks),
+			 block_size);
+	if (b == NULL)
+		return false;
+
+	bits = key_filter_bits(h);
+	for (k = 0; k < KEY_FILTER_PROBES; k++, bits >>= 9) {
+		unsigned int bit = bits % KEY_FILTER_BLOCK_BITS;
+
+		if (!(b[bit / 8] & (1 << (bit % 8))))
+			return true;
+	}
+
+	return false;
+}
+
+static int index_mm_init_trie(const struct kmod_ctx *ctx, struct index_mm *idx)
+{
+	size_t size = idx->size;
+	struct {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t root_offset;
+	} hdr;
+	const void *p;
+
+	if (size < sizeof(hdr))
+		return -EINVAL;
+
+	p = index_mm_get(idx, 0, 4 * sizeof(uint32_t));
+	if (p == NULL)
+		return -EINVAL;
+
+	hdr.magic = read_long_mm(&p);
+	hdr.version = read_long_mm(&p);
+	hdr.root_offset = read_long_mm(&p);
+
+	if (hdr.magic != INDEX_MAGIC) {
+		ERR(ctx, "magic check fail: %x instead of %x\n", hdr.magic,
+								INDEX_MAGIC);
+		return -EINVAL;
+	}
+
+	if (hdr.version >> 16 != INDEX_VERSION_MAJOR &&
+	    hdr.version >> 16 != INDEX_VERSION_MAJOR_V2) {
+		ERR(ctx, "major version check fail: %u instead of %u\n",
+					hdr.version >> 16, INDEX_VERSION_MAJOR);
+		return -EINVAL;
+	}
+
+	/* nodes are only read a block at a time in version 3 */
+	if (idx->blocks != NULL && hdr.version >> 16 != INDEX_VERSION_MAJOR)
+		return -EINVAL;
+
+	idx->root_offset = hdr.root_offset;
+	idx->major = hdr.version >> 16;
+	if (idx->major == INDEX_VERSION_MAJOR) {
+		uint32_t matcher_offset;
+
+		if (size < sizeof(hdr) + sizeof(uint32_t))
+			return -EINVAL;
+
+		/* its groups of patterns can span any number of blocks */
+		matcher_offset = read_long_mm(&p);
+		if (matcher_offset != 0 && idx->blocks == NULL)
+			index_mm_read_matcher(idx, matcher_offset);
+
+		if ((hdr.version & 0xffff) >= 1 &&
+		    size >= sizeof(hdr) + 3 * sizeof(uint32_t)) {
+			uint32_t filter_offset;
+
+			p = index_mm_get(idx, size - 2 * sizeof(uint32_t),
+							2 * sizeof(uint32_t));
+			if (p == NULL)
+				return -EINVAL;
+
+			filter_offset = read_long_mm(&p);
+			if (read_long_mm(&p) == INDEX_FILTER_MAGIC &&
+							filter_offset != 0)
+				index_mm_read_filter(idx, filter_offset);
+		}
+	}
+
+	return 0;
+}
+
+static int index_mm_init(const struct kmod_ctx *ctx, struct index_mm *idx,
+							void *mm, size_t size)
+{
+	const void *p = mm;
+	int err;
+
+	idx->ctx = ctx;
+	idx->mm = mm;
+	idx->size = size;
+	idx->map = mm;
+	idx->blocks = NULL;
+	idx->bundle = NULL;
+	idx->has_matcher = false;
+	idx->filter = NULL;
+	idx->filter_literal = false;
+
+	if (size < sizeof(uint32_t) || read_long_mm(&p) != INDEX_BLOCKS_MAGIC)
+		return index_mm_init_trie(ctx, idx);
+
+#ifdef ENABLE_ZLIB
+	err = index_blocks_new(ctx, mm, size, &idx->blocks);
+	if (err < 0)
+		return err;
+
+	idx->mm = idx->blocks->window;
+	idx->size = idx->blocks->size;
+
+	err = index_mm_init_trie(ctx, idx);
+	if (err < 0)
+		index_blocks_free(idx->blocks);
+#else
+	ERR(ctx, "compressed index, but zlib support is disabled\n");
+	err = -ENOTSUP;
+#endif
+
+	return err;
+}
+
+/*
+ * Index files are mapped once per process: the contexts opening the same
+ * file, as long as it wasn't replaced or changed in between, get the same
+ * read-only mapping and only their struct index_mm is their own. Each
+ * context still checks the stamp of what it opened, so it can find its
+ * indexes stale while another one keeps using them.
+ */
+struct index_map {
+	struct index_map *next;
+	void *mm;
+	size_t size;
+	dev_t dev;
+	ino_t ino;
+	unsigned long long stamp;
+	unsigned int refcount;
+};
+
+static pthread_mutex_t index_maps_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct index_map *index_maps;
+
+static struct index_map *index_map_find(const struct stat *st)
+{
+	struct index_map *m;
+
+	for (m = index_maps; m != NULL; m = m->next) {
+		if (m->dev == st->st_dev && m->ino == st->st_ino &&
+		    m->stamp == stat_mstamp(st) &&
+		    m->size == (size_t) st->st_size)
+			return m;
+	}
+
+	return NULL;
+}
+
+static void *index_mm_map(const struct kmod_ctx *ctx, const char *filename,
+				size_t min_size, size_t *size,
+				unsigned long long *stamp, int *err)
+{
+	struct index_map *m;
+	struct stat st;
+	void *mm = NULL;
+	int fd;
+
+	DBG(ctx, "file=%s\n", filename);
+
+	if ((fd = open(filename, O_RDONLY|O_CLOEXEC)) < 0) {
+		DBG(ctx, "open(%s, O_RDONLY|O_CLOEXEC): %m\n", filename);
+		*err = -errno;
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < min_size) {
+		*err = -EINVAL;
+		close(fd);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&index_maps_lock);
+
+	m = index_map_find(&st);
+	if (m != NULL) {
+		DBG(ctx, "%s already mapped\n", filename);
+		m->refcount++;
+		mm = m->mm;
+		goto done;
+	}
+
+	m = malloc(sizeof(*m));
+	if (m == NULL) {
+		*err = -ENOMEM;
+		goto done;
+	}
+
+	m->mm = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m->mm == MAP_FAILED) {
+		ERR(ctx, "mmap(NULL, %"PRIu64", PROT_READ, %d, MAP_PRIVATE, 0): %m\n",
+							st.st_size, fd);
+		*err = -errno;
+		free(m);
+		goto done;
+	}
+
+	m->size = st.st_size;
+	m->dev = st.st_dev;
+	m->ino = st.st_ino;
+	m->stamp = stat_mstamp(&st);
+	m->refcount = 1;
+	m->next = index_maps;
+	index_maps = m;
+	mm = m->mm;
+
+	kmod_stat_add(ctx, KMOD_STAT_BYTES_MAPPED, st.st_size);
+
+done:
+	pthread_mutex_unlock(&index_maps_lock);
+	close(fd);
+
+	if (mm != NULL) {
+		*size = st.st_size;
+		*stamp = stat_mstamp(&st);
+	}
+
+	return mm;
+}
+
+/* drop a reference to a mapping of index_mm_map() */
+static void index_mm_unmap(void *mm)
+{
+	struct index_map **pm, *m = NULL;
+
+	pthread_mutex_lock(&index_maps_lock);
+
+	for (pm = &index_maps; *pm != NULL; pm = &(*pm)->next) {
+		if ((*pm)->mm != mm)
+			continue;
+
+		m = *pm;
+		if (--m->refcount == 0)
+			*pm = m->next;
+		else
+			m = NULL;
+		break;
+	}
+
+	pthread_mutex_unlock(&index_maps_lock);
+
+	if (m != NULL) {
+		munmap(m->mm, m->size);
+		free(m);
+	}
+}
+
+#ifdef ENABLE_ZLIB
+/*
+ * Without loaded resources, compressed indexes are read by the stdio
+ * reader as any other, from a FILE inflating the blocks it reads.
+ */
+struct index_blocks_file {
+	struct index_blocks *blocks;
+	void *map;
+	size_t pos;
+};
+
+static ssize_t index_blocks_file_read(void *cookie, char *buf, size_t len)
+{
+	struct index_blocks_file *f = cookie;
+	struct index_blocks *b = f->blocks;
+	size_t done = 0;
+
+	while (done < len && f->pos < b->size) {
+		size_t n = b->block_size - f->pos % b->block_size;
+		const void *p;
+
+		if (n > len - done)
+			n = len - done;
+		if (n > b->size - f->pos)
+			n = b->size - f->pos;
+
+		p = index_blocks_get(b, f->pos, n);
+		if (p == NULL) {
+			errno = EIO;
+			return -1;
+		}
+
+		memcpy(buf + done, p, n);
+		done += n;
+		f->pos += n;
+	}
+
+	return done;
+}
+
+static int index_blocks_file_seek(void *cookie, off64_t *offset, int whence)
+{
+	struct index_blocks_file *f = cookie;
+	off64_t pos;
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = *offset;
+		break;
+	case SEEK_CUR:
+		pos = f->pos + *offset;
+		break;
+	case SEEK_END:
+		pos = f->blocks->size + *offset;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (pos < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	f->pos = pos;
+	*offset = pos;
+
+	return 0;
+}
+
+static int index_blocks_file_close(void *cookie)
+{
+	struct index_blocks_file *f = cookie;
+
+	index_blocks_free(f->blocks);
+	index_mm_unmap(f->map);
+	free(f);
+
+	return 0;
+}
+
+static FILE *index_blocks_fopen(const char *filename)
+{
+	static const cookie_io_functions_t io = {
+		.read = index_blocks_file_read,
+		.seek = index_blocks_file_seek,
+		.close = index_blocks_file_close,
+	};
+	struct index_blocks_file *f;
+	unsigned long long stamp;
+	size_t size;
+	FILE *file;
+	int err;
+
+	f = malloc(sizeof(*f));
+	if (f == NULL)
+		return NULL;
+
+	f->pos = 0;
+	f->map = index_mm_map(NULL, filename, 6 * sizeof(uint32_t), &size,
+								&stamp, &err);
+	if (f->map == NULL)
+		goto fail;
+
+	if (index_blocks_new(NULL, f->map, size, &f->blocks) < 0)
+		goto fail_blocks;
+
+	file = fopencookie(f, "r", io);
+	if (file == NULL)
+		goto fail_file;
+
+	return file;
+
+fail_file:
+	index_blocks_free(f->blocks);
+fail_blocks:
+	index_mm_unmap(f->map);
+fail:
+	free(f);
+	return NULL;
+}
+#endif
+
+int index_mm_open(const struct kmod_ctx *ctx, const char *filename,
+		  unsigned long long *stamp, struct index_mm **pidx)
+{
+	int err;
+	struct index_mm *idx;
+	size_t size;
+	void *mm;
+
+	assert(pidx != NULL);
+
+	idx = malloc(sizeof(*idx));
+	if (idx == NULL) {
+		ERR(ctx, "malloc: %m\n");
+		return -ENOMEM;
+	}
+
+	mm = index_mm_map(ctx, filename, 3 * sizeof(uint32_t), &size, stamp,
+									&err);
+	if (mm == NULL) {
+		free(idx);
+		return err;
+	}
+
+	err = index_mm_init(ctx, idx, mm, size);
+	if (err < 0) {
+		index_mm_unmap(mm);
+		free(idx);
+		return err;
+	}
+
+	*pidx = idx;
+
+	return 0;
+}
+
+void index_mm_close(struct index_mm *idx)
+{
+#ifdef ENABLE_ZLIB
+	if (idx->blocks != NULL)
+		index_blocks_free(idx->blocks);
+#endif
+	if (idx->bundle == NULL)
+		index_mm_unmap(idx->map);
+	free(idx);
+}
+
+/*
+ * depmod writes the nodes every lookup goes through right before the
+ * root, which is the last node of the trie: this much before it is read
+ * in with KMOD_INDEX_PRELOAD_HOT, and a page after for the root itself.
+ */
+#define INDEX_MM_HOT_SIZE (16 * 1024)
+
+static int index_mm_advise(struct index_mm *idx, size_t offset, size_t len,
+								int advice)
+{
+	uintptr_t start, end, page = sysconf(_SC_PAGESIZE);
+
+	if (offset >= idx->size)
+		return 0;
+	if (len > idx->size - offset)
+		len = idx->size - offset;
+
+	/* the mapping of a bundle section is not page aligned, but the
+	 * bundle it's in is */
+	start = ((uintptr_t) idx->mm + offset) & ~(page - 1);
+	end = (uintptr_t) idx->mm + offset + len;
+
+	if (madvise((void *) start, end - start, advice) < 0) {
+		DBG(idx->ctx, "madvise(%zu, %zu, %d): %m\n", offset, len,
+								advice);
+		return -errno;
+	}
+
+	return 0;
+}
+
+#ifdef ENABLE_ZLIB
+/*
+ * Inflating it all would defeat the compression: the whole compressed
+ * file is only read in, and the hot nodes are inflated.
+ */
+static void index_blocks_preload(struct index_blocks *b,
+				 enum kmod_index_preload preload,
+				 uint32_t root_offset)
+{
+	uintptr_t start, page = sysconf(_SC_PAGESIZE);
+	size_t hot;
+
+	switch (preload) {
+	case KMOD_INDEX_PRELOAD_ALL:
+		start = (uintptr_t) b->file & ~(page - 1);
+		if (madvise((void *) start, (uintptr_t) b->file +
+				b->file_size - start, MADV_WILLNEED) < 0)
+			DBG(b->ctx, "madvise(%zu, MADV_WILLNEED): %m\n",
+								b->file_size);
+		break;
+	case KMOD_INDEX_PRELOAD_HOT:
+		hot = root_offset < INDEX_MM_HOT_SIZE ? root_offset :
+							INDEX_MM_HOT_SIZE;
+		index_blocks_enter(b);
+		index_blocks_get(b, root_offset - hot, hot);
+		index_blocks_get(b, root_offset, INDEX_MM_OBJECT);
+		index_blocks_leave(b);
+		break;
+	default:
+		break;
+	}
+}
+#endif
+
+/*
+ * Read in the parts of @idx that @preload asks for now, rather than on the
+ * page fault of the first lookup that needs them.
+ */
+void index_mm_preload(struct index_mm *idx, enum kmod_index_preload preload)
+{
+	size_t hot;
+
+#ifdef ENABLE_ZLIB
+	if (idx->blocks != NULL) {
+		index_blocks_preload(idx->blocks, preload, idx->root_offset);
+		return;
+	}
+#endif
+
+	switch (preload) {
+	case KMOD_INDEX_PRELOAD_ALL:
+#ifdef MADV_POPULATE_READ
+		/* what MAP_POPULATE does, but also for a bundle section;
+		 * kernels older than 5.14 only get the readahead */
+		if (index_mm_advise(idx, 0, idx->size, MADV_POPULATE_READ) == 0)
+			break;
+#endif
+		index_mm_advise(idx, 0, idx->size, MADV_WILLNEED);
+		break;
+	case KMOD_INDEX_PRELOAD_HOT:
+		hot = idx->root_offset < INDEX_MM_HOT_SIZE ? idx->root_offset :
+							INDEX_MM_HOT_SIZE;
+		index_mm_advise(idx, 0, sizeof(uint32_t) * 4, MADV_WILLNEED);
+		index_mm_advise(idx, idx->root_offset - hot,
+				hot + sysconf(_SC_PAGESIZE), MADV_WILLNEED);
+		if (idx->has_matcher) {
+			const struct index_mm_matcher *m = &idx->matcher;
+			const char *end = (const char *)
+				((const uint32_t *) m->globs + 2 * m->globs_size);
+			size_t offset = (const char *) m->lengths -
+						(const char *) idx->mm;
+
+			index_mm_advise(idx, offset,
+				end - (const char *) m->lengths, MADV_WILLNEED);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+struct index_bundle {
+	void *mm;
+	size_t size;
+	uint32_t section_count;
+	const void *sections;
+};
+
+int index_bundle_open(const struct kmod_ctx *ctx, const char *filename,
+			unsigned long long *stamp, struct index_bundle **pbundle)
+{
+	struct index_bundle *bundle;
+	uint32_t magic, version;
+	const void *p;
+	int err;
+
+	assert(pbundle != NULL);
+
+	bundle = malloc(sizeof(*bundle));
+	if (bundle == NULL) {
+		ERR(ctx, "malloc: %m\n");
+		return -ENOMEM;
+	}
+
+	bundle->mm = index_mm_map(ctx, filename, 3 * sizeof(uint32_t),
+					&bundle->size, stamp, &err);
+	if (bundle->mm == NULL) {
+		free(bundle);
+		return err;
+	}
+
+	p = bundle->mm;
+	magic = read_long_mm(&p);
+	version = read_long_mm(&p);
+	bundle->section_count = read_long_mm(&p);
+	bundle->sections = p;
+
+	if (magic != INDEX_BUNDLE_MAGIC) {
+		ERR(ctx, "magic check fail: %x instead of %x\n", magic,
+							INDEX_BUNDLE_MAGIC);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	if (version >> 16 != INDEX_BUNDLE_VERSION >> 16) {
+		ERR(ctx, "major version check fail: %u instead of %u\n",
+				version >> 16, INDEX_BUNDLE_VERSION >> 16);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	if (bundle->section_count > (bundle->size - 3 * sizeof(uint32_t)) /
+							(3 * sizeof(uint32_t))) {
+		err = -EINVAL;
+		goto fail;
+	}
+
+	*pbundle = bundle;
+
+	return 0;
+
+fail:
+	index_mm_unmap(bundle->mm);
+	free(bundle);
+	return err;
+}
+
+void index_bundle_close(struct index_bundle *bundle)
+{
+	index_mm_unmap(bundle->mm);
+	free(bundle);
+}
+
+/*
+ * Create an index over the section @type of @bundle. The index borrows the
+ * bundle's mapping, so it must be closed before the bundle is.
+ */
+int index_mm_open_bundle(const struct kmod_ctx *ctx,
+			 struct index_bundle *bundle, unsigned int type,
+			 struct index_mm **pidx)
+{
+	const void *p = bundle->sections;
+	struct index_mm *idx;
+	uint32_t i;
+	int err;
+
+	assert(pidx != NULL);
+
+	for (i = 0; i < bundle->section_count; i++) {
+		uint32_t t = read_long_mm(&p);
+		uint32_t offset = read_long_mm(&p);
+		uint32_t size = read_long_mm(&p);
+
+		if (t != type)
+			continue;
+
+		if (offset > bundle->size || size > bundle->size - offset)
+			return -EINVAL;
+
+		idx = malloc(sizeof(*idx));
+		if (idx == NULL) {
+			ERR(ctx, "malloc: %m\n");
+			return -ENOMEM;
+		}
+
+		err = index_mm_init(ctx, idx, (char *) bundle->mm + offset,
+									size);
+		if (err < 0) {
+			free(idx);
+			return err;
+		}
+
+		idx->bundle = bundle;
+		*pidx = idx;
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+static bool index_mm_readroot(struct index_mm *idx,
+						struct index_mm_node *root)
+{
+	return index_mm_read_node(idx, idx->root_offset, root);
+}
+
+/* Character labelling the arc to the child at @slot of @node's child table */
+static inline int index_mm_child_char(const struct index_mm_node *node,
+							unsigned int slot)
+{
+	if (node->chars != NULL)
+		return (unsigned char) node->chars[slot];
+
+	return node->first + slot;
+}
+
+static bool index_mm_readslot(const struct index_mm_node *parent,
+				unsigned int slot, struct index_mm_node *child)
+{
+	const void *p = (const uint8_t *)parent->children +
+							slot * parent->width;
+	uint32_t ref = read_ref_mm(p, parent->width);
 
-	strbuf_init(&buf);
-	strbuf_pushchars(&buf, prefix);
-	index_mm_dump_node(root, &buf, fd);
-	strbuf_release(&buf);
+	if (parent->idx->major == INDEX_VERSION_MAJOR_V2)
+		return index_mm_read_node(parent->idx, ref, child);
+
+	/* holes in dense v3 tables */
+	if (ref == 0)
+		return false;
+
+	return index_mm_read_node(parent->idx, parent->offset - ref, child);
+}
+
+static bool index_mm_readchild(const struct index_mm_node *parent, int ch,
+						struct index_mm_node *child)
+{
+	unsigned int lo, hi;
+
+	if (ch < parent->first || ch > parent->last)
+		return false;
+
+	if (parent->chars == NULL)
+		return index_mm_readslot(parent, ch - parent->first, child);
+
+	lo = 0;
+	hi = parent->children_len;
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		int c = index_mm_child_char(parent, mid);
+
+		if (c == ch)
+			return index_mm_readslot(parent, mid, child);
+		if (c < ch)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return false;
+}
+
+static void index_mm_dump_node(const struct index_mm_node *node,
+						struct strbuf *buf, int fd)
+{
+	const void *p;
+	unsigned int i;
+	int ch, pushed;
+
+	pushed = strbuf_pushchars(buf, node->prefix);
+
+	for (i = 0, p = node->values; i < node->values_len; i++) {
+		unsigned int priority, len;
+		const char *value = index_mm_node_next_value(&p, &priority,
+									&len);
+
+		write_str_safe(fd, buf->bytes, buf->used);
+		write_str_safe(fd, " ", 1);
+		write_str_safe(fd, value, len);
+		write_str_safe(fd, "\n", 1);
+	}
+
+	for (i = 0; i < node->children_len; i++) {
+		struct index_mm_node child;
+
+		if (!index_mm_readslot(node, i, &child))
+			continue;
+
+		ch = index_mm_child_char(node, i);
+		strbuf_pushchar(buf, ch);
+		index_mm_dump_node(&child, buf, fd);
+		strbuf_popchar(buf);
+	}
+
+	strbuf_popchars(buf, pushed);
+}
+
+void index_mm_dump(struct index_mm *idx, int fd, const char *prefix)
+{
+	struct index_mm_node root;
+	char stack[INDEX_STRBUF_STACK];
+	struct strbuf buf;
+
+	index_mm_enter(idx);
+
+	if (index_mm_readroot(idx, &root)) {
+		strbuf_init_with_stack(&buf, stack, sizeof(stack));
+		strbuf_pushchars(&buf, prefix);
+		index_mm_dump_node(&root, &buf, fd);
+		strbuf_release(&buf);
+	}
+
+	index_mm_leave(idx);
 }
 
 static char *index_mm_search_node(struct index_mm_node *node, const char *key,
 									int i)
 {
-	char *value;
-	struct index_mm_node *child;
 	int ch;
 	int j;
 
-	while(node) {
+	for (;;) {
 		for (j = 0; node->prefix[j]; j++) {
 			ch = node->prefix[j];
 
-			if (ch != key[i+j]) {
-				index_mm_free_node(node);
+			if (ch != key[i+j])
 				return NULL;
-			}
 		}
 
 		i += j;
 
 		if (key[i] == '\0') {
-			value = node->values.len > 0
-				? strdup(node->values.values[0].value)
-				: NULL;
+			const void *p = node->values;
+			unsigned int priority, len;
 
-			index_mm_free_node(node);
-			return value;
+			if (node->values_len == 0)
+				return NULL;
+
+			return strdup(index_mm_node_next_value(&p, &priority,
+									&len));
 		}
 
-		child = index_mm_readchild(node, key[i]);
-		index_mm_free_node(node);
-		node = child;
+		if (!index_mm_readchild(node, key[i], node))
+			return NULL;
 		i++;
 	}
-
-	return NULL;
 }
 
 /*
  * Search the index for a key
  *
  * Returns the value of the first match
- *
- * The recursive functions free their node argument (using index_close).
  */
 char *index_mm_search(struct index_mm *idx, const char *key)
 {
 // FIXME: return value by reference instead of strdup
-	struct index_mm_node *root;
-	char *value;
+	struct index_mm_node root;
+	char *value = NULL;
 
-	root = index_mm_readroot(idx);
-	value = index_mm_search_node(root, key, 0);
+	index_mm_enter(idx);
+
+	if (!index_mm_filter_rejects(idx, key) &&
+					index_mm_readroot(idx, &root))
+		value = index_mm_search_node(&root, key, 0);
+
+	index_mm_leave(idx);
 
 	return value;
 }
 
-/* Level 4: add all the values from a matching node */
-static void index_mm_searchwild_allvalues(struct index_mm_node *node,
+static void index_mm_add_values(const void *p, unsigned int values_len,
 						struct index_value **out)
 {
-	struct index_mm_value *itr, *itr_end;
+	unsigned int i;
+
+	for (i = 0; i < values_len; i++) {
+		unsigned int priority, len;
+		const char *value = index_mm_node_next_value(&p, &priority,
+									&len);
 
-	itr = node->values.values;
-	itr_end = itr + node->values.len;
-	for (; itr < itr_end; itr++)
-		add_value(out, itr->value, itr->len, itr->priority);
+		add_value(out, value, len, priority);
+	}
+}
 
-	index_mm_free_node(node);
+/* Level 4: add all the values from a matching node */
+static void index_mm_searchwild_allvalues(const struct index_mm_node *node,
+						struct index_value **out)
+{
+	index_mm_add_values(node->values, node->values_len, out);
 }
 
 /*
  * Level 3: traverse a sub-keyspace which starts with a wildcard,
  * looking for matches.
  */
-static void index_mm_searchwild_all(struct index_mm_node *node, int j,
+static void index_mm_searchwild_all(const struct index_mm_node *node, int j,
 					  struct strbuf *buf,
 					  const char *subkey,
 					  struct index_value **out)
 {
+	unsigned int i;
 	int pushed = 0;
 	int ch;
 
@@ -979,24 +2412,21 @@ static void index_mm_searchwild_all(struct index_mm_node *node, int j,
 		j++;
 	}
 
-	for (ch = node->first; ch <= node->last; ch++) {
-		struct index_mm_node *child = index_mm_readchild(node, ch);
+	for (i = 0; i < node->children_len; i++) {
+		struct index_mm_node child;
 
-		if (!child)
+		if (!index_mm_readslot(node, i, &child))
 			continue;
 
+		ch = index_mm_child_char(node, i);
 		strbuf_pushchar(buf, ch);
-		index_mm_searchwild_all(child, 0, buf, subkey, out);
+		index_mm_searchwild_all(&child, 0, buf, subkey, out);
 		strbuf_popchar(buf);
 	}
 
-	if (node->values.len > 0) {
+	if (node->values_len > 0) {
 		if (fnmatch(strbuf_str(buf), subkey, 0) == 0)
 			index_mm_searchwild_allvalues(node, out);
-		else
-			index_mm_free_node(node);
-	} else {
-		index_mm_free_node(node);
 	}
 
 	strbuf_popchars(buf, pushed);
@@ -1008,11 +2438,11 @@ static void index_mm_searchwild_node(struct index_mm_node *node,
 					   const char *key, int i,
 					   struct index_value **out)
 {
-	struct index_mm_node *child;
+	struct index_mm_node child;
 	int j;
 	int ch;
 
-	while(node) {
+	for (;;) {
 		for (j = 0; node->prefix[j]; j++) {
 			ch = node->prefix[j];
 
@@ -1022,32 +2452,27 @@ static void index_mm_searchwild_node(struct index_mm_node *node,
 				return;
 			}
 
-			if (ch != key[i+j]) {
-				index_mm_free_node(node);
+			if (ch != key[i+j])
 				return;
-			}
 		}
 
 		i += j;
 
-		child = index_mm_readchild(node, '*');
-		if (child) {
+		if (index_mm_readchild(node, '*', &child)) {
 			strbuf_pushchar(buf, '*');
-			index_mm_searchwild_all(child, 0, buf, &key[i], out);
+			index_mm_searchwild_all(&child, 0, buf, &key[i], out);
 			strbuf_popchar(buf);
 		}
 
-		child = index_mm_readchild(node, '?');
-		if (child) {
+		if (index_mm_readchild(node, '?', &child)) {
 			strbuf_pushchar(buf, '?');
-			index_mm_searchwild_all(child, 0, buf, &key[i], out);
+			index_mm_searchwild_all(&child, 0, buf, &key[i], out);
 			strbuf_popchar(buf);
 		}
 
-		child = index_mm_readchild(node, '[');
-		if (child) {
+		if (index_mm_readchild(node, '[', &child)) {
 			strbuf_pushchar(buf, '[');
-			index_mm_searchwild_all(child, 0, buf, &key[i], out);
+			index_mm_searchwild_all(&child, 0, buf, &key[i], out);
 			strbuf_popchar(buf);
 		}
 
@@ -1057,13 +2482,73 @@ static void index_mm_searchwild_node(struct index_mm_node *node,
 			return;
 		}
 
-		child = index_mm_readchild(node, key[i]);
-		index_mm_free_node(node);
-		node = child;
+		if (!index_mm_readchild(node, key[i], node))
+			return;
 		i++;
 	}
 }
 
+static void index_mm_matcher_add_values(const struct index_mm *idx,
+					uint32_t values_offset,
+					struct index_value **out)
+{
+	const void *p = (const char *)idx->mm + values_offset;
+	unsigned int values_len = read_long_mm(&p);
+
+	index_mm_add_values(p, values_len, out);
+}
+
+static struct index_value *index_mm_matcher_searchwild(struct index_mm *idx,
+							const char *key)
+{
+	const struct index_mm_matcher *m = &idx->matcher;
+	const void *lengths = m->lengths;
+	struct index_value *out = NULL;
+	uint32_t hash = FNV1A_32_INIT;
+	uint32_t n = 0, len;
+	const void *p;
+	size_t i;
+
+	len = m->lengths_len > 0 ? read_long_mm(&lengths) : UINT32_MAX;
+
+	for (i = 0;; i++) {
+		for (; n < m->lengths_len && len == i; n++) {
+			uint32_t j, count;
+
+			p = index_mm_matcher_find(idx, m->globs, m->globs_size,
+						  hash, key, i);
+			if (p != NULL) {
+				count = read_long_mm(&p);
+				for (j = 0; j < count; j++) {
+					uint32_t values_offset = read_long_mm(&p);
+					unsigned int plen;
+					const char *pattern = read_chars_mm(&p,
+									&plen);
+
+					if (fnmatch(pattern, key + i, 0) == 0)
+						index_mm_matcher_add_values(idx,
+							values_offset, &out);
+				}
+			}
+
+			if (n + 1 < m->lengths_len)
+				len = read_long_mm(&lengths);
+		}
+
+		if (key[i] == '\0')
+			break;
+
+		hash = fnv1a_32_step(hash, key[i]);
+	}
+
+	p = index_mm_matcher_find(idx, m->literals, m->literals_size, hash,
+								key, i);
+	if (p != NULL)
+		index_mm_matcher_add_values(idx, read_long_mm(&p), &out);
+
+	return out;
+}
+
 /*
  * Search the index for a key.  The index may contain wildcards.
  *
@@ -1071,12 +2556,333 @@ static void index_mm_searchwild_node(struct index_mm_node *node,
  */
 struct index_value *index_mm_searchwild(struct index_mm *idx, const char *key)
 {
-	struct index_mm_node *root = index_mm_readroot(idx);
+	struct index_mm_node root;
+	char stack[INDEX_STRBUF_STACK];
 	struct strbuf buf;
 	struct index_value *out = NULL;
 
-	strbuf_init(&buf);
-	index_mm_searchwild_node(root, &buf, key, 0, &out);
-	strbuf_release(&buf);
+	if (idx->has_matcher)
+		return index_mm_matcher_searchwild(idx, key);
+
+	index_mm_enter(idx);
+
+	if ((!idx->filter_literal || !index_mm_filter_rejects(idx, key)) &&
+					index_mm_readroot(idx, &root)) {
+		strbuf_init_with_stack(&buf, stack, sizeof(stack));
+		index_mm_searchwild_node(&root, &buf, key, 0, &out);
+		strbuf_release(&buf);
+	}
+
+	index_mm_leave(idx);
+
 	return out;
 }
+
+struct index_moddep {
+	void *mm;
+	size_t size;
+	uint32_t count;
+	const void *modules;
+};
+
+int index_moddep_open(const struct kmod_ctx *ctx, const char *filename,
+			unsigned long long *stamp, struct index_moddep **pidx)
+{
+	struct index_moddep *idx;
+	uint32_t magic, version;
+	const void *p;
+	int err;
+
+	assert(pidx != NULL);
+
+	idx = malloc(sizeof(*idx));
+	if (idx == NULL) {
+		ERR(ctx, "malloc: %m\n");
+		return -ENOMEM;
+	}
+
+	idx->mm = index_mm_map(ctx, filename, 3 * sizeof(uint32_t),
+					&idx->size, stamp, &err);
+	if (idx->mm == NULL) {
+		free(idx);
+		return err;
+	}
+
+	p = idx->mm;
+	magic = read_long_mm(&p);
+	version = read_long_mm(&p);
+	idx->count = read_long_mm(&p);
+	idx->modules = p;
+
+	if (magic != INDEX_MODDEP_MAGIC) {
+		ERR(ctx, "magic check fail: %x instead of %x\n", magic,
+							INDEX_MODDEP_MAGIC);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	if (version >> 16 != INDEX_MODDEP_VERSION >> 16) {
+		ERR(ctx, "major version check fail: %u instead of %u\n",
+				version >> 16, INDEX_MODDEP_VERSION >> 16);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	if (idx->count > (idx->size - 3 * sizeof(uint32_t)) /
+							(4 * sizeof(uint32_t))) {
+		err = -EINVAL;
+		goto fail;
+	}
+
+	*pidx = idx;
+
+	return 0;
+
+fail:
+	index_mm_unmap(idx->mm);
+	free(idx);
+	return err;
+}
+
+void index_moddep_close(struct index_moddep *idx)
+{
+	index_mm_unmap(idx->mm);
+	free(idx);
+}
+
+/* string at @offset, NULL if it doesn't end within the file */
+static const char *index_moddep_string(const struct index_moddep *idx,
+					uint32_t offset, size_t *len)
+{
+	const char *s = (const char *)idx->mm + offset;
+
+	if (offset >= idx->size)
+		return NULL;
+
+	*len = strnlen(s, idx->size - offset);
+	if (*len == idx->size - offset)
+		return NULL;
+
+	return s;
+}
+
+static const void *index_moddep_entry(const struct index_moddep *idx,
+							uint32_t i)
+{
+	return (const uint32_t *)idx->modules + 4 * i;
+}
+
+static const char *index_moddep_path(const struct index_moddep *idx,
+					uint32_t i, size_t *len)
+{
+	const void *p = (const uint32_t *)index_moddep_entry(idx, i) + 1;
+
+	return index_moddep_string(idx, read_long_mm(&p), len);
+}
+
+/*
+ * Return the "path: dep1 dep2 ..." line of @key, as index_mm_search() on
+ * modules.dep.bin would, or NULL if it's not there.
+ */
+char *index_moddep_search(struct index_moddep *idx, const char *key)
+{
+	const char *path, *dp;
+	uint32_t lo = 0, hi = idx->count;
+	uint32_t deps, dep_count, j;
+	size_t len, dlen, linelen;
+	const void *p;
+	char *line, *s;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const char *name;
+		int r;
+
+		p = index_moddep_entry(idx, mid);
+		name = index_moddep_string(idx, read_long_mm(&p), &len);
+		if (name == NULL)
+			return NULL;
+
+		r = strcmp(key, name);
+		if (r == 0)
+			break;
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	if (lo >= hi)
+		return NULL;
+
+	/* p points past the name of the module found */
+	path = index_moddep_string(idx, read_long_mm(&p), &len);
+	deps = read_long_mm(&p);
+	dep_count = read_long_mm(&p);
+	if (path == NULL || deps > idx->size ||
+	    dep_count > (idx->size - deps) / sizeof(uint32_t))
+		return NULL;
+
+	/* first pass for the length: path, ':' and " dep" for each one */
+	linelen = len + 1;
+	for (j = 0, p = (const char *)idx->mm + deps; j < dep_count; j++) {
+		uint32_t id = read_long_mm(&p);
+
+		if (id >= idx->count ||
+		    index_moddep_path(idx, id, &dlen) == NULL)
+			return NULL;
+		linelen += 1 + dlen;
+	}
+
+	line = malloc(linelen + 1);
+	if (line == NULL)
+		return NULL;
+
+	memcpy(line, path, len);
+	s = line + len;
+	*s++ = ':';
+	for (j = 0, p = (const char *)idx->mm + deps; j < dep_count; j++) {
+		dp = index_moddep_path(idx, read_long_mm(&p), &dlen);
+		*s++ = ' ';
+		memcpy(s, dp, dlen);
+		s += dlen;
+	}
+	*s = '\0';
+
+	return line;
+}
+
+struct index_symhash {
+	void *mm;
+	size_t size;
+	uint32_t table_size;
+	const void *table;
+};
+
+int index_symhash_open(const struct kmod_ctx *ctx, const char *filename,
+			unsigned long long *stamp, struct index_symhash **pidx)
+{
+	struct index_symhash *idx;
+	uint32_t magic, version;
+	const void *p;
+	int err;
+
+	assert(pidx != NULL);
+
+	idx = malloc(sizeof(*idx));
+	if (idx == NULL) {
+		ERR(ctx, "malloc: %m\n");
+		return -ENOMEM;
+	}
+
+	idx->mm = index_mm_map(ctx, filename, 4 * sizeof(uint32_t),
+					&idx->size, stamp, &err);
+	if (idx->mm == NULL) {
+		free(idx);
+		return err;
+	}
+
+	p = idx->mm;
+	magic = read_long_mm(&p);
+	version = read_long_mm(&p);
+	idx->table_size = read_long_mm(&p);
+	read_long_mm(&p);
+	idx->table = p;
+
+	if (magic != INDEX_SYMHASH_MAGIC) {
+		ERR(ctx, "magic check fail: %x instead of %x\n", magic,
+							INDEX_SYMHASH_MAGIC);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	if (version >> 16 != INDEX_SYMHASH_VERSION >> 16) {
+		ERR(ctx, "major version check fail: %u instead of %u\n",
+				version >> 16, INDEX_SYMHASH_VERSION >> 16);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	if ((idx->table_size & (idx->table_size - 1)) != 0 ||
+	    idx->table_size > (idx->size - 4 * sizeof(uint32_t)) /
+							(2 * sizeof(uint32_t))) {
+		err = -EINVAL;
+		goto fail;
+	}
+
+	*pidx = idx;
+
+	return 0;
+
+fail:
+	index_mm_unmap(idx->mm);
+	free(idx);
+	return err;
+}
+
+void index_symhash_close(struct index_symhash *idx)
+{
+	index_mm_unmap(idx->mm);
+	free(idx);
+}
+
+/* nul terminated string at @offset, NULL if it doesn't end within the file */
+static const char *index_symhash_string(const struct index_symhash *idx,
+					uint32_t offset, size_t *len)
+{
+	const char *s = (const char *)idx->mm + offset;
+
+	if (offset >= idx->size)
+		return NULL;
+
+	*len = strnlen(s, idx->size - offset);
+	if (*len == idx->size - offset)
+		return NULL;
+
+	return s;
+}
+
+/*
+ * Return the name of the module exporting @name, pointing into the index,
+ * and its CRC in @crc if not NULL, or NULL if no module exports it.
+ */
+const char *index_symhash_search(const struct index_symhash *idx,
+					const char *name, uint64_t *crc)
+{
+	uint32_t hash = FNV1A_32_INIT, mask = idx->table_size - 1;
+	uint32_t i, n;
+	size_t keylen;
+
+	for (keylen = 0; name[keylen] != '\0'; keylen++)
+		hash = fnv1a_32_step(hash, name[keylen]);
+
+	for (i = hash & mask, n = 0; n < idx->table_size; i = (i + 1) & mask, n++) {
+		const void *p = (const uint32_t *)idx->table + 2 * i;
+		uint32_t h = read_long_mm(&p);
+		uint32_t entry = read_long_mm(&p);
+		const char *s, *owner;
+		size_t len;
+
+		if (entry == 0)
+			break;
+		if (h != hash)
+			continue;
+
+		s = index_symhash_string(idx, entry, &len);
+		if (s == NULL || len != keylen || memcmp(s, name, keylen) != 0)
+			continue;
+
+		if (idx->size - entry - len - 1 < 3 * sizeof(uint32_t))
+			return NULL;
+
+		p = s + len + 1;
+		owner = index_symhash_string(idx, read_long_mm(&p), &len);
+		if (owner != NULL && crc != NULL) {
+			*crc = (uint64_t)read_long_mm(&p) << 32;
+			*crc |= read_long_mm(&p);
+		}
+
+		return owner;
+	}
+
+	return NULL;
+}
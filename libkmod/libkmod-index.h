@@ -46,3 +46,27 @@ void index_mm_close(struct index_mm *index);
 char *index_mm_search(struct index_mm *idx, const char *key);
 struct index_value *index_mm_searchwild(struct index_mm *idx, const char *key);
 void index_mm_dump(struct index_mm *idx, int fd, const char *prefix);
+void index_mm_preload(struct index_mm *idx, enum kmod_index_preload preload);
+
+/* All the indexes of a kernel packed in modules.bin, sharing one mapping */
+struct index_bundle;
+int index_bundle_open(const struct kmod_ctx *ctx, const char *filename,
+			unsigned long long *stamp, struct index_bundle **pbundle);
+void index_bundle_close(struct index_bundle *bundle);
+int index_mm_open_bundle(const struct kmod_ctx *ctx,
+			 struct index_bundle *bundle, unsigned int type,
+			 struct index_mm **pidx);
+
+/* modules.dep.ids.bin: dependencies stored as module numbers */
+struct index_moddep;
+int index_moddep_open(const struct kmod_ctx *ctx, const char *filename,
+			unsigned long long *stamp, struct index_moddep **pidx);
+void index_moddep_close(struct index_moddep *idx);
+char *index_moddep_search(struct index_moddep *idx, const char *key);
+
+struct index_symhash;
+int index_symhash_open(const struct kmod_ctx *ctx, const char *filename,
+			unsigned long long *stamp, struct index_symhash **pidx);
+void index_symhash_close(struct index_symhash *idx);
+const char *index_symhash_search(const struct index_symhash *idx,
+					const char *name, uint64_t *crc);
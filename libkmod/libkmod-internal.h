@@ -1,5 +1,6 @@
 #pragma once
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <syslog.h>
@@ -35,10 +36,41 @@ static _always_inline_ _printf_format_(2, 3) void
 #  define ERR(ctx, arg...) kmod_log_null(ctx, ## arg)
 #endif
 
+/*
+ * USDT probes of the "libkmod" provider, for perf, bpftrace or systemtap to
+ * time each step of a lookup or insertion: names end in _entry and _return
+ * for the two ends of an operation. They compile to nothing, arguments
+ * included, without --enable-usdt.
+ */
+#ifdef ENABLE_USDT
+#  include <sys/sdt.h>
+#  define KMOD_PROBE1(name, a) DTRACE_PROBE1(libkmod, name, a)
+#  define KMOD_PROBE2(name, a, b) DTRACE_PROBE2(libkmod, name, a, b)
+#  define KMOD_PROBE3(name, a, b, c) DTRACE_PROBE3(libkmod, name, a, b, c)
+#else
+#  define KMOD_PROBE1(name, a) do { } while (0)
+#  define KMOD_PROBE2(name, a, b) do { } while (0)
+#  define KMOD_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
 #define KMOD_EXPORT __attribute__ ((visibility("default")))
 
 #define KCMD_LINE_SIZE 4096
 
+/*
+ * Lazily computed fields are published with a release store once ready, so
+ * other threads sharing the context can test them without taking a lock.
+ */
+static inline bool init_done(const bool *flag)
+{
+	return __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+}
+
+static inline void init_publish(bool *flag)
+{
+	__atomic_store_n(flag, true, __ATOMIC_RELEASE);
+}
+
 #ifndef HAVE_SECURE_GETENV
 #  ifdef HAVE___SECURE_GETENV
 #    define secure_getenv __secure_getenv
@@ -69,6 +101,7 @@ enum kmod_file_compression_type {
 };
 
 struct kmod_list *kmod_list_append(struct kmod_list *list, const void *data) _must_check_ __attribute__((nonnull(2)));
+void *kmod_list_append_new(struct kmod_list **list, size_t size) _must_check_ __attribute__((nonnull(1)));
 struct kmod_list *kmod_list_prepend(struct kmod_list *list, const void *data) _must_check_ __attribute__((nonnull(2)));
 struct kmod_list *kmod_list_remove(struct kmod_list *list) _must_check_;
 struct kmod_list *kmod_list_remove_data(struct kmod_list *list,
@@ -106,13 +139,55 @@ void kmod_set_modules_visited(struct kmod_ctx *ctx, bool visited) __attribute__(
 void kmod_set_modules_required(struct kmod_ctx *ctx, bool required) __attribute__((nonnull((1))));
 
 char *kmod_search_moddep(struct kmod_ctx *ctx, const char *name) __attribute__((nonnull(1,2)));
-
-struct kmod_module *kmod_pool_get_module(struct kmod_ctx *ctx, const char *key) __attribute__((nonnull(1,2)));
-void kmod_pool_add_module(struct kmod_ctx *ctx, struct kmod_module *mod, const char *key) __attribute__((nonnull(1, 2, 3)));
+char *kmod_search_softdep(struct kmod_ctx *ctx, const char *name) __attribute__((nonnull(1,2)));
+bool kmod_has_softdep_index(struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+bool kmod_has_resources(const struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+
+void kmod_pool_lock(struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+void kmod_pool_unlock(struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+struct kmod_module *kmod_pool_get_module(struct kmod_ctx *ctx, const char *key, size_t keylen) __attribute__((nonnull(1,2)));
+void kmod_pool_add_module(struct kmod_ctx *ctx, struct kmod_module *mod, const char *key, size_t keylen) __attribute__((nonnull(1, 2, 3)));
 void kmod_pool_del_module(struct kmod_ctx *ctx, struct kmod_module *mod, const char *key) __attribute__((nonnull(1, 2, 3)));
 
+/*
+ * Modules without references kept in the pool for reuse, most recently
+ * released first. Managed by libkmod-module.c.
+ */
+struct kmod_module_lru {
+	struct kmod_module *head, *tail;
+	unsigned int count;
+	unsigned int max;
+};
+struct kmod_module_lru *kmod_get_module_lru(struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+
+/*
+ * Probe lists already computed, most recently used first. Managed by
+ * libkmod-module.c and protected by the pool lock.
+ */
+struct kmod_probe_cache {
+	struct hash *entries;
+	struct kmod_probe_entry *head, *tail;
+};
+struct kmod_probe_cache *kmod_get_probe_cache(struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+
+/* how long a snapshot of the loaded modules answers the module getters */
+#define KMOD_LOADED_SNAPSHOT_USEC (1 * USEC_PER_SEC)
+unsigned int kmod_loaded_begin(struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+unsigned int kmod_loaded_get_gen(const struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+void kmod_loaded_drop(struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+
+int kmod_lookup_cache_get(struct kmod_ctx *ctx, const char *alias, struct kmod_list **list) __attribute__((nonnull(1, 2, 3)));
+void kmod_lookup_cache_add(struct kmod_ctx *ctx, const char *alias, const struct kmod_list *list) __attribute__((nonnull(1, 2)));
+void kmod_lookup_cache_flush(struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+
+/* counters for kmod_get_stat(), safe to update from any thread */
+#define _KMOD_STAT_COUNT (KMOD_STAT_CONFIG_USEC + 1)
+void kmod_stat_add(const struct kmod_ctx *ctx, enum kmod_stat stat, uint64_t value);
+
 const struct kmod_config *kmod_get_config(const struct kmod_ctx *ctx) __attribute__((nonnull(1)));
 enum kmod_file_compression_type kmod_get_kernel_compression(const struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+struct kmod_builtin_modinfo *kmod_get_builtin_modinfo(const struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+bool kmod_index_is_current(struct kmod_ctx *ctx, const char *fn, const char *base_fn, unsigned long long stamp) __attribute__((nonnull(1, 2, 3)));
 
 /* libkmod-config.c */
 struct kmod_config_path {
@@ -120,6 +195,22 @@ struct kmod_config_path {
 	char path[];
 };
 
+enum config_type {
+	CONFIG_TYPE_BLACKLIST = 0,
+	CONFIG_TYPE_INSTALL,
+	CONFIG_TYPE_REMOVE,
+	CONFIG_TYPE_ALIAS,
+	CONFIG_TYPE_OPTION,
+	CONFIG_TYPE_SOFTDEP,
+	CONFIG_TYPE_COUNT,
+};
+
+struct kmod_config_index;
+struct kmod_softdep;
+
+/* Compiled configuration, written by "kmod config-compile" in the module dir */
+#define KMOD_CONFIG_CACHE "modules.config.bin"
+
 struct kmod_config {
 	struct kmod_ctx *ctx;
 	struct kmod_list *aliases;
@@ -130,10 +221,41 @@ struct kmod_config {
 	struct kmod_list *softdeps;
 
 	struct kmod_list *paths;
+
+	/*
+	 * The config paths, then every file that was read: used to validate
+	 * the compiled cache
+	 */
+	struct kmod_list *sources;
+	unsigned int n_source_paths;
+	/* first entries coming from the kernel command line, never cached */
+	const struct kmod_list *kcmdline_blacklists;
+	const struct kmod_list *kcmdline_options;
+	bool from_cache;
+	/* modules.softdep was left to modules.softdep.bin, not read */
+	bool softdep_indexed;
+
+	/* lookup tables over each list above, built once it's complete */
+	struct kmod_config_index *index[CONFIG_TYPE_COUNT];
+
+	/*
+	 * Each type is materialized on first use, under @lock. @loaded means
+	 * the files (or the compiled cache) were read; softdeps are only kept
+	 * as lines until their type is needed.
+	 */
+	const char **config_paths;
+	struct kmod_list *softdep_lines;
+	pthread_mutex_t lock;
+	bool loaded;
+	bool kcmdline_parsed;
+	bool ready[CONFIG_TYPE_COUNT];
 };
 
 int kmod_config_new(struct kmod_ctx *ctx, struct kmod_config **config, const char * const *config_paths) __attribute__((nonnull(1, 2,3)));
 void kmod_config_free(struct kmod_config *config) __attribute__((nonnull(1)));
+int kmod_config_write_cache(const struct kmod_config *config) __attribute__((nonnull(1)));
+const struct kmod_list *kmod_config_get_paths(const struct kmod_config *config) __attribute__((nonnull(1)));
+const struct kmod_list *kmod_config_match(const struct kmod_config *config, enum config_type type, const char *name, bool glob, unsigned int *cursor) __attribute__((nonnull(1, 3, 5)));
 const char *kmod_blacklist_get_modname(const struct kmod_list *l) __attribute__((nonnull(1)));
 const char *kmod_alias_get_name(const struct kmod_list *l) __attribute__((nonnull(1)));
 const char *kmod_alias_get_modname(const struct kmod_list *l) __attribute__((nonnull(1)));
@@ -145,6 +267,9 @@ const char *kmod_command_get_modname(const struct kmod_list *l) __attribute__((n
 const char *kmod_softdep_get_name(const struct kmod_list *l) __attribute__((nonnull(1)));
 const char * const *kmod_softdep_get_pre(const struct kmod_list *l, unsigned int *count) __attribute__((nonnull(1, 2)));
 const char * const *kmod_softdep_get_post(const struct kmod_list *l, unsigned int *count);
+struct kmod_softdep *kmod_softdep_new(struct kmod_ctx *ctx, const char *modname, const char *line) __attribute__((nonnull(1, 2, 3)));
+const char * const *kmod_softdep_pre(const struct kmod_softdep *dep, unsigned int *count) __attribute__((nonnull(1, 2)));
+const char * const *kmod_softdep_post(const struct kmod_softdep *dep, unsigned int *count) __attribute__((nonnull(1, 2)));
 
 
 /* libkmod-module.c */
@@ -156,15 +281,50 @@ void kmod_module_set_visited(struct kmod_module *mod, bool visited) __attribute_
 void kmod_module_set_builtin(struct kmod_module *mod, bool builtin) __attribute__((nonnull((1))));
 void kmod_module_set_required(struct kmod_module *mod, bool required) __attribute__((nonnull(1)));
 bool kmod_module_is_builtin(struct kmod_module *mod) __attribute__((nonnull(1)));
+const char *kmod_module_get_hashkey(const struct kmod_module *mod) __attribute__((nonnull(1)));
+struct kmod_module *kmod_module_ref_pooled(struct kmod_module *mod) __attribute__((nonnull(1)));
+void kmod_module_lru_shrink(struct kmod_ctx *ctx, unsigned int max) __attribute__((nonnull(1)));
+void kmod_module_probe_cache_flush(struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+int kmod_module_new_from_path_unchecked(struct kmod_ctx *ctx, const char *path, struct kmod_module **mod) __attribute__((nonnull(1, 2, 3)));
+off_t kmod_module_get_file_size(const struct kmod_module *mod) __attribute__((nonnull(1)));
+struct kmod_list *kmod_module_info_append(struct kmod_list **list, const char *key, size_t keylen, const char *value, size_t valuelen) __attribute__((nonnull(1, 2)));
+struct kmod_list *kmod_module_symbol_append(struct kmod_list **list, uint64_t crc, const char *symbol) __attribute__((nonnull(1, 3)));
+struct kmod_list *kmod_module_dependency_symbol_append(struct kmod_list **list, uint64_t crc, uint8_t bind, const char *symbol) __attribute__((nonnull(1, 4)));
+
+enum kmod_module_list {
+	KMOD_MODULE_LIST_INFO = 1 << 0,
+	KMOD_MODULE_LIST_VERSIONS = 1 << 1,
+	KMOD_MODULE_LIST_SYMBOLS = 1 << 2,
+	KMOD_MODULE_LIST_DEPENDENCY_SYMBOLS = 1 << 3,
+	/* with KMOD_MODULE_LIST_INFO: see KMOD_INFO_NO_SIGNATURE */
+	KMOD_MODULE_LIST_INFO_NO_SIGNATURE = 1 << 4,
+};
+
+struct kmod_module_lists {
+	struct kmod_list *info;
+	struct kmod_list *versions;
+	struct kmod_list *symbols;
+	struct kmod_list *dependency_symbols;
+	int info_ret;
+	int versions_ret;
+	int symbols_ret;
+	int dependency_symbols_ret;
+};
+void kmod_module_get_lists(const struct kmod_module *mod, unsigned int which, struct kmod_module_lists *lists) __attribute__((nonnull(1, 3)));
 
 /* libkmod-file.c */
 struct kmod_file *kmod_file_open(const struct kmod_ctx *ctx, const char *filename) _must_check_ __attribute__((nonnull(1,2)));
+struct kmod_file *kmod_file_open_uncached(const struct kmod_ctx *ctx, const char *filename) _must_check_ __attribute__((nonnull(1,2)));
+bool kmod_file_uses_cache(const struct kmod_file *file) _must_check_ __attribute__((nonnull(1)));
 struct kmod_elf *kmod_file_get_elf(struct kmod_file *file) __attribute__((nonnull(1)));
-void kmod_file_load_contents(struct kmod_file *file) __attribute__((nonnull(1)));
+int kmod_file_load_contents(struct kmod_file *file) __attribute__((nonnull(1)));
+int kmod_file_load_range(struct kmod_file *file, uint64_t offset, uint64_t size) _must_check_ __attribute__((nonnull(1)));
 void *kmod_file_get_contents(const struct kmod_file *file) _must_check_ __attribute__((nonnull(1)));
+int kmod_file_make_writable(struct kmod_file *file) _must_check_ __attribute__((nonnull(1)));
 off_t kmod_file_get_size(const struct kmod_file *file) _must_check_ __attribute__((nonnull(1)));
 enum kmod_file_compression_type kmod_file_get_compression(const struct kmod_file *file) _must_check_ __attribute__((nonnull(1)));
 int kmod_file_get_fd(const struct kmod_file *file) _must_check_ __attribute__((nonnull(1)));
+int kmod_file_get_memfd(struct kmod_file *file) _must_check_ __attribute__((nonnull(1)));
 void kmod_file_unref(struct kmod_file *file) __attribute__((nonnull(1)));
 
 /* libkmod-elf.c */
@@ -176,12 +336,15 @@ struct kmod_modversion {
 };
 
 struct kmod_elf *kmod_elf_new(const void *memory, off_t size) _must_check_;
+struct kmod_elf *kmod_elf_new_partial(const void *memory, off_t size, int (*fill)(void *data, uint64_t offset, uint64_t size), void *data) _must_check_;
 void kmod_elf_unref(struct kmod_elf *elf) __attribute__((nonnull(1)));
+void kmod_elf_set_writable(struct kmod_elf *elf) __attribute__((nonnull(1)));
 const void *kmod_elf_get_memory(const struct kmod_elf *elf) _must_check_ __attribute__((nonnull(1)));
 int kmod_elf_get_strings(const struct kmod_elf *elf, const char *section, char ***array) _must_check_ __attribute__((nonnull(1,2,3)));
 int kmod_elf_get_modversions(const struct kmod_elf *elf, struct kmod_modversion **array) _must_check_ __attribute__((nonnull(1,2)));
 int kmod_elf_get_symbols(const struct kmod_elf *elf, struct kmod_modversion **array) _must_check_ __attribute__((nonnull(1,2)));
 int kmod_elf_get_dependency_symbols(const struct kmod_elf *elf, struct kmod_modversion **array) _must_check_ __attribute__((nonnull(1,2)));
+void kmod_elf_get_symbol_tables(const struct kmod_elf *elf, struct kmod_modversion **symbols, int *symcount, struct kmod_modversion **deps, int *depcount) __attribute__((nonnull(1)));
 int kmod_elf_strip_section(struct kmod_elf *elf, const char *section) _must_check_ __attribute__((nonnull(1,2)));
 int kmod_elf_strip_vermagic(struct kmod_elf *elf) _must_check_ __attribute__((nonnull(1)));
 
@@ -203,8 +366,12 @@ struct kmod_signature_info {
 	void (*free)(void *);
 	void *private;
 };
-bool kmod_module_signature_info(const struct kmod_file *file, struct kmod_signature_info *sig_info) _must_check_ __attribute__((nonnull(1, 2)));
+bool kmod_module_signature_info(struct kmod_file *file, struct kmod_signature_info *sig_info) _must_check_ __attribute__((nonnull(1, 2)));
 void kmod_module_signature_info_free(struct kmod_signature_info *sig_info) __attribute__((nonnull));
 
 /* libkmod-builtin.c */
+struct kmod_builtin_modinfo;
+int kmod_builtin_modinfo_open(struct kmod_ctx *ctx, struct kmod_builtin_modinfo **pbm) __attribute__((nonnull(1, 2)));
+void kmod_builtin_modinfo_close(struct kmod_builtin_modinfo *bm) __attribute__((nonnull(1)));
+bool kmod_builtin_modinfo_is_current(struct kmod_ctx *ctx, const struct kmod_builtin_modinfo *bm) __attribute__((nonnull(1, 2)));
 ssize_t kmod_builtin_get_modinfo(struct kmod_ctx *ctx, const char *modname, char ***modinfo) __attribute__((nonnull(1, 2, 3)));
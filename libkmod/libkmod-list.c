@@ -17,6 +17,7 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stddef.h>
 #include <stdlib.h>
 
 #include "libkmod.h"
@@ -122,6 +123,34 @@ struct kmod_list *kmod_list_append(struct kmod_list *list, const void *data)
 	return list ? list : new;
 }
 
+/* a node followed by its data, suitably aligned for any type */
+struct kmod_list_embedded {
+	struct kmod_list list;
+	max_align_t data[];
+};
+
+/*
+ * Append a node with @size bytes for its data in the same allocation, so
+ * kmod_list_remove() releases both: for the lists of small structs that
+ * libkmod builds and frees by itself, which then take one allocation per
+ * element instead of two. Returns the data, or NULL if @list is unchanged.
+ */
+void *kmod_list_append_new(struct kmod_list **list, size_t size)
+{
+	struct kmod_list_embedded *new;
+
+	new = malloc(sizeof(*new) + size);
+	if (new == NULL)
+		return NULL;
+
+	new->list.data = new->data;
+	list_node_append(*list ? &(*list)->node : NULL, &new->list.node);
+	if (*list == NULL)
+		*list = &new->list;
+
+	return new->data;
+}
+
 struct kmod_list *kmod_list_insert_after(struct kmod_list *list,
 							const void *data)
 {
@@ -21,15 +21,16 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
-#include <fnmatch.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
@@ -39,6 +40,7 @@
 #include <linux/module.h>
 #endif
 
+#include <shared/hash.h>
 #include <shared/util.h>
 
 #include "libkmod.h"
@@ -65,19 +67,30 @@ struct kmod_module {
 	char *hashkey;
 	char *name;
 	char *path;
+	/* dependencies as listed in modules.dep, turned into @dep on demand */
+	char *dep_line;
 	struct kmod_list *dep;
 	char *options;
 	const char *install_commands;	/* owned by kmod_config */
 	const char *remove_commands;	/* owned by kmod_config */
 	char *alias; /* only set if this module was created from an alias */
 	struct kmod_file *file;
-	int n_dep;
+	/* O_PATH fd of /sys/module/<name> while referenced, or -1 */
+	int sysfs_dirfd;
 	int refcount;
+	/* position in the ctx's list of unreferenced modules */
+	struct kmod_module *lru_prev, *lru_next;
+	/*
+	 * lazily filled fields are published with the pool lock held, the
+	 * flags are read with acquire semantics so they can be checked
+	 * without it
+	 */
 	struct {
-		bool dep : 1;
-		bool options : 1;
-		bool install_commands : 1;
-		bool remove_commands : 1;
+		bool dep;
+		bool dep_list;
+		bool options;
+		bool install_commands;
+		bool remove_commands;
 	} init;
 
 	/*
@@ -87,6 +100,20 @@ struct kmod_module {
 	 */
 	enum kmod_module_builtin builtin;
 
+	/*
+	 * state of the module in the kernel as of the snapshot taken by
+	 * kmod_module_new_from_loaded_snapshot(), protected by the pool lock
+	 * and only valid while @gen is the ctx's current one
+	 */
+	struct {
+		unsigned int gen;
+		int initstate;
+		int refcnt;
+		long size;
+		char *holders; /* names, each terminated by '\0' */
+		size_t holders_len;
+	} loaded;
+
 	/*
 	 * private field used by kmod_module_get_probe_list() to detect
 	 * dependency loops
@@ -107,6 +134,32 @@ struct kmod_module {
 	bool required : 1;
 };
 
+static bool refcount_inc_not_zero(int *refcount)
+{
+	int old = __atomic_load_n(refcount, __ATOMIC_RELAXED);
+
+	do {
+		if (old == 0)
+			return false;
+	} while (!__atomic_compare_exchange_n(refcount, &old, old + 1, true,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return true;
+}
+
+static bool refcount_dec_not_one(int *refcount)
+{
+	int old = __atomic_load_n(refcount, __ATOMIC_RELAXED);
+
+	do {
+		if (old == 1)
+			return false;
+	} while (!__atomic_compare_exchange_n(refcount, &old, old - 1, true,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	return true;
+}
+
 static inline const char *path_join(const char *path, size_t prefixlen,
 							char buf[PATH_MAX])
 {
@@ -134,47 +187,111 @@ static inline bool module_is_inkernel(struct kmod_module *mod)
 	return false;
 }
 
+/*
+ * Take the path of @mod from its modules.dep line and keep the rest of the
+ * line: the kmod_module of each dependency is only created when they are
+ * asked for, see module_get_dependencies_noref().
+ */
 int kmod_module_parse_depline(struct kmod_module *mod, char *line)
 {
 	struct kmod_ctx *ctx = mod->ctx;
-	struct kmod_list *list = NULL;
+	char *p, *modpath = NULL, *dep_line = NULL;
 	const char *dirname;
 	char buf[PATH_MAX];
-	char *p, *saveptr;
-	int err = 0, n = 0;
 	size_t dirnamelen;
 
-	if (mod->init.dep)
-		return mod->n_dep;
-	assert(mod->dep == NULL);
-	mod->init.dep = true;
+	if (init_done(&mod->init.dep))
+		return 0;
 
 	p = strchr(line, ':');
 	if (p == NULL)
-		return 0;
+		goto publish;
 
 	*p = '\0';
 	dirname = kmod_get_dirname(mod->ctx);
 	dirnamelen = strlen(dirname);
 	if (dirnamelen + 2 >= PATH_MAX)
-		return 0;
+		goto publish;
 
 	memcpy(buf, dirname, dirnamelen);
 	buf[dirnamelen] = '/';
 	dirnamelen++;
 	buf[dirnamelen] = '\0';
 
-	if (mod->path == NULL) {
+	if (__atomic_load_n(&mod->path, __ATOMIC_ACQUIRE) == NULL) {
 		const char *str = path_join(line, dirnamelen, buf);
 		if (str == NULL)
-			return 0;
-		mod->path = strdup(str);
-		if (mod->path == NULL)
-			return 0;
+			goto publish;
+		modpath = strdup(str);
+		if (modpath == NULL)
+			goto publish;
+	}
+
+	p += strspn(p + 1, " \t") + 1;
+	if (*p != '\0') {
+		dep_line = strdup(p);
+		if (dep_line == NULL) {
+			free(modpath);
+			return -ENOMEM;
+		}
+	}
+
+publish:
+	kmod_pool_lock(ctx);
+
+	/* another thread got here first, use what it found */
+	if (mod->init.dep) {
+		kmod_pool_unlock(ctx);
+		free(dep_line);
+		free(modpath);
+		return 0;
+	}
+
+	if (modpath != NULL && mod->path == NULL) {
+		__atomic_store_n(&mod->path, modpath, __ATOMIC_RELEASE);
+		modpath = NULL;
+	}
+	mod->dep_line = dep_line;
+	init_publish(&mod->init.dep);
+
+	kmod_pool_unlock(ctx);
+	free(modpath);
+
+	return 0;
+}
+
+/* Create the modules listed in the dep line of @mod, once */
+static int module_parse_dep_line(struct kmod_module *mod)
+{
+	struct kmod_ctx *ctx = mod->ctx;
+	struct kmod_list *list = NULL;
+	_cleanup_free_ char *line = NULL;
+	const char *dirname;
+	char buf[PATH_MAX];
+	char *p, *saveptr;
+	size_t dirnamelen;
+	int err = 0, n = 0;
+
+	if (init_done(&mod->init.dep_list))
+		return 0;
+
+	if (mod->dep_line != NULL) {
+		line = strdup(mod->dep_line);
+		if (line == NULL)
+			return -ENOMEM;
 	}
 
-	p++;
-	for (p = strtok_r(p, " \t", &saveptr); p != NULL;
+	dirname = kmod_get_dirname(ctx);
+	dirnamelen = strlen(dirname);
+	if (dirnamelen + 2 >= PATH_MAX)
+		return -ENAMETOOLONG;
+
+	memcpy(buf, dirname, dirnamelen);
+	buf[dirnamelen] = '/';
+	dirnamelen++;
+	buf[dirnamelen] = '\0';
+
+	for (p = line ? strtok_r(line, " \t", &saveptr) : NULL; p != NULL;
 					p = strtok_r(NULL, " \t", &saveptr)) {
 		struct kmod_module *depmod = NULL;
 		const char *path;
@@ -183,6 +300,7 @@ int kmod_module_parse_depline(struct kmod_module *mod, char *line)
 		if (path == NULL) {
 			ERR(ctx, "could not join path '%s' and '%s'.\n",
 			    dirname, p);
+			err = -ENAMETOOLONG;
 			goto fail;
 		}
 
@@ -201,13 +319,24 @@ int kmod_module_parse_depline(struct kmod_module *mod, char *line)
 
 	DBG(ctx, "%d dependencies for %s\n", n, mod->name);
 
+	kmod_pool_lock(ctx);
+
+	/* another thread got here first, use what it found */
+	if (mod->init.dep_list) {
+		kmod_pool_unlock(ctx);
+		kmod_module_unref_list(list);
+		return 0;
+	}
+
 	mod->dep = list;
-	mod->n_dep = n;
-	return n;
+	init_publish(&mod->init.dep_list);
+
+	kmod_pool_unlock(ctx);
+
+	return 0;
 
 fail:
 	kmod_module_unref_list(list);
-	mod->init.dep = false;
 	return err;
 }
 
@@ -218,8 +347,8 @@ void kmod_module_set_visited(struct kmod_module *mod, bool visited)
 
 void kmod_module_set_builtin(struct kmod_module *mod, bool builtin)
 {
-	mod->builtin =
-		builtin ? KMOD_MODULE_BUILTIN_YES : KMOD_MODULE_BUILTIN_NO;
+	__atomic_store_n(&mod->builtin, builtin ? KMOD_MODULE_BUILTIN_YES :
+				KMOD_MODULE_BUILTIN_NO, __ATOMIC_RELAXED);
 }
 
 void kmod_module_set_required(struct kmod_module *mod, bool required)
@@ -229,13 +358,25 @@ void kmod_module_set_required(struct kmod_module *mod, bool required)
 
 bool kmod_module_is_builtin(struct kmod_module *mod)
 {
-	if (mod->builtin == KMOD_MODULE_BUILTIN_UNKNOWN) {
-		kmod_module_set_builtin(mod,
-					kmod_lookup_alias_is_builtin(mod->ctx, mod->name));
+	enum kmod_module_builtin builtin;
+
+	builtin = __atomic_load_n(&mod->builtin, __ATOMIC_RELAXED);
+	if (builtin == KMOD_MODULE_BUILTIN_UNKNOWN) {
+		bool is_builtin = kmod_lookup_alias_is_builtin(mod->ctx,
+								mod->name);
+
+		kmod_module_set_builtin(mod, is_builtin);
+		return is_builtin;
 	}
 
-	return mod->builtin == KMOD_MODULE_BUILTIN_YES;
+	return builtin == KMOD_MODULE_BUILTIN_YES;
+}
+
+const char *kmod_module_get_hashkey(const struct kmod_module *mod)
+{
+	return mod->hashkey;
 }
+
 /*
  * Memory layout with alias:
  *
@@ -267,20 +408,25 @@ static int kmod_module_new(struct kmod_ctx *ctx, const char *key,
 	struct kmod_module *m;
 	size_t keylen;
 
-	m = kmod_pool_get_module(ctx, key);
-	if (m != NULL) {
-		*mod = kmod_module_ref(m);
-		return 0;
-	}
-
 	if (alias == NULL)
 		keylen = namelen;
 	else
 		keylen = namelen + aliaslen + 1;
 
+	kmod_pool_lock(ctx);
+
+	m = kmod_pool_get_module(ctx, key, keylen);
+	if (m != NULL) {
+		*mod = kmod_module_ref_pooled(m);
+		kmod_pool_unlock(ctx);
+		return 0;
+	}
+
 	m = malloc(sizeof(*m) + (alias == NULL ? 1 : 2) * (keylen + 1));
-	if (m == NULL)
+	if (m == NULL) {
+		kmod_pool_unlock(ctx);
 		return -ENOMEM;
+	}
 
 	memset(m, 0, sizeof(*m));
 
@@ -297,8 +443,10 @@ static int kmod_module_new(struct kmod_ctx *ctx, const char *key,
 		memcpy(m->hashkey, key, keylen + 1);
 	}
 
+	m->sysfs_dirfd = -1;
 	m->refcount = 1;
-	kmod_pool_add_module(ctx, m, m->hashkey);
+	kmod_pool_add_module(ctx, m, m->hashkey, keylen);
+	kmod_pool_unlock(ctx);
 	*mod = m;
 
 	return 0;
@@ -363,6 +511,76 @@ int kmod_module_new_from_alias(struct kmod_ctx *ctx, const char *alias,
 	return 0;
 }
 
+/* called with the pool lock held, takes ownership of @abspath */
+static int kmod_module_set_path(struct kmod_module *m, char *abspath)
+{
+	if (m->path == NULL) {
+		__atomic_store_n(&m->path, abspath, __ATOMIC_RELEASE);
+	} else if (streq(m->path, abspath)) {
+		free(abspath);
+	} else if (__atomic_load_n(&m->refcount, __ATOMIC_RELAXED) == 0) {
+		/* unused module kept in the pool, nobody saw its path */
+		free(m->path);
+		m->path = abspath;
+	} else {
+		ERR(m->ctx, "kmod_module '%s' already exists with different path: new-path='%s' old-path='%s'\n",
+						m->name, abspath, m->path);
+		free(abspath);
+		return -EEXIST;
+	}
+
+	return 0;
+}
+
+static int module_new_from_abspath(struct kmod_ctx *ctx, char *abspath,
+						struct kmod_module **mod)
+{
+	struct kmod_module *m;
+	char name[PATH_MAX];
+	size_t namelen;
+	int err;
+
+	if (path_to_modname(abspath, name, &namelen) == NULL) {
+		DBG(ctx, "could not get modname from path %s\n", abspath);
+		free(abspath);
+		return -ENOENT;
+	}
+
+	kmod_pool_lock(ctx);
+
+	m = kmod_pool_get_module(ctx, name, namelen);
+	if (m != NULL) {
+		err = kmod_module_set_path(m, abspath);
+		if (err == 0)
+			kmod_module_ref_pooled(m);
+		kmod_pool_unlock(ctx);
+		if (err < 0)
+			return err;
+	} else {
+		kmod_pool_unlock(ctx);
+
+		err = kmod_module_new(ctx, name, name, namelen, NULL, 0, &m);
+		if (err < 0) {
+			free(abspath);
+			return err;
+		}
+
+		/* it may have been created by another thread meanwhile */
+		kmod_pool_lock(ctx);
+		err = kmod_module_set_path(m, abspath);
+		kmod_pool_unlock(ctx);
+		if (err < 0) {
+			kmod_module_unref(m);
+			return err;
+		}
+	}
+
+	kmod_module_set_builtin(m, false);
+	*mod = m;
+
+	return 0;
+}
+
 /**
  * kmod_module_new_from_path:
  * @ctx: kmod library context
@@ -388,12 +606,9 @@ KMOD_EXPORT int kmod_module_new_from_path(struct kmod_ctx *ctx,
 						const char *path,
 						struct kmod_module **mod)
 {
-	struct kmod_module *m;
 	int err;
 	struct stat st;
-	char name[PATH_MAX];
 	char *abspath;
-	size_t namelen;
 
 	if (ctx == NULL || path == NULL || mod == NULL)
 		return -ENOENT;
@@ -412,40 +627,71 @@ KMOD_EXPORT int kmod_module_new_from_path(struct kmod_ctx *ctx,
 		return err;
 	}
 
-	if (path_to_modname(path, name, &namelen) == NULL) {
-		DBG(ctx, "could not get modname from path %s\n", path);
-		free(abspath);
-		return -ENOENT;
+	return module_new_from_abspath(ctx, abspath, mod);
+}
+
+/*
+ * Like kmod_module_new_from_path(), for a path the caller already knows to
+ * exist, e.g. because it was just read from its directory: doesn't stat() it.
+ */
+int kmod_module_new_from_path_unchecked(struct kmod_ctx *ctx, const char *path,
+						struct kmod_module **mod)
+{
+	char *abspath;
+
+	abspath = path_make_absolute_cwd(path);
+	if (abspath == NULL) {
+		DBG(ctx, "no absolute path for %s\n", path);
+		return -ENOMEM;
 	}
 
-	m = kmod_pool_get_module(ctx, name);
-	if (m != NULL) {
-		if (m->path == NULL)
-			m->path = abspath;
-		else if (streq(m->path, abspath))
-			free(abspath);
-		else {
-			ERR(ctx, "kmod_module '%s' already exists with different path: new-path='%s' old-path='%s'\n",
-							name, abspath, m->path);
-			free(abspath);
-			return -EEXIST;
-		}
+	return module_new_from_abspath(ctx, abspath, mod);
+}
 
-		kmod_module_ref(m);
-	} else {
-		err = kmod_module_new(ctx, name, name, namelen, NULL, 0, &m);
-		if (err < 0) {
-			free(abspath);
-			return err;
-		}
+static void kmod_module_lru_unlink(struct kmod_module_lru *lru,
+						struct kmod_module *mod)
+{
+	if (mod->lru_prev != NULL)
+		mod->lru_prev->lru_next = mod->lru_next;
+	else
+		lru->head = mod->lru_next;
 
-		m->path = abspath;
-	}
+	if (mod->lru_next != NULL)
+		mod->lru_next->lru_prev = mod->lru_prev;
+	else
+		lru->tail = mod->lru_prev;
 
-	m->builtin = KMOD_MODULE_BUILTIN_NO;
-	*mod = m;
+	mod->lru_prev = mod->lru_next = NULL;
+	lru->count--;
+}
 
-	return 0;
+/* free a module with no references, and so no dependencies nor file */
+static void kmod_module_free(struct kmod_module *mod)
+{
+	DBG(mod->ctx, "kmod_module %p released\n", mod);
+
+	kmod_pool_del_module(mod->ctx, mod, mod->hashkey);
+	free(mod->loaded.holders);
+	free(mod->options);
+	free(mod->dep_line);
+	free(mod->path);
+	free(mod);
+}
+
+/*
+ * Release unreferenced modules kept in the pool, least recently used
+ * first, until at most @max are left. Called with the pool lock held.
+ */
+void kmod_module_lru_shrink(struct kmod_ctx *ctx, unsigned int max)
+{
+	struct kmod_module_lru *lru = kmod_get_module_lru(ctx);
+
+	while (lru->count > max) {
+		struct kmod_module *mod = lru->tail;
+
+		kmod_module_lru_unlink(lru, mod);
+		kmod_module_free(mod);
+	}
 }
 
 /**
@@ -453,31 +699,87 @@ KMOD_EXPORT int kmod_module_new_from_path(struct kmod_ctx *ctx,
  * @mod: kmod module
  *
  * Drop a reference of the kmod module. If the refcount reaches zero, its
- * resources are released.
+ * resources are released. The module itself may be kept in @ctx's pool
+ * for reuse, see kmod_set_module_pool_size().
  *
  * Returns: NULL if @mod is NULL or if the module was released. Otherwise it
  * returns the passed @mod with its refcount decremented.
  */
 KMOD_EXPORT struct kmod_module *kmod_module_unref(struct kmod_module *mod)
 {
+	struct kmod_module_lru *lru;
+	struct kmod_list *dep;
+	struct kmod_file *file;
+	struct kmod_ctx *ctx;
+	int sysfs_dirfd;
+
 	if (mod == NULL)
 		return NULL;
 
-	if (--mod->refcount > 0)
+	if (refcount_dec_not_one(&mod->refcount))
 		return mod;
 
-	DBG(mod->ctx, "kmod_module %p released\n", mod);
+	/*
+	 * Dropping the last reference must not race with the module being
+	 * found in the pool and referenced again.
+	 */
+	ctx = mod->ctx;
+	kmod_pool_lock(ctx);
 
-	kmod_pool_del_module(mod->ctx, mod, mod->hashkey);
-	kmod_module_unref_list(mod->dep);
+	if (__atomic_sub_fetch(&mod->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
+		kmod_pool_unlock(ctx);
+		return mod;
+	}
+
+	/*
+	 * Dependencies and the file are dropped even when the module is kept
+	 * in the pool: they hold references that would keep the context
+	 * alive. They are loaded again if the module is reused.
+	 */
+	dep = mod->dep;
+	mod->dep = NULL;
+	mod->init.dep_list = false;
+	free(mod->dep_line);
+	mod->dep_line = NULL;
+	mod->init.dep = false;
 
-	if (mod->file)
-		kmod_file_unref(mod->file);
+	file = mod->file;
+	mod->file = NULL;
+
+	/* don't keep a fd open for each module in the pool */
+	sysfs_dirfd = mod->sysfs_dirfd;
+	mod->sysfs_dirfd = -1;
+
+	lru = kmod_get_module_lru(ctx);
+
+	if (lru->max == 0) {
+		kmod_module_free(mod);
+	} else {
+		DBG(ctx, "kmod_module %p unused\n", mod);
+
+		mod->lru_prev = NULL;
+		mod->lru_next = lru->head;
+		if (lru->head != NULL)
+			lru->head->lru_prev = mod;
+		else
+			lru->tail = mod;
+		lru->head = mod;
+		lru->count++;
+
+		kmod_module_lru_shrink(ctx, lru->max);
+	}
+
+	kmod_pool_unlock(ctx);
+
+	kmod_module_unref_list(dep);
+	if (file != NULL)
+		kmod_file_unref(file);
+	if (sysfs_dirfd >= 0)
+		close(sysfs_dirfd);
+
+	/* last one, since releasing the context releases the unused modules */
+	kmod_unref(ctx);
 
-	kmod_unref(mod->ctx);
-	free(mod->options);
-	free(mod->path);
-	free(mod);
 	return NULL;
 }
 
@@ -494,7 +796,32 @@ KMOD_EXPORT struct kmod_module *kmod_module_ref(struct kmod_module *mod)
 	if (mod == NULL)
 		return NULL;
 
-	mod->refcount++;
+	if (refcount_inc_not_zero(&mod->refcount))
+		return mod;
+
+	kmod_pool_lock(mod->ctx);
+	kmod_module_ref_pooled(mod);
+	kmod_pool_unlock(mod->ctx);
+
+	return mod;
+}
+
+/*
+ * Take a reference of a module found in the pool, which may be an unused
+ * one kept there. Called with the pool lock held.
+ */
+struct kmod_module *kmod_module_ref_pooled(struct kmod_module *mod)
+{
+	if (__atomic_load_n(&mod->refcount, __ATOMIC_RELAXED) == 0) {
+		/* reused from the pool: start over as a new module */
+		kmod_module_lru_unlink(kmod_get_module_lru(mod->ctx), mod);
+		kmod_ref(mod->ctx);
+		mod->visited = false;
+		mod->ignorecmd = false;
+		mod->required = false;
+	}
+
+	__atomic_add_fetch(&mod->refcount, 1, __ATOMIC_RELAXED);
 
 	return mod;
 }
@@ -510,7 +837,9 @@ static int __kmod_module_new_from_lookup(struct kmod_ctx *ctx, const lookup_func
 	for (i = 0; i < lookup_count; i++) {
 		int err;
 
+		KMOD_PROBE2(lookup_method_entry, s, i);
 		err = lookup[i](ctx, s, list);
+		KMOD_PROBE3(lookup_method_return, s, i, err);
 		if (err < 0 && err != -ENOSYS)
 			return err;
 		else if (*list != NULL)
@@ -520,6 +849,24 @@ static int __kmod_module_new_from_lookup(struct kmod_ctx *ctx, const lookup_func
 	return 0;
 }
 
+static int kmod_module_new_from_lookup_cached(struct kmod_ctx *ctx,
+					const lookup_func lookup[],
+					size_t lookup_count, const char *s,
+					struct kmod_list **list)
+{
+	int err;
+
+	err = kmod_lookup_cache_get(ctx, s, list);
+	if (err != 0)
+		return err < 0 ? err : 0;
+
+	err = __kmod_module_new_from_lookup(ctx, lookup, lookup_count, s, list);
+	if (err >= 0)
+		kmod_lookup_cache_add(ctx, s, *list);
+
+	return err;
+}
+
 /**
  * kmod_module_new_from_lookup:
  * @ctx: kmod library context
@@ -543,6 +890,9 @@ static int __kmod_module_new_from_lookup(struct kmod_ctx *ctx, const lookup_func
  * not unref @ctx before all the desired operations with the returned list are
  * completed.
  *
+ * The result is served from the lookup cache if it was enabled with
+ * kmod_set_lookup_cache_size().
+ *
  * Returns: 0 on success or < 0 otherwise. It fails if any of the lookup
  * methods failed, which is basically due to memory allocation fail. If module
  * is not found, it still returns 0, but @list is an empty list.
@@ -578,8 +928,10 @@ KMOD_EXPORT int kmod_module_new_from_lookup(struct kmod_ctx *ctx,
 
 	DBG(ctx, "input alias=%s, normalized=%s\n", given_alias, alias);
 
-	err = __kmod_module_new_from_lookup(ctx, lookup, ARRAY_SIZE(lookup),
-					    alias, list);
+	KMOD_PROBE1(lookup_entry, alias);
+	err = kmod_module_new_from_lookup_cached(ctx, lookup,
+						ARRAY_SIZE(lookup), alias, list);
+	KMOD_PROBE2(lookup_return, alias, err);
 
 	DBG(ctx, "lookup=%s found=%d\n", alias, err >= 0 && *list);
 
@@ -591,23 +943,178 @@ KMOD_EXPORT int kmod_module_new_from_lookup(struct kmod_ctx *ctx,
 	return err;
 }
 
-/**
- * kmod_module_new_from_name_lookup:
- * @ctx: kmod library context
- * @modname: module name to look for
- * @mod: returned module on success
- *
- * Lookup by module name, without considering possible aliases. This is similar
- * to kmod_module_new_from_lookup(), but don't consider as source indexes and
- * configurations that work with aliases. When succesful, this always resolves
- * to one and only one module.
- *
- * The search order is: 1. module names in modules.dep index;
- * 2. builtin indexes from kernel.
- *
- * The initial refcount is 1, and needs to be decremented to release the
- * resources of the kmod_module. Since libkmod keeps track of all
- * kmod_modules created, they are all released upon @ctx destruction too. Do
+struct lookup_key {
+	const char *alias;
+	unsigned int pos;
+};
+
+static int lookup_key_cmp(const void *pa, const void *pb)
+{
+	const struct lookup_key *a = pa, *b = pb;
+
+	return strcmp(a->alias, b->alias);
+}
+
+static struct kmod_list *lookup_list_dup(struct kmod_list *list)
+{
+	struct kmod_list *l, *l_new, *list_new = NULL;
+
+	kmod_list_foreach(l, list) {
+		l_new = kmod_list_append(list_new, kmod_module_ref(l->data));
+		if (l_new == NULL) {
+			kmod_module_unref(l->data);
+			kmod_module_unref_list(list_new);
+			return NULL;
+		}
+
+		list_new = l_new;
+	}
+
+	return list_new;
+}
+
+/**
+ * kmod_module_new_from_lookups:
+ * @ctx: kmod library context
+ * @aliases: array of aliases to look for
+ * @count: number of entries in @aliases
+ * @lists: array of @count empty lists where to save the modules matching
+ * each alias
+ *
+ * Batch version of kmod_module_new_from_lookup(). Each entry in @aliases is
+ * looked up with the same search order and the result is saved in the entry
+ * of @lists with the same position.
+ *
+ * All the aliases are normalized upfront and looked up in sorted order, so
+ * aliases sharing a prefix walk the same index nodes one after the other and
+ * repeated aliases are resolved only once. The indexes are opened once for
+ * the whole batch only if they were loaded with kmod_load_resources(): like
+ * kmod_module_new_from_lookup(), this doesn't load or unload them in @ctx,
+ * which may be shared with other threads, so otherwise each lookup opens the
+ * index it needs.
+ *
+ * Each list in @lists must be released by calling kmod_module_unref_list().
+ * An invalid alias is not an error: its list is left empty.
+ *
+ * Returns: 0 on success or < 0 otherwise. If any of the lookups fail, all
+ * the lists are released and set to NULL.
+ */
+KMOD_EXPORT int kmod_module_new_from_lookups(struct kmod_ctx *ctx,
+						const char * const *aliases,
+						unsigned int count,
+						struct kmod_list **lists)
+{
+	static const lookup_func lookup[] = {
+		kmod_lookup_alias_from_config,
+		kmod_lookup_alias_from_moddep_file,
+		kmod_lookup_alias_from_symbols_file,
+		kmod_lookup_alias_from_commands,
+		kmod_lookup_alias_from_aliases_file,
+		kmod_lookup_alias_from_builtin_file,
+		kmod_lookup_alias_from_kernel_builtin_file,
+	};
+	_cleanup_free_ struct lookup_key *keys = NULL;
+	_cleanup_free_ char *buf = NULL;
+	const struct lookup_key *prev = NULL;
+	unsigned int i, nkeys;
+	size_t buflen;
+	char *p;
+	int err = 0;
+
+	if (ctx == NULL || aliases == NULL || lists == NULL)
+		return -ENOENT;
+
+	for (i = 0; i < count; i++) {
+		if (lists[i] != NULL) {
+			ERR(ctx, "Empty lists are needed to create lookups\n");
+			return -ENOSYS;
+		}
+	}
+
+	if (count == 0)
+		return 0;
+
+	/* normalized aliases have the same length as the given ones */
+	for (i = 0, buflen = 0; i < count; i++) {
+		if (aliases[i] != NULL)
+			buflen += strnlen(aliases[i], PATH_MAX - 1) + 1;
+	}
+
+	keys = malloc(sizeof(*keys) * count);
+	buf = malloc(buflen);
+	if (keys == NULL || buf == NULL)
+		return -ENOMEM;
+
+	for (i = 0, nkeys = 0, p = buf; i < count; i++) {
+		char alias[PATH_MAX];
+		size_t len;
+
+		if (aliases[i] == NULL ||
+				alias_normalize(aliases[i], alias, &len) < 0) {
+			DBG(ctx, "invalid alias: %s\n", aliases[i]);
+			continue;
+		}
+
+		keys[nkeys].alias = memcpy(p, alias, len + 1);
+		keys[nkeys].pos = i;
+		nkeys++;
+		p += len + 1;
+	}
+
+	qsort(keys, nkeys, sizeof(*keys), lookup_key_cmp);
+
+	for (i = 0; i < nkeys; i++) {
+		const struct lookup_key *key = &keys[i];
+
+		if (prev != NULL && streq(prev->alias, key->alias)) {
+			lists[key->pos] = lookup_list_dup(lists[prev->pos]);
+			if (lists[key->pos] == NULL && lists[prev->pos] != NULL) {
+				err = -ENOMEM;
+				break;
+			}
+			continue;
+		}
+
+		err = kmod_module_new_from_lookup_cached(ctx, lookup,
+						ARRAY_SIZE(lookup),
+						key->alias, &lists[key->pos]);
+
+		DBG(ctx, "lookup=%s found=%d\n", key->alias,
+					err >= 0 && lists[key->pos]);
+
+		if (err < 0)
+			break;
+
+		prev = key;
+	}
+
+	if (err < 0) {
+		for (i = 0; i < count; i++) {
+			kmod_module_unref_list(lists[i]);
+			lists[i] = NULL;
+		}
+	}
+
+	return err;
+}
+
+/**
+ * kmod_module_new_from_name_lookup:
+ * @ctx: kmod library context
+ * @modname: module name to look for
+ * @mod: returned module on success
+ *
+ * Lookup by module name, without considering possible aliases. This is similar
+ * to kmod_module_new_from_lookup(), but don't consider as source indexes and
+ * configurations that work with aliases. When succesful, this always resolves
+ * to one and only one module.
+ *
+ * The search order is: 1. module names in modules.dep index;
+ * 2. builtin indexes from kernel.
+ *
+ * The initial refcount is 1, and needs to be decremented to release the
+ * resources of the kmod_module. Since libkmod keeps track of all
+ * kmod_modules created, they are all released upon @ctx destruction too. Do
  * not unref @ctx before all the desired operations with the returned list are
  * completed.
  *
@@ -688,7 +1195,7 @@ KMOD_EXPORT int kmod_module_get_filtered_blacklist(const struct kmod_ctx *ctx,
 
 static const struct kmod_list *module_get_dependencies_noref(const struct kmod_module *mod)
 {
-	if (!mod->init.dep) {
+	if (!init_done(&mod->init.dep)) {
 		/* lazy init */
 		char *line = kmod_search_moddep(mod->ctx, mod->name);
 
@@ -698,10 +1205,13 @@ static const struct kmod_list *module_get_dependencies_noref(const struct kmod_m
 		kmod_module_parse_depline((struct kmod_module *)mod, line);
 		free(line);
 
-		if (!mod->init.dep)
+		if (!init_done(&mod->init.dep))
 			return NULL;
 	}
 
+	if (module_parse_dep_line((struct kmod_module *)mod) < 0)
+		return NULL;
+
 	return mod->dep;
 }
 
@@ -718,14 +1228,13 @@ static const struct kmod_list *module_get_dependencies_noref(const struct kmod_m
  */
 KMOD_EXPORT struct kmod_list *kmod_module_get_dependencies(const struct kmod_module *mod)
 {
-	struct kmod_list *l, *l_new, *list_new = NULL;
+	const struct kmod_list *l;
+	struct kmod_list *l_new, *list_new = NULL;
 
 	if (mod == NULL)
 		return NULL;
 
-	module_get_dependencies_noref(mod);
-
-	kmod_list_foreach(l, mod->dep) {
+	kmod_list_foreach(l, module_get_dependencies_noref(mod)) {
 		l_new = kmod_list_append(list_new, kmod_module_ref(l->data));
 		if (l_new == NULL) {
 			kmod_module_unref(l->data);
@@ -794,16 +1303,19 @@ KMOD_EXPORT const char *kmod_module_get_name(const struct kmod_module *mod)
  */
 KMOD_EXPORT const char *kmod_module_get_path(const struct kmod_module *mod)
 {
+	const char *path;
 	char *line;
 
 	if (mod == NULL)
 		return NULL;
 
-	DBG(mod->ctx, "name='%s' path='%s'\n", mod->name, mod->path);
+	path = __atomic_load_n(&mod->path, __ATOMIC_ACQUIRE);
+
+	DBG(mod->ctx, "name='%s' path='%s'\n", mod->name, path);
 
-	if (mod->path != NULL)
-		return mod->path;
-	if (mod->init.dep)
+	if (path != NULL)
+		return path;
+	if (init_done(&mod->init.dep))
 		return NULL;
 
 	/* lazy init */
@@ -814,7 +1326,7 @@ KMOD_EXPORT const char *kmod_module_get_path(const struct kmod_module *mod)
 	kmod_module_parse_depline((struct kmod_module *) mod, line);
 	free(line);
 
-	return mod->path;
+	return __atomic_load_n(&mod->path, __ATOMIC_ACQUIRE);
 }
 
 
@@ -849,69 +1361,98 @@ KMOD_EXPORT int kmod_module_remove_module(struct kmod_module *mod,
 	flags &= KMOD_REMOVE_FORCE;
 	flags |= KMOD_REMOVE_NOWAIT;
 
+	kmod_pool_lock(mod->ctx);
+	kmod_loaded_drop(mod->ctx);
+	kmod_pool_unlock(mod->ctx);
+
+	KMOD_PROBE1(remove_module_entry, mod->name);
 	err = delete_module(mod->name, flags);
 	if (err != 0) {
 		err = -errno;
 		if (!(libkmod_flags & KMOD_REMOVE_NOLOG))
 			ERR(mod->ctx, "could not remove '%s': %m\n", mod->name);
 	}
+	KMOD_PROBE2(remove_module_return, mod->name, err);
 
 	return err;
 }
 
 extern long init_module(const void *mem, unsigned long len, const char *args);
 
-static int do_finit_module(struct kmod_module *mod, unsigned int flags,
-			   const char *args)
+static int do_finit_module(struct kmod_module *mod, struct kmod_file *file,
+			   unsigned int flags, const char *args)
 {
 	enum kmod_file_compression_type compression, kernel_compression;
 	unsigned int kernel_flags = 0;
-	int err;
+	bool memfd = false;
+	int err, fd;
 
 	/*
 	 * When module is not compressed or its compression type matches the
 	 * one in use by the kernel, there is no need to read the file
-	 * in userspace. Otherwise, re-use ENOSYS to trigger the same fallback
-	 * as when finit_module() is not supported.
+	 * in userspace. Otherwise decompress it into a memfd and hand that
+	 * over: if that or finit_module() on it fails, re-use ENOSYS to
+	 * trigger the same fallback as when finit_module() is not supported.
 	 */
-	compression = kmod_file_get_compression(mod->file);
+	compression = kmod_file_get_compression(file);
 	kernel_compression = kmod_get_kernel_compression(mod->ctx);
-	if (!(compression == KMOD_FILE_COMPRESSION_NONE ||
-	      compression == kernel_compression))
-		return -ENOSYS;
-
-	if (compression != KMOD_FILE_COMPRESSION_NONE)
+	if (compression == KMOD_FILE_COMPRESSION_NONE) {
+		fd = kmod_file_get_fd(file);
+	} else if (compression == kernel_compression) {
+		fd = kmod_file_get_fd(file);
 		kernel_flags |= MODULE_INIT_COMPRESSED_FILE;
+	} else {
+		fd = kmod_file_get_memfd(file);
+		if (fd < 0) {
+			DBG(mod->ctx, "could not decompress '%s' to a memfd: %s\n",
+			    mod->name, strerror(-fd));
+			return -ENOSYS;
+		}
+		memfd = true;
+	}
 
 	if (flags & KMOD_INSERT_FORCE_VERMAGIC)
 		kernel_flags |= MODULE_INIT_IGNORE_VERMAGIC;
 	if (flags & KMOD_INSERT_FORCE_MODVERSION)
 		kernel_flags |= MODULE_INIT_IGNORE_MODVERSIONS;
 
-	err = finit_module(kmod_file_get_fd(mod->file), args, kernel_flags);
+	err = finit_module(fd, args, kernel_flags);
 	if (err < 0)
 		err = -errno;
 
+	/* init_module() would only say the same */
+	if (memfd && err < 0 && err != -EEXIST) {
+		DBG(mod->ctx, "could not insert '%s' from a memfd: %s\n",
+		    mod->name, strerror(-err));
+		return -ENOSYS;
+	}
+
 	return err;
 }
 
-static int do_init_module(struct kmod_module *mod, unsigned int flags,
-			  const char *args)
+static int do_init_module(struct kmod_module *mod, struct kmod_file *file,
+			  unsigned int flags, const char *args)
 {
 	struct kmod_elf *elf;
 	const void *mem;
 	off_t size;
 	int err;
 
-	kmod_file_load_contents(mod->file);
+	err = kmod_file_load_contents(file);
+	if (err < 0)
+		return err;
 
 	if (flags & (KMOD_INSERT_FORCE_VERMAGIC | KMOD_INSERT_FORCE_MODVERSION)) {
-		elf = kmod_file_get_elf(mod->file);
+		elf = kmod_file_get_elf(file);
 		if (elf == NULL) {
 			err = -errno;
 			return err;
 		}
 
+		/* patch the image itself rather than a full copy of it */
+		if (kmod_file_make_writable(file) == 0)
+			kmod_elf_set_writable(elf);
+
 		if (flags & KMOD_INSERT_FORCE_MODVERSION) {
 			err = kmod_elf_strip_section(elf, "__versions");
 			if (err < 0)
@@ -926,9 +1467,9 @@ static int do_init_module(struct kmod_module *mod, unsigned int flags,
 
 		mem = kmod_elf_get_memory(elf);
 	} else {
-		mem = kmod_file_get_contents(mod->file);
+		mem = kmod_file_get_contents(file);
 	}
-	size = kmod_file_get_size(mod->file);
+	size = kmod_file_get_size(file);
 
 	err = init_module(mem, size, args);
 	if (err < 0)
@@ -937,6 +1478,18 @@ static int do_init_module(struct kmod_module *mod, unsigned int flags,
 	return err;
 }
 
+static int module_open_file(struct kmod_module *mod, const char *path)
+{
+	if (mod->file != NULL)
+		return 0;
+
+	mod->file = kmod_file_open(mod->ctx, path);
+	if (mod->file == NULL)
+		return -errno;
+
+	return 0;
+}
+
 /**
  * kmod_module_insert_module:
  * @mod: kmod module
@@ -956,6 +1509,8 @@ KMOD_EXPORT int kmod_module_insert_module(struct kmod_module *mod,
 							unsigned int flags,
 							const char *options)
 {
+	struct kmod_file *file;
+	unsigned long long t0;
 	int err;
 	const char *path;
 	const char *args = options ? options : "";
@@ -969,17 +1524,35 @@ KMOD_EXPORT int kmod_module_insert_module(struct kmod_module *mod,
 		return -ENOENT;
 	}
 
-	if (!mod->file) {
-		mod->file = kmod_file_open(mod->ctx, path);
-		if (mod->file == NULL) {
-			err = -errno;
-			return err;
-		}
+	err = module_open_file(mod, path);
+	if (err < 0)
+		return err;
+
+	/*
+	 * The decompressed-module cache is only for reading modules: the
+	 * kernel gets an image decompressed right here.
+	 */
+	file = mod->file;
+	if (kmod_file_uses_cache(file)) {
+		file = kmod_file_open_uncached(mod->ctx, path);
+		if (file == NULL)
+			return -errno;
 	}
 
-	err = do_finit_module(mod, flags, args);
+	kmod_pool_lock(mod->ctx);
+	kmod_loaded_drop(mod->ctx);
+	kmod_pool_unlock(mod->ctx);
+
+	KMOD_PROBE2(insert_module_entry, mod->name, path);
+	t0 = now_usec();
+	err = do_finit_module(mod, file, flags, args);
 	if (err == -ENOSYS)
-		err = do_init_module(mod, flags, args);
+		err = do_init_module(mod, file, flags, args);
+	kmod_stat_add(mod->ctx, KMOD_STAT_INSERT_USEC, now_usec() - t0);
+	KMOD_PROBE2(insert_module_return, mod->name, err);
+
+	if (file != mod->file)
+		kmod_file_unref(file);
 
 	if (err < 0)
 		INFO(mod->ctx, "Failed to insert module '%s': %s\n",
@@ -992,17 +1565,10 @@ static bool module_is_blacklisted(struct kmod_module *mod)
 {
 	struct kmod_ctx *ctx = mod->ctx;
 	const struct kmod_config *config = kmod_get_config(ctx);
-	const struct kmod_list *bl = config->blacklists;
-	const struct kmod_list *l;
+	unsigned int cursor = 0;
 
-	kmod_list_foreach(l, bl) {
-		const char *modname = kmod_blacklist_get_modname(l);
-
-		if (streq(modname, mod->name))
-			return true;
-	}
-
-	return false;
+	return kmod_config_match(config, CONFIG_TYPE_BLACKLIST, mod->name,
+						false, &cursor) != NULL;
 }
 
 /**
@@ -1070,13 +1636,10 @@ static int command_do(struct kmod_module *mod, const char *type,
 
 	DBG(mod->ctx, "%s %s\n", type, cmd);
 
-	setenv("MODPROBE_MODULE", modname, 1);
-	err = system(cmd);
-	unsetenv("MODPROBE_MODULE");
-
-	if (err == -1) {
-		ERR(mod->ctx, "Could not run %s command '%s' for module %s: %m\n",
-		    type, cmd, modname);
+	err = run_command(cmd, modname);
+	if (err < 0) {
+		ERR(mod->ctx, "Could not run %s command '%s' for module %s: %s\n",
+		    type, cmd, modname, strerror(-err));
 		return -EINVAL;
 	}
 
@@ -1273,6 +1836,226 @@ finish:
 	return err;
 }
 
+#define KMOD_PROBE_CACHE_MAX (128)
+
+/*
+ * A probe list computed by __kmod_module_get_probe_list(), keyed by the
+ * ignorecmd argument and the pool key of the module it was computed for.
+ * Each module of the list follows as the ignorecmd and required flags it
+ * was left with, then its pool key. Like in the lookup cache, modules are
+ * not referenced from here: softdeps may form loops, and the modules are
+ * found in the pool again on a hit.
+ */
+struct kmod_probe_entry {
+	struct kmod_probe_entry *prev, *next;
+	unsigned int n_mods;
+	char key[];
+};
+
+#define PROBE_ENTRY_IGNORECMD	0x1
+#define PROBE_ENTRY_REQUIRED	0x2
+
+static void probe_cache_unlink(struct kmod_probe_cache *cache,
+					struct kmod_probe_entry *entry)
+{
+	if (entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		cache->head = entry->next;
+
+	if (entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		cache->tail = entry->prev;
+}
+
+static void probe_cache_link(struct kmod_probe_cache *cache,
+					struct kmod_probe_entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = cache->head;
+	if (cache->head != NULL)
+		cache->head->prev = entry;
+	else
+		cache->tail = entry;
+	cache->head = entry;
+}
+
+static void probe_cache_drop(struct kmod_probe_cache *cache,
+					struct kmod_probe_entry *entry)
+{
+	probe_cache_unlink(cache, entry);
+	hash_del(cache->entries, entry->key);
+}
+
+void kmod_module_probe_cache_flush(struct kmod_ctx *ctx)
+{
+	struct kmod_probe_cache *cache = kmod_get_probe_cache(ctx);
+
+	kmod_pool_lock(ctx);
+	while (cache->tail != NULL)
+		probe_cache_drop(cache, cache->tail);
+	kmod_pool_unlock(ctx);
+}
+
+static char *probe_cache_key(const struct kmod_module *mod, bool ignorecmd)
+{
+	char *key;
+
+	if (asprintf(&key, "%c%s", ignorecmd ? '1' : '0', mod->hashkey) < 0)
+		return NULL;
+
+	return key;
+}
+
+/*
+ * Returns 1 and the cached probe list of @mod in @list on a hit, with the
+ * flags of its modules restored, 0 on a miss, < 0 on error. Modules not in
+ * the list must already have their required flag cleared.
+ */
+static int probe_cache_get(struct kmod_module *mod, bool ignorecmd,
+						struct kmod_list **list)
+{
+	struct kmod_probe_cache *cache = kmod_get_probe_cache(mod->ctx);
+	struct kmod_module *failed = NULL;
+	struct kmod_probe_entry *entry;
+	_cleanup_free_ char *key = NULL;
+	const char *p;
+	unsigned int i;
+	int ret = 0;
+
+	if (cache->entries == NULL)
+		return 0;
+
+	key = probe_cache_key(mod, ignorecmd);
+	if (key == NULL)
+		return -ENOMEM;
+
+	kmod_pool_lock(mod->ctx);
+
+	entry = hash_find(cache->entries, key);
+	if (entry == NULL)
+		goto out;
+
+	p = entry->key + strlen(entry->key) + 1;
+	for (i = 0; i < entry->n_mods; i++) {
+		size_t keylen = strlen(p + 1);
+		struct kmod_module *m;
+		struct kmod_list *l;
+
+		m = kmod_pool_get_module(mod->ctx, p + 1, keylen);
+		if (m == NULL) {
+			probe_cache_drop(cache, entry);
+			goto out;
+		}
+
+		l = kmod_list_append(*list, kmod_module_ref_pooled(m));
+		if (l == NULL) {
+			/* modules can only be released without the lock held */
+			failed = m;
+			ret = -ENOMEM;
+			goto out;
+		}
+		*list = l;
+
+		m->ignorecmd = !!(p[0] & PROBE_ENTRY_IGNORECMD);
+		m->required = !!(p[0] & PROBE_ENTRY_REQUIRED);
+
+		p += keylen + 2;
+	}
+
+	if (entry != cache->head) {
+		probe_cache_unlink(cache, entry);
+		probe_cache_link(cache, entry);
+	}
+
+	DBG(mod->ctx, "cached probe list of %s n_mods=%u\n", mod->name,
+								entry->n_mods);
+
+	ret = 1;
+
+out:
+	kmod_pool_unlock(mod->ctx);
+
+	if (ret <= 0) {
+		kmod_module_unref(failed);
+		kmod_module_unref_list(*list);
+		*list = NULL;
+	}
+
+	return ret;
+}
+
+static void probe_cache_add(struct kmod_module *mod, bool ignorecmd,
+					const struct kmod_list *list)
+{
+	struct kmod_probe_cache *cache = kmod_get_probe_cache(mod->ctx);
+	struct kmod_probe_entry *entry;
+	_cleanup_free_ char *key = NULL;
+	const struct kmod_list *l;
+	unsigned int n_mods = 0;
+	size_t keylen, len;
+	char *p;
+
+	key = probe_cache_key(mod, ignorecmd);
+	if (key == NULL)
+		return;
+
+	keylen = strlen(key) + 1;
+	len = keylen;
+	kmod_list_foreach(l, list) {
+		const struct kmod_module *m = l->data;
+
+		len += strlen(m->hashkey) + 2;
+		n_mods++;
+	}
+
+	entry = malloc(sizeof(*entry) + len);
+	if (entry == NULL)
+		return;
+
+	entry->n_mods = n_mods;
+	p = memcpy(entry->key, key, keylen);
+	p += keylen;
+	kmod_list_foreach(l, list) {
+		const struct kmod_module *m = l->data;
+		size_t mlen = strlen(m->hashkey) + 1;
+
+		*p++ = (m->ignorecmd ? PROBE_ENTRY_IGNORECMD : 0) |
+			(m->required ? PROBE_ENTRY_REQUIRED : 0);
+		memcpy(p, m->hashkey, mlen);
+		p += mlen;
+	}
+
+	kmod_pool_lock(mod->ctx);
+
+	if (cache->entries == NULL) {
+		cache->entries = hash_new(KMOD_PROBE_CACHE_MAX, free);
+		if (cache->entries == NULL)
+			goto fail;
+	}
+
+	if (hash_get_count(cache->entries) >= KMOD_PROBE_CACHE_MAX)
+		probe_cache_drop(cache, cache->tail);
+
+	/* another thread may have cached the same list meanwhile */
+	if (hash_add_unique(cache->entries, entry->key, entry) < 0)
+		goto fail;
+
+	probe_cache_link(cache, entry);
+	kmod_pool_unlock(mod->ctx);
+	return;
+
+fail:
+	kmod_pool_unlock(mod->ctx);
+	free(entry);
+}
+
+/*
+ * The probe list of a module only depends on modules.dep and on the
+ * configuration, so it's cached in the context until
+ * kmod_validate_resources() finds them changed.
+ */
 static int kmod_module_get_probe_list(struct kmod_module *mod,
 						bool ignorecmd,
 						struct kmod_list **list)
@@ -1288,26 +2071,645 @@ static int kmod_module_get_probe_list(struct kmod_module *mod,
 	kmod_set_modules_visited(mod->ctx, false);
 	kmod_set_modules_required(mod->ctx, false);
 
+	err = probe_cache_get(mod, ignorecmd, list);
+	if (err != 0)
+		return err < 0 ? err : 0;
+
 	err = __kmod_module_get_probe_list(mod, true, ignorecmd, list);
 	if (err < 0) {
 		kmod_module_unref_list(*list);
 		*list = NULL;
+		return err;
 	}
 
+	probe_cache_add(mod, ignorecmd, *list);
+
 	return err;
 }
 
-/**
- * kmod_module_probe_insert_module:
- * @mod: kmod module
- * @flags: flags are not passed to Linux Kernel, but instead they dictate the
- * behavior of this function, valid flags are
- * KMOD_PROBE_FORCE_VERMAGIC: ignore kernel version magic;
- * KMOD_PROBE_FORCE_MODVERSION: ignore symbol version hashes;
- * KMOD_PROBE_IGNORE_COMMAND: whether the probe should ignore install
- * commands and softdeps configured in the system;
- * KMOD_PROBE_IGNORE_LOADED: do not check whether the module is already
- * live in kernel or not;
+/*
+ * Treat "already loaded" error. If we were told to stop on already loaded
+ * and the module being loaded is not a softdep or dep, bail out. Otherwise,
+ * just ignore and continue.
+ *
+ * We need to check here because of race conditions. We checked first if
+ * module was already loaded but it may have been loaded between the check
+ * and the moment we try to insert it.
+ *
+ * Errors from softdeps are ignored as well. Returns true if the probe must
+ * stop, with @err set to what it returns.
+ */
+static bool probe_insert_stop(bool target, bool required, unsigned int flags,
+								int *err)
+{
+	if (*err == -EEXIST && target && (flags & KMOD_PROBE_FAIL_ON_LOADED))
+		return true;
+
+	if (*err == -EEXIST || !required) {
+		*err = 0;
+		return false;
+	}
+
+	return *err < 0;
+}
+
+/*
+ * The modules live in the kernel, read once from /proc/modules for the
+ * checks of a probe list instead of opening /sys/module/<name>/initstate
+ * for each of its modules. Modules inserted by the probe are added as they
+ * go. Modules whose line can't be parsed are kept as unknown and checked
+ * in /sys, as is everything when the set couldn't be read (NULL).
+ */
+struct probe_loaded_entry {
+	bool unknown;
+	char name[];
+};
+
+static int probe_loaded_add(struct hash *loaded, const char *name,
+						size_t namelen, bool unknown)
+{
+	struct probe_loaded_entry *e;
+	int err;
+
+	e = malloc(sizeof(*e) + namelen + 1);
+	if (e == NULL)
+		return -ENOMEM;
+
+	e->unknown = unknown;
+	memcpy(e->name, name, namelen);
+	e->name[namelen] = '\0';
+
+	err = hash_add(loaded, e->name, e);
+	if (err < 0)
+		free(e);
+
+	return err;
+}
+
+static struct hash *probe_loaded_read(struct kmod_ctx *ctx)
+{
+	struct hash *loaded;
+	char line[4096];
+	FILE *fp;
+
+	fp = fopen("/proc/modules", "re");
+	if (fp == NULL) {
+		DBG(ctx, "could not open /proc/modules: %m\n");
+		return NULL;
+	}
+
+	loaded = hash_new(64, free);
+	if (loaded == NULL)
+		goto fail;
+
+	while (fgets(line, sizeof(line), fp)) {
+		size_t len = strlen(line);
+		bool truncated = line[len - 1] != '\n';
+		char *saveptr, *name, *state = NULL;
+		unsigned int i;
+		int err;
+
+		name = strtok_r(line, " \t\n", &saveptr);
+		if (name == NULL)
+			goto eat_line;
+
+		/* size, refcnt and holders come before the state */
+		for (i = 0; i < 4; i++)
+			state = strtok_r(NULL, " \t\n", &saveptr);
+
+		if (truncated || state == NULL)
+			err = probe_loaded_add(loaded, name, strlen(name), true);
+		else if (streq(state, "Live"))
+			err = probe_loaded_add(loaded, name, strlen(name), false);
+		else
+			err = 0;
+		if (err < 0)
+			goto fail;
+eat_line:
+		while (truncated && fgets(line, sizeof(line), fp)) {
+			len = strlen(line);
+			truncated = line[len - 1] != '\n';
+		}
+	}
+
+	fclose(fp);
+	return loaded;
+
+fail:
+	ERR(ctx, "out of memory\n");
+	hash_free(loaded);
+	fclose(fp);
+	return NULL;
+}
+
+static bool probe_loaded_has(struct hash *loaded, struct kmod_module *mod)
+{
+	const struct probe_loaded_entry *e;
+
+	if (loaded == NULL)
+		return module_is_inkernel(mod);
+
+	if (kmod_module_is_builtin(mod))
+		return true;
+
+	e = hash_find(loaded, mod->name);
+	if (e == NULL)
+		return false;
+	if (e->unknown)
+		return module_is_inkernel(mod);
+
+	return true;
+}
+
+/* called once @mod was inserted */
+static void probe_loaded_set(struct hash *loaded, struct kmod_module *mod)
+{
+	if (loaded == NULL)
+		return;
+
+	if (probe_loaded_add(loaded, mod->name, strlen(mod->name), false) < 0)
+		DBG(mod->ctx, "could not add '%s' to the live modules\n",
+								mod->name);
+}
+
+/*
+ * Probe lists inserted as a graph: each module waits for its dependencies,
+ * its pre softdeps and the modules that have it as post softdep, in case
+ * they come before it in the list. Modules backed by an install command
+ * are run alone, after everything before them in the list and before
+ * everything after.
+ *
+ * The callbacks and everything but the insertion itself run in the calling
+ * thread, the insertions run in a pool of workers. Without workers the
+ * nodes are inserted in the calling thread, in list order.
+ *
+ * What kmod_module_get_probe_list() leaves in the modules is copied to the
+ * nodes, since the list of each target is built anew.
+ */
+struct probe_node {
+	struct kmod_module *mod;
+	char *options;
+	unsigned int n_waiting;
+	bool target;
+	bool required;
+	bool barrier;
+	bool dispatched;
+	int err;
+};
+
+struct probe_sched {
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t finished;
+	unsigned int flags;
+	const char *extra_options;
+	/* see probe_loaded_read(), may be NULL */
+	struct hash *loaded;
+	unsigned int n, n_targets;
+	struct probe_node *nodes;
+	/* waits[i * n + j]: node i can't be inserted before node j is done */
+	bool *waits;
+	/* both only grow, as each node is queued and finished once */
+	unsigned int *queue, queue_head, queue_tail;
+	unsigned int *done, done_head, done_tail;
+	bool exit;
+};
+
+static int probe_sched_index(const struct probe_sched *sched,
+						const struct kmod_module *m)
+{
+	unsigned int i;
+
+	for (i = 0; i < sched->n; i++) {
+		if (sched->nodes[i].mod == m)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Append the probe list of @target to the nodes, skipping modules already
+ * there.
+ */
+static int probe_sched_add_list(struct probe_sched *sched,
+				struct kmod_module *target,
+				struct kmod_list *list)
+{
+	struct probe_node *nodes;
+	struct kmod_list *l;
+	unsigned int n = 0;
+
+	if (list == NULL)
+		return 0;
+
+	kmod_list_foreach(l, list)
+		n++;
+
+	nodes = realloc(sched->nodes, sizeof(*nodes) * (sched->n + n));
+	if (nodes == NULL)
+		return -ENOMEM;
+	memset(nodes + sched->n, 0, sizeof(*nodes) * n);
+	sched->nodes = nodes;
+
+	kmod_list_foreach(l, list) {
+		struct kmod_module *m = l->data;
+		struct probe_node *node;
+		int idx = probe_sched_index(sched, m);
+
+		if (idx >= 0) {
+			node = &sched->nodes[idx];
+			node->required |= m->required;
+			node->target |= m == target;
+			continue;
+		}
+
+		node = &sched->nodes[sched->n++];
+		node->mod = kmod_module_ref(m);
+		node->target = m == target;
+		node->required = m->required;
+		node->barrier = !m->ignorecmd &&
+				kmod_module_get_install_commands(m) != NULL;
+	}
+
+	sched->n_targets++;
+
+	return 0;
+}
+
+static void probe_sched_free(struct probe_sched *sched)
+{
+	unsigned int i;
+
+	if (sched->nodes != NULL) {
+		for (i = 0; i < sched->n; i++) {
+			free(sched->nodes[i].options);
+			kmod_module_unref(sched->nodes[i].mod);
+		}
+	}
+	free(sched->done);
+	free(sched->queue);
+	free(sched->waits);
+	free(sched->nodes);
+}
+
+static int probe_sched_fill_edges(struct probe_sched *sched)
+{
+	unsigned int i, j, n = sched->n;
+
+	sched->waits = calloc((size_t)n * n, sizeof(*sched->waits));
+	if (sched->waits == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		struct probe_node *node = &sched->nodes[i];
+		struct kmod_list *dep, *pre = NULL, *post = NULL, *l;
+		int idx, err;
+
+		if (node->barrier) {
+			for (j = 0; j < i; j++)
+				sched->waits[i * n + j] = true;
+			for (j = i + 1; j < n; j++)
+				sched->waits[j * n + i] = true;
+		}
+
+		dep = kmod_module_get_dependencies(node->mod);
+		kmod_list_foreach(l, dep) {
+			idx = probe_sched_index(sched, l->data);
+			if (idx >= 0 && (unsigned int)idx < i)
+				sched->waits[i * n + idx] = true;
+		}
+		kmod_module_unref_list(dep);
+
+		err = kmod_module_get_softdeps(node->mod, &pre, &post);
+		if (err < 0)
+			return err;
+
+		kmod_list_foreach(l, pre) {
+			idx = probe_sched_index(sched, l->data);
+			if (idx >= 0 && (unsigned int)idx < i)
+				sched->waits[i * n + idx] = true;
+		}
+		kmod_list_foreach(l, post) {
+			idx = probe_sched_index(sched, l->data);
+			if (idx >= 0 && (unsigned int)idx > i)
+				sched->waits[idx * n + i] = true;
+		}
+		kmod_module_unref_list(pre);
+		kmod_module_unref_list(post);
+	}
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < i; j++) {
+			if (sched->waits[i * n + j])
+				sched->nodes[i].n_waiting++;
+		}
+	}
+
+	return 0;
+}
+
+static void *probe_sched_worker(void *data)
+{
+	struct probe_sched *sched = data;
+
+	pthread_mutex_lock(&sched->lock);
+
+	for (;;) {
+		struct probe_node *node;
+		unsigned int i;
+		int err;
+
+		while (!sched->exit && sched->queue_head == sched->queue_tail)
+			pthread_cond_wait(&sched->queued, &sched->lock);
+
+		if (sched->queue_head == sched->queue_tail)
+			break;
+
+		i = sched->queue[sched->queue_head++];
+		node = &sched->nodes[i];
+		pthread_mutex_unlock(&sched->lock);
+
+		err = kmod_module_insert_module(node->mod, sched->flags,
+							node->options);
+
+		pthread_mutex_lock(&sched->lock);
+		node->err = err;
+		sched->done[sched->done_tail++] = i;
+		pthread_cond_signal(&sched->finished);
+	}
+
+	pthread_mutex_unlock(&sched->lock);
+
+	return NULL;
+}
+
+static unsigned int probe_sched_jobs(const struct probe_sched *sched)
+{
+	long ncpus;
+
+	if (!(sched->flags & KMOD_PROBE_PARALLEL) ||
+			(sched->flags & KMOD_PROBE_DRY_RUN) || sched->n < 2)
+		return 0;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+
+	return (unsigned long)ncpus < sched->n ? (unsigned int)ncpus : sched->n;
+}
+
+/*
+ * Mark node @i as done. If it failed the probe stops, or with several
+ * targets, only the nodes waiting for it are dropped, with the same error.
+ * Returns true if the probe must stop.
+ */
+static bool probe_sched_finish(struct probe_sched *sched, unsigned int i,
+								int *err)
+{
+	struct probe_node *node = &sched->nodes[i];
+	unsigned int j, n = sched->n;
+	bool failed;
+
+	if (*err == 0 && !node->barrier && !(sched->flags & KMOD_PROBE_DRY_RUN))
+		probe_loaded_set(sched->loaded, node->mod);
+
+	failed = probe_insert_stop(node->target, node->required,
+							sched->flags, err);
+	if (failed && sched->n_targets > 1) {
+		ERR(node->mod->ctx, "could not insert '%s': %s\n",
+					node->mod->name, strerror(-*err));
+
+		for (j = i + 1; j < n; j++) {
+			if (sched->waits[j * n + i] && !sched->nodes[j].dispatched) {
+				sched->nodes[j].dispatched = true;
+				sched->nodes[j].err = *err;
+				probe_sched_finish(sched, j, &sched->nodes[j].err);
+			}
+		}
+		failed = false;
+	}
+
+	for (j = i + 1; j < n; j++) {
+		if (sched->waits[j * n + i])
+			sched->nodes[j].n_waiting--;
+	}
+
+	return failed;
+}
+
+static int probe_sched_run(struct probe_sched *sched,
+			struct probe_insert_cb *cb,
+			void (*print_action)(struct kmod_module *m,
+						bool install,
+						const char *options))
+{
+	unsigned int flags = sched->flags;
+	pthread_t *workers = NULL;
+	unsigned int i, n_workers = 0, n_running = 0, jobs;
+	bool stop = false;
+	int err, ret = 0;
+
+	sched->queue = calloc(sched->n, sizeof(*sched->queue));
+	sched->done = calloc(sched->n, sizeof(*sched->done));
+	if (sched->queue == NULL || sched->done == NULL)
+		return -ENOMEM;
+
+	ret = probe_sched_fill_edges(sched);
+	if (ret < 0)
+		return ret;
+
+	jobs = probe_sched_jobs(sched);
+	if (jobs > 0) {
+		workers = malloc(sizeof(*workers) * jobs);
+		if (workers == NULL)
+			return -ENOMEM;
+	}
+
+	pthread_mutex_init(&sched->lock, NULL);
+	pthread_cond_init(&sched->queued, NULL);
+	pthread_cond_init(&sched->finished, NULL);
+
+	/* with no worker at all, insert from this thread */
+	for (; n_workers < jobs; n_workers++) {
+		if (pthread_create(&workers[n_workers], NULL,
+					probe_sched_worker, sched) != 0)
+			break;
+	}
+
+	pthread_mutex_lock(&sched->lock);
+
+	for (;;) {
+		bool progress = false;
+
+		for (i = 0; !stop && i < sched->n; i++) {
+			struct probe_node *node = &sched->nodes[i];
+			struct kmod_module *m = node->mod;
+			const char *moptions;
+
+			if (node->dispatched || node->n_waiting > 0)
+				continue;
+			if (n_workers > 0 && n_running == n_workers)
+				break;
+
+			node->dispatched = true;
+			progress = true;
+			pthread_mutex_unlock(&sched->lock);
+
+			if (!(flags & KMOD_PROBE_IGNORE_LOADED)
+					&& probe_loaded_has(sched->loaded, m)) {
+				DBG(m->ctx, "Ignoring module '%s': already loaded\n",
+								m->name);
+				err = -EEXIST;
+				goto finish_inline;
+			}
+
+			moptions = kmod_module_get_options(m);
+			node->options = module_options_concat(moptions,
+				node->target ? sched->extra_options : NULL);
+
+			if (node->barrier) {
+				if (print_action != NULL)
+					print_action(m, true,
+						node->options ?: "");
+
+				err = 0;
+				if (!(flags & KMOD_PROBE_DRY_RUN))
+					err = module_do_install_commands(m,
+							node->options, cb);
+				goto finish_inline;
+			}
+
+			if (print_action != NULL)
+				print_action(m, false, node->options ?: "");
+
+			if (n_workers == 0) {
+				err = 0;
+				if (!(flags & KMOD_PROBE_DRY_RUN))
+					err = kmod_module_insert_module(m, flags,
+								node->options);
+				goto finish_inline;
+			}
+
+			pthread_mutex_lock(&sched->lock);
+			sched->queue[sched->queue_tail++] = i;
+			n_running++;
+			pthread_cond_signal(&sched->queued);
+			continue;
+
+finish_inline:
+			pthread_mutex_lock(&sched->lock);
+			if (probe_sched_finish(sched, i, &err)) {
+				stop = true;
+				ret = err;
+			} else if (err < 0 && ret == 0) {
+				ret = err;
+			}
+		}
+
+		if (progress)
+			continue;
+		if (n_running == 0)
+			break;
+
+		while (sched->done_head == sched->done_tail)
+			pthread_cond_wait(&sched->finished, &sched->lock);
+
+		while (sched->done_head < sched->done_tail) {
+			i = sched->done[sched->done_head++];
+			n_running--;
+
+			err = sched->nodes[i].err;
+			if (probe_sched_finish(sched, i, &err) && !stop) {
+				stop = true;
+				ret = err;
+			} else if (err < 0 && ret == 0) {
+				ret = err;
+			}
+		}
+	}
+
+	sched->exit = true;
+	pthread_cond_broadcast(&sched->queued);
+	pthread_mutex_unlock(&sched->lock);
+
+	for (i = 0; i < n_workers; i++)
+		pthread_join(workers[i], NULL);
+
+	pthread_cond_destroy(&sched->finished);
+	pthread_cond_destroy(&sched->queued);
+	pthread_mutex_destroy(&sched->lock);
+	free(workers);
+
+	return ret;
+}
+
+/*
+ * Checks done on @mod before inserting it and build its probe list. Returns
+ * 0 with an empty @list if there's nothing to do, or the reason why it must
+ * not be inserted.
+ */
+static int probe_get_list(struct kmod_module *mod, unsigned int flags,
+						struct kmod_list **list)
+{
+	int err;
+
+	*list = NULL;
+
+	if (!(flags & KMOD_PROBE_IGNORE_LOADED)
+					&& module_is_inkernel(mod)) {
+		if (flags & KMOD_PROBE_FAIL_ON_LOADED)
+			return -EEXIST;
+		else
+			return 0;
+	}
+
+	/*
+	 * Ugly assignement + check. We need to check if we were told to check
+	 * blacklist and also return the reason why we failed.
+	 * KMOD_PROBE_APPLY_BLACKLIST_ALIAS_ONLY will take effect only if the
+	 * module is an alias, so we also need to check it
+	 */
+	if ((mod->alias != NULL && ((err = flags & KMOD_PROBE_APPLY_BLACKLIST_ALIAS_ONLY)))
+			|| (err = flags & KMOD_PROBE_APPLY_BLACKLIST_ALL)
+			|| (err = flags & KMOD_PROBE_APPLY_BLACKLIST)) {
+		if (module_is_blacklisted(mod))
+			return err;
+	}
+
+	err = kmod_module_get_probe_list(mod,
+				!!(flags & KMOD_PROBE_IGNORE_COMMAND), list);
+	if (err < 0)
+		return err;
+
+	if (flags & KMOD_PROBE_APPLY_BLACKLIST_ALL) {
+		struct kmod_list *filtered = NULL;
+
+		err = kmod_module_apply_filter(mod->ctx,
+				KMOD_FILTER_BLACKLIST, *list, &filtered);
+		if (err < 0)
+			return err;
+
+		kmod_module_unref_list(*list);
+		*list = filtered;
+		if (filtered == NULL)
+			return KMOD_PROBE_APPLY_BLACKLIST_ALL;
+	}
+
+	return 0;
+}
+
+/**
+ * kmod_module_probe_insert_module:
+ * @mod: kmod module
+ * @flags: flags are not passed to Linux Kernel, but instead they dictate the
+ * behavior of this function, valid flags are
+ * KMOD_PROBE_FORCE_VERMAGIC: ignore kernel version magic;
+ * KMOD_PROBE_FORCE_MODVERSION: ignore symbol version hashes;
+ * KMOD_PROBE_IGNORE_COMMAND: whether the probe should ignore install
+ * commands and softdeps configured in the system;
+ * KMOD_PROBE_IGNORE_LOADED: do not check whether the module is already
+ * live in kernel or not;
  * KMOD_PROBE_DRY_RUN: dry run, do not insert module, just call the
  * associated callback function;
  * KMOD_PROBE_FAIL_ON_LOADED: if KMOD_PROBE_IGNORE_LOADED is not specified
@@ -1319,7 +2721,9 @@ static int kmod_module_get_probe_list(struct kmod_module *mod,
  * module is already live in kernel;
  * KMOD_PROBE_APPLY_BLACKLIST: probe will fail if the module is blacklisted;
  * KMOD_PROBE_APPLY_BLACKLIST_ALIAS_ONLY: probe will fail if the module is an
- * alias and is blacklisted.
+ * alias and is blacklisted;
+ * KMOD_PROBE_PARALLEL: insert modules that don't depend on each other
+ * concurrently, see below.
  * @extra_options: module's options to pass to Linux Kernel. It applies only
  * to @mod, not to its dependencies.
  * @run_install: function to run when @mod is backed by an install command.
@@ -1331,10 +2735,19 @@ static int kmod_module_get_probe_list(struct kmod_module *mod,
  * Insert a module in Linux kernel resolving dependencies, soft dependencies,
  * install commands and applying blacklist.
  *
- * If @run_install is NULL, this function will fork and exec by calling
- * system(3). Don't pass a NULL argument in @run_install if your binary is
- * setuid/setgid (see warning in system(3)). If you need control over the
- * execution of an install command, give a callback function instead.
+ * If @run_install is NULL, this function will spawn the command with
+ * posix_spawn(3), through /bin/sh unless it's a plain list of words, with
+ * MODPROBE_MODULE set in its environment. Don't pass a NULL argument in
+ * @run_install if your binary is setuid/setgid (see warning in system(3)).
+ * If you need control over the execution of an install command, give a
+ * callback function instead.
+ *
+ * With KMOD_PROBE_PARALLEL each module is inserted as soon as the modules it
+ * depends on, including through softdeps, are live, using up to one thread
+ * per online CPU. Modules with install commands are still run one at a time,
+ * in order. @run_install and @print_action are called from the calling
+ * thread, but the log function of the context may be called from the
+ * threads inserting modules. The flag is ignored with KMOD_PROBE_DRY_RUN.
  *
  * Returns: 0 on success, > 0 if stopped by a reason given in @flags or < 0 on
  * failure.
@@ -1348,119 +2761,663 @@ KMOD_EXPORT int kmod_module_probe_insert_module(struct kmod_module *mod,
 						bool install,
 						const char *options))
 {
-	struct kmod_list *list = NULL, *l;
+	struct kmod_list *list, *l;
 	struct probe_insert_cb cb;
+	struct hash *loaded = NULL;
 	int err;
 
 	if (mod == NULL)
 		return -ENOENT;
 
-	if (!(flags & KMOD_PROBE_IGNORE_LOADED)
-					&& module_is_inkernel(mod)) {
-		if (flags & KMOD_PROBE_FAIL_ON_LOADED)
-			return -EEXIST;
-		else
-			return 0;
+	err = probe_get_list(mod, flags, &list);
+	if (err != 0 || list == NULL) {
+		kmod_module_unref_list(list);
+		return err;
 	}
 
-	/*
-	 * Ugly assignement + check. We need to check if we were told to check
-	 * blacklist and also return the reason why we failed.
-	 * KMOD_PROBE_APPLY_BLACKLIST_ALIAS_ONLY will take effect only if the
-	 * module is an alias, so we also need to check it
-	 */
-	if ((mod->alias != NULL && ((err = flags & KMOD_PROBE_APPLY_BLACKLIST_ALIAS_ONLY)))
-			|| (err = flags & KMOD_PROBE_APPLY_BLACKLIST_ALL)
-			|| (err = flags & KMOD_PROBE_APPLY_BLACKLIST)) {
-		if (module_is_blacklisted(mod))
-			return err;
+	cb.run_install = run_install;
+	cb.data = (void *) data;
+
+	/* only @mod itself: once is not worth reading /proc/modules */
+	if (!(flags & KMOD_PROBE_IGNORE_LOADED) &&
+					kmod_list_next(list, list) != NULL)
+		loaded = probe_loaded_read(mod->ctx);
+
+	if ((flags & KMOD_PROBE_PARALLEL) && !(flags & KMOD_PROBE_DRY_RUN) &&
+					kmod_list_next(list, list) != NULL) {
+		struct probe_sched sched = {
+			.flags = flags,
+			.extra_options = extra_options,
+			.loaded = loaded,
+		};
+
+		err = probe_sched_add_list(&sched, mod, list);
+		if (err == 0)
+			err = probe_sched_run(&sched, &cb, print_action);
+
+		probe_sched_free(&sched);
+		hash_free(loaded);
+		kmod_module_unref_list(list);
+		return err;
+	}
+
+	kmod_list_foreach(l, list) {
+		struct kmod_module *m = l->data;
+		const char *moptions = kmod_module_get_options(m);
+		const char *cmd = kmod_module_get_install_commands(m);
+		char *options;
+
+		if (!(flags & KMOD_PROBE_IGNORE_LOADED)
+					&& probe_loaded_has(loaded, m)) {
+			DBG(mod->ctx, "Ignoring module '%s': already loaded\n",
+								m->name);
+			err = -EEXIST;
+			goto finish_module;
+		}
+
+		options = module_options_concat(moptions,
+					m == mod ? extra_options : NULL);
+
+		if (cmd != NULL && !m->ignorecmd) {
+			if (print_action != NULL)
+				print_action(m, true, options ?: "");
+
+			if (!(flags & KMOD_PROBE_DRY_RUN))
+				err = module_do_install_commands(m, options,
+									&cb);
+		} else {
+			if (print_action != NULL)
+				print_action(m, false, options ?: "");
+
+			if (!(flags & KMOD_PROBE_DRY_RUN)) {
+				err = kmod_module_insert_module(m, flags,
+								options);
+				if (err == 0)
+					probe_loaded_set(loaded, m);
+			}
+		}
+
+		free(options);
+
+finish_module:
+		if (probe_insert_stop(m == mod, m->required, flags, &err))
+			break;
+	}
+
+	hash_free(loaded);
+	kmod_module_unref_list(list);
+	return err;
+}
+
+/**
+ * kmod_module_probe_insert_modules:
+ * @mods: array of kmod modules to insert
+ * @count: number of modules in @mods
+ * @flags: same as in kmod_module_probe_insert_module()
+ * @run_install: function to run when a module is backed by an install
+ * command.
+ * @data: data to give back to @run_install callback
+ * @print_action: function to call with the action being taken (install or
+ * insmod).
+ *
+ * Like calling kmod_module_probe_insert_module() for each module in @mods,
+ * without extra options, but the probe lists of all of them are merged
+ * first so each module is inserted once, in an order that satisfies all of
+ * them. With KMOD_PROBE_PARALLEL they are inserted as a single graph.
+ *
+ * A failure doesn't stop the modules not depending on the one that failed
+ * from being inserted. Each failure is logged with the module's name.
+ *
+ * Returns: 0 on success or the first error found. Modules not inserted
+ * because of the blacklist don't count as errors.
+ */
+KMOD_EXPORT int kmod_module_probe_insert_modules(
+			struct kmod_module * const *mods, unsigned int count,
+			unsigned int flags,
+			int (*run_install)(struct kmod_module *m,
+						const char *cmd, void *data),
+			const void *data,
+			void (*print_action)(struct kmod_module *m,
+						bool install,
+						const char *options))
+{
+	struct probe_sched sched = { .flags = flags };
+	struct probe_insert_cb cb;
+	unsigned int i;
+	int err, ret = 0;
+
+	if (mods == NULL)
+		return -ENOENT;
+
+	for (i = 0; i < count; i++) {
+		struct kmod_module *mod = mods[i];
+		struct kmod_list *probe_list = NULL;
+
+		err = probe_get_list(mod, flags, &probe_list);
+		if (err == 0)
+			err = probe_sched_add_list(&sched, mod, probe_list);
+		kmod_module_unref_list(probe_list);
+
+		if (err == -ENOMEM) {
+			ret = err;
+			goto finish;
+		}
+		if (err < 0) {
+			ERR(mod->ctx, "could not insert '%s': %s\n",
+						mod->name, strerror(-err));
+			if (ret == 0)
+				ret = err;
+		}
+	}
+
+	if (sched.n > 0) {
+		cb.run_install = run_install;
+		cb.data = (void *) data;
+
+		if (!(flags & KMOD_PROBE_IGNORE_LOADED) && sched.n > 1)
+			sched.loaded = probe_loaded_read(mods[0]->ctx);
+
+		err = probe_sched_run(&sched, &cb, print_action);
+		if (ret == 0)
+			ret = err;
+	}
+
+finish:
+	probe_sched_free(&sched);
+	hash_free(sched.loaded);
+
+	return ret;
+}
+
+/*
+ * Insertion queue: each request is resolved in the calling thread, like
+ * kmod_module_probe_insert_module() does before inserting anything, and
+ * the steps left run on a worker. Requests go to the workers in the order
+ * they were queued, their steps in list order, and finished ones wait in
+ * the done list until they are collected. The eventfd counts them.
+ *
+ * The modules of the steps are only read by the workers: whatever they
+ * compute lazily is filled when the request is queued. Requests may share
+ * dependencies, so a worker claims a module in @inserting for its whole
+ * step and one inserted by another worker is waited for: its file is only
+ * opened and decompressed once. Each worker claims one module at a time,
+ * so @inserting has a slot for each of them.
+ */
+struct insert_step {
+	struct kmod_module *mod;
+	char *options;
+	bool install;
+	bool target;
+	bool required;
+	bool loaded;
+};
+
+struct insert_req {
+	struct insert_req *next;
+	struct kmod_module *mod;
+	void *userdata;
+	unsigned int flags;
+	unsigned int n_steps;
+	struct insert_step *steps;
+	int err;
+};
+
+struct kmod_insert_queue {
+	struct kmod_ctx *ctx;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t released;
+	struct kmod_module **inserting;
+	struct insert_req *pending, **pending_tail;
+	struct insert_req *done, **done_tail;
+	pthread_t *workers;
+	unsigned int jobs, n_workers, n_idle;
+	int fd;
+	bool exit;
+};
+
+static void insert_req_free(struct insert_req *req)
+{
+	unsigned int i;
+
+	for (i = 0; i < req->n_steps; i++) {
+		kmod_module_unref(req->steps[i].mod);
+		free(req->steps[i].options);
+	}
+	free(req->steps);
+	kmod_module_unref(req->mod);
+	free(req);
+}
+
+static int insert_req_add_steps(struct insert_req *req,
+						const char *extra_options,
+						struct kmod_list *list)
+{
+	const struct kmod_list *l;
+	struct hash *loaded = NULL;
+	unsigned int n = 0;
+
+	kmod_list_foreach(l, list)
+		n++;
+
+	req->steps = calloc(n, sizeof(*req->steps));
+	if (req->steps == NULL)
+		return -ENOMEM;
+
+	if (!(req->flags & KMOD_PROBE_IGNORE_LOADED) && n > 1)
+		loaded = probe_loaded_read(req->mod->ctx);
+
+	kmod_list_foreach(l, list) {
+		struct kmod_module *m = l->data;
+		struct insert_step *s = &req->steps[req->n_steps];
+		const char *cmd = kmod_module_get_install_commands(m);
+
+		s->options = module_options_concat(kmod_module_get_options(m),
+				m == req->mod ? extra_options : NULL);
+		s->mod = kmod_module_ref(m);
+		s->install = cmd != NULL && !m->ignorecmd;
+		s->target = m == req->mod;
+		s->required = m->required;
+		s->loaded = !(req->flags & KMOD_PROBE_IGNORE_LOADED) &&
+						probe_loaded_has(loaded, m);
+		kmod_module_get_path(m);
+		req->n_steps++;
+	}
+
+	hash_free(loaded);
+	return 0;
+}
+
+/* wait until no other worker is on a step of @mod, then claim it */
+static void insert_queue_claim(struct kmod_insert_queue *q,
+						struct kmod_module *mod)
+{
+	struct kmod_module **slot = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		for (i = 0; i < q->jobs; i++) {
+			if (q->inserting[i] == mod)
+				break;
+			if (q->inserting[i] == NULL && slot == NULL)
+				slot = &q->inserting[i];
+		}
+		if (i == q->jobs)
+			break;
+
+		slot = NULL;
+		pthread_cond_wait(&q->released, &q->lock);
+	}
+	*slot = mod;
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void insert_queue_release(struct kmod_insert_queue *q,
+						struct kmod_module *mod)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&q->lock);
+	for (i = 0; i < q->jobs; i++) {
+		if (q->inserting[i] == mod)
+			q->inserting[i] = NULL;
+	}
+	pthread_cond_broadcast(&q->released);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static int insert_req_run(struct kmod_insert_queue *q,
+						struct insert_req *req)
+{
+	struct probe_insert_cb cb = { };
+	unsigned int i;
+	int err = 0;
+
+	for (i = 0; i < req->n_steps; i++) {
+		struct insert_step *s = &req->steps[i];
+		const char *path;
+
+		if (s->loaded) {
+			DBG(q->ctx, "Ignoring module '%s': already loaded\n",
+							s->mod->name);
+			err = -EEXIST;
+		} else if (req->flags & KMOD_PROBE_DRY_RUN) {
+			err = 0;
+		} else if (s->install) {
+			insert_queue_claim(q, s->mod);
+			err = module_do_install_commands(s->mod, s->options,
+									&cb);
+			insert_queue_release(q, s->mod);
+		} else {
+			insert_queue_claim(q, s->mod);
+			path = kmod_module_get_path(s->mod);
+			err = path != NULL ? module_open_file(s->mod, path) : 0;
+			if (err == 0)
+				err = kmod_module_insert_module(s->mod,
+							req->flags, s->options);
+			insert_queue_release(q, s->mod);
+		}
+
+		if (probe_insert_stop(s->target, s->required, req->flags,
+									&err))
+			break;
+	}
+
+	return err;
+}
+
+/* called with q->lock held */
+static void insert_queue_complete(struct kmod_insert_queue *q,
+						struct insert_req *req)
+{
+	uint64_t one = 1;
+
+	req->next = NULL;
+	*q->done_tail = req;
+	q->done_tail = &req->next;
+
+	if (write(q->fd, &one, sizeof(one)) < 0)
+		ERR(q->ctx, "could not signal the insertion queue: %m\n");
+}
+
+static void *insert_queue_worker(void *data)
+{
+	struct kmod_insert_queue *q = data;
+
+	pthread_mutex_lock(&q->lock);
+
+	for (;;) {
+		struct insert_req *req;
+		int err;
+
+		q->n_idle++;
+		while (!q->exit && q->pending == NULL)
+			pthread_cond_wait(&q->queued, &q->lock);
+		q->n_idle--;
+
+		if (q->exit)
+			break;
+
+		req = q->pending;
+		q->pending = req->next;
+		if (q->pending == NULL)
+			q->pending_tail = &q->pending;
+		pthread_mutex_unlock(&q->lock);
+
+		err = insert_req_run(q, req);
+
+		pthread_mutex_lock(&q->lock);
+		req->err = err;
+		insert_queue_complete(q, req);
+	}
+
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+/**
+ * kmod_insert_queue_new:
+ * @ctx: kmod library context
+ * @jobs: maximum number of modules inserted at the same time, 0 for one per
+ * online CPU
+ *
+ * Create a queue to insert modules without blocking the calling thread,
+ * for programs built around an event loop. The insertions run on up to
+ * @jobs threads, started as needed, and each finished request makes the
+ * file descriptor of kmod_insert_queue_get_fd() readable until it's
+ * collected with kmod_insert_queue_next().
+ *
+ * The queue holds a reference to @ctx. Changing the context while
+ * insertions are in flight is not supported, and the log function of the
+ * context may be called from the threads of the queue.
+ *
+ * Returns: a new queue or NULL on failure, with errno set.
+ */
+KMOD_EXPORT struct kmod_insert_queue *kmod_insert_queue_new(
+					struct kmod_ctx *ctx, unsigned int jobs)
+{
+	struct kmod_insert_queue *q;
+
+	if (ctx == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (jobs == 0) {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		jobs = ncpus < 1 ? 1 : (unsigned int) ncpus;
+	}
+
+	q = calloc(1, sizeof(*q));
+	if (q == NULL)
+		return NULL;
+
+	q->workers = calloc(jobs, sizeof(*q->workers));
+	q->inserting = calloc(jobs, sizeof(*q->inserting));
+	if (q->workers == NULL || q->inserting == NULL) {
+		free(q->inserting);
+		free(q->workers);
+		free(q);
+		return NULL;
+	}
+
+	q->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (q->fd < 0) {
+		int err = errno;
+
+		free(q->inserting);
+		free(q->workers);
+		free(q);
+		errno = err;
+		return NULL;
+	}
+
+	q->ctx = kmod_ref(ctx);
+	q->jobs = jobs;
+	q->pending_tail = &q->pending;
+	q->done_tail = &q->done;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->queued, NULL);
+	pthread_cond_init(&q->released, NULL);
+
+	return q;
+}
+
+/**
+ * kmod_insert_queue_free:
+ * @q: insertion queue
+ *
+ * Wait for the insertions in flight, drop the requests not started yet and
+ * the results not collected, and free @q.
+ */
+KMOD_EXPORT void kmod_insert_queue_free(struct kmod_insert_queue *q)
+{
+	struct insert_req *req, *next;
+	unsigned int i;
+
+	if (q == NULL)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	q->exit = true;
+	pthread_cond_broadcast(&q->queued);
+	pthread_mutex_unlock(&q->lock);
+
+	for (i = 0; i < q->n_workers; i++)
+		pthread_join(q->workers[i], NULL);
+
+	for (req = q->pending; req != NULL; req = next) {
+		next = req->next;
+		insert_req_free(req);
 	}
 
-	err = kmod_module_get_probe_list(mod,
-				!!(flags & KMOD_PROBE_IGNORE_COMMAND), &list);
-	if (err < 0)
-		return err;
+	for (req = q->done; req != NULL; req = next) {
+		next = req->next;
+		insert_req_free(req);
+	}
+
+	pthread_cond_destroy(&q->released);
+	pthread_cond_destroy(&q->queued);
+	pthread_mutex_destroy(&q->lock);
+	close(q->fd);
+	kmod_unref(q->ctx);
+	free(q->inserting);
+	free(q->workers);
+	free(q);
+}
+
+/**
+ * kmod_insert_queue_get_fd:
+ * @q: insertion queue
+ *
+ * Get the file descriptor to poll for finished requests. It's readable
+ * while kmod_insert_queue_next() has results to give: don't read from it.
+ *
+ * Returns: the file descriptor, owned by @q, or < 0 on failure.
+ */
+KMOD_EXPORT int kmod_insert_queue_get_fd(const struct kmod_insert_queue *q)
+{
+	if (q == NULL)
+		return -EINVAL;
+
+	return q->fd;
+}
+
+/**
+ * kmod_insert_queue_probe:
+ * @q: insertion queue
+ * @mod: kmod module
+ * @flags: same as in kmod_module_probe_insert_module(), but
+ * KMOD_PROBE_PARALLEL is ignored
+ * @extra_options: module's options to pass to Linux Kernel. It applies only
+ * to @mod, not to its dependencies.
+ * @userdata: pointer given back by kmod_insert_queue_next()
+ *
+ * Queue the probe of @mod: like kmod_module_probe_insert_module(), but the
+ * checks and the resolution of the dependencies are done here and the
+ * insertions on a thread of @q. Install commands are spawned as when no
+ * @run_install is given to kmod_module_probe_insert_module().
+ *
+ * Requests start in the order they were queued, but several of them can be
+ * in flight and finish in any order. The modules of a request should not
+ * be used from other threads until it's collected, other than to get their
+ * name and path.
+ *
+ * Returns: 0 if the request was queued or < 0 on failure. The result of the
+ * probe itself is given by kmod_insert_queue_next().
+ */
+KMOD_EXPORT int kmod_insert_queue_probe(struct kmod_insert_queue *q,
+					struct kmod_module *mod,
+					unsigned int flags,
+					const char *extra_options,
+					void *userdata)
+{
+	struct kmod_list *list;
+	struct insert_req *req;
+	int err;
 
-	if (flags & KMOD_PROBE_APPLY_BLACKLIST_ALL) {
-		struct kmod_list *filtered = NULL;
+	if (q == NULL || mod == NULL)
+		return -ENOENT;
 
-		err = kmod_module_apply_filter(mod->ctx,
-				KMOD_FILTER_BLACKLIST, list, &filtered);
-		if (err < 0)
-			return err;
+	req = calloc(1, sizeof(*req));
+	if (req == NULL)
+		return -ENOMEM;
 
-		kmod_module_unref_list(list);
-		if (filtered == NULL)
-			return KMOD_PROBE_APPLY_BLACKLIST_ALL;
+	req->mod = kmod_module_ref(mod);
+	req->userdata = userdata;
+	req->flags = flags & ~KMOD_PROBE_PARALLEL;
 
-		list = filtered;
+	err = probe_get_list(mod, flags, &list);
+	if (err == 0 && list != NULL) {
+		err = insert_req_add_steps(req, extra_options, list);
+		kmod_module_unref_list(list);
+		if (err < 0) {
+			insert_req_free(req);
+			return err;
+		}
 	}
 
-	cb.run_install = run_install;
-	cb.data = (void *) data;
+	pthread_mutex_lock(&q->lock);
 
-	kmod_list_foreach(l, list) {
-		struct kmod_module *m = l->data;
-		const char *moptions = kmod_module_get_options(m);
-		const char *cmd = kmod_module_get_install_commands(m);
-		char *options;
+	if (req->n_steps == 0) {
+		req->err = err;
+		insert_queue_complete(q, req);
+		pthread_mutex_unlock(&q->lock);
+		return 0;
+	}
 
-		if (!(flags & KMOD_PROBE_IGNORE_LOADED)
-						&& module_is_inkernel(m)) {
-			DBG(mod->ctx, "Ignoring module '%s': already loaded\n",
-								m->name);
-			err = -EEXIST;
-			goto finish_module;
+	if (q->n_idle == 0 && q->n_workers < q->jobs) {
+		err = pthread_create(&q->workers[q->n_workers], NULL,
+						insert_queue_worker, q);
+		if (err == 0) {
+			q->n_workers++;
+		} else if (q->n_workers == 0) {
+			pthread_mutex_unlock(&q->lock);
+			insert_req_free(req);
+			return -err;
 		}
+	}
 
-		options = module_options_concat(moptions,
-					m == mod ? extra_options : NULL);
-
-		if (cmd != NULL && !m->ignorecmd) {
-			if (print_action != NULL)
-				print_action(m, true, options ?: "");
+	*q->pending_tail = req;
+	q->pending_tail = &req->next;
+	pthread_cond_signal(&q->queued);
+	pthread_mutex_unlock(&q->lock);
 
-			if (!(flags & KMOD_PROBE_DRY_RUN))
-				err = module_do_install_commands(m, options,
-									&cb);
-		} else {
-			if (print_action != NULL)
-				print_action(m, false, options ?: "");
+	return 0;
+}
 
-			if (!(flags & KMOD_PROBE_DRY_RUN))
-				err = kmod_module_insert_module(m, flags,
-								options);
-		}
+/**
+ * kmod_insert_queue_next:
+ * @q: insertion queue
+ * @mod: where to save the module of the request, with a new reference
+ * @err: where to save the result of the probe, as
+ * kmod_module_probe_insert_module() would have returned it
+ * @userdata: where to save the pointer given to kmod_insert_queue_probe(),
+ * or NULL
+ *
+ * Collect a finished request, in the order they finished.
+ *
+ * Returns: 0 if a request was collected, -EAGAIN if none has finished yet
+ * or another value < 0 on failure.
+ */
+KMOD_EXPORT int kmod_insert_queue_next(struct kmod_insert_queue *q,
+					struct kmod_module **mod, int *err,
+					void **userdata)
+{
+	struct insert_req *req;
+	uint64_t count;
 
-		free(options);
+	if (q == NULL || mod == NULL || err == NULL)
+		return -ENOENT;
 
-finish_module:
-		/*
-		 * Treat "already loaded" error. If we were told to stop on
-		 * already loaded and the module being loaded is not a softdep
-		 * or dep, bail out. Otherwise, just ignore and continue.
-		 *
-		 * We need to check here because of race conditions. We
-		 * checked first if module was already loaded but it may have
-		 * been loaded between the check and the moment we try to
-		 * insert it.
-		 */
-		if (err == -EEXIST && m == mod &&
-				(flags & KMOD_PROBE_FAIL_ON_LOADED))
-			break;
+	pthread_mutex_lock(&q->lock);
 
-		/*
-		 * Ignore errors from softdeps
-		 */
-		if (err == -EEXIST || !m->required)
-			err = 0;
+	req = q->done;
+	if (req == NULL) {
+		pthread_mutex_unlock(&q->lock);
+		return -EAGAIN;
+	}
 
-		else if (err < 0)
-			break;
+	q->done = req->next;
+	if (q->done == NULL) {
+		q->done_tail = &q->done;
+		/* the fd is readable as long as there are results */
+		if (read(q->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			ERR(q->ctx, "could not reset the insertion queue: %m\n");
 	}
 
-	kmod_module_unref_list(list);
-	return err;
+	pthread_mutex_unlock(&q->lock);
+
+	*mod = kmod_module_ref(req->mod);
+	*err = req->err;
+	if (userdata != NULL)
+		*userdata = req->userdata;
+	insert_req_free(req);
+
+	return 0;
 }
 
 /**
@@ -1479,28 +3436,49 @@ KMOD_EXPORT const char *kmod_module_get_options(const struct kmod_module *mod)
 	if (mod == NULL)
 		return NULL;
 
-	if (!mod->init.options) {
+	if (!init_done(&mod->init.options)) {
 		/* lazy init */
 		struct kmod_module *m = (struct kmod_module *)mod;
-		const struct kmod_list *l;
+		const struct kmod_list *by_name, *by_alias = NULL;
 		const struct kmod_config *config;
+		const char *alias = mod->alias;
+		unsigned int name_pos = 0, alias_pos = 0;
 		char *opts = NULL;
 		size_t optslen = 0;
 
 		config = kmod_get_config(mod->ctx);
 
-		kmod_list_foreach(l, config->options) {
-			const char *modname = kmod_option_get_modname(l);
+		/* merge the options given to the name and to the alias */
+		if (alias != NULL && streq(alias, mod->name))
+			alias = NULL;
+
+		by_name = kmod_config_match(config, CONFIG_TYPE_OPTION,
+						mod->name, false, &name_pos);
+		if (alias != NULL)
+			by_alias = kmod_config_match(config, CONFIG_TYPE_OPTION,
+						alias, false, &alias_pos);
+
+		while (by_name != NULL || by_alias != NULL) {
+			const struct kmod_list *l;
 			const char *str;
 			size_t len;
 			void *tmp;
 
-			DBG(mod->ctx, "modname=%s mod->name=%s mod->alias=%s\n", modname, mod->name, mod->alias);
-			if (!(streq(modname, mod->name) || (mod->alias != NULL &&
-						streq(modname, mod->alias))))
-				continue;
+			if (by_alias == NULL ||
+				(by_name != NULL && name_pos < alias_pos)) {
+				l = by_name;
+				by_name = kmod_config_match(config,
+						CONFIG_TYPE_OPTION, mod->name,
+						false, &name_pos);
+			} else {
+				l = by_alias;
+				by_alias = kmod_config_match(config,
+						CONFIG_TYPE_OPTION, alias,
+						false, &alias_pos);
+			}
 
-			DBG(mod->ctx, "passed = modname=%s mod->name=%s mod->alias=%s\n", modname, mod->name, mod->alias);
+			DBG(mod->ctx, "modname=%s mod->name=%s mod->alias=%s\n",
+				kmod_option_get_modname(l), mod->name, mod->alias);
 			str = kmod_option_get_options(l);
 			len = strlen(str);
 			if (len < 1)
@@ -1524,8 +3502,14 @@ KMOD_EXPORT const char *kmod_module_get_options(const struct kmod_module *mod)
 			opts[optslen] = '\0';
 		}
 
-		m->init.options = true;
-		m->options = opts;
+		kmod_pool_lock(mod->ctx);
+		if (!m->init.options) {
+			m->options = opts;
+			init_publish(&m->init.options);
+			opts = NULL;
+		}
+		kmod_pool_unlock(mod->ctx);
+		free(opts);
 	}
 
 	return mod->options;
@@ -1554,30 +3538,32 @@ KMOD_EXPORT const char *kmod_module_get_install_commands(const struct kmod_modul
 	if (mod == NULL)
 		return NULL;
 
-	if (!mod->init.install_commands) {
+	if (!init_done(&mod->init.install_commands)) {
 		/* lazy init */
-		struct kmod_module *m = (struct kmod_module *)mod;
 		const struct kmod_list *l;
 		const struct kmod_config *config;
+		const char *cmd = NULL;
+		unsigned int cursor = 0;
 
 		config = kmod_get_config(mod->ctx);
 
-		kmod_list_foreach(l, config->install_commands) {
-			const char *modname = kmod_command_get_modname(l);
-
-			if (fnmatch(modname, mod->name, 0) != 0)
-				continue;
+		/*
+		 * find only the first command, as modprobe from
+		 * module-init-tools does
+		 */
+		l = kmod_config_match(config, CONFIG_TYPE_INSTALL, mod->name, true,
+								&cursor);
+		if (l != NULL)
+			cmd = kmod_command_get_command(l);
 
-			m->install_commands = kmod_command_get_command(l);
+		kmod_pool_lock(mod->ctx);
+		if (!mod->init.install_commands) {
+			struct kmod_module *m = (struct kmod_module *)mod;
 
-			/*
-			 * find only the first command, as modprobe from
-			 * module-init-tools does
-			 */
-			break;
+			m->install_commands = cmd;
+			init_publish(&m->init.install_commands);
 		}
-
-		m->init.install_commands = true;
+		kmod_pool_unlock(mod->ctx);
 	}
 
 	return mod->install_commands;
@@ -1585,8 +3571,10 @@ KMOD_EXPORT const char *kmod_module_get_install_commands(const struct kmod_modul
 
 void kmod_module_set_install_commands(struct kmod_module *mod, const char *cmd)
 {
-	mod->init.install_commands = true;
+	kmod_pool_lock(mod->ctx);
 	mod->install_commands = cmd;
+	init_publish(&mod->init.install_commands);
+	kmod_pool_unlock(mod->ctx);
 }
 
 static struct kmod_list *lookup_softdep(struct kmod_ctx *ctx, const char * const * array, unsigned int count)
@@ -1609,6 +3597,36 @@ static struct kmod_list *lookup_softdep(struct kmod_ctx *ctx, const char * const
 	return ret;
 }
 
+/*
+ * Softdeps the module declared itself, when depmod indexed them in
+ * modules.softdep.bin instead of leaving them to the configuration
+ */
+static void module_get_indexed_softdeps(const struct kmod_module *mod,
+						struct kmod_list **pre,
+						struct kmod_list **post)
+{
+	const char * const *array;
+	struct kmod_softdep *dep;
+	unsigned int count;
+	char *line;
+
+	line = kmod_search_softdep(mod->ctx, mod->name);
+	if (line == NULL)
+		return;
+
+	dep = kmod_softdep_new(mod->ctx, mod->name, line);
+	free(line);
+	if (dep == NULL)
+		return;
+
+	array = kmod_softdep_pre(dep, &count);
+	*pre = lookup_softdep(mod->ctx, array, count);
+	array = kmod_softdep_post(dep, &count);
+	*post = lookup_softdep(mod->ctx, array, count);
+
+	free(dep);
+}
+
 /**
  * kmod_module_get_softdeps:
  * @mod: kmod module
@@ -1616,10 +3634,11 @@ static struct kmod_list *lookup_softdep(struct kmod_ctx *ctx, const char * const
  * @post: where to save the list of post soft dependencies.
  *
  * Get soft dependencies for this kmod module. Soft dependencies come
- * from configuration file and are not cached in @mod because it may include
- * dependency cycles that would make we leak kmod_module. Any call
- * to this function will search for this module in configuration, allocate a
- * list and return the result.
+ * from configuration file, or from the module itself through depmod's
+ * modules.softdep.bin if the configuration has none, and are not cached in
+ * @mod because it may include dependency cycles that would make we leak
+ * kmod_module. Any call to this function will search for this module in
+ * configuration, allocate a list and return the result.
  *
  * Both @pre and @post are newly created list of kmod_module and
  * should be unreferenced with kmod_module_unref_list().
@@ -1632,124 +3651,397 @@ KMOD_EXPORT int kmod_module_get_softdeps(const struct kmod_module *mod,
 {
 	const struct kmod_list *l;
 	const struct kmod_config *config;
+	const char * const *array;
+	unsigned int count, cursor = 0;
+
+	if (mod == NULL || pre == NULL || post == NULL)
+		return -ENOENT;
+
+	assert(*pre == NULL);
+	assert(*post == NULL);
+
+	config = kmod_get_config(mod->ctx);
+
+	/*
+	 * find only the first command, as modprobe from
+	 * module-init-tools does
+	 */
+	l = kmod_config_match(config, CONFIG_TYPE_SOFTDEP, mod->name, true,
+								&cursor);
+	if (l == NULL) {
+		module_get_indexed_softdeps(mod, pre, post);
+		return 0;
+	}
+
+	array = kmod_softdep_get_pre(l, &count);
+	*pre = lookup_softdep(mod->ctx, array, count);
+	array = kmod_softdep_get_post(l, &count);
+	*post = lookup_softdep(mod->ctx, array, count);
+
+	return 0;
+}
+
+/**
+ * kmod_module_get_remove_commands:
+ * @mod: kmod module
+ *
+ * Get remove commands for this kmod module. Remove commands come from the
+ * configuration file and are cached in @mod. The first call to this function
+ * will search for this module in configuration and subsequent calls return
+ * the cached string. The remove commands are returned as they were in the
+ * configuration, concatenated by ';'. No other processing is made in this
+ * string.
+ *
+ * Returns: a string with all remove commands separated by semicolons. This
+ * string is owned by @mod, do not free it.
+ */
+KMOD_EXPORT const char *kmod_module_get_remove_commands(const struct kmod_module *mod)
+{
+	if (mod == NULL)
+		return NULL;
+
+	if (!init_done(&mod->init.remove_commands)) {
+		/* lazy init */
+		const struct kmod_list *l;
+		const struct kmod_config *config;
+		const char *cmd = NULL;
+		unsigned int cursor = 0;
+
+		config = kmod_get_config(mod->ctx);
+
+		/*
+		 * find only the first command, as modprobe from
+		 * module-init-tools does
+		 */
+		l = kmod_config_match(config, CONFIG_TYPE_REMOVE, mod->name, true,
+								&cursor);
+		if (l != NULL)
+			cmd = kmod_command_get_command(l);
+
+		kmod_pool_lock(mod->ctx);
+		if (!mod->init.remove_commands) {
+			struct kmod_module *m = (struct kmod_module *)mod;
+
+			m->remove_commands = cmd;
+			init_publish(&m->init.remove_commands);
+		}
+		kmod_pool_unlock(mod->ctx);
+	}
+
+	return mod->remove_commands;
+}
+
+void kmod_module_set_remove_commands(struct kmod_module *mod, const char *cmd)
+{
+	kmod_pool_lock(mod->ctx);
+	mod->remove_commands = cmd;
+	init_publish(&mod->init.remove_commands);
+	kmod_pool_unlock(mod->ctx);
+}
+
+/**
+ * SECTION:libkmod-loaded
+ * @short_description: currently loaded modules
+ *
+ * Information about currently loaded modules, as reported by Linux kernel.
+ * These information are not cached by libkmod and are always read from /sys
+ * and /proc/modules, unless a snapshot was taken with
+ * kmod_module_new_from_loaded_snapshot().
+ */
+
+/**
+ * kmod_module_new_from_loaded:
+ * @ctx: kmod library context
+ * @list: where to save the list of loaded modules
+ *
+ * Create a new list of kmod modules with all modules currently loaded in
+ * kernel. It uses /proc/modules to get the names of loaded modules and to
+ * create kmod modules by calling kmod_module_new_from_name() in each of them.
+ * They are put in @list in no particular order.
+ *
+ * The initial refcount is 1, and needs to be decremented to release the
+ * resources of the kmod_module. The returned @list must be released by
+ * calling kmod_module_unref_list(). Since libkmod keeps track of all
+ * kmod_modules created, they are all released upon @ctx destruction too. Do
+ * not unref @ctx before all the desired operations with the returned list are
+ * completed.
+ *
+ * Returns: 0 on success or < 0 on error.
+ */
+KMOD_EXPORT int kmod_module_new_from_loaded(struct kmod_ctx *ctx,
+						struct kmod_list **list)
+{
+	struct kmod_list *l = NULL;
+	FILE *fp;
+	char line[4096];
+
+	if (ctx == NULL || list == NULL)
+		return -ENOENT;
+
+	fp = fopen("/proc/modules", "re");
+	if (fp == NULL) {
+		int err = -errno;
+		ERR(ctx, "could not open /proc/modules: %s\n", strerror(errno));
+		return err;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		struct kmod_module *m;
+		struct kmod_list *node;
+		int err;
+		size_t len = strlen(line);
+		char *saveptr, *name = strtok_r(line, " \t", &saveptr);
+
+		err = kmod_module_new_from_name(ctx, name, &m);
+		if (err < 0) {
+			ERR(ctx, "could not get module from name '%s': %s\n",
+				name, strerror(-err));
+			goto eat_line;
+		}
+
+		node = kmod_list_append(l, m);
+		if (node)
+			l = node;
+		else {
+			ERR(ctx, "out of memory\n");
+			kmod_module_unref(m);
+		}
+eat_line:
+		while (line[len - 1] != '\n' && fgets(line, sizeof(line), fp))
+			len = strlen(line);
+	}
+
+	fclose(fp);
+	*list = l;
+
+	return 0;
+}
+
+/*
+ * Open @attr of @mod in /sys/module/<name>, relative to a dirfd kept while
+ * the module is referenced so the kernel doesn't walk the whole path for
+ * each attribute. If the module was removed and loaded again the kept dirfd
+ * refers to the old directory, so it's opened again once before giving up.
+ * @loaded, if given, tells if the module's directory exists.
+ *
+ * The pool lock is held so a dirfd being replaced isn't used by another
+ * thread.
+ */
+static int module_sysfs_openat(const struct kmod_module *mod,
+				const char *attr, int flags, bool *loaded)
+{
+	struct kmod_module *m = (struct kmod_module *)mod;
+	bool fresh = false;
+	int fd, err;
+
+	kmod_pool_lock(mod->ctx);
+
+	for (;;) {
+		if (m->sysfs_dirfd < 0) {
+			char path[PATH_MAX];
+
+			snprintf(path, sizeof(path), "/sys/module/%s", mod->name);
+			m->sysfs_dirfd = open(path,
+					O_PATH|O_DIRECTORY|O_CLOEXEC);
+			if (m->sysfs_dirfd < 0) {
+				err = -errno;
+				if (loaded != NULL)
+					*loaded = false;
+				break;
+			}
+			fresh = true;
+		}
 
-	if (mod == NULL || pre == NULL || post == NULL)
-		return -ENOENT;
+		fd = openat(m->sysfs_dirfd, attr, flags|O_CLOEXEC);
+		if (fd >= 0 || errno != ENOENT || fresh) {
+			err = fd >= 0 ? fd : -errno;
+			if (loaded != NULL)
+				*loaded = true;
+			break;
+		}
 
-	assert(*pre == NULL);
-	assert(*post == NULL);
+		close(m->sysfs_dirfd);
+		m->sysfs_dirfd = -1;
+	}
 
-	config = kmod_get_config(mod->ctx);
+	kmod_pool_unlock(mod->ctx);
 
-	kmod_list_foreach(l, config->softdeps) {
-		const char *modname = kmod_softdep_get_name(l);
-		const char * const *array;
-		unsigned count;
+	return err;
+}
 
-		if (fnmatch(modname, mod->name, 0) != 0)
-			continue;
+static DIR *module_sysfs_opendir(const struct kmod_module *mod,
+							const char *name)
+{
+	DIR *d;
+	int fd;
 
-		array = kmod_softdep_get_pre(l, &count);
-		*pre = lookup_softdep(mod->ctx, array, count);
-		array = kmod_softdep_get_post(l, &count);
-		*post = lookup_softdep(mod->ctx, array, count);
+	fd = module_sysfs_openat(mod, name, O_RDONLY|O_DIRECTORY, NULL);
+	if (fd < 0) {
+		errno = -fd;
+		return NULL;
+	}
 
-		/*
-		 * find only the first command, as modprobe from
-		 * module-init-tools does
-		 */
-		break;
+	d = fdopendir(fd);
+	if (d == NULL) {
+		int err = errno;
+		close(fd);
+		errno = err;
 	}
 
-	return 0;
+	return d;
 }
 
-/**
- * kmod_module_get_remove_commands:
- * @mod: kmod module
- *
- * Get remove commands for this kmod module. Remove commands come from the
- * configuration file and are cached in @mod. The first call to this function
- * will search for this module in configuration and subsequent calls return
- * the cached string. The remove commands are returned as they were in the
- * configuration, concatenated by ';'. No other processing is made in this
- * string.
- *
- * Returns: a string with all remove commands separated by semicolons. This
- * string is owned by @mod, do not free it.
+static int loaded_state_from_proc(const char *state)
+{
+	if (streq(state, "Live"))
+		return KMOD_MODULE_LIVE;
+	if (streq(state, "Loading"))
+		return KMOD_MODULE_COMING;
+	if (streq(state, "Unloading"))
+		return KMOD_MODULE_GOING;
+
+	return -EINVAL;
+}
+
+/*
+ * The size in /proc/modules also counts the init sections until they are
+ * freed, at the end of the module's init: while that may still be running,
+ * use coresize, as kmod_module_get_size() does. /sys/module is only opened,
+ * through *@sysfd, the first time this is needed, and stays at -1 if it
+ * can't be.
  */
-KMOD_EXPORT const char *kmod_module_get_remove_commands(const struct kmod_module *mod)
+static long module_loaded_coresize(struct kmod_module *mod, int *sysfd,
+								long size)
 {
-	if (mod == NULL)
-		return NULL;
+	char path[PATH_MAX];
+	long coresize;
+	int fd;
+
+	if (*sysfd == -EAGAIN)
+		*sysfd = open("/sys/module", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (*sysfd < 0) {
+		*sysfd = -1;
+		return size;
+	}
 
-	if (!mod->init.remove_commands) {
-		/* lazy init */
-		struct kmod_module *m = (struct kmod_module *)mod;
-		const struct kmod_list *l;
-		const struct kmod_config *config;
+	snprintf(path, sizeof(path), "%s/coresize", mod->name);
+	fd = openat(*sysfd, path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return size;
 
-		config = kmod_get_config(mod->ctx);
+	if (read_str_long(fd, &coresize, 10) == 0)
+		size = coresize;
+	close(fd);
 
-		kmod_list_foreach(l, config->remove_commands) {
-			const char *modname = kmod_command_get_modname(l);
+	return size;
+}
 
-			if (fnmatch(modname, mod->name, 0) != 0)
-				continue;
+/*
+ * Fill the snapshot of @mod from the remaining fields of its line in
+ * /proc/modules: size, refcnt, used by and state. "Used by" is a comma
+ * terminated list of holders followed by flags in brackets, or "-", as is
+ * refcnt, when the kernel doesn't support unloading modules.
+ */
+static int module_fill_loaded(struct kmod_module *mod, unsigned int gen,
+					int *sysfd, char *fields[4])
+{
+	char *endptr, *holders = NULL, *tok, *saveptr;
+	size_t holders_len = 0;
+	int initstate, refcnt;
+	long size;
 
-			m->remove_commands = kmod_command_get_command(l);
+	size = strtol(fields[0], &endptr, 10);
+	if (endptr == fields[0] || *endptr != '\0')
+		return -EINVAL;
 
-			/*
-			 * find only the first command, as modprobe from
-			 * module-init-tools does
-			 */
-			break;
-		}
+	if (streq(fields[1], "-")) {
+		refcnt = -ENOENT;
+	} else {
+		refcnt = strtol(fields[1], &endptr, 10);
+		if (endptr == fields[1] || *endptr != '\0')
+			return -EINVAL;
+	}
+
+	initstate = loaded_state_from_proc(fields[3]);
+	if (initstate < 0)
+		return initstate;
+
+	if (initstate != KMOD_MODULE_LIVE)
+		size = module_loaded_coresize(mod, sysfd, size);
 
-		m->init.remove_commands = true;
+	if (!streq(fields[2], "-")) {
+		/* holders are stored as the list itself, commas as '\0' */
+		holders = malloc(strlen(fields[2]) + 1);
+		if (holders == NULL)
+			return -ENOMEM;
+
+		for (tok = strtok_r(fields[2], ",", &saveptr); tok != NULL;
+				tok = strtok_r(NULL, ",", &saveptr)) {
+			size_t toklen = strlen(tok);
+
+			if (tok[0] == '[')
+				continue;
+
+			memcpy(holders + holders_len, tok, toklen + 1);
+			holders_len += toklen + 1;
+		}
 	}
 
-	return mod->remove_commands;
-}
+	kmod_pool_lock(mod->ctx);
+	free(mod->loaded.holders);
+	mod->loaded.gen = gen;
+	mod->loaded.initstate = initstate;
+	mod->loaded.refcnt = refcnt;
+	mod->loaded.size = size;
+	mod->loaded.holders = holders;
+	mod->loaded.holders_len = holders_len;
+	kmod_pool_unlock(mod->ctx);
 
-void kmod_module_set_remove_commands(struct kmod_module *mod, const char *cmd)
-{
-	mod->init.remove_commands = true;
-	mod->remove_commands = cmd;
+	return 0;
 }
 
-/**
- * SECTION:libkmod-loaded
- * @short_description: currently loaded modules
- *
- * Information about currently loaded modules, as reported by Linux kernel.
- * These information are not cached by libkmod and are always read from /sys
- * and /proc/modules.
+/*
+ * Return with the pool lock held if @mod is part of the current snapshot
+ * of loaded modules.
  */
+static bool module_loaded_lock(const struct kmod_module *mod)
+{
+	unsigned int gen;
+
+	kmod_pool_lock(mod->ctx);
+	gen = kmod_loaded_get_gen(mod->ctx);
+	if (gen != 0 && mod->loaded.gen == gen)
+		return true;
+	kmod_pool_unlock(mod->ctx);
+
+	return false;
+}
 
 /**
- * kmod_module_new_from_loaded:
+ * kmod_module_new_from_loaded_snapshot:
  * @ctx: kmod library context
  * @list: where to save the list of loaded modules
  *
- * Create a new list of kmod modules with all modules currently loaded in
- * kernel. It uses /proc/modules to get the names of loaded modules and to
- * create kmod modules by calling kmod_module_new_from_name() in each of them.
- * They are put in @list in no particular order.
+ * Like kmod_module_new_from_loaded(), but also take a snapshot of the
+ * state of each module in the same pass: kmod_module_get_initstate(),
+ * kmod_module_get_refcnt(), kmod_module_get_size() and
+ * kmod_module_get_holders() then answer from it rather than reading
+ * /sys again. The snapshot is read from /proc/modules in one pass; only
+ * the size of modules that are not live yet, whose init sections may still
+ * be counted there, is taken from /sys/module. It is dropped when a module
+ * is inserted or removed through @ctx, when a new one is taken and after
+ * about a second, after which the getters go back to reading /sys.
  *
- * The initial refcount is 1, and needs to be decremented to release the
- * resources of the kmod_module. The returned @list must be released by
- * calling kmod_module_unref_list(). Since libkmod keeps track of all
- * kmod_modules created, they are all released upon @ctx destruction too. Do
- * not unref @ctx before all the desired operations with the returned list are
- * completed.
+ * The returned @list must be released by calling kmod_module_unref_list().
  *
  * Returns: 0 on success or < 0 on error.
  */
-KMOD_EXPORT int kmod_module_new_from_loaded(struct kmod_ctx *ctx,
+KMOD_EXPORT int kmod_module_new_from_loaded_snapshot(struct kmod_ctx *ctx,
 						struct kmod_list **list)
 {
 	struct kmod_list *l = NULL;
+	unsigned int gen;
+	int sysfd = -EAGAIN, lineno = 0;
 	FILE *fp;
 	char line[4096];
 
@@ -1763,12 +4055,26 @@ KMOD_EXPORT int kmod_module_new_from_loaded(struct kmod_ctx *ctx,
 		return err;
 	}
 
+	kmod_pool_lock(ctx);
+	gen = kmod_loaded_begin(ctx);
+	kmod_pool_unlock(ctx);
+
 	while (fgets(line, sizeof(line), fp)) {
 		struct kmod_module *m;
 		struct kmod_list *node;
-		int err;
 		size_t len = strlen(line);
-		char *saveptr, *name = strtok_r(line, " \t", &saveptr);
+		bool truncated = line[len - 1] != '\n';
+		char *saveptr, *name, *fields[4];
+		unsigned int i;
+		int err;
+
+		lineno++;
+		name = strtok_r(line, " \t\n", &saveptr);
+		if (name == NULL)
+			goto eat_line;
+
+		for (i = 0; i < ARRAY_SIZE(fields); i++)
+			fields[i] = strtok_r(NULL, " \t\n", &saveptr);
 
 		err = kmod_module_new_from_name(ctx, name, &m);
 		if (err < 0) {
@@ -1777,6 +4083,17 @@ KMOD_EXPORT int kmod_module_new_from_loaded(struct kmod_ctx *ctx,
 			goto eat_line;
 		}
 
+		kmod_module_set_builtin(m, false);
+
+		/* the getters keep reading /sys for what can't be parsed */
+		if (truncated || fields[ARRAY_SIZE(fields) - 1] == NULL)
+			err = -EINVAL;
+		else
+			err = module_fill_loaded(m, gen, &sysfd, fields);
+		if (err < 0)
+			DBG(ctx, "no snapshot of '%s' from /proc/modules:%d: %s\n",
+				name, lineno, strerror(-err));
+
 		node = kmod_list_append(l, m);
 		if (node)
 			l = node;
@@ -1785,10 +4102,14 @@ KMOD_EXPORT int kmod_module_new_from_loaded(struct kmod_ctx *ctx,
 			kmod_module_unref(m);
 		}
 eat_line:
-		while (line[len - 1] != '\n' && fgets(line, sizeof(line), fp))
+		while (truncated && fgets(line, sizeof(line), fp)) {
 			len = strlen(line);
+			truncated = line[len - 1] != '\n';
+		}
 	}
 
+	if (sysfd >= 0)
+		close(sysfd);
 	fclose(fp);
 	*list = l;
 
@@ -1835,8 +4156,9 @@ KMOD_EXPORT const char *kmod_module_initstate_str(enum kmod_module_initstate sta
  */
 KMOD_EXPORT int kmod_module_get_initstate(const struct kmod_module *mod)
 {
-	char path[PATH_MAX], buf[32];
-	int fd, err, pathlen;
+	char buf[32];
+	bool loaded;
+	int fd, err;
 
 	if (mod == NULL)
 		return -ENOENT;
@@ -1845,36 +4167,29 @@ KMOD_EXPORT int kmod_module_get_initstate(const struct kmod_module *mod)
 	if (kmod_module_is_builtin((struct kmod_module *)mod))
 		return KMOD_MODULE_BUILTIN;
 
-	pathlen = snprintf(path, sizeof(path),
-				"/sys/module/%s/initstate", mod->name);
-	if (pathlen >= (int)sizeof(path)) {
-		/* Too long path was truncated */
-		return -ENAMETOOLONG;
+	if (module_loaded_lock(mod)) {
+		err = mod->loaded.initstate;
+		kmod_pool_unlock(mod->ctx);
+		return err;
 	}
-	fd = open(path, O_RDONLY|O_CLOEXEC);
-	if (fd < 0) {
-		err = -errno;
 
-		DBG(mod->ctx, "could not open '%s': %s\n",
-			path, strerror(-err));
+	fd = module_sysfs_openat(mod, "initstate", O_RDONLY, &loaded);
+	if (fd < 0) {
+		DBG(mod->ctx, "could not open '/sys/module/%s/initstate': %s\n",
+			mod->name, strerror(-fd));
 
-		if (pathlen > (int)sizeof("/initstate") - 1) {
-			struct stat st;
-			path[pathlen - (sizeof("/initstate") - 1)] = '\0';
-			if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
-				return KMOD_MODULE_COMING;
-		}
+		/* the directory exists before initstate while loading */
+		if (loaded && fd == -ENOENT)
+			return KMOD_MODULE_COMING;
 
-		DBG(mod->ctx, "could not open '%s': %s\n",
-			path, strerror(-err));
-		return err;
+		return fd;
 	}
 
 	err = read_str_safe(fd, buf, sizeof(buf));
 	close(fd);
 	if (err < 0) {
-		ERR(mod->ctx, "could not read from '%s': %s\n",
-			path, strerror(-err));
+		ERR(mod->ctx, "could not read from '/sys/module/%s/initstate': %s\n",
+			mod->name, strerror(-err));
 		return err;
 	}
 
@@ -1885,7 +4200,8 @@ KMOD_EXPORT int kmod_module_get_initstate(const struct kmod_module *mod)
 	else if (streq(buf, "going\n"))
 		return KMOD_MODULE_GOING;
 
-	ERR(mod->ctx, "unknown %s: '%s'\n", path, buf);
+	ERR(mod->ctx, "unknown /sys/module/%s/initstate: '%s'\n",
+		mod->name, buf);
 	return -EINVAL;
 }
 
@@ -1906,27 +4222,31 @@ KMOD_EXPORT long kmod_module_get_size(const struct kmod_module *mod)
 	char line[4096];
 	int lineno = 0;
 	long size = -ENOENT;
-	int dfd, cfd;
+	bool loaded;
+	int cfd;
 
 	if (mod == NULL)
 		return -ENOENT;
 
-	/* try to open the module dir in /sys. If this fails, don't
-	 * bother trying to find the size as we know the module isn't
-	 * loaded.
-	 */
-	snprintf(line, sizeof(line), "/sys/module/%s", mod->name);
-	dfd = open(line, O_RDONLY|O_CLOEXEC);
-	if (dfd < 0)
-		return -errno;
+	if (module_loaded_lock(mod)) {
+		size = mod->loaded.size;
+		kmod_pool_unlock(mod->ctx);
+		return size;
+	}
 
-	/* available as of linux 3.3.x */
-	cfd = openat(dfd, "coresize", O_RDONLY|O_CLOEXEC);
+	/* available as of linux 3.3.x. If the module dir in /sys doesn't
+	 * exist, don't bother trying to find the size as we know the module
+	 * isn't loaded.
+	 */
+	cfd = module_sysfs_openat(mod, "coresize", O_RDONLY, &loaded);
+	if (!loaded)
+		return cfd;
 	if (cfd >= 0) {
 		if (read_str_long(cfd, &size, 10) < 0)
-			ERR(mod->ctx, "failed to read coresize from %s\n", line);
+			ERR(mod->ctx, "failed to read coresize from /sys/module/%s\n",
+				mod->name);
 		close(cfd);
-		goto done;
+		return size;
 	}
 
 	/* fall back on parsing /proc/modules */
@@ -1935,7 +4255,6 @@ KMOD_EXPORT long kmod_module_get_size(const struct kmod_module *mod)
 		int err = -errno;
 		ERR(mod->ctx,
 		    "could not open /proc/modules: %s\n", strerror(errno));
-		close(dfd);
 		return err;
 	}
 
@@ -1970,8 +4289,6 @@ eat_line:
 	}
 	fclose(fp);
 
-done:
-	close(dfd);
 	return size;
 }
 
@@ -1986,33 +4303,74 @@ done:
  */
 KMOD_EXPORT int kmod_module_get_refcnt(const struct kmod_module *mod)
 {
-	char path[PATH_MAX];
 	long refcnt;
 	int fd, err;
 
 	if (mod == NULL)
 		return -ENOENT;
 
-	snprintf(path, sizeof(path), "/sys/module/%s/refcnt", mod->name);
-	fd = open(path, O_RDONLY|O_CLOEXEC);
-	if (fd < 0) {
-		err = -errno;
-		DBG(mod->ctx, "could not open '%s': %s\n",
-			path, strerror(errno));
+	if (module_loaded_lock(mod)) {
+		err = mod->loaded.refcnt;
+		kmod_pool_unlock(mod->ctx);
 		return err;
 	}
 
+	fd = module_sysfs_openat(mod, "refcnt", O_RDONLY, NULL);
+	if (fd < 0) {
+		DBG(mod->ctx, "could not open '/sys/module/%s/refcnt': %s\n",
+			mod->name, strerror(-fd));
+		return fd;
+	}
+
 	err = read_str_long(fd, &refcnt, 10);
 	close(fd);
 	if (err < 0) {
-		ERR(mod->ctx, "could not read integer from '%s': '%s'\n",
-			path, strerror(-err));
+		ERR(mod->ctx, "could not read integer from '/sys/module/%s/refcnt': '%s'\n",
+			mod->name, strerror(-err));
 		return err;
 	}
 
 	return (int)refcnt;
 }
 
+static struct kmod_list *module_holders_from_snapshot(
+					const struct kmod_module *mod,
+					char *holders, size_t len)
+{
+	struct kmod_list *list = NULL;
+	size_t pos;
+
+	for (pos = 0; pos < len; pos += strlen(holders + pos) + 1) {
+		struct kmod_module *holder;
+		struct kmod_list *l;
+		int err;
+
+		err = kmod_module_new_from_name(mod->ctx, holders + pos,
+						&holder);
+		if (err < 0) {
+			ERR(mod->ctx, "could not create module for '%s': %s\n",
+				holders + pos, strerror(-err));
+			goto fail;
+		}
+
+		l = kmod_list_append(list, holder);
+		if (l == NULL) {
+			ERR(mod->ctx, "out of memory\n");
+			kmod_module_unref(holder);
+			goto fail;
+		}
+		list = l;
+	}
+
+	free(holders);
+	return list;
+
+fail:
+	free(holders);
+	kmod_module_unref_list(list);
+	return NULL;
+}
+
 /**
  * kmod_module_get_holders:
  * @mod: kmod module
@@ -2032,9 +4390,25 @@ KMOD_EXPORT struct kmod_list *kmod_module_get_holders(const struct kmod_module *
 	if (mod == NULL || mod->ctx == NULL)
 		return NULL;
 
+	if (module_loaded_lock(mod)) {
+		size_t len = mod->loaded.holders_len;
+		char *holders = NULL;
+
+		if (len > 0)
+			holders = memdup(mod->loaded.holders, len);
+
+		kmod_pool_unlock(mod->ctx);
+		if (len > 0 && holders == NULL) {
+			ERR(mod->ctx, "out of memory\n");
+			return NULL;
+		}
+
+		return module_holders_from_snapshot(mod, holders, len);
+	}
+
 	snprintf(dname, sizeof(dname), "/sys/module/%s/holders", mod->name);
 
-	d = opendir(dname);
+	d = module_sysfs_opendir(mod, "holders");
 	if (d == NULL) {
 		ERR(mod->ctx, "could not open '%s': %s\n",
 						dname, strerror(errno));
@@ -2115,7 +4489,7 @@ KMOD_EXPORT struct kmod_list *kmod_module_get_sections(const struct kmod_module
 
 	snprintf(dname, sizeof(dname), "/sys/module/%s/sections", mod->name);
 
-	d = opendir(dname);
+	d = module_sysfs_opendir(mod, "sections");
 	if (d == NULL) {
 		ERR(mod->ctx, "could not open '%s': %s\n",
 			dname, strerror(errno));
@@ -2242,7 +4616,11 @@ KMOD_EXPORT void kmod_module_section_free_list(struct kmod_list *list)
 
 static struct kmod_elf *kmod_module_get_elf(const struct kmod_module *mod)
 {
-	if (mod->file == NULL) {
+	struct kmod_module *m = (struct kmod_module *)mod;
+	struct kmod_file *file, *unused = NULL;
+
+	file = __atomic_load_n(&mod->file, __ATOMIC_ACQUIRE);
+	if (file == NULL) {
 		const char *path = kmod_module_get_path(mod);
 
 		if (path == NULL) {
@@ -2250,13 +4628,38 @@ static struct kmod_elf *kmod_module_get_elf(const struct kmod_module *mod)
 			return NULL;
 		}
 
-		((struct kmod_module *)mod)->file = kmod_file_open(mod->ctx,
-									path);
-		if (mod->file == NULL)
+		file = kmod_file_open(mod->ctx, path);
+		if (file == NULL)
 			return NULL;
+
+		/* parse it before it can be seen by other threads */
+		kmod_file_get_elf(file);
+
+		kmod_pool_lock(mod->ctx);
+		if (m->file == NULL) {
+			__atomic_store_n(&m->file, file, __ATOMIC_RELEASE);
+		} else {
+			unused = file;
+			file = m->file;
+		}
+		kmod_pool_unlock(mod->ctx);
+
+		if (unused != NULL)
+			kmod_file_unref(unused);
 	}
 
-	return kmod_file_get_elf(mod->file);
+	return kmod_file_get_elf(file);
+}
+
+/*
+ * Size of the contents of the module file, after decompression, or 0 if it
+ * wasn't opened. For depmod --stats.
+ */
+off_t kmod_module_get_file_size(const struct kmod_module *mod)
+{
+	struct kmod_file *file = __atomic_load_n(&mod->file, __ATOMIC_ACQUIRE);
+
+	return file != NULL ? kmod_file_get_size(file) : 0;
 }
 
 struct kmod_module_info {
@@ -2264,11 +4667,16 @@ struct kmod_module_info {
 	char value[];
 };
 
-static struct kmod_module_info *kmod_module_info_new(const char *key, size_t keylen, const char *value, size_t valuelen)
+/*
+ * The info, version, symbol and dependency symbol lists keep each element
+ * in its node, see kmod_list_append_new(): removing the node releases it.
+ */
+struct kmod_list *kmod_module_info_append(struct kmod_list **list, const char *key, size_t keylen, const char *value, size_t valuelen)
 {
 	struct kmod_module_info *info;
 
-	info = malloc(sizeof(struct kmod_module_info) + keylen + valuelen + 2);
+	info = kmod_list_append_new(list, sizeof(struct kmod_module_info) +
+						keylen + valuelen + 2);
 	if (info == NULL)
 		return NULL;
 
@@ -2278,28 +4686,7 @@ static struct kmod_module_info *kmod_module_info_new(const char *key, size_t key
 	info->key[keylen] = '\0';
 	memcpy(info->value, value, valuelen);
 	info->value[valuelen] = '\0';
-	return info;
-}
-
-static void kmod_module_info_free(struct kmod_module_info *info)
-{
-	free(info);
-}
-
-static struct kmod_list *kmod_module_info_append(struct kmod_list **list, const char *key, size_t keylen, const char *value, size_t valuelen)
-{
-	struct kmod_module_info *info;
-	struct kmod_list *n;
-
-	info = kmod_module_info_new(key, keylen, value, valuelen);
-	if (info == NULL)
-		return NULL;
-	n = kmod_list_append(*list, info);
-	if (n != NULL)
-		*list = n;
-	else
-		kmod_module_info_free(info);
-	return n;
+	return *list;
 }
 
 static char *kmod_module_hex_to_str(const char *hex, size_t len)
@@ -2335,77 +4722,39 @@ static struct kmod_list *kmod_module_info_append_hex(struct kmod_list **list,
 						     const char *value,
 						     size_t valuelen)
 {
-	char *hex;
-	struct kmod_list *n;
-
-	if (valuelen > 0) {
-		/* Display as 01:12:DE:AD:BE:EF:... */
-		hex = kmod_module_hex_to_str(value, valuelen);
-		if (hex == NULL)
-			goto list_error;
-		n = kmod_module_info_append(list, key, keylen, hex, strlen(hex));
-		free(hex);
-		if (n == NULL)
-			goto list_error;
-	} else {
-		n = kmod_module_info_append(list, key, keylen, NULL, 0);
-		if (n == NULL)
-			goto list_error;
-	}
-
-	return n;
-
-list_error:
-	return NULL;
-}
-
-/**
- * kmod_module_get_info:
- * @mod: kmod module
- * @list: where to return list of module information. Use
- *        kmod_module_info_get_key() and
- *        kmod_module_info_get_value(). Release this list with
- *        kmod_module_info_free_list()
- *
- * Get a list of entries in ELF section ".modinfo", these contain
- * alias, license, depends, vermagic and other keys with respective
- * values. If the module is signed (CONFIG_MODULE_SIG), information
- * about the module signature is included as well: signer,
- * sig_key and sig_hashalgo.
- *
- * After use, free the @list by calling kmod_module_info_free_list().
- *
- * Returns: number of entries in @list on success or < 0 otherwise.
- */
-KMOD_EXPORT int kmod_module_get_info(const struct kmod_module *mod, struct kmod_list **list)
-{
-	struct kmod_elf *elf;
-	char **strings;
-	int i, count, ret = -ENOMEM;
-	struct kmod_signature_info sig_info = {};
-
-	if (mod == NULL || list == NULL)
-		return -ENOENT;
-
-	assert(*list == NULL);
+	char *hex;
+	struct kmod_list *n;
 
-	/* remove const: this can only change internal state */
-	if (kmod_module_is_builtin((struct kmod_module *)mod)) {
-		count = kmod_builtin_get_modinfo(mod->ctx,
-						kmod_module_get_name(mod),
-						&strings);
-		if (count < 0)
-			return count;
+	if (valuelen > 0) {
+		/* Display as 01:12:DE:AD:BE:EF:... */
+		hex = kmod_module_hex_to_str(value, valuelen);
+		if (hex == NULL)
+			goto list_error;
+		n = kmod_module_info_append(list, key, keylen, hex, strlen(hex));
+		free(hex);
+		if (n == NULL)
+			goto list_error;
 	} else {
-		elf = kmod_module_get_elf(mod);
-		if (elf == NULL)
-			return -errno;
-
-		count = kmod_elf_get_strings(elf, ".modinfo", &strings);
-		if (count < 0)
-			return count;
+		n = kmod_module_info_append(list, key, keylen, NULL, 0);
+		if (n == NULL)
+			goto list_error;
 	}
 
+	return n;
+
+list_error:
+	return NULL;
+}
+
+/* takes ownership of @strings */
+static int kmod_module_info_from_strings(const struct kmod_module *mod,
+					char **strings, int count,
+					unsigned int flags,
+					struct kmod_list **list)
+{
+	struct kmod_signature_info sig_info = {};
+	int i, ret = -ENOMEM;
+
 	for (i = 0; i < count; i++) {
 		struct kmod_list *n;
 		const char *key, *value;
@@ -2428,7 +4777,8 @@ KMOD_EXPORT int kmod_module_get_info(const struct kmod_module *mod, struct kmod_
 			goto list_error;
 	}
 
-	if (mod->file && kmod_module_signature_info(mod->file, &sig_info)) {
+	if (!(flags & KMOD_INFO_NO_SIGNATURE) && mod->file &&
+			kmod_module_signature_info(mod->file, &sig_info)) {
 		struct kmod_list *n;
 
 		n = kmod_module_info_append(list, "sig_id", strlen("sig_id"),
@@ -2486,6 +4836,152 @@ list_error:
 	return ret;
 }
 
+/**
+ * kmod_module_get_info:
+ * @mod: kmod module
+ * @list: where to return list of module information. Use
+ *        kmod_module_info_get_key() and
+ *        kmod_module_info_get_value(). Release this list with
+ *        kmod_module_info_free_list()
+ *
+ * Get a list of entries in ELF section ".modinfo", these contain
+ * alias, license, depends, vermagic and other keys with respective
+ * values. If the module is signed (CONFIG_MODULE_SIG), information
+ * about the module signature is included as well: signer,
+ * sig_key and sig_hashalgo.
+ *
+ * After use, free the @list by calling kmod_module_info_free_list().
+ *
+ * Returns: number of entries in @list on success or < 0 otherwise.
+ */
+KMOD_EXPORT int kmod_module_get_info(const struct kmod_module *mod, struct kmod_list **list)
+{
+	return kmod_module_get_info_flags(mod, 0, list);
+}
+
+/**
+ * kmod_module_get_info_flags:
+ * @mod: kmod module
+ * @flags: flags to select which entries are returned, valid flags are
+ * KMOD_INFO_NO_SIGNATURE: leave out the fields decoded from the module
+ * signature, so it isn't parsed at all.
+ * @list: where to return list of module information, as with
+ *        kmod_module_get_info()
+ *
+ * Like kmod_module_get_info(), but lets the caller skip work it doesn't
+ * need. Decoding the signature can be much more expensive than reading
+ * ".modinfo", in particular for PKCS#7 signatures.
+ *
+ * After use, free the @list by calling kmod_module_info_free_list().
+ *
+ * Returns: number of entries in @list on success or < 0 otherwise.
+ */
+KMOD_EXPORT int kmod_module_get_info_flags(const struct kmod_module *mod,
+						unsigned int flags,
+						struct kmod_list **list)
+{
+	struct kmod_elf *elf;
+	char **strings;
+	int count;
+
+	if (mod == NULL || list == NULL)
+		return -ENOENT;
+
+	assert(*list == NULL);
+
+	/* remove const: this can only change internal state */
+	if (kmod_module_is_builtin((struct kmod_module *)mod)) {
+		count = kmod_builtin_get_modinfo(mod->ctx,
+						kmod_module_get_name(mod),
+						&strings);
+		if (count < 0)
+			return count;
+	} else {
+		elf = kmod_module_get_elf(mod);
+		if (elf == NULL)
+			return -errno;
+
+		count = kmod_elf_get_strings(elf, ".modinfo", &strings);
+		if (count < 0)
+			return count;
+	}
+
+	return kmod_module_info_from_strings(mod, strings, count, flags, list);
+}
+
+/**
+ * kmod_module_get_info_next:
+ * @mod: kmod module
+ * @pos: position in the ".modinfo" section, start with 0
+ * @key: where to return the key of the entry
+ * @keylen: where to return the length of @key
+ * @value: where to return the value of the entry
+ * @valuelen: where to return the length of @value
+ *
+ * Iterate the entries in ELF section ".modinfo" without copying them:
+ * @key and @value point into the module image and stay valid until @mod
+ * is released. Neither is NUL-terminated, use @keylen and @valuelen. An
+ * entry with no "=" gives an empty value.
+ *
+ * Unlike kmod_module_get_info(), this only works for modules with a file
+ * and doesn't report the module signature.
+ *
+ * Returns: 1 if an entry was returned and @pos moved past it, 0 after the
+ * last entry or < 0 on failure.
+ */
+KMOD_EXPORT int kmod_module_get_info_next(const struct kmod_module *mod,
+					size_t *pos,
+					const char **key, size_t *keylen,
+					const char **value, size_t *valuelen)
+{
+	struct kmod_elf *elf;
+	const char *strings, *entry, *end, *eq;
+	const void *buf;
+	uint64_t size;
+	size_t i, len;
+	int err;
+
+	if (mod == NULL || pos == NULL || key == NULL || keylen == NULL ||
+				value == NULL || valuelen == NULL)
+		return -ENOENT;
+
+	elf = kmod_module_get_elf(mod);
+	if (elf == NULL)
+		return -errno;
+
+	err = kmod_elf_get_section(elf, ".modinfo", &buf, &size);
+	if (err < 0)
+		return err;
+
+	/* skip zero padding, as kmod_elf_get_strings() does */
+	strings = buf;
+	for (i = *pos; i < size && strings[i] == '\0'; i++)
+		;
+	if (i >= size) {
+		*pos = size;
+		return 0;
+	}
+
+	entry = strings + i;
+	end = memchr(entry, '\0', size - i);
+	len = end != NULL ? (size_t)(end - entry) : size - i;
+	*pos = i + len;
+
+	eq = memchr(entry, '=', len);
+	*key = entry;
+	if (eq == NULL) {
+		*keylen = len;
+		*value = entry + len;
+		*valuelen = 0;
+	} else {
+		*keylen = eq - entry;
+		*value = eq + 1;
+		*valuelen = len - *keylen - 1;
+	}
+
+	return 1;
+}
+
 /**
  * kmod_module_info_get_key:
  * @entry: a list entry representing a kmod module info
@@ -2534,10 +5030,8 @@ KMOD_EXPORT const char *kmod_module_info_get_value(const struct kmod_list *entry
  */
 KMOD_EXPORT void kmod_module_info_free_list(struct kmod_list *list)
 {
-	while (list) {
-		kmod_module_info_free(list->data);
+	while (list)
 		list = kmod_list_remove(list);
-	}
 }
 
 struct kmod_module_version {
@@ -2545,12 +5039,15 @@ struct kmod_module_version {
 	char symbol[];
 };
 
-static struct kmod_module_version *kmod_module_versions_new(uint64_t crc, const char *symbol)
+static struct kmod_module_version *kmod_module_versions_append(
+						struct kmod_list **list,
+						uint64_t crc, const char *symbol)
 {
 	struct kmod_module_version *mv;
 	size_t symbollen = strlen(symbol) + 1;
 
-	mv = malloc(sizeof(struct kmod_module_version) + symbollen);
+	mv = kmod_list_append_new(list, sizeof(struct kmod_module_version) +
+								symbollen);
 	if (mv == NULL)
 		return NULL;
 
@@ -2559,9 +5056,26 @@ static struct kmod_module_version *kmod_module_versions_new(uint64_t crc, const
 	return mv;
 }
 
-static void kmod_module_version_free(struct kmod_module_version *version)
+/* takes ownership of @versions */
+static int kmod_module_versions_from_array(struct kmod_modversion *versions,
+					int count, struct kmod_list **list)
 {
-	free(version);
+	int i, ret = 0;
+
+	for (i = 0; i < count; i++) {
+		if (kmod_module_versions_append(list, versions[i].crc,
+						versions[i].symbol) == NULL) {
+			kmod_module_versions_free_list(*list);
+			*list = NULL;
+			ret = -ENOMEM;
+			goto list_error;
+		}
+	}
+	ret = count;
+
+list_error:
+	free(versions);
+	return ret;
 }
 
 /**
@@ -2582,7 +5096,7 @@ KMOD_EXPORT int kmod_module_get_versions(const struct kmod_module *mod, struct k
 {
 	struct kmod_elf *elf;
 	struct kmod_modversion *versions;
-	int i, count, ret = 0;
+	int count;
 
 	if (mod == NULL || list == NULL)
 		return -ENOENT;
@@ -2597,34 +5111,7 @@ KMOD_EXPORT int kmod_module_get_versions(const struct kmod_module *mod, struct k
 	if (count < 0)
 		return count;
 
-	for (i = 0; i < count; i++) {
-		struct kmod_module_version *mv;
-		struct kmod_list *n;
-
-		mv = kmod_module_versions_new(versions[i].crc, versions[i].symbol);
-		if (mv == NULL) {
-			ret = -errno;
-			kmod_module_versions_free_list(*list);
-			*list = NULL;
-			goto list_error;
-		}
-
-		n = kmod_list_append(*list, mv);
-		if (n != NULL)
-			*list = n;
-		else {
-			kmod_module_version_free(mv);
-			kmod_module_versions_free_list(*list);
-			*list = NULL;
-			ret = -ENOMEM;
-			goto list_error;
-		}
-	}
-	ret = count;
-
-list_error:
-	free(versions);
-	return ret;
+	return kmod_module_versions_from_array(versions, count, list);
 }
 
 /**
@@ -2674,10 +5161,8 @@ KMOD_EXPORT uint64_t kmod_module_version_get_crc(const struct kmod_list *entry)
  */
 KMOD_EXPORT void kmod_module_versions_free_list(struct kmod_list *list)
 {
-	while (list) {
-		kmod_module_version_free(list->data);
+	while (list)
 		list = kmod_list_remove(list);
-	}
 }
 
 struct kmod_module_symbol {
@@ -2685,23 +5170,43 @@ struct kmod_module_symbol {
 	char symbol[];
 };
 
-static struct kmod_module_symbol *kmod_module_symbols_new(uint64_t crc, const char *symbol)
+/* build a list like kmod_module_get_symbols() does, for depmod's cache */
+struct kmod_list *kmod_module_symbol_append(struct kmod_list **list,
+					uint64_t crc, const char *symbol)
 {
 	struct kmod_module_symbol *mv;
 	size_t symbollen = strlen(symbol) + 1;
 
-	mv = malloc(sizeof(struct kmod_module_symbol) + symbollen);
+	mv = kmod_list_append_new(list, sizeof(struct kmod_module_symbol) +
+								symbollen);
 	if (mv == NULL)
 		return NULL;
 
 	mv->crc = crc;
 	memcpy(mv->symbol, symbol, symbollen);
-	return mv;
+	return *list;
 }
 
-static void kmod_module_symbol_free(struct kmod_module_symbol *symbol)
+/* takes ownership of @symbols */
+static int kmod_module_symbols_from_array(struct kmod_modversion *symbols,
+					int count, struct kmod_list **list)
 {
-	free(symbol);
+	int i, ret = 0;
+
+	for (i = 0; i < count; i++) {
+		if (kmod_module_symbol_append(list, symbols[i].crc,
+						symbols[i].symbol) == NULL) {
+			kmod_module_symbols_free_list(*list);
+			*list = NULL;
+			ret = -ENOMEM;
+			goto list_error;
+		}
+	}
+	ret = count;
+
+list_error:
+	free(symbols);
+	return ret;
 }
 
 /**
@@ -2722,7 +5227,7 @@ KMOD_EXPORT int kmod_module_get_symbols(const struct kmod_module *mod, struct km
 {
 	struct kmod_elf *elf;
 	struct kmod_modversion *symbols;
-	int i, count, ret = 0;
+	int count;
 
 	if (mod == NULL || list == NULL)
 		return -ENOENT;
@@ -2737,34 +5242,7 @@ KMOD_EXPORT int kmod_module_get_symbols(const struct kmod_module *mod, struct km
 	if (count < 0)
 		return count;
 
-	for (i = 0; i < count; i++) {
-		struct kmod_module_symbol *mv;
-		struct kmod_list *n;
-
-		mv = kmod_module_symbols_new(symbols[i].crc, symbols[i].symbol);
-		if (mv == NULL) {
-			ret = -errno;
-			kmod_module_symbols_free_list(*list);
-			*list = NULL;
-			goto list_error;
-		}
-
-		n = kmod_list_append(*list, mv);
-		if (n != NULL)
-			*list = n;
-		else {
-			kmod_module_symbol_free(mv);
-			kmod_module_symbols_free_list(*list);
-			*list = NULL;
-			ret = -ENOMEM;
-			goto list_error;
-		}
-	}
-	ret = count;
-
-list_error:
-	free(symbols);
-	return ret;
+	return kmod_module_symbols_from_array(symbols, count, list);
 }
 
 /**
@@ -2814,10 +5292,8 @@ KMOD_EXPORT uint64_t kmod_module_symbol_get_crc(const struct kmod_list *entry)
  */
 KMOD_EXPORT void kmod_module_symbols_free_list(struct kmod_list *list)
 {
-	while (list) {
-		kmod_module_symbol_free(list->data);
+	while (list)
 		list = kmod_list_remove(list);
-	}
 }
 
 struct kmod_module_dependency_symbol {
@@ -2826,24 +5302,47 @@ struct kmod_module_dependency_symbol {
 	char symbol[];
 };
 
-static struct kmod_module_dependency_symbol *kmod_module_dependency_symbols_new(uint64_t crc, uint8_t bind, const char *symbol)
+/* build a list like kmod_module_get_dependency_symbols() does */
+struct kmod_list *kmod_module_dependency_symbol_append(struct kmod_list **list,
+					uint64_t crc, uint8_t bind,
+					const char *symbol)
 {
 	struct kmod_module_dependency_symbol *mv;
 	size_t symbollen = strlen(symbol) + 1;
 
-	mv = malloc(sizeof(struct kmod_module_dependency_symbol) + symbollen);
+	mv = kmod_list_append_new(list,
+			sizeof(struct kmod_module_dependency_symbol) +
+								symbollen);
 	if (mv == NULL)
 		return NULL;
 
 	mv->crc = crc;
 	mv->bind = bind;
 	memcpy(mv->symbol, symbol, symbollen);
-	return mv;
+	return *list;
 }
 
-static void kmod_module_dependency_symbol_free(struct kmod_module_dependency_symbol *dependency_symbol)
+/* takes ownership of @symbols */
+static int kmod_module_dependency_symbols_from_array(struct kmod_modversion *symbols,
+					int count, struct kmod_list **list)
 {
-	free(dependency_symbol);
+	int i, ret = 0;
+
+	for (i = 0; i < count; i++) {
+		if (kmod_module_dependency_symbol_append(list, symbols[i].crc,
+						symbols[i].bind,
+						symbols[i].symbol) == NULL) {
+			kmod_module_dependency_symbols_free_list(*list);
+			*list = NULL;
+			ret = -ENOMEM;
+			goto list_error;
+		}
+	}
+	ret = count;
+
+list_error:
+	free(symbols);
+	return ret;
 }
 
 /**
@@ -2865,7 +5364,7 @@ KMOD_EXPORT int kmod_module_get_dependency_symbols(const struct kmod_module *mod
 {
 	struct kmod_elf *elf;
 	struct kmod_modversion *symbols;
-	int i, count, ret = 0;
+	int count;
 
 	if (mod == NULL || list == NULL)
 		return -ENOENT;
@@ -2880,36 +5379,90 @@ KMOD_EXPORT int kmod_module_get_dependency_symbols(const struct kmod_module *mod
 	if (count < 0)
 		return count;
 
-	for (i = 0; i < count; i++) {
-		struct kmod_module_dependency_symbol *mv;
-		struct kmod_list *n;
+	return kmod_module_dependency_symbols_from_array(symbols, count, list);
+}
 
-		mv = kmod_module_dependency_symbols_new(symbols[i].crc,
-							symbols[i].bind,
-							symbols[i].symbol);
-		if (mv == NULL) {
-			ret = -errno;
-			kmod_module_dependency_symbols_free_list(*list);
-			*list = NULL;
-			goto list_error;
-		}
+/*
+ * Fill the lists selected by @which, the same as kmod_module_get_info(),
+ * kmod_module_get_versions(), kmod_module_get_symbols() and
+ * kmod_module_get_dependency_symbols() would, but looking the ELF up once
+ * and walking .symtab a single time for both kinds of symbols. Each *_ret
+ * is what the matching function returns: they fail independently.
+ */
+void kmod_module_get_lists(const struct kmod_module *mod, unsigned int which,
+					struct kmod_module_lists *lists)
+{
+	unsigned int info_flags = 0;
+	struct kmod_modversion *symbols, *deps;
+	struct kmod_elf *elf;
+	char **strings;
+	int count, depcount;
 
-		n = kmod_list_append(*list, mv);
-		if (n != NULL)
-			*list = n;
-		else {
-			kmod_module_dependency_symbol_free(mv);
-			kmod_module_dependency_symbols_free_list(*list);
-			*list = NULL;
-			ret = -ENOMEM;
-			goto list_error;
-		}
+	if (which & KMOD_MODULE_LIST_INFO_NO_SIGNATURE)
+		info_flags |= KMOD_INFO_NO_SIGNATURE;
+
+	memset(lists, 0, sizeof(*lists));
+
+	elf = kmod_module_get_elf(mod);
+	if (elf == NULL) {
+		int err = -errno;
+
+		/* builtin modules still have a .modinfo */
+		if (which & KMOD_MODULE_LIST_INFO)
+			lists->info_ret = kmod_module_get_info_flags(mod,
+						info_flags, &lists->info);
+		if (which & KMOD_MODULE_LIST_VERSIONS)
+			lists->versions_ret = err;
+		if (which & KMOD_MODULE_LIST_SYMBOLS)
+			lists->symbols_ret = err;
+		if (which & KMOD_MODULE_LIST_DEPENDENCY_SYMBOLS)
+			lists->dependency_symbols_ret = err;
+		return;
 	}
-	ret = count;
 
-list_error:
-	free(symbols);
-	return ret;
+	if (which & KMOD_MODULE_LIST_INFO) {
+		count = kmod_elf_get_strings(elf, ".modinfo", &strings);
+		if (count < 0)
+			lists->info_ret = count;
+		else
+			lists->info_ret = kmod_module_info_from_strings(mod,
+					strings, count, info_flags, &lists->info);
+	}
+
+	if (which & KMOD_MODULE_LIST_VERSIONS) {
+		count = kmod_elf_get_modversions(elf, &symbols);
+		if (count < 0)
+			lists->versions_ret = count;
+		else
+			lists->versions_ret = kmod_module_versions_from_array(
+					symbols, count, &lists->versions);
+	}
+
+	if (!(which & (KMOD_MODULE_LIST_SYMBOLS |
+				KMOD_MODULE_LIST_DEPENDENCY_SYMBOLS)))
+		return;
+
+	kmod_elf_get_symbol_tables(elf,
+		(which & KMOD_MODULE_LIST_SYMBOLS) ? &symbols : NULL, &count,
+		(which & KMOD_MODULE_LIST_DEPENDENCY_SYMBOLS) ? &deps : NULL,
+								&depcount);
+
+	if (which & KMOD_MODULE_LIST_SYMBOLS) {
+		if (count < 0)
+			lists->symbols_ret = count;
+		else
+			lists->symbols_ret = kmod_module_symbols_from_array(
+					symbols, count, &lists->symbols);
+	}
+
+	if (which & KMOD_MODULE_LIST_DEPENDENCY_SYMBOLS) {
+		if (depcount < 0)
+			lists->dependency_symbols_ret = depcount;
+		else
+			lists->dependency_symbols_ret =
+				kmod_module_dependency_symbols_from_array(deps,
+					depcount, &lists->dependency_symbols);
+	}
 }
 
 /**
@@ -2979,8 +5532,6 @@ KMOD_EXPORT int kmod_module_dependency_symbol_get_bind(const struct kmod_list *e
  */
 KMOD_EXPORT void kmod_module_dependency_symbols_free_list(struct kmod_list *list)
 {
-	while (list) {
-		kmod_module_dependency_symbol_free(list->data);
+	while (list)
 		list = kmod_list_remove(list);
-	}
 }
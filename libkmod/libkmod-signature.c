@@ -315,17 +315,25 @@ static bool fill_pkcs7(const char *mem, off_t size,
  * [ SIG_MAGIC               ]
  */
 
-bool kmod_module_signature_info(const struct kmod_file *file, struct kmod_signature_info *sig_info)
+bool kmod_module_signature_info(struct kmod_file *file, struct kmod_signature_info *sig_info)
 {
 	const char *mem;
-	off_t size;
+	off_t size, tail;
 	const struct module_signature *modsig;
 	size_t sig_len;
 
 	size = kmod_file_get_size(file);
-	mem = kmod_file_get_contents(file);
 	if (size < (off_t)strlen(SIG_MAGIC))
 		return false;
+
+	/* only the end of the image is read, which may not be loaded yet */
+	tail = strlen(SIG_MAGIC) + sizeof(struct module_signature);
+	if (tail > size)
+		tail = size;
+	if (kmod_file_load_range(file, size - tail, tail) < 0)
+		return false;
+
+	mem = kmod_file_get_contents(file);
 	size -= strlen(SIG_MAGIC);
 	if (memcmp(SIG_MAGIC, mem + size, strlen(SIG_MAGIC)) != 0)
 		return false;
@@ -343,6 +351,10 @@ bool kmod_module_signature_info(const struct kmod_file *file, struct kmod_signat
 	    size < (int64_t)(modsig->signer_len + modsig->key_id_len + sig_len))
 		return false;
 
+	tail = modsig->signer_len + modsig->key_id_len + sig_len;
+	if (kmod_file_load_range(file, size - tail, tail) < 0)
+		return false;
+
 	switch (modsig->id_type) {
 	case PKEY_ID_PKCS7:
 		return fill_pkcs7(mem, size, modsig, sig_len, sig_info);
@@ -20,14 +20,15 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
-#include <fnmatch.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
 
@@ -41,6 +42,11 @@
 #define KMOD_HASH_SIZE (256)
 #define KMOD_LRU_MAX (128)
 #define _KMOD_INDEX_MODULES_SIZE KMOD_INDEX_MODULES_BUILTIN + 1
+/* the indexes depmod --delta writes a delta of */
+#define _KMOD_DELTA_SIZE KMOD_INDEX_MODULES_SYMBOL + 1
+#define MODDEP_IDS_FN "modules.dep.ids.bin"
+#define SYMHASH_FN "modules.symbols.hash.bin"
+#define SOFTDEP_FN "modules.softdep"
 
 /**
  * SECTION:libkmod
@@ -48,6 +54,14 @@
  *
  * The context contains the default values for the library user,
  * and is passed to all library operations.
+ *
+ * Once kmod_load_resources() returned, a context may be shared by several
+ * threads to look up modules and query them, e.g. with
+ * kmod_module_new_from_lookup(), kmod_module_get_dependencies(),
+ * kmod_module_get_path() or kmod_module_get_info(). Changing the context,
+ * e.g. with kmod_set_log_fn(), kmod_unload_resources() or
+ * kmod_validate_resources(), and inserting, probing or removing modules
+ * still need to be serialized by the caller.
  */
 
 static const struct {
@@ -77,6 +91,8 @@ static const char *const default_config_paths[] = {
  */
 struct kmod_ctx {
 	int refcount;
+	/* protects modules_by_name, modules_lru and the lookup cache */
+	pthread_mutex_t pool_lock;
 	int log_priority;
 	void (*log_fn)(void *data,
 			int priority, const char *file, int line,
@@ -87,8 +103,52 @@ struct kmod_ctx {
 	enum kmod_file_compression_type kernel_compression;
 	struct kmod_config *config;
 	struct hash *modules_by_name;
+	struct kmod_module_lru modules_lru;
+	struct kmod_probe_cache probe_cache;
 	struct index_mm *indexes[_KMOD_INDEX_MODULES_SIZE];
 	unsigned long long indexes_stamp[_KMOD_INDEX_MODULES_SIZE];
+	enum kmod_index_preload indexes_preload[_KMOD_INDEX_MODULES_SIZE];
+	struct index_bundle *bundle;
+	unsigned long long bundle_stamp;
+	struct index_moddep *moddep_ids;
+	unsigned long long moddep_ids_stamp;
+	struct index_symhash *symhash;
+	unsigned long long symhash_stamp;
+	/* owners given by kmod_resolve_symbols() without symhash */
+	struct hash *symbol_owners;
+	struct index_mm *softdeps;
+	unsigned long long softdeps_stamp;
+	struct kmod_builtin_modinfo *builtin_modinfo;
+	/* of depmod --delta, looked up before the index of the same type */
+	struct index_mm *deltas[_KMOD_DELTA_SIZE];
+	unsigned long long deltas_stamp[_KMOD_DELTA_SIZE];
+	struct hash *lookup_cache;
+	struct kmod_lookup_entry *lookup_head, *lookup_tail;
+	unsigned int lookup_cache_size;
+	unsigned int decompress_threads;
+	char *decompress_cache;
+	/* inotify of kmod_watch_resources(), -1 if not watching */
+	int watch_fd;
+	/* something changed since the last validation found all current */
+	bool watch_dirty;
+	/* a watch was lost, only stat() can tell */
+	bool watch_broken;
+	/* generation of the current snapshot of loaded modules, 0 for none */
+	unsigned int loaded_gen;
+	unsigned long long loaded_stamp;
+	uint64_t stats[_KMOD_STAT_COUNT];
+	uint64_t index_lookups[_KMOD_INDEX_MODULES_SIZE];
+};
+
+/*
+ * Result of a lookup in the cache: the pool keys of the modules it resolved
+ * to, stored after the alias. Modules are not referenced from here, they
+ * are fetched from the pool again on a hit.
+ */
+struct kmod_lookup_entry {
+	struct kmod_lookup_entry *prev, *next;
+	unsigned int n_keys;
+	char alias[];
 };
 
 void kmod_log(const struct kmod_ctx *ctx,
@@ -277,17 +337,37 @@ static enum kmod_file_compression_type get_kernel_compression(struct kmod_ctx *c
  *                /lib/modprobe.d. Give an empty vector if configuration should
  *                not be read. This array must be null terminated.
  *
- * Create kmod library context. This reads the kmod configuration
- * and fills in the default values.
+ * Create kmod library context. This fills in the default values. The kmod
+ * configuration is read the first time something needs it, and the kernel
+ * command line only when blacklists or module options are looked up.
  *
  * The initial refcount is 1, and needs to be decremented to
  * release the resources of the kmod library context.
  *
  * Returns: a new kmod library context
  */
+static void index_preload_from_env(struct kmod_ctx *ctx, const char *env)
+{
+	enum kmod_index_preload preload;
+	size_t i;
+
+	if (streq(env, "lazy"))
+		preload = KMOD_INDEX_PRELOAD_LAZY;
+	else if (streq(env, "hot"))
+		preload = KMOD_INDEX_PRELOAD_HOT;
+	else if (streq(env, "all"))
+		preload = KMOD_INDEX_PRELOAD_ALL;
+	else
+		return;
+
+	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++)
+		ctx->indexes_preload[i] = preload;
+}
+
 KMOD_EXPORT struct kmod_ctx *kmod_new(const char *dirname,
 					const char * const *config_paths)
 {
+	unsigned long long t0;
 	const char *env;
 	struct kmod_ctx *ctx;
 	int err;
@@ -297,6 +377,8 @@ KMOD_EXPORT struct kmod_ctx *kmod_new(const char *dirname,
 		return NULL;
 
 	ctx->refcount = 1;
+	ctx->watch_fd = -1;
+	pthread_mutex_init(&ctx->pool_lock, NULL);
 	ctx->log_fn = log_filep;
 	ctx->log_data = stderr;
 	ctx->log_priority = LOG_ERR;
@@ -308,11 +390,21 @@ KMOD_EXPORT struct kmod_ctx *kmod_new(const char *dirname,
 	if (env != NULL)
 		kmod_set_log_priority(ctx, log_priority(env));
 
+	env = secure_getenv("KMOD_DECOMPRESS_CACHE");
+	if (env != NULL && *env != '\0')
+		kmod_set_decompress_cache(ctx, env);
+
+	env = secure_getenv("KMOD_INDEX_PRELOAD");
+	if (env != NULL)
+		index_preload_from_env(ctx, env);
+
 	ctx->kernel_compression = get_kernel_compression(ctx);
 
 	if (config_paths == NULL)
 		config_paths = default_config_paths;
+	t0 = now_usec();
 	err = kmod_config_new(ctx, &ctx->config, config_paths);
+	ctx->stats[KMOD_STAT_CONFIG_USEC] = now_usec() - t0;
 	if (err < 0) {
 		ERR(ctx, "could not create config\n");
 		goto fail;
@@ -323,6 +415,8 @@ KMOD_EXPORT struct kmod_ctx *kmod_new(const char *dirname,
 		ERR(ctx, "could not create by-name hash\n");
 		goto fail;
 	}
+	ctx->modules_lru.max = KMOD_LRU_MAX;
+	ctx->decompress_threads = 1;
 
 	INFO(ctx, "ctx %p created\n", ctx);
 	DBG(ctx, "log_priority=%d\n", ctx->log_priority);
@@ -331,7 +425,9 @@ KMOD_EXPORT struct kmod_ctx *kmod_new(const char *dirname,
 
 fail:
 	free(ctx->modules_by_name);
+	free(ctx->decompress_cache);
 	free(ctx->dirname);
+	pthread_mutex_destroy(&ctx->pool_lock);
 	free(ctx);
 	return NULL;
 }
@@ -348,7 +444,7 @@ KMOD_EXPORT struct kmod_ctx *kmod_ref(struct kmod_ctx *ctx)
 {
 	if (ctx == NULL)
 		return NULL;
-	ctx->refcount++;
+	__atomic_add_fetch(&ctx->refcount, 1, __ATOMIC_RELAXED);
 	return ctx;
 }
 
@@ -366,17 +462,25 @@ KMOD_EXPORT struct kmod_ctx *kmod_unref(struct kmod_ctx *ctx)
 	if (ctx == NULL)
 		return NULL;
 
-	if (--ctx->refcount > 0)
+	if (__atomic_sub_fetch(&ctx->refcount, 1, __ATOMIC_ACQ_REL) > 0)
 		return ctx;
 
 	INFO(ctx, "context %p released\n", ctx);
 
 	kmod_unload_resources(ctx);
+	hash_free(ctx->lookup_cache);
+	kmod_module_probe_cache_flush(ctx);
+	hash_free(ctx->probe_cache.entries);
+	kmod_module_lru_shrink(ctx, 0);
 	hash_free(ctx->modules_by_name);
+	free(ctx->decompress_cache);
 	free(ctx->dirname);
 	if (ctx->config)
 		kmod_config_free(ctx->config);
+	if (ctx->watch_fd >= 0)
+		close(ctx->watch_fd);
 
+	pthread_mutex_destroy(&ctx->pool_lock);
 	free(ctx);
 	return NULL;
 }
@@ -433,287 +537,1348 @@ KMOD_EXPORT void kmod_set_log_priority(struct kmod_ctx *ctx, int priority)
 	ctx->log_priority = priority;
 }
 
-struct kmod_module *kmod_pool_get_module(struct kmod_ctx *ctx,
-							const char *key)
+/**
+ * kmod_get_lookup_cache_size:
+ * @ctx: kmod library context
+ *
+ * Returns: the maximum number of entries kept in the lookup cache, 0 if
+ * it's disabled
+ */
+KMOD_EXPORT unsigned int kmod_get_lookup_cache_size(const struct kmod_ctx *ctx)
 {
-	struct kmod_module *mod;
-
-	mod = hash_find(ctx->modules_by_name, key);
-
-	DBG(ctx, "get module name='%s' found=%p\n", key, mod);
-
-	return mod;
+	if (ctx == NULL)
+		return 0;
+	return ctx->lookup_cache_size;
 }
 
-void kmod_pool_add_module(struct kmod_ctx *ctx, struct kmod_module *mod,
-							const char *key)
+static void lookup_cache_unlink(struct kmod_ctx *ctx,
+					struct kmod_lookup_entry *entry)
 {
-	DBG(ctx, "add %p key='%s'\n", mod, key);
-
-	hash_add(ctx->modules_by_name, key, mod);
+	if (entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		ctx->lookup_head = entry->next;
+
+	if (entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		ctx->lookup_tail = entry->prev;
 }
 
-void kmod_pool_del_module(struct kmod_ctx *ctx, struct kmod_module *mod,
-							const char *key)
+static void lookup_cache_drop(struct kmod_ctx *ctx,
+					struct kmod_lookup_entry *entry)
 {
-	DBG(ctx, "del %p key='%s'\n", mod, key);
-
-	hash_del(ctx->modules_by_name, key);
+	lookup_cache_unlink(ctx, entry);
+	hash_del(ctx->lookup_cache, entry->alias);
 }
 
-static int kmod_lookup_alias_from_alias_bin(struct kmod_ctx *ctx,
-						enum kmod_index index_number,
-						const char *name,
-						struct kmod_list **list)
+/**
+ * kmod_set_lookup_cache_size:
+ * @ctx: kmod library context
+ * @size: maximum number of entries, 0 to disable the cache
+ *
+ * Cache the results of kmod_module_new_from_lookup() and
+ * kmod_module_new_from_lookups() in @ctx, keyed by the normalized alias.
+ * Both aliases resolving to modules and aliases resolving to nothing are
+ * cached, so long-lived users asking for the same aliases again skip all
+ * the lookups. Once @size entries are cached, the least recently used one
+ * is evicted.
+ *
+ * The cache is dropped whenever kmod_validate_resources() reports that the
+ * configuration or the indexes changed.
+ *
+ * Returns: 0 on success or < 0 otherwise.
+ */
+KMOD_EXPORT int kmod_set_lookup_cache_size(struct kmod_ctx *ctx,
+							unsigned int size)
 {
-	int err, nmatch = 0;
-	struct index_file *idx;
-	struct index_value *realnames, *realname;
-
-	if (ctx->indexes[index_number] != NULL) {
-		DBG(ctx, "use mmaped index '%s' for name=%s\n",
-			index_files[index_number].fn, name);
-		realnames = index_mm_searchwild(ctx->indexes[index_number],
-									name);
-	} else {
-		char fn[PATH_MAX];
-
-		snprintf(fn, sizeof(fn), "%s/%s.bin", ctx->dirname,
-					index_files[index_number].fn);
-
-		DBG(ctx, "file=%s name=%s\n", fn, name);
-
-		idx = index_file_open(fn);
-		if (idx == NULL)
-			return -ENOSYS;
+	int err = 0;
 
-		realnames = index_searchwild(idx, name);
-		index_file_close(idx);
-	}
+	if (ctx == NULL)
+		return -ENOENT;
 
-	for (realname = realnames; realname; realname = realname->next) {
-		struct kmod_module *mod;
+	kmod_pool_lock(ctx);
 
-		err = kmod_module_new_from_alias(ctx, name, realname->value, &mod);
-		if (err < 0) {
-			ERR(ctx, "Could not create module for alias=%s realname=%s: %s\n",
-			    name, realname->value, strerror(-err));
-			goto fail;
+	if (size > 0 && ctx->lookup_cache == NULL) {
+		ctx->lookup_cache = hash_new(KMOD_HASH_SIZE, free);
+		if (ctx->lookup_cache == NULL) {
+			err = -ENOMEM;
+			goto out;
 		}
-
-		*list = kmod_list_append(*list, mod);
-		nmatch++;
 	}
 
-	index_values_free(realnames);
-	return nmatch;
+	ctx->lookup_cache_size = size;
 
-fail:
-	*list = kmod_list_remove_n_latest(*list, nmatch);
-	index_values_free(realnames);
-	return err;
+	while (ctx->lookup_cache != NULL &&
+			hash_get_count(ctx->lookup_cache) > size)
+		lookup_cache_drop(ctx, ctx->lookup_tail);
 
+out:
+	kmod_pool_unlock(ctx);
+	return err;
 }
 
-int kmod_lookup_alias_from_symbols_file(struct kmod_ctx *ctx, const char *name,
-						struct kmod_list **list)
+void kmod_lookup_cache_flush(struct kmod_ctx *ctx)
 {
-	if (!strstartswith(name, "symbol:"))
-		return 0;
-
-	return kmod_lookup_alias_from_alias_bin(ctx, KMOD_INDEX_MODULES_SYMBOL,
-								name, list);
+	kmod_pool_lock(ctx);
+	while (ctx->lookup_tail != NULL)
+		lookup_cache_drop(ctx, ctx->lookup_tail);
+	kmod_pool_unlock(ctx);
 }
 
-int kmod_lookup_alias_from_aliases_file(struct kmod_ctx *ctx, const char *name,
+/*
+ * Returns 1 and the cached result in @list on a hit, 0 if @alias is not
+ * cached or one of its modules was released meanwhile, < 0 on error.
+ */
+int kmod_lookup_cache_get(struct kmod_ctx *ctx, const char *alias,
 						struct kmod_list **list)
 {
-	return kmod_lookup_alias_from_alias_bin(ctx, KMOD_INDEX_MODULES_ALIAS,
-								name, list);
-}
+	struct kmod_module *failed = NULL;
+	struct kmod_lookup_entry *entry;
+	struct kmod_list *l;
+	const char *key;
+	size_t keylen;
+	unsigned int i;
+	int ret = 0;
 
-static char *lookup_builtin_file(struct kmod_ctx *ctx, const char *name)
-{
-	char *line;
+	if (ctx->lookup_cache == NULL)
+		return 0;
 
-	if (ctx->indexes[KMOD_INDEX_MODULES_BUILTIN]) {
-		DBG(ctx, "use mmaped index '%s' modname=%s\n",
-				index_files[KMOD_INDEX_MODULES_BUILTIN].fn,
-				name);
-		line = index_mm_search(ctx->indexes[KMOD_INDEX_MODULES_BUILTIN],
-									name);
-	} else {
-		struct index_file *idx;
-		char fn[PATH_MAX];
+	kmod_pool_lock(ctx);
 
-		snprintf(fn, sizeof(fn), "%s/%s.bin", ctx->dirname,
-				index_files[KMOD_INDEX_MODULES_BUILTIN].fn);
-		DBG(ctx, "file=%s modname=%s\n", fn, name);
+	entry = hash_find(ctx->lookup_cache, alias);
+	if (entry == NULL) {
+		kmod_stat_add(ctx, KMOD_STAT_LOOKUP_CACHE_MISSES, 1);
+		goto out;
+	}
 
-		idx = index_file_open(fn);
-		if (idx == NULL) {
-			DBG(ctx, "could not open builtin file '%s'\n", fn);
-			return NULL;
+	key = entry->alias + strlen(entry->alias) + 1;
+	for (i = 0; i < entry->n_keys; i++, key += keylen + 1) {
+		struct kmod_module *mod;
+
+		keylen = strlen(key);
+		mod = kmod_pool_get_module(ctx, key, keylen);
+
+		if (mod == NULL) {
+			lookup_cache_drop(ctx, entry);
+			kmod_stat_add(ctx, KMOD_STAT_LOOKUP_CACHE_MISSES, 1);
+			goto out;
 		}
 
-		line = index_search(idx, name);
-		index_file_close(idx);
+		l = kmod_list_append(*list, kmod_module_ref_pooled(mod));
+		if (l == NULL) {
+			/* modules can only be released without the lock held */
+			failed = mod;
+			ret = -ENOMEM;
+			goto out;
+		}
+		*list = l;
 	}
 
-	return line;
-}
+	if (entry != ctx->lookup_head) {
+		lookup_cache_unlink(ctx, entry);
+		entry->prev = NULL;
+		entry->next = ctx->lookup_head;
+		ctx->lookup_head->prev = entry;
+		ctx->lookup_head = entry;
+	}
 
-int kmod_lookup_alias_from_kernel_builtin_file(struct kmod_ctx *ctx,
-						const char *name,
-						struct kmod_list **list)
-{
-	struct kmod_list *l;
-	int ret;
+	DBG(ctx, "cached lookup=%s n_keys=%u\n", alias, entry->n_keys);
 
-	assert(*list == NULL);
+	kmod_stat_add(ctx, KMOD_STAT_LOOKUP_CACHE_HITS, 1);
+	ret = 1;
 
-	ret = kmod_lookup_alias_from_alias_bin(ctx,
-					       KMOD_INDEX_MODULES_BUILTIN_ALIAS,
-					       name, list);
+out:
+	kmod_pool_unlock(ctx);
 
-	kmod_list_foreach(l, *list) {
-		struct kmod_module *mod = l->data;
-		kmod_module_set_builtin(mod, true);
+	if (ret <= 0) {
+		kmod_module_unref(failed);
+		kmod_module_unref_list(*list);
+		*list = NULL;
 	}
 
 	return ret;
 }
 
-int kmod_lookup_alias_from_builtin_file(struct kmod_ctx *ctx, const char *name,
-						struct kmod_list **list)
+void kmod_lookup_cache_add(struct kmod_ctx *ctx, const char *alias,
+					const struct kmod_list *list)
 {
-	char *line;
-	int err = 0;
-
-	assert(*list == NULL);
-
-	line = lookup_builtin_file(ctx, name);
-	if (line != NULL) {
-		struct kmod_module *mod;
+	struct kmod_lookup_entry *entry;
+	const struct kmod_list *l;
+	size_t aliaslen, len;
+	unsigned int n_keys = 0;
+	char *p;
 
-		err = kmod_module_new_from_name(ctx, name, &mod);
-		if (err < 0) {
-			ERR(ctx, "Could not create module from name %s: %s\n",
-							name, strerror(-err));
-			goto finish;
-		}
+	if (ctx->lookup_cache == NULL || ctx->lookup_cache_size == 0)
+		return;
 
-		/* already mark it as builtin since it's being created from
-		 * this index */
-		kmod_module_set_builtin(mod, true);
-		*list = kmod_list_append(*list, mod);
-		if (*list == NULL)
-			err = -ENOMEM;
+	aliaslen = strlen(alias) + 1;
+	len = aliaslen;
+	kmod_list_foreach(l, list) {
+		len += strlen(kmod_module_get_hashkey(l->data)) + 1;
+		n_keys++;
 	}
 
-finish:
-	free(line);
-	return err;
-}
-
-bool kmod_lookup_alias_is_builtin(struct kmod_ctx *ctx, const char *name)
-{
-	_cleanup_free_ char *line;
+	entry = malloc(sizeof(*entry) + len);
+	if (entry == NULL)
+		return;
 
-	line = lookup_builtin_file(ctx, name);
+	entry->n_keys = n_keys;
+	p = memcpy(entry->alias, alias, aliaslen);
+	p += aliaslen;
+	kmod_list_foreach(l, list) {
+		const char *key = kmod_module_get_hashkey(l->data);
+		size_t keylen = strlen(key) + 1;
 
-	return line != NULL;
-}
+		memcpy(p, key, keylen);
+		p += keylen;
+	}
 
-char *kmod_search_moddep(struct kmod_ctx *ctx, const char *name)
-{
-	struct index_file *idx;
-	char fn[PATH_MAX];
-	char *line;
+	kmod_pool_lock(ctx);
 
-	if (ctx->indexes[KMOD_INDEX_MODULES_DEP]) {
-		DBG(ctx, "use mmaped index '%s' modname=%s\n",
-				index_files[KMOD_INDEX_MODULES_DEP].fn, name);
-		return index_mm_search(ctx->indexes[KMOD_INDEX_MODULES_DEP],
-									name);
+	/*
+	 * Another thread may have cached the same alias meanwhile: look
+	 * before evicting, or a valid entry would be dropped for nothing.
+	 */
+	if (hash_find(ctx->lookup_cache, entry->alias) != NULL) {
+		kmod_pool_unlock(ctx);
+		free(entry);
+		return;
 	}
 
-	snprintf(fn, sizeof(fn), "%s/%s.bin", ctx->dirname,
-					index_files[KMOD_INDEX_MODULES_DEP].fn);
-
-	DBG(ctx, "file=%s modname=%s\n", fn, name);
+	if (hash_get_count(ctx->lookup_cache) >= ctx->lookup_cache_size)
+		lookup_cache_drop(ctx, ctx->lookup_tail);
 
-	idx = index_file_open(fn);
-	if (idx == NULL) {
-		DBG(ctx, "could not open moddep file '%s'\n", fn);
-		return NULL;
+	if (hash_add_unique(ctx->lookup_cache, entry->alias, entry) < 0) {
+		kmod_pool_unlock(ctx);
+		free(entry);
+		return;
 	}
 
-	line = index_search(idx, name);
-	index_file_close(idx);
+	entry->prev = NULL;
+	entry->next = ctx->lookup_head;
+	if (ctx->lookup_head != NULL)
+		ctx->lookup_head->prev = entry;
+	else
+		ctx->lookup_tail = entry;
+	ctx->lookup_head = entry;
 
-	return line;
+	kmod_pool_unlock(ctx);
 }
 
-int kmod_lookup_alias_from_moddep_file(struct kmod_ctx *ctx, const char *name,
-						struct kmod_list **list)
+/* modules.builtin.modinfo and its index, if kmod_load_resources() kept them */
+struct kmod_builtin_modinfo *kmod_get_builtin_modinfo(const struct kmod_ctx *ctx)
 {
-	char *line;
-	int n = 0;
+	return ctx->builtin_modinfo;
+}
 
-	/*
-	 * Module names do not contain ':'. Return early if we know it will
-	 * not be found.
-	 */
-	if (strchr(name, ':'))
-		return 0;
+struct kmod_module_lru *kmod_get_module_lru(struct kmod_ctx *ctx)
+{
+	return &ctx->modules_lru;
+}
 
-	line = kmod_search_moddep(ctx, name);
-	if (line != NULL) {
-		struct kmod_module *mod;
+struct kmod_probe_cache *kmod_get_probe_cache(struct kmod_ctx *ctx)
+{
+	return &ctx->probe_cache;
+}
 
-		n = kmod_module_new_from_name(ctx, name, &mod);
-		if (n < 0) {
-			ERR(ctx, "Could not create module from name %s: %s\n",
-			    name, strerror(-n));
-			goto finish;
-		}
+/*
+ * kmod_loaded_*() must be called with the pool lock held. Each snapshot of
+ * the loaded modules gets a new generation, and modules filled from it
+ * record it: their data is used as long as it's the current generation and
+ * the snapshot is younger than KMOD_LOADED_SNAPSHOT_USEC.
+ */
+unsigned int kmod_loaded_begin(struct kmod_ctx *ctx)
+{
+	if (++ctx->loaded_gen == 0)
+		ctx->loaded_gen = 1;
+	ctx->loaded_stamp = now_usec();
 
-		*list = kmod_list_append(*list, mod);
-		kmod_module_parse_depline(mod, line);
-	}
+	return ctx->loaded_gen;
+}
 
-finish:
-	free(line);
+unsigned int kmod_loaded_get_gen(const struct kmod_ctx *ctx)
+{
+	if (ctx->loaded_stamp == 0 ||
+	    now_usec() - ctx->loaded_stamp >= KMOD_LOADED_SNAPSHOT_USEC)
+		return 0;
 
-	return n;
+	return ctx->loaded_gen;
 }
 
-int kmod_lookup_alias_from_config(struct kmod_ctx *ctx, const char *name,
-						struct kmod_list **list)
+void kmod_loaded_drop(struct kmod_ctx *ctx)
 {
-	struct kmod_config *config = ctx->config;
-	struct kmod_list *l;
-	int err, nmatch = 0;
+	ctx->loaded_stamp = 0;
+}
 
-	kmod_list_foreach(l, config->aliases) {
-		const char *aliasname = kmod_alias_get_name(l);
-		const char *modname = kmod_alias_get_modname(l);
+/**
+ * kmod_get_module_pool_size:
+ * @ctx: kmod library context
+ *
+ * Returns: the maximum number of unreferenced modules kept in @ctx
+ */
+KMOD_EXPORT unsigned int kmod_get_module_pool_size(const struct kmod_ctx *ctx)
+{
+	if (ctx == NULL)
+		return 0;
+	return ctx->modules_lru.max;
+}
+
+/**
+ * kmod_set_module_pool_size:
+ * @ctx: kmod library context
+ * @size: maximum number of unreferenced modules, 0 to release modules as
+ * soon as their last reference is dropped
+ *
+ * When the last reference of a kmod_module is dropped, the module is kept
+ * in @ctx so it doesn't need to be created again if it's looked up later.
+ * Its dependencies and open file are released, but what was already read
+ * from the configuration is kept. Once more than @size modules are kept
+ * like this, the least recently released ones are freed. The default is
+ * 128.
+ *
+ * The kept modules are also freed when kmod_validate_resources() reports
+ * that the configuration or the indexes changed.
+ *
+ * Returns: 0 on success or < 0 otherwise.
+ */
+KMOD_EXPORT int kmod_set_module_pool_size(struct kmod_ctx *ctx,
+							unsigned int size)
+{
+	if (ctx == NULL)
+		return -ENOENT;
+
+	kmod_pool_lock(ctx);
+	ctx->modules_lru.max = size;
+	kmod_module_lru_shrink(ctx, size);
+	kmod_pool_unlock(ctx);
+
+	return 0;
+}
+
+/**
+ * kmod_get_decompress_threads:
+ * @ctx: kmod library context
+ *
+ * Returns: the number of threads used to decompress a module, 0 for one
+ * per CPU
+ */
+KMOD_EXPORT unsigned int kmod_get_decompress_threads(const struct kmod_ctx *ctx)
+{
+	if (ctx == NULL)
+		return 1;
+	return ctx->decompress_threads;
+}
+
+/**
+ * kmod_set_decompress_threads:
+ * @ctx: kmod library context
+ * @threads: number of threads, 0 for one per CPU
+ *
+ * Set how many threads may decompress a module that has to be read by
+ * libkmod itself. This applies to xz modules made of several blocks,
+ * such as those written by "xz -T", when libkmod is built with liblzma
+ * 5.4 or later. Other modules use a single thread. The default is 1.
+ *
+ * Returns: 0 on success or < 0 otherwise.
+ */
+KMOD_EXPORT int kmod_set_decompress_threads(struct kmod_ctx *ctx,
+							unsigned int threads)
+{
+	if (ctx == NULL)
+		return -ENOENT;
+
+	ctx->decompress_threads = threads;
+	return 0;
+}
+
+/**
+ * kmod_get_decompress_cache:
+ * @ctx: kmod library context
+ *
+ * Returns: the directory where decompressed modules are cached or NULL if
+ * the cache is not in use
+ */
+KMOD_EXPORT const char *kmod_get_decompress_cache(const struct kmod_ctx *ctx)
+{
+	if (ctx == NULL)
+		return NULL;
+	return ctx->decompress_cache;
+}
+
+/**
+ * kmod_set_decompress_cache:
+ * @ctx: kmod library context
+ * @dir: an existing directory or NULL to stop using the cache
+ *
+ * Keep the decompressed image of each compressed module read by libkmod in
+ * @dir, so later reads of the same file, by this or another process, map
+ * it from there instead of decompressing it again. Entries are keyed by
+ * the device, inode, size and modification time of the module: a module
+ * that is replaced gets a new entry and the old one is left behind, it's
+ * up to the caller to clean @dir up. The cache is off by default; it's
+ * also enabled when KMOD_DECOMPRESS_CACHE is set in the environment.
+ *
+ * @dir and its entries are only used if they are owned by the effective
+ * user and not writable by the group or others. Modules inserted with
+ * kmod_module_insert_module() are never taken from the cache: the kernel
+ * always gets an image decompressed for it.
+ *
+ * Returns: 0 on success or < 0 otherwise.
+ */
+KMOD_EXPORT int kmod_set_decompress_cache(struct kmod_ctx *ctx,
+							const char *dir)
+{
+	char *p = NULL;
+
+	if (ctx == NULL)
+		return -ENOENT;
+
+	if (dir != NULL) {
+		p = strdup(dir);
+		if (p == NULL)
+			return -ENOMEM;
+	}
+
+	free(ctx->decompress_cache);
+	ctx->decompress_cache = p;
+	return 0;
+}
+
+void kmod_stat_add(const struct kmod_ctx *ctx, enum kmod_stat stat,
+							uint64_t value)
+{
+	/* remove const: this only changes the counters */
+	struct kmod_ctx *c = (struct kmod_ctx *)ctx;
+
+	if (ctx == NULL)
+		return;
+
+	__atomic_fetch_add(&c->stats[stat], value, __ATOMIC_RELAXED);
+}
+
+static inline void index_lookup_add(struct kmod_ctx *ctx,
+					enum kmod_index type, uint64_t n)
+{
+	__atomic_fetch_add(&ctx->index_lookups[type], n, __ATOMIC_RELAXED);
+}
+
+static inline void index_lookup_inc(struct kmod_ctx *ctx,
+						enum kmod_index type)
+{
+	index_lookup_add(ctx, type, 1);
+}
+
+/**
+ * kmod_get_stat:
+ * @ctx: kmod library context
+ * @stat: which counter to get
+ * @value: where to store it
+ *
+ * Get one of the counters of the work done by @ctx, cheap enough to be
+ * always kept, so a long-lived context can be monitored:
+ *
+ * KMOD_STAT_LOOKUP_CACHE_HITS and KMOD_STAT_LOOKUP_CACHE_MISSES: lookups
+ * answered or not by the cache of kmod_set_lookup_cache_size(), which
+ * counts nothing while disabled;
+ * KMOD_STAT_POOL_MODULES: modules currently in the pool, referenced or
+ * kept for reuse;
+ * KMOD_STAT_BYTES_MAPPED: size of all the indexes and uncompressed modules
+ * mapped so far, including the ones unmapped since, but not the indexes
+ * another context of the process had already mapped;
+ * KMOD_STAT_BYTES_DECOMPRESSED and KMOD_STAT_DECOMPRESS_USEC: size of the
+ * compressed modules once decompressed, and the time spent doing it; the
+ * first also counts the blocks of compressed indexes;
+ * KMOD_STAT_INSERT_USEC: time spent in the init_module() and
+ * finit_module() system calls;
+ * KMOD_STAT_CONFIG_USEC: time spent parsing the configuration in
+ * kmod_new().
+ *
+ * All counters but KMOD_STAT_POOL_MODULES start from zero again with
+ * kmod_reset_stats().
+ *
+ * Returns: 0 on success or < 0 otherwise.
+ */
+KMOD_EXPORT int kmod_get_stat(const struct kmod_ctx *ctx,
+				enum kmod_stat stat, uint64_t *value)
+{
+	/* remove const: the pool lock is only taken to count the modules */
+	struct kmod_ctx *c = (struct kmod_ctx *)ctx;
+
+	if (ctx == NULL || value == NULL)
+		return -ENOENT;
+
+	if ((unsigned int) stat >= _KMOD_STAT_COUNT)
+		return -EINVAL;
+
+	if (stat == KMOD_STAT_POOL_MODULES) {
+		kmod_pool_lock(c);
+		*value = hash_get_count(ctx->modules_by_name);
+		kmod_pool_unlock(c);
+	} else {
+		*value = __atomic_load_n(&ctx->stats[stat], __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+/**
+ * kmod_get_index_lookups:
+ * @ctx: kmod library context
+ * @type: index to get the lookups of
+ * @value: where to store them
+ *
+ * Get how many times @ctx searched the index @type, whether it was
+ * loaded with kmod_load_resources() or read from its file on demand.
+ * Lookups answered by the lookup cache don't touch any index.
+ *
+ * Returns: 0 on success or < 0 otherwise.
+ */
+KMOD_EXPORT int kmod_get_index_lookups(const struct kmod_ctx *ctx,
+				enum kmod_index type, uint64_t *value)
+{
+	if (ctx == NULL || value == NULL)
+		return -ENOENT;
+
+	if ((unsigned int) type >= _KMOD_INDEX_MODULES_SIZE)
+		return -EINVAL;
+
+	*value = __atomic_load_n(&ctx->index_lookups[type], __ATOMIC_RELAXED);
+	return 0;
+}
+
+/**
+ * kmod_reset_stats:
+ * @ctx: kmod library context
+ *
+ * Start the counters of kmod_get_stat() and kmod_get_index_lookups() from
+ * zero again, e.g. after each time they were exported.
+ */
+KMOD_EXPORT void kmod_reset_stats(struct kmod_ctx *ctx)
+{
+	unsigned int i;
+
+	if (ctx == NULL)
+		return;
+
+	for (i = 0; i < _KMOD_STAT_COUNT; i++)
+		__atomic_store_n(&ctx->stats[i], 0, __ATOMIC_RELAXED);
+	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++)
+		__atomic_store_n(&ctx->index_lookups[i], 0, __ATOMIC_RELAXED);
+}
+
+void kmod_pool_lock(struct kmod_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->pool_lock);
+}
+
+void kmod_pool_unlock(struct kmod_ctx *ctx)
+{
+	pthread_mutex_unlock(&ctx->pool_lock);
+}
+
+/* kmod_pool_*_module() must be called with the pool lock held */
+struct kmod_module *kmod_pool_get_module(struct kmod_ctx *ctx,
+						const char *key, size_t keylen)
+{
+	struct kmod_module *mod;
+
+	mod = hash_find_len(ctx->modules_by_name, key, keylen);
+
+	DBG(ctx, "get module name='%s' found=%p\n", key, mod);
+
+	return mod;
+}
+
+void kmod_pool_add_module(struct kmod_ctx *ctx, struct kmod_module *mod,
+						const char *key, size_t keylen)
+{
+	DBG(ctx, "add %p key='%s'\n", mod, key);
+
+	hash_add_len(ctx->modules_by_name, key, keylen, mod);
+}
+
+void kmod_pool_del_module(struct kmod_ctx *ctx, struct kmod_module *mod,
+							const char *key)
+{
+	DBG(ctx, "del %p key='%s'\n", mod, key);
+
+	hash_del(ctx->modules_by_name, key);
+}
+
+/*
+ * Whether index @fn, last modified at @stamp, can be used: see
+ * index_is_current(). @base_fn is the file in the module directory it's
+ * derived from.
+ */
+bool kmod_index_is_current(struct kmod_ctx *ctx, const char *fn,
+				const char *base_fn, unsigned long long stamp)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", ctx->dirname, base_fn);
+	if (index_is_current(path, stamp))
+		return true;
+
+	DBG(ctx, "%s is newer than %s\n", path, fn);
+	return false;
+}
+
+/*
+ * depmod --delta writes modules.{dep,alias,symbols}.delta.bin with only the
+ * modules that changed since the last full run. They are looked up before
+ * the base indexes: a module in modules.dep.delta.bin replaces everything
+ * it had in those, and one with an empty line there was removed. A delta
+ * older than its base index is not used.
+ */
+static int delta_open(struct kmod_ctx *ctx, enum kmod_index type,
+			unsigned long long *stamp, struct index_mm **pidx)
+{
+	char path[PATH_MAX], base_fn[NAME_MAX];
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s.delta.bin", ctx->dirname,
+							index_files[type].fn);
+	ret = index_mm_open(ctx, path, stamp, pidx);
+	if (ret < 0)
+		return ret;
+
+	snprintf(base_fn, sizeof(base_fn), "%s.bin", index_files[type].fn);
+	if (!kmod_index_is_current(ctx, path, base_fn, *stamp)) {
+		index_mm_close(*pidx);
+		*pidx = NULL;
+		return -ESTALE;
+	}
+
+	return 0;
+}
+
+/* whether delta_open() would use the delta of index @type */
+static bool delta_is_current(struct kmod_ctx *ctx, enum kmod_index type)
+{
+	char path[PATH_MAX], base_fn[NAME_MAX];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s.delta.bin", ctx->dirname,
+							index_files[type].fn);
+	if (stat(path, &st) < 0)
+		return false;
+
+	snprintf(base_fn, sizeof(base_fn), "%s.bin", index_files[type].fn);
+	return kmod_index_is_current(ctx, path, base_fn, stat_mstamp(&st));
+}
+
+/*
+ * The delta of index @type: kept in @ctx by kmod_load_resources(),
+ * otherwise opened for each lookup, like the base index, and closed with
+ * delta_put().
+ */
+static struct index_mm *delta_get(struct kmod_ctx *ctx, enum kmod_index type)
+{
+	unsigned long long stamp;
+	struct index_mm *idx;
+
+	if (kmod_has_resources(ctx))
+		return ctx->deltas[type];
+
+	if (delta_open(ctx, type, &stamp, &idx) < 0)
+		return NULL;
+
+	return idx;
+}
+
+static void delta_put(struct kmod_ctx *ctx, struct index_mm *idx)
+{
+	if (idx != NULL && !kmod_has_resources(ctx))
+		index_mm_close(idx);
+}
+
+static bool delta_has_module(struct index_mm *dep_delta, const char *modname)
+{
+	char *line = index_mm_search(dep_delta, modname);
+	bool found = line != NULL;
+
+	free(line);
+	return found;
+}
+
+/*
+ * The matches of @name in the delta @delta and those of @base for the
+ * modules not in @dep_delta, in the order of their priorities like the
+ * matches of a single index.
+ */
+static struct index_value *delta_merge(struct index_mm *dep_delta,
+					struct index_mm *delta,
+					const char *name,
+					struct index_value *base)
+{
+	struct index_value *values = NULL, **tail = &values, *d = NULL;
+
+	if (delta != NULL)
+		d = index_mm_searchwild(delta, name);
+
+	while (base != NULL || d != NULL) {
+		struct index_value *v;
+
+		if (base == NULL || (d != NULL && d->priority < base->priority)) {
+			v = d;
+			d = d->next;
+		} else {
+			v = base;
+			base = base->next;
+			if (delta_has_module(dep_delta, v->value)) {
+				free(v);
+				continue;
+			}
+		}
+
+		*tail = v;
+		tail = &v->next;
+	}
+	*tail = NULL;
+
+	return values;
+}
+
+/* the lookup of @name in index @index_number, merged with @dep_delta if set */
+static int alias_bin_lookup(struct kmod_ctx *ctx, enum kmod_index index_number,
+				const char *name, struct index_mm *dep_delta,
+				struct kmod_list **list)
+{
+	int err, nmatch = 0;
+	struct index_file *idx;
+	struct index_value *realnames, *realname;
+	struct index_mm *delta;
+
+	index_lookup_inc(ctx, index_number);
+
+	if (ctx->indexes[index_number] != NULL) {
+		DBG(ctx, "use mmaped index '%s' for name=%s\n",
+			index_files[index_number].fn, name);
+		realnames = index_mm_searchwild(ctx->indexes[index_number],
+									name);
+	} else {
+		char fn[PATH_MAX];
+
+		snprintf(fn, sizeof(fn), "%s/%s.bin", ctx->dirname,
+					index_files[index_number].fn);
+
+		DBG(ctx, "file=%s name=%s\n", fn, name);
+
+		idx = index_file_open(fn);
+		if (idx == NULL)
+			return -ENOSYS;
+
+		realnames = index_searchwild(idx, name);
+		index_file_close(idx);
+	}
+
+	if (dep_delta != NULL) {
+		delta = delta_get(ctx, index_number);
+		realnames = delta_merge(dep_delta, delta, name, realnames);
+		delta_put(ctx, delta);
+	}
+
+	for (realname = realnames; realname; realname = realname->next) {
+		struct kmod_module *mod;
+
+		err = kmod_module_new_from_alias(ctx, name, realname->value, &mod);
+		if (err < 0) {
+			ERR(ctx, "Could not create module for alias=%s realname=%s: %s\n",
+			    name, realname->value, strerror(-err));
+			goto fail;
+		}
+
+		*list = kmod_list_append(*list, mod);
+		nmatch++;
+	}
+
+	index_values_free(realnames);
+	return nmatch;
+
+fail:
+	*list = kmod_list_remove_n_latest(*list, nmatch);
+	index_values_free(realnames);
+	return err;
+
+}
+
+static int kmod_lookup_alias_from_alias_bin(struct kmod_ctx *ctx,
+						enum kmod_index index_number,
+						const char *name,
+						struct kmod_list **list)
+{
+	struct index_mm *dep_delta = NULL;
+	int err;
+
+	if (index_number == KMOD_INDEX_MODULES_ALIAS ||
+			index_number == KMOD_INDEX_MODULES_SYMBOL)
+		dep_delta = delta_get(ctx, KMOD_INDEX_MODULES_DEP);
+
+	err = alias_bin_lookup(ctx, index_number, name, dep_delta, list);
+	delta_put(ctx, dep_delta);
+
+	return err;
+}
+
+static int symhash_open(struct kmod_ctx *ctx, unsigned long long *stamp,
+					struct index_symhash **pidx)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s", ctx->dirname, SYMHASH_FN);
+	ret = index_symhash_open(ctx, path, stamp, pidx);
+	if (ret < 0)
+		return ret;
+
+	if (!kmod_index_is_current(ctx, SYMHASH_FN, "modules.symbols.bin",
+								*stamp)) {
+		index_symhash_close(*pidx);
+		*pidx = NULL;
+		return -ESTALE;
+	}
+
+	return 0;
+}
+
+int kmod_lookup_alias_from_symbols_file(struct kmod_ctx *ctx, const char *name,
+						struct kmod_list **list)
+{
+	struct kmod_module *mod;
+	struct index_mm *dep_delta;
+	const char *owner;
+	int err;
+
+	if (!strstartswith(name, "symbol:"))
+		return 0;
+
+	/* the hash table only has the literal names, and not the deltas */
+	dep_delta = delta_get(ctx, KMOD_INDEX_MODULES_DEP);
+	if (ctx->symhash == NULL || strpbrk(name, "*?[") != NULL ||
+						dep_delta != NULL) {
+		err = alias_bin_lookup(ctx, KMOD_INDEX_MODULES_SYMBOL, name,
+							dep_delta, list);
+		delta_put(ctx, dep_delta);
+		return err;
+	}
+
+	index_lookup_inc(ctx, KMOD_INDEX_MODULES_SYMBOL);
+	DBG(ctx, "use mmaped index '%s' for name=%s\n", SYMHASH_FN, name);
+
+	owner = index_symhash_search(ctx->symhash,
+				name + sizeof("symbol:") - 1, NULL);
+	if (owner == NULL)
+		return 0;
+
+	err = kmod_module_new_from_alias(ctx, name, owner, &mod);
+	if (err < 0) {
+		ERR(ctx, "Could not create module for alias=%s realname=%s: %s\n",
+		    name, owner, strerror(-err));
+		return err;
+	}
+
+	*list = kmod_list_append(*list, mod);
+
+	return 1;
+}
+
+/* a copy of @owner, kept until kmod_unload_resources() */
+static const char *symbol_owner_intern(struct kmod_ctx *ctx,
+							const char *owner)
+{
+	char *s;
+
+	if (ctx->symbol_owners == NULL) {
+		ctx->symbol_owners = hash_new(64, free);
+		if (ctx->symbol_owners == NULL)
+			return NULL;
+	}
+
+	s = hash_find(ctx->symbol_owners, owner);
+	if (s != NULL)
+		return s;
+
+	s = strdup(owner);
+	if (s == NULL)
+		return NULL;
+
+	if (hash_add(ctx->symbol_owners, s, s) < 0) {
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+/*
+ * Put the deltas above @owner, the owner of @symbol in the base indexes:
+ * the one in @delta if it has one, or none if @owner changed since.
+ * Returns 1 if @owner was replaced, 0 if not or < 0 on errors.
+ */
+static int delta_resolve_symbol(struct kmod_ctx *ctx,
+				struct index_mm *dep_delta,
+				struct index_mm *delta, const char *symbol,
+				const char **owner)
+{
+	char key[PATH_MAX];
+	char *s;
+
+	if (delta != NULL && snprintf(key, sizeof(key), "symbol:%s", symbol) <
+							(int)sizeof(key)) {
+		s = index_mm_search(delta, key);
+		if (s != NULL) {
+			*owner = symbol_owner_intern(ctx, s);
+			free(s);
+			return *owner != NULL ? 1 : -ENOMEM;
+		}
+	}
+
+	if (*owner != NULL && delta_has_module(dep_delta, *owner)) {
+		*owner = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * kmod_resolve_symbols:
+ * @ctx: kmod library context
+ * @symbols: array of symbol names, without the "symbol:" prefix
+ * @count: number of entries in @symbols
+ * @owners: array of @count where to save the name of the module exporting
+ * each symbol, or NULL if none does
+ * @crcs: array of @count where to save the CRC of each symbol, or NULL.
+ * It's 0 for the symbols without one or when it's not known.
+ *
+ * Batch resolution of the symbols exported by the modules, as looking up
+ * "symbol:" aliases would, without creating any module or list. With the
+ * hash table depmod writes to modules.symbols.hash.bin, each symbol costs a
+ * single probe. Otherwise modules.symbols.bin is searched for each one and
+ * the CRCs are not known, nor are those of the symbols of the modules
+ * depmod --delta wrote again.
+ *
+ * The strings saved in @owners belong to @ctx and are valid until
+ * kmod_unload_resources() or kmod_unref() is called. The index is kept
+ * open in @ctx until then as well, even if kmod_load_resources() was not
+ * called.
+ *
+ * Returns: the number of symbols resolved or < 0 on error.
+ */
+KMOD_EXPORT int kmod_resolve_symbols(struct kmod_ctx *ctx,
+					const char * const *symbols,
+					unsigned int count, const char **owners,
+					uint64_t *crcs)
+{
+	struct index_mm *dep_delta, *delta = NULL;
+	struct index_file *file = NULL;
+	struct index_mm *mm;
+	unsigned int i;
+	int n = 0, err = 0;
+
+	if (ctx == NULL || (count > 0 && (symbols == NULL || owners == NULL)))
+		return -EINVAL;
+
+	if (ctx->symhash == NULL)
+		symhash_open(ctx, &ctx->symhash_stamp, &ctx->symhash);
+
+	dep_delta = delta_get(ctx, KMOD_INDEX_MODULES_DEP);
+	if (dep_delta != NULL)
+		delta = delta_get(ctx, KMOD_INDEX_MODULES_SYMBOL);
+
+	if (ctx->symhash != NULL) {
+		for (i = 0; i < count; i++) {
+			uint64_t crc = 0;
+
+			owners[i] = index_symhash_search(ctx->symhash,
+							symbols[i], &crc);
+			if (dep_delta != NULL) {
+				err = delta_resolve_symbol(ctx, dep_delta,
+						delta, symbols[i], &owners[i]);
+				if (err < 0)
+					break;
+				/* the CRCs of the deltas are not known */
+				if (err > 0)
+					crc = 0;
+				err = 0;
+			}
+			if (crcs != NULL)
+				crcs[i] = crc;
+			if (owners[i] != NULL)
+				n++;
+		}
+		index_lookup_add(ctx, KMOD_INDEX_MODULES_SYMBOL, count);
+
+		goto out;
+	}
+
+	mm = ctx->indexes[KMOD_INDEX_MODULES_SYMBOL];
+	if (mm == NULL) {
+		char fn[PATH_MAX];
+
+		snprintf(fn, sizeof(fn), "%s/%s.bin", ctx->dirname,
+				index_files[KMOD_INDEX_MODULES_SYMBOL].fn);
+		file = index_file_open(fn);
+		if (file == NULL) {
+			err = -ENOSYS;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		char key[PATH_MAX];
+		char *owner;
+
+		owners[i] = NULL;
+		if (crcs != NULL)
+			crcs[i] = 0;
+
+		if (snprintf(key, sizeof(key), "symbol:%s", symbols[i]) >=
+							(int)sizeof(key))
+			continue;
+
+		owner = mm != NULL ? index_mm_search(mm, key) :
+						index_search(file, key);
+		if (owner != NULL) {
+			owners[i] = symbol_owner_intern(ctx, owner);
+			free(owner);
+			if (owners[i] == NULL) {
+				err = -ENOMEM;
+				break;
+			}
+		}
+
+		if (dep_delta != NULL) {
+			err = delta_resolve_symbol(ctx, dep_delta, delta,
+						symbols[i], &owners[i]);
+			if (err < 0)
+				break;
+			err = 0;
+		}
+
+		if (owners[i] != NULL)
+			n++;
+	}
+	index_lookup_add(ctx, KMOD_INDEX_MODULES_SYMBOL, count);
+
+	if (file != NULL)
+		index_file_close(file);
+
+out:
+	delta_put(ctx, delta);
+	delta_put(ctx, dep_delta);
+
+	return err < 0 ? err : n;
+}
+
+int kmod_lookup_alias_from_aliases_file(struct kmod_ctx *ctx, const char *name,
+						struct kmod_list **list)
+{
+	return kmod_lookup_alias_from_alias_bin(ctx, KMOD_INDEX_MODULES_ALIAS,
+								name, list);
+}
+
+static char *lookup_builtin_file(struct kmod_ctx *ctx, const char *name)
+{
+	char *line;
+
+	index_lookup_inc(ctx, KMOD_INDEX_MODULES_BUILTIN);
+
+	if (ctx->indexes[KMOD_INDEX_MODULES_BUILTIN]) {
+		DBG(ctx, "use mmaped index '%s' modname=%s\n",
+				index_files[KMOD_INDEX_MODULES_BUILTIN].fn,
+				name);
+		line = index_mm_search(ctx->indexes[KMOD_INDEX_MODULES_BUILTIN],
+									name);
+	} else {
+		struct index_file *idx;
+		char fn[PATH_MAX];
+
+		snprintf(fn, sizeof(fn), "%s/%s.bin", ctx->dirname,
+				index_files[KMOD_INDEX_MODULES_BUILTIN].fn);
+		DBG(ctx, "file=%s modname=%s\n", fn, name);
+
+		idx = index_file_open(fn);
+		if (idx == NULL) {
+			DBG(ctx, "could not open builtin file '%s'\n", fn);
+			return NULL;
+		}
+
+		line = index_search(idx, name);
+		index_file_close(idx);
+	}
+
+	return line;
+}
+
+int kmod_lookup_alias_from_kernel_builtin_file(struct kmod_ctx *ctx,
+						const char *name,
+						struct kmod_list **list)
+{
+	struct kmod_list *l;
+	int ret;
+
+	assert(*list == NULL);
+
+	ret = kmod_lookup_alias_from_alias_bin(ctx,
+					       KMOD_INDEX_MODULES_BUILTIN_ALIAS,
+					       name, list);
+
+	kmod_list_foreach(l, *list) {
+		struct kmod_module *mod = l->data;
+		kmod_module_set_builtin(mod, true);
+	}
+
+	return ret;
+}
+
+int kmod_lookup_alias_from_builtin_file(struct kmod_ctx *ctx, const char *name,
+						struct kmod_list **list)
+{
+	char *line;
+	int err = 0;
+
+	assert(*list == NULL);
+
+	line = lookup_builtin_file(ctx, name);
+	if (line != NULL) {
+		struct kmod_module *mod;
+
+		err = kmod_module_new_from_name(ctx, name, &mod);
+		if (err < 0) {
+			ERR(ctx, "Could not create module from name %s: %s\n",
+							name, strerror(-err));
+			goto finish;
+		}
+
+		/* already mark it as builtin since it's being created from
+		 * this index */
+		kmod_module_set_builtin(mod, true);
+		*list = kmod_list_append(*list, mod);
+		if (*list == NULL)
+			err = -ENOMEM;
+	}
+
+finish:
+	free(line);
+	return err;
+}
+
+bool kmod_lookup_alias_is_builtin(struct kmod_ctx *ctx, const char *name)
+{
+	_cleanup_free_ char *line;
+
+	line = lookup_builtin_file(ctx, name);
+
+	return line != NULL;
+}
+
+static int moddep_ids_open(struct kmod_ctx *ctx, unsigned long long *stamp,
+					struct index_moddep **pidx)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s", ctx->dirname, MODDEP_IDS_FN);
+	ret = index_moddep_open(ctx, path, stamp, pidx);
+	if (ret < 0)
+		return ret;
+
+	if (!kmod_index_is_current(ctx, MODDEP_IDS_FN, "modules.dep.bin",
+								*stamp)) {
+		index_moddep_close(*pidx);
+		*pidx = NULL;
+		return -ESTALE;
+	}
+
+	return 0;
+}
+
+char *kmod_search_moddep(struct kmod_ctx *ctx, const char *name)
+{
+	struct index_mm *delta;
+	struct index_moddep *ids;
+	unsigned long long stamp;
+	struct index_file *idx;
+	char fn[PATH_MAX];
+	char *line;
+
+	index_lookup_inc(ctx, KMOD_INDEX_MODULES_DEP);
+
+	delta = delta_get(ctx, KMOD_INDEX_MODULES_DEP);
+	if (delta != NULL) {
+		DBG(ctx, "use delta of '%s' modname=%s\n",
+				index_files[KMOD_INDEX_MODULES_DEP].fn, name);
+		line = index_mm_search(delta, name);
+		delta_put(ctx, delta);
+
+		/* an empty line for a module that was removed */
+		if (line != NULL && line[0] == '\0') {
+			free(line);
+			return NULL;
+		}
+		if (line != NULL)
+			return line;
+	}
+
+	if (ctx->moddep_ids) {
+		DBG(ctx, "use mmaped index '%s' modname=%s\n", MODDEP_IDS_FN,
+									name);
+		return index_moddep_search(ctx->moddep_ids, name);
+	}
+
+	if (ctx->indexes[KMOD_INDEX_MODULES_DEP]) {
+		DBG(ctx, "use mmaped index '%s' modname=%s\n",
+				index_files[KMOD_INDEX_MODULES_DEP].fn, name);
+		return index_mm_search(ctx->indexes[KMOD_INDEX_MODULES_DEP],
+									name);
+	}
+
+	if (moddep_ids_open(ctx, &stamp, &ids) == 0) {
+		DBG(ctx, "file=%s modname=%s\n", MODDEP_IDS_FN, name);
+		line = index_moddep_search(ids, name);
+		index_moddep_close(ids);
+		return line;
+	}
+
+	snprintf(fn, sizeof(fn), "%s/%s.bin", ctx->dirname,
+					index_files[KMOD_INDEX_MODULES_DEP].fn);
+
+	DBG(ctx, "file=%s modname=%s\n", fn, name);
+
+	idx = index_file_open(fn);
+	if (idx == NULL) {
+		DBG(ctx, "could not open moddep file '%s'\n", fn);
+		return NULL;
+	}
+
+	line = index_search(idx, name);
+	index_file_close(idx);
+
+	return line;
+}
+
+static int softdep_index_open(struct kmod_ctx *ctx, unsigned long long *stamp,
+						struct index_mm **pidx)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/" SOFTDEP_FN ".bin", ctx->dirname);
+	ret = index_mm_open(ctx, path, stamp, pidx);
+	if (ret < 0)
+		return ret;
+
+	if (!kmod_index_is_current(ctx, SOFTDEP_FN ".bin", SOFTDEP_FN, *stamp)) {
+		index_mm_close(*pidx);
+		*pidx = NULL;
+		return -ESTALE;
+	}
+
+	return 0;
+}
+
+/*
+ * Whether the softdeps of modules.softdep are resolved through its index
+ * rather than parsed as configuration.
+ */
+bool kmod_has_softdep_index(struct kmod_ctx *ctx)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (ctx->softdeps != NULL)
+		return true;
+
+	snprintf(path, sizeof(path), "%s/" SOFTDEP_FN ".bin", ctx->dirname);
+	if (stat(path, &st) < 0)
+		return false;
+
+	return kmod_index_is_current(ctx, SOFTDEP_FN ".bin", SOFTDEP_FN,
+							stat_mstamp(&st));
+}
+
+/* The softdep line of module @name taken from modules.softdep.bin */
+char *kmod_search_softdep(struct kmod_ctx *ctx, const char *name)
+{
+	unsigned long long stamp;
+	struct index_mm *idx;
+	char *line;
+
+	if (ctx->softdeps != NULL) {
+		DBG(ctx, "use mmaped index '" SOFTDEP_FN ".bin' modname=%s\n",
+									name);
+		return index_mm_search(ctx->softdeps, name);
+	}
+
+	if (softdep_index_open(ctx, &stamp, &idx) < 0)
+		return NULL;
+
+	DBG(ctx, "file=" SOFTDEP_FN ".bin modname=%s\n", name);
+	line = index_mm_search(idx, name);
+	index_mm_close(idx);
+
+	return line;
+}
+
+int kmod_lookup_alias_from_moddep_file(struct kmod_ctx *ctx, const char *name,
+						struct kmod_list **list)
+{
+	char *line;
+	int n = 0;
+
+	/*
+	 * Module names do not contain ':'. Return early if we know it will
+	 * not be found.
+	 */
+	if (strchr(name, ':'))
+		return 0;
+
+	line = kmod_search_moddep(ctx, name);
+	if (line != NULL) {
+		struct kmod_module *mod;
+
+		n = kmod_module_new_from_name(ctx, name, &mod);
+		if (n < 0) {
+			ERR(ctx, "Could not create module from name %s: %s\n",
+			    name, strerror(-n));
+			goto finish;
+		}
 
-		if (fnmatch(aliasname, name, 0) == 0) {
-			struct kmod_module *mod;
+		*list = kmod_list_append(*list, mod);
+		kmod_module_parse_depline(mod, line);
+	}
 
-			err = kmod_module_new_from_alias(ctx, aliasname,
-								modname, &mod);
-			if (err < 0) {
-				ERR(ctx, "Could not create module for alias=%s modname=%s: %s\n",
-				    name, modname, strerror(-err));
-				goto fail;
-			}
+finish:
+	free(line);
+
+	return n;
+}
+
+int kmod_lookup_alias_from_config(struct kmod_ctx *ctx, const char *name,
+						struct kmod_list **list)
+{
+	struct kmod_config *config = ctx->config;
+	const struct kmod_list *l;
+	unsigned int cursor = 0;
+	int err, nmatch = 0;
+
+	while ((l = kmod_config_match(config, CONFIG_TYPE_ALIAS, name, true,
+							&cursor)) != NULL) {
+		const char *aliasname = kmod_alias_get_name(l);
+		const char *modname = kmod_alias_get_modname(l);
+		struct kmod_module *mod;
 
-			*list = kmod_list_append(*list, mod);
-			nmatch++;
+		err = kmod_module_new_from_alias(ctx, aliasname, modname, &mod);
+		if (err < 0) {
+			ERR(ctx, "Could not create module for alias=%s modname=%s: %s\n",
+			    name, modname, strerror(-err));
+			goto fail;
 		}
+
+		*list = kmod_list_append(*list, mod);
+		nmatch++;
 	}
 
 	return nmatch;
@@ -727,79 +1892,48 @@ int kmod_lookup_alias_from_commands(struct kmod_ctx *ctx, const char *name,
 						struct kmod_list **list)
 {
 	struct kmod_config *config = ctx->config;
-	struct kmod_list *l, *node;
-	int err, nmatch = 0;
-
-	kmod_list_foreach(l, config->install_commands) {
-		const char *modname = kmod_command_get_modname(l);
-
-		if (streq(modname, name)) {
-			const char *cmd = kmod_command_get_command(l);
-			struct kmod_module *mod;
-
-			err = kmod_module_new_from_name(ctx, modname, &mod);
-			if (err < 0) {
-				ERR(ctx, "Could not create module from name %s: %s\n",
-				    modname, strerror(-err));
-				return err;
-			}
-
-			node = kmod_list_append(*list, mod);
-			if (node == NULL) {
-				ERR(ctx, "out of memory\n");
-				return -ENOMEM;
-			}
-
-			*list = node;
-			nmatch = 1;
-
-			kmod_module_set_install_commands(mod, cmd);
+	const struct kmod_list *l;
+	struct kmod_list *node;
+	struct kmod_module *mod;
+	unsigned int cursor = 0;
+	bool install = true;
+	int err;
 
-			/*
-			 * match only the first one, like modprobe from
-			 * module-init-tools does
-			 */
-			break;
-		}
+	/*
+	 * match only the first one, like modprobe from
+	 * module-init-tools does
+	 */
+	l = kmod_config_match(config, CONFIG_TYPE_INSTALL, name, false, &cursor);
+	if (l == NULL) {
+		cursor = 0;
+		install = false;
+		l = kmod_config_match(config, CONFIG_TYPE_REMOVE, name, false,
+								&cursor);
+		if (l == NULL)
+			return 0;
 	}
 
-	if (nmatch)
-		return nmatch;
-
-	kmod_list_foreach(l, config->remove_commands) {
-		const char *modname = kmod_command_get_modname(l);
-
-		if (streq(modname, name)) {
-			const char *cmd = kmod_command_get_command(l);
-			struct kmod_module *mod;
-
-			err = kmod_module_new_from_name(ctx, modname, &mod);
-			if (err < 0) {
-				ERR(ctx, "Could not create module from name %s: %s\n",
-				    modname, strerror(-err));
-				return err;
-			}
-
-			node = kmod_list_append(*list, mod);
-			if (node == NULL) {
-				ERR(ctx, "out of memory\n");
-				return -ENOMEM;
-			}
+	err = kmod_module_new_from_name(ctx, name, &mod);
+	if (err < 0) {
+		ERR(ctx, "Could not create module from name %s: %s\n",
+		    name, strerror(-err));
+		return err;
+	}
 
-			*list = node;
-			nmatch = 1;
+	node = kmod_list_append(*list, mod);
+	if (node == NULL) {
+		ERR(ctx, "out of memory\n");
+		return -ENOMEM;
+	}
 
-			kmod_module_set_remove_commands(mod, cmd);
+	*list = node;
 
-			/*
-			 * match only the first one, like modprobe from
-			 * module-init-tools does
-			 */
-			break;
-		}
-	}
+	if (install)
+		kmod_module_set_install_commands(mod, kmod_command_get_command(l));
+	else
+		kmod_module_set_remove_commands(mod, kmod_command_get_command(l));
 
-	return nmatch;
+	return 1;
 }
 
 void kmod_set_modules_visited(struct kmod_ctx *ctx, bool visited)
@@ -835,33 +1969,88 @@ static bool is_cache_invalid(const char *path, unsigned long long stamp)
 	return false;
 }
 
-/**
- * kmod_validate_resources:
- * @ctx: kmod library context
- *
- * Check if indexes and configuration files changed on disk and the current
- * context is not valid anymore.
- *
- * Returns: KMOD_RESOURCES_OK if resources are still valid,
- * KMOD_RESOURCES_MUST_RELOAD if it's sufficient to call
- * kmod_unload_resources() and kmod_load_resources() or
- * KMOD_RESOURCES_MUST_RECREATE if @ctx must be re-created.
- */
-KMOD_EXPORT int kmod_validate_resources(struct kmod_ctx *ctx)
+static int validate_resources(struct kmod_ctx *ctx)
 {
-	struct kmod_list *l;
+	const struct kmod_list *l, *paths;
 	size_t i;
 
-	if (ctx == NULL || ctx->config == NULL)
+	if (ctx->config == NULL)
 		return KMOD_RESOURCES_MUST_RECREATE;
 
-	kmod_list_foreach(l, ctx->config->paths) {
+	paths = kmod_config_get_paths(ctx->config);
+	kmod_list_foreach(l, paths) {
 		struct kmod_config_path *cf = l->data;
 
 		if (is_cache_invalid(cf->path, cf->stamp))
 			return KMOD_RESOURCES_MUST_RECREATE;
 	}
 
+	if (ctx->moddep_ids != NULL) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s/%s", ctx->dirname,
+							MODDEP_IDS_FN);
+
+		if (is_cache_invalid(path, ctx->moddep_ids_stamp))
+			return KMOD_RESOURCES_MUST_RELOAD;
+	}
+
+	if (ctx->symhash != NULL) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s/%s", ctx->dirname, SYMHASH_FN);
+
+		if (is_cache_invalid(path, ctx->symhash_stamp))
+			return KMOD_RESOURCES_MUST_RELOAD;
+	}
+
+	if (ctx->softdeps != NULL) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s/" SOFTDEP_FN ".bin",
+							ctx->dirname);
+
+		if (is_cache_invalid(path, ctx->softdeps_stamp))
+			return KMOD_RESOURCES_MUST_RELOAD;
+	}
+
+	if (ctx->builtin_modinfo != NULL &&
+	    !kmod_builtin_modinfo_is_current(ctx, ctx->builtin_modinfo))
+		return KMOD_RESOURCES_MUST_RELOAD;
+
+	for (i = 0; i < _KMOD_DELTA_SIZE; i++) {
+		char path[PATH_MAX];
+
+		if (ctx->deltas[i] == NULL) {
+			/* written by depmod --delta since the indexes were loaded */
+			if (kmod_has_resources(ctx) && delta_is_current(ctx, i))
+				return KMOD_RESOURCES_MUST_RELOAD;
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s.delta.bin", ctx->dirname,
+							index_files[i].fn);
+
+		if (is_cache_invalid(path, ctx->deltas_stamp[i]))
+			return KMOD_RESOURCES_MUST_RELOAD;
+	}
+
+	if (ctx->bundle != NULL) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s/modules.bin", ctx->dirname);
+
+		if (is_cache_invalid(path, ctx->bundle_stamp))
+			return KMOD_RESOURCES_MUST_RELOAD;
+
+		/* as in kmod_load_bundle(): rewritten without modules.bin */
+		if (!kmod_index_is_current(ctx, "modules.bin", "modules.dep.bin",
+							ctx->bundle_stamp))
+			return KMOD_RESOURCES_MUST_RELOAD;
+
+		return KMOD_RESOURCES_OK;
+	}
+
 	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
 		char path[PATH_MAX];
 
@@ -878,6 +2067,210 @@ KMOD_EXPORT int kmod_validate_resources(struct kmod_ctx *ctx)
 	return KMOD_RESOURCES_OK;
 }
 
+#define WATCH_MASK (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+		    IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF)
+
+/* Read all the pending events: any of them may be a change */
+static void watch_drain(struct kmod_ctx *ctx)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	for (;;) {
+		const struct inotify_event *ev;
+		ssize_t n;
+		char *p;
+
+		n = read(ctx->watch_fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			break;
+		if (n <= 0) {
+			ctx->watch_broken = true;
+			break;
+		}
+
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *) p;
+			if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED))
+				ctx->watch_broken = true;
+			ctx->watch_dirty = true;
+		}
+	}
+}
+
+/**
+ * kmod_watch_resources:
+ * @ctx: kmod library context
+ *
+ * Watch the module directory and the configuration paths of @ctx for
+ * changes, so kmod_validate_resources() only needs to check the files when
+ * something happened to them since it last found everything current,
+ * instead of calling stat() on each of them every time. The returned file
+ * descriptor becomes readable on a change: a daemon can add it to its event
+ * loop and call kmod_validate_resources() then, but it must not read from it
+ * itself. It belongs to @ctx and is closed with it. Calling this function
+ * again returns the same file descriptor.
+ *
+ * Returns: a file descriptor to poll or < 0 on error, in which case
+ * kmod_validate_resources() keeps checking every file.
+ */
+KMOD_EXPORT int kmod_watch_resources(struct kmod_ctx *ctx)
+{
+	const char *const *path;
+	int fd, err;
+
+	if (ctx == NULL)
+		return -ENOENT;
+
+	if (ctx->watch_fd >= 0)
+		return ctx->watch_fd;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (inotify_add_watch(fd, ctx->dirname, WATCH_MASK) < 0)
+		goto fail;
+
+	/*
+	 * The configured paths rather than the ones the configuration was
+	 * read from: it may only be read after this. As when it's read, the
+	 * ones that don't exist are skipped.
+	 */
+	if (ctx->config != NULL) {
+		for (path = ctx->config->config_paths; *path != NULL; path++) {
+			if (inotify_add_watch(fd, *path, WATCH_MASK) < 0 &&
+			    errno != ENOENT && errno != ENOTDIR)
+				goto fail;
+		}
+	}
+
+	/* anything may have changed before the watches were added */
+	ctx->watch_fd = fd;
+	ctx->watch_dirty = true;
+	ctx->watch_broken = false;
+
+	return fd;
+
+fail:
+	err = -errno;
+	DBG(ctx, "could not watch the resources: %s\n", strerror(-err));
+	close(fd);
+	return err;
+}
+
+/**
+ * kmod_validate_resources:
+ * @ctx: kmod library context
+ *
+ * Check if indexes and configuration files changed on disk and the current
+ * context is not valid anymore. If so, the lookup cache, the cached probe
+ * lists and the unused modules kept in the pool are dropped too. After
+ * kmod_watch_resources(), the files are only checked when a change was
+ * notified.
+ *
+ * Returns: KMOD_RESOURCES_OK if resources are still valid,
+ * KMOD_RESOURCES_MUST_RELOAD if it's sufficient to call
+ * kmod_unload_resources() and kmod_load_resources() or
+ * KMOD_RESOURCES_MUST_RECREATE if @ctx must be re-created.
+ */
+KMOD_EXPORT int kmod_validate_resources(struct kmod_ctx *ctx)
+{
+	int ret;
+
+	if (ctx == NULL)
+		return KMOD_RESOURCES_MUST_RECREATE;
+
+	if (ctx->watch_fd >= 0) {
+		watch_drain(ctx);
+		if (!ctx->watch_dirty && !ctx->watch_broken)
+			return KMOD_RESOURCES_OK;
+	}
+
+	ret = validate_resources(ctx);
+	if (ret == KMOD_RESOURCES_OK)
+		ctx->watch_dirty = false;
+	else {
+		kmod_lookup_cache_flush(ctx);
+		kmod_module_probe_cache_flush(ctx);
+		kmod_pool_lock(ctx);
+		kmod_module_lru_shrink(ctx, 0);
+		kmod_pool_unlock(ctx);
+	}
+
+	return ret;
+}
+
+/*
+ * Map all the indexes at once from modules.bin. A stale bundle, older than
+ * modules.dep.bin, is not used and the per-file indexes are used instead.
+ */
+static int kmod_load_bundle(struct kmod_ctx *ctx)
+{
+	char path[PATH_MAX];
+	size_t i;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/modules.bin", ctx->dirname);
+	ret = index_bundle_open(ctx, path, &ctx->bundle_stamp, &ctx->bundle);
+	if (ret < 0)
+		return ret;
+
+	if (!kmod_index_is_current(ctx, "modules.bin", "modules.dep.bin",
+							ctx->bundle_stamp)) {
+		ret = -ESTALE;
+		goto fail;
+	}
+
+	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
+		ret = index_mm_open_bundle(ctx, ctx->bundle, i,
+					   &ctx->indexes[i]);
+		if (ret) {
+			if (i != KMOD_INDEX_MODULES_BUILTIN_ALIAS)
+				goto fail;
+			ret = 0;
+		} else {
+			index_mm_preload(ctx->indexes[i],
+						ctx->indexes_preload[i]);
+		}
+		ctx->indexes_stamp[i] = ctx->bundle_stamp;
+	}
+
+	return 0;
+
+fail:
+	kmod_unload_resources(ctx);
+	return ret;
+}
+
+/*
+ * modules.dep.ids.bin, modules.symbols.hash.bin and modules.softdep.bin are
+ * optional: modules.dep.bin, modules.symbols.bin and modules.softdep are
+ * used without them. So are the deltas of depmod --delta, and
+ * modules.builtin.modinfo.bin, without which modules.builtin.modinfo is
+ * scanned.
+ */
+static void kmod_load_optional_indexes(struct kmod_ctx *ctx)
+{
+	size_t i;
+
+	if (ctx->moddep_ids == NULL)
+		moddep_ids_open(ctx, &ctx->moddep_ids_stamp, &ctx->moddep_ids);
+	if (ctx->symhash == NULL)
+		symhash_open(ctx, &ctx->symhash_stamp, &ctx->symhash);
+	if (ctx->softdeps == NULL)
+		softdep_index_open(ctx, &ctx->softdeps_stamp, &ctx->softdeps);
+	if (ctx->builtin_modinfo == NULL)
+		kmod_builtin_modinfo_open(ctx, &ctx->builtin_modinfo);
+
+	for (i = 0; i < _KMOD_DELTA_SIZE; i++) {
+		if (ctx->deltas[i] == NULL)
+			delta_open(ctx, i, &ctx->deltas_stamp[i],
+							&ctx->deltas[i]);
+	}
+}
+
 /**
  * kmod_load_resources:
  * @ctx: kmod library context
@@ -891,6 +2284,14 @@ KMOD_EXPORT int kmod_validate_resources(struct kmod_ctx *ctx)
  * udev that on bootup issues hundreds of calls to lookup the index, calling
  * this function will speedup the searches.
  *
+ * If depmod packed all the indexes in modules.bin, they are loaded with a
+ * single mapping of that file. Otherwise each modules.*.bin file is mapped.
+ * How much of each index is read in right away is set with
+ * kmod_set_index_preload(). The mappings are shared with the other contexts
+ * of the process that loaded the same files, unchanged since: each context
+ * still finds out on its own with kmod_validate_resources() when they are
+ * stale.
+ *
  * Returns: 0 on success or < 0 otherwise.
  */
 KMOD_EXPORT int kmod_load_resources(struct kmod_ctx *ctx)
@@ -901,6 +2302,11 @@ KMOD_EXPORT int kmod_load_resources(struct kmod_ctx *ctx)
 	if (ctx == NULL)
 		return -ENOENT;
 
+	if (!kmod_has_resources(ctx) && kmod_load_bundle(ctx) == 0) {
+		kmod_load_optional_indexes(ctx);
+		return 0;
+	}
+
 	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
 		char path[PATH_MAX];
 
@@ -924,15 +2330,32 @@ KMOD_EXPORT int kmod_load_resources(struct kmod_ctx *ctx)
 			if (i != KMOD_INDEX_MODULES_BUILTIN_ALIAS)
 				break;
 			ret = 0;
+			continue;
 		}
+
+		index_mm_preload(ctx->indexes[i], ctx->indexes_preload[i]);
 	}
 
 	if (ret)
 		kmod_unload_resources(ctx);
+	else
+		kmod_load_optional_indexes(ctx);
 
 	return ret;
 }
 
+bool kmod_has_resources(const struct kmod_ctx *ctx)
+{
+	size_t i;
+
+	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
+		if (ctx->indexes[i] != NULL)
+			return true;
+	}
+
+	return false;
+}
+
 /**
  * kmod_unload_resources:
  * @ctx: kmod library context
@@ -962,6 +2385,102 @@ KMOD_EXPORT void kmod_unload_resources(struct kmod_ctx *ctx)
 			ctx->indexes_stamp[i] = 0;
 		}
 	}
+
+	if (ctx->bundle != NULL) {
+		index_bundle_close(ctx->bundle);
+		ctx->bundle = NULL;
+		ctx->bundle_stamp = 0;
+	}
+
+	if (ctx->moddep_ids != NULL) {
+		index_moddep_close(ctx->moddep_ids);
+		ctx->moddep_ids = NULL;
+		ctx->moddep_ids_stamp = 0;
+	}
+
+	if (ctx->symhash != NULL) {
+		index_symhash_close(ctx->symhash);
+		ctx->symhash = NULL;
+		ctx->symhash_stamp = 0;
+	}
+
+	if (ctx->symbol_owners != NULL) {
+		hash_free(ctx->symbol_owners);
+		ctx->symbol_owners = NULL;
+	}
+
+	for (i = 0; i < _KMOD_DELTA_SIZE; i++) {
+		if (ctx->deltas[i] != NULL) {
+			index_mm_close(ctx->deltas[i]);
+			ctx->deltas[i] = NULL;
+			ctx->deltas_stamp[i] = 0;
+		}
+	}
+
+	if (ctx->softdeps != NULL) {
+		index_mm_close(ctx->softdeps);
+		ctx->softdeps = NULL;
+		ctx->softdeps_stamp = 0;
+	}
+
+	if (ctx->builtin_modinfo != NULL) {
+		kmod_builtin_modinfo_close(ctx->builtin_modinfo);
+		ctx->builtin_modinfo = NULL;
+	}
+}
+
+/**
+ * kmod_get_index_preload:
+ * @ctx: kmod library context
+ * @type: index
+ *
+ * Returns: how much of the index @type kmod_load_resources() reads in
+ */
+KMOD_EXPORT enum kmod_index_preload kmod_get_index_preload(
+						const struct kmod_ctx *ctx,
+						enum kmod_index type)
+{
+	if (ctx == NULL || type < 0 || type >= _KMOD_INDEX_MODULES_SIZE)
+		return KMOD_INDEX_PRELOAD_LAZY;
+	return ctx->indexes_preload[type];
+}
+
+/**
+ * kmod_set_index_preload:
+ * @ctx: kmod library context
+ * @type: index
+ * @preload: how much of the index to read in
+ *
+ * Choose what kmod_load_resources() does with the index @type besides
+ * mapping it. With KMOD_INDEX_PRELOAD_LAZY, the default, its pages are
+ * read when a lookup first needs them. KMOD_INDEX_PRELOAD_HOT starts
+ * reading in the top of the index, which every lookup goes through, and
+ * its hash tables of aliases without wildcards: a few tens of KiB per
+ * index, which is what a daemon like udev doing its coldplug wants.
+ * KMOD_INDEX_PRELOAD_ALL reads the whole index before returning, in
+ * exchange for no page fault on any lookup. If the index is already
+ * loaded, @preload applies right away. The default for all the indexes
+ * may also be given with KMOD_INDEX_PRELOAD=lazy|hot|all in the
+ * environment.
+ *
+ * Returns: 0 on success or < 0 otherwise.
+ */
+KMOD_EXPORT int kmod_set_index_preload(struct kmod_ctx *ctx,
+					enum kmod_index type,
+					enum kmod_index_preload preload)
+{
+	if (ctx == NULL)
+		return -ENOENT;
+
+	if (type < 0 || type >= _KMOD_INDEX_MODULES_SIZE ||
+					preload > KMOD_INDEX_PRELOAD_ALL)
+		return -EINVAL;
+
+	ctx->indexes_preload[type] = preload;
+	if (ctx->indexes[type] != NULL)
+		index_mm_preload(ctx->indexes[type], preload);
+
+	return 0;
 }
 
 /**
@@ -24,6 +24,7 @@
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <inttypes.h>
 
 #ifdef __cplusplus
@@ -50,6 +51,14 @@ int kmod_get_log_priority(const struct kmod_ctx *ctx);
 void kmod_set_log_priority(struct kmod_ctx *ctx, int priority);
 void *kmod_get_userdata(const struct kmod_ctx *ctx);
 void kmod_set_userdata(struct kmod_ctx *ctx, const void *userdata);
+unsigned int kmod_get_lookup_cache_size(const struct kmod_ctx *ctx);
+int kmod_set_lookup_cache_size(struct kmod_ctx *ctx, unsigned int size);
+unsigned int kmod_get_module_pool_size(const struct kmod_ctx *ctx);
+int kmod_set_module_pool_size(struct kmod_ctx *ctx, unsigned int size);
+unsigned int kmod_get_decompress_threads(const struct kmod_ctx *ctx);
+int kmod_set_decompress_threads(struct kmod_ctx *ctx, unsigned int threads);
+const char *kmod_get_decompress_cache(const struct kmod_ctx *ctx);
+int kmod_set_decompress_cache(struct kmod_ctx *ctx, const char *dir);
 
 const char *kmod_get_dirname(const struct kmod_ctx *ctx);
 
@@ -65,6 +74,7 @@ enum kmod_resources {
 	KMOD_RESOURCES_MUST_RECREATE = 2,
 };
 int kmod_validate_resources(struct kmod_ctx *ctx);
+int kmod_watch_resources(struct kmod_ctx *ctx);
 
 enum kmod_index {
 	KMOD_INDEX_MODULES_DEP = 0,
@@ -77,6 +87,46 @@ enum kmod_index {
 };
 int kmod_dump_index(struct kmod_ctx *ctx, enum kmod_index type, int fd);
 
+int kmod_resolve_symbols(struct kmod_ctx *ctx, const char * const *symbols,
+			 unsigned int count, const char **owners,
+			 uint64_t *crcs);
+
+/*
+ * How much of an index is read in when kmod_load_resources() maps it
+ */
+enum kmod_index_preload {
+	KMOD_INDEX_PRELOAD_LAZY = 0,
+	KMOD_INDEX_PRELOAD_HOT,
+	KMOD_INDEX_PRELOAD_ALL,
+	/* Padding to make sure enum is not mapped to char */
+	_KMOD_INDEX_PRELOAD_PAD = 1U << 31,
+};
+enum kmod_index_preload kmod_get_index_preload(const struct kmod_ctx *ctx,
+						enum kmod_index type);
+int kmod_set_index_preload(struct kmod_ctx *ctx, enum kmod_index type,
+				enum kmod_index_preload preload);
+
+/*
+ * Counters of the work done by a context, for monitoring
+ */
+enum kmod_stat {
+	KMOD_STAT_LOOKUP_CACHE_HITS = 0,
+	KMOD_STAT_LOOKUP_CACHE_MISSES,
+	KMOD_STAT_POOL_MODULES,
+	KMOD_STAT_BYTES_MAPPED,
+	KMOD_STAT_BYTES_DECOMPRESSED,
+	KMOD_STAT_DECOMPRESS_USEC,
+	KMOD_STAT_INSERT_USEC,
+	KMOD_STAT_CONFIG_USEC,
+	/* Padding to make sure enum is not mapped to char */
+	_KMOD_STAT_PAD = 1U << 31,
+};
+int kmod_get_stat(const struct kmod_ctx *ctx, enum kmod_stat stat,
+							uint64_t *value);
+int kmod_get_index_lookups(const struct kmod_ctx *ctx, enum kmod_index type,
+							uint64_t *value);
+void kmod_reset_stats(struct kmod_ctx *ctx);
+
 /*
  * kmod_list
  *
@@ -132,8 +182,14 @@ int kmod_module_new_from_lookup(struct kmod_ctx *ctx, const char *given_alias,
 int kmod_module_new_from_name_lookup(struct kmod_ctx *ctx,
 				     const char *modname,
 				     struct kmod_module **mod);
+int kmod_module_new_from_lookups(struct kmod_ctx *ctx,
+				 const char * const *aliases,
+				 unsigned int count,
+				 struct kmod_list **lists);
 int kmod_module_new_from_loaded(struct kmod_ctx *ctx,
 						struct kmod_list **list);
+int kmod_module_new_from_loaded_snapshot(struct kmod_ctx *ctx,
+						struct kmod_list **list);
 
 struct kmod_module *kmod_module_ref(struct kmod_module *mod);
 struct kmod_module *kmod_module_unref(struct kmod_module *mod);
@@ -163,6 +219,7 @@ enum kmod_probe {
 	KMOD_PROBE_IGNORE_LOADED =		0x00008,
 	KMOD_PROBE_DRY_RUN =			0x00010,
 	KMOD_PROBE_FAIL_ON_LOADED =		0x00020,
+	KMOD_PROBE_PARALLEL =			0x00040,
 
 	/* codes below can be used in return value, too */
 	KMOD_PROBE_APPLY_BLACKLIST_ALL =	0x10000,
@@ -186,6 +243,29 @@ int kmod_module_probe_insert_module(struct kmod_module *mod,
 			const void *data,
 			void (*print_action)(struct kmod_module *m, bool install,
 						const char *options));
+int kmod_module_probe_insert_modules(struct kmod_module * const *mods,
+			unsigned int count, unsigned int flags,
+			int (*run_install)(struct kmod_module *m,
+						const char *cmdline, void *data),
+			const void *data,
+			void (*print_action)(struct kmod_module *m, bool install,
+						const char *options));
+
+/*
+ * kmod_insert_queue
+ *
+ * Probes running on threads of the library, for event loops
+ */
+struct kmod_insert_queue;
+struct kmod_insert_queue *kmod_insert_queue_new(struct kmod_ctx *ctx,
+							unsigned int jobs);
+void kmod_insert_queue_free(struct kmod_insert_queue *q);
+int kmod_insert_queue_get_fd(const struct kmod_insert_queue *q);
+int kmod_insert_queue_probe(struct kmod_insert_queue *q,
+			struct kmod_module *mod, unsigned int flags,
+			const char *extra_options, void *userdata);
+int kmod_insert_queue_next(struct kmod_insert_queue *q,
+			struct kmod_module **mod, int *err, void **userdata);
 
 
 const char *kmod_module_get_name(const struct kmod_module *mod);
@@ -235,10 +315,17 @@ long kmod_module_get_size(const struct kmod_module *mod);
  * Information retrieved from ELF headers and sections
  */
 
+/* Flags to kmod_module_get_info_flags() */
+enum kmod_info {
+	KMOD_INFO_NO_SIGNATURE = 0x1,
+};
+
 int kmod_module_get_info(const struct kmod_module *mod, struct kmod_list **list);
+int kmod_module_get_info_flags(const struct kmod_module *mod, unsigned int flags, struct kmod_list **list);
 const char *kmod_module_info_get_key(const struct kmod_list *entry);
 const char *kmod_module_info_get_value(const struct kmod_list *entry);
 void kmod_module_info_free_list(struct kmod_list *list);
+int kmod_module_get_info_next(const struct kmod_module *mod, size_t *pos, const char **key, size_t *keylen, const char **value, size_t *valuelen);
 
 int kmod_module_get_versions(const struct kmod_module *mod, struct kmod_list **list);
 const char *kmod_module_version_get_symbol(const struct kmod_list *entry);
@@ -58,10 +58,13 @@ cdef extern from 'libkmod/libkmod.h':
         pass
     ctypedef kmod_module* const_kmod_module_ptr 'const struct kmod_module *'
     int kmod_module_new_from_name(
-        kmod_ctx *ctx, const_char_ptr name, kmod_module **mod)
+        kmod_ctx *ctx, const_char_ptr name, kmod_module **mod) nogil
     int kmod_module_new_from_lookup(
-        kmod_ctx *ctx, const_char_ptr given_alias, kmod_list **list)
-    int kmod_module_new_from_loaded(kmod_ctx *ctx, kmod_list **list)
+        kmod_ctx *ctx, const_char_ptr given_alias, kmod_list **list) nogil
+    int kmod_module_new_from_lookups(
+        kmod_ctx *ctx, const_char_ptr *aliases, unsigned int count,
+        kmod_list **lists) nogil
+    int kmod_module_new_from_loaded(kmod_ctx *ctx, kmod_list **list) nogil
 
     kmod_module *kmod_module_ref(kmod_module *mod)
     kmod_module *kmod_module_unref(kmod_module *mod)
@@ -91,23 +94,30 @@ cdef extern from 'libkmod/libkmod.h':
         )
 
     const_char_ptr kmod_module_get_name(const_kmod_module_ptr mod)
-    const_char_ptr kmod_module_get_path(const_kmod_module_ptr mod)
-    const_char_ptr kmod_module_get_options(const_kmod_module_ptr mod)
-    const_char_ptr kmod_module_get_install_commands(const_kmod_module_ptr mod)
-    const_char_ptr kmod_module_get_remove_commands(const_kmod_module_ptr mod)
+    const_char_ptr kmod_module_get_path(const_kmod_module_ptr mod) nogil
+    const_char_ptr kmod_module_get_options(const_kmod_module_ptr mod) nogil
+    const_char_ptr kmod_module_get_install_commands(
+        const_kmod_module_ptr mod) nogil
+    const_char_ptr kmod_module_get_remove_commands(
+        const_kmod_module_ptr mod) nogil
 
     # Information regarding "live information" from module's state, as
     # returned by kernel
-    int kmod_module_get_refcnt(const_kmod_module_ptr mod)
-    long kmod_module_get_size(const_kmod_module_ptr mod)
+    int kmod_module_get_refcnt(const_kmod_module_ptr mod) nogil
+    long kmod_module_get_size(const_kmod_module_ptr mod) nogil
 
     # Information retrieved from ELF headers and section
-    int kmod_module_get_info(const_kmod_module_ptr mod, kmod_list **list)
+    int kmod_module_get_info(
+        const_kmod_module_ptr mod, kmod_list **list) nogil
     const_char_ptr kmod_module_info_get_key(const_kmod_list_ptr entry)
     const_char_ptr kmod_module_info_get_value(const_kmod_list_ptr entry)
     void kmod_module_info_free_list(kmod_list *list)
+    int kmod_module_get_info_next(
+        const_kmod_module_ptr mod, size_t *pos, const_char_ptr *key,
+        size_t *keylen, const_char_ptr *value, size_t *valuelen) nogil
 
-    int kmod_module_get_versions(const_kmod_module_ptr mod, kmod_list **list)
+    int kmod_module_get_versions(
+        const_kmod_module_ptr mod, kmod_list **list) nogil
     const_char_ptr kmod_module_version_get_symbol(const_kmod_list_ptr entry)
     _stdint.uint64_t kmod_module_version_get_crc(const_kmod_list_ptr entry)
     void kmod_module_versions_free_list(kmod_list *list)
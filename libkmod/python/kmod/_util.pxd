@@ -18,3 +18,4 @@ cimport _libkmod_h
 
 
 cdef object char_ptr_to_str(_libkmod_h.const_char_ptr bytes)
+cdef object char_ptr_len_to_str(_libkmod_h.const_char_ptr bytes, size_t length)
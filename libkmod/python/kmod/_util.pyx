@@ -26,3 +26,13 @@ cdef object char_ptr_to_str(_libkmod_h.const_char_ptr char_ptr):
         return str(char_ptr, 'ascii')
     # Python 2
     return unicode(char_ptr, 'ascii')
+
+
+cdef object char_ptr_len_to_str(_libkmod_h.const_char_ptr char_ptr,
+                                size_t length):
+    if char_ptr is NULL:
+        return None
+    if _sys.version_info >= (3,):  # Python 3
+        return str(char_ptr[:length], 'ascii')
+    # Python 2
+    return unicode(char_ptr[:length], 'ascii')
@@ -18,6 +18,8 @@
 "Define the Kmod class"
 
 cimport cython as _cython
+cimport libc.stdlib as _stdlib
+
 cimport _libkmod_h
 from error import KmodError as _KmodError
 cimport module as _module
@@ -61,7 +63,12 @@ cdef class Kmod (object):
         "iterate through currently loaded modules"
         cdef _list.ModList ml = _list.ModList()
         cdef _list.ModListItem mli
-        err = _libkmod_h.kmod_module_new_from_loaded(self._kmod_ctx, &ml.list)
+        cdef _libkmod_h.kmod_list *c_list = NULL
+        cdef int err
+        with nogil:
+            err = _libkmod_h.kmod_module_new_from_loaded(
+                self._kmod_ctx, &c_list)
+        ml.list = c_list
         if err < 0:
             raise _KmodError('Could not get loaded modules')
         for item in ml:
@@ -74,10 +81,16 @@ cdef class Kmod (object):
         "iterate through modules matching `alias_name`"
         cdef _list.ModList ml = _list.ModList()
         cdef _list.ModListItem mli
+        cdef _libkmod_h.kmod_list *c_list = NULL
+        cdef char *alias
+        cdef int err
         if hasattr(alias_name, 'encode'):
             alias_name = alias_name.encode('ascii')
-        err = _libkmod_h.kmod_module_new_from_lookup(
-            self._kmod_ctx, alias_name, &ml.list)
+        alias = alias_name
+        with nogil:
+            err = _libkmod_h.kmod_module_new_from_lookup(
+                self._kmod_ctx, alias, &c_list)
+        ml.list = c_list
         if err < 0:
             raise _KmodError('Could not modprobe')
         for item in ml:
@@ -86,17 +99,82 @@ cdef class Kmod (object):
             mod.from_mod_list_item(item)
             yield mod
 
+    def lookup_many(self, aliases):
+        """
+        look up all the `aliases` at once, in a single pass over the
+        indexes, and return a list with the modules matching each alias,
+        in the same order
+        """
+        cdef _libkmod_h.const_char_ptr *c_aliases = NULL
+        cdef _libkmod_h.kmod_list **lists = NULL
+        cdef _list.ModList ml
+        cdef unsigned int i, count
+        cdef int err
+        encoded = [a.encode('ascii') if hasattr(a, 'encode') else a
+                   for a in aliases]
+        count = len(encoded)
+        if count == 0:
+            return []
+        c_aliases = <_libkmod_h.const_char_ptr *> _stdlib.calloc(
+            count, sizeof(_libkmod_h.const_char_ptr))
+        lists = <_libkmod_h.kmod_list **> _stdlib.calloc(
+            count, sizeof(_libkmod_h.kmod_list *))
+        try:
+            if c_aliases is NULL or lists is NULL:
+                raise MemoryError()
+            for i in range(count):
+                c_aliases[i] = encoded[i]
+            with nogil:
+                err = _libkmod_h.kmod_module_new_from_lookups(
+                    self._kmod_ctx, c_aliases, count, lists)
+            if err < 0:
+                raise _KmodError('Could not look up aliases')
+            result = []
+            for i in range(count):
+                # the ModList releases the list from now on
+                ml = _list.ModList()
+                ml.list = lists[i]
+                lists[i] = NULL
+                mods = []
+                for item in ml:
+                    mod = _module.Module()
+                    mod.from_mod_list_item(item)
+                    mods.append(mod)
+                result.append(mods)
+            return result
+        finally:
+            if lists is not NULL:
+                for i in range(count):
+                    if lists[i] is not NULL:
+                        _libkmod_h.kmod_module_unref_list(lists[i])
+            _stdlib.free(lists)
+            _stdlib.free(c_aliases)
+
     @_cython.always_allow_keywords(True)
     def module_from_name(self, name):
         cdef _module.Module mod = _module.Module()
+        cdef _libkmod_h.kmod_module *c_mod = NULL
+        cdef char *c_name
+        cdef int err
         if hasattr(name, 'encode'):
             name = name.encode('ascii')
-        err = _libkmod_h.kmod_module_new_from_name(
-            self._kmod_ctx, name, &mod.module)
+        c_name = name
+        with nogil:
+            err = _libkmod_h.kmod_module_new_from_name(
+                self._kmod_ctx, c_name, &c_mod)
         if err < 0:
             raise _KmodError('Could not get module')
+        mod.module = c_mod
         return mod
 
+    def modinfo_many(self, names):
+        """
+        return a list with the .modinfo entries of each module in `names`,
+        in the same order, as `Module.info` without the signature, or None
+        for a module without a file
+        """
+        return [self.module_from_name(name)._modinfo() for name in names]
+
     def list(self):
         "iterate through currently loaded modules and sizes"
         for mod in self.loaded():
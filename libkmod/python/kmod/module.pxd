@@ -20,5 +20,8 @@ cimport list as _list
 
 cdef class Module (object):
     cdef _libkmod_h.kmod_module *module
+    cdef object _name
+    cdef object _path
+    cdef object _info
 
     cpdef from_mod_list_item(self, _list.ModListItem item)
@@ -27,9 +27,18 @@ import _util
 
 
 cdef class Module (object):
-    "Wrap a struct kmod_module* item"
+    """
+    Wrap a struct kmod_module* item
+
+    The name, path and info of a module are only read the first time they
+    are used, then kept.  libkmod is called without the GIL, except to
+    insert and remove modules, which it needs serialized.
+    """
     def __cinit__(self):
         self.module = NULL
+        self._name = None
+        self._path = None
+        self._info = None
 
     def __dealloc__(self):
         self._cleanup()
@@ -41,45 +50,74 @@ cdef class Module (object):
 
     cpdef from_mod_list_item(self, _list.ModListItem item):
         self._cleanup()
+        self._name = None
+        self._path = None
+        self._info = None
         self.module = _libkmod_h.kmod_module_get_module(item.list)
 
     def _name_get(self):
-        return _util.char_ptr_to_str(
-            _libkmod_h.kmod_module_get_name(self.module))
+        if self._name is None:
+            self._name = _util.char_ptr_to_str(
+                _libkmod_h.kmod_module_get_name(self.module))
+        return self._name
     name = property(fget=_name_get)
 
     def _path_get(self):
-        return _util.char_ptr_to_str(
-            _libkmod_h.kmod_module_get_path(self.module))
+        cdef _libkmod_h.const_char_ptr path
+        if self._path is None:
+            with nogil:
+                path = _libkmod_h.kmod_module_get_path(self.module)
+            self._path = _util.char_ptr_to_str(path)
+        return self._path
     path = property(fget=_path_get)
 
     def _options_get(self):
-        return _util.char_ptr_to_str(
-            _libkmod_h.kmod_module_get_options(self.module))
+        cdef _libkmod_h.const_char_ptr options
+        with nogil:
+            options = _libkmod_h.kmod_module_get_options(self.module)
+        return _util.char_ptr_to_str(options)
     options = property(fget=_options_get)
 
     def _install_commands_get(self):
-        return _util.char_ptr_to_str(
-            _libkmod_h.kmod_module_get_install_commands(self.module))
+        cdef _libkmod_h.const_char_ptr commands
+        with nogil:
+            commands = _libkmod_h.kmod_module_get_install_commands(
+                self.module)
+        return _util.char_ptr_to_str(commands)
     install_commands = property(fget=_install_commands_get)
 
     def _remove_commands_get(self):
-        return _util.char_ptr_to_str(
-            _libkmod_h.kmod_module_get_remove_commands(self.module))
+        cdef _libkmod_h.const_char_ptr commands
+        with nogil:
+            commands = _libkmod_h.kmod_module_get_remove_commands(
+                self.module)
+        return _util.char_ptr_to_str(commands)
     remove_commands = property(fget=_remove_commands_get)
 
     def _refcnt_get(self):
-        return _libkmod_h.kmod_module_get_refcnt(self.module)
+        cdef int refcnt
+        with nogil:
+            refcnt = _libkmod_h.kmod_module_get_refcnt(self.module)
+        return refcnt
     refcnt = property(fget=_refcnt_get)
 
     def _size_get(self):
-        return _libkmod_h.kmod_module_get_size(self.module)
+        cdef long size
+        with nogil:
+            size = _libkmod_h.kmod_module_get_size(self.module)
+        return size
     size = property(fget=_size_get)
 
     def _info_get(self):
         cdef _list.ModList ml = _list.ModList()
         cdef _list.ModListItem mli
-        err = _libkmod_h.kmod_module_get_info(self.module, &ml.list)
+        cdef _libkmod_h.kmod_list *c_list = NULL
+        cdef int err
+        if self._info is not None:
+            return self._info
+        with nogil:
+            err = _libkmod_h.kmod_module_get_info(self.module, &c_list)
+        ml.list = c_list
         if err < 0:
             raise _KmodError('Could not get info')
         info = _collections.OrderedDict()
@@ -94,13 +132,42 @@ cdef class Module (object):
         finally:
             _libkmod_h.kmod_module_info_free_list(ml.list)
             ml.list = NULL
+        self._info = info
         return info
     info = property(fget=_info_get)
 
+    def _modinfo(self):
+        """
+        Read the .modinfo entries of the module, like `info` but without
+        the signature and without copying them in libkmod, or return None
+        for a module without a file.
+        """
+        cdef _libkmod_h.const_char_ptr key, value
+        cdef size_t pos = 0, keylen, valuelen
+        cdef int err
+        if self._path_get() is None:
+            return None
+        info = _collections.OrderedDict()
+        while True:
+            with nogil:
+                err = _libkmod_h.kmod_module_get_info_next(
+                    self.module, &pos, &key, &keylen, &value, &valuelen)
+            if err < 0:
+                raise _KmodError('Could not get info')
+            if err == 0:
+                break
+            info[_util.char_ptr_len_to_str(key, keylen)] = (
+                _util.char_ptr_len_to_str(value, valuelen))
+        return info
+
     def _versions_get(self):
         cdef _list.ModList ml = _list.ModList()
         cdef _list.ModListItem mli
-        err = _libkmod_h.kmod_module_get_versions(self.module, &ml.list)
+        cdef _libkmod_h.kmod_list *c_list = NULL
+        cdef int err
+        with nogil:
+            err = _libkmod_h.kmod_module_get_versions(self.module, &c_list)
+        ml.list = c_list
         if err < 0:
             raise _KmodError('Could not get versions')
         try:
@@ -0,0 +1,125 @@
+/*
+ * kmod - interface to kernel module operations
+ *
+ * Copyright (C) 2026  kmod contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <shared/arena.h>
+
+#define ARENA_CHUNK (64 * 1024)
+
+/* enough for pointers and for uint64_t, also on 32-bit */
+#define ARENA_ALIGN (sizeof(uint64_t) > sizeof(void *) ? \
+		     sizeof(uint64_t) : sizeof(void *))
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	char *cur;
+	char *end;
+	char data[];
+};
+
+static inline char *arena_align(char *p)
+{
+	uintptr_t u = (uintptr_t) p;
+
+	return p + (-u & (ARENA_ALIGN - 1));
+}
+
+static struct arena_chunk *arena_chunk_new(size_t size)
+{
+	struct arena_chunk *chunk;
+
+	chunk = malloc(sizeof(*chunk) + ARENA_ALIGN + size);
+	if (chunk == NULL)
+		return NULL;
+	chunk->cur = arena_align(chunk->data);
+	chunk->end = chunk->cur + size;
+
+	return chunk;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	char *p;
+
+	/*
+	 * Large blocks get a chunk of their own, behind the current one so
+	 * that what is left of it is still used.
+	 */
+	if (size > ARENA_CHUNK / 4) {
+		chunk = arena_chunk_new(size);
+		if (chunk == NULL)
+			return NULL;
+		if (arena->chunks == NULL) {
+			chunk->next = NULL;
+			arena->chunks = chunk;
+		} else {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		}
+		chunk->cur = chunk->end;
+		return chunk->end - size;
+	}
+
+	if (chunk == NULL || (size_t)(chunk->end - chunk->cur) < size) {
+		chunk = arena_chunk_new(ARENA_CHUNK);
+		if (chunk == NULL)
+			return NULL;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+
+	p = chunk->cur;
+	chunk->cur = arena_align(p + size);
+	if (chunk->cur > chunk->end)
+		chunk->cur = chunk->end;
+
+	return p;
+}
+
+void *arena_memdup(struct arena *arena, const void *p, size_t size)
+{
+	void *q = arena_alloc(arena, size);
+
+	if (q != NULL)
+		memcpy(q, p, size);
+
+	return q;
+}
+
+char *arena_strdup(struct arena *arena, const char *str)
+{
+	return arena_memdup(arena, str, strlen(str) + 1);
+}
+
+void arena_release(struct arena *arena)
+{
+	struct arena_chunk *chunk = arena->chunks;
+
+	while (chunk != NULL) {
+		struct arena_chunk *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+	arena->chunks = NULL;
+}
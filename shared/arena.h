@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Memory taken in chunks and only released all at once, for many small
+ * objects sharing the same lifetime: they get neither a malloc() nor a
+ * free() each. Not thread safe.
+ *
+ * Declaration of struct arena is in header so it can be embedded in
+ * another structure; a zeroed one is empty and ready to use.
+ */
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk *chunks;
+};
+
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_memdup(struct arena *arena, const void *p, size_t size);
+char *arena_strdup(struct arena *arena, const char *str);
+void arena_release(struct arena *arena);
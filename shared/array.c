@@ -82,6 +82,7 @@ void array_pop(struct array *array) {
 
 void array_free_array(struct array *array) {
 	free(array->array);
+	array->array = NULL;
 	array->count = 0;
 	array->total = 0;
 }
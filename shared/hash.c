@@ -25,273 +25,281 @@
 #include <shared/hash.h>
 #include <shared/util.h>
 
+/*
+ * Open addressing with linear probing. The table doubles once it's 3/4
+ * full, and deletions shift the following entries back instead of leaving
+ * tombstones, so lookups never walk more than the current cluster. Each
+ * entry caches the hash of its key, which makes both growing the table and
+ * skipping non-matching entries cheap.
+ */
 struct hash_entry {
-	const char *key;
+	const char *key; /* NULL for empty slots */
 	const void *value;
-};
-
-struct hash_bucket {
-	struct hash_entry *entries;
-	unsigned int used;
-	unsigned int total;
+	unsigned int hashval;
 };
 
 struct hash {
 	unsigned int count;
-	unsigned int step;
-	unsigned int n_buckets;
+	unsigned int n_buckets; /* power of 2 */
 	void (*free_value)(void *value);
-	struct hash_bucket buckets[];
+	struct hash_entry *entries;
 };
 
+#define HASH_MIN_BUCKETS 8
+
 struct hash *hash_new(unsigned int n_buckets,
 					void (*free_value)(void *value))
 {
 	struct hash *hash;
 
-	n_buckets = ALIGN_POWER2(n_buckets);
-	hash = calloc(1, sizeof(struct hash) +
-		      n_buckets * sizeof(struct hash_bucket));
+	hash = malloc(sizeof(struct hash));
 	if (hash == NULL)
 		return NULL;
+
+	if (n_buckets < HASH_MIN_BUCKETS)
+		n_buckets = HASH_MIN_BUCKETS;
+	n_buckets = ALIGN_POWER2(n_buckets);
+
+	hash->entries = calloc(n_buckets, sizeof(struct hash_entry));
+	if (hash->entries == NULL) {
+		free(hash);
+		return NULL;
+	}
+
+	hash->count = 0;
 	hash->n_buckets = n_buckets;
 	hash->free_value = free_value;
-	hash->step = n_buckets / 32;
-	if (hash->step == 0)
-		hash->step = 4;
-	else if (hash->step > 64)
-		hash->step = 64;
 	return hash;
 }
 
 void hash_free(struct hash *hash)
 {
-	struct hash_bucket *bucket, *bucket_end;
+	struct hash_entry *entry, *entry_end;
 
 	if (hash == NULL)
 		return;
 
-	bucket = hash->buckets;
-	bucket_end = bucket + hash->n_buckets;
-	for (; bucket < bucket_end; bucket++) {
-		if (hash->free_value) {
-			struct hash_entry *entry, *entry_end;
-			entry = bucket->entries;
-			entry_end = entry + bucket->used;
-			for (; entry < entry_end; entry++)
+	if (hash->free_value) {
+		entry = hash->entries;
+		entry_end = entry + hash->n_buckets;
+		for (; entry < entry_end; entry++) {
+			if (entry->key != NULL)
 				hash->free_value((void *)entry->value);
 		}
-		free(bucket->entries);
 	}
+
+	free(hash->entries);
 	free(hash);
 }
 
-static inline unsigned int hash_superfast(const char *key, unsigned int len)
+/*
+ * Hash @len bytes of @key a 64-bit word at a time. A tail shorter than a
+ * word is read with two overlapping loads instead of byte by byte, which
+ * is fine since @len is mixed in as well. The words are loaded in native
+ * byte order, so values differ between little and big endian machines:
+ * never store them.
+ */
+unsigned int hash_str(const char *key, size_t len)
 {
-	/* Paul Hsieh (http://www.azillionmonkeys.com/qed/hash.html)
-	 * used by WebCore (http://webkit.org/blog/8/hashtables-part-2/)
-	 * EFL's eina and possible others.
-	 */
-	unsigned int tmp, hash = len, rem = len & 3;
+	uint64_t h = len * 0x9e3779b97f4a7c15ULL;
+	uint64_t w;
+
+	for (; len > sizeof(uint64_t); len -= sizeof(uint64_t)) {
+		w = get_unaligned((const uint64_t *) key);
+		h = (h ^ w) * 0xbf58476d1ce4e5b9ULL;
+		h ^= h >> 31;
+		key += sizeof(uint64_t);
+	}
+
+	if (len == sizeof(uint64_t))
+		w = get_unaligned((const uint64_t *) key);
+	else if (len >= 4)
+		w = get_unaligned((const uint32_t *) key) |
+			(uint64_t) get_unaligned((const uint32_t *)
+						 (key + len - 4)) << 32;
+	else if (len > 0)
+		w = (uint8_t) key[0] | (uint8_t) key[len / 2] << 8 |
+			(uint8_t) key[len - 1] << 16;
+	else
+		w = 0;
+
+	h = (h ^ w) * 0x94d049bb133111ebULL;
+	h ^= h >> 32;
+
+	return (unsigned int) h;
+}
 
-	len /= 4;
+static int hash_resize(struct hash *hash, unsigned int n_buckets)
+{
+	unsigned int mask = n_buckets - 1;
+	struct hash_entry *entries, *entry, *entry_end;
 
-	/* Main loop */
-	for (; len > 0; len--) {
-		hash += get_unaligned((uint16_t *) key);
-		tmp = (get_unaligned((uint16_t *)(key + 2)) << 11) ^ hash;
-		hash = (hash << 16) ^ tmp;
-		key += 4;
-		hash += hash >> 11;
-	}
+	entries = calloc(n_buckets, sizeof(struct hash_entry));
+	if (entries == NULL)
+		return -errno;
 
-	/* Handle end cases */
-	switch (rem) {
-	case 3:
-		hash += get_unaligned((uint16_t *) key);
-		hash ^= hash << 16;
-		hash ^= key[2] << 18;
-		hash += hash >> 11;
-		break;
-
-	case 2:
-		hash += get_unaligned((uint16_t *) key);
-		hash ^= hash << 11;
-		hash += hash >> 17;
-		break;
-
-	case 1:
-		hash += *key;
-		hash ^= hash << 10;
-		hash += hash >> 1;
+	entry = hash->entries;
+	entry_end = entry + hash->n_buckets;
+	for (; entry < entry_end; entry++) {
+		unsigned int pos;
+
+		if (entry->key == NULL)
+			continue;
+
+		pos = entry->hashval & mask;
+		while (entries[pos].key != NULL)
+			pos = (pos + 1) & mask;
+		entries[pos] = *entry;
 	}
 
-	/* Force "avalanching" of final 127 bits */
-	hash ^= hash << 3;
-	hash += hash >> 5;
-	hash ^= hash << 4;
-	hash += hash >> 17;
-	hash ^= hash << 25;
-	hash += hash >> 6;
+	free(hash->entries);
+	hash->entries = entries;
+	hash->n_buckets = n_buckets;
+	return 0;
+}
 
-	return hash;
+static int hash_grow(struct hash *hash)
+{
+	return hash_resize(hash, hash->n_buckets * 2);
 }
 
 /*
- * add or replace key in hash map.
- *
- * none of key or value are copied, just references are remembered as is,
- * make sure they are live while pair exists in hash!
+ * Make room for @count entries in total, so that adding them doesn't grow
+ * the table several times along the way.
  */
-int hash_add(struct hash *hash, const char *key, const void *value)
+int hash_reserve(struct hash *hash, unsigned int count)
 {
-	unsigned int keylen = strlen(key);
-	unsigned int hashval = hash_superfast(key, keylen);
-	unsigned int pos = hashval & (hash->n_buckets - 1);
-	struct hash_bucket *bucket = hash->buckets + pos;
-	struct hash_entry *entry, *entry_end;
+	unsigned int n_buckets = hash->n_buckets;
 
-	if (bucket->used + 1 >= bucket->total) {
-		unsigned new_total = bucket->total + hash->step;
-		size_t size = new_total * sizeof(struct hash_entry);
-		struct hash_entry *tmp = realloc(bucket->entries, size);
-		if (tmp == NULL)
-			return -errno;
-		bucket->entries = tmp;
-		bucket->total = new_total;
-	}
+	while (count * 4ULL > n_buckets * 3ULL)
+		n_buckets *= 2;
 
-	entry = bucket->entries;
-	entry_end = entry + bucket->used;
-	for (; entry < entry_end; entry++) {
-		int c = strcmp(key, entry->key);
-		if (c == 0) {
-			if (hash->free_value)
-				hash->free_value((void *)entry->value);
-			entry->key = key;
-			entry->value = value;
-			return 0;
-		} else if (c < 0) {
-			memmove(entry + 1, entry,
-				(entry_end - entry) * sizeof(struct hash_entry));
-			break;
-		}
-	}
+	if (n_buckets == hash->n_buckets)
+		return 0;
 
-	entry->key = key;
-	entry->value = value;
-	bucket->used++;
-	hash->count++;
-	return 0;
+	return hash_resize(hash, n_buckets);
 }
 
-/* similar to hash_add(), but fails if key already exists */
-int hash_add_unique(struct hash *hash, const char *key, const void *value)
+/*
+ * Return the entry for @key, or the empty slot where it should be added.
+ */
+static struct hash_entry *hash_lookup(const struct hash *hash,
+					const char *key, unsigned int hashval)
 {
-	unsigned int keylen = strlen(key);
-	unsigned int hashval = hash_superfast(key, keylen);
-	unsigned int pos = hashval & (hash->n_buckets - 1);
-	struct hash_bucket *bucket = hash->buckets + pos;
-	struct hash_entry *entry, *entry_end;
+	unsigned int mask = hash->n_buckets - 1;
+	unsigned int pos = hashval & mask;
 
-	if (bucket->used + 1 >= bucket->total) {
-		unsigned new_total = bucket->total + hash->step;
-		size_t size = new_total * sizeof(struct hash_entry);
-		struct hash_entry *tmp = realloc(bucket->entries, size);
-		if (tmp == NULL)
-			return -errno;
-		bucket->entries = tmp;
-		bucket->total = new_total;
+	for (;; pos = (pos + 1) & mask) {
+		struct hash_entry *entry = hash->entries + pos;
+
+		if (entry->key == NULL)
+			return entry;
+		if (entry->hashval == hashval && streq(entry->key, key))
+			return entry;
 	}
+}
 
-	entry = bucket->entries;
-	entry_end = entry + bucket->used;
-	for (; entry < entry_end; entry++) {
-		int c = strcmp(key, entry->key);
-		if (c == 0)
+static int hash_insert(struct hash *hash, const char *key, size_t keylen,
+					const void *value, bool replace)
+{
+	unsigned int hashval = hash_str(key, keylen);
+	struct hash_entry *entry = hash_lookup(hash, key, hashval);
+
+	if (entry->key != NULL) {
+		if (!replace)
 			return -EEXIST;
-		else if (c < 0) {
-			memmove(entry + 1, entry,
-				(entry_end - entry) * sizeof(struct hash_entry));
-			break;
-		}
+		if (hash->free_value)
+			hash->free_value((void *)entry->value);
+		entry->key = key;
+		entry->value = value;
+		return 0;
+	}
+
+	/* keep at least one empty slot in every cluster */
+	if ((hash->count + 1) * 4 > hash->n_buckets * 3) {
+		int err = hash_grow(hash);
+		if (err < 0)
+			return err;
+		entry = hash_lookup(hash, key, hashval);
 	}
 
 	entry->key = key;
 	entry->value = value;
-	bucket->used++;
+	entry->hashval = hashval;
 	hash->count++;
 	return 0;
 }
 
-static int hash_entry_cmp(const void *pa, const void *pb)
+/*
+ * add or replace key in hash map.
+ *
+ * none of key or value are copied, just references are remembered as is,
+ * make sure they are live while pair exists in hash!
+ */
+int hash_add(struct hash *hash, const char *key, const void *value)
 {
-	const struct hash_entry *a = pa;
-	const struct hash_entry *b = pb;
-	return strcmp(a->key, b->key);
+	return hash_insert(hash, key, strlen(key), value, true);
+}
+
+/* similar to hash_add(), for callers that already know strlen(@key) */
+int hash_add_len(struct hash *hash, const char *key, size_t keylen,
+							const void *value)
+{
+	return hash_insert(hash, key, keylen, value, true);
+}
+
+/* similar to hash_add(), but fails if key already exists */
+int hash_add_unique(struct hash *hash, const char *key, const void *value)
+{
+	return hash_insert(hash, key, strlen(key), value, false);
 }
 
 void *hash_find(const struct hash *hash, const char *key)
 {
-	unsigned int keylen = strlen(key);
-	unsigned int hashval = hash_superfast(key, keylen);
-	unsigned int pos = hashval & (hash->n_buckets - 1);
-	const struct hash_bucket *bucket = hash->buckets + pos;
-	const struct hash_entry se = {
-		.key = key,
-		.value = NULL
-	};
-	const struct hash_entry *entry;
-
-	if (!bucket->entries)
-		return NULL;
+	return hash_find_len(hash, key, strlen(key));
+}
 
-	entry = bsearch(&se, bucket->entries, bucket->used,
-			sizeof(struct hash_entry), hash_entry_cmp);
+/* similar to hash_find(), for callers that already know strlen(@key) */
+void *hash_find_len(const struct hash *hash, const char *key, size_t keylen)
+{
+	unsigned int hashval = hash_str(key, keylen);
+	const struct hash_entry *entry = hash_lookup(hash, key, hashval);
 
-	return entry ? (void *)entry->value : NULL;
+	return entry->key != NULL ? (void *)entry->value : NULL;
 }
 
 int hash_del(struct hash *hash, const char *key)
 {
-	unsigned int keylen = strlen(key);
-	unsigned int hashval = hash_superfast(key, keylen);
-	unsigned int pos = hashval & (hash->n_buckets - 1);
-	unsigned int steps_used, steps_total;
-	struct hash_bucket *bucket = hash->buckets + pos;
-	struct hash_entry *entry, *entry_end;
-	const struct hash_entry se = {
-		.key = key,
-		.value = NULL
-	};
-
-	entry = bsearch(&se, bucket->entries, bucket->used,
-		sizeof(struct hash_entry), hash_entry_cmp);
-	if (entry == NULL)
+	unsigned int hashval = hash_str(key, strlen(key));
+	unsigned int mask = hash->n_buckets - 1;
+	struct hash_entry *entry = hash_lookup(hash, key, hashval);
+	unsigned int hole, pos;
+
+	if (entry->key == NULL)
 		return -ENOENT;
 
 	if (hash->free_value)
 		hash->free_value((void *)entry->value);
 
-	entry_end = bucket->entries + bucket->used;
-	memmove(entry, entry + 1,
-		(entry_end - entry) * sizeof(struct hash_entry));
-
-	bucket->used--;
-	hash->count--;
-
-	steps_used = bucket->used / hash->step;
-	steps_total = bucket->total / hash->step;
-	if (steps_used + 1 < steps_total) {
-		size_t size = (steps_used + 1) *
-			hash->step * sizeof(struct hash_entry);
-		struct hash_entry *tmp = realloc(bucket->entries, size);
-		if (tmp) {
-			bucket->entries = tmp;
-			bucket->total = (steps_used + 1) * hash->step;
+	/*
+	 * Move back the entries after the hole that can't be found anymore
+	 * otherwise, i.e. whose home slot is not between the hole and them.
+	 */
+	hole = entry - hash->entries;
+	for (pos = (hole + 1) & mask; hash->entries[pos].key != NULL;
+						pos = (pos + 1) & mask) {
+		unsigned int home = hash->entries[pos].hashval & mask;
+
+		if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+			hash->entries[hole] = hash->entries[pos];
+			hole = pos;
 		}
 	}
 
+	hash->entries[hole].key = NULL;
+	hash->entries[hole].value = NULL;
+	hash->count--;
+
 	return 0;
 }
 
@@ -303,34 +311,23 @@ unsigned int hash_get_count(const struct hash *hash)
 void hash_iter_init(const struct hash *hash, struct hash_iter *iter)
 {
 	iter->hash = hash;
-	iter->bucket = 0;
-	iter->entry = -1;
+	iter->bucket = -1;
 }
 
 bool hash_iter_next(struct hash_iter *iter, const char **key,
 							const void **value)
 {
-	const struct hash_bucket *b = iter->hash->buckets + iter->bucket;
+	const struct hash *hash = iter->hash;
 	const struct hash_entry *e;
 
-	iter->entry++;
-
-	if (iter->entry >= b->used) {
-		iter->entry = 0;
-
-		for (iter->bucket++; iter->bucket < iter->hash->n_buckets;
-							iter->bucket++) {
-			b = iter->hash->buckets + iter->bucket;
-
-			if (b->used > 0)
-				break;
-		}
-
-		if (iter->bucket >= iter->hash->n_buckets)
-			return false;
+	for (iter->bucket++; iter->bucket < hash->n_buckets; iter->bucket++) {
+		e = hash->entries + iter->bucket;
+		if (e->key != NULL)
+			break;
 	}
 
-	e = b->entries + iter->entry;
+	if (iter->bucket >= hash->n_buckets)
+		return false;
 
 	if (value != NULL)
 		*value = e->value;
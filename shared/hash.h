@@ -1,22 +1,28 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct hash;
 
 struct hash_iter {
 	const struct hash *hash;
 	unsigned int bucket;
-	unsigned int entry;
 };
 
+/* @n_buckets is just the initial size, the table grows as needed */
 struct hash *hash_new(unsigned int n_buckets, void (*free_value)(void *value));
 void hash_free(struct hash *hash);
+int hash_reserve(struct hash *hash, unsigned int count);
 int hash_add(struct hash *hash, const char *key, const void *value);
+int hash_add_len(struct hash *hash, const char *key, size_t keylen,
+							const void *value);
 int hash_add_unique(struct hash *hash, const char *key, const void *value);
 int hash_del(struct hash *hash, const char *key);
 void *hash_find(const struct hash *hash, const char *key);
+void *hash_find_len(const struct hash *hash, const char *key, size_t keylen);
 unsigned int hash_get_count(const struct hash *hash);
+unsigned int hash_str(const char *key, size_t len);
 void hash_iter_init(const struct hash *hash, struct hash_iter *iter);
 bool hash_iter_next(struct hash_iter *iter, const char **key,
 							const void **value);
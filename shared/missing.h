@@ -1,6 +1,7 @@
 #pragma once
 
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
 
 #ifdef HAVE_LINUX_MODULE_H
@@ -37,6 +38,36 @@ static inline int finit_module(int fd, const char *uargs, int flags)
 }
 #endif
 
+#ifndef MFD_CLOEXEC
+# define MFD_CLOEXEC 0x0001U
+#endif
+
+#ifndef MFD_ALLOW_SEALING
+# define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+# define F_ADD_SEALS (1024 + 9)
+# define F_SEAL_SEAL 0x0001
+# define F_SEAL_SHRINK 0x0002
+# define F_SEAL_GROW 0x0004
+# define F_SEAL_WRITE 0x0008
+#endif
+
+#ifndef HAVE_MEMFD_CREATE
+#include <errno.h>
+
+static inline int memfd_create(const char *name, unsigned int flags)
+{
+#ifdef __NR_memfd_create
+	return syscall(__NR_memfd_create, name, flags);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+#endif
+
 #if !HAVE_DECL_STRNDUPA
 #define strndupa(s, n)							\
 	({								\
@@ -41,11 +41,18 @@ static bool buf_grow(struct strbuf *buf, size_t newsize)
 	else
 		sz = ((newsize / BUF_STEP) + 1) * BUF_STEP;
 
-	tmp = realloc(buf->bytes, sz);
+	if (buf->heap) {
+		tmp = realloc(buf->bytes, sz);
+	} else {
+		tmp = malloc(sz);
+		if (tmp != NULL)
+			memcpy(tmp, buf->bytes, buf->used);
+	}
 	if (sz > 0 && tmp == NULL)
 		return false;
 	buf->bytes = tmp;
 	buf->size = sz;
+	buf->heap = true;
 	return true;
 }
 
@@ -54,22 +61,38 @@ void strbuf_init(struct strbuf *buf)
 	buf->bytes = NULL;
 	buf->size = 0;
 	buf->used = 0;
+	buf->heap = true;
+}
+
+void strbuf_init_with_stack(struct strbuf *buf, char *stack, unsigned size)
+{
+	buf->bytes = stack;
+	buf->size = size;
+	buf->used = 0;
+	buf->heap = false;
 }
 
 void strbuf_release(struct strbuf *buf)
 {
-	free(buf->bytes);
+	if (buf->heap)
+		free(buf->bytes);
 }
 
 char *strbuf_steal(struct strbuf *buf)
 {
 	char *bytes;
 
-	bytes = realloc(buf->bytes, buf->used + 1);
-	if (!bytes) {
-		free(buf->bytes);
-		return NULL;
+	if (!buf->heap) {
+		bytes = malloc(buf->used + 1);
+		if (bytes != NULL)
+			memcpy(bytes, buf->bytes, buf->used);
+	} else {
+		bytes = realloc(buf->bytes, buf->used + 1);
+		if (!bytes)
+			free(buf->bytes);
 	}
+	if (!bytes)
+		return NULL;
 	bytes[buf->used] = '\0';
 	return bytes;
 }
@@ -9,9 +9,17 @@ struct strbuf {
 	char *bytes;
 	unsigned size;
 	unsigned used;
+	/* false while @bytes is the caller's buffer */
+	bool heap;
 };
 
 void strbuf_init(struct strbuf *buf);
+/*
+ * Use the @size bytes at @stack before allocating: a buffer on the stack of
+ * the caller gives short strings no allocation at all. @stack must outlive
+ * the strbuf.
+ */
+void strbuf_init_with_stack(struct strbuf *buf, char *stack, unsigned size);
 void strbuf_release(struct strbuf *buf);
 void strbuf_clear(struct strbuf *buf);
 
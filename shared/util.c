@@ -21,13 +21,17 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <endian.h>
 #include <errno.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <shared/missing.h>
 #include <shared/util.h>
@@ -65,6 +69,23 @@ void *memdup(const void *p, size_t n)
 	return memcpy(r, p, n);
 }
 
+uint64_t key_filter_hash(const char *key, size_t len)
+{
+	uint64_t h = len * 0x9e3779b97f4a7c15ULL, w;
+
+	for (; len >= sizeof(w); key += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, key, sizeof(w));
+		h = (h ^ le64toh(w)) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+
+	w = 0;
+	memcpy(&w, key, len);
+	h = (h ^ le64toh(w)) * 0xff51afd7ed558ccdULL;
+
+	return key_filter_mix(h);
+}
+
 char *strchr_replace(char *s, char c, char r)
 {
 	char *p;
@@ -81,32 +102,50 @@ char *strchr_replace(char *s, char c, char r)
 /* ************************************************************************ */
 int alias_normalize(const char *alias, char buf[static PATH_MAX], size_t *len)
 {
-	size_t i;
+	size_t i = 0;
+
+	/*
+	 * Copy the runs without '-', '[' or ']' at once: strcspn() and
+	 * memcpy() are vectorized by the libc, and most aliases are a single
+	 * such run.
+	 */
+	for (;;) {
+		size_t n = strcspn(alias + i, "-[]");
+
+		if (n >= PATH_MAX - 1 - i) {
+			n = PATH_MAX - 1 - i;
+			memcpy(buf + i, alias + i, n);
+			i += n;
+			break;
+		}
 
-	for (i = 0; i < PATH_MAX - 1; i++) {
-		const char c = alias[i];
-		switch (c) {
+		memcpy(buf + i, alias + i, n);
+		i += n;
+
+		switch (alias[i]) {
 		case '-':
-			buf[i] = '_';
+			buf[i++] = '_';
 			break;
 		case ']':
 			return -EINVAL;
 		case '[':
-			while (alias[i] != ']' && alias[i] != '\0') {
-				buf[i] = alias[i];
-				i++;
-			}
-
-			if (alias[i] != ']')
+			/* dashes in a range are kept, up to the closing ']' */
+			n = strcspn(alias + i, "]");
+			if (alias[i + n] != ']')
 				return -EINVAL;
 
-			buf[i] = alias[i];
+			n++;
+			if (n > PATH_MAX - 1 - i)
+				n = PATH_MAX - 1 - i;
+			memcpy(buf + i, alias + i, n);
+			i += n;
 			break;
 		case '\0':
 			goto finish;
-		default:
-			buf[i] = c;
 		}
+
+		if (i >= PATH_MAX - 1)
+			break;
 	}
 
 finish:
@@ -130,10 +169,10 @@ int underscores(char *s)
 	if (!s)
 		return -EINVAL;
 
-	for (i = 0; s[i]; i++) {
+	for (i = strcspn(s, "-[]"); s[i]; i += strcspn(&s[i], "-[]")) {
 		switch (s[i]) {
 		case '-':
-			s[i] = '_';
+			s[i++] = '_';
 			break;
 		case ']':
 			return -EINVAL;
@@ -141,6 +180,7 @@ int underscores(char *s)
 			i += strcspn(&s[i], "]");
 			if (!s[i])
 				return -EINVAL;
+			i++;
 			break;
 		}
 	}
@@ -288,67 +328,145 @@ int read_str_ulong(int fd, unsigned long *value, int base)
 }
 
 /*
- * Read one logical line from a configuration file.
+ * Read the logical lines of a configuration file.
  *
- * Line endings may be escaped with backslashes, to form one logical line from
- * several physical lines.  No end of line character(s) are included in the
- * result.
+ * The file is read whole into one buffer and the lines are joined and
+ * terminated in place: each byte is looked at once and a line costs no
+ * allocation. The lines returned by line_reader_next() may be modified,
+ * e.g. by strtok_r(), and stay valid until line_reader_close().
+ *
+ * It's not mapped: libkmod runs inside long-lived daemons, which would get
+ * SIGBUS if a file was truncated while being read.
+ */
+int line_reader_open(struct line_reader *r, int fd)
+{
+	struct stat st;
+	size_t size = 0, hint = 4096;
+	char *buf = NULL;
+
+	memset(r, 0, sizeof(*r));
+
+	if (fstat(fd, &st) < 0)
+		return -errno;
+
+	/* one more byte to see the end of the file in a single pass */
+	if (S_ISREG(st.st_mode) && st.st_size > 0)
+		hint = st.st_size + 1;
+
+	/* pipes and files of procfs have no size to go by */
+	for (;;) {
+		size_t n = size == 0 ? hint : size * 2;
+		ssize_t len;
+		char *tmp;
+
+		tmp = realloc(buf, n);
+		if (tmp == NULL) {
+			free(buf);
+			return -ENOMEM;
+		}
+		buf = tmp;
+
+		while (size < n) {
+			len = read(fd, buf + size, n - size);
+			if (len < 0) {
+				if (errno == EINTR)
+					continue;
+				len = -errno;
+				free(buf);
+				return len;
+			}
+			if (len == 0)
+				break;
+			size += len;
+		}
+
+		if (size < n)
+			break;
+	}
+
+	r->data = buf;
+	r->size = size;
+
+	return 0;
+}
+
+/*
+ * Return the next logical line, or NULL at the end of the file. Line endings
+ * escaped with a backslash form one logical line from several physical
+ * lines, and a backslash before any other character is dropped. No end of
+ * line character is included in the result.
  *
  * If linenum is not NULL, it is incremented by the number of physical lines
  * which have been read.
  */
-char *freadline_wrapped(FILE *fp, unsigned int *linenum)
+char *line_reader_next(struct line_reader *r, unsigned int *linenum)
 {
-	int size = 256;
-	int i = 0, n = 0;
-	_cleanup_free_ char *buf = malloc(size);
+	char *start, *out, *p, *eol, *bs, *end;
+	unsigned int n = 1;
+	size_t len;
 
-	if (buf == NULL)
+	if (r->pos >= r->size)
 		return NULL;
 
-	for(;;) {
-		int ch = getc_unlocked(fp);
+	start = out = p = r->data + r->pos;
+	end = r->data + r->size;
 
-		switch(ch) {
-		case EOF:
-			if (i == 0)
-				return NULL;
-			/* else fall through */
+	eol = memchr(p, '\n', end - p);
+	if (eol == NULL)
+		eol = end;
 
-		case '\n':
-			n++;
+	for (;;) {
+		bs = memchr(p, '\\', eol - p);
+		len = (bs == NULL ? eol : bs) - p;
 
-			{
-				char *ret = buf;
-				ret[i] = '\0';
-				buf = NULL;
-				if (linenum)
-					*linenum += n;
-				return ret;
-			}
+		/* text is only moved after a backslash */
+		if (out != p)
+			memmove(out, p, len);
+		out += len;
 
-		case '\\':
-			ch = getc_unlocked(fp);
+		if (bs == NULL) {
+			p = eol;
+			break;
+		}
 
-			if (ch == '\n') {
-				n++;
-				continue;
-			}
-			/* else fall through */
-
-		default:
-			buf[i++] = ch;
-
-			if (i == size) {
-				char *tmp;
-				size *= 2;
-				tmp = realloc(buf, size);
-				if (!tmp)
-					return NULL;
-				buf = tmp;
-			}
+		p = bs + 1;
+		if (p == end)
+			break;
+
+		if (*p == '\n') {
+			n++;
+			p++;
+			eol = memchr(p, '\n', end - p);
+			if (eol == NULL)
+				eol = end;
+			continue;
 		}
+
+		*out++ = *p++;
+	}
+
+	if (p == end) {
+		r->pos = r->size;
+
+		/* like an empty file, a continuation with nothing after it */
+		if (out == start)
+			return NULL;
+	} else {
+		r->pos = p + 1 - r->data;
 	}
+
+	/* even a last line without a newline, the buffer has a byte to spare */
+	*out = '\0';
+	if (linenum)
+		*linenum += n;
+
+	return start;
+}
+
+void line_reader_close(struct line_reader *r)
+{
+	free(r->data);
+	memset(r, 0, sizeof(*r));
 }
 
 /* path handling functions                                                  */
@@ -546,3 +664,142 @@ unsigned long long stat_mstamp(const struct stat *st)
 	return (unsigned long long) st->st_mtime;
 #endif
 }
+
+/*
+ * Whether an index that depmod derives from @base_path, last modified at
+ * @stamp, can be trusted: one that is older than the file it's derived from
+ * was left behind by a depmod that doesn't write it.
+ */
+bool index_is_current(const char *base_path, unsigned long long stamp)
+{
+	struct stat st;
+
+	return stat(base_path, &st) < 0 || stat_mstamp(&st) <= stamp;
+}
+
+/* process handling functions                                               */
+/* ************************************************************************ */
+
+/*
+ * Characters that make a command need a shell: anything other than plain
+ * words separated by blanks. A '=' in the first word is an assignment.
+ */
+#define SHELL_META "|&;<>()$`\\\"'*?[]#~{}!\n"
+
+static char **command_split(char *cmd)
+{
+	size_t n = 0, max;
+	char **argv, *p;
+
+	if (cmd[strcspn(cmd, SHELL_META)] != '\0')
+		return NULL;
+
+	p = cmd + strspn(cmd, " \t");
+	if (*p == '\0' || memchr(p, '=', strcspn(p, " \t")) != NULL)
+		return NULL;
+
+	/* there can't be more words than half the string, plus one */
+	max = strlen(p) / 2 + 2;
+	argv = malloc(sizeof(char *) * max);
+	if (argv == NULL)
+		return NULL;
+
+	for (;;) {
+		p += strspn(p, " \t");
+		if (*p == '\0')
+			break;
+
+		argv[n++] = p;
+		p += strcspn(p, " \t");
+		if (*p == '\0')
+			break;
+		*p++ = '\0';
+	}
+	argv[n] = NULL;
+
+	return argv;
+}
+
+/*
+ * The environment of the caller plus MODPROBE_MODULE, built without
+ * touching our own environment: setenv() isn't safe to call from a library.
+ */
+static char **command_env(const char *modname, char **var)
+{
+	size_t n = 0, i, j;
+	char **envp;
+
+	if (asprintf(var, "MODPROBE_MODULE=%s", modname) < 0)
+		return NULL;
+
+	if (environ != NULL)
+		for (; environ[n] != NULL; n++)
+			;
+
+	envp = malloc(sizeof(char *) * (n + 2));
+	if (envp == NULL) {
+		free(*var);
+		return NULL;
+	}
+
+	for (i = 0, j = 0; i < n; i++) {
+		if (!strstartswith(environ[i], "MODPROBE_MODULE="))
+			envp[j++] = environ[i];
+	}
+	envp[j++] = *var;
+	envp[j] = NULL;
+
+	return envp;
+}
+
+/*
+ * Run @cmd the way system(3) does, with MODPROBE_MODULE=@modname in its
+ * environment. posix_spawn() is used instead of fork(), so calling it from
+ * a process with a big address space doesn't copy its page tables, and the
+ * shell is only started when @cmd uses shell syntax or isn't found in PATH
+ * (a builtin like "exit" or ":").
+ *
+ * Returns the wait status of the command or a negative errno.
+ */
+int run_command(const char *cmd, const char *modname)
+{
+	char *shargv[] = { (char *) "sh", (char *) "-c", (char *) cmd, NULL };
+	char **argv, **envp, *var, *buf;
+	int err, status;
+	pid_t pid;
+
+	buf = strdup(cmd);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	envp = command_env(modname, &var);
+	if (envp == NULL) {
+		free(buf);
+		return -ENOMEM;
+	}
+
+	/*
+	 * If the command can't be spawned directly, leave it to the shell: it
+	 * may be a builtin, and otherwise the shell reports the error with
+	 * the same exit status system() would.
+	 */
+	argv = command_split(buf);
+	err = argv != NULL ? posix_spawnp(&pid, argv[0], NULL, NULL, argv, envp) : -1;
+	if (err != 0)
+		err = posix_spawn(&pid, "/bin/sh", NULL, NULL, shargv, envp);
+
+	free(argv);
+	free(envp);
+	free(var);
+	free(buf);
+
+	if (err != 0)
+		return -err;
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			return -errno;
+	}
+
+	return status;
+}
@@ -18,6 +18,48 @@
 char *strchr_replace(char *s, char c, char r);
 void *memdup(const void *p, size_t n) __attribute__((nonnull(1)));
 
+/*
+ * 32-bit FNV-1a, fed one character at a time so the hash of every prefix of
+ * a string comes for free. Binary indexes store it: don't change it.
+ */
+#define FNV1A_32_INIT 0x811c9dc5U
+
+static inline uint32_t fnv1a_32_step(uint32_t h, unsigned char c)
+{
+	return (h ^ c) * 0x01000193U;
+}
+
+/*
+ * Blocked Bloom filter of the keys of a binary index: a key sets
+ * KEY_FILTER_PROBES bits of a single block of KEY_FILTER_BLOCK_BITS, so
+ * checking it touches one cache line. The block and the bits come from
+ * key_filter_hash(), which reads the key 8 bytes at a time. Binary indexes
+ * store it: don't change it.
+ */
+#define KEY_FILTER_BLOCK_BITS 512
+#define KEY_FILTER_PROBES 6
+
+static inline uint64_t key_filter_mix(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+uint64_t key_filter_hash(const char *key, size_t len) __attribute__((nonnull(1)));
+
+/* @block_count is a power of 2 */
+static inline uint32_t key_filter_block(uint64_t hash, uint32_t block_count)
+{
+	return (hash >> 32) & (block_count - 1);
+}
+
+/* bit @i of the block is (key_filter_bits(hash) >> (9 * i)) % 512 */
+static inline uint64_t key_filter_bits(uint64_t hash)
+{
+	return key_filter_mix(hash);
+}
+
 /* module-related functions                                                 */
 /* ************************************************************************ */
 #define KMOD_EXTENSION_UNCOMPRESSED ".ko"
@@ -34,7 +76,16 @@ ssize_t read_str_safe(int fd, char *buf, size_t buflen) _must_check_ __attribute
 ssize_t write_str_safe(int fd, const char *buf, size_t buflen) __attribute__((nonnull(2)));
 int read_str_long(int fd, long *value, int base) _must_check_ __attribute__((nonnull(2)));
 int read_str_ulong(int fd, unsigned long *value, int base) _must_check_ __attribute__((nonnull(2)));
-char *freadline_wrapped(FILE *fp, unsigned int *linenum) __attribute__((nonnull(1)));
+
+struct line_reader {
+	char *data;
+	size_t size;
+	size_t pos;
+};
+
+int line_reader_open(struct line_reader *r, int fd) _must_check_ __attribute__((nonnull(1)));
+char *line_reader_next(struct line_reader *r, unsigned int *linenum) __attribute__((nonnull(1)));
+void line_reader_close(struct line_reader *r) __attribute__((nonnull(1)));
 
 /* path handling functions                                                  */
 /* ************************************************************************ */
@@ -42,6 +93,7 @@ char *path_make_absolute_cwd(const char *p) _must_check_ __attribute__((nonnull(
 int mkdir_p(const char *path, int len, mode_t mode);
 int mkdir_parents(const char *path, mode_t mode);
 unsigned long long stat_mstamp(const struct stat *st);
+bool index_is_current(const char *base_path, unsigned long long stamp) __attribute__((nonnull(1)));
 
 /* time-related functions
  * ************************************************************************ */
@@ -57,6 +109,9 @@ unsigned long long get_backoff_delta_msec(unsigned long long t0,
 					  unsigned long long tend,
 					  unsigned long long *delta);
 
+/* process handling functions                                               */
+/* ************************************************************************ */
+int run_command(const char *cmd, const char *modname) __attribute__((nonnull(1, 2)));
 
 /* endianess and alignments                                                 */
 /* ************************************************************************ */
@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2026  kmod contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmark for shared/hash.c on a set of names shaped like the
+ * exported symbols of a distro kernel, which is what depmod hashes the
+ * most. Not run by "make check": run it by hand and compare the numbers.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <shared/hash.h>
+#include <shared/macro.h>
+#include <shared/util.h>
+
+#define ROUNDS 20
+
+static const char *const prefixes[] = {
+	"", "__", "snd_", "snd_pcm_", "drm_", "drm_atomic_helper_", "usb_",
+	"pci_", "of_", "dev_", "devm_", "i2c_", "net", "netdev_", "nf_",
+	"sk_", "tcp_", "xfrm_", "acpi_", "kvm_", "iommu_", "dma_", "blk_",
+	"scsi_", "ata_", "mlx5_", "ieee80211_", "cfg80211_", "v4l2_",
+};
+
+static const char *const verbs[] = {
+	"get", "put", "alloc", "free", "register", "unregister", "init",
+	"cleanup", "add", "del", "find", "lookup", "set", "clear", "enable",
+	"disable", "read", "write", "start", "stop",
+};
+
+static const char *const objects[] = {
+	"", "_device", "_driver", "_buffer", "_queue", "_resource", "_irq",
+	"_table", "_entry", "_state_locked", "_by_name", "_ops", "_work",
+	"_region", "_stream", "_mapping", "_fw", "_property", "_node", "_sync",
+};
+
+static char **make_symbols(unsigned int *count)
+{
+	unsigned int i, j, k, n = 0;
+	char **syms;
+
+	syms = malloc(sizeof(char *) * ARRAY_SIZE(prefixes) *
+				ARRAY_SIZE(verbs) * ARRAY_SIZE(objects));
+	if (syms == NULL)
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < ARRAY_SIZE(prefixes); i++)
+		for (j = 0; j < ARRAY_SIZE(verbs); j++)
+			for (k = 0; k < ARRAY_SIZE(objects); k++) {
+				if (asprintf(&syms[n], "%s%s%s", prefixes[i],
+						verbs[j], objects[k]) < 0)
+					exit(EXIT_FAILURE);
+				n++;
+			}
+
+	*count = n;
+	return syms;
+}
+
+/* Paul Hsieh's hash, used by shared/hash.c before hash_str() */
+static unsigned int hash_superfast(const char *key, unsigned int len)
+{
+	unsigned int tmp, hash = len, rem = len & 3;
+
+	len /= 4;
+
+	for (; len > 0; len--) {
+		hash += get_unaligned((uint16_t *) key);
+		tmp = (get_unaligned((uint16_t *)(key + 2)) << 11) ^ hash;
+		hash = (hash << 16) ^ tmp;
+		key += 4;
+		hash += hash >> 11;
+	}
+
+	switch (rem) {
+	case 3:
+		hash += get_unaligned((uint16_t *) key);
+		hash ^= hash << 16;
+		hash ^= key[2] << 18;
+		hash += hash >> 11;
+		break;
+
+	case 2:
+		hash += get_unaligned((uint16_t *) key);
+		hash ^= hash << 11;
+		hash += hash >> 17;
+		break;
+
+	case 1:
+		hash += *key;
+		hash ^= hash << 10;
+		hash += hash >> 1;
+	}
+
+	hash ^= hash << 3;
+	hash += hash >> 5;
+	hash ^= hash << 4;
+	hash += hash >> 17;
+	hash ^= hash << 25;
+	hash += hash >> 6;
+
+	return hash;
+}
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *what, uint64_t nsec, unsigned int ops)
+{
+	printf("%-32s %8.2f ns/op\n", what, (double) nsec / ops);
+}
+
+int main(int argc, char *argv[])
+{
+	volatile unsigned int sink = 0;
+	unsigned int count, i, r;
+	size_t *lens;
+	struct hash *h;
+	char **syms;
+	uint64_t t;
+
+	syms = make_symbols(&count);
+	lens = malloc(sizeof(size_t) * count);
+	if (lens == NULL)
+		exit(EXIT_FAILURE);
+	for (i = 0; i < count; i++)
+		lens[i] = strlen(syms[i]);
+
+	printf("%u symbols, %d rounds\n", count, ROUNDS);
+
+	t = now_nsec();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < count; i++)
+			sink += hash_superfast(syms[i], strlen(syms[i]));
+	report("superfast + strlen", now_nsec() - t, ROUNDS * count);
+
+	t = now_nsec();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < count; i++)
+			sink += hash_str(syms[i], strlen(syms[i]));
+	report("hash_str + strlen", now_nsec() - t, ROUNDS * count);
+
+	t = now_nsec();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < count; i++)
+			sink += hash_str(syms[i], lens[i]);
+	report("hash_str, known length", now_nsec() - t, ROUNDS * count);
+
+	t = now_nsec();
+	for (r = 0; r < ROUNDS; r++) {
+		h = hash_new(2048, NULL);
+		for (i = 0; i < count; i++)
+			hash_add_len(h, syms[i], lens[i], syms[i]);
+		hash_free(h);
+	}
+	report("hash_add_len", now_nsec() - t, ROUNDS * count);
+
+	h = hash_new(2048, NULL);
+	for (i = 0; i < count; i++)
+		hash_add_len(h, syms[i], lens[i], syms[i]);
+
+	t = now_nsec();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < count; i++)
+			sink += hash_find(h, syms[i]) != NULL;
+	report("hash_find", now_nsec() - t, ROUNDS * count);
+
+	t = now_nsec();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < count; i++)
+			sink += hash_find_len(h, syms[i], lens[i]) != NULL;
+	report("hash_find_len", now_nsec() - t, ROUNDS * count);
+
+	hash_free(h);
+	for (i = 0; i < count; i++)
+		free(syms[i]);
+	free(syms);
+	free(lens);
+
+	return sink == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,415 @@
+/*
+ * Copyright (C) 2026  kmod contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmark for libkmod/libkmod-index.c: both implementations, the
+ * mmap and the stdio one, and the lookup of a modalias through a context.
+ * The indexes are written by the depmod built in the tree, from a
+ * modules.builtin.modinfo with some thousands of modules whose aliases are
+ * shaped like those of a distro kernel, in both index versions. Pass "-k"
+ * to keep the temporary directory. Not run by "make check": run it by hand
+ * and compare the numbers.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <shared/macro.h>
+#include <shared/util.h>
+
+#include <libkmod/libkmod-internal.h>
+#include <libkmod/libkmod-index.h>
+
+#define KVER "4.4.4"
+#define N_MODULES 4000
+#define N_QUERIES 4096
+#define ROUNDS 4
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+/*
+ * Count the allocations by wrapping glibc's allocator: the library is
+ * linked in, so its calls end up here too. Not with ASan, which has an
+ * allocator of its own.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long n_allocs;
+
+void *malloc(size_t size)
+{
+	n_allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	n_allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	n_allocs++;
+	return __libc_realloc(ptr, size);
+}
+#define HAVE_ALLOC_COUNT 1
+#else
+static unsigned long n_allocs;
+#define HAVE_ALLOC_COUNT 0
+#endif
+
+static const unsigned int vendors[] = {
+	0x8086, 0x10de, 0x1002, 0x14e4, 0x10ec, 0x15b3, 0x1077, 0x1000,
+	0x8087, 0x168c, 0x17cb, 0x1af4, 0x1b4b, 0x1022, 0x1912, 0x046d,
+};
+
+static uint32_t rnd_state = 2463534242U;
+
+/* xorshift, so the trees and queries are the same on every run */
+static uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *what, uint64_t nsec, unsigned long allocs,
+							unsigned int ops)
+{
+	if (HAVE_ALLOC_COUNT)
+		printf("%-44s %10.2f ns/lookup %6.2f allocs/lookup\n", what,
+			(double) nsec / ops, (double) allocs / ops);
+	else
+		printf("%-44s %10.2f ns/lookup\n", what, (double) nsec / ops);
+}
+
+/*
+ * Each module matches a few PCI or USB ids, PCI classes, ACPI or OF
+ * compatibles, with the wildcards file2alias gives them.
+ */
+static void write_modinfo(FILE *fp, FILE *builtin)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < N_MODULES; i++) {
+		unsigned int vendor = vendors[i % ARRAY_SIZE(vendors)];
+		unsigned int n = 1 + rnd() % 8;
+
+		fprintf(builtin, "kernel/drivers/bench/bench_%u.ko\n", i);
+		fprintf(fp, "bench_%u.license=GPL%c", i, '\0');
+
+		for (j = 0; j < n; j++) {
+			unsigned int dev = rnd() & 0xffff;
+
+			switch (i % 8) {
+			case 0 ... 3:
+				fprintf(fp, "bench_%u.alias=pci:v0000%04Xd0000%04Xsv*sd*bc*sc*i*%c",
+					i, vendor, dev, '\0');
+				break;
+			case 4:
+				fprintf(fp, "bench_%u.alias=usb:v%04Xp%04Xd*dc*dsc*dp*ic*isc*ip*in*%c",
+					i, vendor, dev, '\0');
+				break;
+			case 5:
+				/* few drivers bind by class only, and with one alias */
+				if (i % 32 == 5 && j == 0)
+					fprintf(fp, "bench_%u.alias=pci:v*d*sv*sd*bc%02Xsc%02Xi*%c",
+						i, dev % 16, (dev >> 8) % 16, '\0');
+				else
+					fprintf(fp, "bench_%u.alias=pci:v0000%04Xd0000%04Xsv*sd*bc*sc*i*%c",
+						i, vendor, dev, '\0');
+				break;
+			case 6:
+				fprintf(fp, "bench_%u.alias=acpi*:BNCH%04X:*%c",
+					i, dev, '\0');
+				break;
+			default:
+				fprintf(fp, "bench_%u.alias=of:N*T*Cbench,chip%u-%u%c",
+					i, i, j, '\0');
+				fprintf(fp, "bench_%u.alias=of:N*T*Cbench,chip%u-%uC*%c",
+					i, i, j, '\0');
+				break;
+			}
+		}
+	}
+}
+
+/* Device modaliases as udev sends them, about half of them with a driver */
+static char **make_queries(void)
+{
+	char **q = malloc(sizeof(char *) * N_QUERIES);
+	unsigned int i;
+	int r = 0;
+
+	if (q == NULL)
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < N_QUERIES && r >= 0; i++) {
+		unsigned int vendor = vendors[rnd() % ARRAY_SIZE(vendors)];
+		unsigned int dev = rnd() & 0xffff;
+
+		switch (i % 4) {
+		case 0:
+		case 1:
+			r = asprintf(&q[i], "pci:v0000%04Xd0000%04Xsv0000%04Xsd0000%04Xbc%02Xsc%02Xi%02X",
+				vendor, dev, vendor, rnd() & 0xffff,
+				rnd() % 16, rnd() % 16, rnd() % 4);
+			break;
+		case 2:
+			r = asprintf(&q[i], "usb:v%04Xp%04Xd0100dc00dsc00dp00ic03isc01ip01in00",
+				vendor, dev);
+			break;
+		default:
+			r = asprintf(&q[i], "acpi:BNCH%04X:", dev);
+			break;
+		}
+	}
+	if (r < 0)
+		exit(EXIT_FAILURE);
+
+	return q;
+}
+
+static int run_depmod(const char *root, const char *version_opt)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+
+	if (pid == 0) {
+		int fd = open("/dev/null", O_WRONLY);
+
+		dup2(fd, STDERR_FILENO);
+		execl(ABS_TOP_BUILDDIR "/tools/depmod", "depmod", "-b", root,
+						version_opt, KVER, NULL);
+		_exit(EXIT_FAILURE);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		return -errno;
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -EINVAL;
+}
+
+static void make_tree(const char *root, const char *version_opt)
+{
+	char path[PATH_MAX];
+	FILE *fp, *builtin;
+
+	snprintf(path, sizeof(path), "%s/lib/modules/" KVER, root);
+	if (mkdir_p(path, strlen(path), 0755) < 0)
+		exit(EXIT_FAILURE);
+
+	snprintf(path, sizeof(path), "%s/lib/modules/" KVER "/modules.builtin.modinfo", root);
+	fp = fopen(path, "we");
+	snprintf(path, sizeof(path), "%s/lib/modules/" KVER "/modules.builtin", root);
+	builtin = fopen(path, "we");
+	if (fp == NULL || builtin == NULL)
+		exit(EXIT_FAILURE);
+
+	rnd_state = 2463534242U;
+	write_modinfo(fp, builtin);
+	fclose(fp);
+	fclose(builtin);
+
+	if (run_depmod(root, version_opt) < 0) {
+		fprintf(stderr, "depmod failed for %s\n", root);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void bench_tree(const char *root, const char *label, char **queries)
+{
+	char dirname[PATH_MAX], alias_bin[PATH_MAX + 32], builtin_bin[PATH_MAX + 32];
+	char what[128], names[N_QUERIES][32];
+	const char *null_config = NULL;
+	volatile unsigned long sink = 0;
+	struct index_file *file;
+	struct index_mm *mm;
+	unsigned long long stamp;
+	struct kmod_ctx *ctx;
+	unsigned long allocs;
+	unsigned int i, r;
+	uint64_t t;
+
+	snprintf(dirname, sizeof(dirname), "%s/lib/modules/" KVER, root);
+	snprintf(alias_bin, sizeof(alias_bin), "%s/modules.builtin.alias.bin", dirname);
+	snprintf(builtin_bin, sizeof(builtin_bin), "%s/modules.builtin.bin", dirname);
+
+	/* hits and misses of exact keys */
+	for (i = 0; i < N_QUERIES; i++)
+		snprintf(names[i], sizeof(names[i]), "bench_%u",
+						(i * 7919) % (2 * N_MODULES));
+
+	ctx = kmod_new(dirname, &null_config);
+	if (ctx == NULL || index_mm_open(ctx, builtin_bin, &stamp, &mm) < 0)
+		exit(EXIT_FAILURE);
+
+	allocs = n_allocs;
+	t = now_nsec();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < N_QUERIES; i++) {
+			char *v = index_mm_search(mm, names[i]);
+
+			sink += v != NULL;
+			free(v);
+		}
+	snprintf(what, sizeof(what), "%s index_mm_search", label);
+	report(what, now_nsec() - t, n_allocs - allocs, ROUNDS * N_QUERIES);
+	index_mm_close(mm);
+
+	file = index_file_open(builtin_bin);
+	if (file == NULL)
+		exit(EXIT_FAILURE);
+
+	allocs = n_allocs;
+	t = now_nsec();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < N_QUERIES; i++) {
+			char *v = index_search(file, names[i]);
+
+			sink += v != NULL;
+			free(v);
+		}
+	snprintf(what, sizeof(what), "%s index_search", label);
+	report(what, now_nsec() - t, n_allocs - allocs, ROUNDS * N_QUERIES);
+	index_file_close(file);
+
+	if (index_mm_open(ctx, alias_bin, &stamp, &mm) < 0)
+		exit(EXIT_FAILURE);
+
+	allocs = n_allocs;
+	t = now_nsec();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < N_QUERIES; i++) {
+			struct index_value *v = index_mm_searchwild(mm, queries[i]);
+
+			sink += v != NULL;
+			index_values_free(v);
+		}
+	snprintf(what, sizeof(what), "%s index_mm_searchwild", label);
+	report(what, now_nsec() - t, n_allocs - allocs, ROUNDS * N_QUERIES);
+	index_mm_close(mm);
+
+	file = index_file_open(alias_bin);
+	if (file == NULL)
+		exit(EXIT_FAILURE);
+
+	allocs = n_allocs;
+	t = now_nsec();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < N_QUERIES; i++) {
+			struct index_value *v = index_searchwild(file, queries[i]);
+
+			sink += v != NULL;
+			index_values_free(v);
+		}
+	snprintf(what, sizeof(what), "%s index_searchwild", label);
+	report(what, now_nsec() - t, n_allocs - allocs, ROUNDS * N_QUERIES);
+	index_file_close(file);
+
+	/* what modprobe and udev do for each device */
+	if (kmod_load_resources(ctx) < 0)
+		exit(EXIT_FAILURE);
+
+	allocs = n_allocs;
+	t = now_nsec();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < N_QUERIES; i++) {
+			struct kmod_list *list = NULL;
+
+			kmod_module_new_from_lookup(ctx, queries[i], &list);
+			sink += list != NULL;
+			kmod_module_unref_list(list);
+		}
+	snprintf(what, sizeof(what), "%s kmod_module_new_from_lookup", label);
+	report(what, now_nsec() - t, n_allocs - allocs, ROUNDS * N_QUERIES);
+
+	kmod_unref(ctx);
+
+	if (sink == 0)
+		exit(EXIT_FAILURE);
+}
+
+static void remove_tree(const char *root)
+{
+	char cmd[PATH_MAX + 16];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", root);
+	if (system(cmd) != 0)
+		fprintf(stderr, "could not remove %s\n", root);
+}
+
+int main(int argc, char *argv[])
+{
+	char tmpl[] = "/tmp/kmod-bench-index-XXXXXX";
+	char root_v3[PATH_MAX], root_v2[PATH_MAX];
+	bool keep = argc > 1 && streq(argv[1], "-k");
+	char **queries;
+	unsigned int i;
+
+	if (mkdtemp(tmpl) == NULL) {
+		fprintf(stderr, "could not create temporary directory: %m\n");
+		return EXIT_FAILURE;
+	}
+
+	snprintf(root_v3, sizeof(root_v3), "%s/v3", tmpl);
+	snprintf(root_v2, sizeof(root_v2), "%s/v2", tmpl);
+	make_tree(root_v3, "--index-version=3");
+	make_tree(root_v2, "--index-version=2");
+
+	rnd_state = 88172645U;
+	queries = make_queries();
+
+	printf("%d modules, %d queries, %d rounds\n", N_MODULES, N_QUERIES,
+								ROUNDS);
+	bench_tree(root_v3, "v3", queries);
+	bench_tree(root_v2, "v2", queries);
+
+	for (i = 0; i < N_QUERIES; i++)
+		free(queries[i]);
+	free(queries);
+
+	if (keep)
+		printf("indexes kept in %s\n", tmpl);
+	else
+		remove_tree(tmpl);
+
+	return EXIT_SUCCESS;
+}
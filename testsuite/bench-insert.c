@@ -0,0 +1,564 @@
+/*
+ * Copyright (C) 2026  kmod contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark for the loading of a module by kmod_module_insert_module():
+ * open, decompress and insert, for each compression libkmod is built with
+ * and both routes, finit_module() (from a memfd if the module is
+ * compressed) and init_module() (from the contents in memory, taken when
+ * uname.so reports a kernel older than finit_module()). The syscalls are
+ * the ones of the testsuite's init_module.so, so the times are only those
+ * of userspace. Modules are mod-simple.ko padded up to the given sizes,
+ * about as compressible as code, or the uncompressed modules given with
+ * -m; the compressed ones are made with gzip, xz and zstd. Each
+ * measurement is a child process inserting the module repeatedly: peak
+ * RSS comes from wait4(), and the copies of the image made in userspace
+ * from KMOD_STAT_BYTES_DECOMPRESSED, a mapped module makes none. Not run
+ * by "make check": run it by hand and compare the numbers.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <shared/macro.h>
+#include <shared/util.h>
+
+#include <libkmod/libkmod.h>
+
+#define OVERRIDE_LIBDIR ABS_TOP_BUILDDIR "/testsuite/.libs/"
+#define BASE_MODULE TESTSUITE_ROOTFS \
+	"test-depmod/search-order-simple/lib/modules/4.4.4/updates/mod-simple.ko"
+#define ROUNDS 20
+#define MAX_MODULES 16
+/* release given to uname.so: whether init_module.so has finit_module() */
+#define RELEASE_FINIT "4.4.4"
+#define RELEASE_INIT "3.0.0"
+/* the longest command line of the compressors, with its NULL */
+#define COMPRESS_ARGS 6
+#define MAX_COMPRESSORS 4
+
+static const struct {
+	const char *name;
+	const char *suffix;
+	const char *const argv[COMPRESS_ARGS];
+} compressors[] = {
+	{ "none", "", { NULL } },
+#ifdef ENABLE_ZLIB
+	{ "gzip", ".gz", { "gzip", "-n", "-k", "-f", NULL } },
+#endif
+#ifdef ENABLE_XZ
+	{ "xz", ".xz", { "xz", "-k", "--check=crc32", "--lzma2=dict=1MiB", "-f", NULL } },
+#endif
+#ifdef ENABLE_ZSTD
+	{ "zstd", ".zst", { "zstd", "-q", "-k", "-f", NULL } },
+#endif
+};
+
+static const struct {
+	const char *name;
+	const char *release;
+} routes[] = {
+	{ "finit", RELEASE_FINIT },
+	{ "init", RELEASE_INIT },
+};
+
+struct result {
+	uint64_t usec;
+	unsigned long long decompressed;
+	long rss_kib;
+};
+
+static const char cmdopts_s[] = "s:m:r:kh";
+static const struct option cmdopts[] = {
+	{ "sizes", required_argument, 0, 's' },
+	{ "module", required_argument, 0, 'm' },
+	{ "rounds", required_argument, 0, 'r' },
+	{ "keep", no_argument, 0, 'k' },
+	{ "help", no_argument, 0, 'h' },
+	{ }
+};
+
+static void help(void)
+{
+	printf("Usage:\n"
+	       "\t%s [options]\n"
+	       "Options:\n"
+	       "\t-s, --sizes=KIB,...    Sizes of the padded modules (default 64,512,4096)\n"
+	       "\t-m, --module=FILE      Use an uncompressed module instead, may be repeated\n"
+	       "\t-r, --rounds=N         Inserts per measurement (default %d)\n"
+	       "\t-k, --keep             Keep the temporary directory\n"
+	       "\t-h, --help             Show this help\n",
+	       program_invocation_short_name, ROUNDS);
+}
+
+static uint32_t rnd_state = 2463534242U;
+
+/* xorshift, so the padding is the same on every run */
+static uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+/*
+ * The child side: insert @path @rounds times in a single context, each
+ * time from a new module so the file is opened and decompressed again.
+ * init_module.so says -EEXIST once the module is "live", which is fine.
+ */
+static int do_run(const char *path, unsigned int rounds)
+{
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	uint64_t decompressed;
+	unsigned int i;
+	uint64_t t0, t;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL)
+		return EXIT_FAILURE;
+
+	t0 = now_usec();
+	for (i = 0; i < rounds; i++) {
+		struct kmod_module *mod;
+		int err;
+
+		err = kmod_module_new_from_path(ctx, path, &mod);
+		if (err < 0) {
+			fprintf(stderr, "%s: %s\n", path, strerror(-err));
+			return EXIT_FAILURE;
+		}
+
+		err = kmod_module_insert_module(mod, 0, NULL);
+		kmod_module_unref(mod);
+		if (err < 0 && err != -EEXIST) {
+			fprintf(stderr, "%s: %s\n", path, strerror(-err));
+			return EXIT_FAILURE;
+		}
+	}
+	t = now_usec() - t0;
+
+	if (kmod_get_stat(ctx, KMOD_STAT_BYTES_DECOMPRESSED, &decompressed) < 0)
+		decompressed = 0;
+	printf("%llu %llu\n", (unsigned long long) t,
+				(unsigned long long) decompressed);
+
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+
+static int measure(const char *self, const char *root, const char *path,
+		   const char *release, unsigned int rounds, struct result *r)
+{
+	char preload[PATH_MAX * 2], buf[128], nrounds[16];
+	struct rusage ru;
+	unsigned long long usec;
+	int fds[2], status;
+	ssize_t len;
+	pid_t pid;
+
+	snprintf(preload, sizeof(preload), "%s:%s:%s",
+		 OVERRIDE_LIBDIR "init_module.so", OVERRIDE_LIBDIR "path.so",
+		 OVERRIDE_LIBDIR "uname.so");
+	snprintf(nrounds, sizeof(nrounds), "%u", rounds);
+
+	if (pipe(fds) < 0)
+		return -errno;
+
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -errno;
+	}
+
+	if (pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		setenv("TESTSUITE_ROOTFS", root, 1);
+		setenv("TESTSUITE_UNAME_R", release, 1);
+		setenv("TESTSUITE_INIT_MODULE_RETCODES", "", 1);
+		setenv("LD_PRELOAD", preload, 1);
+		execl(self, self, "--run", path, nrounds, NULL);
+		_exit(EXIT_FAILURE);
+	}
+
+	close(fds[1]);
+	len = read_str_safe(fds[0], buf, sizeof(buf));
+	close(fds[0]);
+
+	if (wait4(pid, &status, 0, &ru) < 0)
+		return -errno;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || len <= 0 ||
+	    sscanf(buf, "%llu %llu", &usec, &r->decompressed) != 2)
+		return -EINVAL;
+
+	r->usec = usec;
+	r->rss_kib = ru.ru_maxrss;
+
+	return 0;
+}
+
+static int compress_file(unsigned int c, const char *path)
+{
+	const char *argv[COMPRESS_ARGS + 1];
+	unsigned int i;
+	int status;
+	pid_t pid;
+
+	for (i = 0; compressors[c].argv[i] != NULL; i++)
+		argv[i] = compressors[c].argv[i];
+	argv[i++] = path;
+	argv[i] = NULL;
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+
+	if (pid == 0) {
+		int fd = open("/dev/null", O_WRONLY);
+
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		execvp(argv[0], (char **) argv);
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		return -errno;
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -ENOEXEC;
+}
+
+static int read_file(const char *path, uint8_t **data, size_t *size)
+{
+	struct stat st;
+	ssize_t r;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	/* read_str_safe() terminates what it read */
+	*data = malloc(st.st_size + 1);
+	if (*data == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	r = read_str_safe(fd, (char *) *data, st.st_size + 1);
+	close(fd);
+	if (r != st.st_size) {
+		free(*data);
+		return -EIO;
+	}
+
+	*size = st.st_size;
+	return 0;
+}
+
+static int write_file(const char *path, const uint8_t *data, size_t size,
+		      size_t padded)
+{
+	uint8_t run[16];
+	size_t off;
+	int fd, err = 0;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	if (write_str_safe(fd, (const char *) data, size) < 0)
+		err = -EIO;
+
+	/*
+	 * Past its end the module is followed by runs of its own bytes,
+	 * which the ELF parser ignores: the compressors find matches as in
+	 * code, but not the same ones all the time.
+	 */
+	for (off = size; off + sizeof(run) <= padded && err == 0;
+							off += sizeof(run)) {
+		size_t from = rnd() % (size - sizeof(run));
+
+		memcpy(run, data + from, sizeof(run));
+		if (rnd() % 4 == 0)
+			run[rnd() % sizeof(run)] = rnd();
+		if (write_str_safe(fd, (const char *) run, sizeof(run)) < 0)
+			err = -EIO;
+	}
+
+	close(fd);
+
+	return err;
+}
+
+static off_t file_size(const char *path)
+{
+	struct stat st;
+
+	return stat(path, &st) < 0 ? -1 : st.st_size;
+}
+
+/* write @name.ko in @root/mods, then its compressed variants */
+static int prepare(const char *root, const char *name, const uint8_t *data,
+		   size_t size, size_t padded, bool *have)
+{
+	char path[PATH_MAX];
+	unsigned int c;
+	int err;
+
+	snprintf(path, sizeof(path), "%s/mods/%s.ko", root, name);
+	err = write_file(path, data, size, padded);
+	if (err < 0)
+		return err;
+
+	have[0] = true;
+	for (c = 1; c < ARRAY_SIZE(compressors); c++) {
+		have[c] = compress_file(c, path) == 0;
+		if (!have[c])
+			fprintf(stderr, "could not run %s, skipping it\n",
+						compressors[c].argv[0]);
+	}
+
+	return 0;
+}
+
+static void report(const char *self, const char *root, const char *name,
+		   const bool *have, unsigned int rounds)
+{
+	off_t size = -1;
+	unsigned int c, i;
+
+	for (c = 0; c < ARRAY_SIZE(compressors); c++) {
+		char path[PATH_MAX], full[PATH_MAX];
+		off_t csize;
+
+		if (!have[c])
+			continue;
+
+		/* relative to the root path.so redirects to */
+		snprintf(path, sizeof(path), "/mods/%s.ko%s", name,
+						compressors[c].suffix);
+		snprintf(full, sizeof(full), "%s%s", root, path);
+		csize = file_size(full);
+		if (c == 0)
+			size = csize;
+		if (size <= 0 || csize <= 0)
+			continue;
+
+		for (i = 0; i < ARRAY_SIZE(routes); i++) {
+			struct result r;
+			double per_insert;
+			int err;
+
+			err = measure(self, root, path, routes[i].release,
+								rounds, &r);
+			if (err < 0) {
+				printf("%-20s %-5s %-6s failed: %s\n", name,
+					compressors[c].name, routes[i].name,
+					strerror(-err));
+				continue;
+			}
+
+			per_insert = (double) r.usec / rounds;
+			printf("%-20s %-5s %-6s %9lld %6.2f %10.1f %10.1f %8ld %6.2f\n",
+				name, compressors[c].name, routes[i].name,
+				(long long) size, (double) size / csize,
+				per_insert, size / (per_insert > 0 ? per_insert : 1),
+				r.rss_kib,
+				(double) r.decompressed / rounds / size);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	char self[PATH_MAX], root[] = "/tmp/kmod-bench-insert-XXXXXX";
+	char buf[PATH_MAX];
+	const char *modules[MAX_MODULES];
+	const char *sizes = "64,512,4096";
+	unsigned int n_modules = 0, rounds = ROUNDS;
+	bool keep = false;
+	uint8_t *base = NULL;
+	size_t base_size;
+	ssize_t len;
+	int err;
+
+	if (argc == 4 && streq(argv[1], "--run"))
+		return do_run(argv[2], strtoul(argv[3], NULL, 10));
+
+	for (;;) {
+		int c, idx = 0;
+		char *end;
+
+		c = getopt_long(argc, argv, cmdopts_s, cmdopts, &idx);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 's':
+			sizes = optarg;
+			break;
+		case 'm':
+			if (n_modules == MAX_MODULES) {
+				fprintf(stderr, "at most %d modules\n",
+								MAX_MODULES);
+				return EXIT_FAILURE;
+			}
+			modules[n_modules++] = optarg;
+			break;
+		case 'r':
+			rounds = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || rounds == 0) {
+				fprintf(stderr, "invalid rounds: '%s'\n",
+								optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'k':
+			keep = true;
+			break;
+		case 'h':
+			help();
+			return EXIT_SUCCESS;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len < 0) {
+		fprintf(stderr, "could not find myself: %m\n");
+		return EXIT_FAILURE;
+	}
+	self[len] = '\0';
+
+	if (mkdtemp(root) == NULL) {
+		fprintf(stderr, "could not create temporary directory: %m\n");
+		return EXIT_FAILURE;
+	}
+	snprintf(buf, sizeof(buf), "%s/mods", root);
+	if (mkdir(buf, 0755) < 0) {
+		fprintf(stderr, "could not create %s: %m\n", buf);
+		err = -errno;
+		goto finish;
+	}
+
+	printf("%u inserts per measurement; times in us, throughput in bytes/us\n",
+									rounds);
+	printf("%-20s %-5s %-6s %9s %6s %10s %10s %8s %6s\n", "module", "comp",
+		"route", "size", "ratio", "per insert", "throughput",
+		"RSS KiB", "copies");
+
+	if (n_modules > 0) {
+		unsigned int i;
+
+		for (i = 0; i < n_modules; i++) {
+			bool have[MAX_COMPRESSORS];
+			const char *name = basename(modules[i]);
+			char stem[NAME_MAX];
+			size_t namelen = strlen(name);
+
+			err = read_file(modules[i], &base, &base_size);
+			if (err < 0) {
+				fprintf(stderr, "could not read %s: %s\n",
+						modules[i], strerror(-err));
+				goto finish;
+			}
+
+			if (namelen > 3 && streq(name + namelen - 3, ".ko"))
+				namelen -= 3;
+			snprintf(stem, sizeof(stem), "%.*s", (int) namelen, name);
+			err = prepare(root, stem, base, base_size, base_size,
+									have);
+			free(base);
+			base = NULL;
+			if (err < 0)
+				goto finish;
+			report(self, root, stem, have, rounds);
+		}
+	} else {
+		const char *p;
+
+		err = read_file(BASE_MODULE, &base, &base_size);
+		if (err < 0) {
+			fprintf(stderr, "could not read %s: %s\n",
+					BASE_MODULE, strerror(-err));
+			goto finish;
+		}
+
+		for (p = sizes; *p != '\0';) {
+			bool have[MAX_COMPRESSORS];
+			char name[NAME_MAX];
+			unsigned long kib;
+			char *end;
+
+			kib = strtoul(p, &end, 10);
+			if (end == p || (*end != ',' && *end != '\0')) {
+				fprintf(stderr, "invalid sizes: '%s'\n", sizes);
+				err = -EINVAL;
+				goto finish;
+			}
+			p = *end == ',' ? end + 1 : end;
+
+			snprintf(name, sizeof(name), "mod-simple-%luk", kib);
+			err = prepare(root, name, base, base_size,
+				kib * 1024 > base_size ? kib * 1024 : base_size,
+									have);
+			if (err < 0)
+				goto finish;
+			report(self, root, name, have, rounds);
+		}
+	}
+
+	err = 0;
+
+finish:
+	free(base);
+
+	if (keep) {
+		printf("tree kept in %s\n", root);
+	} else {
+		char cmd[PATH_MAX];
+
+		snprintf(cmd, sizeof(cmd), "rm -rf '%s'", root);
+		if (system(cmd) != 0)
+			fprintf(stderr, "could not remove %s\n", root);
+	}
+
+	return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
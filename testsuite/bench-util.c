@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2026  kmod contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmark for the normalization of aliases and module names in
+ * shared/util.c, against the byte at a time loops alias_normalize() and
+ * underscores() used before, on modaliases and module names shaped like
+ * those of a distro kernel. Not run by "make check": run it by hand and
+ * compare the numbers.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <shared/macro.h>
+#include <shared/util.h>
+
+#define ROUNDS 50000
+
+static const char *const aliases[] = {
+	"pci:v00008086d00002668sv00001028sd000001F3bc01sc06i01",
+	"pci:v000010DEd00001C82sv00001458sd00003746bc03sc00i00",
+	"usb:v046Dp0825d0010dcEFdsc02dp01ic0Eisc01ip00in00",
+	"usb:v8087p0A2Bd0001dcE0dsc01dp01icE0isc01ip01in00",
+	"acpi:PNP0C0A:",
+	"acpi:INT33A1:PNP0D80:",
+	"platform:intel_pmc_core",
+	"platform:snd-soc-dummy",
+	"hid:b0003g0001v0000046Dp0000C52B",
+	"input:b0019v0000p0001e0000-e0,1,k74,ramlsfw",
+	"of:NgpioT(null)Cgpio-leds",
+	"virtio:d00000001v00001AF4",
+	"scsi:t-0x05",
+	"i2c:tpm_i2c_infineon",
+	"dmi:bvnLENOVO:bvrN2HET:bd10/2023:svnLENOVO:pn20XW",
+	"cpu:type:x86,ven0000fam0006mod009E:feature:,0058,",
+	"serio:ty06pr*id*ex*",
+	"pcmcia:m*c*f*fn*pfn*pa*pb*pc*pd*",
+	"fs-ext4",
+	"char-major-10-229",
+};
+
+static const char *const modnames[] = {
+	"snd_hda_intel", "snd-hda-codec-realtek", "i915", "nvidia_drm",
+	"iwlwifi", "iwlmvm", "btusb", "bluetooth", "x86_pkg_temp_thermal",
+	"intel-rapl-msr", "kvm_intel", "ext4", "nf_conntrack",
+	"nf-nat-ftp.ko", "ip6table_filter", "dm-crypt", "usb-storage",
+	"hid-logitech-dj", "cfg80211", "thinkpad_acpi",
+};
+
+/* the implementations before the runs were copied at once */
+static int alias_normalize_bytewise(const char *alias,
+					char buf[static PATH_MAX], size_t *len)
+{
+	size_t i;
+
+	for (i = 0; i < PATH_MAX - 1; i++) {
+		const char c = alias[i];
+		switch (c) {
+		case '-':
+			buf[i] = '_';
+			break;
+		case ']':
+			return -EINVAL;
+		case '[':
+			while (alias[i] != ']' && alias[i] != '\0') {
+				buf[i] = alias[i];
+				i++;
+			}
+
+			if (alias[i] != ']')
+				return -EINVAL;
+
+			buf[i] = alias[i];
+			break;
+		case '\0':
+			goto finish;
+		default:
+			buf[i] = c;
+		}
+	}
+
+finish:
+	buf[i] = '\0';
+	if (len)
+		*len = i;
+
+	return 0;
+}
+
+static int underscores_bytewise(char *s)
+{
+	unsigned int i;
+
+	for (i = 0; s[i]; i++) {
+		switch (s[i]) {
+		case '-':
+			s[i] = '_';
+			break;
+		case ']':
+			return -EINVAL;
+		case '[':
+			i += strcspn(&s[i], "]");
+			if (!s[i])
+				return -EINVAL;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *what, uint64_t nsec, unsigned int ops)
+{
+	printf("%-32s %8.2f ns/op\n", what, (double) nsec / ops);
+}
+
+int main(int argc, char *argv[])
+{
+	char buf[PATH_MAX], ref[PATH_MAX];
+	volatile size_t sink = 0;
+	unsigned int i, r;
+	size_t len;
+	uint64_t t;
+
+	for (i = 0; i < ARRAY_SIZE(aliases); i++) {
+		alias_normalize(aliases[i], buf, NULL);
+		alias_normalize_bytewise(aliases[i], ref, NULL);
+		if (!streq(buf, ref)) {
+			fprintf(stderr, "alias_normalize: '%s' != '%s'\n",
+								buf, ref);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(aliases); i++) {
+		strcpy(buf, aliases[i]);
+		strcpy(ref, aliases[i]);
+		underscores(buf);
+		underscores_bytewise(ref);
+		if (!streq(buf, ref)) {
+			fprintf(stderr, "underscores: '%s' != '%s'\n",
+								buf, ref);
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("%zu aliases, %zu module names, %d rounds\n",
+		ARRAY_SIZE(aliases), ARRAY_SIZE(modnames), ROUNDS);
+
+	t = now_nsec();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < ARRAY_SIZE(aliases); i++) {
+			alias_normalize_bytewise(aliases[i], buf, &len);
+			sink += len;
+		}
+	report("alias_normalize, bytewise", now_nsec() - t,
+					ROUNDS * ARRAY_SIZE(aliases));
+
+	t = now_nsec();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < ARRAY_SIZE(aliases); i++) {
+			alias_normalize(aliases[i], buf, &len);
+			sink += len;
+		}
+	report("alias_normalize", now_nsec() - t,
+					ROUNDS * ARRAY_SIZE(aliases));
+
+	t = now_nsec();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < ARRAY_SIZE(aliases); i++) {
+			strcpy(buf, aliases[i]);
+			sink += underscores_bytewise(buf);
+		}
+	report("strcpy + underscores, bytewise", now_nsec() - t,
+					ROUNDS * ARRAY_SIZE(aliases));
+
+	t = now_nsec();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < ARRAY_SIZE(aliases); i++) {
+			strcpy(buf, aliases[i]);
+			sink += underscores(buf);
+		}
+	report("strcpy + underscores", now_nsec() - t,
+					ROUNDS * ARRAY_SIZE(aliases));
+
+	/* names are too short for the libc calls to pay off: kept bytewise */
+	t = now_nsec();
+	for (r = 0; r < ROUNDS; r++)
+		for (i = 0; i < ARRAY_SIZE(modnames); i++) {
+			modname_normalize(modnames[i], buf, &len);
+			sink += len;
+		}
+	report("modname_normalize", now_nsec() - t,
+					ROUNDS * ARRAY_SIZE(modnames));
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,724 @@
+/*
+ * Copyright (C) 2026  kmod contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Generate a /lib/modules/<version> tree at distro scale, to benchmark and
+ * profile depmod, modprobe and modinfo on something bigger than the
+ * testsuite's rootfs. The modules are minimal relocatable ELF objects with
+ * what kmod reads from them: .modinfo, __ksymtab_strings, __versions and a
+ * .symtab with the exports (as __crc_ symbols) and the imports. Modules
+ * form dependency chains of configurable depth, and also depend on a few
+ * "core" modules, like drivers on their subsystem. The output only depends
+ * on the options, so runs can be compared. Compression is done by running
+ * gzip, xz or zstd, with the options the kernel build uses.
+ */
+
+#include <elf.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <shared/macro.h>
+#include <shared/util.h>
+
+enum compression {
+	COMPRESS_NONE,
+	COMPRESS_GZIP,
+	COMPRESS_XZ,
+	COMPRESS_ZSTD,
+	_COMPRESS_COUNT,
+	COMPRESS_MIXED = _COMPRESS_COUNT,
+};
+
+/* the longest command line of the compressors, with its NULL */
+#define COMPRESS_ARGS 6
+
+static const struct {
+	const char *name;
+	const char *const argv[COMPRESS_ARGS];
+} compressors[] = {
+	[COMPRESS_NONE] = { "none", { NULL } },
+	[COMPRESS_GZIP] = { "gzip", { "gzip", "-n", "-f", NULL } },
+	[COMPRESS_XZ] = { "xz", { "xz", "--check=crc32", "--lzma2=dict=1MiB", "-f", NULL } },
+	[COMPRESS_ZSTD] = { "zstd", { "zstd", "-q", "-T0", "--rm", "-f", NULL } },
+};
+
+/* files per compressor run */
+#define COMPRESS_BATCH 256
+
+struct options {
+	const char *root;
+	const char *kversion;
+	unsigned int n_modules;
+	unsigned int n_symbols;
+	unsigned int n_aliases;
+	unsigned int depth;
+	enum compression compression;
+};
+
+struct module {
+	unsigned int n_exports;
+	unsigned int deps[2];
+	unsigned int n_deps;
+};
+
+struct stats {
+	unsigned long exports;
+	unsigned long imports;
+	unsigned long aliases;
+};
+
+static const char cmdopts_s[] = "o:V:n:s:a:D:z:h";
+static const struct option cmdopts[] = {
+	{ "output", required_argument, 0, 'o' },
+	{ "kversion", required_argument, 0, 'V' },
+	{ "modules", required_argument, 0, 'n' },
+	{ "symbols", required_argument, 0, 's' },
+	{ "aliases", required_argument, 0, 'a' },
+	{ "depth", required_argument, 0, 'D' },
+	{ "compression", required_argument, 0, 'z' },
+	{ "help", no_argument, 0, 'h' },
+	{ }
+};
+
+static const unsigned int vendors[] = {
+	0x8086, 0x10de, 0x1002, 0x14e4, 0x10ec, 0x15b3, 0x1077, 0x1000,
+	0x8087, 0x168c, 0x17cb, 0x1af4, 0x1b4b, 0x1022, 0x1912, 0x046d,
+};
+
+static uint32_t rnd_state = 2463534242U;
+
+/* xorshift, so the same options give the same tree */
+static uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+/* FNV-1a, a stand-in for the CRC genksyms would give the symbol */
+static uint32_t symbol_crc(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	for (; *name != '\0'; name++) {
+		h ^= (uint8_t) *name;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static void help(void)
+{
+	printf("Usage:\n"
+	       "\t%s -o DIR [options]\n"
+	       "Generate a synthetic DIR/lib/modules/VERSION tree for benchmarks.\n"
+	       "Run depmod -b DIR VERSION on it afterwards.\n\n"
+	       "Options:\n"
+	       "\t-o, --output=DIR       Root of the tree to create\n"
+	       "\t-V, --kversion=VERSION Kernel version (default 4.4.4)\n"
+	       "\t-n, --modules=N        Number of modules (default 6000)\n"
+	       "\t-s, --symbols=N        Average exported symbols per module (default 7)\n"
+	       "\t-a, --aliases=N        Average aliases per module (default 5)\n"
+	       "\t-D, --depth=N          Length of the dependency chains (default 12)\n"
+	       "\t-z, --compression=TYPE none, gzip, xz, zstd, or mixed for all of\n"
+	       "\t                       them in turn (default none)\n"
+	       "\t-h, --help             Show this help\n",
+	       program_invocation_short_name);
+}
+
+static int parse_uint(const char *s, unsigned int min, unsigned int *out)
+{
+	unsigned long v;
+	char *end;
+
+	errno = 0;
+	v = strtoul(s, &end, 10);
+	if (errno != 0 || end == s || *end != '\0' || v < min || v > UINT_MAX / 64)
+		return -EINVAL;
+
+	*out = v;
+	return 0;
+}
+
+static void module_name(char *buf, size_t len, unsigned int i)
+{
+	snprintf(buf, len, "synth%04u", i);
+}
+
+static void export_name(char *buf, size_t len, unsigned int i, unsigned int k)
+{
+	snprintf(buf, len, "synth%04u_export%u", i, k);
+}
+
+/*
+ * The first modules are shared by many others, like subsystem cores; the
+ * rest is split in chains of @depth modules, each depending on the
+ * previous one, and on one of the core modules.
+ */
+static struct module *plan_modules(const struct options *o,
+							struct stats *stats)
+{
+	struct module *mods = calloc(o->n_modules, sizeof(*mods));
+	unsigned int n_core = o->n_modules >= 100 ? o->n_modules / 100 : 1;
+	unsigned int i, export = 0;
+
+	if (mods == NULL)
+		return NULL;
+
+	for (i = 0; i < o->n_modules; i++) {
+		struct module *m = &mods[i];
+
+		m->n_exports = 1 + rnd() % (2 * o->n_symbols - 1);
+		export += m->n_exports;
+
+		if (i < n_core) {
+			if (i > 0 && i % o->depth != 0)
+				m->deps[m->n_deps++] = i - 1;
+			continue;
+		}
+
+		if ((i - n_core) % o->depth != 0)
+			m->deps[m->n_deps++] = i - 1;
+		if (m->n_deps == 0 || rnd() % 2 == 0)
+			m->deps[m->n_deps++] = rnd() % n_core;
+	}
+
+	stats->exports = export;
+
+	return mods;
+}
+
+/* The aliases file2alias would give a driver for PCI, USB, ACPI or OF */
+static void write_aliases(FILE *fp, const char *prefix, unsigned int i,
+				unsigned int n, struct stats *stats)
+{
+	unsigned int vendor = vendors[i % ARRAY_SIZE(vendors)];
+	unsigned int j;
+
+	for (j = 0; j < n; j++) {
+		unsigned int dev = rnd() & 0xffff;
+
+		switch (i % 8) {
+		case 0 ... 3:
+			fprintf(fp, "%salias=pci:v0000%04Xd0000%04Xsv*sd*bc*sc*i*%c",
+				prefix, vendor, dev, '\0');
+			break;
+		case 4:
+		case 5:
+			fprintf(fp, "%salias=usb:v%04Xp%04Xd*dc*dsc*dp*ic*isc*ip*in*%c",
+				prefix, vendor, dev, '\0');
+			break;
+		case 6:
+			fprintf(fp, "%salias=acpi*:SYNT%04X:*%c",
+				prefix, dev, '\0');
+			break;
+		default:
+			fprintf(fp, "%salias=of:N*T*Csynth,chip%u-%u%c",
+				prefix, i, j, '\0');
+			break;
+		}
+	}
+
+	stats->aliases += n;
+}
+
+static void write_modinfo(FILE *fp, const struct options *o,
+				const struct module *mods, unsigned int i,
+				struct stats *stats)
+{
+	const struct module *m = &mods[i];
+	char name[32];
+	unsigned int j;
+
+	module_name(name, sizeof(name), i);
+
+	fprintf(fp, "license=GPL%c", '\0');
+	fprintf(fp, "description=Synthetic module %u%c", i, '\0');
+	if (i % 4 == 0) {
+		fprintf(fp, "parm=debug:Enable debug output%c", '\0');
+		fprintf(fp, "parmtype=debug:int%c", '\0');
+	}
+	if (i % 16 == 0)
+		fprintf(fp, "firmware=synth/%s.bin%c", name, '\0');
+
+	write_aliases(fp, "", i, rnd() % (2 * o->n_aliases + 1), stats);
+
+	fprintf(fp, "depends=");
+	for (j = 0; j < m->n_deps; j++) {
+		char dep[32];
+
+		module_name(dep, sizeof(dep), m->deps[j]);
+		fprintf(fp, "%s%s", j > 0 ? "," : "", dep);
+	}
+	fputc('\0', fp);
+
+	fprintf(fp, "intree=Y%c", '\0');
+	fprintf(fp, "name=%s%c", name, '\0');
+	fprintf(fp, "vermagic=%s SMP preempt mod_unload modversions %c",
+							o->kversion, '\0');
+}
+
+struct elf_out {
+	FILE *modinfo, *ksymtab_strings, *versions, *symtab, *strtab;
+	char *buf[5];
+	size_t len[5];
+};
+
+static void add_symbol(struct elf_out *e, const char *name, uint16_t shndx,
+				uint8_t type, uint64_t value)
+{
+	Elf64_Sym sym = {
+		.st_name = ftell(e->strtab),
+		.st_info = ELF64_ST_INFO(STB_GLOBAL, type),
+		.st_shndx = shndx,
+		.st_value = value,
+	};
+
+	fwrite(name, strlen(name) + 1, 1, e->strtab);
+	fwrite(&sym, sizeof(sym), 1, e->symtab);
+}
+
+static void add_version(struct elf_out *e, const char *name, uint32_t crc)
+{
+	struct {
+		uint64_t crc;
+		char name[64 - sizeof(uint64_t)];
+	} v = { .crc = crc };
+	size_t len = strlen(name);
+
+	memcpy(v.name, name, len < sizeof(v.name) ? len : sizeof(v.name) - 1);
+	fwrite(&v, sizeof(v), 1, e->versions);
+}
+
+enum {
+	SEC_TEXT = 1,
+	SEC_MODINFO,
+	SEC_KSYMTAB_STRINGS,
+	SEC_VERSIONS,
+	SEC_SYMTAB,
+	SEC_STRTAB,
+	SEC_SHSTRTAB,
+	SEC_COUNT,
+};
+
+static const char shstrtab[] =
+	"\0.text\0.modinfo\0__ksymtab_strings\0__versions\0"
+	".symtab\0.strtab\0.shstrtab";
+
+static int write_elf(const char *path, const struct options *o,
+				const struct module *mods, unsigned int i,
+				struct stats *stats)
+{
+	static const uint8_t text[16];
+	const struct module *m = &mods[i];
+	struct elf_out e = { };
+	Elf64_Shdr shdr[SEC_COUNT] = { };
+	Elf64_Ehdr ehdr = {
+		.e_ident = {
+			ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64,
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			ELFDATA2LSB,
+#else
+			ELFDATA2MSB,
+#endif
+			EV_CURRENT,
+		},
+		.e_type = ET_REL,
+		.e_machine = EM_X86_64,
+		.e_version = EV_CURRENT,
+		.e_ehsize = sizeof(Elf64_Ehdr),
+		.e_shentsize = sizeof(Elf64_Shdr),
+		.e_shnum = SEC_COUNT,
+		.e_shstrndx = SEC_SHSTRTAB,
+	};
+	Elf64_Sym null_sym = { };
+	FILE **streams[] = {
+		&e.modinfo, &e.ksymtab_strings, &e.versions, &e.symtab,
+		&e.strtab,
+	};
+	const char *shname = shstrtab + 1;
+	uint64_t off;
+	unsigned int j, k;
+	FILE *fp;
+	int err = 0;
+
+	for (j = 0; j < ARRAY_SIZE(streams); j++) {
+		*streams[j] = open_memstream(&e.buf[j], &e.len[j]);
+		if (*streams[j] == NULL)
+			return -errno;
+	}
+
+	write_modinfo(e.modinfo, o, mods, i, stats);
+
+	fputc('\0', e.strtab);
+	fwrite(&null_sym, sizeof(null_sym), 1, e.symtab);
+
+	for (k = 0; k < m->n_exports; k++) {
+		char sym[64], crc[80];
+
+		export_name(sym, sizeof(sym), i, k);
+		snprintf(crc, sizeof(crc), "__crc_%s", sym);
+
+		fwrite(sym, strlen(sym) + 1, 1, e.ksymtab_strings);
+		add_symbol(&e, sym, SEC_TEXT, STT_FUNC, 0);
+		add_symbol(&e, crc, SHN_ABS, STT_NOTYPE, symbol_crc(sym));
+	}
+
+	/* the first export of each dependency, and sometimes one more */
+	add_version(&e, "module_layout", symbol_crc("module_layout"));
+	for (j = 0; j < m->n_deps; j++) {
+		const struct module *d = &mods[m->deps[j]];
+		unsigned int n = d->n_exports > 1 ? 1 + rnd() % 2 : 1;
+
+		for (k = 0; k < n; k++) {
+			char sym[64];
+
+			export_name(sym, sizeof(sym), m->deps[j], k);
+			add_symbol(&e, sym, SHN_UNDEF, STT_NOTYPE, 0);
+			add_version(&e, sym, symbol_crc(sym));
+			stats->imports++;
+		}
+	}
+
+	for (j = 0; j < ARRAY_SIZE(streams); j++) {
+		if (fclose(*streams[j]) != 0)
+			err = -errno;
+	}
+	if (err < 0)
+		goto out;
+
+	off = sizeof(ehdr);
+	for (j = SEC_TEXT; j < SEC_COUNT; j++) {
+		Elf64_Shdr *s = &shdr[j];
+
+		s->sh_name = shname - shstrtab;
+		shname += strlen(shname) + 1;
+		s->sh_offset = off;
+		s->sh_addralign = 1;
+
+		switch (j) {
+		case SEC_TEXT:
+			s->sh_type = SHT_PROGBITS;
+			s->sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+			s->sh_size = sizeof(text);
+			break;
+		case SEC_SYMTAB:
+			s->sh_type = SHT_SYMTAB;
+			s->sh_link = SEC_STRTAB;
+			s->sh_info = 1;
+			s->sh_entsize = sizeof(Elf64_Sym);
+			s->sh_addralign = 8;
+			s->sh_size = e.len[j - SEC_MODINFO];
+			break;
+		case SEC_STRTAB:
+			s->sh_type = SHT_STRTAB;
+			s->sh_size = e.len[j - SEC_MODINFO];
+			break;
+		case SEC_SHSTRTAB:
+			s->sh_type = SHT_STRTAB;
+			s->sh_size = sizeof(shstrtab);
+			break;
+		case SEC_VERSIONS:
+			s->sh_addralign = 8;
+			/* fall through */
+		default:
+			s->sh_type = SHT_PROGBITS;
+			s->sh_flags = SHF_ALLOC;
+			s->sh_size = e.len[j - SEC_MODINFO];
+			break;
+		}
+
+		off += (s->sh_size + 7) & ~7ULL;
+	}
+	ehdr.e_shoff = off;
+
+	fp = fopen(path, "we");
+	if (fp == NULL) {
+		err = -errno;
+		goto out;
+	}
+
+	fwrite(&ehdr, sizeof(ehdr), 1, fp);
+	for (j = SEC_TEXT; j < SEC_COUNT; j++) {
+		static const uint8_t pad[8];
+		const void *data;
+
+		if (j == SEC_TEXT)
+			data = text;
+		else if (j == SEC_SHSTRTAB)
+			data = shstrtab;
+		else
+			data = e.buf[j - SEC_MODINFO];
+
+		fwrite(data, shdr[j].sh_size, 1, fp);
+		fwrite(pad, ((shdr[j].sh_size + 7) & ~7ULL) - shdr[j].sh_size,
+									1, fp);
+	}
+	fwrite(shdr, sizeof(shdr), 1, fp);
+
+	if (ferror(fp))
+		err = -EIO;
+	if (fclose(fp) != 0 && err == 0)
+		err = -errno;
+
+out:
+	for (j = 0; j < ARRAY_SIZE(e.buf); j++)
+		free(e.buf[j]);
+
+	return err;
+}
+
+static int run_compressor(enum compression c, char **files, unsigned int n)
+{
+	const char *argv[COMPRESS_ARGS + COMPRESS_BATCH];
+	unsigned int i, argc = 0;
+	int status;
+	pid_t pid;
+
+	if (n == 0)
+		return 0;
+
+	for (i = 0; compressors[c].argv[i] != NULL; i++)
+		argv[argc++] = compressors[c].argv[i];
+	for (i = 0; i < n; i++)
+		argv[argc++] = files[i];
+	argv[argc] = NULL;
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+
+	if (pid == 0) {
+		execvp(argv[0], (char **) argv);
+		fprintf(stderr, "could not run %s: %m\n", argv[0]);
+		_exit(EXIT_FAILURE);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		return -errno;
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -EINVAL;
+}
+
+struct batch {
+	char *files[COMPRESS_BATCH];
+	unsigned int n;
+};
+
+static int batch_flush(struct batch *b, enum compression c)
+{
+	int err = run_compressor(c, b->files, b->n);
+
+	while (b->n > 0)
+		free(b->files[--b->n]);
+
+	return err;
+}
+
+static int generate(const struct options *o)
+{
+	struct batch batches[_COMPRESS_COUNT] = { };
+	struct stats stats = { };
+	struct module *mods;
+	char dir[PATH_MAX - 128], path[PATH_MAX];
+	FILE *order = NULL, *builtin = NULL, *builtin_modinfo = NULL;
+	unsigned int i, n_builtin = o->n_modules / 20;
+	int r, err = 0;
+
+	mods = plan_modules(o, &stats);
+	if (mods == NULL)
+		return -ENOMEM;
+
+	r = snprintf(dir, sizeof(dir), "%s/lib/modules/%s", o->root, o->kversion);
+	if (r < 0 || (size_t) r >= sizeof(dir)) {
+		free(mods);
+		return -ENAMETOOLONG;
+	}
+
+	snprintf(path, sizeof(path), "%s/modules.order", dir);
+	if (mkdir_parents(path, 0755) < 0 || (order = fopen(path, "we")) == NULL)
+		goto fail_errno;
+	snprintf(path, sizeof(path), "%s/modules.builtin", dir);
+	if ((builtin = fopen(path, "we")) == NULL)
+		goto fail_errno;
+	snprintf(path, sizeof(path), "%s/modules.builtin.modinfo", dir);
+	if ((builtin_modinfo = fopen(path, "we")) == NULL)
+		goto fail_errno;
+
+	for (i = 0; i < n_builtin; i++) {
+		char prefix[48];
+
+		snprintf(prefix, sizeof(prefix), "synth_builtin%u.", i);
+		fprintf(builtin, "kernel/drivers/synth/synth_builtin%u.ko\n", i);
+		fprintf(builtin_modinfo, "%slicense=GPL%c", prefix, '\0');
+		write_aliases(builtin_modinfo, prefix, i, 1 + rnd() % 4, &stats);
+	}
+
+	for (i = 0; i < o->n_modules; i++) {
+		enum compression c = o->compression;
+		char rel[128], name[32];
+		struct batch *b;
+
+		if (c == COMPRESS_MIXED)
+			c = i % _COMPRESS_COUNT;
+
+		module_name(name, sizeof(name), i);
+		snprintf(rel, sizeof(rel), "kernel/drivers/synth/g%02u/%s.ko",
+								i / 100, name);
+		fprintf(order, "%s\n", rel);
+
+		r = snprintf(path, sizeof(path), "%s/%s", dir, rel);
+		if (r < 0 || (size_t) r >= sizeof(path)) {
+			err = -ENAMETOOLONG;
+			goto out;
+		}
+		if (i % 100 == 0 && mkdir_parents(path, 0755) < 0)
+			goto fail_errno;
+
+		err = write_elf(path, o, mods, i, &stats);
+		if (err < 0) {
+			fprintf(stderr, "could not write %s: %s\n", path,
+							strerror(-err));
+			goto out;
+		}
+
+		if (c == COMPRESS_NONE)
+			continue;
+
+		b = &batches[c];
+		b->files[b->n] = strdup(path);
+		if (b->files[b->n] == NULL) {
+			err = -ENOMEM;
+			goto out;
+		}
+		if (++b->n == COMPRESS_BATCH && (err = batch_flush(b, c)) < 0)
+			goto out;
+	}
+
+	for (i = 0; i < _COMPRESS_COUNT; i++) {
+		r = batch_flush(&batches[i], i);
+		if (r < 0 && err == 0)
+			err = r;
+	}
+	if (err < 0)
+		goto out;
+
+	printf("%u modules (%u builtin), %lu exported symbols, %lu imports, %lu aliases in %s\n",
+		o->n_modules, n_builtin, stats.exports, stats.imports,
+		stats.aliases, dir);
+	goto out;
+
+fail_errno:
+	err = -errno;
+	fprintf(stderr, "could not create %s: %m\n", path);
+out:
+	for (i = 0; i < _COMPRESS_COUNT; i++)
+		while (batches[i].n > 0)
+			free(batches[i].files[--batches[i].n]);
+	if (order != NULL)
+		fclose(order);
+	if (builtin != NULL)
+		fclose(builtin);
+	if (builtin_modinfo != NULL)
+		fclose(builtin_modinfo);
+	free(mods);
+
+	return err;
+}
+
+int main(int argc, char *argv[])
+{
+	struct options o = {
+		.kversion = "4.4.4",
+		.n_modules = 6000,
+		.n_symbols = 7,
+		.n_aliases = 5,
+		.depth = 12,
+		.compression = COMPRESS_NONE,
+	};
+	int err = 0;
+
+	for (;;) {
+		int c, idx = 0;
+		unsigned int k;
+
+		c = getopt_long(argc, argv, cmdopts_s, cmdopts, &idx);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'o':
+			o.root = optarg;
+			break;
+		case 'V':
+			o.kversion = optarg;
+			break;
+		case 'n':
+			err = parse_uint(optarg, 1, &o.n_modules);
+			break;
+		case 's':
+			err = parse_uint(optarg, 1, &o.n_symbols);
+			break;
+		case 'a':
+			err = parse_uint(optarg, 0, &o.n_aliases);
+			break;
+		case 'D':
+			err = parse_uint(optarg, 1, &o.depth);
+			break;
+		case 'z':
+			if (streq(optarg, "mixed")) {
+				o.compression = COMPRESS_MIXED;
+				break;
+			}
+			for (k = 0; k < _COMPRESS_COUNT; k++) {
+				if (streq(optarg, compressors[k].name))
+					break;
+			}
+			if (k == _COMPRESS_COUNT)
+				err = -EINVAL;
+			o.compression = k;
+			break;
+		case 'h':
+			help();
+			return EXIT_SUCCESS;
+		default:
+			return EXIT_FAILURE;
+		}
+
+		if (err < 0) {
+			fprintf(stderr, "invalid argument for -%c: '%s'\n",
+								c, optarg);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (o.root == NULL || optind < argc) {
+		help();
+		return EXIT_FAILURE;
+	}
+
+	return generate(&o) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -59,6 +60,8 @@ struct mod {
 static struct mod *modules;
 static bool need_init = true;
 static struct kmod_ctx *ctx;
+/* modprobe --parallel inserts modules from several threads */
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void parse_retcodes(struct mod *_modules, const char *s)
 {
@@ -224,6 +227,19 @@ static uint8_t elf_identify(void *mem)
 
 TS_EXPORT long init_module(void *mem, unsigned long len, const char *args);
 
+static long __init_module(void *mem, unsigned long len, const char *args);
+
+long init_module(void *mem, unsigned long len, const char *args)
+{
+	long err;
+
+	pthread_mutex_lock(&init_lock);
+	err = __init_module(mem, len, args);
+	pthread_mutex_unlock(&init_lock);
+
+	return err;
+}
+
 /*
  * Default behavior is to try to mimic init_module behavior inside the kernel.
  * If it is a simple test that you know the error code, set the return code
@@ -233,7 +249,7 @@ TS_EXPORT long init_module(void *mem, unsigned long len, const char *args);
  * This is because we want to be able to pass dummy modules (and not real
  * ones) and it still work.
  */
-long init_module(void *mem, unsigned long len, const char *args)
+static long __init_module(void *mem, unsigned long len, const char *args)
 {
 	const char *modname;
 	struct kmod_elf *elf;
@@ -355,9 +371,10 @@ TS_EXPORT long int syscall(long int __sysno, ...)
 		return ret;
 	}
 
-	if (__sysno == __NR_gettid) {
+	if (__sysno == __NR_gettid || __sysno == __NR_capget) {
 		static void *nextlib = NULL;
 		static long (*nextlib_syscall)(long number, ...);
+		void *hdr, *data;
 
 		if (nextlib_syscall == NULL) {
 #ifdef RTLD_NEXT
@@ -373,7 +390,16 @@ TS_EXPORT long int syscall(long int __sysno, ...)
 			}
 		}
 
-		return nextlib_syscall(__NR_gettid);
+		if (__sysno == __NR_gettid)
+			return nextlib_syscall(__NR_gettid);
+
+		/* kmod server checks the capabilities of its clients */
+		va_start(ap, __sysno);
+		hdr = va_arg(ap, void *);
+		data = va_arg(ap, void *);
+		va_end(ap);
+
+		return nextlib_syscall(__NR_capget, hdr, data);
 	}
 
 	/*
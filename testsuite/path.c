@@ -30,6 +30,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -41,6 +42,14 @@ static void *nextlib;
 static const char *rootpath;
 static size_t rootpathlen;
 
+/* read by testsuite_calls() through dlsym(), so tests can count the I/O */
+TS_EXPORT unsigned long testsuite_call_counters[_TS_CALL_LAST];
+
+static inline void count_call(enum testsuite_call call)
+{
+	__atomic_fetch_add(&testsuite_call_counters[call], 1, __ATOMIC_RELAXED);
+}
+
 static inline bool need_trap(const char *path)
 {
 	return path != NULL && path[0] == '/'
@@ -102,13 +111,14 @@ static void *get_libc_func(const char *f)
 }
 
 /* wrapper template for a function with one "const char* path" argument */
-#define WRAP_1ARG(rettype, failret, name) \
+#define WRAP_1ARG(rettype, failret, name, call) \
 TS_EXPORT rettype name(const char *path) \
 { \
 	const char *p;				\
 	char buf[PATH_MAX * 2];                 \
 	static rettype (*_fn)(const char*);	\
 						\
+	count_call(call);			\
 	if (!get_rootpath(__func__))		\
 		return failret;			\
 	_fn = get_libc_func(#name);		\
@@ -119,13 +129,14 @@ TS_EXPORT rettype name(const char *path) \
 }
 
 /* wrapper template for a function with "const char* path" and another argument */
-#define WRAP_2ARGS(rettype, failret, name, arg2t)	\
+#define WRAP_2ARGS(rettype, failret, name, arg2t, call)	\
 TS_EXPORT rettype name(const char *path, arg2t arg2)	\
 { \
 	const char *p;					\
 	char buf[PATH_MAX * 2];				\
 	static rettype (*_fn)(const char*, arg2t arg2);	\
 							\
+	count_call(call);				\
 	if (!get_rootpath(__func__))			\
 		return failret;				\
 	_fn = get_libc_func(#name);			\
@@ -143,6 +154,7 @@ TS_EXPORT int open ## suffix (const char *path, int flags, ...)	\
 	char buf[PATH_MAX * 2];					\
 	static int (*_fn)(const char *path, int flags, ...);	\
 								\
+	count_call(TS_CALL_OPEN);				\
 	if (!get_rootpath(__func__))				\
 		return -1;					\
 	_fn = get_libc_func("open" #suffix);			\
@@ -163,6 +175,35 @@ TS_EXPORT int open ## suffix (const char *path, int flags, ...)	\
 	return _fn(p, flags);					\
 }
 
+/* wrapper template for openat family: only absolute paths are trapped */
+#define WRAP_OPENAT(suffix)					\
+TS_EXPORT int openat ## suffix (int dirfd, const char *path, int flags, ...) \
+{ \
+	const char *p;						\
+	char buf[PATH_MAX * 2];					\
+	static int (*_fn)(int dirfd, const char *path, int flags, ...); \
+								\
+	count_call(TS_CALL_OPEN);				\
+	if (!get_rootpath(__func__))				\
+		return -1;					\
+	_fn = get_libc_func("openat" #suffix);			\
+	p = trap_path(path, buf);				\
+	if (p == NULL)						\
+		return -1;					\
+								\
+	if (flags & O_CREAT) {					\
+		mode_t mode;					\
+		va_list ap;					\
+								\
+		va_start(ap, flags);				\
+		mode = va_arg(ap, mode_t);			\
+		va_end(ap);					\
+		return _fn(dirfd, p, flags, mode);		\
+	}							\
+								\
+	return _fn(dirfd, p, flags);				\
+}
+
 /*
  * wrapper template for __xstat family
  * This family got deprecated/dropped in glibc 2.32.9000, but we still need
@@ -182,6 +223,7 @@ TS_EXPORT int prefix ## stat ## suffix (int ver,	    \
 		          struct stat ## suffix *);	    \
 	_fn = get_libc_func(#prefix "stat" #suffix);	    \
 							    \
+	count_call(TS_CALL_STAT);			    \
 	if (!get_rootpath(__func__))			    \
 		return -1;				    \
 	p = trap_path(path, buf);			    \
@@ -191,20 +233,38 @@ TS_EXPORT int prefix ## stat ## suffix (int ver,	    \
 	return _fn(ver, p, st);				    \
 }
 
-WRAP_1ARG(DIR*, NULL, opendir);
-WRAP_1ARG(int, -1, chdir);
-
-WRAP_2ARGS(FILE*, NULL, fopen, const char*);
-WRAP_2ARGS(FILE*, NULL, fopen64, const char*);
-WRAP_2ARGS(int, -1, mkdir, mode_t);
-WRAP_2ARGS(int, -1, access, int);
-WRAP_2ARGS(int, -1, stat, struct stat*);
-WRAP_2ARGS(int, -1, lstat, struct stat*);
-WRAP_2ARGS(int, -1, stat64, struct stat64*);
-WRAP_2ARGS(int, -1, lstat64, struct stat64*);
+WRAP_1ARG(DIR*, NULL, opendir, TS_CALL_OPEN);
+WRAP_1ARG(int, -1, chdir, TS_CALL_OTHER);
+
+WRAP_2ARGS(FILE*, NULL, fopen, const char*, TS_CALL_OPEN);
+WRAP_2ARGS(FILE*, NULL, fopen64, const char*, TS_CALL_OPEN);
+WRAP_2ARGS(int, -1, mkdir, mode_t, TS_CALL_OTHER);
+WRAP_2ARGS(int, -1, access, int, TS_CALL_STAT);
+WRAP_2ARGS(int, -1, stat, struct stat*, TS_CALL_STAT);
+WRAP_2ARGS(int, -1, lstat, struct stat*, TS_CALL_STAT);
+WRAP_2ARGS(int, -1, stat64, struct stat64*, TS_CALL_STAT);
+WRAP_2ARGS(int, -1, lstat64, struct stat64*, TS_CALL_STAT);
 WRAP_OPEN(64);
+WRAP_OPENAT(64);
 
 WRAP_OPEN();
+WRAP_OPENAT();
+
+TS_EXPORT int inotify_add_watch(int fd, const char *path, uint32_t mask)
+{
+	const char *p;
+	char buf[PATH_MAX * 2];
+	static int (*_fn)(int fd, const char *path, uint32_t mask);
+
+	count_call(TS_CALL_OTHER);
+	if (!get_rootpath(__func__))
+		return -1;
+	_fn = get_libc_func("inotify_add_watch");
+	p = trap_path(path, buf);
+	if (p == NULL)
+		return -1;
+	return (*_fn)(fd, p, mask);
+}
 
 #ifdef HAVE___XSTAT
 WRAP_VERSTAT(__x,);
@@ -0,0 +1,406 @@
+/*
+ * Copyright (C) 2026  kmod contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Performance gate, run by "make check-perf": on a tree from gen-rootfs,
+ * time depmod with one and with all the CPUs, a cold modprobe
+ * --show-depends and a storm of lookups in a single context, and compare
+ * the wall time and the peak RSS (from wait4()) of each with a baseline.
+ * Anything slower or bigger than the baseline plus the tolerance fails.
+ * Timings depend on the machine: regenerate the baseline with -u on the
+ * one running the gate.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <shared/macro.h>
+#include <shared/util.h>
+
+#include <libkmod/libkmod.h>
+
+#define KVER "4.4.4"
+#define ROUNDS 3
+#define STORM_QUERIES 8000
+#define N_RESULTS 4
+/* below this, a difference in wall time is noise rather than a regression */
+#define SLACK_USEC 5000
+/* last of a dependency chain with gen-rootfs' defaults */
+#define DEEP_MODULE "synth5999"
+
+struct result {
+	char name[32];
+	uint64_t usec;
+	long rss_kib;
+};
+
+static const char cmdopts_s[] = "b:t:ukh";
+static const struct option cmdopts[] = {
+	{ "baseline", required_argument, 0, 'b' },
+	{ "tolerance", required_argument, 0, 't' },
+	{ "update", no_argument, 0, 'u' },
+	{ "keep", no_argument, 0, 'k' },
+	{ "help", no_argument, 0, 'h' },
+	{ }
+};
+
+static void help(void)
+{
+	printf("Usage:\n"
+	       "\t%s -b FILE [options]\n"
+	       "Options:\n"
+	       "\t-b, --baseline=FILE    Results to compare with\n"
+	       "\t-t, --tolerance=PCT    Allowed regression, in percent (default 50)\n"
+	       "\t-u, --update           Write the results to the baseline instead\n"
+	       "\t-k, --keep             Keep the generated tree\n"
+	       "\t-h, --help             Show this help\n",
+	       program_invocation_short_name);
+}
+
+/*
+ * Run @argv with the output discarded, @rounds times: keep the fastest
+ * run, which is the least disturbed by the rest of the machine, and the
+ * biggest peak RSS.
+ */
+static int measure(const char *name, const char *const argv[],
+				unsigned int rounds, struct result *r)
+{
+	unsigned int i;
+
+	memset(r, 0, sizeof(*r));
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->usec = UINT64_MAX;
+
+	for (i = 0; i < rounds; i++) {
+		struct rusage ru;
+		uint64_t t0, t;
+		int status;
+		pid_t pid;
+
+		t0 = now_usec();
+		pid = fork();
+		if (pid < 0)
+			return -errno;
+
+		if (pid == 0) {
+			int fd = open("/dev/null", O_WRONLY);
+
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			execv(argv[0], (char **) argv);
+			_exit(EXIT_FAILURE);
+		}
+
+		if (wait4(pid, &status, 0, &ru) < 0)
+			return -errno;
+		t = now_usec() - t0;
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "%s: %s failed\n", name, argv[0]);
+			return -EINVAL;
+		}
+
+		if (t < r->usec)
+			r->usec = t;
+		if (ru.ru_maxrss > r->rss_kib)
+			r->rss_kib = ru.ru_maxrss;
+	}
+
+	return 0;
+}
+
+/*
+ * The child side of the lookup storm: the modaliases of the devices come
+ * from modules.alias, with the wildcards filled in, and one in four is for
+ * a device without a driver.
+ */
+static int do_storm(const char *dirname)
+{
+	struct kmod_ctx *ctx;
+	char path[PATH_MAX], line[PATH_MAX];
+	unsigned int n = 0;
+	FILE *fp;
+	int err = 0;
+
+	snprintf(path, sizeof(path), "%s/modules.alias", dirname);
+	fp = fopen(path, "re");
+	if (fp == NULL)
+		return EXIT_FAILURE;
+
+	ctx = kmod_new(dirname, NULL);
+	if (ctx == NULL) {
+		fclose(fp);
+		return EXIT_FAILURE;
+	}
+	kmod_load_resources(ctx);
+
+	while (n < STORM_QUERIES && fgets(line, sizeof(line), fp) != NULL) {
+		struct kmod_list *list = NULL;
+		char *alias, *p;
+
+		if (strncmp(line, "alias ", 6) != 0)
+			continue;
+
+		alias = line + 6;
+		p = strchr(alias, ' ');
+		if (p == NULL)
+			continue;
+		*p = '\0';
+
+		for (p = alias; *p != '\0'; p++) {
+			if (*p == '*' || *p == '?')
+				*p = '0';
+		}
+
+		if (n % 4 == 3)
+			alias[0] = 'x';
+
+		if (kmod_module_new_from_lookup(ctx, alias, &list) < 0)
+			err = -EINVAL;
+		kmod_module_unref_list(list);
+		n++;
+	}
+
+	fclose(fp);
+	kmod_unref(ctx);
+
+	return err < 0 || n == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int read_baseline(const char *path, struct result *base, size_t n)
+{
+	char line[256];
+	FILE *fp;
+	size_t i;
+
+	fp = fopen(path, "re");
+	if (fp == NULL)
+		return -errno;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char name[32];
+		unsigned long long usec;
+		long rss;
+
+		if (line[0] == '#' ||
+			sscanf(line, "%31s %llu %ld", name, &usec, &rss) != 3)
+			continue;
+
+		for (i = 0; i < n; i++) {
+			if (streq(base[i].name, name)) {
+				base[i].usec = usec;
+				base[i].rss_kib = rss;
+			}
+		}
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+static int write_baseline(const char *path, const struct result *res,
+								size_t n)
+{
+	FILE *fp;
+	size_t i;
+
+	fp = fopen(path, "we");
+	if (fp == NULL)
+		return -errno;
+
+	fprintf(fp, "# generated by perf-gate -u: name, wall time (us), peak RSS (KiB)\n");
+	for (i = 0; i < n; i++)
+		fprintf(fp, "%s %llu %ld\n", res[i].name,
+				(unsigned long long) res[i].usec, res[i].rss_kib);
+
+	return fclose(fp) == 0 ? 0 : -errno;
+}
+
+static bool check(const struct result *r, const struct result *b,
+							unsigned int tolerance)
+{
+	double dt, drss;
+	bool ok;
+
+	if (b->usec == 0) {
+		printf("%-20s %10.1f ms %8ld KiB  (no baseline)\n", r->name,
+			r->usec / 1000.0, r->rss_kib);
+		return true;
+	}
+
+	dt = ((double) r->usec / b->usec - 1) * 100;
+	drss = ((double) r->rss_kib / b->rss_kib - 1) * 100;
+	ok = (dt <= tolerance || r->usec < b->usec + SLACK_USEC) &&
+							drss <= tolerance;
+
+	printf("%-20s %10.1f ms (%+5.0f%%) %8ld KiB (%+5.0f%%)%s\n", r->name,
+		r->usec / 1000.0, dt, r->rss_kib, drss,
+		ok ? "" : "  REGRESSION");
+
+	return ok;
+}
+
+static int run_gate(const char *root, const char *baseline,
+				unsigned int tolerance, bool update)
+{
+	char self[PATH_MAX], dirname[PATH_MAX];
+	const char *const gen[] = {
+		ABS_TOP_BUILDDIR "/testsuite/gen-rootfs", "-o", root,
+		"-V", KVER, NULL,
+	};
+	const char *const depmod_serial[] = {
+		ABS_TOP_BUILDDIR "/tools/depmod", "-b", root,
+		"-j", "1", KVER, NULL,
+	};
+	const char *const depmod_parallel[] = {
+		ABS_TOP_BUILDDIR "/tools/depmod", "-b", root,
+		"-j", "0", KVER, NULL,
+	};
+	const char *const modprobe[] = {
+		ABS_TOP_BUILDDIR "/tools/modprobe", "-d", root,
+		"-S", KVER, "--show-depends", DEEP_MODULE, NULL,
+	};
+	const char *const storm[] = {
+		self, "--storm", dirname, NULL,
+	};
+	struct result res[N_RESULTS], base[N_RESULTS];
+	struct result gen_res;
+	bool ok = true;
+	size_t i;
+	ssize_t len;
+	int err;
+
+	len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len < 0)
+		return -errno;
+	self[len] = '\0';
+	snprintf(dirname, sizeof(dirname), "%s/lib/modules/" KVER, root);
+
+	err = measure("gen-rootfs", gen, 1, &gen_res);
+	if (err < 0)
+		return err;
+
+	if ((err = measure("depmod-serial", depmod_serial, ROUNDS, &res[0])) < 0 ||
+	    (err = measure("depmod-parallel", depmod_parallel, ROUNDS, &res[1])) < 0 ||
+	    (err = measure("modprobe-cold", modprobe, ROUNDS, &res[2])) < 0 ||
+	    (err = measure("lookup-storm", storm, ROUNDS, &res[3])) < 0)
+		return err;
+
+	if (update) {
+		err = write_baseline(baseline, res, N_RESULTS);
+		if (err < 0)
+			fprintf(stderr, "could not write %s: %s\n", baseline,
+							strerror(-err));
+		return err;
+	}
+
+	memset(base, 0, sizeof(base));
+	for (i = 0; i < N_RESULTS; i++)
+		memcpy(base[i].name, res[i].name, sizeof(base[i].name));
+
+	err = read_baseline(baseline, base, N_RESULTS);
+	if (err < 0) {
+		fprintf(stderr, "could not read %s: %s\n", baseline,
+							strerror(-err));
+		return err;
+	}
+
+	for (i = 0; i < N_RESULTS; i++)
+		ok = check(&res[i], &base[i], tolerance) && ok;
+
+	return ok ? 0 : -EINVAL;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *baseline = NULL;
+	unsigned int tolerance = 50;
+	char root[] = "/tmp/kmod-perf-gate-XXXXXX";
+	bool update = false, keep = false;
+	int err;
+
+	if (argc == 3 && streq(argv[1], "--storm"))
+		return do_storm(argv[2]);
+
+	for (;;) {
+		int c, idx = 0;
+		char *end;
+
+		c = getopt_long(argc, argv, cmdopts_s, cmdopts, &idx);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'b':
+			baseline = optarg;
+			break;
+		case 't':
+			tolerance = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0') {
+				fprintf(stderr, "invalid tolerance: '%s'\n",
+								optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'u':
+			update = true;
+			break;
+		case 'k':
+			keep = true;
+			break;
+		case 'h':
+			help();
+			return EXIT_SUCCESS;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (baseline == NULL || optind < argc) {
+		help();
+		return EXIT_FAILURE;
+	}
+
+	if (mkdtemp(root) == NULL) {
+		fprintf(stderr, "could not create temporary directory: %m\n");
+		return EXIT_FAILURE;
+	}
+
+	err = run_gate(root, baseline, tolerance, update);
+
+	if (keep) {
+		printf("tree kept in %s\n", root);
+	} else {
+		char cmd[PATH_MAX];
+
+		snprintf(cmd, sizeof(cmd), "rm -rf '%s'", root);
+		if (system(cmd) != 0)
+			fprintf(stderr, "could not remove %s\n", root);
+	}
+
+	return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
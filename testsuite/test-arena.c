@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2026  kmod contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <shared/arena.h>
+#include <shared/util.h>
+
+#include "testsuite.h"
+
+static int test_arena_alloc(const struct test *t)
+{
+	struct arena arena = { };
+	char *prev = NULL;
+	unsigned int i;
+
+	/* enough to span several chunks */
+	for (i = 0; i < 20000; i++) {
+		uint64_t *v = arena_alloc(&arena, sizeof(*v) + (i & 7));
+
+		assert_return(v != NULL, EXIT_FAILURE);
+		assert_return(((uintptr_t) v & (sizeof(uint64_t) - 1)) == 0,
+			      EXIT_FAILURE);
+		*v = i;
+		if (prev != NULL)
+			assert_return(*(uint64_t *) prev == i - 1, EXIT_FAILURE);
+		prev = (char *) v;
+	}
+
+	arena_release(&arena);
+	assert_return(arena.chunks == NULL, EXIT_FAILURE);
+
+	return 0;
+}
+DEFINE_TEST(test_arena_alloc,
+		.description = "test arena for aligned allocations over many chunks");
+
+static int test_arena_large(const struct test *t)
+{
+	struct arena arena = { };
+	char *small, *large, *small2;
+	size_t large_size = 1024 * 1024;
+
+	small = arena_strdup(&arena, "before");
+	large = arena_alloc(&arena, large_size);
+	small2 = arena_strdup(&arena, "after");
+	assert_return(small != NULL && large != NULL && small2 != NULL,
+		      EXIT_FAILURE);
+
+	memset(large, 'x', large_size);
+
+	/* the chunk of the small blocks is still in use after a large one */
+	assert_return(small2 == small + 8, EXIT_FAILURE);
+	assert_return(streq(small, "before"), EXIT_FAILURE);
+	assert_return(streq(small2, "after"), EXIT_FAILURE);
+
+	arena_release(&arena);
+
+	return 0;
+}
+DEFINE_TEST(test_arena_large,
+		.description = "test arena for blocks larger than a chunk");
+
+static int test_arena_memdup(const struct test *t)
+{
+	struct arena arena = { };
+	const char data[] = { 'a', '\0', 'b', '\0', 'c' };
+	char *p;
+
+	p = arena_memdup(&arena, data, sizeof(data));
+	assert_return(p != NULL, EXIT_FAILURE);
+	assert_return(memcmp(p, data, sizeof(data)) == 0, EXIT_FAILURE);
+
+	p = arena_strdup(&arena, "");
+	assert_return(p != NULL && p[0] == '\0', EXIT_FAILURE);
+
+	arena_release(&arena);
+
+	/* released arena can be used again */
+	p = arena_strdup(&arena, "again");
+	assert_return(p != NULL && streq(p, "again"), EXIT_FAILURE);
+	arena_release(&arena);
+
+	return 0;
+}
+DEFINE_TEST(test_arena_memdup,
+		.description = "test arena_memdup and arena_strdup");
+
+TESTSUITE_MAIN();
@@ -102,4 +102,106 @@ DEFINE_TEST(blacklist_1,
 	.need_spawn = true,
 );
 
+static bool has_blacklist(struct kmod_ctx *ctx, const char *modname,
+							unsigned int *count)
+{
+	struct kmod_config_iter *iter;
+	bool found = false;
+
+	*count = 0;
+	iter = kmod_config_get_blacklists(ctx);
+	while (kmod_config_iter_next(iter)) {
+		if (streq(kmod_config_iter_get_key(iter), modname))
+			found = true;
+		(*count)++;
+	}
+	kmod_config_iter_free_iter(iter);
+
+	return found;
+}
+
+static int write_config(const char *contents)
+{
+	FILE *fp = fopen(SYSCONFDIR "/modprobe.d/modprobe.conf", "we");
+
+	if (fp == NULL)
+		return -errno;
+
+	fputs(contents, fp);
+	return fclose(fp) == 0 ? 0 : -errno;
+}
+
+static int blacklist_cache(const struct test *t)
+{
+	static const char config[] = "blacklist floppy\nblacklist pcspkr\n";
+	struct kmod_ctx *ctx;
+	unsigned int count;
+	int err;
+
+	ctx = kmod_new(NULL, NULL);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	err = kmod_config_write_cache(kmod_get_config(ctx));
+	kmod_unref(ctx);
+	if (err < 0) {
+		ERR("could not write cache: %s\n", strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	/* kernel command line entries come on top of the cached ones */
+	ctx = kmod_new(NULL, NULL);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	if (!has_blacklist(ctx, "pcspkr", &count) || count != 3 ||
+			!has_blacklist(ctx, "mod_kcmdline", &count)) {
+		ERR("wrong blacklist from cache: %u entries\n", count);
+		goto fail;
+	}
+
+	if (!kmod_get_config(ctx)->from_cache) {
+		ERR("compiled configuration was not used\n");
+		goto fail;
+	}
+	kmod_unref(ctx);
+
+	/* any change in the sources makes it parse them again */
+	err = write_config("blacklist floppy\nblacklist pcspkr\nblacklist ext4\n");
+	if (err < 0) {
+		ERR("could not change config: %s\n", strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	ctx = kmod_new(NULL, NULL);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	if (!has_blacklist(ctx, "ext4", &count) || count != 4) {
+		ERR("wrong blacklist after change: %u entries\n", count);
+		goto fail;
+	}
+
+	if (kmod_get_config(ctx)->from_cache) {
+		ERR("stale compiled configuration was used\n");
+		goto fail;
+	}
+	kmod_unref(ctx);
+
+	return write_config(config) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+fail:
+	kmod_unref(ctx);
+	return EXIT_FAILURE;
+}
+
+DEFINE_TEST(blacklist_cache,
+	.description = "check if blacklists are loaded from the compiled configuration",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-blacklist-cache/",
+		[TC_UNAME_R] = "4.4.4",
+	},
+	.need_spawn = true,
+);
+
 TESTSUITE_MAIN();
@@ -17,6 +17,7 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -86,4 +87,161 @@ DEFINE_TEST(test_dependencies,
 	},
 	.need_spawn = true);
 
+static char probe_buf[1024];
+
+static void probe_list_print(struct kmod_module *m, bool install,
+							const char *options)
+{
+	size_t len = strlen(probe_buf);
+
+	snprintf(probe_buf + len, sizeof(probe_buf) - len, "%s%s",
+				len > 0 ? " " : "", kmod_module_get_name(m));
+}
+
+static int probe_list(struct kmod_ctx *ctx, char *buf, size_t buflen)
+{
+	struct kmod_module *mod;
+	int err;
+
+	err = kmod_module_new_from_name(ctx, "mod-foo", &mod);
+	if (err < 0)
+		return err;
+
+	probe_buf[0] = '\0';
+	err = kmod_module_probe_insert_module(mod, KMOD_PROBE_DRY_RUN,
+					NULL, NULL, NULL, probe_list_print);
+	kmod_module_unref(mod);
+
+	snprintf(buf, buflen, "%s", probe_buf);
+	return err;
+}
+
+static noreturn int test_probe_list_cached(const struct test *t)
+{
+	char first[sizeof(probe_buf)], again[sizeof(probe_buf)];
+	struct kmod_ctx *ctx;
+
+	ctx = kmod_new(NULL, NULL);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	if (probe_list(ctx, first, sizeof(first)) < 0)
+		exit(EXIT_FAILURE);
+	printf("%s\n", first);
+
+	/* answered from the cache */
+	if (probe_list(ctx, again, sizeof(again)) < 0 || !streq(first, again))
+		exit(EXIT_FAILURE);
+
+	/* modules of the cached list released: computed again */
+	if (kmod_set_module_pool_size(ctx, 0) < 0 ||
+			probe_list(ctx, again, sizeof(again)) < 0 ||
+			!streq(first, again))
+		exit(EXIT_FAILURE);
+
+	kmod_unref(ctx);
+
+	exit(EXIT_SUCCESS);
+}
+DEFINE_TEST(test_probe_list_cached,
+	.description = "test if cached probe lists match the computed ones",
+	.config = {
+		[TC_UNAME_R] = TEST_UNAME,
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-dependencies/",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-dependencies/correct-probe-list.txt",
+	},
+	.need_spawn = true);
+
+#define N_THREADS 8
+#define N_ITERATIONS 500
+
+static void *lookup_thread(void *data)
+{
+	struct kmod_ctx *ctx = data;
+	unsigned int i;
+
+	for (i = 0; i < N_ITERATIONS; i++) {
+		struct kmod_list *list = NULL, *deps, *l;
+		struct kmod_module *mod;
+		const char *path;
+		size_t len = 0;
+
+		if (kmod_module_new_from_lookup(ctx, "mod-foo", &list) < 0 ||
+				list == NULL)
+			return (void *) "lookup failed";
+
+		mod = kmod_module_get_module(list);
+		kmod_module_unref_list(list);
+
+		path = kmod_module_get_path(mod);
+		if (path == NULL || !streq(path, "/lib/modules/" TEST_UNAME
+						"/kernel/fs/mod-foo.ko"))
+			return (void *) "wrong path";
+
+		deps = kmod_module_get_dependencies(mod);
+		kmod_list_foreach(l, deps) {
+			struct kmod_module *m = kmod_module_get_module(l);
+			bool has_path = kmod_module_get_path(m) != NULL;
+
+			kmod_module_unref(m);
+			if (!has_path)
+				return (void *) "dependency without path";
+			len++;
+		}
+		kmod_module_unref_list(deps);
+		kmod_module_unref(mod);
+
+		if (len != 3)
+			return (void *) "wrong dependencies";
+	}
+
+	return NULL;
+}
+
+static noreturn int test_dependencies_threads(const struct test *t)
+{
+	pthread_t threads[N_THREADS];
+	struct kmod_ctx *ctx;
+	int ret = EXIT_SUCCESS;
+	unsigned int i;
+
+	ctx = kmod_new(NULL, NULL);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	/* keep modules going in and out of the pool and the lookup cache */
+	if (kmod_load_resources(ctx) < 0 ||
+			kmod_set_module_pool_size(ctx, 1) < 0 ||
+			kmod_set_lookup_cache_size(ctx, 1) < 0)
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < N_THREADS; i++) {
+		if (pthread_create(&threads[i], NULL, lookup_thread, ctx) != 0)
+			exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < N_THREADS; i++) {
+		void *err;
+
+		pthread_join(threads[i], &err);
+		if (err != NULL) {
+			ERR("thread %u: %s\n", i, (const char *) err);
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	kmod_unref(ctx);
+
+	exit(ret);
+}
+DEFINE_TEST(test_dependencies_threads,
+	.description = "test if lookups and dependencies work from several threads",
+	.config = {
+		[TC_UNAME_R] = TEST_UNAME,
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-dependencies/",
+	},
+	.need_spawn = true);
+
 TESTSUITE_MAIN();
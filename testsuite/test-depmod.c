@@ -15,17 +15,51 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <libkmod/libkmod.h>
+
+#include <shared/util.h>
 
 #include "testsuite.h"
 
 #define MODULES_UNAME "4.4.4"
+
+/*
+ * Run depmod with @args and wait for it, for the tests that change the tree
+ * between runs. Only what depmod does is redirected to the rootfs: the test
+ * itself has to use the real paths.
+ */
+static int run_depmod(const char *const args[])
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+	if (pid == 0) {
+		test_spawn_prog(args[0], args);
+		_exit(EXIT_FAILURE);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+			WEXITSTATUS(status) != EXIT_SUCCESS)
+		return -EINVAL;
+
+	return 0;
+}
+
 #define MODULES_ORDER_ROOTFS TESTSUITE_ROOTFS "test-depmod/modules-order-compressed"
 #define MODULES_ORDER_LIB_MODULES MODULES_ORDER_ROOTFS "/lib/modules/" MODULES_UNAME
 static noreturn int depmod_modules_order_for_compressed(const struct test *t)
@@ -86,6 +120,560 @@ DEFINE_TEST(depmod_modules_outdir,
 		},
 	});
 
+#define JOBS_ROOTFS TESTSUITE_ROOTFS "test-depmod/jobs"
+#define JOBS_LIB_MODULES JOBS_ROOTFS "/lib/modules/" MODULES_UNAME
+static noreturn int depmod_jobs(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/depmod";
+	const char *const args[] = {
+		progname,
+		"-j", "3",
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+
+DEFINE_TEST(depmod_jobs,
+	.description = "check if depmod generates the same files with several jobs",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = JOBS_ROOTFS,
+	},
+	.output = {
+		.files = (const struct keyval[]) {
+			{ JOBS_LIB_MODULES "/modules.dep",
+			  JOBS_ROOTFS "/correct-modules.dep" },
+			{ JOBS_LIB_MODULES "/modules.alias",
+			  JOBS_ROOTFS "/correct-modules.alias" },
+			{ JOBS_LIB_MODULES "/modules.symbols",
+			  JOBS_ROOTFS "/correct-modules.symbols" },
+			{ }
+		},
+	});
+
+#define FILTER_ROOTFS TESTSUITE_ROOTFS "test-depmod/filter"
+static int lookup_count(struct kmod_ctx *ctx, const char *alias)
+{
+	struct kmod_list *list = NULL, *l;
+	int n = 0;
+
+	if (kmod_module_new_from_lookup(ctx, alias, &list) < 0)
+		return -1;
+	kmod_list_foreach(l, list)
+		n++;
+	kmod_module_unref_list(list);
+
+	return n;
+}
+
+static noreturn int depmod_index_filter(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/depmod";
+	const char *const args[] = {
+		progname,
+		NULL,
+	};
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	bool ok;
+
+	if (run_depmod(args) < 0)
+		exit(EXIT_FAILURE);
+
+	/*
+	 * The filters must not hide any key. Without modules.dep.ids.bin,
+	 * modules are looked up in modules.dep.bin.
+	 */
+	if (unlink(FILTER_ROOTFS "/lib/modules/" MODULES_UNAME
+						"/modules.dep.ids.bin") < 0)
+		exit(EXIT_FAILURE);
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL || kmod_load_resources(ctx) < 0)
+		exit(EXIT_FAILURE);
+
+	ok = lookup_count(ctx, "hpsa") == 1 &&
+		lookup_count(ctx, "scsi_mod") == 1 &&
+		lookup_count(ctx, "symbol:dummy_export") == 1 &&
+		lookup_count(ctx, "hpsb") == 0 &&
+		lookup_count(ctx, "scsi_mo") == 0 &&
+		lookup_count(ctx, "symbol:dummy_exports") == 0;
+
+	kmod_unref(ctx);
+
+	exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+DEFINE_TEST(depmod_index_filter,
+	.description = "check that lookups through the filters of the indexes depmod writes find all the keys",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = FILTER_ROOTFS,
+	},
+	.need_spawn = true);
+
+#define CACHE_ROOTFS TESTSUITE_ROOTFS "test-depmod/cache"
+#define CACHE_LIB_MODULES CACHE_ROOTFS "/lib/modules/" MODULES_UNAME
+static noreturn int depmod_cache(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/depmod";
+	const char *const args[] = {
+		progname,
+		NULL,
+	};
+	const char *modpath = "/lib/modules/" MODULES_UNAME
+					"/kernel/drivers/scsi/hpsa.ko";
+	struct timespec times[2];
+	struct stat st;
+	char *zeros;
+	int fd;
+
+	/* a first run fills the cache */
+	if (run_depmod(args) < 0)
+		exit(EXIT_FAILURE);
+
+	/*
+	 * Wipe a module without changing its size nor its mtime: the same
+	 * files can only be generated again if it's taken from the cache.
+	 */
+	fd = open(modpath, O_WRONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		exit(EXIT_FAILURE);
+	zeros = calloc(1, st.st_size);
+	if (zeros == NULL || pwrite(fd, zeros, st.st_size, 0) != st.st_size)
+		exit(EXIT_FAILURE);
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	if (futimens(fd, times) < 0)
+		exit(EXIT_FAILURE);
+	close(fd);
+	free(zeros);
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+
+DEFINE_TEST(depmod_cache,
+	.description = "check if depmod takes unchanged modules from its cache",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = CACHE_ROOTFS,
+	},
+	.output = {
+		.files = (const struct keyval[]) {
+			{ CACHE_LIB_MODULES "/modules.dep",
+			  CACHE_ROOTFS "/correct-modules.dep" },
+			{ CACHE_LIB_MODULES "/modules.alias",
+			  CACHE_ROOTFS "/correct-modules.alias" },
+			{ CACHE_LIB_MODULES "/modules.symbols",
+			  CACHE_ROOTFS "/correct-modules.symbols" },
+			{ }
+		},
+	},
+	.need_spawn = true);
+
+#define STAMPS_ROOTFS TESTSUITE_ROOTFS "test-depmod/stamps"
+#define STAMPS_LIB_MODULES STAMPS_ROOTFS "/lib/modules/" MODULES_UNAME
+static noreturn int depmod_stamps(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/depmod";
+	const char *const args[] = {
+		progname,
+		NULL,
+	};
+	const char *const args_quick[] = {
+		progname,
+		"-A",
+		NULL,
+	};
+	struct timespec times[2];
+
+	/* a first run writes the stamps of the directories */
+	if (run_depmod(args) < 0)
+		exit(EXIT_FAILURE);
+
+	/*
+	 * Move a newer module in, as a package manager would: -A must notice
+	 * it in the directory that changed.
+	 */
+	if (clock_gettime(CLOCK_REALTIME, &times[0]) < 0)
+		exit(EXIT_FAILURE);
+	times[0].tv_sec += 3600;
+	times[1] = times[0];
+	if (utimensat(AT_FDCWD, STAMPS_ROOTFS "/hpsa.ko", times, 0) < 0 ||
+			rename(STAMPS_ROOTFS "/hpsa.ko", STAMPS_LIB_MODULES
+				"/kernel/drivers/scsi/hpsa.ko") < 0)
+		exit(EXIT_FAILURE);
+
+	test_spawn_prog(progname, args_quick);
+	exit(EXIT_FAILURE);
+}
+
+DEFINE_TEST(depmod_stamps,
+	.description = "check if depmod -A finds a new module with the stamps",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = STAMPS_ROOTFS,
+	},
+	.output = {
+		.files = (const struct keyval[]) {
+			{ STAMPS_LIB_MODULES "/modules.dep",
+			  STAMPS_ROOTFS "/correct-modules.dep" },
+			{ STAMPS_LIB_MODULES "/modules.alias",
+			  STAMPS_ROOTFS "/correct-modules.alias" },
+			{ }
+		},
+	},
+	.need_spawn = true);
+
+#define BATCH_ROOTFS TESTSUITE_ROOTFS "test-depmod/batch"
+#define BATCH_LIB_MODULES BATCH_ROOTFS "/lib/modules/" MODULES_UNAME
+#define BATCH_LIB_MODULES2 BATCH_ROOTFS "/lib/modules/4.4.5"
+static noreturn int depmod_batch(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/depmod";
+	const char *const args[] = {
+		progname,
+		"-j", "2",
+		MODULES_UNAME, "4.4.5",
+		NULL,
+	};
+
+	/* the same file in both trees, as with flavours of a kernel */
+	if (mkdir(BATCH_LIB_MODULES2 "/kernel/drivers/scsi", 0755) < 0 &&
+			errno != EEXIST)
+		exit(EXIT_FAILURE);
+	if (link(BATCH_LIB_MODULES "/kernel/drivers/scsi/hpsa.ko",
+		 BATCH_LIB_MODULES2 "/kernel/drivers/scsi/hpsa.ko") < 0)
+		exit(EXIT_FAILURE);
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+
+DEFINE_TEST(depmod_batch,
+	.description = "check if depmod generates the files of several kernels at once",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = BATCH_ROOTFS,
+	},
+	.output = {
+		.files = (const struct keyval[]) {
+			{ BATCH_LIB_MODULES "/modules.dep",
+			  BATCH_ROOTFS "/correct-modules.dep" },
+			{ BATCH_LIB_MODULES "/modules.alias",
+			  BATCH_ROOTFS "/correct-modules.alias" },
+			{ BATCH_LIB_MODULES2 "/modules.dep",
+			  BATCH_ROOTFS "/correct-modules.dep" },
+			{ BATCH_LIB_MODULES2 "/modules.alias",
+			  BATCH_ROOTFS "/correct-modules.alias" },
+			{ }
+		},
+	},
+	.need_spawn = true);
+
+#define SYNC_ROOTFS TESTSUITE_ROOTFS "test-depmod/sync"
+#define SYNC_LIB_MODULES SYNC_ROOTFS "/lib/modules/" MODULES_UNAME
+static noreturn int depmod_sync(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/depmod";
+	const char *const args[] = {
+		progname,
+		"-j", "3",
+		NULL,
+	};
+	const char *const args_sync[] = {
+		progname,
+		"-j", "3",
+		"--sync",
+		NULL,
+	};
+
+	/* the modules.bin written with the indexes in place */
+	if (run_depmod(args) < 0)
+		exit(EXIT_FAILURE);
+
+	/*
+	 * Keep it, and remove the indexes it packs: with --sync, it must be
+	 * made of the temporaries, not renamed in place yet.
+	 */
+	if (link(SYNC_LIB_MODULES "/modules.bin",
+		 SYNC_ROOTFS "/correct-modules.bin") < 0 ||
+	    unlink(SYNC_LIB_MODULES "/modules.dep.bin") < 0 ||
+	    unlink(SYNC_LIB_MODULES "/modules.alias.bin") < 0 ||
+	    unlink(SYNC_LIB_MODULES "/modules.symbols.bin") < 0)
+		exit(EXIT_FAILURE);
+
+	test_spawn_prog(progname, args_sync);
+	exit(EXIT_FAILURE);
+}
+
+DEFINE_TEST(depmod_sync,
+	.description = "check if depmod --sync generates the same files",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = SYNC_ROOTFS,
+	},
+	.output = {
+		.files = (const struct keyval[]) {
+			{ SYNC_LIB_MODULES "/modules.dep",
+			  SYNC_ROOTFS "/correct-modules.dep" },
+			{ SYNC_LIB_MODULES "/modules.alias",
+			  SYNC_ROOTFS "/correct-modules.alias" },
+			{ SYNC_LIB_MODULES "/modules.bin",
+			  SYNC_ROOTFS "/correct-modules.bin" },
+			{ }
+		},
+	},
+	.need_spawn = true);
+
+#define UNCHANGED_ROOTFS TESTSUITE_ROOTFS "test-depmod/unchanged"
+#define UNCHANGED_LIB_MODULES UNCHANGED_ROOTFS "/lib/modules/" MODULES_UNAME
+static noreturn int depmod_unchanged(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/depmod";
+	const char *const args[] = {
+		progname,
+		NULL,
+	};
+	struct stat before, after;
+
+	/* a second run only writes again the file that was removed */
+	if (run_depmod(args) < 0 ||
+	    stat(UNCHANGED_LIB_MODULES "/modules.dep.bin", &before) < 0 ||
+	    unlink(UNCHANGED_LIB_MODULES "/modules.alias") < 0 ||
+	    run_depmod(args) < 0)
+		exit(EXIT_FAILURE);
+
+	/* the same file, not a copy renamed over it */
+	if (stat(UNCHANGED_LIB_MODULES "/modules.dep.bin", &after) < 0 ||
+	    after.st_ino != before.st_ino ||
+	    after.st_mtim.tv_sec != before.st_mtim.tv_sec ||
+	    after.st_mtim.tv_nsec != before.st_mtim.tv_nsec) {
+		ERR("modules.dep.bin was written again\n");
+		exit(EXIT_FAILURE);
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+DEFINE_TEST(depmod_unchanged,
+	.description = "check if depmod keeps the files that don't change",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = UNCHANGED_ROOTFS,
+	},
+	.output = {
+		.files = (const struct keyval[]) {
+			{ UNCHANGED_LIB_MODULES "/modules.dep",
+			  UNCHANGED_ROOTFS "/correct-modules.dep" },
+			{ UNCHANGED_LIB_MODULES "/modules.alias",
+			  UNCHANGED_ROOTFS "/correct-modules.alias" },
+			{ }
+		},
+	},
+	.need_spawn = true);
+
+#define DELTA_ROOTFS TESTSUITE_ROOTFS "test-depmod/delta"
+#define DELTA_LIB_MODULES DELTA_ROOTFS "/lib/modules/" MODULES_UNAME
+#define DELTA_CCISS_ALIAS "pci:v00000E11d0000B060sv00000E11sd00004070bc01sc04i00"
+#define DELTA_HPSA_ALIAS "pci:v0000103Cd0000323Asv0000103Csd00003241bc01sc04i00"
+
+/* only the module @name, at @path, is found for @lookup, or none if NULL */
+static bool delta_lookup(struct kmod_ctx *ctx, const char *lookup,
+					const char *name, const char *path)
+{
+	struct kmod_list *list = NULL, *l;
+	bool ok;
+
+	if (kmod_module_new_from_lookup(ctx, lookup, &list) < 0) {
+		ERR("could not look up %s\n", lookup);
+		return false;
+	}
+
+	ok = (list == NULL) == (name == NULL);
+	kmod_list_foreach(l, list) {
+		struct kmod_module *mod = kmod_module_get_module(l);
+		const char *p = kmod_module_get_path(mod);
+
+		if (name == NULL || !streq(kmod_module_get_name(mod), name) ||
+				(path != NULL && (p == NULL ||
+						  strstr(p, path) == NULL)))
+			ok = false;
+		kmod_module_unref(mod);
+	}
+
+	if (!ok)
+		ERR("unexpected match of %s\n", lookup);
+	kmod_module_unref_list(list);
+	return ok;
+}
+
+static bool delta_check(bool load)
+{
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	bool ok;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL || (load && kmod_load_resources(ctx) < 0))
+		return false;
+
+	ok = delta_lookup(ctx, "hpsa", "hpsa", "/updates/hpsa.ko") &&
+		delta_lookup(ctx, DELTA_HPSA_ALIAS, "hpsa", NULL) &&
+		delta_lookup(ctx, "cciss", NULL, NULL) &&
+		delta_lookup(ctx, DELTA_CCISS_ALIAS, NULL, NULL) &&
+		delta_lookup(ctx, "scsi_mod", "scsi_mod", "/kernel/");
+
+	kmod_unref(ctx);
+	return ok;
+}
+
+static noreturn int depmod_delta(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/depmod";
+	const char *const args[] = {
+		progname,
+		NULL,
+	};
+	const char *const args_delta[] = {
+		progname,
+		"--delta",
+		NULL,
+	};
+
+	if (run_depmod(args) < 0)
+		exit(EXIT_FAILURE);
+
+	/* install a module in updates/ and remove another */
+	if (mkdir(DELTA_LIB_MODULES "/updates", 0755) < 0 ||
+	    rename(DELTA_ROOTFS "/hpsa.ko",
+			DELTA_LIB_MODULES "/updates/hpsa.ko") < 0 ||
+	    unlink(DELTA_LIB_MODULES "/kernel/drivers/block/cciss.ko") < 0)
+		exit(EXIT_FAILURE);
+
+	if (run_depmod(args_delta) < 0)
+		exit(EXIT_FAILURE);
+
+	if (access(DELTA_LIB_MODULES "/modules.dep.delta.bin", F_OK) < 0) {
+		ERR("no delta was written\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* from the deltas, opened for each lookup or loaded */
+	if (!delta_check(false) || !delta_check(true))
+		exit(EXIT_FAILURE);
+
+	/* a full run writes it all again and removes the deltas */
+	if (run_depmod(args) < 0)
+		exit(EXIT_FAILURE);
+
+	if (access(DELTA_LIB_MODULES "/modules.dep.delta.bin", F_OK) == 0) {
+		ERR("the deltas were not removed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	exit(delta_check(true) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+DEFINE_TEST(depmod_delta,
+	.description = "check if depmod --delta writes the modules that changed for libkmod",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = DELTA_ROOTFS,
+	},
+	.output = {
+		.files = (const struct keyval[]) {
+			{ DELTA_LIB_MODULES "/modules.dep",
+			  DELTA_ROOTFS "/correct-modules.dep" },
+			{ }
+		},
+	},
+	.need_spawn = true);
+
+#ifdef ENABLE_ZLIB
+#define COMPRESS_ROOTFS TESTSUITE_ROOTFS "test-depmod/compress"
+#define COMPRESS_LIB_MODULES COMPRESS_ROOTFS "/lib/modules/" MODULES_UNAME
+#define COMPRESS_NO_ALIAS "pci:v00001234d00005678sv00000000sd00000000bc00sc00i00"
+static bool compress_is_blocks(const char *path)
+{
+	uint32_t magic = 0;
+	FILE *fp = fopen(path, "re");
+
+	if (fp == NULL)
+		return false;
+	if (fread(&magic, sizeof(magic), 1, fp) != 1)
+		magic = 0;
+	fclose(fp);
+
+	if (ntohl(magic) != 0xB007F45D) {
+		ERR("%s is not compressed\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+static bool compress_check(bool load)
+{
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	uint64_t inflated;
+	bool ok;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL || (load && kmod_load_resources(ctx) < 0))
+		return false;
+
+	ok = delta_lookup(ctx, DELTA_CCISS_ALIAS, "cciss", NULL) &&
+		delta_lookup(ctx, DELTA_HPSA_ALIAS, "hpsa", NULL) &&
+		delta_lookup(ctx, "symbol:dummy_export", "scsi_mod", NULL) &&
+		delta_lookup(ctx, COMPRESS_NO_ALIAS, NULL, NULL) &&
+		delta_lookup(ctx, "hpsa", "hpsa", "/kernel/drivers/scsi/");
+
+	/* loaded indexes are read by libkmod itself, not through stdio */
+	if (ok && load && (kmod_get_stat(ctx, KMOD_STAT_BYTES_DECOMPRESSED,
+					 &inflated) < 0 || inflated == 0)) {
+		ERR("nothing was inflated\n");
+		ok = false;
+	}
+
+	kmod_unref(ctx);
+	return ok;
+}
+
+static noreturn int depmod_compress_indexes(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/depmod";
+	const char *const args[] = {
+		progname,
+		"--compress-indexes",
+		NULL,
+	};
+
+	if (run_depmod(args) < 0)
+		exit(EXIT_FAILURE);
+
+	if (!compress_is_blocks(COMPRESS_LIB_MODULES "/modules.alias.bin") ||
+	    !compress_is_blocks(COMPRESS_LIB_MODULES "/modules.symbols.bin"))
+		exit(EXIT_FAILURE);
+
+	/* opened for each lookup, then loaded */
+	exit(compress_check(false) && compress_check(true) ?
+					EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+DEFINE_TEST(depmod_compress_indexes,
+	.description = "check if libkmod reads the indexes of depmod --compress-indexes",
+	.config = {
+		[TC_UNAME_R] = MODULES_UNAME,
+		[TC_ROOTFS] = COMPRESS_ROOTFS,
+	},
+	.need_spawn = true);
+#endif
+
 #define SEARCH_ORDER_SIMPLE_ROOTFS TESTSUITE_ROOTFS "test-depmod/search-order-simple"
 #define SEARCH_ORDER_SIMPLE_LIB_MODULES SEARCH_ORDER_SIMPLE_ROOTFS "/lib/modules/" MODULES_UNAME
 static noreturn int depmod_search_order_simple(const struct test *t)
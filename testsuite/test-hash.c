@@ -279,4 +279,124 @@ static int test_hash_massive_add_del(const struct test *t)
 DEFINE_TEST(test_hash_massive_add_del,
 		.description = "test multiple adds followed by multiple dels")
 
+static int test_hash_grow_del(const struct test *t)
+{
+	static char buf[8 * 8192];
+	struct hash_iter iter;
+	struct hash *h;
+	const char *k;
+	unsigned int i, n, N = 8192;
+
+	h = hash_new(4, NULL);
+
+	for (i = 0; i < N; i++) {
+		snprintf(&buf[i * 8], 8, "k%u", i);
+		assert_return(hash_add(h, &buf[i * 8], &buf[i * 8]) == 0,
+							EXIT_FAILURE);
+	}
+
+	assert_return(hash_get_count(h) == N, EXIT_FAILURE);
+
+	/* deleting must not hide the entries that collided with others */
+	for (i = 0; i < N; i += 2)
+		assert_return(hash_del(h, &buf[i * 8]) == 0, EXIT_FAILURE);
+
+	assert_return(hash_get_count(h) == N / 2, EXIT_FAILURE);
+
+	for (i = 0; i < N; i++) {
+		const char *v = hash_find(h, &buf[i * 8]);
+
+		if (i % 2)
+			assert_return(v == &buf[i * 8], EXIT_FAILURE);
+		else
+			assert_return(v == NULL, EXIT_FAILURE);
+	}
+
+	n = 0;
+	for (hash_iter_init(h, &iter); hash_iter_next(&iter, &k, NULL);) {
+		assert_return(hash_find(h, k) == k, EXIT_FAILURE);
+		n++;
+	}
+
+	assert_return(n == N / 2, EXIT_FAILURE);
+
+	hash_free(h);
+	return 0;
+}
+DEFINE_TEST(test_hash_grow_del,
+		.description = "test hash growing and deleting colliding entries");
+
+static int test_hash_add_find_len(const struct test *t)
+{
+	static const char *const keys[] = {
+		"", "a", "ab", "abc", "abcd", "abcdefg", "abcdefgh",
+		"abcdefghi", "snd_pcm_lib_ioctl", "drm_atomic_helper_commit",
+	};
+	char buf[64];
+	struct hash *h;
+	unsigned int i;
+
+	h = hash_new(8, NULL);
+
+	for (i = 0; i < ARRAY_SIZE(keys); i++)
+		assert_return(hash_add_len(h, keys[i], strlen(keys[i]),
+					   keys[i]) == 0, EXIT_FAILURE);
+
+	/* keys added with a length must be found with and without one */
+	for (i = 0; i < ARRAY_SIZE(keys); i++) {
+		assert_return(hash_find(h, keys[i]) == keys[i], EXIT_FAILURE);
+		assert_return(hash_find_len(h, keys[i], strlen(keys[i])) ==
+						keys[i], EXIT_FAILURE);
+	}
+
+	/* neither alignment nor the bytes after the key change its hash */
+	for (i = 0; i < ARRAY_SIZE(keys); i++) {
+		size_t len = strlen(keys[i]);
+
+		memset(buf, 'x', sizeof(buf));
+		memcpy(buf + 1, keys[i], len);
+		assert_return(hash_str(buf + 1, len) == hash_str(keys[i], len),
+							EXIT_FAILURE);
+	}
+
+	hash_free(h);
+	return 0;
+}
+DEFINE_TEST(test_hash_add_find_len,
+		.description = "test hash add and find with a known key length");
+
+static int test_hash_reserve(const struct test *t)
+{
+	const char *k[] = { "k1", "k2", "k3", "k4", "k5" };
+	const char *v[] = { "v1", "v2", "v3", "v4", "v5" };
+	char buf[1024 * 8];
+	struct hash *h;
+	unsigned int i, N = 1000;
+
+	h = hash_new(8, NULL);
+
+	/* existing entries are kept when making room */
+	for (i = 0; i < ARRAY_SIZE(k); i++)
+		hash_add(h, k[i], v[i]);
+	assert_return(hash_reserve(h, N + ARRAY_SIZE(k)) == 0, EXIT_FAILURE);
+	assert_return(hash_reserve(h, 4) == 0, EXIT_FAILURE);
+
+	for (i = 0; i < N; i++) {
+		snprintf(buf + i * 8, 8, "%d", i);
+		hash_add(h, buf + i * 8, &buf[i * 8]);
+	}
+
+	assert_return(hash_get_count(h) == N + ARRAY_SIZE(k), EXIT_FAILURE);
+	for (i = 0; i < ARRAY_SIZE(k); i++)
+		assert_return(streq(hash_find(h, k[i]), v[i]), EXIT_FAILURE);
+	for (i = 0; i < N; i++)
+		assert_return(hash_find(h, buf + i * 8) == &buf[i * 8],
+							EXIT_FAILURE);
+
+	hash_free(h);
+	return 0;
+}
+DEFINE_TEST(test_hash_reserve,
+		.description = "test hash_reserve keeps entries and makes room");
+
 TESTSUITE_MAIN();
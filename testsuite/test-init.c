@@ -15,13 +15,17 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <shared/macro.h>
 
@@ -166,4 +170,448 @@ DEFINE_TEST(test_remove,
 	},
 	.need_spawn = true);
 
+#define N_QUEUED 3
+static noreturn int test_insert_queue(const struct test *t)
+{
+	static const char *const names[N_QUEUED] = {
+		"mod_foo", "mod_foo_b", "mod_nope",
+	};
+	static const int expected[N_QUEUED] = { 0, 0, -ENOENT };
+	const char *null_config = NULL;
+	struct kmod_insert_queue *q;
+	struct kmod_ctx *ctx;
+	struct pollfd pfd = { .events = POLLIN };
+	unsigned int i, n = 0;
+	bool seen[N_QUEUED] = { };
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	q = kmod_insert_queue_new(ctx, 2);
+	if (q == NULL)
+		exit(EXIT_FAILURE);
+	pfd.fd = kmod_insert_queue_get_fd(q);
+
+	for (i = 0; i < N_QUEUED; i++) {
+		struct kmod_module *mod;
+
+		if (kmod_module_new_from_name(ctx, names[i], &mod) < 0 ||
+		    kmod_insert_queue_probe(q, mod, 0, NULL,
+						(void *) &names[i]) < 0)
+			exit(EXIT_FAILURE);
+		kmod_module_unref(mod);
+	}
+
+	while (n < N_QUEUED) {
+		struct kmod_module *mod;
+		const char *const *name;
+		int err, r;
+
+		if (poll(&pfd, 1, 5000) != 1) {
+			ERR("timed out waiting for the queue\n");
+			exit(EXIT_FAILURE);
+		}
+
+		while ((r = kmod_insert_queue_next(q, &mod, &err,
+						(void **) &name)) == 0) {
+			i = name - names;
+			if (i >= N_QUEUED || seen[i] ||
+			    strcmp(kmod_module_get_name(mod), names[i]) != 0 ||
+			    err != expected[i]) {
+				ERR("unexpected result for %s: %d\n",
+					kmod_module_get_name(mod), err);
+				exit(EXIT_FAILURE);
+			}
+			seen[i] = true;
+			kmod_module_unref(mod);
+			n++;
+		}
+		if (r != -EAGAIN)
+			exit(EXIT_FAILURE);
+	}
+
+	/* the fd is not readable with nothing to collect */
+	if (poll(&pfd, 1, 0) != 0)
+		exit(EXIT_FAILURE);
+
+	kmod_insert_queue_free(q);
+	kmod_unref(ctx);
+
+	exit(EXIT_SUCCESS);
+}
+DEFINE_TEST(test_insert_queue,
+	.description = "test inserting modules through kmod_insert_queue",
+	.config = {
+		[TC_UNAME_R] = "4.0.20-kmod",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-init-insert-queue",
+		[TC_INIT_MODULE_RETCODES] = "",
+	},
+	.modules_loaded = "mod-foo,mod-foo-a,mod-foo-b,mod-foo-c",
+	.need_spawn = true);
+
+static uint64_t get_stat(struct kmod_ctx *ctx, enum kmod_stat stat)
+{
+	uint64_t value;
+
+	if (kmod_get_stat(ctx, stat, &value) < 0)
+		exit(EXIT_FAILURE);
+
+	return value;
+}
+
+static noreturn int test_stats(const struct test *t)
+{
+	static const char *alias = "pci:v00008086d00002668sv00001028sd000001F3bc01sc06i01";
+	struct kmod_ctx *ctx;
+	struct kmod_list *list = NULL;
+	const char *null_config = NULL;
+	uint64_t lookups, value;
+	int i;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	kmod_set_lookup_cache_size(ctx, 16);
+	if (kmod_load_resources(ctx) < 0)
+		exit(EXIT_FAILURE);
+
+	if (get_stat(ctx, KMOD_STAT_BYTES_MAPPED) == 0) {
+		ERR("indexes loaded but no bytes mapped\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (kmod_module_new_from_lookup(ctx, alias, &list) < 0 ||
+								list == NULL)
+			exit(EXIT_FAILURE);
+		kmod_module_unref_list(list);
+		list = NULL;
+	}
+
+	if (get_stat(ctx, KMOD_STAT_LOOKUP_CACHE_MISSES) != 1 ||
+			get_stat(ctx, KMOD_STAT_LOOKUP_CACHE_HITS) != 2) {
+		ERR("expected 1 miss and 2 hits of the lookup cache\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (kmod_get_index_lookups(ctx, KMOD_INDEX_MODULES_ALIAS,
+							&lookups) < 0 ||
+								lookups != 1) {
+		ERR("expected 1 lookup in modules.alias\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (get_stat(ctx, KMOD_STAT_POOL_MODULES) == 0) {
+		ERR("no module kept in the pool\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (kmod_get_stat(ctx, _KMOD_STAT_PAD, &value) != -EINVAL)
+		exit(EXIT_FAILURE);
+
+	kmod_reset_stats(ctx);
+	if (kmod_get_index_lookups(ctx, KMOD_INDEX_MODULES_ALIAS,
+							&lookups) < 0 ||
+			lookups != 0 ||
+			get_stat(ctx, KMOD_STAT_LOOKUP_CACHE_HITS) != 0 ||
+			get_stat(ctx, KMOD_STAT_BYTES_MAPPED) != 0) {
+		ERR("counters not reset\n");
+		exit(EXIT_FAILURE);
+	}
+
+	kmod_unref(ctx);
+
+	exit(EXIT_SUCCESS);
+}
+DEFINE_TEST(test_stats,
+	.description = "test the counters of kmod_get_stat() and kmod_get_index_lookups()",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-syscalls",
+		[TC_UNAME_R] = "4.4.4",
+	},
+	.need_spawn = true);
+
+#define SHARED_INDEX TESTSUITE_ROOTFS "test-syscalls/lib/modules/4.4.4/modules.alias.bin"
+static noreturn int test_shared_indexes(const struct test *t)
+{
+	static const char *alias = "pci:v00008086d00002668sv00001028sd000001F3bc01sc06i01";
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx, *ctx2;
+	struct kmod_list *list = NULL;
+	struct timespec times[2];
+	struct stat st;
+
+	ctx = kmod_new(NULL, &null_config);
+	ctx2 = kmod_new(NULL, &null_config);
+	if (ctx == NULL || ctx2 == NULL || kmod_load_resources(ctx) < 0 ||
+					kmod_load_resources(ctx2) < 0)
+		exit(EXIT_FAILURE);
+
+	/* the second context maps none of the indexes again */
+	if (get_stat(ctx, KMOD_STAT_BYTES_MAPPED) == 0 ||
+			get_stat(ctx2, KMOD_STAT_BYTES_MAPPED) != 0) {
+		ERR("indexes mapped again by the second context\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* and keeps them once the first one is gone */
+	kmod_unref(ctx);
+	if (kmod_module_new_from_lookup(ctx2, alias, &list) < 0 || list == NULL)
+		exit(EXIT_FAILURE);
+	kmod_module_unref_list(list);
+	list = NULL;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL || kmod_load_resources(ctx) < 0 ||
+			get_stat(ctx, KMOD_STAT_BYTES_MAPPED) != 0)
+		exit(EXIT_FAILURE);
+
+	/* a changed index: only the context reloading it maps it again */
+	if (stat(SHARED_INDEX, &st) < 0)
+		exit(EXIT_FAILURE);
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	times[1].tv_sec += 1;
+	if (utimensat(AT_FDCWD, SHARED_INDEX, times, 0) < 0)
+		exit(EXIT_FAILURE);
+
+	if (kmod_validate_resources(ctx) != KMOD_RESOURCES_MUST_RELOAD ||
+	    kmod_validate_resources(ctx2) != KMOD_RESOURCES_MUST_RELOAD)
+		exit(EXIT_FAILURE);
+
+	kmod_unload_resources(ctx);
+	if (kmod_load_resources(ctx) < 0 ||
+	    get_stat(ctx, KMOD_STAT_BYTES_MAPPED) != (uint64_t) st.st_size) {
+		ERR("expected only %s to be mapped again\n", SHARED_INDEX);
+		exit(EXIT_FAILURE);
+	}
+
+	/* the old mapping is still there for the other one */
+	if (kmod_module_new_from_lookup(ctx2, alias, &list) < 0 || list == NULL)
+		exit(EXIT_FAILURE);
+	kmod_module_unref_list(list);
+
+	times[1].tv_sec -= 1;
+	utimensat(AT_FDCWD, SHARED_INDEX, times, 0);
+
+	kmod_unref(ctx2);
+	kmod_unref(ctx);
+
+	exit(EXIT_SUCCESS);
+}
+DEFINE_TEST(test_shared_indexes,
+	.description = "test that contexts of a process share the mappings of the indexes",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-syscalls",
+		[TC_UNAME_R] = "4.4.4",
+	},
+	.need_spawn = true);
+
+static noreturn int test_index_preload(const struct test *t)
+{
+	static const char *alias = "pci:v00008086d00002668sv00001028sd000001F3bc01sc06i01";
+	struct kmod_ctx *ctx;
+	struct kmod_list *list = NULL;
+	const char *null_config = NULL;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	if (kmod_get_index_preload(ctx, KMOD_INDEX_MODULES_ALIAS) !=
+						KMOD_INDEX_PRELOAD_LAZY ||
+	    kmod_set_index_preload(ctx, _KMOD_INDEX_PAD,
+					KMOD_INDEX_PRELOAD_HOT) != -EINVAL ||
+	    kmod_set_index_preload(ctx, KMOD_INDEX_MODULES_ALIAS,
+						_KMOD_INDEX_PRELOAD_PAD) != -EINVAL)
+		exit(EXIT_FAILURE);
+
+	if (kmod_set_index_preload(ctx, KMOD_INDEX_MODULES_ALIAS,
+						KMOD_INDEX_PRELOAD_HOT) < 0 ||
+	    kmod_set_index_preload(ctx, KMOD_INDEX_MODULES_DEP,
+						KMOD_INDEX_PRELOAD_ALL) < 0 ||
+	    kmod_load_resources(ctx) < 0)
+		exit(EXIT_FAILURE);
+
+	/* already loaded: applied right away */
+	if (kmod_set_index_preload(ctx, KMOD_INDEX_MODULES_SYMBOL,
+						KMOD_INDEX_PRELOAD_ALL) < 0 ||
+	    kmod_get_index_preload(ctx, KMOD_INDEX_MODULES_SYMBOL) !=
+						KMOD_INDEX_PRELOAD_ALL)
+		exit(EXIT_FAILURE);
+
+	if (kmod_module_new_from_lookup(ctx, alias, &list) < 0 ||
+								list == NULL)
+		exit(EXIT_FAILURE);
+	kmod_module_unref_list(list);
+	kmod_unref(ctx);
+
+	setenv("KMOD_INDEX_PRELOAD", "hot", 1);
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL ||
+	    kmod_get_index_preload(ctx, KMOD_INDEX_MODULES_BUILTIN) !=
+						KMOD_INDEX_PRELOAD_HOT)
+		exit(EXIT_FAILURE);
+	kmod_unref(ctx);
+
+	exit(EXIT_SUCCESS);
+}
+DEFINE_TEST(test_index_preload,
+	.description = "test choosing how much of each index is read in on loading",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-syscalls",
+		[TC_UNAME_R] = "4.4.4",
+	},
+	.need_spawn = true);
+
+#ifdef ENABLE_XZ
+#define CACHE_DIR TESTSUITE_ROOTFS "test-init-cache/kernel/cache"
+
+/* bytes decompressed to read or insert the module, from a new context */
+static uint64_t cache_use(bool insert)
+{
+	const char *null_config = NULL;
+	struct kmod_list *info = NULL;
+	struct kmod_module *mod;
+	struct kmod_ctx *ctx;
+	uint64_t bytes;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL || kmod_set_decompress_cache(ctx, CACHE_DIR) < 0 ||
+	    kmod_module_new_from_path(ctx, "/kernel/mod-simple.ko.xz", &mod) < 0)
+		exit(EXIT_FAILURE);
+
+	if (insert) {
+		if (kmod_module_insert_module(mod, 0, NULL) < 0)
+			exit(EXIT_FAILURE);
+	} else {
+		if (kmod_module_get_info(mod, &info) < 0)
+			exit(EXIT_FAILURE);
+		kmod_module_info_free_list(info);
+	}
+
+	bytes = get_stat(ctx, KMOD_STAT_BYTES_DECOMPRESSED);
+	kmod_module_unref(mod);
+	kmod_unref(ctx);
+
+	return bytes;
+}
+
+/* chmod the entries to @mode, or remove them with 0 */
+static void cache_entries(mode_t mode)
+{
+	struct dirent *ent;
+	DIR *d;
+
+	d = opendir(CACHE_DIR);
+	if (d == NULL)
+		exit(EXIT_FAILURE);
+
+	while ((ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+		if (mode != 0)
+			fchmodat(dirfd(d), ent->d_name, mode, 0);
+		else
+			unlinkat(dirfd(d), ent->d_name, 0);
+	}
+	closedir(d);
+}
+
+static noreturn int test_decompress_cache(const struct test *t)
+{
+	if (mkdir(CACHE_DIR, 0700) < 0)
+		exit(EXIT_FAILURE);
+
+	/* filled, then used */
+	if (cache_use(false) == 0 || cache_use(false) != 0) {
+		ERR("decompressed-module cache not filled or not used\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* nothing that others can write to is trusted */
+	cache_entries(0666);
+	if (cache_use(false) == 0) {
+		ERR("cache entry writable by others used\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (chmod(CACHE_DIR, 0777) < 0)
+		exit(EXIT_FAILURE);
+	if (cache_use(false) == 0) {
+		ERR("cache directory writable by others used\n");
+		exit(EXIT_FAILURE);
+	}
+	if (chmod(CACHE_DIR, 0700) < 0 || cache_use(false) != 0)
+		exit(EXIT_FAILURE);
+
+	/* and the kernel never gets what is in there */
+	if (cache_use(true) == 0) {
+		ERR("module inserted from the cache\n");
+		exit(EXIT_FAILURE);
+	}
+
+	cache_entries(0);
+	rmdir(CACHE_DIR);
+
+	exit(EXIT_SUCCESS);
+}
+DEFINE_TEST(test_decompress_cache,
+	.description = "test which entries of the decompressed-module cache are used",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-init-cache/",
+		[TC_INIT_MODULE_RETCODES] = "",
+	},
+	.modules_loaded = "mod_simple",
+	.need_spawn = true);
+#endif
+
+#define BUNDLE_DIR TESTSUITE_ROOTFS "test-modprobe/show-depends-bundle/lib/modules/4.4.4"
+static noreturn int test_bundle_stale(const struct test *t)
+{
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	struct timespec times[2];
+	struct stat st;
+	int fd;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL || kmod_load_resources(ctx) < 0 ||
+	    kmod_validate_resources(ctx) != KMOD_RESOURCES_OK)
+		exit(EXIT_FAILURE);
+
+	/* a depmod that doesn't write modules.bin ran after the one that did */
+	if (stat(BUNDLE_DIR "/modules.bin", &st) < 0)
+		exit(EXIT_FAILURE);
+	fd = open(BUNDLE_DIR "/modules.dep.bin",
+				O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0)
+		exit(EXIT_FAILURE);
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	times[1].tv_sec += 1;
+	if (futimens(fd, times) < 0)
+		exit(EXIT_FAILURE);
+	close(fd);
+
+	if (kmod_validate_resources(ctx) != KMOD_RESOURCES_MUST_RELOAD) {
+		ERR("modules.bin older than modules.dep.bin still valid\n");
+		exit(EXIT_FAILURE);
+	}
+
+	unlink(BUNDLE_DIR "/modules.dep.bin");
+	kmod_unref(ctx);
+
+	exit(EXIT_SUCCESS);
+}
+DEFINE_TEST(test_bundle_stale,
+	.description = "test that a modules.bin older than modules.dep.bin must be reloaded",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/show-depends-bundle",
+		[TC_UNAME_R] = "4.4.4",
+	},
+	.need_spawn = true);
+
 TESTSUITE_MAIN();
@@ -88,4 +88,71 @@ DEFINE_TEST(loaded_1,
 		.out = TESTSUITE_ROOTFS "test-loaded/correct.txt",
 	});
 
+static int loaded_snapshot(const struct test *t)
+{
+	struct kmod_ctx *ctx;
+	const char *null_config = NULL;
+	struct kmod_list *list, *itr;
+	int err;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	err = kmod_module_new_from_loaded_snapshot(ctx, &list);
+	if (err < 0) {
+		fprintf(stderr, "%s\n", strerror(-err));
+		kmod_unref(ctx);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Module                  Size  Used by\n");
+
+	/*
+	 * only rfcomm, still loading, has a directory in /sys, for its size:
+	 * the rest is from the snapshot
+	 */
+	kmod_list_foreach(itr, list) {
+		struct kmod_module *mod = kmod_module_get_module(itr);
+		const char *name = kmod_module_get_name(mod);
+		int use_count = kmod_module_get_refcnt(mod);
+		long size = kmod_module_get_size(mod);
+		int state = kmod_module_get_initstate(mod);
+		struct kmod_list *holders, *hitr;
+		int first = 1;
+
+		printf("%-19s %8ld  %d %s ", name, size, use_count,
+					kmod_module_initstate_str(state));
+		holders = kmod_module_get_holders(mod);
+		kmod_list_foreach(hitr, holders) {
+			struct kmod_module *hm = kmod_module_get_module(hitr);
+
+			if (!first)
+				putchar(',');
+			else
+				first = 0;
+
+			fputs(kmod_module_get_name(hm), stdout);
+			kmod_module_unref(hm);
+		}
+		putchar('\n');
+		kmod_module_unref_list(holders);
+		kmod_module_unref(mod);
+	}
+	kmod_module_unref_list(list);
+
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(loaded_snapshot,
+	.description = "check if the getters answer from a snapshot of loaded modules",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-loaded-snapshot/",
+	},
+	.need_spawn = true,
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-loaded-snapshot/correct.txt",
+	});
+
 TESTSUITE_MAIN();
@@ -22,6 +22,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+
+#include <shared/util.h>
+
+#include <libkmod/libkmod.h>
 
 #include "testsuite.h"
 
@@ -119,4 +124,254 @@ DEFINE_TEST(test_modinfo_external,
 		.out = TESTSUITE_ROOTFS "test-modinfo/correct-external.txt",
 	})
 
+static noreturn int test_modinfo_builtin(const struct test *t)
+{
+	const char *const args[] = {
+		progname,
+		"fs-ext2", "usb_storage", "crc16",
+		NULL,
+	};
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(test_modinfo_builtin,
+	.description = "check if modinfo finds the info of builtin modules",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modinfo/builtin",
+		[TC_UNAME_R] = "4.4.4",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modinfo/correct-builtin.txt",
+	})
+
+static noreturn int test_modinfo_jobs(const struct test *t)
+{
+	const char *const args[] = {
+		progname, "-j", "2", "-F", "license",
+		"/mod-simple-i386.ko",
+		"/mod-simple-x86_64.ko",
+		"/mod-simple-sparc64.ko",
+		NULL,
+	};
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(test_modinfo_jobs,
+	.description = "check if modinfo keeps the order of the modules with several jobs",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modinfo/",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modinfo/correct-license.txt",
+	})
+
+static noreturn int test_modinfo_builtin_jobs(const struct test *t)
+{
+	const char *const args[] = {
+		progname, "--jobs=0",
+		"fs-ext2", "usb_storage", "crc16",
+		NULL,
+	};
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(test_modinfo_builtin_jobs,
+	.description = "check if modinfo finds the info of builtin modules with several jobs",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modinfo/builtin",
+		[TC_UNAME_R] = "4.4.4",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modinfo/correct-builtin.txt",
+	})
+
+static int test_modinfo_next(const struct test *t)
+{
+	static const char *const paths[] = {
+		"/mod-simple-i386.ko",
+		"/mod-simple-x86_64.ko",
+		"/mod-simple-sparc64.ko",
+	};
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	size_t i;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < ARRAY_SIZE(paths); i++) {
+		struct kmod_module *mod;
+		struct kmod_list *list = NULL, *l;
+		const char *key, *value;
+		size_t pos = 0, keylen, valuelen;
+		int err, count = 0;
+
+		err = kmod_module_new_from_path(ctx, paths[i], &mod);
+		if (err < 0)
+			exit(EXIT_FAILURE);
+
+		err = kmod_module_get_info(mod, &list);
+		if (err <= 0)
+			exit(EXIT_FAILURE);
+
+		/* the same entries as the copied list, in the same order */
+		l = list;
+		while ((err = kmod_module_get_info_next(mod, &pos, &key, &keylen,
+						&value, &valuelen)) > 0) {
+			if (l == NULL)
+				exit(EXIT_FAILURE);
+			if (strlen(kmod_module_info_get_key(l)) != keylen ||
+			    memcmp(kmod_module_info_get_key(l), key, keylen) ||
+			    strlen(kmod_module_info_get_value(l)) != valuelen ||
+			    memcmp(kmod_module_info_get_value(l), value, valuelen)) {
+				ERR("%s: entry %d differs\n", paths[i], count);
+				exit(EXIT_FAILURE);
+			}
+			l = kmod_list_next(list, l);
+			count++;
+		}
+		if (err < 0 || l != NULL)
+			exit(EXIT_FAILURE);
+
+		/* and it stays at the end */
+		if (kmod_module_get_info_next(mod, &pos, &key, &keylen,
+						&value, &valuelen) != 0)
+			exit(EXIT_FAILURE);
+
+		kmod_module_info_free_list(list);
+		kmod_module_unref(mod);
+	}
+
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(test_modinfo_next,
+	.description = "check modinfo entries can be iterated without copies",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modinfo/",
+	},
+	.need_spawn = true);
+
+static int count_sig_fields(struct kmod_list *list)
+{
+	struct kmod_list *l;
+	int n = 0;
+
+	kmod_list_foreach(l, list) {
+		const char *key = kmod_module_info_get_key(l);
+
+		if (streq(key, "signer") || streq(key, "sig_key"))
+			n++;
+	}
+
+	return n;
+}
+
+static int test_modinfo_no_signature(const struct test *t)
+{
+	const char *null_config = NULL;
+	struct kmod_list *full = NULL, *list = NULL;
+	struct kmod_module *mod;
+	struct kmod_ctx *ctx;
+	int n_full, n;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	if (kmod_module_new_from_path(ctx, "/mod-simple-sha256.ko", &mod) < 0)
+		exit(EXIT_FAILURE);
+
+	n_full = kmod_module_get_info(mod, &full);
+	n = kmod_module_get_info_flags(mod, KMOD_INFO_NO_SIGNATURE, &list);
+
+	/* the same .modinfo, just none of the signature fields */
+	if (n <= 0 || n_full <= n || count_sig_fields(full) != 2 ||
+					count_sig_fields(list) != 0)
+		exit(EXIT_FAILURE);
+
+	kmod_module_info_free_list(full);
+	kmod_module_info_free_list(list);
+	kmod_module_unref(mod);
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(test_modinfo_no_signature,
+	.description = "check modinfo can be read without decoding the signature",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modinfo/",
+	},
+	.need_spawn = true);
+
+#ifdef ENABLE_XZ
+static bool info_equal(struct kmod_list *list_a, struct kmod_list *list_b)
+{
+	struct kmod_list *a = list_a, *b = list_b;
+
+	while (a != NULL && b != NULL) {
+		if (!streq(kmod_module_info_get_key(a),
+					kmod_module_info_get_key(b)) ||
+		    !streq(kmod_module_info_get_value(a),
+					kmod_module_info_get_value(b)))
+			return false;
+		a = kmod_list_next(list_a, a);
+		b = kmod_list_next(list_b, b);
+	}
+
+	return a == NULL && b == NULL;
+}
+
+static int test_modinfo_seekable(const struct test *t)
+{
+	const char *null_config = NULL;
+	struct kmod_list *plain = NULL, *list = NULL;
+	struct kmod_module *mod, *mod_plain;
+	struct kmod_ctx *ctx;
+	uint64_t decompressed;
+	struct stat st;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	if (kmod_module_new_from_path(ctx, "/mod-simple-sha256.ko",
+							&mod_plain) < 0 ||
+	    kmod_module_new_from_path(ctx, "/mod-simple-blocks.ko.xz",
+								&mod) < 0 ||
+	    stat("/mod-simple-sha256.ko", &st) < 0)
+		exit(EXIT_FAILURE);
+
+	/* the same .modinfo and signature as the module it was made from */
+	if (kmod_module_get_info(mod_plain, &plain) <= 0 ||
+	    kmod_module_get_info(mod, &list) <= 0 || !info_equal(plain, list))
+		exit(EXIT_FAILURE);
+
+	/* from the blocks with the headers, .modinfo and the signature */
+	if (kmod_get_stat(ctx, KMOD_STAT_BYTES_DECOMPRESSED,
+						&decompressed) < 0 ||
+	    decompressed == 0 || decompressed >= (uint64_t) st.st_size / 2) {
+		ERR("decompressed %" PRIu64 " bytes of %lld\n", decompressed,
+						(long long) st.st_size);
+		exit(EXIT_FAILURE);
+	}
+
+	kmod_module_info_free_list(plain);
+	kmod_module_info_free_list(list);
+	kmod_module_unref(mod_plain);
+	kmod_module_unref(mod);
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(test_modinfo_seekable,
+	.description = "check modinfo only decompresses the blocks it needs from a module in several xz blocks",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modinfo/",
+	},
+	.need_spawn = true);
+#endif
+
 TESTSUITE_MAIN();
@@ -16,12 +16,15 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "testsuite.h"
 
@@ -69,6 +72,103 @@ DEFINE_TEST(modprobe_show_depends2,
 		.out = TESTSUITE_ROOTFS "test-modprobe/show-depends/correct-mod-simple.txt",
 	});
 
+static noreturn int kmod_closure(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/kmod";
+	const char *const args[] = {
+		progname,
+		"closure", "mod-loop-a", "mod-simple", "mod-loop-b",
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(kmod_closure,
+	.description = "check if kmod closure lists each needed module once",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/show-depends",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/show-depends/correct-closure.txt",
+	});
+
+static noreturn int kmod_profile(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/kmod";
+	const char *const args[] = {
+		progname,
+		"profile", "/profile.txt",
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(kmod_profile,
+	.description = "check if kmod profile sums up the records per module",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/profile",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/profile/correct.txt",
+	});
+
+static noreturn int kmod_audit(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/kmod";
+	const char *const args[] = {
+		progname,
+		"audit", "-s", "-j", "2", "-E", "/Module.symvers",
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(kmod_audit,
+	.description = "check if kmod audit reports the vermagic, symbol versions and signatures of all modules",
+	.config = {
+		[TC_UNAME_R] = "4.0.3-1-ARCH",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/audit",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/audit/correct.txt",
+	},
+	.expected_fail = true,
+	);
+
+DEFINE_TEST_WITH_FUNC(modprobe_show_depends_v3, modprobe_show_depends,
+	.description = "check if output for modprobe --show-depends is correct with v3 indexes",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/show-depends-v3",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/show-depends-v3/correct.txt",
+	});
+
+DEFINE_TEST_WITH_FUNC(modprobe_show_depends_bundle, modprobe_show_depends,
+	.description = "check if output for modprobe --show-depends is correct with modules.bin",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/show-depends-bundle",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/show-depends-bundle/correct.txt",
+	});
+
+DEFINE_TEST_WITH_FUNC(modprobe_show_depends_ids, modprobe_show_depends,
+	.description = "check if output for modprobe --show-depends is correct with modules.dep.ids.bin",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/show-depends-ids",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/show-depends-ids/correct.txt",
+	});
+
 
 static noreturn int modprobe_show_alias_to_none(const struct test *t)
 {
@@ -159,6 +259,31 @@ DEFINE_TEST(modprobe_builtin_lookup_only,
 		.out = TESTSUITE_ROOTFS "test-modprobe/builtin/correct.txt",
 	});
 
+static noreturn int modprobe_builtin_alias_v3(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
+	const char *const args[] = {
+		progname,
+		"--show-depends", "-a",
+		"pci:v00008086d00002668sv00001028sd000001F3bc01sc06i01",
+		"platform:snd-hda-intel",
+		"pci:v00008086d0000100Esv00008086sd00001000bc02sc00i00",
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(modprobe_builtin_alias_v3,
+	.description = "check if builtin aliases resolve through the v3 matcher section",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/builtin-alias-v3",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/builtin-alias-v3/correct.txt",
+	});
+
 static noreturn int modprobe_softdep_loop(const struct test *t)
 {
 	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
@@ -181,6 +306,97 @@ DEFINE_TEST(modprobe_softdep_loop,
 	.modules_loaded = "mod-loop-a,mod-loop-b",
 	);
 
+static noreturn int modprobe_softdep_index(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
+	const char *const args[] = {
+		progname,
+		"mod-loop-b",
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(modprobe_softdep_index,
+	.description = "check if modprobe uses softdeps from modules.softdep.bin",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/softdep-index",
+		[TC_INIT_MODULE_RETCODES] = "",
+	},
+	.modules_loaded = "mod-loop-a,mod-loop-b",
+	);
+
+#define SERVER_SOCKET ABS_TOP_BUILDDIR "/testsuite/modprobe-server.sock"
+
+static bool server_is_listening(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	bool ret;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+
+	strncpy(addr.sun_path, SERVER_SOCKET, sizeof(addr.sun_path) - 1);
+	ret = connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+	close(fd);
+
+	return ret;
+}
+
+static noreturn int modprobe_server(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
+	const char *server = ABS_TOP_BUILDDIR "/tools/kmod";
+	const char *const args[] = {
+		progname,
+		"mod-loop-b",
+		NULL,
+	};
+	int i;
+
+	if (fork() == 0) {
+		int fd = open("/dev/null", O_RDWR);
+
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+
+		/* don't keep the test's monitor pipe open after it's done */
+		for (fd = STDERR_FILENO + 1; fd < 256; fd++)
+			close(fd);
+
+		execl(server, server, "server", "-s", SERVER_SOCKET, "-t", "1",
+									NULL);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < 500 && !server_is_listening(); i++)
+		usleep(10000);
+
+	/*
+	 * modprobe can't find anything by itself here: the modules are loaded
+	 * only if the server does it
+	 */
+	setenv(S_TC_ROOTFS, TESTSUITE_ROOTFS "test-modprobe/nonexistent", 1);
+	setenv("KMOD_SERVER_SOCKET", SERVER_SOCKET, 1);
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(modprobe_server,
+	.description = "check if modprobe hands the work to a kmod server",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/server",
+		[TC_INIT_MODULE_RETCODES] = "",
+	},
+	.modules_loaded = "mod-loop-a,mod-loop-b",
+	);
+
 static noreturn int modprobe_install_cmd_loop(const struct test *t)
 {
 	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
@@ -350,6 +566,97 @@ DEFINE_TEST(modprobe_force,
 	.modules_loaded = "mod-simple",
 	);
 
+static noreturn int modprobe_parallel(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
+	const char *const args[] = {
+		progname,
+		"--parallel", "mod-foo",
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(modprobe_parallel,
+	.description = "check modprobe --parallel inserts all dependencies",
+	.config = {
+		[TC_UNAME_R] = "4.0.20-kmod",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/parallel",
+		[TC_INIT_MODULE_RETCODES] = "",
+	},
+	.modules_loaded = "mod-foo,mod-foo-a,mod-foo-b,mod-foo-c",
+	);
+
+static noreturn int modprobe_parallel_all(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
+	const char *const args[] = {
+		progname,
+		"-a", "--parallel", "mod-foo-b", "mod-foo-c", "mod-foo-a",
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(modprobe_parallel_all,
+	.description = "check modprobe -a --parallel inserts each module once",
+	.config = {
+		[TC_UNAME_R] = "4.0.20-kmod",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/parallel-all",
+		[TC_INIT_MODULE_RETCODES] = "",
+	},
+	.modules_loaded = "mod-foo-a,mod-foo-b,mod-foo-c",
+	);
+
+static noreturn int modprobe_remove_parallel(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
+	const char *const args[] = {
+		progname,
+		"-r", "--remove-holders", "--parallel", "--dry-run",
+		"--wait", "1000", "mod-foo-a",
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(modprobe_remove_parallel,
+	.description = "check modprobe -r --parallel removes the holders first, in the serial order",
+	.config = {
+		[TC_UNAME_R] = "4.0.20-kmod",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/remove-parallel",
+		[TC_DELETE_MODULE_RETCODES] = "",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/remove-parallel/correct.txt",
+	});
+
+static noreturn int modprobe_remove_parallel_holder_fails(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
+	const char *const args[] = {
+		progname,
+		"-r", "--remove-holders", "--parallel", "--wait", "1000",
+		"mod-foo-a",
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(modprobe_remove_parallel_holder_fails,
+	.description = "check modprobe -r --parallel fails when a holder can't be removed",
+	.config = {
+		[TC_UNAME_R] = "4.0.20-kmod",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/remove-parallel",
+		[TC_DELETE_MODULE_RETCODES] = "mod_foo_b:-1:" STRINGIFY(EBUSY),
+	},
+	.expected_fail = true,
+	);
+
 static noreturn int modprobe_oldkernel(const struct test *t)
 {
 	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -70,6 +71,56 @@ DEFINE_TEST(from_name,
 		.out = TESTSUITE_ROOTFS "test-new-module/from_name/correct.txt",
 	});
 
+static int from_name_pool(const struct test *t)
+{
+	struct kmod_ctx *ctx;
+	struct kmod_module *mod, *a, *b;
+	const char *null_config = NULL;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	if (kmod_get_module_pool_size(ctx) == 0 ||
+			kmod_set_module_pool_size(ctx, 1) < 0 ||
+			kmod_get_module_pool_size(ctx) != 1)
+		exit(EXIT_FAILURE);
+
+	/* an unused module is kept and handed out again */
+	if (kmod_module_new_from_name(ctx, "ext4", &a) < 0)
+		exit(EXIT_FAILURE);
+	kmod_module_unref(a);
+	if (kmod_module_new_from_name(ctx, "ext4", &mod) < 0 || mod != a)
+		exit(EXIT_FAILURE);
+	printf("modname: %s\n", kmod_module_get_name(mod));
+
+	/* and evicted once more than the pool size are unused */
+	if (kmod_module_new_from_name(ctx, "snd-timer", &b) < 0)
+		exit(EXIT_FAILURE);
+	printf("modname: %s\n", kmod_module_get_name(b));
+	kmod_module_unref(mod);
+	kmod_module_unref(b);
+
+	if (kmod_module_new_from_name(ctx, "snd-timer", &mod) < 0 || mod != b)
+		exit(EXIT_FAILURE);
+	printf("modname: %s\n", kmod_module_get_name(mod));
+	kmod_module_unref(mod);
+
+	/* releasing the context releases the unused modules too */
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(from_name_pool,
+	.description = "check if unused modules are kept in the pool",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-new-module/from_name/",
+	},
+	.need_spawn = true,
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-new-module/from_name/correct-pool.txt",
+	});
+
 static int from_alias(const struct test *t)
 {
 	static const char *const modnames[] = {
@@ -115,4 +166,248 @@ DEFINE_TEST(from_alias,
 		.out = TESTSUITE_ROOTFS "test-new-module/from_alias/correct.txt",
 	});
 
+static int from_alias_config_order(const struct test *t)
+{
+	struct kmod_list *l, *list = NULL;
+	struct kmod_ctx *ctx;
+	int err;
+
+	ctx = kmod_new(NULL, NULL);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	err = kmod_module_new_from_lookup(ctx, "simple-alias", &list);
+	if (err < 0)
+		exit(EXIT_FAILURE);
+
+	kmod_list_foreach(l, list) {
+		struct kmod_module *m = kmod_module_get_module(l);
+		const char *s;
+
+		printf("modname: %s\n", kmod_module_get_name(m));
+		s = kmod_module_get_options(m);
+		printf("\toptions: %s\n", s ? s : "(null)");
+		s = kmod_module_get_install_commands(m);
+		printf("\tinstall: %s\n", s ? s : "(null)");
+		s = kmod_module_get_remove_commands(m);
+		printf("\tremove: %s\n", s ? s : "(null)");
+		kmod_module_unref(m);
+	}
+	kmod_module_unref_list(list);
+
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(from_alias_config_order,
+	.description = "check if config entries are matched in the order they are given",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-new-module/config_order/",
+	},
+	.need_spawn = true,
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-new-module/config_order/correct.txt",
+	});
+
+static int from_alias_batch(const struct test *t)
+{
+	static const char *const aliases[] = {
+		"pci:v00008086d00001234sv",
+		"ext4.foo",
+		"not-there",
+		"pci:v00008086d0000AAAA",
+		"ext4-foo",
+		"ext4.foo",
+	};
+	struct kmod_list *lists[sizeof(aliases) / sizeof(aliases[0])] = { };
+	struct kmod_ctx *ctx;
+	unsigned int i;
+	int err;
+
+	ctx = kmod_new(NULL, NULL);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	err = kmod_module_new_from_lookups(ctx, aliases, ARRAY_SIZE(aliases),
+									lists);
+	if (err < 0)
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < ARRAY_SIZE(aliases); i++) {
+		struct kmod_list *l;
+
+		printf("%s:", aliases[i]);
+		kmod_list_foreach(l, lists[i]) {
+			struct kmod_module *m;
+			m = kmod_module_get_module(l);
+
+			printf(" %s", kmod_module_get_name(m));
+			kmod_module_unref(m);
+		}
+		printf("\n");
+		kmod_module_unref_list(lists[i]);
+	}
+
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(from_alias_batch,
+	.description = "check if a batch of aliases is looked up correctly",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-new-module/from_alias_batch/",
+	},
+	.need_spawn = true,
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-new-module/from_alias_batch/correct.txt",
+	});
+
+static void print_lookup(struct kmod_ctx *ctx, const char *alias,
+						struct kmod_list **list)
+{
+	struct kmod_list *l;
+	int err;
+
+	err = kmod_module_new_from_lookup(ctx, alias, list);
+	if (err < 0)
+		exit(EXIT_FAILURE);
+
+	printf("%s:", alias);
+	kmod_list_foreach(l, *list) {
+		struct kmod_module *m;
+		m = kmod_module_get_module(l);
+
+		printf(" %s", kmod_module_get_name(m));
+		kmod_module_unref(m);
+	}
+	printf("\n");
+}
+
+static int from_alias_cached(const struct test *t)
+{
+	static const char *const aliases[] = {
+		"pci:v00008086d00001234sv",
+		"not-there",
+		"ext4.foo",
+	};
+	struct kmod_list *held = NULL, *list = NULL;
+	struct kmod_module *a, *b;
+	struct kmod_ctx *ctx;
+	unsigned int i;
+
+	ctx = kmod_new(NULL, NULL);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	if (kmod_set_lookup_cache_size(ctx, 2) < 0 ||
+			kmod_get_lookup_cache_size(ctx) != 2)
+		exit(EXIT_FAILURE);
+
+	/* hit while the modules are still referenced: same objects */
+	print_lookup(ctx, aliases[0], &held);
+	print_lookup(ctx, aliases[0], &list);
+	a = kmod_module_get_module(held);
+	b = kmod_module_get_module(list);
+	if (a != b)
+		exit(EXIT_FAILURE);
+	kmod_module_unref(a);
+	kmod_module_unref(b);
+	kmod_module_unref_list(list);
+	list = NULL;
+
+	/* misses are cached and the oldest entry gets evicted */
+	for (i = 0; i < ARRAY_SIZE(aliases); i++) {
+		print_lookup(ctx, aliases[i], &list);
+		kmod_module_unref_list(list);
+		list = NULL;
+	}
+
+	/* modules released meanwhile are looked up again */
+	kmod_module_unref_list(held);
+	for (i = 0; i < ARRAY_SIZE(aliases); i++) {
+		print_lookup(ctx, aliases[i], &list);
+		kmod_module_unref_list(list);
+		list = NULL;
+	}
+
+	if (kmod_set_lookup_cache_size(ctx, 0) < 0)
+		exit(EXIT_FAILURE);
+	print_lookup(ctx, aliases[2], &list);
+	kmod_module_unref_list(list);
+
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(from_alias_cached,
+	.description = "check if aliases are looked up correctly with the lookup cache",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-new-module/from_alias_batch/",
+	},
+	.need_spawn = true,
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-new-module/from_alias_batch/correct-cached.txt",
+	});
+
+static int resolve_symbols(const struct test *t)
+{
+	static const char *const symbols[] = {
+		"print_fooB",
+		"not_there",
+		"print_fooA",
+		"print_fooC",
+		"print_fooA",
+	};
+	const char *owners[sizeof(symbols) / sizeof(symbols[0])];
+	uint64_t crcs[sizeof(symbols) / sizeof(symbols[0])];
+	struct kmod_list *list = NULL;
+	struct kmod_ctx *ctx;
+	unsigned int i;
+	int n;
+
+	ctx = kmod_new(NULL, NULL);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	n = kmod_resolve_symbols(ctx, symbols, ARRAY_SIZE(symbols), owners,
+									crcs);
+	if (n < 0)
+		exit(EXIT_FAILURE);
+
+	printf("resolved: %d\n", n);
+	for (i = 0; i < ARRAY_SIZE(symbols); i++)
+		printf("%s: %s 0x%08llx\n", symbols[i],
+			owners[i] ? owners[i] : "(null)",
+			(unsigned long long) crcs[i]);
+
+	/* the same index is used for the lookups of the symbol: aliases */
+	print_lookup(ctx, "symbol:print_fooC", &list);
+	kmod_module_unref_list(list);
+
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(resolve_symbols,
+	.description = "check if a batch of symbols is resolved with modules.symbols.hash.bin",
+	.config = {
+		[TC_UNAME_R] = "4.0.20-kmod",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-new-module/resolve_symbols/",
+	},
+	.need_spawn = true,
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-new-module/resolve_symbols/correct.txt",
+	});
+
+DEFINE_TEST_WITH_FUNC(resolve_symbols_trie, resolve_symbols,
+	.description = "check if a batch of symbols is resolved with modules.symbols.bin",
+	.config = {
+		[TC_UNAME_R] = "4.0.20-kmod",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-dependencies/",
+	},
+	.need_spawn = true,
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-new-module/resolve_symbols/correct-trie.txt",
+	});
+
 TESTSUITE_MAIN();
@@ -94,5 +94,38 @@ static int test_strbuf_pushchars(const struct test *t)
 DEFINE_TEST(test_strbuf_pushchars,
 		.description = "test strbuf_{pushchars, popchar, popchars}");
 
+static int test_strbuf_with_stack(const struct test *t)
+{
+	char stack[16];
+	struct strbuf buf;
+	char *result;
+	const char *c;
+
+	strbuf_init_with_stack(&buf, stack, sizeof(stack));
+
+	strbuf_pushchars(&buf, "short");
+	assert_return(buf.bytes == stack, EXIT_FAILURE);
+	assert_return(streq(strbuf_str(&buf), "short"), EXIT_FAILURE);
+
+	/* spilling to the heap keeps what is in the buffer */
+	strbuf_clear(&buf);
+	for (c = TEXT; *c != '\0'; c++)
+		strbuf_pushchar(&buf, *c);
+	assert_return(buf.bytes != stack, EXIT_FAILURE);
+	assert_return(streq(strbuf_str(&buf), TEXT), EXIT_FAILURE);
+	strbuf_release(&buf);
+
+	/* a string stolen from the stack is a copy */
+	strbuf_init_with_stack(&buf, stack, sizeof(stack));
+	strbuf_pushchars(&buf, "short");
+	result = strbuf_steal(&buf);
+	assert_return(result != stack, EXIT_FAILURE);
+	assert_return(streq(result, "short"), EXIT_FAILURE);
+	free(result);
+
+	return 0;
+}
+DEFINE_TEST(test_strbuf_with_stack,
+		.description = "test strbuf_init_with_stack() and the spill to the heap");
 
 TESTSUITE_MAIN();
@@ -0,0 +1,422 @@
+/*
+ * Copyright (C) 2026  kmod contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Budgets for the I/O of libkmod operations, from the calls path.so
+ * traps: they fail when an index or a sysfs file starts being opened
+ * again where it used to be cached.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libkmod/libkmod.h>
+
+#include <shared/macro.h>
+
+#include "testsuite.h"
+
+static bool check_calls(const char *what, long max_opens, long max_stats)
+{
+	long opens = testsuite_calls(TS_CALL_OPEN);
+	long stats = testsuite_calls(TS_CALL_STAT);
+
+	if (opens < 0 || stats < 0) {
+		ERR("path.so is not preloaded\n");
+		return false;
+	}
+
+	if (opens > max_opens || stats > max_stats) {
+		ERR("%s: %ld opens and %ld stats, expected at most %ld and %ld\n",
+			what, opens, stats, max_opens, max_stats);
+		return false;
+	}
+
+	return true;
+}
+
+static int lookup_all(struct kmod_ctx *ctx, const char *const *aliases)
+{
+	for (; *aliases != NULL; aliases++) {
+		struct kmod_list *list = NULL;
+		int err;
+
+		err = kmod_module_new_from_lookup(ctx, *aliases, &list);
+		if (err < 0)
+			return err;
+		kmod_module_unref_list(list);
+	}
+
+	return 0;
+}
+
+static noreturn int test_lookup_warm(const struct test *t)
+{
+	static const char *const aliases[] = {
+		"pci:v00008086d00002668sv00001028sd000001F3bc01sc06i01",
+		"platform:snd-hda-intel",
+		"pci:v00008086d0000100Esv00008086sd00001000bc02sc00i00",
+		"pci:v0000FFFFd0000FFFFsv0000FFFFsd0000FFFFbcFFscFFiFF",
+		"e1000",
+		"not-a-module",
+		NULL,
+	};
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	bool ok;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	if (kmod_load_resources(ctx) < 0 || lookup_all(ctx, aliases) < 0)
+		exit(EXIT_FAILURE);
+
+	testsuite_calls_reset();
+	if (lookup_all(ctx, aliases) < 0)
+		exit(EXIT_FAILURE);
+	ok = check_calls("warm lookups", 0, 0);
+
+	kmod_unref(ctx);
+
+	exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+DEFINE_TEST(test_lookup_warm,
+	.description = "check that lookups in a context with the indexes loaded do no I/O",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-syscalls",
+		[TC_UNAME_R] = "4.4.4",
+	},
+	.need_spawn = true);
+
+static int initstate_all(struct kmod_list *list, long *n)
+{
+	struct kmod_list *itr;
+
+	*n = 0;
+	kmod_list_foreach(itr, list) {
+		struct kmod_module *mod = kmod_module_get_module(itr);
+		int state = kmod_module_get_initstate(mod);
+
+		if (state != KMOD_MODULE_LIVE) {
+			ERR("%s is not live: %d\n", kmod_module_get_name(mod),
+									state);
+			kmod_module_unref(mod);
+			return -EINVAL;
+		}
+		kmod_module_unref(mod);
+		(*n)++;
+	}
+
+	return 0;
+}
+
+static noreturn int test_initstate_opens(const struct test *t)
+{
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	struct kmod_list *list;
+	long n;
+	bool ok;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL || kmod_load_resources(ctx) < 0)
+		exit(EXIT_FAILURE);
+
+	/* /proc/modules, then the directory and initstate of each module */
+	testsuite_calls_reset();
+	if (kmod_module_new_from_loaded(ctx, &list) < 0 ||
+					initstate_all(list, &n) < 0)
+		exit(EXIT_FAILURE);
+	ok = check_calls("first initstate", 1 + 2 * n, 0);
+
+	/* the directories are kept open */
+	testsuite_calls_reset();
+	if (initstate_all(list, &n) < 0)
+		exit(EXIT_FAILURE);
+	ok = check_calls("second initstate", n, 0) && ok;
+
+	kmod_module_unref_list(list);
+	kmod_unref(ctx);
+
+	exit(ok && n == 3 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+DEFINE_TEST(test_initstate_opens,
+	.description = "check the opens kmod_module_get_initstate() needs for N modules",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-syscalls",
+		[TC_UNAME_R] = "4.4.4",
+	},
+	.need_spawn = true);
+
+static noreturn int test_snapshot_opens(const struct test *t)
+{
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	struct kmod_list *list;
+	long n;
+	bool ok;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL || kmod_load_resources(ctx) < 0)
+		exit(EXIT_FAILURE);
+
+	/* all the modules are live: only /proc/modules is read */
+	testsuite_calls_reset();
+	if (kmod_module_new_from_loaded_snapshot(ctx, &list) < 0 ||
+					initstate_all(list, &n) < 0)
+		exit(EXIT_FAILURE);
+	ok = check_calls("snapshot", 1, 0);
+
+	kmod_module_unref_list(list);
+	kmod_unref(ctx);
+
+	exit(ok && n == 3 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+DEFINE_TEST(test_snapshot_opens,
+	.description = "check that a snapshot of live modules only reads /proc/modules",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-syscalls",
+		[TC_UNAME_R] = "4.4.4",
+	},
+	.need_spawn = true);
+
+static unsigned int n_actions;
+
+static void count_action(struct kmod_module *m, bool install,
+							const char *options)
+{
+	n_actions++;
+}
+
+static noreturn int test_probe_opens(const struct test *t)
+{
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	struct kmod_module *mod;
+	bool ok;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL || kmod_load_resources(ctx) < 0 ||
+	    kmod_module_new_from_name(ctx, "mod-foo", &mod) < 0)
+		exit(EXIT_FAILURE);
+
+	/* the first probe also reads the config and the probe list */
+	if (kmod_module_probe_insert_module(mod, KMOD_PROBE_DRY_RUN, NULL,
+					NULL, NULL, count_action) < 0)
+		exit(EXIT_FAILURE);
+
+	/* initstate of mod-foo, then /proc/modules for its 3 dependencies */
+	n_actions = 0;
+	testsuite_calls_reset();
+	if (kmod_module_probe_insert_module(mod, KMOD_PROBE_DRY_RUN, NULL,
+					NULL, NULL, count_action) < 0)
+		exit(EXIT_FAILURE);
+	ok = check_calls("probe", 2, 0);
+
+	/* mod-foo-a and mod-foo-c are live */
+	if (n_actions != 2) {
+		ERR("expected 2 modules to insert, got %u\n", n_actions);
+		ok = false;
+	}
+
+	kmod_module_unref(mod);
+	kmod_unref(ctx);
+
+	exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+DEFINE_TEST(test_probe_opens,
+	.description = "check that a probe reads the live modules once for all its dependencies",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-syscalls-probe",
+		[TC_UNAME_R] = "4.0.20-kmod",
+	},
+	.need_spawn = true);
+
+static int builtin_info(struct kmod_ctx *ctx, const char *const *names)
+{
+	for (; *names != NULL; names++) {
+		struct kmod_module *mod;
+		struct kmod_list *info = NULL;
+		int err;
+
+		err = kmod_module_new_from_name(ctx, *names, &mod);
+		if (err < 0)
+			return err;
+
+		err = kmod_module_get_info(mod, &info);
+		kmod_module_unref(mod);
+		if (err <= 0)
+			return err < 0 ? err : -ENOENT;
+		kmod_module_info_free_list(info);
+	}
+
+	return 0;
+}
+
+static noreturn int test_builtin_modinfo_opens(const struct test *t)
+{
+	static const char *const names[] = {
+		"ext4", "usb_storage", "crc16", NULL,
+	};
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	bool ok;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL || kmod_load_resources(ctx) < 0)
+		exit(EXIT_FAILURE);
+
+	/* modules.builtin.modinfo and its index are kept in the context */
+	testsuite_calls_reset();
+	if (builtin_info(ctx, names) < 0)
+		exit(EXIT_FAILURE);
+	ok = check_calls("builtin modinfo", 0, 0);
+
+	kmod_unref(ctx);
+
+	exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+DEFINE_TEST(test_builtin_modinfo_opens,
+	.description = "check that the modinfo of builtin modules in a loaded context does no I/O",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modinfo/builtin",
+		[TC_UNAME_R] = "4.4.4",
+	},
+	.need_spawn = true);
+
+#define WATCH_FILE TESTSUITE_ROOTFS "test-syscalls/lib/modules/4.4.4/watch-test"
+static noreturn int test_validate_watch(const struct test *t)
+{
+	const char *null_config = NULL;
+	struct pollfd pfd = { .events = POLLIN };
+	struct kmod_ctx *ctx;
+	bool ok;
+	int fd;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL || kmod_load_resources(ctx) < 0)
+		exit(EXIT_FAILURE);
+
+	/* the first validation checks the files, then nothing changes */
+	pfd.fd = kmod_watch_resources(ctx);
+	if (pfd.fd < 0 || kmod_watch_resources(ctx) != pfd.fd ||
+	    kmod_validate_resources(ctx) != KMOD_RESOURCES_OK)
+		exit(EXIT_FAILURE);
+
+	testsuite_calls_reset();
+	if (kmod_validate_resources(ctx) != KMOD_RESOURCES_OK ||
+	    kmod_validate_resources(ctx) != KMOD_RESOURCES_OK)
+		exit(EXIT_FAILURE);
+	ok = check_calls("watched validation", 0, 0);
+
+	/* a new file in the module directory */
+	fd = open(WATCH_FILE, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		exit(EXIT_FAILURE);
+	close(fd);
+
+	if (poll(&pfd, 1, 1000) != 1) {
+		ERR("no event for a new file\n");
+		ok = false;
+	}
+
+	testsuite_calls_reset();
+	if (kmod_validate_resources(ctx) != KMOD_RESOURCES_OK)
+		exit(EXIT_FAILURE);
+	if (testsuite_calls(TS_CALL_STAT) == 0) {
+		ERR("a change was notified but the files were not checked\n");
+		ok = false;
+	}
+
+	/* only once */
+	testsuite_calls_reset();
+	if (kmod_validate_resources(ctx) != KMOD_RESOURCES_OK)
+		exit(EXIT_FAILURE);
+	ok = check_calls("validation after a change", 0, 0) && ok;
+
+	unlink(WATCH_FILE);
+	kmod_unref(ctx);
+
+	exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+DEFINE_TEST(test_validate_watch,
+	.description = "check that kmod_validate_resources() only checks the files after a change with kmod_watch_resources()",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-syscalls",
+		[TC_UNAME_R] = "4.4.4",
+	},
+	.need_spawn = true);
+
+#define WATCH_CONF_DIR TESTSUITE_ROOTFS "test-syscalls/run/modprobe.d"
+static noreturn int test_validate_watch_config(const struct test *t)
+{
+	const char *config[] = { WATCH_CONF_DIR, NULL };
+	struct pollfd pfd = { .events = POLLIN };
+	struct kmod_list *list = NULL;
+	struct kmod_ctx *ctx;
+	bool ok = true;
+	int fd;
+
+	ctx = kmod_new(NULL, config);
+	if (ctx == NULL || kmod_load_resources(ctx) < 0)
+		exit(EXIT_FAILURE);
+
+	/* watched before the configuration is read by the first lookup */
+	pfd.fd = kmod_watch_resources(ctx);
+	if (pfd.fd < 0 ||
+	    kmod_module_new_from_lookup(ctx, "watch-alias", &list) < 0 ||
+	    list == NULL ||
+	    kmod_validate_resources(ctx) != KMOD_RESOURCES_OK)
+		exit(EXIT_FAILURE);
+	kmod_module_unref_list(list);
+
+	fd = open(WATCH_CONF_DIR "/watch-new.conf",
+			O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		exit(EXIT_FAILURE);
+	close(fd);
+
+	if (poll(&pfd, 1, 1000) != 1) {
+		ERR("no event for a new file in modprobe.d\n");
+		ok = false;
+	}
+
+	if (kmod_validate_resources(ctx) != KMOD_RESOURCES_MUST_RECREATE) {
+		ERR("a new file in modprobe.d was not noticed\n");
+		ok = false;
+	}
+
+	unlink(WATCH_CONF_DIR "/watch-new.conf");
+	kmod_unref(ctx);
+
+	exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+DEFINE_TEST(test_validate_watch_config,
+	.description = "check that kmod_watch_resources() watches configuration read after it",
+	.config = {
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-syscalls",
+		[TC_UNAME_R] = "4.4.4",
+	},
+	.need_spawn = true);
+
+TESTSUITE_MAIN();
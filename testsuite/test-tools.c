@@ -68,4 +68,44 @@ DEFINE_TEST(kmod_tool_remove,
 	},
 	);
 
+static noreturn int kmod_tool_static_nodes(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/kmod";
+	const char *const args[] = {
+		progname,
+		"static-nodes", "--format=tmpfiles", "--output=/static-nodes.txt",
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(kmod_tool_static_nodes,
+	.description = "check kmod static-nodes with only modules.devname.bin",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-tools/static-nodes",
+	},
+	.output = {
+		.files = (const struct keyval[]) {
+			{ TESTSUITE_ROOTFS "test-tools/correct-static-nodes.txt",
+			  TESTSUITE_ROOTFS "test-tools/static-nodes/static-nodes.txt" },
+			{ }
+		},
+	});
+
+DEFINE_TEST_WITH_FUNC(kmod_tool_static_nodes_corrupt, kmod_tool_static_nodes,
+	.description = "check kmod static-nodes falls back to modules.devname",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-tools/static-nodes-corrupt",
+	},
+	.output = {
+		.files = (const struct keyval[]) {
+			{ TESTSUITE_ROOTFS "test-tools/correct-static-nodes.txt",
+			  TESTSUITE_ROOTFS "test-tools/static-nodes-corrupt/static-nodes.txt" },
+			{ }
+		},
+	});
+
 TESTSUITE_MAIN();
@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 #include <shared/util.h>
 
@@ -37,6 +38,10 @@ static int alias_1(const struct test *t)
 		"bar[aaa][bbbb]sss",
 		"kmod[p.b]lib",
 		"[az]1234[AZ]",
+		"snd-hda-intel",
+		"-a[b-c]-d-",
+		"a-b]c",
+		"a-[b-c",
 		NULL,
 	};
 
@@ -71,28 +76,29 @@ DEFINE_TEST(alias_1,
 		.out = TESTSUITE_ROOTFS "test-util/alias-correct.txt",
 	});
 
-static int test_freadline_wrapped(const struct test *t)
+static int test_line_reader(const struct test *t)
 {
-	FILE *fp = fopen("/freadline_wrapped-input.txt", "re");
+	struct line_reader r;
+	int fd = open("/freadline_wrapped-input.txt", O_RDONLY | O_CLOEXEC);
 
-	if (!fp)
+	if (fd < 0 || line_reader_open(&r, fd) < 0)
 		return EXIT_FAILURE;
+	close(fd);
 
-	while (!feof(fp) && !ferror(fp)) {
+	for (;;) {
 		unsigned int num = 0;
-		char *s = freadline_wrapped(fp, &num);
+		char *s = line_reader_next(&r, &num);
 		if (!s)
 			break;
 		puts(s);
-		free(s);
 		printf("%u\n", num);
 	}
 
-	fclose(fp);
+	line_reader_close(&r);
 	return EXIT_SUCCESS;
 }
-DEFINE_TEST(test_freadline_wrapped,
-	.description = "check if freadline_wrapped() does the right thing",
+DEFINE_TEST(test_line_reader,
+	.description = "check if line_reader_next() does the right thing",
 	.config = {
 		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-util/",
 	},
@@ -269,5 +275,44 @@ DEFINE_TEST(test_backoff_time,
 	.need_spawn = false,
 	);
 
+static int test_run_command(const struct test *t)
+{
+	static const struct {
+		const char *cmd;
+		int ret;
+	} cmds[] = {
+		/* spawned directly */
+		{ "true", 0 },
+		{ "  false  ", 1 },
+		{ "test\t1 -eq 3", 1 },
+		/* builtins and syntax need the shell */
+		{ "exit 4", 4 },
+		{ "true && exit 5", 5 },
+		{ "test \"$MODPROBE_MODULE\" = mod-foo", 0 },
+		{ "FOO=1 false", 1 },
+		{ "/nonexistent", 127 },
+	};
+	size_t i;
+
+	setenv("MODPROBE_MODULE", "stale", 1);
+
+	for (i = 0; i < ARRAY_SIZE(cmds); i++) {
+		int err = run_command(cmds[i].cmd, "mod-foo");
+
+		if (err < 0 || !WIFEXITED(err) || WEXITSTATUS(err) != cmds[i].ret) {
+			ERR("'%s': got %d, expected exit status %d\n",
+			    cmds[i].cmd, err, cmds[i].ret);
+			return EXIT_FAILURE;
+		}
+	}
+
+	assert_return(streq(getenv("MODPROBE_MODULE"), "stale"), EXIT_FAILURE);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(test_run_command,
+	.description = "check implementation of run_command()",
+	.need_spawn = false,
+	);
 
 TESTSUITE_MAIN();
@@ -16,6 +16,7 @@
  */
 
 #include <dirent.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
@@ -29,6 +30,7 @@
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
@@ -203,6 +205,9 @@ static void test_export_environ(const struct test *t)
 
 	free(preload);
 
+	/* never hand the work to a kmod server of the host */
+	setenv("KMOD_SERVER_SOCKET", "", 1);
+
 	for (env = t->env_vars; env && env->key; env++)
 		setenv(env->key, env->val, 1);
 }
@@ -933,6 +938,7 @@ out_a1:
 static inline int test_run_parent(const struct test *t, int fdout[2],
 				int fderr[2], int fdmonitor[2], pid_t child)
 {
+	struct rusage ru;
 	pid_t pid;
 	int err;
 	bool matchout, match_modules;
@@ -966,9 +972,9 @@ static inline int test_run_parent(const struct test *t, int fdout[2],
 	close(fdmonitor[0]);
 
 	do {
-		pid = wait(&err);
+		pid = wait4(child, &err, 0, &ru);
 		if (pid == -1) {
-			ERR("error waitpid(): %m\n");
+			ERR("error wait4(): %m\n");
 			err = EXIT_FAILURE;
 			goto exit;
 		}
@@ -979,8 +985,9 @@ static inline int test_run_parent(const struct test *t, int fdout[2],
 			ERR("'%s' [%u] exited with return code %d\n",
 					t->name, pid, WEXITSTATUS(err));
 		else
-			LOG("'%s' [%u] exited with return code %d\n",
-					t->name, pid, WEXITSTATUS(err));
+			LOG("'%s' [%u] exited with return code %d, peak RSS %ld KiB\n",
+					t->name, pid, WEXITSTATUS(err),
+					ru.ru_maxrss);
 	} else if (WIFSIGNALED(err)) {
 		ERR("'%s' [%u] terminated by signal %d (%s)\n", t->name, pid,
 				WTERMSIG(err), strsignal(WTERMSIG(err)));
@@ -1117,3 +1124,32 @@ int test_run(const struct test *t)
 
 	return test_run_child(t, fdout, fderr, fdmonitor);
 }
+
+static unsigned long *testsuite_call_counters(void)
+{
+	static unsigned long *counters;
+
+	if (counters == NULL)
+		counters = dlsym(RTLD_DEFAULT, "testsuite_call_counters");
+
+	return counters;
+}
+
+long testsuite_calls(enum testsuite_call call)
+{
+	unsigned long *counters = testsuite_call_counters();
+
+	if (counters == NULL)
+		return -1;
+
+	return __atomic_load_n(&counters[call], __ATOMIC_RELAXED);
+}
+
+void testsuite_calls_reset(void)
+{
+	unsigned long *counters = testsuite_call_counters();
+	int i;
+
+	for (i = 0; counters != NULL && i < _TS_CALL_LAST; i++)
+		__atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+}
@@ -79,6 +79,17 @@ struct keyval {
 	const char *val;
 };
 
+/*
+ * Calls trapped by path.so, i.e. with TC_ROOTFS set, counted so tests
+ * can put a budget on the I/O of an operation: see testsuite_calls().
+ */
+enum testsuite_call {
+	TS_CALL_OPEN,	/* open(), openat(), fopen(), opendir() */
+	TS_CALL_STAT,	/* stat(), lstat(), access() */
+	TS_CALL_OTHER,	/* mkdir(), chdir() */
+	_TS_CALL_LAST,
+};
+
 struct test {
 	const char *name;
 	const char *description;
@@ -122,6 +133,13 @@ const struct test *test_find(const struct test *start, const struct test *stop,
 int test_spawn_prog(const char *prog, const char *const args[]);
 int test_run(const struct test *t);
 
+/*
+ * Number of @call made since the last testsuite_calls_reset(), or -1
+ * if path.so isn't preloaded.
+ */
+long testsuite_calls(enum testsuite_call call);
+void testsuite_calls_reset(void);
+
 #define TS_EXPORT __attribute__ ((visibility("default")))
 
 #define _LOG(prefix, fmt, ...) printf("TESTSUITE: " prefix fmt, ## __VA_ARGS__)
@@ -0,0 +1,753 @@
+/*
+ * kmod-audit - check all the modules of a kernel before using them
+ *
+ * Copyright (C) 2026  kmod contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include <shared/array.h>
+#include <shared/hash.h>
+#include <shared/macro.h>
+#include <shared/util.h>
+
+#include <libkmod/libkmod-internal.h>
+
+#undef ERR
+#undef DBG
+
+#include "kmod.h"
+
+static const char cmdopts_s[] = "d:S:E:V:sj:h";
+static const struct option cmdopts[] = {
+	{"dirname", required_argument, 0, 'd'},
+	{"set-version", required_argument, 0, 'S'},
+	{"symvers", required_argument, 0, 'E'},
+	{"vermagic", required_argument, 0, 'V'},
+	{"signatures", no_argument, 0, 's'},
+	{"jobs", required_argument, 0, 'j'},
+	{"help", no_argument, 0, 'h'},
+	{ }
+};
+
+struct audit_module {
+	struct kmod_list *symbols;
+	struct kmod_list *dependency_symbols;
+	char *vermagic;
+	char *signer;
+	char *sig_key;
+	int err;
+	bool sig_done;
+	/* relative to the module directory, as in modules.dep */
+	char path[];
+};
+
+/* who exports a symbol: the first module in path order, or vmlinux */
+struct audit_symbol {
+	uint64_t crc;
+	const char *owner;
+	char name[];
+};
+
+struct audit_signer {
+	unsigned int count;
+	const char *signer;
+	const char *sig_key;
+};
+
+struct audit {
+	struct kmod_ctx *ctx;
+	const char *dirname;
+	struct audit_module **mods;
+	size_t count;
+	size_t next;
+	bool signatures;
+};
+
+struct audit_stats {
+	unsigned int unreadable;
+	unsigned int vermagic;
+	unsigned int symvers;
+	unsigned int unsigned_;
+};
+
+static void help(void)
+{
+	printf("Usage:\n"
+	       "\t%s audit [options]\n"
+	       "\n"
+	       "kmod audit reads every module in the module directory and reports\n"
+	       "those whose vermagic doesn't match the kernel and the symbols whose\n"
+	       "version disagrees with the one of the module exporting them, as\n"
+	       "depmod -e -E does. With -s the signatures are decoded as well: the\n"
+	       "modules that are not signed are reported, and the number of modules\n"
+	       "per signer and key is printed last. The exit status is 1 when\n"
+	       "anything was reported.\n"
+	       "\n"
+	       "Options:\n"
+	       "\t-d, --dirname=DIR           Use DIR as filesystem root for /lib/modules\n"
+	       "\t-S, --set-version=VERSION   Use VERSION instead of `uname -r`\n"
+	       "\t-E, --symvers=FILE          Use Module.symvers file for the versions\n"
+	       "\t                            of the symbols of the kernel\n"
+	       "\t-V, --vermagic=STRING       Expect STRING as vermagic, rather than\n"
+	       "\t                            only checking it starts with VERSION\n"
+	       "\t-s, --signatures            Check the signatures too\n"
+	       "\t-j, --jobs=N                Read up to N modules at once, 0 for one\n"
+	       "\t                            per CPU (default)\n"
+	       "\t-h, --help                  show this help\n",
+	       program_invocation_short_name);
+}
+
+static int audit_module_cmp(const void *pa, const void *pb)
+{
+	const struct audit_module *a = *(const struct audit_module **) pa;
+	const struct audit_module *b = *(const struct audit_module **) pb;
+
+	return strcmp(a->path, b->path);
+}
+
+static void audit_module_free(struct audit_module *m)
+{
+	kmod_module_symbols_free_list(m->symbols);
+	kmod_module_dependency_symbols_free_list(m->dependency_symbols);
+	free(m->vermagic);
+	free(m->signer);
+	free(m->sig_key);
+	free(m);
+}
+
+/*
+ * Find the modules under @dfd, like depmod does but without the search
+ * configuration: symbolic links, such as "build" and "source", are not
+ * followed.
+ */
+static int audit_scan_dir(struct array *mods, int dfd, char *path,
+							size_t baselen)
+{
+	struct dirent *de;
+	DIR *d;
+	int err = 0;
+
+	d = fdopendir(dfd);
+	if (d == NULL) {
+		err = -errno;
+		close(dfd);
+		return err;
+	}
+
+	while ((de = readdir(d)) != NULL && err >= 0) {
+		size_t namelen = strlen(de->d_name);
+		unsigned char type = de->d_type;
+
+		if (de->d_name[0] == '.')
+			continue;
+
+		if (baselen + namelen + 2 >= PATH_MAX) {
+			ERR("path is too long: %s/%s\n", path, de->d_name);
+			continue;
+		}
+
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+
+			if (fstatat(dirfd(d), de->d_name, &st,
+						AT_SYMLINK_NOFOLLOW) < 0)
+				continue;
+			if (S_ISDIR(st.st_mode))
+				type = DT_DIR;
+			else if (S_ISREG(st.st_mode))
+				type = DT_REG;
+		}
+
+		if (type == DT_DIR) {
+			int fd = openat(dirfd(d), de->d_name,
+				O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+			if (fd < 0)
+				continue;
+
+			path[baselen] = '/';
+			memcpy(path + baselen + 1, de->d_name, namelen + 1);
+			err = audit_scan_dir(mods, fd, path,
+						baselen + 1 + namelen);
+			path[baselen] = '\0';
+		} else if (type == DT_REG &&
+				path_ends_with_kmod_ext(de->d_name, namelen)) {
+			/* @path starts with a "/" unless it's empty */
+			size_t dirlen = baselen > 0 ? baselen - 1 : 0;
+			struct audit_module *m;
+
+			m = calloc(1, sizeof(*m) + baselen + namelen + 1);
+			if (m == NULL) {
+				err = -ENOMEM;
+				break;
+			}
+
+			if (dirlen > 0) {
+				memcpy(m->path, path + 1, dirlen);
+				m->path[dirlen++] = '/';
+			}
+			memcpy(m->path + dirlen, de->d_name, namelen + 1);
+
+			err = array_append(mods, m);
+			if (err < 0) {
+				free(m);
+				break;
+			}
+		}
+	}
+
+	closedir(d);
+
+	return err < 0 ? err : 0;
+}
+
+static char *info_dup(const char *key, size_t keylen, const char *want,
+					const char *value, size_t valuelen)
+{
+	if (keylen != strlen(want) || memcmp(key, want, keylen) != 0)
+		return NULL;
+
+	return strndup(value, valuelen);
+}
+
+static void audit_signature(struct audit_module *m, struct kmod_module *mod)
+{
+	struct kmod_list *l, *list = NULL;
+
+	if (kmod_module_get_info(mod, &list) < 0)
+		return;
+
+	kmod_list_foreach(l, list) {
+		const char *key = kmod_module_info_get_key(l);
+		const char *value = kmod_module_info_get_value(l);
+
+		if (value == NULL)
+			continue;
+		if (m->signer == NULL && streq(key, "signer"))
+			m->signer = strdup(value);
+		else if (m->sig_key == NULL && streq(key, "sig_key"))
+			m->sig_key = strdup(value);
+	}
+	kmod_module_info_free_list(list);
+
+	m->sig_done = true;
+}
+
+/*
+ * Everything the checks need from a module, read in one go: vermagic from
+ * ".modinfo" without decoding the signature, unless asked to, and the
+ * exported and the needed symbols from a single walk of .symtab.
+ */
+static void audit_read_module(const struct audit *audit, struct audit_module *m)
+{
+	struct kmod_module_lists lists;
+	struct kmod_module *mod;
+	char path[PATH_MAX];
+	const char *key, *value;
+	size_t pos = 0, keylen, valuelen;
+	int err;
+
+	snprintf(path, sizeof(path), "%s/%s", audit->dirname, m->path);
+	err = kmod_module_new_from_path(audit->ctx, path, &mod);
+	if (err < 0) {
+		m->err = err;
+		return;
+	}
+
+	while ((err = kmod_module_get_info_next(mod, &pos, &key, &keylen,
+						&value, &valuelen)) > 0) {
+		if (m->vermagic == NULL)
+			m->vermagic = info_dup(key, keylen, "vermagic",
+							value, valuelen);
+	}
+	if (err < 0) {
+		m->err = err;
+		goto finish;
+	}
+
+	kmod_module_get_lists(mod, KMOD_MODULE_LIST_SYMBOLS |
+				KMOD_MODULE_LIST_DEPENDENCY_SYMBOLS, &lists);
+	m->symbols = lists.symbols;
+	m->dependency_symbols = lists.dependency_symbols;
+	if (lists.symbols_ret < 0 && lists.symbols_ret != -ENODATA)
+		m->err = lists.symbols_ret;
+	else if (lists.dependency_symbols_ret < 0 &&
+			lists.dependency_symbols_ret != -ENODATA)
+		m->err = lists.dependency_symbols_ret;
+
+	if (audit->signatures)
+		audit_signature(m, mod);
+
+finish:
+	kmod_module_unref(mod);
+}
+
+static void *audit_worker(void *data)
+{
+	struct audit *audit = data;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&audit->next, 1, __ATOMIC_RELAXED))
+							< audit->count)
+		audit_read_module(audit, audit->mods[i]);
+
+	return NULL;
+}
+
+/* as depmod_load_modules_parallel(), the calling thread included */
+static void audit_read_modules(struct audit *audit, unsigned int jobs)
+{
+	pthread_t *threads = NULL;
+	unsigned int i, n = 0;
+
+	if (jobs > audit->count)
+		jobs = audit->count;
+
+	if (jobs > 1)
+		threads = malloc(sizeof(*threads) * (jobs - 1));
+	if (threads != NULL) {
+		for (; n < jobs - 1; n++) {
+			if (pthread_create(&threads[n], NULL, audit_worker,
+								audit) != 0) {
+				WRN("could not start thread, using %u: %m\n",
+				    n + 1);
+				break;
+			}
+		}
+	}
+
+	audit_worker(audit);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+static int audit_symbol_add(struct hash *symbols, const char *name,
+				size_t namelen, uint64_t crc, const char *owner)
+{
+	struct audit_symbol *sym;
+	int err;
+
+	if (hash_find_len(symbols, name, namelen) != NULL)
+		return 0;
+
+	sym = malloc(sizeof(*sym) + namelen + 1);
+	if (sym == NULL)
+		return -ENOMEM;
+
+	sym->crc = crc;
+	sym->owner = owner;
+	memcpy(sym->name, name, namelen);
+	sym->name[namelen] = '\0';
+
+	err = hash_add_len(symbols, sym->name, namelen, sym);
+	if (err < 0)
+		free(sym);
+
+	return err;
+}
+
+/* the symbols of vmlinux, in the format depmod -E reads */
+static int audit_load_symvers(struct hash *symbols, const char *filename)
+{
+	char *line = NULL;
+	size_t linesz = 0;
+	unsigned int linenum = 0;
+	FILE *fp;
+	int err = 0;
+
+	fp = fopen(filename, "re");
+	if (fp == NULL)
+		return -errno;
+
+	/* eg. "0xb352177e\tfind_first_bit\tvmlinux\tEXPORT_SYMBOL" */
+	while (getline(&line, &linesz, fp) > 0 && err >= 0) {
+		char *saveptr, *ver, *sym, *where, *end;
+		uint64_t crc;
+
+		linenum++;
+		ver = strtok_r(line, " \t\n", &saveptr);
+		sym = strtok_r(NULL, " \t\n", &saveptr);
+		where = strtok_r(NULL, " \t\n", &saveptr);
+		if (ver == NULL || sym == NULL || where == NULL ||
+						!streq(where, "vmlinux"))
+			continue;
+
+		crc = strtoull(ver, &end, 16);
+		if (*end != '\0') {
+			ERR("%s:%u Invalid symbol version %s\n", filename,
+							linenum, ver);
+			continue;
+		}
+
+		err = audit_symbol_add(symbols, sym, strlen(sym), crc,
+								"vmlinux");
+	}
+
+	free(line);
+	fclose(fp);
+
+	return err;
+}
+
+/*
+ * The check of depmod_load_module_dependencies() with check_symvers: the
+ * version a module has for a symbol must be the one of its exporter.
+ */
+static void audit_check_symbols(const struct hash *symbols,
+				const struct audit_module *m,
+				struct audit_stats *stats)
+{
+	struct kmod_list *l;
+
+	kmod_list_foreach(l, m->dependency_symbols) {
+		const char *name = kmod_module_dependency_symbol_get_symbol(l);
+		uint64_t crc = kmod_module_dependency_symbol_get_crc(l);
+		int bindtype = kmod_module_dependency_symbol_get_bind(l);
+		const struct audit_symbol *sym = hash_find(symbols, name);
+
+		if (sym == NULL || bindtype == KMOD_SYMBOL_WEAK ||
+							sym->crc == crc)
+			continue;
+
+		printf("%s: disagrees about version of symbol %s (%#"PRIx64", %#"PRIx64" in %s)\n",
+		       m->path, name, crc, sym->crc, sym->owner);
+		stats->symvers++;
+	}
+}
+
+/* modpost leaves a space at the end of vermagic: ignore those */
+static size_t vermagic_len(const char *s)
+{
+	size_t len = strlen(s);
+
+	while (len > 0 && s[len - 1] == ' ')
+		len--;
+
+	return len;
+}
+
+static void audit_check_vermagic(const struct audit_module *m,
+				 const char *kversion, const char *vermagic,
+				 struct audit_stats *stats)
+{
+	size_t len;
+
+	if (m->vermagic == NULL) {
+		printf("%s: no vermagic\n", m->path);
+		stats->vermagic++;
+		return;
+	}
+
+	if (vermagic != NULL) {
+		len = vermagic_len(vermagic);
+		if (vermagic_len(m->vermagic) == len &&
+				strncmp(m->vermagic, vermagic, len) == 0)
+			return;
+	} else {
+		/* the release is the first word */
+		len = strlen(kversion);
+		if (strncmp(m->vermagic, kversion, len) == 0 &&
+			(m->vermagic[len] == ' ' || m->vermagic[len] == '\0'))
+			return;
+	}
+
+	printf("%s: vermagic \"%s\" doesn't match \"%s\"\n", m->path,
+			m->vermagic, vermagic != NULL ? vermagic : kversion);
+	stats->vermagic++;
+}
+
+static int audit_signer_cmp(const void *pa, const void *pb)
+{
+	const struct audit_signer *a = *(const struct audit_signer **) pa;
+	const struct audit_signer *b = *(const struct audit_signer **) pb;
+	int r;
+
+	if (a->count != b->count)
+		return a->count < b->count ? 1 : -1;
+
+	r = strcmp(a->signer, b->signer);
+	return r != 0 ? r : strcmp(a->sig_key, b->sig_key);
+}
+
+static int audit_print_signers(const struct audit *audit)
+{
+	struct array signers;
+	size_t i, j;
+	int err = 0;
+
+	array_init(&signers, 4);
+
+	for (i = 0; i < audit->count; i++) {
+		const struct audit_module *m = audit->mods[i];
+		struct audit_signer *s = NULL;
+
+		if (m->signer == NULL)
+			continue;
+
+		for (j = 0; j < signers.count; j++) {
+			struct audit_signer *t = signers.array[j];
+
+			if (streq(t->signer, m->signer) &&
+			    streq(t->sig_key, m->sig_key ? m->sig_key : "")) {
+				s = t;
+				break;
+			}
+		}
+
+		if (s == NULL) {
+			s = malloc(sizeof(*s));
+			if (s == NULL || array_append(&signers, s) < 0) {
+				free(s);
+				err = -ENOMEM;
+				goto finish;
+			}
+			s->count = 0;
+			s->signer = m->signer;
+			s->sig_key = m->sig_key ? m->sig_key : "";
+		}
+		s->count++;
+	}
+
+	array_sort(&signers, audit_signer_cmp);
+	for (i = 0; i < signers.count; i++) {
+		const struct audit_signer *s = signers.array[i];
+
+		printf("%u signed by \"%s\" with key %s\n", s->count,
+							s->signer, s->sig_key);
+	}
+
+finish:
+	for (i = 0; i < signers.count; i++)
+		free(signers.array[i]);
+	array_free_array(&signers);
+
+	return err;
+}
+
+static int audit_report(const struct audit *audit, const char *kversion,
+			const char *vermagic, const char *symvers)
+{
+	struct audit_stats stats = { };
+	struct hash *symbols;
+	size_t i;
+	int err = 0;
+
+	symbols = hash_new(1024, free);
+	if (symbols == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < audit->count && err >= 0; i++) {
+		const struct audit_module *m = audit->mods[i];
+		struct kmod_list *l;
+
+		kmod_list_foreach(l, m->symbols) {
+			const char *name = kmod_module_symbol_get_symbol(l);
+
+			err = audit_symbol_add(symbols, name, strlen(name),
+					kmod_module_symbol_get_crc(l), m->path);
+			if (err < 0)
+				break;
+		}
+	}
+
+	if (err >= 0 && symvers != NULL) {
+		err = audit_load_symvers(symbols, symvers);
+		if (err < 0 && err != -ENOMEM) {
+			ERR("could not load %s: %s\n", symvers, strerror(-err));
+			goto finish;
+		}
+	}
+
+	if (err < 0)
+		goto finish;
+
+	for (i = 0; i < audit->count; i++) {
+		const struct audit_module *m = audit->mods[i];
+
+		if (m->err < 0) {
+			printf("%s: could not read: %s\n", m->path,
+							strerror(-m->err));
+			stats.unreadable++;
+			continue;
+		}
+
+		audit_check_vermagic(m, kversion, vermagic, &stats);
+		audit_check_symbols(symbols, m, &stats);
+
+		if (m->sig_done && m->signer == NULL) {
+			printf("%s: not signed\n", m->path);
+			stats.unsigned_++;
+		}
+	}
+
+	printf("%zu modules: %u unreadable, %u with a bad vermagic, %u symbol versions disagreeing",
+	       audit->count, stats.unreadable, stats.vermagic, stats.symvers);
+	if (audit->signatures)
+		printf(", %u not signed", stats.unsigned_);
+	printf("\n");
+
+	if (audit->signatures)
+		err = audit_print_signers(audit);
+
+	if (err >= 0 && stats.unreadable + stats.vermagic + stats.symvers +
+							stats.unsigned_ > 0)
+		err = 1;
+
+finish:
+	hash_free(symbols);
+	return err;
+}
+
+static int do_audit(int argc, char *argv[])
+{
+	struct audit audit = { };
+	struct array mods;
+	char dirname[PATH_MAX], path[PATH_MAX];
+	const char *root = "";
+	const char *kversion = NULL;
+	const char *symvers = NULL;
+	const char *vermagic = NULL;
+	unsigned int jobs = 0;
+	struct utsname u;
+	size_t i;
+	int fd, err;
+
+	for (;;) {
+		int c, idx = 0;
+		unsigned long n;
+		char *end;
+
+		c = getopt_long(argc, argv, cmdopts_s, cmdopts, &idx);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'd':
+			root = optarg;
+			break;
+		case 'S':
+			kversion = optarg;
+			break;
+		case 'E':
+			symvers = optarg;
+			break;
+		case 'V':
+			vermagic = optarg;
+			break;
+		case 's':
+			audit.signatures = true;
+			break;
+		case 'j':
+			n = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || n > UINT_MAX) {
+				ERR("invalid number of jobs: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			jobs = n;
+			break;
+		case 'h':
+			help();
+			return EXIT_SUCCESS;
+		case '?':
+			return EXIT_FAILURE;
+		default:
+			ERR("Unexpected getopt_long() value '%c'.\n", c);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc) {
+		ERR("unexpected argument: %s\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	if (kversion == NULL) {
+		if (uname(&u) < 0) {
+			ERR("uname() failed: %m\n");
+			return EXIT_FAILURE;
+		}
+		kversion = u.release;
+	}
+	snprintf(dirname, sizeof(dirname), "%s/lib/modules/%s", root,
+								kversion);
+
+	if (jobs == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		jobs = n > 0 ? (unsigned int) n : 1;
+	}
+
+	fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		ERR("could not open %s: %m\n", dirname);
+		return EXIT_FAILURE;
+	}
+
+	array_init(&mods, 1024);
+	path[0] = '\0';
+	err = audit_scan_dir(&mods, fd, path, 0);
+	if (err < 0) {
+		ERR("could not read %s: %s\n", dirname, strerror(-err));
+		goto finish;
+	}
+	array_sort(&mods, audit_module_cmp);
+
+	audit.ctx = kmod_new(dirname, NULL);
+	if (audit.ctx == NULL) {
+		ERR("kmod_new() failed!\n");
+		err = -ENOMEM;
+		goto finish;
+	}
+	log_setup_kmod_log(audit.ctx, LOG_ERR);
+
+	audit.dirname = dirname;
+	audit.mods = (struct audit_module **) mods.array;
+	audit.count = mods.count;
+	audit_read_modules(&audit, jobs);
+
+	err = audit_report(&audit, kversion, vermagic, symvers);
+	if (err == -ENOMEM)
+		ERR("could not allocate memory\n");
+
+	kmod_unref(audit.ctx);
+
+finish:
+	for (i = 0; i < mods.count; i++)
+		audit_module_free(mods.array[i]);
+	array_free_array(&mods);
+
+	return err != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+const struct kmod_cmd kmod_cmd_audit = {
+	.name = "audit",
+	.cmd = do_audit,
+	.help = "check the vermagic, symbol versions and signatures of all modules",
+};
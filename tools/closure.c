@@ -0,0 +1,268 @@
+/*
+ * kmod-closure - list everything needed to load a set of modules
+ *
+ * Copyright (C) 2026  kmod contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+
+#include <shared/hash.h>
+#include <shared/macro.h>
+#include <shared/util.h>
+
+#include <libkmod/libkmod.h>
+
+#include "kmod.h"
+
+static const char cmdopts_s[] = "d:S:h";
+static const struct option cmdopts[] = {
+	{"dirname", required_argument, 0, 'd'},
+	{"set-version", required_argument, 0, 'S'},
+	{"help", no_argument, 0, 'h'},
+	{ }
+};
+
+/* what was printed already, so each module and firmware appears once */
+static struct hash *seen_modules;
+static struct hash *seen_firmware;
+
+static void help(void)
+{
+	printf("Usage:\n"
+	       "\t%s closure [options] [module...]\n"
+	       "\n"
+	       "kmod closure prints the modules, builtin modules, install commands and\n"
+	       "firmware files needed to load the given modules or aliases, including\n"
+	       "their dependencies and softdeps, each only once. Without arguments the\n"
+	       "names are read from the standard input, separated by whitespace.\n"
+	       "\n"
+	       "Options:\n"
+	       "\t-d, --dirname=DIR           Use DIR as filesystem root for /lib/modules\n"
+	       "\t-S, --set-version=VERSION   Use VERSION instead of `uname -r`\n"
+	       "\t-h, --help                  show this help\n",
+	       program_invocation_short_name);
+}
+
+/* Returns true if @s wasn't in @hash yet and was added to it */
+static bool closure_mark(struct hash *hash, const char *s, size_t len)
+{
+	char *key;
+
+	if (hash_find_len(hash, s, len) != NULL)
+		return false;
+
+	key = strndup(s, len);
+	if (key == NULL || hash_add_len(hash, key, len, key) < 0) {
+		free(key);
+		return false;
+	}
+
+	return true;
+}
+
+static void closure_print_firmware(struct kmod_module *mod)
+{
+	const char *key, *value;
+	size_t pos = 0, keylen, valuelen;
+
+	while (kmod_module_get_info_next(mod, &pos, &key, &keylen,
+						&value, &valuelen) > 0) {
+		if (keylen != strlen("firmware") ||
+				memcmp(key, "firmware", keylen) != 0)
+			continue;
+
+		if (closure_mark(seen_firmware, value, valuelen))
+			printf("firmware %.*s\n", (int) valuelen, value);
+	}
+}
+
+static void closure_print(struct kmod_module *m, bool install,
+							const char *options)
+{
+	const char *name = kmod_module_get_name(m);
+	const char *path;
+
+	if (!closure_mark(seen_modules, name, strlen(name)))
+		return;
+
+	path = kmod_module_get_path(m);
+
+	if (install)
+		printf("install %s %s\n", name,
+					kmod_module_get_install_commands(m));
+
+	if (path != NULL)
+		printf("module %s\n", path);
+	else if (kmod_module_get_initstate(m) == KMOD_MODULE_BUILTIN)
+		printf("builtin %s\n", name);
+	else
+		/* an alias backed by an install command only */
+		return;
+
+	closure_print_firmware(m);
+}
+
+static int closure_add(struct kmod_ctx *ctx, const char *alias)
+{
+	struct kmod_list *l, *list = NULL;
+	int err;
+
+	err = kmod_module_new_from_lookup(ctx, alias, &list);
+	if (list == NULL || err < 0) {
+		ERR("Module %s not found in directory %s\n", alias,
+							kmod_get_dirname(ctx));
+		return -ENOENT;
+	}
+
+	kmod_list_foreach(l, list) {
+		struct kmod_module *mod = kmod_module_get_module(l);
+		int r;
+
+		/*
+		 * A dry run of the whole probe list, as modprobe
+		 * --show-depends does: the lists are memoized in the context,
+		 * so the modules shared by several arguments are cheap.
+		 */
+		r = kmod_module_probe_insert_module(mod,
+				KMOD_PROBE_DRY_RUN | KMOD_PROBE_IGNORE_LOADED,
+				NULL, NULL, NULL, closure_print);
+		if (r < 0) {
+			ERR("could not resolve '%s': %s\n",
+					kmod_module_get_name(mod), strerror(-r));
+			err = r;
+		}
+
+		kmod_module_unref(mod);
+	}
+	kmod_module_unref_list(list);
+
+	return err < 0 ? err : 0;
+}
+
+static int closure_add_stdin(struct kmod_ctx *ctx)
+{
+	char *line = NULL;
+	size_t linesz = 0;
+	int err = 0;
+
+	while (getline(&line, &linesz, stdin) > 0) {
+		char *saveptr, *name;
+
+		for (name = strtok_r(line, " \t\n", &saveptr); name != NULL;
+				name = strtok_r(NULL, " \t\n", &saveptr)) {
+			if (closure_add(ctx, name) < 0)
+				err = -ENOENT;
+		}
+	}
+
+	free(line);
+
+	return err;
+}
+
+static int do_closure(int argc, char *argv[])
+{
+	struct kmod_ctx *ctx;
+	char dirname_buf[PATH_MAX];
+	const char *dirname = NULL;
+	const char *root = NULL;
+	const char *kversion = NULL;
+	int i, err = 0;
+
+	for (;;) {
+		int c, idx = 0;
+		c = getopt_long(argc, argv, cmdopts_s, cmdopts, &idx);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'd':
+			root = optarg;
+			break;
+		case 'S':
+			kversion = optarg;
+			break;
+		case 'h':
+			help();
+			return EXIT_SUCCESS;
+		case '?':
+			return EXIT_FAILURE;
+		default:
+			ERR("Unexpected getopt_long() value '%c'.\n", c);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (root != NULL || kversion != NULL) {
+		struct utsname u;
+
+		if (root == NULL)
+			root = "";
+		if (kversion == NULL) {
+			if (uname(&u) < 0) {
+				ERR("uname() failed: %m\n");
+				return EXIT_FAILURE;
+			}
+			kversion = u.release;
+		}
+		snprintf(dirname_buf, sizeof(dirname_buf),
+				"%s/lib/modules/%s", root, kversion);
+		dirname = dirname_buf;
+	}
+
+	ctx = kmod_new(dirname, NULL);
+	if (!ctx) {
+		ERR("kmod_new() failed!\n");
+		return EXIT_FAILURE;
+	}
+
+	log_setup_kmod_log(ctx, LOG_ERR);
+	kmod_load_resources(ctx);
+
+	seen_modules = hash_new(256, free);
+	seen_firmware = hash_new(64, free);
+	if (seen_modules == NULL || seen_firmware == NULL) {
+		ERR("could not allocate memory\n");
+		err = -ENOMEM;
+		goto finish;
+	}
+
+	if (optind >= argc)
+		err = closure_add_stdin(ctx);
+
+	for (i = optind; i < argc; i++) {
+		if (closure_add(ctx, argv[i]) < 0)
+			err = -ENOENT;
+	}
+
+finish:
+	hash_free(seen_firmware);
+	hash_free(seen_modules);
+	kmod_unref(ctx);
+
+	return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+const struct kmod_cmd kmod_cmd_closure = {
+	.name = "closure",
+	.cmd = do_closure,
+	.help = "list the files needed to load modules and their dependencies",
+};
@@ -0,0 +1,135 @@
+/*
+ * kmod-config-compile - compile the modprobe configuration
+ *
+ * Copyright (C) 2026  kmod contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+
+#include <libkmod/libkmod-internal.h>
+
+#undef ERR
+#undef DBG
+
+#include "kmod.h"
+
+static const char cmdopts_s[] = "d:S:h";
+static const struct option cmdopts[] = {
+	{"dirname", required_argument, 0, 'd'},
+	{"set-version", required_argument, 0, 'S'},
+	{"help", no_argument, 0, 'h'},
+	{ }
+};
+
+static void help(void)
+{
+	printf("Usage:\n"
+	       "\t%s config-compile [options]\n"
+	       "\n"
+	       "kmod config-compile parses the modprobe configuration and stores it in\n"
+	       "the module directory as " KMOD_CONFIG_CACHE ", which libkmod uses\n"
+	       "as long as none of the configuration files change.\n"
+	       "\n"
+	       "Options:\n"
+	       "\t-d, --dirname=DIR           Use DIR as filesystem root for /lib/modules\n"
+	       "\t-S, --set-version=VERSION   Use VERSION instead of `uname -r`\n"
+	       "\t-h, --help                  show this help\n",
+	       program_invocation_short_name);
+}
+
+static int do_config_compile(int argc, char *argv[])
+{
+	struct kmod_ctx *ctx;
+	char dirname_buf[PATH_MAX];
+	const char *dirname = NULL;
+	const char *root = NULL;
+	const char *kversion = NULL;
+	int err;
+
+	for (;;) {
+		int c, idx = 0;
+		c = getopt_long(argc, argv, cmdopts_s, cmdopts, &idx);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'd':
+			root = optarg;
+			break;
+		case 'S':
+			kversion = optarg;
+			break;
+		case 'h':
+			help();
+			return EXIT_SUCCESS;
+		case '?':
+			return EXIT_FAILURE;
+		default:
+			ERR("Unexpected getopt_long() value '%c'.\n", c);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc) {
+		ERR("Unexpected argument '%s'\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	if (root != NULL || kversion != NULL) {
+		struct utsname u;
+
+		if (root == NULL)
+			root = "";
+		if (kversion == NULL) {
+			if (uname(&u) < 0) {
+				ERR("uname() failed: %m\n");
+				return EXIT_FAILURE;
+			}
+			kversion = u.release;
+		}
+		snprintf(dirname_buf, sizeof(dirname_buf),
+				"%s/lib/modules/%s", root, kversion);
+		dirname = dirname_buf;
+	}
+
+	ctx = kmod_new(dirname, NULL);
+	if (!ctx) {
+		ERR("kmod_new() failed!\n");
+		return EXIT_FAILURE;
+	}
+
+	log_setup_kmod_log(ctx, LOG_ERR);
+
+	err = kmod_config_write_cache(kmod_get_config(ctx));
+	if (err < 0)
+		ERR("could not compile configuration in %s: %s\n",
+				kmod_get_dirname(ctx), strerror(-err));
+
+	kmod_unref(ctx);
+
+	return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+const struct kmod_cmd kmod_cmd_config_compile = {
+	.name = "config-compile",
+	.cmd = do_config_compile,
+	.help = "compile the modprobe configuration for faster loading",
+};
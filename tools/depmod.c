@@ -21,22 +21,33 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/utsname.h>
 
+#ifdef ENABLE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <shared/arena.h>
 #include <shared/array.h>
 #include <shared/hash.h>
 #include <shared/macro.h>
 #include <shared/util.h>
 #include <shared/scratchbuf.h>
+#include <shared/strbuf.h>
 
 #include <libkmod/libkmod-internal.h>
 
@@ -59,7 +70,7 @@ static const char *const default_cfg_paths[] = {
 	NULL
 };
 
-static const char cmdopts_s[] = "aAb:o:C:E:F:euqrvnP:wmVh";
+static const char cmdopts_s[] = "aAb:o:C:E:F:euqrvnP:wj:mVh";
 static const struct option cmdopts[] = {
 	{ "all", no_argument, 0, 'a' },
 	{ "quick", no_argument, 0, 'A' },
@@ -77,7 +88,13 @@ static const struct option cmdopts[] = {
 	{ "dry-run", no_argument, 0, 'n' },
 	{ "symbol-prefix", required_argument, 0, 'P' },
 	{ "warn", no_argument, 0, 'w' },
+	{ "jobs", required_argument, 0, 'j' },
 	{ "map", no_argument, 0, 'm' }, /* deprecated */
+	{ "index-version", required_argument, 0, 1 },
+	{ "stats", optional_argument, 0, 2 },
+	{ "sync", no_argument, 0, 3 },
+	{ "delta", no_argument, 0, 4 },
+	{ "compress-indexes", no_argument, 0, 5 },
 	{ "version", no_argument, 0, 'V' },
 	{ "help", no_argument, 0, 'h' },
 	{ }
@@ -86,7 +103,7 @@ static const struct option cmdopts[] = {
 static void help(void)
 {
 	printf("Usage:\n"
-		"\t%s -[aA] [options] [forced_version]\n"
+		"\t%s -[aA] [options] [forced_version...]\n"
 		"\n"
 		"If no arguments (except options) are given, \"depmod -a\" is assumed\n"
 		"\n"
@@ -101,6 +118,8 @@ static void help(void)
 		"\t-C, --config=PATH    Read configuration from PATH\n"
 		"\t-v, --verbose        Enable verbose mode\n"
 		"\t-w, --warn           Warn on duplicates\n"
+		"\t-j, --jobs=N         Read up to N modules at once, 0 for one\n"
+		"\t                     per online CPU\n"
 		"\t-V, --version        show version\n"
 		"\t-h, --help           show this help\n"
 		"\n"
@@ -110,7 +129,17 @@ static void help(void)
 		"\t-F, --filesyms=FILE  Use the file instead of the\n"
 		"\t                     current kernel symbols.\n"
 		"\t-E, --symvers=FILE   Use Module.symvers file to check\n"
-		"\t                     symbol versions.\n",
+		"\t                     symbol versions.\n"
+		"\t--index-version=N    Binary index format to write: 2 (default),\n"
+		"\t                     read by all libkmod, or 3.\n"
+		"\t--stats[=FORMAT]     Print the time and data of each phase on\n"
+		"\t                     stderr, as text (default) or json.\n"
+		"\t--sync               Flush the files to disk before renaming\n"
+		"\t                     them in place, all at once.\n"
+		"\t--delta              Only write the indexes of the modules\n"
+		"\t                     changed since the last full run.\n"
+		"\t--compress-indexes   Write the alias and symbol indexes in\n"
+		"\t                     compressed blocks.\n",
 		program_invocation_short_name);
 }
 
@@ -129,7 +158,6 @@ static inline void _show(const char *fmt, ...)
 }
 #define SHOW(...) _show(__VA_ARGS__)
 
-
 /* binary index write *************************************************/
 #include <arpa/inet.h>
 /* BEGIN: code from module-init-tools/index.c just modified to compile here.
@@ -155,10 +183,27 @@ static inline void _show(const char *fmt, ...)
 /* see documentation in libkmod/libkmod-index.c */
 
 #define INDEX_MAGIC 0xB007F457
-#define INDEX_VERSION_MAJOR 0x0002
+#define INDEX_VERSION_MAJOR 0x0003
 #define INDEX_VERSION_MINOR 0x0001
 #define INDEX_VERSION ((INDEX_VERSION_MAJOR<<16)|INDEX_VERSION_MINOR)
+#define INDEX_VERSION_V2 ((0x0002<<16)|0x0001)
+#define INDEX_FILTER_MAGIC 0xB007F45A
+#define INDEX_FILTER_LITERAL 0x1
+/* about 1% of false positives with KEY_FILTER_PROBES */
+#define INDEX_FILTER_BITS_PER_KEY 10
 #define INDEX_CHILDMAX 128
+/* nodes written together at the end of a v3 trie, the first in BFS order */
+#define INDEX_TOP_NODES 256
+#define INDEX_BUNDLE_MAGIC 0xB007F458
+#define INDEX_BUNDLE_VERSION 0x00010000
+#define INDEX_MODDEP_MAGIC 0xB007F459
+#define INDEX_MODDEP_VERSION 0x00010000
+#define INDEX_DEVNAME_MAGIC 0xB007F45B
+#define INDEX_DEVNAME_VERSION 0x00010000
+#define INDEX_SYMHASH_MAGIC 0xB007F45C
+#define INDEX_SYMHASH_VERSION 0x00010000
+#define INDEX_BLOCKS_MAGIC 0xB007F45D
+#define INDEX_BLOCKS_VERSION 0x00010000
 
 struct index_value {
 	struct index_value *next;
@@ -166,13 +211,27 @@ struct index_value {
 	char value[0];
 };
 
+struct index_child {
+	unsigned char ch;
+	struct index_node *node;
+};
+
 /* In-memory index (depmod only) */
 struct index_node {
 	char *prefix;		/* path compression */
 	struct index_value *values;
-	unsigned char first;	/* range of child nodes */
-	unsigned char last;
-	struct index_node *children[INDEX_CHILDMAX]; /* indexed by character */
+	uint32_t values_offset;	/* position in the v3 value pool */
+	uint32_t offset;	/* of the v3 node, once written */
+	bool top;		/* written with the top of the v3 trie */
+	unsigned char child_count;
+	unsigned char child_alloc;
+	struct index_child *children; /* sorted by character */
+};
+
+/* Everything in a trie, nodes, prefixes and values, is in its arena */
+struct index {
+	struct arena arena;
+	struct index_node root;
 };
 
 
@@ -186,40 +245,95 @@ enum node_offset {
 	INDEX_NODE_MASK     = 0x0FFFFFFF, /* Offset value */
 };
 
-static struct index_node *index_create(void)
+/* Flags byte heading each node of a v3 index file */
+enum node_flags {
+	INDEX_NODE3_PREFIX      = 0x01,
+	INDEX_NODE3_VALUES      = 0x02,
+	INDEX_NODE3_CHILDS      = 0x04,
+	INDEX_NODE3_SPARSE      = 0x08,
+	INDEX_NODE3_WIDTH_MASK  = 0x30, /* log2 of child reference size */
+	INDEX_NODE3_WIDTH_SHIFT = 4,
+};
+
+static void *index_alloc(struct index *idx, size_t size)
 {
-	struct index_node *node;
+	return NOFAIL(arena_alloc(&idx->arena, size));
+}
+
+static char *index_strdup(struct index *idx, const char *str)
+{
+	return NOFAIL(arena_strdup(&idx->arena, str));
+}
+
+static struct index *index_create(void)
+{
+	struct index *idx;
 
-	node = NOFAIL(calloc(1, sizeof(struct index_node)));
-	node->prefix = NOFAIL(strdup(""));
-	node->first = INDEX_CHILDMAX;
+	idx = NOFAIL(calloc(1, sizeof(struct index)));
+	idx->root.prefix = index_strdup(idx, "");
 
-	return node;
+	return idx;
 }
 
-static void index_values_free(struct index_value *values)
+static void index_destroy(struct index *idx)
 {
-	while (values) {
-		struct index_value *value = values;
+	arena_release(&idx->arena);
+	free(idx);
+}
 
-		values = value->next;
-		free(value);
-	}
+static struct index_node *index_node_new(struct index *idx, char *prefix)
+{
+	struct index_node *n = index_alloc(idx, sizeof(struct index_node));
+
+	memset(n, 0, sizeof(*n));
+	n->prefix = prefix;
+
+	return n;
 }
 
-static void index_destroy(struct index_node *node)
+/* position of ch in node->children, or where it would be inserted */
+static unsigned int index_node_find_child(const struct index_node *node,
+							unsigned char ch)
 {
-	int c;
+	unsigned int lo = 0, hi = node->child_count;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (node->children[mid].ch < ch)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	for (c = node->first; c <= node->last; c++) {
-		struct index_node *child = node->children[c];
+	return lo;
+}
 
-		if (child)
-			index_destroy(child);
+static void index_node_add_child(struct index *idx, struct index_node *node,
+				 unsigned int pos, unsigned char ch,
+				 struct index_node *child)
+{
+	if (node->child_count == node->child_alloc) {
+		/* the old array stays in the arena, at most doubling its use */
+		unsigned int alloc = node->child_alloc ? node->child_alloc * 2 : 2;
+		struct index_child *children;
+
+		if (alloc > INDEX_CHILDMAX)
+			alloc = INDEX_CHILDMAX;
+
+		children = index_alloc(idx, alloc * sizeof(struct index_child));
+		if (node->child_count)
+			memcpy(children, node->children,
+			       node->child_count * sizeof(struct index_child));
+		node->children = children;
+		node->child_alloc = alloc;
 	}
-	index_values_free(node->values);
-	free(node->prefix);
-	free(node);
+
+	memmove(node->children + pos + 1, node->children + pos,
+		(node->child_count - pos) * sizeof(struct index_child));
+	node->children[pos].ch = ch;
+	node->children[pos].node = child;
+	node->child_count++;
 }
 
 static void index__checkstring(const char *str)
@@ -235,7 +349,7 @@ static void index__checkstring(const char *str)
 	}
 }
 
-static int index_add_value(struct index_value **values,
+static int index_add_value(struct index *idx, struct index_value **values,
 				const char *value, unsigned int priority)
 {
 	struct index_value *v;
@@ -253,7 +367,7 @@ static int index_add_value(struct index_value **values,
 		values = &(*values)->next;
 
 	len = strlen(value);
-	v = NOFAIL(calloc(1, sizeof(struct index_value) + len + 1));
+	v = index_alloc(idx, sizeof(struct index_value) + len + 1);
 	v->next = *values;
 	v->priority = priority;
 	memcpy(v->value, value, len + 1);
@@ -262,10 +376,12 @@ static int index_add_value(struct index_value **values,
 	return duplicate;
 }
 
-static int index_insert(struct index_node *node, const char *key,
+static int index_insert(struct index *idx, const char *key,
 			const char *value, unsigned int priority)
 {
+	struct index_node *node = &idx->root;
 	int i = 0; /* index within str */
+	unsigned int pos;
 	int ch;
 
 	index__checkstring(key);
@@ -284,17 +400,19 @@ static int index_insert(struct index_node *node, const char *key,
 				struct index_node *n;
 
 				/* New child is copy of node with prefix[j+1..N] */
-				n = NOFAIL(calloc(1, sizeof(struct index_node)));
-				memcpy(n, node, sizeof(struct index_node));
-				n->prefix = NOFAIL(strdup(&prefix[j+1]));
+				n = index_node_new(idx, &prefix[j+1]);
+				n->values = node->values;
+				n->child_count = node->child_count;
+				n->child_alloc = node->child_alloc;
+				n->children = node->children;
 
 				/* Parent has prefix[0..j], child at prefix[j] */
-				memset(node, 0, sizeof(struct index_node));
 				prefix[j] = '\0';
-				node->prefix = prefix;
-				node->first = ch;
-				node->last = ch;
-				node->children[ch] = n;
+				node->values = NULL;
+				node->child_count = 0;
+				node->child_alloc = 0;
+				node->children = NULL;
+				index_node_add_child(idx, node, 0, ch, n);
 
 				break;
 			}
@@ -304,34 +422,59 @@ static int index_insert(struct index_node *node, const char *key,
 
 		ch = key[i];
 		if(ch == '\0')
-			return index_add_value(&node->values, value, priority);
+			return index_add_value(idx, &node->values, value,
+					       priority);
 
-		if (!node->children[ch]) {
+		pos = index_node_find_child(node, ch);
+		if (pos == node->child_count || node->children[pos].ch != ch) {
 			struct index_node *child;
 
-			if (ch < node->first)
-				node->first = ch;
-			if (ch > node->last)
-				node->last = ch;
-			node->children[ch] = NOFAIL(calloc(1, sizeof(struct index_node)));
-
-			child = node->children[ch];
-			child->prefix = NOFAIL(strdup(&key[i+1]));
-			child->first = INDEX_CHILDMAX;
-			index_add_value(&child->values, value, priority);
+			child = index_node_new(idx, index_strdup(idx, &key[i+1]));
+			index_node_add_child(idx, node, pos, ch, child);
+			index_add_value(idx, &child->values, value, priority);
 
 			return 0;
 		}
 
 		/* Descend into child node and continue */
-		node = node->children[ch];
+		node = node->children[pos].node;
 		i++;
 	}
 }
 
 static int index__haschildren(const struct index_node *node)
 {
-	return node->first < INDEX_CHILDMAX;
+	return node->child_count > 0;
+}
+
+static unsigned char index__first(const struct index_node *node)
+{
+	return node->children[0].ch;
+}
+
+static unsigned char index__last(const struct index_node *node)
+{
+	return node->children[node->child_count - 1].ch;
+}
+
+static void index_write__values(const struct index_value *values, FILE *out)
+{
+	const struct index_value *v;
+	unsigned int value_count;
+	uint32_t u;
+
+	value_count = 0;
+	for (v = values; v != NULL; v = v->next)
+		value_count++;
+	u = htonl(value_count);
+	fwrite(&u, sizeof(u), 1, out);
+
+	for (v = values; v != NULL; v = v->next) {
+		u = htonl(v->priority);
+		fwrite(&u, sizeof(u), 1, out);
+		fputs(v->value, out);
+		fputc('\0', out);
+	}
 }
 
 /* Recursive post-order traversal
@@ -350,17 +493,18 @@ static uint32_t index_write__node(const struct index_node *node, FILE *out)
 	if (!node)
 		return 0;
 
-	/* Write children and save their offsets */
+	/* Write children and save their offsets, absent ones are left as 0 */
 	if (index__haschildren(node)) {
-		const struct index_node *child;
+		const struct index_child *child;
 		int i;
 
-		child_count = node->last - node->first + 1;
-		child_offs = NOFAIL(malloc(child_count * sizeof(uint32_t)));
+		child_count = index__last(node) - index__first(node) + 1;
+		child_offs = NOFAIL(calloc(child_count, sizeof(uint32_t)));
 
-		for (i = 0; i < child_count; i++) {
-			child = node->children[node->first + i];
-			child_offs[i] = htonl(index_write__node(child, out));
+		for (i = 0; i < node->child_count; i++) {
+			child = &node->children[i];
+			child_offs[child->ch - index__first(node)] =
+				htonl(index_write__node(child->node, out));
 		}
 	}
 
@@ -374,8 +518,8 @@ static uint32_t index_write__node(const struct index_node *node, FILE *out)
 	}
 
 	if (child_count) {
-		fputc(node->first, out);
-		fputc(node->last, out);
+		fputc(index__first(node), out);
+		fputc(index__last(node), out);
 		fwrite(child_offs, sizeof(uint32_t), child_count, out);
 		offset |= INDEX_NODE_CHILDS;
 	}
@@ -383,2543 +527,6325 @@ static uint32_t index_write__node(const struct index_node *node, FILE *out)
 	free(child_offs);
 
 	if (node->values) {
-		const struct index_value *v;
-		unsigned int value_count;
-		uint32_t u;
-
-		value_count = 0;
-		for (v = node->values; v != NULL; v = v->next)
-			value_count++;
-		u = htonl(value_count);
-		fwrite(&u, sizeof(u), 1, out);
-
-		for (v = node->values; v != NULL; v = v->next) {
-			u = htonl(v->priority);
-			fwrite(&u, sizeof(u), 1, out);
-			fputs(v->value, out);
-			fputc('\0', out);
-		}
+		index_write__values(node->values, out);
 		offset |= INDEX_NODE_VALUES;
 	}
 
 	return offset;
 }
 
-static void index_write(const struct index_node *node, FILE *out)
+/* Pre-order traversal filling the v3 value pool, so values of keys sharing
+ * a prefix end up next to each other. @max_size gets the size of the
+ * biggest value list, if bigger.
+ */
+static void index_write__pool(struct index_node *node, FILE *out,
+							uint32_t *max_size)
 {
-	long initial_offset, final_offset;
-	uint32_t u;
+	unsigned int i;
 
-	u = htonl(INDEX_MAGIC);
-	fwrite(&u, sizeof(u), 1, out);
-	u = htonl(INDEX_VERSION);
-	fwrite(&u, sizeof(u), 1, out);
+	if (node->values) {
+		uint32_t len;
 
-	/* Second word is reserved for the offset of the root node */
-	initial_offset = ftell(out);
-	assert(initial_offset >= 0);
-	u = 0;
-	fwrite(&u, sizeof(uint32_t), 1, out);
+		node->values_offset = ftell(out);
+		index_write__values(node->values, out);
+		len = ftell(out) - node->values_offset;
+		if (len > *max_size)
+			*max_size = len;
+	}
 
-	/* Dump trie */
-	u = htonl(index_write__node(node, out));
+	for (i = 0; i < node->child_count; i++)
+		index_write__pool(node->children[i].node, out, max_size);
+}
 
-	/* Update first word */
-	final_offset = ftell(out);
-	assert(final_offset >= 0);
-	(void)fseek(out, initial_offset, SEEK_SET);
-	fwrite(&u, sizeof(uint32_t), 1, out);
-	(void)fseek(out, final_offset, SEEK_SET);
+static void index_write__ref(uint32_t ref, unsigned int width, FILE *out)
+{
+	while (width--)
+		fputc((ref >> (width * 8)) & 0xff, out);
 }
 
-/* END: code from module-init-tools/index.c just modified to compile here.
+/* Write a v3 node whose children are all written: they are referenced by
+ * their distance from the parent using the smallest width that fits, and
+ * each node picks whichever of the dense (first..last) or sparse (sorted
+ * character list) child tables is smaller.
  */
+static void index_write__node_v3_emit(struct index_node *node, FILE *out,
+							uint32_t *max_size)
+{
+	uint32_t child_offs[INDEX_CHILDMAX];
+	unsigned char child_chars[INDEX_CHILDMAX];
+	unsigned int i, child_count = 0, width, shift;
+	size_t dense_len, sparse_len;
+	uint32_t maxdelta = 0;
+	uint8_t flags = 0;
+	long offset;
 
-/* configuration parsing **********************************************/
-struct cfg_override {
-	struct cfg_override *next;
-	size_t len;
-	char path[];
-};
-
-enum search_type {
-	SEARCH_PATH,
-	SEARCH_BUILTIN,
-	SEARCH_EXTERNAL
-};
+	for (child_count = 0; child_count < node->child_count; child_count++) {
+		const struct index_child *child = &node->children[child_count];
 
-struct cfg_search {
-	struct cfg_search *next;
-	enum search_type type;
-	size_t len;
-	char path[];
-};
+		child_chars[child_count] = child->ch;
+		child_offs[child_count] = child->node->offset;
+	}
 
-struct cfg_external {
-	struct cfg_external *next;
-	size_t len;
-	char path[];
-};
+	offset = ftell(out);
+	assert(offset >= 0 && offset <= UINT32_MAX);
 
-struct cfg_exclude {
-	struct cfg_exclude *next;
-	char exclude_dir[];
-};
+	for (i = 0; i < child_count; i++) {
+		child_offs[i] = offset - child_offs[i];
+		if (child_offs[i] > maxdelta)
+			maxdelta = child_offs[i];
+	}
 
-struct cfg {
-	const char *kversion;
-	char dirname[PATH_MAX];
-	size_t dirnamelen;
-	char outdirname[PATH_MAX];
-	size_t outdirnamelen;
-	char sym_prefix;
-	uint8_t check_symvers;
-	uint8_t print_unknown;
-	uint8_t warn_dups;
-	struct cfg_override *overrides;
-	struct cfg_search *searches;
-	struct cfg_external *externals;
-	struct cfg_exclude *excludes;
-};
+	if (maxdelta <= UINT8_MAX)
+		shift = 0;
+	else if (maxdelta <= UINT16_MAX)
+		shift = 1;
+	else
+		shift = 2;
+	width = 1U << shift;
 
-static enum search_type cfg_define_search_type(const char *path)
-{
-	if (streq(path, CFG_BUILTIN_KEY))
-		return SEARCH_BUILTIN;
-	if (streq(path, CFG_EXTERNAL_KEY))
-		return SEARCH_EXTERNAL;
-	return SEARCH_PATH;
-}
+	if (node->prefix[0])
+		flags |= INDEX_NODE3_PREFIX;
+	if (node->values)
+		flags |= INDEX_NODE3_VALUES;
 
-static int cfg_search_add(struct cfg *cfg, const char *path)
-{
-	struct cfg_search *s;
-	size_t len;
-	enum search_type type;
+	dense_len = sparse_len = 0;
+	if (child_count) {
+		dense_len = 2 + (index__last(node) - index__first(node) + 1) * width;
+		sparse_len = 1 + child_count * (1 + width);
 
-	type = cfg_define_search_type(path);
+		flags |= INDEX_NODE3_CHILDS;
+		flags |= shift << INDEX_NODE3_WIDTH_SHIFT;
+		if (sparse_len < dense_len)
+			flags |= INDEX_NODE3_SPARSE;
+	}
 
-	if (type != SEARCH_PATH)
-		len = 0;
-	else
-		len = strlen(path) + 1;
+	fputc(flags, out);
 
-	s = malloc(sizeof(struct cfg_search) + len);
-	if (s == NULL) {
-		ERR("search add: out of memory\n");
-		return -ENOMEM;
+	if (node->prefix[0]) {
+		fputs(node->prefix, out);
+		fputc('\0', out);
 	}
-	s->type = type;
-	if (type != SEARCH_PATH)
-		s->len = 0;
-	else {
-		s->len = len - 1;
-		memcpy(s->path, path, len);
+
+	if (node->values) {
+		uint32_t u = htonl(node->values_offset);
+		fwrite(&u, sizeof(u), 1, out);
 	}
 
-	DBG("search add: %s, search type=%hhu\n", path, type);
+	if (flags & INDEX_NODE3_SPARSE) {
+		fputc(child_count, out);
+		fwrite(child_chars, 1, child_count, out);
+		for (i = 0; i < child_count; i++)
+			index_write__ref(child_offs[i], width, out);
+	} else if (child_count) {
+		int c;
+
+		fputc(index__first(node), out);
+		fputc(index__last(node), out);
+		for (c = index__first(node), i = 0; c <= index__last(node); c++) {
+			uint32_t delta = 0;
+
+			if (i < child_count && child_chars[i] == c)
+				delta = child_offs[i++];
+			index_write__ref(delta, width, out);
+		}
+	}
 
-	s->next = cfg->searches;
-	cfg->searches = s;
-	return 0;
+	node->offset = offset;
+	if ((uint32_t) (ftell(out) - offset) > *max_size)
+		*max_size = ftell(out) - offset;
 }
 
-static void cfg_search_free(struct cfg_search *s)
+/* Post-order traversal as in index_write__node(): children must come before
+ * their parent, whose references are distances back in the file */
+static void index_write__subtree_v3(struct index_node *node, FILE *out,
+							uint32_t *max_size)
 {
-	free(s);
+	unsigned int i;
+
+	for (i = 0; i < node->child_count; i++)
+		index_write__subtree_v3(node->children[i].node, out, max_size);
+
+	index_write__node_v3_emit(node, out, max_size);
 }
 
-static int cfg_override_add(struct cfg *cfg, const char *modname, const char *subdir)
+/* Post-order alone leaves the root at the end of the file and each of its
+ * children after its whole subtree, so a cold lookup faults in a page per
+ * level. Instead, the first INDEX_TOP_NODES nodes in BFS order, the ones
+ * every lookup goes through, are written together at the end, deepest
+ * first, after the subtrees below them, each packed in post-order.
+ * @max_size gets the size of the biggest node, if bigger.
+ */
+static uint32_t index_write__node_v3(struct index_node *root, FILE *out,
+							uint32_t *max_size)
 {
-	struct cfg_override *o;
-	size_t modnamelen = strlen(modname);
-	size_t subdirlen = strlen(subdir);
-	size_t i;
+	struct array bfs;
+	size_t i, ntop;
+	unsigned int j;
 
-	o = malloc(sizeof(struct cfg_override) + subdirlen + 1
-		   + modnamelen + 1);
-	if (o == NULL) {
-		ERR("override add: out of memory\n");
-		return -ENOMEM;
+	array_init(&bfs, INDEX_TOP_NODES);
+	array_append(&bfs, root);
+
+	for (i = 0; i < bfs.count && i < INDEX_TOP_NODES; i++) {
+		struct index_node *node = bfs.array[i];
+
+		node->top = true;
+		for (j = 0; j < node->child_count; j++)
+			array_append(&bfs, node->children[j].node);
 	}
-	memcpy(o->path, subdir, subdirlen);
-	i = subdirlen;
-	o->path[i] = '/';
-	i++;
+	ntop = i;
 
-	memcpy(o->path + i, modname, modnamelen);
-	i += modnamelen;
-	o->path[i] = '\0'; /* no extension, so we can match .ko/.ko.gz */
+	for (i = 0; i < ntop; i++) {
+		struct index_node *node = bfs.array[i];
 
-	o->len = i;
+		for (j = 0; j < node->child_count; j++) {
+			if (!node->children[j].node->top)
+				index_write__subtree_v3(node->children[j].node,
+								out, max_size);
+		}
+	}
 
-	DBG("override add: %s\n", o->path);
+	for (i = ntop; i > 0; i--)
+		index_write__node_v3_emit(bfs.array[i - 1], out, max_size);
 
-	o->next = cfg->overrides;
-	cfg->overrides = o;
-	return 0;
-}
+	array_free_array(&bfs);
 
-static void cfg_override_free(struct cfg_override *o)
-{
-	free(o);
+	return root->offset;
 }
 
-static int cfg_external_add(struct cfg *cfg, const char *path)
+/* Key of the v3 matcher section, split at its first wildcard */
+struct index_matcher_entry {
+	uint32_t values_offset;
+	uint32_t hash;		/* of key[0..prefixlen) */
+	size_t prefixlen;
+	size_t keylen;
+	unsigned int seq;	/* trie order, keeps sorting stable */
+	char key[];
+};
+
+static void index_matcher_collect(const struct index_node *node,
+				  struct strbuf *buf, struct array *literals,
+				  struct array *globs)
 {
-	struct cfg_external *ext;
-	size_t len = strlen(path);
+	unsigned int pushed, c;
 
-	ext = malloc(sizeof(struct cfg_external) + len + 1);
-	if (ext == NULL) {
-		ERR("external add: out of memory\n");
-		return -ENOMEM;
+	pushed = strbuf_pushchars(buf, node->prefix);
+
+	if (node->values) {
+		const char *key = strbuf_str(buf);
+		struct index_matcher_entry *e;
+		size_t i;
+
+		e = NOFAIL(malloc(sizeof(*e) + buf->used + 1));
+		memcpy(e->key, key, buf->used + 1);
+		e->keylen = buf->used;
+		e->prefixlen = strcspn(e->key, "*?[");
+		e->values_offset = node->values_offset;
+		e->hash = FNV1A_32_INIT;
+		for (i = 0; i < e->prefixlen; i++)
+			e->hash = fnv1a_32_step(e->hash, e->key[i]);
+
+		if (e->prefixlen == e->keylen) {
+			e->seq = literals->count;
+			array_append(literals, e);
+		} else {
+			e->seq = globs->count;
+			array_append(globs, e);
+		}
 	}
 
-	strcpy(ext->path, path);
-	ext->len = len;
+	for (c = 0; c < node->child_count; c++) {
+		strbuf_pushchar(buf, node->children[c].ch);
+		index_matcher_collect(node->children[c].node, buf, literals,
+				      globs);
+		strbuf_popchar(buf);
+	}
 
-	DBG("external add: %s\n", ext->path);
+	strbuf_popchars(buf, pushed);
+}
 
-	ext->next = cfg->externals;
-	cfg->externals = ext;
+static int index_matcher_prefix_cmp(const struct index_matcher_entry *a,
+				    const struct index_matcher_entry *b)
+{
+	size_t len = a->prefixlen < b->prefixlen ? a->prefixlen : b->prefixlen;
+	int r = memcmp(a->key, b->key, len);
+
+	if (r != 0)
+		return r;
+	if (a->prefixlen != b->prefixlen)
+		return a->prefixlen < b->prefixlen ? -1 : 1;
 	return 0;
 }
 
-static void cfg_external_free(struct cfg_external *ext)
+static int index_matcher_glob_cmp(const void *pa, const void *pb)
 {
-	free(ext);
+	const struct index_matcher_entry *a = *(const struct index_matcher_entry **)pa;
+	const struct index_matcher_entry *b = *(const struct index_matcher_entry **)pb;
+	int r = index_matcher_prefix_cmp(a, b);
+
+	if (r != 0)
+		return r;
+	return (int)a->seq - (int)b->seq;
 }
 
-static int cfg_exclude_add(struct cfg *cfg, const char *path)
+static void index_matcher_table_add(uint32_t *table, uint32_t size,
+				    uint32_t hash, uint32_t entry)
 {
-	struct cfg_exclude *exc;
-	size_t len = strlen(path);
-
-	exc = malloc(sizeof(struct cfg_exclude) + len + 1);
-	if (exc == NULL) {
-		ERR("exclude add: out of memory\n");
-		return -ENOMEM;
-	}
-	memcpy(exc->exclude_dir, path, len + 1);
+	uint32_t i;
 
-	DBG("exclude add: %s\n", path);
+	for (i = hash & (size - 1); table[2 * i + 1] != 0;
+	     i = (i + 1) & (size - 1))
+		;
 
-	exc->next = cfg->excludes;
-	cfg->excludes = exc;
-	return 0;
+	table[2 * i] = htonl(hash);
+	table[2 * i + 1] = htonl(entry);
 }
 
-static void cfg_exclude_free(struct cfg_exclude *exc)
+static uint32_t index_matcher_table_size(size_t count)
 {
-	free(exc);
+	/* keep the load factor at or below 1/2 */
+	return count > 0 ? ALIGN_POWER2(count * 2) : 0;
 }
 
-static int cfg_kernel_matches(const struct cfg *cfg, const char *pattern)
+/*
+ * The matcher section lets readers resolve a key without walking the trie:
+ * literal keys are looked up in a hash table, and patterns are grouped by
+ * the literal prefix before their first wildcard, so only the groups whose
+ * prefix starts the key need fnmatch(). See libkmod/libkmod-index.c.
+ */
+static uint32_t index_write__matcher(const struct index_node *node, FILE *out)
 {
-	regex_t re;
-	int status;
+	struct array literals, globs;
+	struct strbuf buf;
+	uint32_t *lit_table, *glob_table, *lens;
+	uint32_t lit_size, glob_size, n_groups = 0, n_lens = 0, u;
+	long offset, pos;
+	size_t i, j;
+
+	array_init(&literals, 256);
+	array_init(&globs, 256);
+	strbuf_init(&buf);
+	index_matcher_collect(node, &buf, &literals, &globs);
+	strbuf_release(&buf);
+
+	array_sort(&globs, index_matcher_glob_cmp);
+
+	/* distinct prefix lengths, ascending */
+	lens = NOFAIL(malloc(sizeof(uint32_t) * (globs.count + 1)));
+	for (i = 0; i < globs.count; i++) {
+		const struct index_matcher_entry *e = globs.array[i];
+
+		if (i == 0 || index_matcher_prefix_cmp(globs.array[i - 1], e))
+			n_groups++;
+
+		for (j = 0; j < n_lens && lens[j] < e->prefixlen; j++)
+			;
+		if (j < n_lens && lens[j] == e->prefixlen)
+			continue;
+		memmove(lens + j + 1, lens + j, (n_lens - j) * sizeof(uint32_t));
+		lens[j] = e->prefixlen;
+		n_lens++;
+	}
 
-	/* old style */
-	if (streq(pattern, "*"))
-		return 1;
+	lit_size = index_matcher_table_size(literals.count);
+	glob_size = index_matcher_table_size(n_groups);
+	lit_table = NOFAIL(calloc(2 * lit_size + 1, sizeof(uint32_t)));
+	glob_table = NOFAIL(calloc(2 * glob_size + 1, sizeof(uint32_t)));
 
-	if (regcomp(&re, pattern, REG_EXTENDED|REG_NOSUB) != 0)
-		return 0;
+	offset = ftell(out);
+	assert(offset >= 0);
+	pos = offset + sizeof(uint32_t) * (3 + n_lens + 2 * lit_size +
+					   2 * glob_size);
 
-	status = regexec(&re, cfg->kversion, 0, NULL, 0);
-	regfree(&re);
+	/* Lay out the entries to fill in the hash tables */
+	for (i = 0; i < literals.count; i++) {
+		const struct index_matcher_entry *e = literals.array[i];
 
-	return status == 0;
-}
+		index_matcher_table_add(lit_table, lit_size, e->hash, pos);
+		pos += e->keylen + 1 + sizeof(uint32_t);
+	}
 
-static int cfg_file_parse(struct cfg *cfg, const char *filename)
-{
-	char *line;
-	FILE *fp;
-	unsigned int linenum = 0;
-	int err;
+	for (i = 0; i < globs.count; i++) {
+		const struct index_matcher_entry *e = globs.array[i];
 
-	fp = fopen(filename, "r");
-	if (fp == NULL) {
-		err = -errno;
-		ERR("file parse %s: %m\n", filename);
-		return err;
+		if (i == 0 || index_matcher_prefix_cmp(globs.array[i - 1], e)) {
+			index_matcher_table_add(glob_table, glob_size, e->hash,
+						pos);
+			pos += e->prefixlen + 1 + sizeof(uint32_t);
+		}
+		pos += sizeof(uint32_t) + e->keylen - e->prefixlen + 1;
 	}
+	assert(pos <= UINT32_MAX);
 
-	while ((line = freadline_wrapped(fp, &linenum)) != NULL) {
-		char *cmd, *saveptr;
-
-		if (line[0] == '\0' || line[0] == '#')
-			goto done_next;
+	u = htonl(lit_size);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(glob_size);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(n_lens);
+	fwrite(&u, sizeof(u), 1, out);
+	for (i = 0; i < n_lens; i++) {
+		u = htonl(lens[i]);
+		fwrite(&u, sizeof(u), 1, out);
+	}
+	fwrite(lit_table, sizeof(uint32_t), 2 * lit_size, out);
+	fwrite(glob_table, sizeof(uint32_t), 2 * glob_size, out);
 
-		cmd = strtok_r(line, "\t ", &saveptr);
-		if (cmd == NULL)
-			goto done_next;
+	for (i = 0; i < literals.count; i++) {
+		const struct index_matcher_entry *e = literals.array[i];
 
-		if (streq(cmd, "search")) {
-			const char *sp;
-			while ((sp = strtok_r(NULL, "\t ", &saveptr)) != NULL) {
-				cfg_search_add(cfg, sp);
-			}
-		} else if (streq(cmd, "override")) {
-			const char *modname = strtok_r(NULL, "\t ", &saveptr);
-			const char *version = strtok_r(NULL, "\t ", &saveptr);
-			const char *subdir = strtok_r(NULL, "\t ", &saveptr);
-
-			if (modname == NULL || version == NULL ||
-					subdir == NULL)
-				goto syntax_error;
-
-			if (!cfg_kernel_matches(cfg, version)) {
-				INF("%s:%u: override kernel did not match %s\n",
-				    filename, linenum, version);
-				goto done_next;
-			}
+		fwrite(e->key, 1, e->keylen + 1, out);
+		u = htonl(e->values_offset);
+		fwrite(&u, sizeof(u), 1, out);
+	}
 
-			cfg_override_add(cfg, modname, subdir);
-		} else if (streq(cmd, "external")) {
-			const char *version = strtok_r(NULL, "\t ", &saveptr);
-			const char *dir = strtok_r(NULL, "\t ", &saveptr);
+	for (i = 0; i < globs.count; i = j) {
+		const struct index_matcher_entry *e = globs.array[i];
 
-			if (version == NULL || dir == NULL)
-				goto syntax_error;
+		for (j = i + 1; j < globs.count; j++) {
+			if (index_matcher_prefix_cmp(e, globs.array[j]))
+				break;
+		}
 
-			if (!cfg_kernel_matches(cfg, version)) {
-				INF("%s:%u: external directory did not match %s\n",
-				    filename, linenum, version);
-				goto done_next;
-			}
+		fwrite(e->key, 1, e->prefixlen, out);
+		fputc('\0', out);
+		u = htonl(j - i);
+		fwrite(&u, sizeof(u), 1, out);
 
-			cfg_external_add(cfg, dir);
-		} else if (streq(cmd, "exclude")) {
-			const char *sp;
-			while ((sp = strtok_r(NULL, "\t ", &saveptr)) != NULL) {
-				cfg_exclude_add(cfg, sp);
-			}
-		} else if (streq(cmd, "include")
-				|| streq(cmd, "make_map_files")) {
-			INF("%s:%u: command %s not implemented yet\n",
-			    filename, linenum, cmd);
-		} else {
-syntax_error:
-			ERR("%s:%u: ignoring bad line starting with '%s'\n",
-			    filename, linenum, cmd);
+		for (; i < j; i++) {
+			e = globs.array[i];
+			u = htonl(e->values_offset);
+			fwrite(&u, sizeof(u), 1, out);
+			fwrite(e->key + e->prefixlen, 1,
+			       e->keylen - e->prefixlen + 1, out);
 		}
-
-done_next:
-		free(line);
 	}
 
-	fclose(fp);
+	for (i = 0; i < literals.count; i++)
+		free(literals.array[i]);
+	for (i = 0; i < globs.count; i++)
+		free(globs.array[i]);
+	array_free_array(&literals);
+	array_free_array(&globs);
+	free(lit_table);
+	free(glob_table);
+	free(lens);
 
-	return 0;
+	return offset;
 }
 
-static int cfg_files_filter_out(DIR *d, const char *dir, const char *name)
+struct index_filter_keys {
+	uint64_t *hashes;
+	size_t count;
+	size_t alloc;
+	bool literal;
+};
+
+static void index_filter_collect(const struct index_node *node,
+				 struct strbuf *buf,
+				 struct index_filter_keys *keys)
 {
-	size_t len = strlen(name);
-	struct stat st;
+	unsigned int pushed, c;
 
-	if (name[0] == '.')
-		return 1;
+	pushed = strbuf_pushchars(buf, node->prefix);
 
-	if (len < 6 || !streq(name + len - 5, ".conf")) {
-		INF("All cfg files need .conf: %s/%s\n", dir, name);
-		return 1;
+	if (node->values) {
+		const char *key = strbuf_str(buf);
+
+		if (keys->count == keys->alloc) {
+			keys->alloc = keys->alloc ? keys->alloc * 2 : 256;
+			keys->hashes = NOFAIL(realloc(keys->hashes,
+					keys->alloc * sizeof(uint64_t)));
+		}
+		keys->hashes[keys->count++] = key_filter_hash(key, buf->used);
+
+		if (key[strcspn(key, "*?[")] != '\0')
+			keys->literal = false;
 	}
 
-	fstatat(dirfd(d), name, &st, 0);
-	if (S_ISDIR(st.st_mode)) {
-		ERR("Directories inside directories are not supported: %s/%s\n",
-		    dir, name);
-		return 1;
+	for (c = 0; c < node->child_count; c++) {
+		strbuf_pushchar(buf, node->children[c].ch);
+		index_filter_collect(node->children[c].node, buf, keys);
+		strbuf_popchar(buf);
 	}
 
-	return 0;
+	strbuf_popchars(buf, pushed);
 }
 
-struct cfg_file {
-	size_t dirlen;
-	size_t namelen;
-	const char *name;
-	char path[];
-};
-
-static void cfg_file_free(struct cfg_file *f)
+/*
+ * Bloom filter of all the keys, so readers can tell most of the keys that
+ * are not in the index without walking the trie; blocks are aligned to
+ * cache lines in the file. See libkmod/libkmod-index.c.
+ */
+static uint32_t index_write__filter(const struct index_node *node, FILE *out)
 {
-	free(f);
-}
+	struct index_filter_keys keys = { .literal = true };
+	const size_t block_size = KEY_FILTER_BLOCK_BITS / 8;
+	uint8_t *blocks;
+	uint32_t block_count, u;
+	struct strbuf buf;
+	long offset;
+	size_t i, nbits;
 
-static int cfg_files_insert_sorted(struct cfg_file ***p_files, size_t *p_n_files,
-					const char *dir, const char *name)
-{
-	struct cfg_file **files, *f;
-	size_t i, n_files, namelen, dirlen;
-	void *tmp;
+	strbuf_init(&buf);
+	index_filter_collect(node, &buf, &keys);
+	strbuf_release(&buf);
 
-	dirlen = strlen(dir);
-	if (name != NULL)
-		namelen = strlen(name);
-	else {
-		name = basename(dir);
-		namelen = strlen(name);
-		dirlen -= namelen + 1;
-	}
+	nbits = keys.count * INDEX_FILTER_BITS_PER_KEY;
+	block_count = (nbits + KEY_FILTER_BLOCK_BITS - 1) / KEY_FILTER_BLOCK_BITS;
+	block_count = block_count > 1 ? ALIGN_POWER2(block_count) : 1;
+	blocks = NOFAIL(calloc(block_count, block_size));
 
-	n_files = *p_n_files;
-	files = *p_files;
-	for (i = 0; i < n_files; i++) {
-		int cmp = strcmp(name, files[i]->name);
-		if (cmp == 0) {
-			DBG("Ignoring duplicate config file: %.*s/%s\n",
-			    (int)dirlen, dir, name);
-			return -EEXIST;
-		} else if (cmp < 0)
-			break;
-	}
+	for (i = 0; i < keys.count; i++) {
+		uint8_t *b = blocks + block_size *
+			key_filter_block(keys.hashes[i], block_count);
+		uint64_t bits = key_filter_bits(keys.hashes[i]);
+		unsigned int k;
 
-	f = malloc(sizeof(struct cfg_file) + dirlen + namelen + 2);
-	if (f == NULL) {
-		ERR("files insert sorted: out of memory\n");
-		return -ENOMEM;
-	}
+		for (k = 0; k < KEY_FILTER_PROBES; k++, bits >>= 9) {
+			unsigned int bit = bits % KEY_FILTER_BLOCK_BITS;
 
-	tmp = realloc(files, sizeof(struct cfg_file *) * (n_files + 1));
-	if (tmp == NULL) {
-		ERR("files insert sorted: out of memory\n");
-		free(f);
-		return -ENOMEM;
+			b[bit / 8] |= 1 << (bit % 8);
+		}
 	}
-	*p_files = files = tmp;
 
-	if (i < n_files) {
-		memmove(files + i + 1, files + i,
-			sizeof(struct cfg_file *) * (n_files - i));
-	}
-	files[i] = f;
+	offset = ftell(out);
+	assert(offset >= 0);
+	u = htonl(keys.literal ? INDEX_FILTER_LITERAL : 0);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(block_count);
+	fwrite(&u, sizeof(u), 1, out);
+	for (i = offset + 2 * sizeof(u); i % block_size != 0; i++)
+		fputc('\0', out);
+	fwrite(blocks, block_size, block_count, out);
 
-	f->dirlen = dirlen;
-	f->namelen = namelen;
-	f->name = f->path + dirlen + 1;
-	memcpy(f->path, dir, dirlen);
-	f->path[dirlen] = '/';
-	memcpy(f->path + dirlen + 1, name, namelen);
-	f->path[dirlen + 1 + namelen] = '\0';
+	free(blocks);
+	free(keys.hashes);
 
-	*p_n_files = n_files + 1;
-	return 0;
+	return offset;
 }
 
-/*
- * Insert configuration files ignoring duplicates
- */
-static int cfg_files_list(struct cfg_file ***p_files, size_t *p_n_files,
-				const char *path)
+/* @max_size gets the size of the biggest node or value list of a v3 index */
+static void index_write__image(struct index *idx, FILE *out,
+			       unsigned int version, bool matcher,
+			       uint32_t *max_size)
 {
-	struct dirent *dent;
-	DIR *d;
-	int err = 0;
-	struct stat st;
-
-	if (stat(path, &st) != 0) {
-		err = -errno;
-		DBG("could not stat '%s': %m\n", path);
-		return err;
-	}
+	struct index_node *node = &idx->root;
+	long initial_offset, final_offset;
+	uint32_t u, root, matcher_offset = 0, filter_offset = 0;
 
-	if (!S_ISDIR(st.st_mode)) {
-		cfg_files_insert_sorted(p_files, p_n_files, path, NULL);
-		return 0;
-	}
+	u = htonl(INDEX_MAGIC);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(version >= 3 ? INDEX_VERSION : INDEX_VERSION_V2);
+	fwrite(&u, sizeof(u), 1, out);
 
-	d = opendir(path);
-	if (d == NULL) {
-		ERR("files list %s: %m\n", path);
-		return -EINVAL;
-	}
+	/* Second word is reserved for the offset of the root node, v3 adds
+	 * a third one for the matcher section */
+	initial_offset = ftell(out);
+	assert(initial_offset >= 0);
+	u = 0;
+	fwrite(&u, sizeof(uint32_t), 1, out);
+	if (version >= 3)
+		fwrite(&u, sizeof(uint32_t), 1, out);
 
-	for (dent = readdir(d); dent != NULL; dent = readdir(d)) {
-		if (cfg_files_filter_out(d, path, dent->d_name))
-			continue;
+	/* Dump trie */
+	if (version >= 3) {
+		index_write__pool(node, out, max_size);
+		root = index_write__node_v3(node, out, max_size);
+		if (matcher)
+			matcher_offset = index_write__matcher(node, out);
+		else
+			filter_offset = index_write__filter(node, out);
+
+		u = htonl(filter_offset);
+		fwrite(&u, sizeof(u), 1, out);
+		u = htonl(INDEX_FILTER_MAGIC);
+		fwrite(&u, sizeof(u), 1, out);
+	} else
+		root = index_write__node(node, out);
 
-		cfg_files_insert_sorted(p_files, p_n_files, path, dent->d_name);
+	/* Update reserved words */
+	final_offset = ftell(out);
+	assert(final_offset >= 0);
+	(void)fseek(out, initial_offset, SEEK_SET);
+	u = htonl(root);
+	fwrite(&u, sizeof(uint32_t), 1, out);
+	if (version >= 3) {
+		u = htonl(matcher_offset);
+		fwrite(&u, sizeof(uint32_t), 1, out);
 	}
-
-	closedir(d);
-	DBG("parsed configuration files from %s\n", path);
-	return err;
+	(void)fseek(out, final_offset, SEEK_SET);
 }
 
-static int cfg_load(struct cfg *cfg, const char * const *cfg_paths)
+static void index_write(struct index *idx, FILE *out,
+			unsigned int version, bool matcher)
 {
-	size_t i, n_files = 0;
-	struct cfg_file **files = NULL;
+	uint32_t max_size = 0;
 
-	if (cfg_paths == NULL)
-		cfg_paths = default_cfg_paths;
+	index_write__image(idx, out, version, matcher, &max_size);
+}
 
-	for (i = 0; cfg_paths[i] != NULL; i++)
-		cfg_files_list(&files, &n_files, cfg_paths[i]);
+#ifdef ENABLE_ZLIB
+/* no node or value list may be bigger, see libkmod/libkmod-index.c */
+#define INDEX_BLOCK_SIZE (8 * 1024)
+#define INDEX_BLOCKS_DICT_SLICES 32
+#define INDEX_BLOCKS_DICT_SLICE 1024
 
-	for (i = 0; i < n_files; i++) {
-		struct cfg_file *f = files[i];
-		cfg_file_parse(cfg, f->path);
-		cfg_file_free(f);
+/*
+ * Cut the v3 image of @idx, without a matcher section, in blocks deflated
+ * one by one, so readers only inflate the blocks a lookup goes through.
+ * Alone, a block compresses much worse than the whole file: they all share
+ * a preset dictionary made of slices taken all over the image, which have
+ * the strings the blocks repeat. An index with a node or value list bigger
+ * than a block is written as it is.
+ */
+static int index_write_blocks(struct index *idx, FILE *out)
+{
+	uint8_t dict[INDEX_BLOCKS_DICT_SLICES * INDEX_BLOCKS_DICT_SLICE];
+	uint32_t max_size = 0, dict_size = 0, block_count, hdr_size, u, i;
+	uint32_t *offsets = NULL;
+	uint8_t *zbuf = NULL;
+	char *image = NULL;
+	size_t size = 0, bound, pos;
+	z_stream zs = { };
+	FILE *mem;
+	int err = 0;
+
+	mem = open_memstream(&image, &size);
+	if (mem == NULL)
+		return -errno;
+
+	index_write__image(idx, mem, INDEX_VERSION_MAJOR, false, &max_size);
+	if (fclose(mem) != 0) {
+		free(image);
+		return -ENOMEM;
 	}
-	free(files);
 
-	/* For backward compatibility add "updates" to the head of the search
-	 * list here. But only if there was no "search" option specified.
-	 */
-	if (cfg->searches == NULL)
-		cfg_search_add(cfg, "updates");
+	if (max_size > INDEX_BLOCK_SIZE) {
+		WRN("index node of %u bytes, writing it uncompressed\n",
+								max_size);
+		fwrite(image, 1, size, out);
+		free(image);
+		return 0;
+	}
 
-	return 0;
-}
+	if (size > sizeof(dict)) {
+		for (i = 0; i < INDEX_BLOCKS_DICT_SLICES; i++) {
+			size_t off = (size - INDEX_BLOCKS_DICT_SLICE) * i /
+					(INDEX_BLOCKS_DICT_SLICES - 1);
 
-static void cfg_free(struct cfg *cfg)
-{
-	while (cfg->overrides) {
-		struct cfg_override *tmp = cfg->overrides;
-		cfg->overrides = cfg->overrides->next;
-		cfg_override_free(tmp);
+			memcpy(dict + dict_size, image + off,
+						INDEX_BLOCKS_DICT_SLICE);
+			dict_size += INDEX_BLOCKS_DICT_SLICE;
+		}
 	}
 
-	while (cfg->searches) {
-		struct cfg_search *tmp = cfg->searches;
-		cfg->searches = cfg->searches->next;
-		cfg_search_free(tmp);
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 9,
+						Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(image);
+		return -ENOMEM;
 	}
 
-	while (cfg->externals) {
-		struct cfg_external *tmp = cfg->externals;
-		cfg->externals = cfg->externals->next;
-		cfg_external_free(tmp);
+	block_count = (size + INDEX_BLOCK_SIZE - 1) / INDEX_BLOCK_SIZE;
+	hdr_size = sizeof(uint32_t) * (6 + block_count + 1) + dict_size;
+	bound = deflateBound(&zs, INDEX_BLOCK_SIZE);
+	offsets = malloc(sizeof(uint32_t) * (block_count + 1));
+	zbuf = malloc(bound * block_count);
+	if (offsets == NULL || zbuf == NULL) {
+		err = -ENOMEM;
+		goto out;
 	}
 
-	while (cfg->excludes) {
-		struct cfg_exclude *tmp = cfg->excludes;
-		cfg->excludes = cfg->excludes->next;
-		cfg_exclude_free(tmp);
+	for (i = 0, pos = 0; i < block_count; i++) {
+		size_t start = (size_t) i * INDEX_BLOCK_SIZE;
+
+		offsets[i] = htonl(hdr_size + pos);
+
+		deflateReset(&zs);
+		if (dict_size > 0)
+			deflateSetDictionary(&zs, dict, dict_size);
+		zs.next_in = (uint8_t *) image + start;
+		zs.avail_in = size - start < INDEX_BLOCK_SIZE ?
+						size - start : INDEX_BLOCK_SIZE;
+		zs.next_out = zbuf + pos;
+		zs.avail_out = bound;
+		if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+			err = -EINVAL;
+			goto out;
+		}
+		pos += bound - zs.avail_out;
 	}
+	offsets[block_count] = htonl(hdr_size + pos);
+
+	u = htonl(INDEX_BLOCKS_MAGIC);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(INDEX_BLOCKS_VERSION);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(size);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(INDEX_BLOCK_SIZE);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(dict_size);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(block_count);
+	fwrite(&u, sizeof(u), 1, out);
+	fwrite(offsets, sizeof(uint32_t), block_count + 1, out);
+	fwrite(dict, 1, dict_size, out);
+	fwrite(zbuf, 1, pos, out);
+
+out:
+	deflateEnd(&zs);
+	free(offsets);
+	free(zbuf);
+	free(image);
+	return err;
 }
+#endif
 
+/* END: code from module-init-tools/index.c just modified to compile here.
+ */
 
-/* depmod calculations ***********************************************/
-struct vertex;
-struct mod {
-	struct kmod_module *kmod;
-	char *path;
-	const char *relpath; /* path relative to '$ROOT/lib/modules/$VER/' */
-	char *uncrelpath; /* same as relpath but ending in .ko */
-	struct kmod_list *info_list;
-	struct kmod_list *dep_sym_list;
-	struct array deps; /* struct symbol */
-	size_t baselen; /* points to start of basename/filename */
-	size_t modnamesz;
-	int sort_idx; /* sort index using modules.order */
-	int dep_sort_idx; /* topological sort index */
-	uint16_t idx; /* index in depmod->modules.array */
-	uint16_t users; /* how many modules depend on this one */
-	bool visited; /* helper field to report cycles */
-	struct vertex *vertex; /* helper field to report cycles */
-	char modname[];
+/* configuration parsing **********************************************/
+struct cfg_override {
+	struct cfg_override *next;
+	size_t len;
+	char path[];
 };
 
-struct symbol {
-	struct mod *owner;
-	uint64_t crc;
-	char name[];
+enum search_type {
+	SEARCH_PATH,
+	SEARCH_BUILTIN,
+	SEARCH_EXTERNAL
 };
 
-struct depmod {
-	const struct cfg *cfg;
-	struct kmod_ctx *ctx;
-	struct array modules;
-	struct hash *modules_by_uncrelpath;
-	struct hash *modules_by_name;
-	struct hash *symbols;
+struct cfg_search {
+	struct cfg_search *next;
+	enum search_type type;
+	size_t len;
+	char path[];
 };
 
-static void mod_free(struct mod *mod)
-{
-	DBG("free %p kmod=%p, path=%s\n", mod, mod->kmod, mod->path);
-	array_free_array(&mod->deps);
-	kmod_module_unref(mod->kmod);
-	kmod_module_info_free_list(mod->info_list);
-	kmod_module_dependency_symbols_free_list(mod->dep_sym_list);
-	free(mod->uncrelpath);
-	free(mod->path);
-	free(mod);
-}
-
-static int mod_add_dependency(struct mod *mod, struct symbol *sym)
-{
-	int err;
-
-	DBG("%s depends on %s %s\n", mod->path, sym->name,
-	    sym->owner != NULL ? sym->owner->path : "(unknown)");
+struct cfg_external {
+	struct cfg_external *next;
+	size_t len;
+	char path[];
+};
 
-	if (sym->owner == NULL)
-		return 0;
+struct cfg_exclude {
+	struct cfg_exclude *next;
+	char exclude_dir[];
+};
 
-	err = array_append_unique(&mod->deps, sym->owner);
-	if (err == -EEXIST)
-		return 0;
-	if (err < 0)
-		return err;
+enum stats_format {
+	STATS_NONE,
+	STATS_TEXT,
+	STATS_JSON,
+};
 
-	sym->owner->users++;
-	SHOW("%s needs \"%s\": %s\n", mod->path, sym->name, sym->owner->path);
-	return 0;
-}
+struct cfg {
+	const char *kversion;
+	char dirname[PATH_MAX];
+	size_t dirnamelen;
+	char outdirname[PATH_MAX];
+	size_t outdirnamelen;
+	char sym_prefix;
+	uint8_t check_symvers;
+	uint8_t print_unknown;
+	uint8_t warn_dups;
+	uint8_t index_version;
+	uint8_t stats; /* enum stats_format */
+	uint8_t sync;
+	uint8_t delta;
+	uint8_t compress;
+	unsigned int jobs;
+	struct cfg_override *overrides;
+	struct cfg_search *searches;
+	struct cfg_external *externals;
+	struct cfg_exclude *excludes;
+};
 
-static void symbol_free(struct symbol *sym)
+static enum search_type cfg_define_search_type(const char *path)
 {
-	DBG("free %p sym=%s, owner=%p %s\n", sym, sym->name, sym->owner,
-	    sym->owner != NULL ? sym->owner->path : "");
-	free(sym);
+	if (streq(path, CFG_BUILTIN_KEY))
+		return SEARCH_BUILTIN;
+	if (streq(path, CFG_EXTERNAL_KEY))
+		return SEARCH_EXTERNAL;
+	return SEARCH_PATH;
 }
 
-static int depmod_init(struct depmod *depmod, struct cfg *cfg,
-							struct kmod_ctx *ctx)
+static int cfg_search_add(struct cfg *cfg, const char *path)
 {
-	int err = 0;
+	struct cfg_search *s;
+	size_t len;
+	enum search_type type;
 
-	depmod->cfg = cfg;
-	depmod->ctx = ctx;
+	type = cfg_define_search_type(path);
 
-	array_init(&depmod->modules, 128);
+	if (type != SEARCH_PATH)
+		len = 0;
+	else
+		len = strlen(path) + 1;
 
-	depmod->modules_by_uncrelpath = hash_new(512, NULL);
-	if (depmod->modules_by_uncrelpath == NULL) {
-		err = -errno;
-		goto modules_by_uncrelpath_failed;
+	s = malloc(sizeof(struct cfg_search) + len);
+	if (s == NULL) {
+		ERR("search add: out of memory\n");
+		return -ENOMEM;
 	}
-
-	depmod->modules_by_name = hash_new(512, NULL);
-	if (depmod->modules_by_name == NULL) {
-		err = -errno;
-		goto modules_by_name_failed;
+	s->type = type;
+	if (type != SEARCH_PATH)
+		s->len = 0;
+	else {
+		s->len = len - 1;
+		memcpy(s->path, path, len);
 	}
 
-	depmod->symbols = hash_new(2048, (void (*)(void *))symbol_free);
-	if (depmod->symbols == NULL) {
-		err = -errno;
-		goto symbols_failed;
-	}
+	DBG("search add: %s, search type=%hhu\n", path, type);
 
+	s->next = cfg->searches;
+	cfg->searches = s;
 	return 0;
+}
 
-symbols_failed:
-	hash_free(depmod->modules_by_name);
-modules_by_name_failed:
-	hash_free(depmod->modules_by_uncrelpath);
-modules_by_uncrelpath_failed:
-	return err;
+static void cfg_search_free(struct cfg_search *s)
+{
+	free(s);
 }
 
-static void depmod_shutdown(struct depmod *depmod)
+static int cfg_override_add(struct cfg *cfg, const char *modname, const char *subdir)
 {
+	struct cfg_override *o;
+	size_t modnamelen = strlen(modname);
+	size_t subdirlen = strlen(subdir);
 	size_t i;
 
-	hash_free(depmod->symbols);
+	o = malloc(sizeof(struct cfg_override) + subdirlen + 1
+		   + modnamelen + 1);
+	if (o == NULL) {
+		ERR("override add: out of memory\n");
+		return -ENOMEM;
+	}
+	memcpy(o->path, subdir, subdirlen);
+	i = subdirlen;
+	o->path[i] = '/';
+	i++;
 
-	hash_free(depmod->modules_by_uncrelpath);
+	memcpy(o->path + i, modname, modnamelen);
+	i += modnamelen;
+	o->path[i] = '\0'; /* no extension, so we can match .ko/.ko.gz */
 
-	hash_free(depmod->modules_by_name);
+	o->len = i;
 
-	for (i = 0; i < depmod->modules.count; i++)
-		mod_free(depmod->modules.array[i]);
-	array_free_array(&depmod->modules);
+	DBG("override add: %s\n", o->path);
 
-	kmod_unref(depmod->ctx);
+	o->next = cfg->overrides;
+	cfg->overrides = o;
+	return 0;
 }
 
-static int depmod_module_add(struct depmod *depmod, struct kmod_module *kmod)
+static void cfg_override_free(struct cfg_override *o)
 {
-	const struct cfg *cfg = depmod->cfg;
-	const char *modname, *lastslash;
-	size_t modnamesz;
-	struct mod *mod;
-	int err;
+	free(o);
+}
 
-	modname = kmod_module_get_name(kmod);
-	modnamesz = strlen(modname) + 1;
+static int cfg_external_add(struct cfg *cfg, const char *path)
+{
+	struct cfg_external *ext;
+	size_t len = strlen(path);
 
-	mod = calloc(1, sizeof(struct mod) + modnamesz);
-	if (mod == NULL)
+	ext = malloc(sizeof(struct cfg_external) + len + 1);
+	if (ext == NULL) {
+		ERR("external add: out of memory\n");
 		return -ENOMEM;
-	mod->kmod = kmod;
-	mod->sort_idx = depmod->modules.count + 1;
-	mod->dep_sort_idx = INT32_MAX;
-	memcpy(mod->modname, modname, modnamesz);
-	mod->modnamesz = modnamesz;
-
-	array_init(&mod->deps, 4);
-
-	mod->path = strdup(kmod_module_get_path(kmod));
-	lastslash = strrchr(mod->path, '/');
-	mod->baselen = lastslash - mod->path;
-	if (strncmp(mod->path, cfg->dirname, cfg->dirnamelen) == 0 &&
-			mod->path[cfg->dirnamelen] == '/')
-		mod->relpath = mod->path + cfg->dirnamelen + 1;
-	else
-		mod->relpath = NULL;
-
-	err = hash_add_unique(depmod->modules_by_name, mod->modname, mod);
-	if (err < 0) {
-		ERR("hash_add_unique %s: %s\n", mod->modname, strerror(-err));
-		goto fail;
 	}
 
-	if (mod->relpath != NULL) {
-		size_t uncrelpathlen = lastslash - mod->relpath + modnamesz
-				       + strlen(KMOD_EXTENSION_UNCOMPRESSED);
-		mod->uncrelpath = memdup(mod->relpath, uncrelpathlen + 1);
-		mod->uncrelpath[uncrelpathlen] = '\0';
-		err = hash_add_unique(depmod->modules_by_uncrelpath,
-				      mod->uncrelpath, mod);
-		if (err < 0) {
-			ERR("hash_add_unique %s: %s\n",
-			    mod->uncrelpath, strerror(-err));
-			hash_del(depmod->modules_by_name, mod->modname);
-			goto fail;
-		}
-	}
+	strcpy(ext->path, path);
+	ext->len = len;
 
-	DBG("add %p kmod=%p, path=%s\n", mod, kmod, mod->path);
+	DBG("external add: %s\n", ext->path);
 
+	ext->next = cfg->externals;
+	cfg->externals = ext;
 	return 0;
+}
 
-fail:
-	free(mod->uncrelpath);
-	free(mod);
-	return err;
+static void cfg_external_free(struct cfg_external *ext)
+{
+	free(ext);
 }
 
-static int depmod_module_del(struct depmod *depmod, struct mod *mod)
+static int cfg_exclude_add(struct cfg *cfg, const char *path)
 {
-	DBG("del %p kmod=%p, path=%s\n", mod, mod->kmod, mod->path);
+	struct cfg_exclude *exc;
+	size_t len = strlen(path);
 
-	if (mod->uncrelpath != NULL)
-		hash_del(depmod->modules_by_uncrelpath, mod->uncrelpath);
+	exc = malloc(sizeof(struct cfg_exclude) + len + 1);
+	if (exc == NULL) {
+		ERR("exclude add: out of memory\n");
+		return -ENOMEM;
+	}
+	memcpy(exc->exclude_dir, path, len + 1);
 
-	hash_del(depmod->modules_by_name, mod->modname);
+	DBG("exclude add: %s\n", path);
 
-	mod_free(mod);
+	exc->next = cfg->excludes;
+	cfg->excludes = exc;
 	return 0;
 }
 
-static const char *search_to_string(const struct cfg_search *s)
+static void cfg_exclude_free(struct cfg_exclude *exc)
 {
-	switch(s->type) {
-	case SEARCH_EXTERNAL:
-		return "external";
-	case SEARCH_BUILTIN:
-		return "built-in";
-	default:
-		return s->path;
-	}
+	free(exc);
 }
 
-static bool depmod_is_path_starts_with(const char *path,
-				       size_t pathlen,
-				       const char *prefix,
-				       size_t prefix_len)
+static int cfg_kernel_matches(const struct cfg *cfg, const char *pattern)
 {
-	if (pathlen <= prefix_len)
-		return false;
-	if (path[prefix_len] != '/')
-		return false;
-	if (memcmp(path, prefix, prefix_len) != 0)
-		return false;
+	regex_t re;
+	int status;
+
+	/* old style */
+	if (streq(pattern, "*"))
+		return 1;
+
+	if (regcomp(&re, pattern, REG_EXTENDED|REG_NOSUB) != 0)
+		return 0;
+
+	status = regexec(&re, cfg->kversion, 0, NULL, 0);
+	regfree(&re);
+
+	return status == 0;
+}
+
+/*
+ * The lines of the configuration files, read once and applied to the cfg of
+ * each kernel by cfg_load() since what they mean depends on the version.
+ */
+struct cfg_line {
+	const char *filename;
+	unsigned int linenum;
+	char text[];
+};
+
+struct cfg_lines {
+	struct array files; /* the filenames of the lines */
+	struct array lines; /* struct cfg_line */
+};
+
+static int cfg_file_read(struct cfg_lines *lines, const char *filename)
+{
+	struct line_reader r;
+	char *line, *fname;
+	unsigned int linenum = 0;
+	int fd, err = 0;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		err = -errno;
+		ERR("file parse %s: %m\n", filename);
+		return err;
+	}
+
+	err = line_reader_open(&r, fd);
+	close(fd);
+	if (err < 0) {
+		ERR("file parse %s: %s\n", filename, strerror(-err));
+		return err;
+	}
+
+	fname = strdup(filename);
+	if (fname == NULL || array_append(&lines->files, fname) < 0) {
+		free(fname);
+		line_reader_close(&r);
+		return -ENOMEM;
+	}
+
+	while ((line = line_reader_next(&r, &linenum)) != NULL) {
+		size_t len = strlen(line);
+		struct cfg_line *l;
+
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+
+		l = malloc(sizeof(struct cfg_line) + len + 1);
+		if (l == NULL || array_append(&lines->lines, l) < 0) {
+			free(l);
+			err = -ENOMEM;
+			break;
+		}
+		l->filename = fname;
+		l->linenum = linenum;
+		memcpy(l->text, line, len + 1);
+	}
+
+	line_reader_close(&r);
+
+	return err;
+}
+
+static int cfg_line_parse(struct cfg *cfg, const struct cfg_line *l)
+{
+	const char *filename = l->filename;
+	unsigned int linenum = l->linenum;
+	char *line, *cmd, *saveptr;
+
+	line = strdup(l->text);
+	if (line == NULL)
+		return -ENOMEM;
+
+	cmd = strtok_r(line, "\t ", &saveptr);
+	if (cmd == NULL)
+		goto done;
+
+	if (streq(cmd, "search")) {
+		const char *sp;
+		while ((sp = strtok_r(NULL, "\t ", &saveptr)) != NULL) {
+			cfg_search_add(cfg, sp);
+		}
+	} else if (streq(cmd, "override")) {
+		const char *modname = strtok_r(NULL, "\t ", &saveptr);
+		const char *version = strtok_r(NULL, "\t ", &saveptr);
+		const char *subdir = strtok_r(NULL, "\t ", &saveptr);
+
+		if (modname == NULL || version == NULL || subdir == NULL)
+			goto syntax_error;
+
+		if (!cfg_kernel_matches(cfg, version)) {
+			INF("%s:%u: override kernel did not match %s\n",
+			    filename, linenum, version);
+			goto done;
+		}
+
+		cfg_override_add(cfg, modname, subdir);
+	} else if (streq(cmd, "external")) {
+		const char *version = strtok_r(NULL, "\t ", &saveptr);
+		const char *dir = strtok_r(NULL, "\t ", &saveptr);
+
+		if (version == NULL || dir == NULL)
+			goto syntax_error;
+
+		if (!cfg_kernel_matches(cfg, version)) {
+			INF("%s:%u: external directory did not match %s\n",
+			    filename, linenum, version);
+			goto done;
+		}
+
+		cfg_external_add(cfg, dir);
+	} else if (streq(cmd, "exclude")) {
+		const char *sp;
+		while ((sp = strtok_r(NULL, "\t ", &saveptr)) != NULL) {
+			cfg_exclude_add(cfg, sp);
+		}
+	} else if (streq(cmd, "include")
+			|| streq(cmd, "make_map_files")) {
+		INF("%s:%u: command %s not implemented yet\n",
+		    filename, linenum, cmd);
+	} else {
+syntax_error:
+		ERR("%s:%u: ignoring bad line starting with '%s'\n",
+		    filename, linenum, cmd);
+	}
+
+done:
+	free(line);
+	return 0;
+}
+
+static int cfg_files_filter_out(DIR *d, const char *dir, const char *name)
+{
+	size_t len = strlen(name);
+	struct stat st;
+
+	if (name[0] == '.')
+		return 1;
+
+	if (len < 6 || !streq(name + len - 5, ".conf")) {
+		INF("All cfg files need .conf: %s/%s\n", dir, name);
+		return 1;
+	}
+
+	fstatat(dirfd(d), name, &st, 0);
+	if (S_ISDIR(st.st_mode)) {
+		ERR("Directories inside directories are not supported: %s/%s\n",
+		    dir, name);
+		return 1;
+	}
+
+	return 0;
+}
+
+struct cfg_file {
+	size_t dirlen;
+	size_t namelen;
+	const char *name;
+	char path[];
+};
+
+static void cfg_file_free(struct cfg_file *f)
+{
+	free(f);
+}
+
+static int cfg_files_insert_sorted(struct cfg_file ***p_files, size_t *p_n_files,
+					const char *dir, const char *name)
+{
+	struct cfg_file **files, *f;
+	size_t i, n_files, namelen, dirlen;
+	void *tmp;
+
+	dirlen = strlen(dir);
+	if (name != NULL)
+		namelen = strlen(name);
+	else {
+		name = basename(dir);
+		namelen = strlen(name);
+		dirlen -= namelen + 1;
+	}
+
+	n_files = *p_n_files;
+	files = *p_files;
+	for (i = 0; i < n_files; i++) {
+		int cmp = strcmp(name, files[i]->name);
+		if (cmp == 0) {
+			DBG("Ignoring duplicate config file: %.*s/%s\n",
+			    (int)dirlen, dir, name);
+			return -EEXIST;
+		} else if (cmp < 0)
+			break;
+	}
+
+	f = malloc(sizeof(struct cfg_file) + dirlen + namelen + 2);
+	if (f == NULL) {
+		ERR("files insert sorted: out of memory\n");
+		return -ENOMEM;
+	}
+
+	tmp = realloc(files, sizeof(struct cfg_file *) * (n_files + 1));
+	if (tmp == NULL) {
+		ERR("files insert sorted: out of memory\n");
+		free(f);
+		return -ENOMEM;
+	}
+	*p_files = files = tmp;
+
+	if (i < n_files) {
+		memmove(files + i + 1, files + i,
+			sizeof(struct cfg_file *) * (n_files - i));
+	}
+	files[i] = f;
+
+	f->dirlen = dirlen;
+	f->namelen = namelen;
+	f->name = f->path + dirlen + 1;
+	memcpy(f->path, dir, dirlen);
+	f->path[dirlen] = '/';
+	memcpy(f->path + dirlen + 1, name, namelen);
+	f->path[dirlen + 1 + namelen] = '\0';
+
+	*p_n_files = n_files + 1;
+	return 0;
+}
+
+/*
+ * Insert configuration files ignoring duplicates
+ */
+static int cfg_files_list(struct cfg_file ***p_files, size_t *p_n_files,
+				const char *path)
+{
+	struct dirent *dent;
+	DIR *d;
+	int err = 0;
+	struct stat st;
+
+	if (stat(path, &st) != 0) {
+		err = -errno;
+		DBG("could not stat '%s': %m\n", path);
+		return err;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		cfg_files_insert_sorted(p_files, p_n_files, path, NULL);
+		return 0;
+	}
+
+	d = opendir(path);
+	if (d == NULL) {
+		ERR("files list %s: %m\n", path);
+		return -EINVAL;
+	}
+
+	for (dent = readdir(d); dent != NULL; dent = readdir(d)) {
+		if (cfg_files_filter_out(d, path, dent->d_name))
+			continue;
+
+		cfg_files_insert_sorted(p_files, p_n_files, path, dent->d_name);
+	}
+
+	closedir(d);
+	DBG("parsed configuration files from %s\n", path);
+	return err;
+}
+
+static void cfg_lines_free(struct cfg_lines *lines)
+{
+	size_t i;
+
+	for (i = 0; i < lines->lines.count; i++)
+		free(lines->lines.array[i]);
+	array_free_array(&lines->lines);
+
+	for (i = 0; i < lines->files.count; i++)
+		free(lines->files.array[i]);
+	array_free_array(&lines->files);
+}
+
+static int cfg_lines_read(struct cfg_lines *lines,
+				const char * const *cfg_paths)
+{
+	size_t i, n_files = 0;
+	struct cfg_file **files = NULL;
+	int err = 0;
+
+	array_init(&lines->files, 16);
+	array_init(&lines->lines, 64);
+
+	if (cfg_paths == NULL)
+		cfg_paths = default_cfg_paths;
+
+	for (i = 0; cfg_paths[i] != NULL; i++)
+		cfg_files_list(&files, &n_files, cfg_paths[i]);
+
+	for (i = 0; i < n_files; i++) {
+		struct cfg_file *f = files[i];
+		if (err != -ENOMEM)
+			err = cfg_file_read(lines, f->path);
+		cfg_file_free(f);
+	}
+	free(files);
+
+	if (err == -ENOMEM) {
+		cfg_lines_free(lines);
+		return err;
+	}
+
+	return 0;
+}
+
+static int cfg_load(struct cfg *cfg, const struct cfg_lines *lines)
+{
+	size_t i;
+
+	for (i = 0; i < lines->lines.count; i++) {
+		int err = cfg_line_parse(cfg, lines->lines.array[i]);
+		if (err < 0)
+			return err;
+	}
+
+	/* For backward compatibility add "updates" to the head of the search
+	 * list here. But only if there was no "search" option specified.
+	 */
+	if (cfg->searches == NULL)
+		cfg_search_add(cfg, "updates");
+
+	return 0;
+}
+
+static void cfg_free(struct cfg *cfg)
+{
+	while (cfg->overrides) {
+		struct cfg_override *tmp = cfg->overrides;
+		cfg->overrides = cfg->overrides->next;
+		cfg_override_free(tmp);
+	}
+
+	while (cfg->searches) {
+		struct cfg_search *tmp = cfg->searches;
+		cfg->searches = cfg->searches->next;
+		cfg_search_free(tmp);
+	}
+
+	while (cfg->externals) {
+		struct cfg_external *tmp = cfg->externals;
+		cfg->externals = cfg->externals->next;
+		cfg_external_free(tmp);
+	}
+
+	while (cfg->excludes) {
+		struct cfg_exclude *tmp = cfg->excludes;
+		cfg->excludes = cfg->excludes->next;
+		cfg_exclude_free(tmp);
+	}
+}
+
+
+/* depmod calculations ***********************************************/
+struct vertex;
+struct mod {
+	struct kmod_module *kmod;
+	char *path;
+	const char *relpath; /* path relative to '$ROOT/lib/modules/$VER/' */
+	char *uncrelpath; /* same as relpath but ending in .ko */
+	struct kmod_list *info_list;
+	struct kmod_list *dep_sym_list;
+	struct kmod_list *sym_list; /* exported, until added to depmod */
+	int sym_err;
+	uint64_t dev, ino, size, mtime; /* of the file, to match the cache */
+	bool cacheable; /* the lists are complete and can be cached */
+	uint64_t read_size; /* decompressed, if read from its file this time */
+	struct array deps; /* struct symbol */
+	const struct mod **all_deps; /* transitive, in dep_sort_idx order */
+	size_t n_all_deps;
+	size_t baselen; /* points to start of basename/filename */
+	size_t modnamesz;
+	int sort_idx; /* sort index using modules.order */
+	int dep_sort_idx; /* topological sort index */
+	uint16_t idx; /* index in depmod->modules.array */
+	uint16_t users; /* how many modules depend on this one */
+	bool visited; /* helper field to report cycles */
+	struct vertex *vertex; /* helper field to report cycles */
+	char modname[];
+};
+
+struct symbol {
+	struct mod *owner;
+	uint64_t crc;
+	char name[];
+};
+
+struct depmod_shared;
+
+struct depmod_cache {
+	void *mem;
+	size_t size;
+	struct hash *records; /* path -> rest of its record */
+	struct depmod_shared *shared; /* of the batch, or NULL */
+};
+
+/* what --stats reports, times in ns */
+struct stats_time {
+	uint64_t wall;
+	uint64_t cpu;
+};
+
+#define STATS_FILES_MAX 17
+
+struct depmod_stats {
+	struct stats_time search, load, deps, output;
+	uint64_t modules_read; /* from their file rather than a cache */
+	uint64_t bytes_read; /* by those, after decompression */
+	struct {
+		struct stats_time time;
+		uint64_t bytes;
+	} files[STATS_FILES_MAX]; /* in the order of depmod->files */
+};
+
+static uint64_t stats_now(clockid_t clock)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clock, &ts) < 0)
+		return 0;
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * The cpu time is that of the whole process for the phases, since they use
+ * their own threads, and that of the calling thread for the files.
+ */
+static void stats_start(struct stats_time *t, clockid_t cpu_clock)
+{
+	t->wall -= stats_now(CLOCK_MONOTONIC);
+	t->cpu -= stats_now(cpu_clock);
+}
+
+static void stats_stop(struct stats_time *t, clockid_t cpu_clock)
+{
+	t->wall += stats_now(CLOCK_MONOTONIC);
+	t->cpu += stats_now(cpu_clock);
+}
+
+struct depmod {
+	const struct cfg *cfg;
+	struct kmod_ctx *ctx;
+	struct array modules;
+	struct hash *modules_by_uncrelpath;
+	struct hash *modules_by_name;
+	struct hash *symbols;
+	struct arena arena; /* the mods, their paths and the symbols */
+	struct depmod_cache cache;
+	bool update_cache;
+	struct array stamps; /* struct depmod_stamp, of the module dirs */
+	struct depmod_stats stats;
+	struct hash *pending; /* with --sync, file name -> temporary name */
+	const struct depfile *files; /* depfiles[], or deltafiles[] */
+	struct hash *delta; /* with --delta, module name -> struct delta_mod */
+};
+
+static void mod_free(struct mod *mod)
+{
+	DBG("free %p kmod=%p, path=%s\n", mod, mod->kmod, mod->path);
+	array_free_array(&mod->deps);
+	kmod_module_unref(mod->kmod);
+	kmod_module_info_free_list(mod->info_list);
+	kmod_module_dependency_symbols_free_list(mod->dep_sym_list);
+}
+
+static int mod_add_dependency(struct mod *mod, struct symbol *sym)
+{
+	int err;
+
+	DBG("%s depends on %s %s\n", mod->path, sym->name,
+	    sym->owner != NULL ? sym->owner->path : "(unknown)");
+
+	if (sym->owner == NULL)
+		return 0;
+
+	err = array_append_unique(&mod->deps, sym->owner);
+	if (err == -EEXIST)
+		return 0;
+	if (err < 0)
+		return err;
+
+	/* modules are resolved from several threads */
+	__atomic_fetch_add(&sym->owner->users, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static int depmod_init(struct depmod *depmod, struct cfg *cfg,
+							struct kmod_ctx *ctx)
+{
+	int err = 0;
+
+	depmod->cfg = cfg;
+	depmod->ctx = ctx;
+
+	array_init(&depmod->modules, 128);
+
+	depmod->modules_by_uncrelpath = hash_new(512, NULL);
+	if (depmod->modules_by_uncrelpath == NULL) {
+		err = -errno;
+		goto modules_by_uncrelpath_failed;
+	}
+
+	depmod->modules_by_name = hash_new(512, NULL);
+	if (depmod->modules_by_name == NULL) {
+		err = -errno;
+		goto modules_by_name_failed;
+	}
+
+	/* symbols are in depmod->arena, not freed one by one */
+	depmod->symbols = hash_new(2048, NULL);
+	if (depmod->symbols == NULL) {
+		err = -errno;
+		goto symbols_failed;
+	}
+
+	return 0;
+
+symbols_failed:
+	hash_free(depmod->modules_by_name);
+modules_by_name_failed:
+	hash_free(depmod->modules_by_uncrelpath);
+modules_by_uncrelpath_failed:
+	return err;
+}
+
+static void depmod_stamps_free(struct depmod *depmod)
+{
+	size_t i;
+
+	for (i = 0; i < depmod->stamps.count; i++)
+		free(depmod->stamps.array[i]);
+	array_free_array(&depmod->stamps);
+}
+
+static void depmod_shutdown(struct depmod *depmod)
+{
+	size_t i;
+
+	hash_free(depmod->symbols);
+
+	hash_free(depmod->modules_by_uncrelpath);
+
+	hash_free(depmod->modules_by_name);
+
+	for (i = 0; i < depmod->modules.count; i++)
+		mod_free(depmod->modules.array[i]);
+	array_free_array(&depmod->modules);
+
+	arena_release(&depmod->arena);
+
+	depmod_stamps_free(depmod);
+
+	hash_free(depmod->delta);
+
+	kmod_unref(depmod->ctx);
+}
+
+static void mod_set_stamp(struct mod *mod, const struct stat *st)
+{
+	mod->dev = st->st_dev;
+	mod->ino = st->st_ino;
+	mod->size = st->st_size;
+	mod->mtime = stat_mstamp(st);
+	mod->cacheable = true;
+}
+
+/* @st, if not NULL, is the result of stat() on the file of @kmod */
+static int depmod_module_add(struct depmod *depmod, struct kmod_module *kmod,
+						const struct stat *st)
+{
+	const struct cfg *cfg = depmod->cfg;
+	const char *modname, *lastslash;
+	size_t modnamesz;
+	struct mod *mod;
+	int err;
+
+	modname = kmod_module_get_name(kmod);
+	modnamesz = strlen(modname) + 1;
+
+	/* a module deleted later for a higher priority one stays in the arena */
+	mod = arena_alloc(&depmod->arena, sizeof(struct mod) + modnamesz);
+	if (mod == NULL)
+		return -ENOMEM;
+	memset(mod, 0, sizeof(struct mod));
+	mod->kmod = kmod;
+	if (st != NULL)
+		mod_set_stamp(mod, st);
+	mod->sort_idx = depmod->modules.count + 1;
+	mod->dep_sort_idx = INT32_MAX;
+	memcpy(mod->modname, modname, modnamesz);
+	mod->modnamesz = modnamesz;
+
+	array_init(&mod->deps, 4);
+
+	mod->path = arena_strdup(&depmod->arena, kmod_module_get_path(kmod));
+	if (mod->path == NULL)
+		return -ENOMEM;
+	lastslash = strrchr(mod->path, '/');
+	mod->baselen = lastslash - mod->path;
+	if (strncmp(mod->path, cfg->dirname, cfg->dirnamelen) == 0 &&
+			mod->path[cfg->dirnamelen] == '/')
+		mod->relpath = mod->path + cfg->dirnamelen + 1;
+	else
+		mod->relpath = NULL;
+
+	err = hash_add_unique(depmod->modules_by_name, mod->modname, mod);
+	if (err < 0) {
+		ERR("hash_add_unique %s: %s\n", mod->modname, strerror(-err));
+		return err;
+	}
+
+	if (mod->relpath != NULL) {
+		size_t uncrelpathlen = lastslash - mod->relpath + modnamesz
+				       + strlen(KMOD_EXTENSION_UNCOMPRESSED);
+		mod->uncrelpath = arena_memdup(&depmod->arena, mod->relpath,
+					       uncrelpathlen + 1);
+		if (mod->uncrelpath == NULL) {
+			hash_del(depmod->modules_by_name, mod->modname);
+			return -ENOMEM;
+		}
+		mod->uncrelpath[uncrelpathlen] = '\0';
+		err = hash_add_unique(depmod->modules_by_uncrelpath,
+				      mod->uncrelpath, mod);
+		if (err < 0) {
+			ERR("hash_add_unique %s: %s\n",
+			    mod->uncrelpath, strerror(-err));
+			hash_del(depmod->modules_by_name, mod->modname);
+			return err;
+		}
+	}
+
+	DBG("add %p kmod=%p, path=%s\n", mod, kmod, mod->path);
+
+	return 0;
+}
+
+static int depmod_module_del(struct depmod *depmod, struct mod *mod)
+{
+	DBG("del %p kmod=%p, path=%s\n", mod, mod->kmod, mod->path);
+
+	if (mod->uncrelpath != NULL)
+		hash_del(depmod->modules_by_uncrelpath, mod->uncrelpath);
+
+	hash_del(depmod->modules_by_name, mod->modname);
+
+	mod_free(mod);
+	return 0;
+}
+
+static const char *search_to_string(const struct cfg_search *s)
+{
+	switch(s->type) {
+	case SEARCH_EXTERNAL:
+		return "external";
+	case SEARCH_BUILTIN:
+		return "built-in";
+	default:
+		return s->path;
+	}
+}
+
+static bool depmod_is_path_starts_with(const char *path,
+				       size_t pathlen,
+				       const char *prefix,
+				       size_t prefix_len)
+{
+	if (pathlen <= prefix_len)
+		return false;
+	if (path[prefix_len] != '/')
+		return false;
+	if (memcmp(path, prefix, prefix_len) != 0)
+		return false;
+
+	return true;
+}
+
+/* returns if existing module @mod is higher priority than newpath.
+ * note this is the inverse of module-init-tools is_higher_priority()
+ */
+static int depmod_module_is_higher_priority(const struct depmod *depmod, const struct mod *mod, size_t baselen, size_t namelen, size_t modnamelen, const char *newpath)
+{
+	const struct cfg *cfg = depmod->cfg;
+	const struct cfg_override *ov;
+	const struct cfg_search *se;
+	const struct cfg_external *ext;
+
+	/* baselen includes the last '/' and mod->baselen doesn't. So it's
+	 * actually correct to use modnamelen in the first and modnamesz in
+	 * the latter */
+	size_t newlen = baselen + modnamelen;
+	size_t oldlen = mod->baselen + mod->modnamesz;
+	const char *oldpath = mod->path;
+	int i, bprio = -1, oldprio = -1, newprio = -1;
+	size_t relnewlen = 0;
+	size_t reloldlen = 0;
+	const char *relnewpath = NULL;
+	const char *reloldpath = NULL;
+
+	DBG("comparing priorities of %s and %s\n",
+	    oldpath, newpath);
+
+	if (strncmp(newpath, cfg->dirname, cfg->dirnamelen) == 0) {
+		relnewpath = newpath + cfg->dirnamelen + 1;
+		relnewlen = newlen - (cfg->dirnamelen + 1);
+	}
+	if (strncmp(oldpath, cfg->dirname, cfg->dirnamelen) == 0) {
+		reloldpath = oldpath + cfg->dirnamelen + 1;
+		reloldlen = oldlen - (cfg->dirnamelen + 1);
+	}
+
+	for (ov = cfg->overrides; ov != NULL; ov = ov->next) {
+		DBG("override %s\n", ov->path);
+		if (relnewlen == ov->len &&
+		    memcmp(ov->path, relnewpath, relnewlen) == 0)
+			return 0;
+		if (reloldlen == ov->len &&
+		    memcmp(ov->path, reloldpath, reloldlen) == 0)
+			return 1;
+	}
+
+	for (i = 0, se = cfg->searches; se != NULL; se = se->next, i++) {
+		DBG("search %s\n", search_to_string(se));
+		if (se->type == SEARCH_BUILTIN)
+			bprio = i;
+		else if (se->type == SEARCH_EXTERNAL) {
+			for (ext = cfg->externals; ext != NULL; ext = ext->next, i++) {
+				if (depmod_is_path_starts_with(newpath,
+							       newlen,
+							       ext->path,
+							       ext->len))
+					newprio = i;
+				if (depmod_is_path_starts_with(oldpath,
+							       oldlen,
+							       ext->path,
+							       ext->len))
+					oldprio = i;
+			}
+		} else if (relnewlen > se->len && relnewpath[se->len] == '/' &&
+			 memcmp(se->path, relnewpath, se->len) == 0)
+			newprio = i;
+		else if (reloldlen > se->len && reloldpath[se->len] == '/' &&
+			 memcmp(se->path, reloldpath, se->len) == 0)
+			oldprio = i;
+	}
+
+	if (newprio < 0)
+		newprio = bprio;
+	if (oldprio < 0)
+		oldprio = bprio;
+
+	DBG("priorities: built-in: %d, old: %d, new: %d\n",
+	    bprio, oldprio, newprio);
+
+	return newprio <= oldprio;
+}
+
+static bool should_exclude_dir(const struct cfg *cfg, const char *name)
+{
+	struct cfg_exclude *exc;
+
+	if (name[0] == '.' && (name[1] == '\0' ||
+			(name[1] == '.' && name[2] == '\0')))
+		return true;
+
+	if (streq(name, "build") || streq(name, "source"))
+		return true;
+
+	for (exc = cfg->excludes; exc != NULL; exc = exc->next) {
+		if (streq(name, exc->exclude_dir))
+			return true;
+	}
+
+	return false;
+}
+
+static int depmod_modules_search_file(struct depmod *depmod, size_t baselen, size_t namelen, const char *path, const struct stat *st)
+{
+	struct kmod_module *kmod;
+	struct mod *mod;
+	const char *relpath;
+	char modname[PATH_MAX];
+	size_t modnamelen;
+	int err;
+
+	if (path_to_modname(path, modname, &modnamelen) == NULL) {
+		ERR("could not get modname from path %s\n", path);
+		return -EINVAL;
+	}
+
+	relpath = path + depmod->cfg->dirnamelen + 1;
+	DBG("try %s (%s)\n", relpath, modname);
+
+	mod = hash_find_len(depmod->modules_by_name, modname, modnamelen);
+	if (mod == NULL)
+		goto add;
+
+	if (depmod_module_is_higher_priority(depmod, mod, baselen,
+						namelen, modnamelen, path)) {
+		DBG("Ignored lower priority: %s, higher: %s\n",
+		    path, mod->path);
+		return 0;
+	}
+
+	DBG("Replace lower priority %s with new module %s\n",
+	    mod->relpath, relpath);
+	err = depmod_module_del(depmod, mod);
+	if (err < 0) {
+		ERR("could not del module %s: %s\n", mod->path, strerror(-err));
+		return err;
+	}
+
+add:
+	err = kmod_module_new_from_path_unchecked(depmod->ctx, path, &kmod);
+	if (err < 0) {
+		ERR("could not create module %s: %s\n", path, strerror(-err));
+		return err;
+	}
+
+	err = depmod_module_add(depmod, kmod, st);
+	if (err < 0) {
+		ERR("could not add module %s: %s\n",
+		    path, strerror(-err));
+		kmod_module_unref(kmod);
+		return err;
+	}
+	return 0;
+}
+
+/* A module file found while walking one of the search roots */
+struct depmod_search_entry {
+	struct stat st;
+	size_t baselen;
+	size_t namelen;
+	char path[];
+};
+
+/*
+ * The walk of each root only touches the filesystem and its own entries,
+ * so with -j the roots are walked at the same time. The entries are then
+ * added to depmod in the same order as a serial walk would have.
+ */
+struct depmod_search {
+	const struct cfg *cfg;
+	const char *root;
+	struct array entries; /* struct depmod_search_entry */
+	pthread_t thread;
+	bool started;
+	int err;
+};
+
+static int depmod_search_add_entry(struct depmod_search *search, int dfd,
+				   const char *path, size_t baselen,
+				   size_t namelen, const struct stat *st)
+{
+	struct depmod_search_entry *e;
+
+	e = malloc(sizeof(*e) + baselen + namelen + 1);
+	if (e == NULL)
+		return -ENOMEM;
+
+	/* a file of unknown type was already stat()'ed to find out */
+	if (st != NULL)
+		e->st = *st;
+	else if (fstatat(dfd, path + baselen, &e->st, 0) < 0) {
+		int err = -errno;
+
+		ERR("fstatat(%d, %s): %m\n", dfd, path + baselen);
+		free(e);
+		return err;
+	}
+
+	e->baselen = baselen;
+	e->namelen = namelen;
+	memcpy(e->path, path, baselen + namelen + 1);
+
+	if (array_append(&search->entries, e) < 0) {
+		free(e);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int depmod_search_dir(struct depmod_search *search, DIR *d, size_t baselen, struct scratchbuf *s_path)
+{
+	struct dirent *de;
+	int err = 0, dfd = dirfd(d);
+	char *path;
+
+	while ((de = readdir(d)) != NULL) {
+		const char *name = de->d_name;
+		struct stat st, *pst = NULL;
+		size_t namelen;
+		uint8_t is_dir;
+
+		if (should_exclude_dir(search->cfg, name))
+			continue;
+
+		namelen = strlen(name);
+		if (scratchbuf_alloc(s_path, baselen + namelen + 2) < 0) {
+			err = -ENOMEM;
+			ERR("No memory\n");
+			continue;
+		}
+
+		path = scratchbuf_str(s_path);
+		memcpy(path + baselen, name, namelen + 1);
+
+		if (de->d_type == DT_REG)
+			is_dir = 0;
+		else if (de->d_type == DT_DIR)
+			is_dir = 1;
+		else {
+			if (fstatat(dfd, name, &st, 0) < 0) {
+				ERR("fstatat(%d, %s): %m\n", dfd, name);
+				continue;
+			} else if (S_ISREG(st.st_mode))
+				is_dir = 0;
+			else if (S_ISDIR(st.st_mode))
+				is_dir = 1;
+			else {
+				ERR("unsupported file type %s: %o\n",
+				    path, st.st_mode & S_IFMT);
+				continue;
+			}
+			pst = &st;
+		}
+
+		if (is_dir) {
+			int fd;
+			DIR *subdir;
+			fd = openat(dfd, name, O_RDONLY);
+			if (fd < 0) {
+				ERR("openat(%d, %s, O_RDONLY): %m\n",
+				    dfd, name);
+				continue;
+			}
+			subdir = fdopendir(fd);
+			if (subdir == NULL) {
+				ERR("fdopendir(%d): %m\n", fd);
+				close(fd);
+				continue;
+			}
+			path[baselen + namelen] = '/';
+			path[baselen + namelen + 1] = '\0';
+			err = depmod_search_dir(search, subdir,
+						baselen + namelen + 1, s_path);
+			closedir(subdir);
+		} else if (path_ends_with_kmod_ext(name, namelen)) {
+			err = depmod_search_add_entry(search, dfd, path,
+						      baselen, namelen, pst);
+		}
+
+		if (err < 0) {
+			path[baselen + namelen] = '\0';
+			ERR("failed %s: %s\n", path, strerror(-err));
+			err = 0; /* ignore errors */
+		}
+	}
+	return err;
+}
+
+static void *depmod_search_path(void *data)
+{
+	struct depmod_search *search = data;
+	const char *path = search->root;
+	char buf[256];
+	_cleanup_(scratchbuf_release) struct scratchbuf s_path_buf =
+		SCRATCHBUF_INITIALIZER(buf);
+	char *path_buf;
+	DIR *d;
+	size_t baselen;
+	int err;
+
+	d = opendir(path);
+	if (d == NULL) {
+		search->err = -errno;
+		ERR("could not open directory %s: %m\n", path);
+		return NULL;
+	}
+
+	baselen = strlen(path);
+
+	if (scratchbuf_alloc(&s_path_buf, baselen + 2) < 0) {
+		err = -ENOMEM;
+		goto out;
+	}
+	path_buf = scratchbuf_str(&s_path_buf);
+
+	memcpy(path_buf, path, baselen);
+	path_buf[baselen] = '/';
+	baselen++;
+	path_buf[baselen] = '\0';
+
+	err = depmod_search_dir(search, d, baselen, &s_path_buf);
+out:
+	closedir(d);
+	search->err = err;
+	return NULL;
+}
+
+static void depmod_search_release(struct depmod_search *search)
+{
+	size_t i;
+
+	for (i = 0; i < search->entries.count; i++)
+		free(search->entries.array[i]);
+	array_free_array(&search->entries);
+}
+
+static int depmod_modules_search(struct depmod *depmod)
+{
+	const struct cfg *cfg = depmod->cfg;
+	struct depmod_search *searches;
+	struct cfg_external *ext;
+	size_t i, j, n = 1;
+	int err = 0;
+
+	for (ext = cfg->externals; ext != NULL; ext = ext->next)
+		n++;
+
+	searches = calloc(n, sizeof(*searches));
+	if (searches == NULL)
+		return -ENOMEM;
+
+	searches[0].root = cfg->dirname;
+	for (i = 1, ext = cfg->externals; ext != NULL; ext = ext->next, i++)
+		searches[i].root = ext->path;
+
+	for (i = 0; i < n; i++) {
+		searches[i].cfg = cfg;
+		array_init(&searches[i].entries, 256);
+	}
+
+	if (cfg->jobs != 1) {
+		for (i = 1; i < n; i++)
+			searches[i].started = pthread_create(&searches[i].thread,
+					NULL, depmod_search_path,
+					&searches[i]) == 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (searches[i].started)
+			pthread_join(searches[i].thread, NULL);
+		else
+			depmod_search_path(&searches[i]);
+	}
+
+	/* ignore errors and absence of the external dirs */
+	err = searches[0].err;
+	if (err < 0)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < searches[i].entries.count; j++) {
+			const struct depmod_search_entry *e =
+				searches[i].entries.array[j];
+			int r;
+
+			r = depmod_modules_search_file(depmod, e->baselen,
+						e->namelen, e->path, &e->st);
+			if (r < 0)
+				ERR("failed %s: %s\n", e->path, strerror(-r));
+		}
+	}
+
+out:
+	for (i = 0; i < n; i++)
+		depmod_search_release(&searches[i]);
+	free(searches);
+
+	return err < 0 ? err : 0;
+}
+
+static int mod_cmp(const void *pa, const void *pb) {
+	const struct mod *a = *(const struct mod **)pa;
+	const struct mod *b = *(const struct mod **)pb;
+	return a->sort_idx - b->sort_idx;
+}
+
+static int depmod_modules_build_array(struct depmod *depmod)
+{
+	struct hash_iter module_iter;
+	const void *v;
+	int err;
+
+	hash_iter_init(depmod->modules_by_name, &module_iter);
+	while (hash_iter_next(&module_iter, NULL, &v)) {
+		struct mod *mod = (struct mod *) v;
+		mod->idx = depmod->modules.count;
+		err = array_append(&depmod->modules, mod);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+static FILE *dfdopen(const char *dname, const char *filename, int flags,
+		     const char *mode)
+{
+	int fd, dfd;
+	FILE *ret;
+
+	dfd = open(dname, O_RDONLY);
+	if (dfd < 0) {
+		WRN("could not open directory %s: %m\n", dname);
+		return NULL;
+	}
+
+	fd = openat(dfd, filename, flags);
+	if (fd < 0) {
+		WRN("could not open %s at %s: %m\n", filename, dname);
+		ret = NULL;
+	} else {
+		ret = fdopen(fd, mode);
+		if (!ret) {
+			WRN("could not associate stream with %s: %m\n", filename);
+			close(fd);
+		}
+	}
+	close(dfd);
+	return ret;
+}
+
+
+
+static void depmod_modules_sort(struct depmod *depmod)
+{
+	char line[PATH_MAX];
+	const char *order_file = "modules.order";
+	FILE *fp;
+	unsigned idx = 0, total = 0;
+
+	fp = dfdopen(depmod->cfg->dirname, order_file, O_RDONLY, "r");
+	if (fp == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		size_t len = strlen(line);
+		idx++;
+		if (len == 0)
+			continue;
+		if (line[len - 1] != '\n') {
+			ERR("%s/%s:%u corrupted line misses '\\n'\n",
+				depmod->cfg->dirname, order_file, idx);
+			goto corrupted;
+		}
+	}
+	total = idx + 1;
+	idx = 0;
+	fseek(fp, 0, SEEK_SET);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		size_t len = strlen(line);
+		struct mod *mod;
+
+		idx++;
+		if (len == 0)
+			continue;
+		line[len - 1] = '\0';
+
+		mod = hash_find(depmod->modules_by_uncrelpath, line);
+		if (mod == NULL)
+			continue;
+		mod->sort_idx = idx - total;
+	}
+
+	array_sort(&depmod->modules, mod_cmp);
+	for (idx = 0; idx < depmod->modules.count; idx++) {
+		struct mod *m = depmod->modules.array[idx];
+		m->idx = idx;
+	}
+
+corrupted:
+	fclose(fp);
+}
+
+/* @name doesn't need to be NUL-terminated */
+static int depmod_symbol_add_len(struct depmod *depmod, const char *name,
+					size_t namelen, bool prefix_skipped,
+					uint64_t crc, const struct mod *owner)
+{
+	int err;
+	struct symbol *sym;
+
+	if (!prefix_skipped && namelen > 0 &&
+				name[0] == depmod->cfg->sym_prefix) {
+		name++;
+		namelen--;
+	}
+
+	/* a symbol replaced by another with the same name stays there */
+	sym = arena_alloc(&depmod->arena,
+				sizeof(struct symbol) + namelen + 1);
+	if (sym == NULL)
+		return -ENOMEM;
+
+	sym->owner = (struct mod *)owner;
+	sym->crc = crc;
+	memcpy(sym->name, name, namelen);
+	sym->name[namelen] = '\0';
+
+	err = hash_add_len(depmod->symbols, sym->name, namelen, sym);
+	if (err < 0)
+		return err;
+
+	DBG("add %p sym=%s, owner=%p %s\n", sym, sym->name, owner,
+	    owner != NULL ? owner->path : "");
+
+	return 0;
+}
+
+static int depmod_symbol_add(struct depmod *depmod, const char *name,
+					bool prefix_skipped, uint64_t crc,
+					const struct mod *owner)
+{
+	return depmod_symbol_add_len(depmod, name, strlen(name),
+				     prefix_skipped, crc, owner);
+}
+
+static struct symbol *depmod_symbol_find(const struct depmod *depmod,
+							const char *name)
+{
+	if (name[0] == '.') /* PPC64 needs this: .foo == foo */
+		name++;
+	if (name[0] == depmod->cfg->sym_prefix)
+		name++;
+	return hash_find(depmod->symbols, name);
+}
+
+/*
+ * modules.depmod.cache, next to the generated files, keeps what the last
+ * run read from each module file. A module whose inode, size and mtime are
+ * unchanged is taken from there instead of being decompressed and parsed
+ * again. The file is only meant for the depmod that wrote it: integers are
+ * in host byte order and the header has the kmod version.
+ *
+ *   header: magic, version
+ *   record: path, ino, size, mtime, flags,
+ *           n_syms x (crc, symbol),
+ *           n_info x (key, value),
+ *           n_deps x (crc, bind, symbol)
+ *
+ * ino, size, mtime and crc are 64 bits, bind is 8 bits, other integers are
+ * 32 bits. A string is its 32 bits length, then itself including the NUL.
+ */
+#define DEPMOD_CACHE_FILE "modules.depmod.cache"
+#define DEPMOD_CACHE_MAGIC 0x4b4d4443
+#define DEPMOD_CACHE_NO_SYMBOLS 0x1
+
+struct cache_reader {
+	const char *p, *end;
+};
+
+static bool cache_read(struct cache_reader *r, void *v, size_t len)
+{
+	if ((size_t)(r->end - r->p) < len)
+		return false;
+
+	memcpy(v, r->p, len);
+	r->p += len;
+	return true;
+}
+
+static const char *cache_read_str(struct cache_reader *r, uint32_t *len)
+{
+	const char *str;
+
+	if (!cache_read(r, len, sizeof(*len)) ||
+			(size_t)(r->end - r->p) <= *len || r->p[*len] != '\0')
+		return NULL;
+
+	str = r->p;
+	r->p += *len + 1;
+	return str;
+}
+
+/*
+ * Parse a record after its path and stat fields, into the lists of @mod if
+ * it's not NULL. Returns false if the record is invalid or on allocation
+ * failure, in which case the lists of @mod are incomplete.
+ */
+static bool cache_read_record(struct cache_reader *r, struct mod *mod)
+{
+	uint32_t flags, n, i, len, vlen;
+	const char *str, *val;
+	uint64_t crc;
+	uint8_t bind;
+
+	if (!cache_read(r, &flags, sizeof(flags)))
+		return false;
+	if (mod != NULL)
+		mod->sym_err = flags & DEPMOD_CACHE_NO_SYMBOLS ? -ENODATA : 0;
+
+	if (!cache_read(r, &n, sizeof(n)))
+		return false;
+	for (i = 0; i < n; i++) {
+		if (!cache_read(r, &crc, sizeof(crc)) ||
+				(str = cache_read_str(r, &len)) == NULL)
+			return false;
+		if (mod != NULL &&
+			kmod_module_symbol_append(&mod->sym_list, crc, str) == NULL)
+			return false;
+	}
+
+	if (!cache_read(r, &n, sizeof(n)))
+		return false;
+	for (i = 0; i < n; i++) {
+		if ((str = cache_read_str(r, &len)) == NULL ||
+				(val = cache_read_str(r, &vlen)) == NULL)
+			return false;
+		if (mod != NULL && kmod_module_info_append(&mod->info_list,
+						str, len, val, vlen) == NULL)
+			return false;
+	}
+
+	if (!cache_read(r, &n, sizeof(n)))
+		return false;
+	for (i = 0; i < n; i++) {
+		if (!cache_read(r, &crc, sizeof(crc)) ||
+				!cache_read(r, &bind, sizeof(bind)) ||
+				(str = cache_read_str(r, &len)) == NULL)
+			return false;
+		if (mod != NULL && kmod_module_dependency_symbol_append(
+					&mod->dep_sym_list, crc, bind, str) == NULL)
+			return false;
+	}
+
+	return true;
+}
+
+static void depmod_cache_close(struct depmod_cache *cache)
+{
+	hash_free(cache->records);
+	if (cache->mem != NULL)
+		munmap(cache->mem, cache->size);
+	cache->records = NULL;
+	cache->mem = NULL;
+}
+
+/* a missing or invalid cache only means every module is read */
+static void depmod_cache_open(struct depmod_cache *cache, const char *dirname)
+{
+	struct cache_reader r;
+	char path[PATH_MAX];
+	const char *version;
+	struct stat st;
+	uint32_t magic, len;
+	int fd;
+
+	if (snprintf(path, sizeof(path), "%s/" DEPMOD_CACHE_FILE,
+						dirname) >= (int)sizeof(path))
+		return;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return;
+	}
+
+	cache->mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cache->mem == MAP_FAILED) {
+		cache->mem = NULL;
+		return;
+	}
+	cache->size = st.st_size;
+
+	cache->records = hash_new(512, NULL);
+	if (cache->records == NULL)
+		goto invalid;
+
+	r.p = cache->mem;
+	r.end = r.p + cache->size;
+
+	if (!cache_read(&r, &magic, sizeof(magic)) ||
+			magic != DEPMOD_CACHE_MAGIC ||
+			(version = cache_read_str(&r, &len)) == NULL ||
+			!streq(version, VERSION))
+		goto invalid;
+
+	while (r.p < r.end) {
+		const char *modpath, *record;
+		uint64_t stamp[3];
+
+		if ((modpath = cache_read_str(&r, &len)) == NULL)
+			goto invalid;
+
+		record = r.p;
+		if (!cache_read(&r, stamp, sizeof(stamp)) ||
+				!cache_read_record(&r, NULL))
+			goto invalid;
+
+		if (hash_add_len(cache->records, modpath, len, record) < 0)
+			goto invalid;
+	}
+
+	DBG("%u modules in %s\n", hash_get_count(cache->records), path);
+	return;
+
+invalid:
+	DBG("ignoring %s\n", path);
+	depmod_cache_close(cache);
+}
+
+static void mod_free_lists(struct mod *mod)
+{
+	kmod_module_symbols_free_list(mod->sym_list);
+	kmod_module_info_free_list(mod->info_list);
+	kmod_module_dependency_symbols_free_list(mod->dep_sym_list);
+	mod->sym_list = mod->info_list = mod->dep_sym_list = NULL;
+}
+
+/* fill @mod from the cache, returns false if it must be read from its file */
+static bool depmod_cache_load(const struct depmod_cache *cache,
+							struct mod *mod)
+{
+	struct cache_reader r;
+	uint64_t stamp[3];
+
+	if (cache->records == NULL || !mod->cacheable)
+		return false;
+
+	r.p = hash_find(cache->records, mod->path);
+	if (r.p == NULL)
+		return false;
+	r.end = (const char *)cache->mem + cache->size;
+
+	if (!cache_read(&r, stamp, sizeof(stamp)) || stamp[0] != mod->ino ||
+			stamp[1] != mod->size || stamp[2] != mod->mtime)
+		return false;
+
+	if (!cache_read_record(&r, mod)) {
+		mod_free_lists(mod);
+		return false;
+	}
+
+	return true;
+}
+
+static void cache_write(FILE *fp, const void *v, size_t len)
+{
+	fwrite(v, len, 1, fp);
+}
+
+static void cache_write_str(FILE *fp, const char *str)
+{
+	uint32_t len = strlen(str);
+
+	cache_write(fp, &len, sizeof(len));
+	cache_write(fp, str, len + 1);
+}
+
+static void cache_write_count(FILE *fp, const struct kmod_list *list)
+{
+	const struct kmod_list *l;
+	uint32_t n = 0;
+
+	kmod_list_foreach(l, list)
+		n++;
+	cache_write(fp, &n, sizeof(n));
+}
+
+static void depmod_cache_write_record(FILE *fp, const struct mod *mod)
+{
+	uint64_t stamp[3] = { mod->ino, mod->size, mod->mtime };
+	uint32_t flags = mod->sym_err < 0 ? DEPMOD_CACHE_NO_SYMBOLS : 0;
+	const struct kmod_list *l;
+
+	cache_write_str(fp, mod->path);
+	cache_write(fp, stamp, sizeof(stamp));
+	cache_write(fp, &flags, sizeof(flags));
+
+	cache_write_count(fp, mod->sym_list);
+	kmod_list_foreach(l, mod->sym_list) {
+		uint64_t crc = kmod_module_symbol_get_crc(l);
+
+		cache_write(fp, &crc, sizeof(crc));
+		cache_write_str(fp, kmod_module_symbol_get_symbol(l));
+	}
+
+	cache_write_count(fp, mod->info_list);
+	kmod_list_foreach(l, mod->info_list) {
+		cache_write_str(fp, kmod_module_info_get_key(l));
+		cache_write_str(fp, kmod_module_info_get_value(l));
+	}
+
+	cache_write_count(fp, mod->dep_sym_list);
+	kmod_list_foreach(l, mod->dep_sym_list) {
+		uint64_t crc = kmod_module_dependency_symbol_get_crc(l);
+		uint8_t bind = kmod_module_dependency_symbol_get_bind(l);
+
+		cache_write(fp, &crc, sizeof(crc));
+		cache_write(fp, &bind, sizeof(bind));
+		cache_write_str(fp, kmod_module_dependency_symbol_get_symbol(l));
+	}
+}
+
+/*
+ * When depmod is given several kernels, what was read from each module file
+ * is also kept here for the others: a file found in several of their trees,
+ * e.g. hard linked between flavours, is then only read once. The records
+ * are as in modules.depmod.cache, keyed by the device, inode, size and
+ * mtime of the file, and stay until the end of the batch.
+ */
+struct depmod_shared {
+	pthread_mutex_t lock;
+	struct hash *records; /* struct shared_record */
+};
+
+struct shared_record {
+	char *data;
+	size_t size;
+	char key[];
+};
+
+#define SHARED_KEY_MAX (4 * 16 + 3 + 1)
+
+static void shared_record_free(void *data)
+{
+	struct shared_record *rec = data;
+
+	free(rec->data);
+	free(rec);
+}
+
+static int depmod_shared_init(struct depmod_shared *shared)
+{
+	shared->records = hash_new(2048, shared_record_free);
+	if (shared->records == NULL)
+		return -errno;
+	pthread_mutex_init(&shared->lock, NULL);
+	return 0;
+}
+
+static void depmod_shared_free(struct depmod_shared *shared)
+{
+	hash_free(shared->records);
+	pthread_mutex_destroy(&shared->lock);
+}
+
+static size_t shared_key(const struct mod *mod, char key[static SHARED_KEY_MAX])
+{
+	return snprintf(key, SHARED_KEY_MAX,
+			"%"PRIx64":%"PRIx64":%"PRIx64":%"PRIx64,
+			mod->dev, mod->ino, mod->size, mod->mtime);
+}
+
+static const struct shared_record *depmod_shared_find(
+				struct depmod_shared *shared, const char *key)
+{
+	const struct shared_record *rec;
+
+	pthread_mutex_lock(&shared->lock);
+	rec = hash_find(shared->records, key);
+	pthread_mutex_unlock(&shared->lock);
+
+	return rec;
+}
+
+/* like depmod_cache_load(), from what another kernel of the batch read */
+static bool depmod_shared_load(struct depmod_shared *shared, struct mod *mod)
+{
+	const struct shared_record *rec;
+	char key[SHARED_KEY_MAX];
+	struct cache_reader r;
+	uint64_t stamp[3];
+	uint32_t len;
+
+	if (shared == NULL || !mod->cacheable)
+		return false;
+
+	shared_key(mod, key);
+	rec = depmod_shared_find(shared, key);
+	if (rec == NULL)
+		return false;
+
+	r.p = rec->data;
+	r.end = r.p + rec->size;
+	if (cache_read_str(&r, &len) == NULL ||
+			!cache_read(&r, stamp, sizeof(stamp)) ||
+			!cache_read_record(&r, mod)) {
+		mod_free_lists(mod);
+		return false;
+	}
+
+	DBG("%s: reusing what was read from the same file\n", mod->path);
+	return true;
+}
+
+static void depmod_shared_store(struct depmod_shared *shared,
+							const struct mod *mod)
+{
+	struct shared_record *rec;
+	char key[SHARED_KEY_MAX];
+	size_t keylen;
+	FILE *fp;
+	int err;
+
+	if (shared == NULL || !mod->cacheable)
+		return;
+
+	keylen = shared_key(mod, key);
+	if (depmod_shared_find(shared, key) != NULL)
+		return;
+
+	rec = malloc(sizeof(struct shared_record) + keylen + 1);
+	if (rec == NULL)
+		return;
+	memcpy(rec->key, key, keylen + 1);
+
+	fp = open_memstream(&rec->data, &rec->size);
+	if (fp == NULL) {
+		free(rec);
+		return;
+	}
+	depmod_cache_write_record(fp, mod);
+	if ((ferror(fp) | fclose(fp)) != 0) {
+		shared_record_free(rec);
+		return;
+	}
+
+	pthread_mutex_lock(&shared->lock);
+	err = hash_add_unique(shared->records, rec->key, rec);
+	pthread_mutex_unlock(&shared->lock);
+	if (err < 0)
+		shared_record_free(rec);
+}
+
+/*
+ * The new cache is written next to the old one and renamed over it once
+ * complete, relative to @dfd since that's where the other files go too.
+ */
+static FILE *depmod_cache_create(int dfd, const char *name, uint32_t magic,
+						char tmp[static NAME_MAX])
+{
+	FILE *fp;
+	int fd;
+
+	snprintf(tmp, NAME_MAX, "%s.%i", name, getpid());
+	fd = openat(dfd, tmp, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		DBG("could not create %s: %m\n", tmp);
+		return NULL;
+	}
+
+	fp = fdopen(fd, "wb");
+	if (fp == NULL) {
+		close(fd);
+		unlinkat(dfd, tmp, 0);
+		return NULL;
+	}
+
+	cache_write(fp, &magic, sizeof(magic));
+	cache_write_str(fp, VERSION);
+
+	return fp;
+}
+
+static void depmod_cache_commit(int dfd, FILE *fp, const char *tmp,
+							const char *name)
+{
+	if ((ferror(fp) | fclose(fp)) != 0 ||
+			renameat(dfd, tmp, dfd, name) != 0) {
+		WRN("could not write %s: %m\n", name);
+		unlinkat(dfd, tmp, 0);
+	}
+}
+
+/*
+ * modules.depmod.stamp has the mtime and link count of each directory of
+ * the module tree as they were when the last full run started, so that
+ * depmod -A only needs to look for new modules in the directories that
+ * changed since then. It's tied to the modules.dep written by that run.
+ *
+ *   header: magic, version, modules.dep ino, size and mtime
+ *   record: path relative to the module dir, mtime, nlink
+ *
+ * With the same encoding as modules.depmod.cache.
+ */
+#define DEPMOD_STAMP_FILE "modules.depmod.stamp"
+#define DEPMOD_STAMP_MAGIC 0x4b4d4453
+
+struct depmod_stamp {
+	uint64_t mtime;
+	uint64_t nlink;
+	char path[];
+};
+
+static bool should_skip_stamp_dir(const char *name)
+{
+	/* same as depfile_up_to_date_dir() */
+	if (name[0] == '.' && (name[1] == '\0' ||
+			(name[1] == '.' && name[2] == '\0')))
+		return true;
+
+	return streq(name, "build") || streq(name, "source");
+}
+
+static int depmod_stamps_add(struct depmod *depmod, const char *path,
+				size_t len, const struct stat *st)
+{
+	struct depmod_stamp *stamp;
+
+	stamp = malloc(sizeof(*stamp) + len + 1);
+	if (stamp == NULL)
+		return -ENOMEM;
+
+	stamp->mtime = stat_mstamp(st);
+	stamp->nlink = st->st_nlink;
+	memcpy(stamp->path, path, len);
+	stamp->path[len] = '\0';
+
+	if (array_append(&depmod->stamps, stamp) < 0) {
+		free(stamp);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* takes ownership of @fd, a directory whose path is in @s_path */
+static int depmod_stamps_scan_dir(struct depmod *depmod, int fd,
+				  struct scratchbuf *s_path, size_t len)
+{
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+	int err;
+
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	err = depmod_stamps_add(depmod, scratchbuf_str(s_path), len, &st);
+	if (err < 0) {
+		close(fd);
+		return err;
+	}
+
+	d = fdopendir(fd);
+	if (d == NULL) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		const char *name = de->d_name;
+		size_t namelen, sublen;
+		char *path;
+		int subfd;
+
+		/* only directories matter, d_type spares stat()'ing modules */
+		if (de->d_type == DT_REG || should_skip_stamp_dir(name))
+			continue;
+
+		subfd = openat(dirfd(d), name,
+				O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (subfd < 0) {
+			if (errno == ENOTDIR || errno == ENOENT)
+				continue;
+			err = -errno;
+			break;
+		}
+
+		namelen = strlen(name);
+		if (scratchbuf_alloc(s_path, len + namelen + 2) < 0) {
+			close(subfd);
+			err = -ENOMEM;
+			break;
+		}
+
+		path = scratchbuf_str(s_path);
+		sublen = len;
+		if (sublen > 0)
+			path[sublen++] = '/';
+		memcpy(path + sublen, name, namelen + 1);
+
+		err = depmod_stamps_scan_dir(depmod, subfd, s_path,
+					     sublen + namelen);
+		if (err < 0)
+			break;
+	}
+
+	closedir(d);
+	return err;
+}
+
+/*
+ * Done before the modules are searched: a change made while depmod runs
+ * is then noticed by the next depmod -A.
+ */
+static void depmod_stamps_scan(struct depmod *depmod)
+{
+	const char *dirname = depmod->cfg->dirname;
+	char buf[256];
+	_cleanup_(scratchbuf_release) struct scratchbuf s_path =
+		SCRATCHBUF_INITIALIZER(buf);
+	int fd, err;
+
+	array_init(&depmod->stamps, 64);
+
+	fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	scratchbuf_str(&s_path)[0] = '\0';
+	err = depmod_stamps_scan_dir(depmod, fd, &s_path, 0);
+	if (err < 0) {
+		DBG("not writing %s: %s\n", DEPMOD_STAMP_FILE, strerror(-err));
+		depmod_stamps_free(depmod);
+	}
+}
+
+static void depmod_stamps_write(const struct depmod *depmod)
+{
+	const char *dname = depmod->cfg->outdirname;
+	char tmp[NAME_MAX];
+	uint64_t stamp[3];
+	struct stat st;
+	FILE *fp;
+	size_t i;
+	int dfd;
+
+	if (depmod->stamps.count == 0)
+		return;
+
+	dfd = open(dname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0)
+		return;
+
+	if (fstatat(dfd, "modules.dep", &st, 0) < 0)
+		goto out;
+
+	fp = depmod_cache_create(dfd, DEPMOD_STAMP_FILE, DEPMOD_STAMP_MAGIC,
+									tmp);
+	if (fp == NULL)
+		goto out;
+
+	stamp[0] = st.st_ino;
+	stamp[1] = st.st_size;
+	stamp[2] = stat_mstamp(&st);
+	cache_write(fp, stamp, sizeof(stamp));
+
+	for (i = 0; i < depmod->stamps.count; i++) {
+		const struct depmod_stamp *s = depmod->stamps.array[i];
+
+		cache_write_str(fp, s->path);
+		cache_write(fp, &s->mtime, sizeof(s->mtime));
+		cache_write(fp, &s->nlink, sizeof(s->nlink));
+	}
+
+	depmod_cache_commit(dfd, fp, tmp, DEPMOD_STAMP_FILE);
+out:
+	close(dfd);
+}
+
+/* read everything needed from the module file: doesn't touch depmod */
+static void depmod_load_module(const struct depmod_cache *cache,
+							struct mod *mod)
+{
+	struct kmod_module_lists lists;
+	struct stat st;
+
+	/* modules found by the search were already stat()'ed */
+	if (!mod->cacheable && stat(mod->path, &st) == 0)
+		mod_set_stamp(mod, &st);
+
+	if (depmod_cache_load(cache, mod))
+		goto done;
+	if (depmod_shared_load(cache->shared, mod))
+		goto shared;
+
+	/* nothing in the indexes comes from the signature */
+	kmod_module_get_lists(mod->kmod, KMOD_MODULE_LIST_INFO |
+					KMOD_MODULE_LIST_INFO_NO_SIGNATURE |
+					KMOD_MODULE_LIST_SYMBOLS |
+					KMOD_MODULE_LIST_DEPENDENCY_SYMBOLS,
+					&lists);
+	mod->info_list = lists.info;
+	mod->sym_list = lists.symbols;
+	mod->sym_err = lists.symbols_ret;
+	mod->dep_sym_list = lists.dependency_symbols;
+	mod->read_size = kmod_module_get_file_size(mod->kmod);
+
+	/* don't remember failures that may not happen next time */
+	if ((mod->sym_err < 0 && mod->sym_err != -ENODATA) ||
+			lists.info_ret < 0 ||
+			(lists.dependency_symbols_ret < 0 &&
+			 lists.dependency_symbols_ret != -ENODATA))
+		mod->cacheable = false;
+
+done:
+	depmod_shared_store(cache->shared, mod);
+shared:
+	kmod_module_unref(mod->kmod);
+	mod->kmod = NULL;
+}
+
+static void depmod_add_module_symbols(struct depmod *depmod, struct mod *mod)
+{
+	struct kmod_list *l;
+
+	if (mod->sym_err < 0) {
+		if (mod->sym_err == -ENODATA)
+			DBG("ignoring %s: no symbols\n", mod->path);
+		else
+			ERR("failed to load symbols from %s: %s\n",
+					mod->path, strerror(-mod->sym_err));
+		return;
+	}
+
+	kmod_list_foreach(l, mod->sym_list) {
+		const char *name = kmod_module_symbol_get_symbol(l);
+		uint64_t crc = kmod_module_symbol_get_crc(l);
+		depmod_symbol_add(depmod, name, false, crc, mod);
+	}
+	kmod_module_symbols_free_list(mod->sym_list);
+	mod->sym_list = NULL;
+}
+
+struct depmod_loader {
+	const struct depmod_cache *cache;
+	struct mod **mods;
+	size_t count;
+	size_t next;
+};
+
+static void *depmod_load_worker(void *data)
+{
+	struct depmod_loader *loader = data;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&loader->next, 1, __ATOMIC_RELAXED))
+							< loader->count)
+		depmod_load_module(loader->cache, loader->mods[i]);
+
+	return NULL;
+}
+
+/*
+ * Open, decompress and parse the modules from @jobs threads, the calling
+ * one included. libkmod is safe to use from several threads as long as
+ * each module is only handled by one of them.
+ */
+static void depmod_load_modules_parallel(struct depmod *depmod,
+							unsigned int jobs)
+{
+	struct depmod_loader loader = {
+		.cache = &depmod->cache,
+		.mods = (struct mod **)depmod->modules.array,
+		.count = depmod->modules.count,
+	};
+	pthread_t *threads;
+	unsigned int i, n = 0;
+
+	threads = malloc(sizeof(*threads) * (jobs - 1));
+	if (threads != NULL) {
+		for (; n < jobs - 1; n++) {
+			if (pthread_create(&threads[n], NULL,
+					   depmod_load_worker, &loader) != 0) {
+				WRN("could not start thread, using %u: %m\n",
+				    n + 1);
+				break;
+			}
+		}
+	}
+
+	depmod_load_worker(&loader);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+/* threads for a pass over all the modules: -j, but not more than modules */
+static unsigned int depmod_jobs(const struct depmod *depmod)
+{
+	unsigned int jobs = depmod->cfg->jobs;
+
+	if (jobs == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		jobs = n > 0 ? (unsigned int) n : 1;
+	}
+	if (jobs > depmod->modules.count)
+		jobs = depmod->modules.count;
+
+	return jobs;
+}
+
+/*
+ * Symbols are added in the order of depmod->modules either way, so that
+ * which module wins a symbol exported twice, and so the output, doesn't
+ * depend on the number of jobs.
+ */
+static int depmod_load_modules(struct depmod *depmod)
+{
+	const char *dname = depmod->cfg->outdirname;
+	struct mod **itr, **itr_end;
+	unsigned int jobs;
+	char tmp[NAME_MAX];
+	FILE *cache_fp = NULL;
+	int dfd = -1;
+
+	DBG("load symbols (%zd modules)\n", depmod->modules.count);
+
+	depmod_cache_open(&depmod->cache, dname);
+
+	if (depmod->update_cache && mkdir_p(dname, strlen(dname), 0755) == 0)
+		dfd = open(dname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd >= 0)
+		cache_fp = depmod_cache_create(dfd, DEPMOD_CACHE_FILE,
+						DEPMOD_CACHE_MAGIC, tmp);
+
+	jobs = depmod_jobs(depmod);
+	if (jobs > 1)
+		depmod_load_modules_parallel(depmod, jobs);
+
+	itr = (struct mod **)depmod->modules.array;
+	itr_end = itr + depmod->modules.count;
+	for (; itr < itr_end; itr++) {
+		struct mod *mod = *itr;
+
+		if (jobs <= 1)
+			depmod_load_module(&depmod->cache, mod);
+		if (mod->read_size > 0) {
+			depmod->stats.modules_read++;
+			depmod->stats.bytes_read += mod->read_size;
+		}
+		if (cache_fp != NULL && mod->cacheable)
+			depmod_cache_write_record(cache_fp, mod);
+		depmod_add_module_symbols(depmod, mod);
+	}
+
+	depmod_cache_close(&depmod->cache);
+	if (cache_fp != NULL)
+		depmod_cache_commit(dfd, cache_fp, tmp, DEPMOD_CACHE_FILE);
+	if (dfd >= 0)
+		close(dfd);
+
+	DBG("loaded symbols (%zd modules, %u symbols)\n",
+	    depmod->modules.count, hash_get_count(depmod->symbols));
+
+	return 0;
+}
+
+/*
+ * What resolving the dependencies of a module reports, with -e and -v.
+ * When modules are resolved in parallel each one keeps its notes, and they
+ * are printed afterwards in the order of depmod->modules, the same as a
+ * single thread prints them.
+ */
+enum dep_note_type {
+	DEP_NOTE_UNKNOWN,
+	DEP_NOTE_VERSION,
+	DEP_NOTE_NEEDS,
+};
+
+struct dep_note {
+	enum dep_note_type type;
+	const char *name;
+	const struct symbol *sym;
+};
+
+static void dep_note_print(const struct mod *mod, const struct dep_note *n)
+{
+	switch (n->type) {
+	case DEP_NOTE_UNKNOWN:
+		WRN("%s needs unknown symbol %s\n", mod->path, n->name);
+		break;
+	case DEP_NOTE_VERSION:
+		WRN("%s disagrees about version of symbol %s\n", mod->path,
+								n->name);
+		break;
+	case DEP_NOTE_NEEDS:
+		SHOW("%s needs \"%s\": %s\n", mod->path, n->sym->name,
+						n->sym->owner->path);
+		break;
+	}
+}
+
+/* print it right away without @notes, or append it there */
+static void dep_note_add(struct array *notes, const struct mod *mod,
+			 enum dep_note_type type, const char *name,
+			 const struct symbol *sym)
+{
+	struct dep_note *n, note = { type, name, sym };
+
+	if (notes == NULL) {
+		dep_note_print(mod, &note);
+		return;
+	}
+
+	n = malloc(sizeof(*n));
+	if (n != NULL) {
+		*n = note;
+		if (array_append(notes, n) >= 0)
+			return;
+		free(n);
+	}
+	/* out of order is still better than lost */
+	dep_note_print(mod, &note);
+}
+
+static void dep_notes_flush(struct array *notes, const struct mod *mod)
+{
+	size_t i;
+
+	for (i = 0; i < notes->count; i++) {
+		dep_note_print(mod, notes->array[i]);
+		free(notes->array[i]);
+	}
+	array_free_array(notes);
+}
+
+static int depmod_load_module_dependencies(struct depmod *depmod,
+					struct mod *mod, struct array *notes)
+{
+	const struct cfg *cfg = depmod->cfg;
+	struct kmod_list *l;
+
+	DBG("do dependencies of %s\n", mod->path);
+	kmod_list_foreach(l, mod->dep_sym_list) {
+		const char *name = kmod_module_dependency_symbol_get_symbol(l);
+		uint64_t crc = kmod_module_dependency_symbol_get_crc(l);
+		int bindtype = kmod_module_dependency_symbol_get_bind(l);
+		struct symbol *sym = depmod_symbol_find(depmod, name);
+		uint8_t is_weak = bindtype == KMOD_SYMBOL_WEAK;
+
+		if (sym == NULL) {
+			DBG("%s needs (%c) unknown symbol %s\n",
+			    mod->path, bindtype, name);
+			if (cfg->print_unknown && !is_weak)
+				dep_note_add(notes, mod, DEP_NOTE_UNKNOWN,
+								name, NULL);
+			continue;
+		}
+
+		if (cfg->check_symvers && sym->crc != crc && !is_weak) {
+			DBG("symbol %s (%#"PRIx64") module %s (%#"PRIx64")\n",
+			    sym->name, sym->crc, mod->path, crc);
+			if (cfg->print_unknown)
+				dep_note_add(notes, mod, DEP_NOTE_VERSION,
+								name, sym);
+		}
+
+		if (mod_add_dependency(mod, sym) > 0 &&
+						verbose > DEFAULT_VERBOSE)
+			dep_note_add(notes, mod, DEP_NOTE_NEEDS, name, sym);
+	}
+
+	return 0;
+}
+
+struct depmod_resolver {
+	struct depmod *depmod;
+	struct mod **mods;
+	struct array *notes;
+	size_t count;
+	size_t next;
+};
+
+static void *depmod_resolve_worker(void *data)
+{
+	struct depmod_resolver *resolver = data;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&resolver->next, 1, __ATOMIC_RELAXED))
+							< resolver->count) {
+		struct mod *mod = resolver->mods[i];
+
+		if (mod->dep_sym_list != NULL)
+			depmod_load_module_dependencies(resolver->depmod, mod,
+							&resolver->notes[i]);
+	}
+
+	return NULL;
+}
+
+/*
+ * Resolve the modules from @jobs threads, the calling one included: this
+ * only reads the symbols, each module's dependencies are its own and the
+ * counts of users are atomic. The order of the dependencies of a module is
+ * that of its symbols either way, depmod_sort_dependencies() fixes it up.
+ */
+static bool depmod_load_dependencies_parallel(struct depmod *depmod,
+							unsigned int jobs)
+{
+	struct depmod_resolver resolver = {
+		.depmod = depmod,
+		.mods = (struct mod **)depmod->modules.array,
+		.count = depmod->modules.count,
+	};
+	pthread_t *threads;
+	unsigned int n = 0;
+	size_t i;
+
+	resolver.notes = malloc(sizeof(*resolver.notes) * resolver.count);
+	threads = malloc(sizeof(*threads) * (jobs - 1));
+	if (resolver.notes == NULL || threads == NULL) {
+		free(resolver.notes);
+		free(threads);
+		return false;
+	}
+
+	for (i = 0; i < resolver.count; i++)
+		array_init(&resolver.notes[i], 4);
+
+	for (; n < jobs - 1; n++) {
+		if (pthread_create(&threads[n], NULL, depmod_resolve_worker,
+							&resolver) != 0) {
+			WRN("could not start thread, using %u: %m\n", n + 1);
+			break;
+		}
+	}
+
+	depmod_resolve_worker(&resolver);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	for (i = 0; i < resolver.count; i++)
+		dep_notes_flush(&resolver.notes[i], resolver.mods[i]);
+	free(resolver.notes);
+
+	return true;
+}
+
+static int depmod_load_dependencies(struct depmod *depmod)
+{
+	struct mod **itr, **itr_end;
+	unsigned int jobs;
+
+	DBG("load dependencies (%zd modules, %u symbols)\n",
+	    depmod->modules.count, hash_get_count(depmod->symbols));
+
+	jobs = depmod_jobs(depmod);
+	if (jobs > 1 && depmod_load_dependencies_parallel(depmod, jobs))
+		goto done;
+
+	itr = (struct mod **)depmod->modules.array;
+	itr_end = itr + depmod->modules.count;
+	for (; itr < itr_end; itr++) {
+		struct mod *mod = *itr;
+
+		if (mod->dep_sym_list == NULL) {
+			DBG("ignoring %s: no dependency symbols\n", mod->path);
+			continue;
+		}
+
+		depmod_load_module_dependencies(depmod, mod, NULL);
+	}
+
+done:
+	DBG("loaded dependencies (%zd modules, %u symbols)\n",
+	    depmod->modules.count, hash_get_count(depmod->symbols));
+
+	return 0;
+}
+
+static int dep_cmp(const void *pa, const void *pb)
+{
+	const struct mod *a = *(const struct mod **)pa;
+	const struct mod *b = *(const struct mod **)pb;
+	return a->dep_sort_idx - b->dep_sort_idx;
+}
+
+static void depmod_sort_dependencies(struct depmod *depmod)
+{
+	struct mod **itr, **itr_end;
+	itr = (struct mod **)depmod->modules.array;
+	itr_end = itr + depmod->modules.count;
+	for (; itr < itr_end; itr++) {
+		struct mod *m = *itr;
+		if (m->deps.count > 1)
+			array_sort(&m->deps, dep_cmp);
+	}
+}
+
+struct vertex {
+	struct vertex *parent;
+	struct mod *mod;
+};
+
+static struct vertex *vertex_new(struct mod *mod, struct vertex *parent)
+{
+	struct vertex *v;
+
+	v = malloc(sizeof(*v));
+	if (v == NULL)
+		return NULL;
+
+	v->parent = parent;
+	v->mod = mod;
+	return v;
+}
+
+static void depmod_list_remove_data(struct kmod_list **list, void *data)
+{
+	struct kmod_list *l;
+
+	l = kmod_list_remove_data(*list, data);
+	*list = l;
+}
+
+static int depmod_report_one_cycle(struct depmod *depmod,
+				   struct vertex *vertex,
+				   struct kmod_list **roots,
+				   struct hash *loop_set)
+{
+	const char sep[] = " -> ";
+	size_t sz;
+	char *buf;
+	struct array reverse;
+	int i;
+	int n;
+	struct vertex *v;
+	int rc;
+
+	array_init(&reverse, 3);
+
+	sz = 0;
+	for (v = vertex->parent, n = 0;
+	     v != NULL;
+	     v = v->parent, n++) {
+
+		sz += v->mod->modnamesz - 1;
+		array_append(&reverse, v);
+		rc = hash_add(loop_set, v->mod->modname, NULL);
+		if (rc != 0)
+			return rc;
+		/* the hash will be freed where created */
+	}
+	sz += vertex->mod->modnamesz - 1;
+
+	buf = malloc(sz + n * strlen(sep) + 1);
+
+	sz = 0;
+	for (i = reverse.count - 1; i >= 0; i--) {
+		size_t len;
+
+		v = reverse.array[i];
+
+		len = v->mod->modnamesz - 1;
+		memcpy(buf + sz, v->mod->modname, len);
+		sz += len;
+		strcpy(buf + sz, sep);
+		sz += strlen(sep);
+
+		depmod_list_remove_data(roots, v->mod);
+	}
+	strcpy(buf + sz, vertex->mod->modname);
+	ERR("Cycle detected: %s\n", buf);
+
+	free(buf);
+	array_free_array(&reverse);
+
+	return 0;
+}
+
+static int depmod_report_cycles_from_root(struct depmod *depmod,
+					  struct mod *root_mod,
+					  struct kmod_list **roots,
+					  void **stack,
+					  size_t stack_size,
+					  struct hash *loop_set)
+{
+	struct kmod_list *free_list = NULL; /* struct vertex */
+	struct kmod_list *l;
+	struct vertex *root;
+	struct vertex *vertex;
+	struct vertex *v;
+	struct mod *m;
+	struct mod **itr, **itr_end;
+	size_t is;
+	int ret = -ENOMEM;
+
+	root = vertex_new(root_mod, NULL);
+	if (root == NULL) {
+		ERR("No memory to report cycles\n");
+		goto out;
+	}
+
+	l = kmod_list_append(free_list, root);
+	if (l == NULL) {
+		ERR("No memory to report cycles\n");
+		goto out;
+	}
+	free_list = l;
+
+	is = 0;
+	stack[is++] = (void *)root;
+
+	while (is > 0) {
+		vertex = stack[--is];
+		m = vertex->mod;
+		/*
+		 * because of the topological sort we can start only
+		 * from part of a loop or from a branch after a loop
+		 */
+		if (m->visited && m == root->mod) {
+			int rc;
+			rc = depmod_report_one_cycle(depmod, vertex,
+						     roots, loop_set);
+			if (rc != 0) {
+				ret = rc;
+				goto out;
+			}
+			continue;
+		}
+
+		m->visited = true;
+		if (m->deps.count == 0) {
+			/*
+			 * boundary condition: if there is more than one
+			 * single node branch (not a loop), it is
+			 * recognized as a loop by the code above:
+			 * m->visited because more then one,
+			 * m == root->mod since it is a single node.
+			 * So, prevent deeping into the branch second
+			 * time.
+			 */
+			depmod_list_remove_data(roots, m);
+
+			continue;
+		}
+
+		itr = (struct mod **) m->deps.array;
+		itr_end = itr + m->deps.count;
+		for (; itr < itr_end; itr++) {
+			struct mod *dep = *itr;
+			v = vertex_new(dep, vertex);
+			if (v == NULL) {
+				ERR("No memory to report cycles\n");
+				goto out;
+			}
+			assert(is < stack_size);
+			stack[is++] = v;
+
+			l = kmod_list_append(free_list, v);
+			if (l == NULL) {
+				ERR("No memory to report cycles\n");
+				goto out;
+			}
+			free_list = l;
+
+		}
+	}
+	ret = 0;
+
+out:
+	while (free_list) {
+		v = free_list->data;
+		l = kmod_list_remove(free_list);
+		free_list = l;
+		free(v);
+	}
+
+	return ret;
+}
+
+static void depmod_report_cycles(struct depmod *depmod, uint16_t n_mods,
+				 uint16_t *users)
+{
+	int num_cyclic = 0;
+	struct kmod_list *roots = NULL; /* struct mod */
+	struct kmod_list *l;
+	size_t n_r; /* local n_roots */
+	int i;
+	int err;
+	_cleanup_free_ void **stack = NULL;
+	struct mod *m;
+	struct mod *root;
+	struct hash *loop_set;
+
+	for (i = 0, n_r = 0; i < n_mods; i++) {
+		if (users[i] <= 0)
+			continue;
+		m = depmod->modules.array[i];
+		l = kmod_list_append(roots, m);
+		if (l == NULL) {
+			ERR("No memory to report cycles\n");
+			goto out_list;
+		}
+		roots = l;
+		n_r++;
+	}
+
+	stack = malloc(n_r * sizeof(void *));
+	if (stack == NULL) {
+		ERR("No memory to report cycles\n");
+		goto out_list;
+	}
+
+	loop_set = hash_new(16, NULL);
+	if (loop_set == NULL) {
+		ERR("No memory to report cycles\n");
+		goto out_list;
+	}
+
+	while (roots != NULL) {
+		root = roots->data;
+		l = kmod_list_remove(roots);
+		roots = l;
+		err = depmod_report_cycles_from_root(depmod,
+						     root,
+						     &roots,
+						     stack, n_r, loop_set);
+		if (err < 0)
+			goto out_hash;
+	}
+
+	num_cyclic = hash_get_count(loop_set);
+	ERR("Found %d modules in dependency cycles!\n", num_cyclic);
+
+out_hash:
+	hash_free(loop_set);
+out_list:
+	while (roots != NULL) {
+		/* no need to free data, come from outside */
+		roots = kmod_list_remove(roots);
+	}
+}
+
+/*
+ * Fill mod->all_deps for every module, walking them in reverse topological
+ * order so the closure of each direct dependency is already known and the
+ * closure of a module is only the union of those. The union is done on a
+ * bitset of sort positions, so reading it back in order also sorts it.
+ */
+static int depmod_calculate_all_dependencies(struct depmod *depmod,
+					     const uint16_t *sorted)
+{
+	uint16_t n_mods = depmod->modules.count;
+	size_t n_words = (n_mods + 63) / 64;
+	const struct mod **deps;
+	uint64_t *seen;
+	size_t i;
+
+	seen = calloc(n_words, sizeof(uint64_t));
+	deps = malloc(sizeof(struct mod *) * n_mods);
+	if (seen == NULL || deps == NULL) {
+		free(seen);
+		free(deps);
+		return -ENOMEM;
+	}
+
+	for (i = n_mods; i-- > 0;) {
+		struct mod *m = depmod->modules.array[sorted[i]];
+		size_t j, k, w, n = 0;
+
+		if (m->deps.count == 0)
+			continue;
+
+		for (j = 0; j < m->deps.count; j++) {
+			const struct mod *d = m->deps.array[j];
+
+			seen[d->dep_sort_idx / 64] |= 1ULL << (d->dep_sort_idx % 64);
+			for (k = 0; k < d->n_all_deps; k++) {
+				int pos = d->all_deps[k]->dep_sort_idx;
+
+				seen[pos / 64] |= 1ULL << (pos % 64);
+			}
+		}
+
+		/* dependencies always sort after their users */
+		for (w = i / 64; w < n_words; w++) {
+			while (seen[w]) {
+				size_t pos = w * 64 + __builtin_ctzll(seen[w]);
+
+				seen[w] &= seen[w] - 1;
+				deps[n++] = depmod->modules.array[sorted[pos]];
+			}
+		}
+
+		m->all_deps = arena_memdup(&depmod->arena, deps,
+					   sizeof(struct mod *) * n);
+		if (m->all_deps == NULL) {
+			free(seen);
+			free(deps);
+			return -ENOMEM;
+		}
+		m->n_all_deps = n;
+	}
+
+	free(seen);
+	free(deps);
+
+	return 0;
+}
+
+static int depmod_calculate_dependencies(struct depmod *depmod)
+{
+	const struct mod **itrm;
+	uint16_t *users, *roots, *sorted;
+	uint16_t i, n_roots = 0, n_sorted = 0, n_mods = depmod->modules.count;
+	int ret = 0;
+
+	users = malloc(sizeof(uint16_t) * n_mods * 3);
+	if (users == NULL)
+		return -ENOMEM;
+	roots = users + n_mods;
+	sorted = roots + n_mods;
+
+	DBG("calculate dependencies and ordering (%hu modules)\n", n_mods);
+
+	assert(depmod->modules.count < UINT16_MAX);
+
+	/* populate modules users (how many modules uses it) */
+	itrm = (const struct mod **)depmod->modules.array;
+	for (i = 0; i < n_mods; i++, itrm++) {
+		const struct mod *m = *itrm;
+		users[i] = m->users;
+		if (users[i] == 0) {
+			roots[n_roots] = i;
+			n_roots++;
+		}
+	}
+
+	/* topological sort (outputs modules without users first) */
+	while (n_roots > 0) {
+		const struct mod **itr_dst, **itr_dst_end;
+		struct mod *src;
+		uint16_t src_idx = roots[--n_roots];
+
+		src = depmod->modules.array[src_idx];
+		src->dep_sort_idx = n_sorted;
+		sorted[n_sorted] = src_idx;
+		n_sorted++;
+
+		itr_dst = (const struct mod **)src->deps.array;
+		itr_dst_end = itr_dst + src->deps.count;
+		for (; itr_dst < itr_dst_end; itr_dst++) {
+			const struct mod *dst = *itr_dst;
+			uint16_t dst_idx = dst->idx;
+			assert(users[dst_idx] > 0);
+			users[dst_idx]--;
+			if (users[dst_idx] == 0) {
+				roots[n_roots] = dst_idx;
+				n_roots++;
+			}
+		}
+	}
+
+	if (n_sorted < n_mods) {
+		depmod_report_cycles(depmod, n_mods, users);
+		ret = -EINVAL;
+		goto exit;
+	}
+
+	depmod_sort_dependencies(depmod);
+
+	ret = depmod_calculate_all_dependencies(depmod, sorted);
+	if (ret < 0)
+		goto exit;
+
+	DBG("calculated dependencies and ordering (%hu modules)\n", n_mods);
+
+exit:
+	free(users);
+	return ret;
+}
+
+static int depmod_load(struct depmod *depmod)
+{
+	int err;
+
+	stats_start(&depmod->stats.load, CLOCK_PROCESS_CPUTIME_ID);
+	err = depmod_load_modules(depmod);
+	stats_stop(&depmod->stats.load, CLOCK_PROCESS_CPUTIME_ID);
+	if (err < 0)
+		return err;
+
+	stats_start(&depmod->stats.deps, CLOCK_PROCESS_CPUTIME_ID);
+	err = depmod_load_dependencies(depmod);
+	if (err >= 0)
+		err = depmod_calculate_dependencies(depmod);
+	stats_stop(&depmod->stats.deps, CLOCK_PROCESS_CPUTIME_ID);
+	if (err < 0)
+		return err;
+
+	return 0;
+}
+
+static inline const char *mod_get_compressed_path(const struct mod *mod)
+{
+	if (mod->relpath != NULL)
+		return mod->relpath;
+	return mod->path;
+}
+
+static int output_deps(struct depmod *depmod, FILE *out)
+{
+	size_t i;
+
+	for (i = 0; i < depmod->modules.count; i++) {
+		const struct mod *mod = depmod->modules.array[i];
+		size_t j;
+
+		fprintf(out, "%s:", mod_get_compressed_path(mod));
+
+		for (j = 0; j < mod->n_all_deps; j++) {
+			const struct mod *d = mod->all_deps[j];
+			fprintf(out, " %s", mod_get_compressed_path(d));
+		}
+
+		putc('\n', out);
+	}
+
+	return 0;
+}
+
+/* the line of @mod in modules.dep, without the end of line */
+static char *mod_dep_line(const struct mod *mod)
+{
+	const struct mod **deps = mod->all_deps;
+	const char *p = mod_get_compressed_path(mod);
+	size_t j, n_deps = mod->n_all_deps;
+	size_t linepos, linelen, slen;
+	char *line;
+
+	linelen = strlen(p) + 1;
+	for (j = 0; j < n_deps; j++) {
+		const struct mod *d = deps[j];
+		linelen += 1 + strlen(mod_get_compressed_path(d));
+	}
+
+	line = malloc(linelen + 1);
+	if (line == NULL)
+		return NULL;
+
+	linepos = 0;
+	slen = strlen(p);
+	memcpy(line + linepos, p, slen);
+	linepos += slen;
+	line[linepos] = ':';
+	linepos++;
+
+	for (j = 0; j < n_deps; j++) {
+		const struct mod *d = deps[j];
+		const char *dp;
+
+		line[linepos] = ' ';
+		linepos++;
+
+		dp = mod_get_compressed_path(d);
+		slen = strlen(dp);
+		memcpy(line + linepos, dp, slen);
+		linepos += slen;
+	}
+	line[linepos] = '\0';
+
+	return line;
+}
+
+/*
+ * With --delta, the modules whose lines in modules.dep, modules.alias or
+ * modules.symbols are not the same as in the files of the last full run,
+ * which the base indexes were written from too: only those are in the
+ * delta indexes. The lines of each module are compared once sorted, so
+ * the order doesn't matter.
+ */
+struct delta_mod {
+	struct array base; /* of the module in the text files in place */
+	struct array now; /* and the lines it has in them now */
+	bool changed;
+	bool removed; /* only in the files in place */
+	char name[];
+};
+
+static void delta_mod_free_lines(struct delta_mod *m)
+{
+	size_t i;
+
+	for (i = 0; i < m->base.count; i++)
+		free(m->base.array[i]);
+	for (i = 0; i < m->now.count; i++)
+		free(m->now.array[i]);
+	array_free_array(&m->base);
+	array_free_array(&m->now);
+}
+
+static void delta_mod_free(void *data)
+{
+	struct delta_mod *m = data;
+
+	delta_mod_free_lines(m);
+	free(m);
+}
+
+/* add @line, prefixed with the file it's from, to the lines of @modname */
+static int delta_add_line(struct hash *mods, const char *modname, bool now,
+					char file, const char *fmt, ...)
+{
+	struct delta_mod *m = hash_find(mods, modname);
+	va_list args;
+	char *line;
+	int err;
+
+	if (m == NULL) {
+		size_t namelen = strlen(modname) + 1;
+
+		m = calloc(1, sizeof(*m) + namelen);
+		if (m == NULL)
+			return -ENOMEM;
+		memcpy(m->name, modname, namelen);
+		array_init(&m->base, 16);
+		array_init(&m->now, 16);
+
+		err = hash_add(mods, m->name, m);
+		if (err < 0) {
+			free(m);
+			return err;
+		}
+	}
+
+	va_start(args, fmt);
+	err = vasprintf(&line, fmt, args);
+	va_end(args);
+	if (err < 0)
+		return -ENOMEM;
+	line[0] = file;
+
+	err = array_append(now ? &m->now : &m->base, line);
+	if (err < 0) {
+		free(line);
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+ * The lines of modules.dep are keyed by the name of the module in their
+ * path, those of modules.alias and modules.symbols by the module at their
+ * end.
+ */
+static int delta_read_base(struct depmod *depmod, struct hash *mods,
+				int dfd, const char *fn, char file)
+{
+	const char *dname = depmod->cfg->outdirname;
+	struct line_reader r;
+	char *line;
+	int fd, err;
+
+	fd = openat(dfd, fn, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		err = -errno;
+		ERR("--delta needs the files of a full run: %s/%s: %m\n",
+								dname, fn);
+		return err;
+	}
+
+	err = line_reader_open(&r, fd);
+	close(fd);
+	if (err < 0) {
+		ERR("could not read %s/%s: %s\n", dname, fn, strerror(-err));
+		return err;
+	}
+
+	while ((line = line_reader_next(&r, NULL)) != NULL) {
+		char buf[PATH_MAX];
+		const char *modname;
+		char *p;
+
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+
+		if (file == 'd') {
+			p = strchr(line, ':');
+			if (p == NULL)
+				continue;
+			*p = '\0';
+			modname = path_to_modname(line, buf, NULL);
+			*p = ':';
+		} else {
+			p = strrchr(line, ' ');
+			modname = p != NULL ? p + 1 : NULL;
+		}
+		if (modname == NULL)
+			continue;
+
+		err = delta_add_line(mods, modname, false, file, " %s", line);
+		if (err < 0)
+			break;
+	}
+
+	line_reader_close(&r);
+
+	return err;
+}
+
+static int delta_add_current(struct depmod *depmod, struct hash *mods)
+{
+	struct hash_iter iter;
+	const void *v;
+	size_t i;
+	int err;
+
+	for (i = 0; i < depmod->modules.count; i++) {
+		const struct mod *mod = depmod->modules.array[i];
+		struct kmod_list *l;
+		char *line;
+
+		line = mod_dep_line(mod);
+		if (line == NULL)
+			return -ENOMEM;
+		err = delta_add_line(mods, mod->modname, true, 'd', " %s",
+									line);
+		free(line);
+		if (err < 0)
+			return err;
+
+		kmod_list_foreach(l, mod->info_list) {
+			if (!streq(kmod_module_info_get_key(l), "alias"))
+				continue;
+
+			err = delta_add_line(mods, mod->modname, true, 'a',
+					" alias %s %s",
+					kmod_module_info_get_value(l),
+					mod->modname);
+			if (err < 0)
+				return err;
+		}
+	}
+
+	hash_iter_init(depmod->symbols, &iter);
+	while (hash_iter_next(&iter, NULL, &v)) {
+		const struct symbol *sym = v;
+
+		if (sym->owner == NULL)
+			continue;
+
+		err = delta_add_line(mods, sym->owner->modname, true, 's',
+				" alias symbol:%s %s", sym->name,
+				sym->owner->modname);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+static int delta_line_cmp(const void *pa, const void *pb)
+{
+	return strcmp(*(const char **)pa, *(const char **)pb);
+}
+
+static bool delta_mod_changed(struct delta_mod *m)
+{
+	size_t i;
+
+	if (m->base.count != m->now.count)
+		return true;
+
+	array_sort(&m->base, delta_line_cmp);
+	array_sort(&m->now, delta_line_cmp);
+
+	for (i = 0; i < m->base.count; i++) {
+		if (!streq(m->base.array[i], m->now.array[i]))
+			return true;
+	}
+
+	return false;
+}
+
+static int depmod_delta_scan(struct depmod *depmod)
+{
+	struct hash_iter iter;
+	unsigned int n = 0;
+	struct hash *mods;
+	const void *v;
+	int dfd, err;
+
+	dfd = open(depmod->cfg->outdirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0)
+		return -errno;
+
+	mods = hash_new(512, delta_mod_free);
+	if (mods == NULL) {
+		close(dfd);
+		return -ENOMEM;
+	}
+
+	err = delta_read_base(depmod, mods, dfd, "modules.dep", 'd');
+	if (err >= 0)
+		err = delta_read_base(depmod, mods, dfd, "modules.alias", 'a');
+	if (err >= 0)
+		err = delta_read_base(depmod, mods, dfd, "modules.symbols", 's');
+	close(dfd);
+	if (err >= 0)
+		err = delta_add_current(depmod, mods);
+	if (err < 0) {
+		hash_free(mods);
+		return err;
+	}
+
+	hash_iter_init(mods, &iter);
+	while (hash_iter_next(&iter, NULL, &v)) {
+		struct delta_mod *m = (struct delta_mod *) v;
+
+		m->changed = delta_mod_changed(m);
+		m->removed = m->changed && m->now.count == 0;
+		if (m->changed) {
+			DBG("%s changed since the last full run\n", m->name);
+			n++;
+		}
+		delta_mod_free_lines(m);
+	}
+
+	SHOW("%u modules changed since the last full run\n", n);
+	depmod->delta = mods;
+
+	return 0;
+}
+
+static bool mod_in_delta(const struct depmod *depmod, const struct mod *mod)
+{
+	const struct delta_mod *m = hash_find(depmod->delta, mod->modname);
 
-	return true;
+	return m != NULL && m->changed;
 }
 
-/* returns if existing module @mod is higher priority than newpath.
- * note this is the inverse of module-init-tools is_higher_priority()
+/*
+ * Write a trie of aliases or symbols: in compressed blocks with
+ * --compress-indexes, except for deltas that are small anyway.
  */
-static int depmod_module_is_higher_priority(const struct depmod *depmod, const struct mod *mod, size_t baselen, size_t namelen, size_t modnamelen, const char *newpath)
+static int index_write_trie(struct depmod *depmod, struct index *idx,
+				FILE *out, bool delta, bool matcher)
 {
-	const struct cfg *cfg = depmod->cfg;
-	const struct cfg_override *ov;
-	const struct cfg_search *se;
-	const struct cfg_external *ext;
+#ifdef ENABLE_ZLIB
+	if (depmod->cfg->compress && !delta)
+		return index_write_blocks(idx, out);
+#endif
+	index_write(idx, out, depmod->cfg->index_version, matcher);
 
-	/* baselen includes the last '/' and mod->baselen doesn't. So it's
-	 * actually correct to use modnamelen in the first and modnamesz in
-	 * the latter */
-	size_t newlen = baselen + modnamelen;
-	size_t oldlen = mod->baselen + mod->modnamesz;
-	const char *oldpath = mod->path;
-	int i, bprio = -1, oldprio = -1, newprio = -1;
-	size_t relnewlen = 0;
-	size_t reloldlen = 0;
-	const char *relnewpath = NULL;
-	const char *reloldpath = NULL;
+	return 0;
+}
 
-	DBG("comparing priorities of %s and %s\n",
-	    oldpath, newpath);
+/*
+ * With @delta, only the modules that changed: the ones that were removed
+ * get an empty line, so they are not found in the base index either.
+ */
+static int output_deps_index(struct depmod *depmod, FILE *out, bool delta)
+{
+	struct index *idx;
+	size_t i;
 
-	if (strncmp(newpath, cfg->dirname, cfg->dirnamelen) == 0) {
-		relnewpath = newpath + cfg->dirnamelen + 1;
-		relnewlen = newlen - (cfg->dirnamelen + 1);
+	if (out == stdout)
+		return 0;
+
+	idx = index_create();
+	if (idx == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < depmod->modules.count; i++) {
+		const struct mod *mod = depmod->modules.array[i];
+		char *line;
+		int duplicate;
+
+		if (delta && !mod_in_delta(depmod, mod))
+			continue;
+
+		line = mod_dep_line(mod);
+		if (line == NULL) {
+			ERR("modules.deps.bin: out of memory\n");
+			continue;
+		}
+
+		duplicate = index_insert(idx, mod->modname, line, mod->idx);
+		if (duplicate && depmod->cfg->warn_dups)
+			WRN("duplicate module deps:\n%s\n", line);
+		free(line);
 	}
-	if (strncmp(oldpath, cfg->dirname, cfg->dirnamelen) == 0) {
-		reloldpath = oldpath + cfg->dirnamelen + 1;
-		reloldlen = oldlen - (cfg->dirnamelen + 1);
+
+	if (delta) {
+		struct hash_iter iter;
+		const void *v;
+
+		hash_iter_init(depmod->delta, &iter);
+		while (hash_iter_next(&iter, NULL, &v)) {
+			const struct delta_mod *m = v;
+
+			if (m->removed)
+				index_insert(idx, m->name, "", 0);
+		}
 	}
 
-	for (ov = cfg->overrides; ov != NULL; ov = ov->next) {
-		DBG("override %s\n", ov->path);
-		if (relnewlen == ov->len &&
-		    memcmp(ov->path, relnewpath, relnewlen) == 0)
-			return 0;
-		if (reloldlen == ov->len &&
-		    memcmp(ov->path, reloldpath, reloldlen) == 0)
-			return 1;
+	index_write(idx, out, depmod->cfg->index_version, false);
+	index_destroy(idx);
+
+	return 0;
+}
+
+static int output_deps_bin(struct depmod *depmod, FILE *out)
+{
+	return output_deps_index(depmod, out, false);
+}
+
+static int output_deps_delta_bin(struct depmod *depmod, FILE *out)
+{
+	return output_deps_index(depmod, out, true);
+}
+
+static int mod_cmp_modname(const void *pa, const void *pb)
+{
+	const struct mod *a = *(const struct mod **)pa;
+	const struct mod *b = *(const struct mod **)pb;
+	int r = strcmp(a->modname, b->modname);
+
+	if (r != 0)
+		return r;
+
+	return (int) a->idx - (int) b->idx;
+}
+
+/*
+ * Same information as modules.dep.bin, with each module listed once in a
+ * table sorted by name and its dependencies as indexes in that table.
+ * A module found more than once is listed with its first path, as the one
+ * with the lowest priority in modules.dep.bin.
+ */
+static int output_deps_ids_bin(struct depmod *depmod, FILE *out)
+{
+	const struct mod **sorted;
+	uint32_t *ids, u, n = 0, offset, dep_offset, str_offset;
+	size_t i, j, count = depmod->modules.count;
+	uint64_t end;
+	int err = 0;
+
+	if (out == stdout)
+		return 0;
+
+	sorted = malloc(sizeof(*sorted) * count);
+	ids = malloc(sizeof(*ids) * count);
+	if (sorted == NULL || ids == NULL) {
+		err = -ENOMEM;
+		goto out;
 	}
 
-	for (i = 0, se = cfg->searches; se != NULL; se = se->next, i++) {
-		DBG("search %s\n", search_to_string(se));
-		if (se->type == SEARCH_BUILTIN)
-			bprio = i;
-		else if (se->type == SEARCH_EXTERNAL) {
-			for (ext = cfg->externals; ext != NULL; ext = ext->next, i++) {
-				if (depmod_is_path_starts_with(newpath,
-							       newlen,
-							       ext->path,
-							       ext->len))
-					newprio = i;
-				if (depmod_is_path_starts_with(oldpath,
-							       oldlen,
-							       ext->path,
-							       ext->len))
-					oldprio = i;
+	for (i = 0; i < count; i++)
+		sorted[i] = depmod->modules.array[i];
+	qsort(sorted, count, sizeof(*sorted), mod_cmp_modname);
+
+	/* modules are numbered after their name, duplicates share a number */
+	for (i = 0; i < count; i++) {
+		if (n > 0 && streq(sorted[n - 1]->modname, sorted[i]->modname)) {
+			ids[sorted[i]->idx] = n - 1;
+			continue;
+		}
+		ids[sorted[i]->idx] = n;
+		sorted[n++] = sorted[i];
+	}
+
+	dep_offset = 3 * sizeof(uint32_t) + n * 4 * sizeof(uint32_t);
+	end = dep_offset;
+	for (i = 0; i < n; i++)
+		end += sorted[i]->n_all_deps * sizeof(uint32_t);
+	str_offset = end;
+	for (i = 0; i < n; i++)
+		end += sorted[i]->modnamesz +
+			strlen(mod_get_compressed_path(sorted[i])) + 1;
+	if (end > UINT32_MAX) {
+		err = -EFBIG;
+		goto out;
+	}
+
+	u = htonl(INDEX_MODDEP_MAGIC);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(INDEX_MODDEP_VERSION);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(n);
+	fwrite(&u, sizeof(u), 1, out);
+
+	for (i = 0, offset = str_offset; i < n; i++) {
+		const struct mod *mod = sorted[i];
+
+		u = htonl(offset);
+		fwrite(&u, sizeof(u), 1, out);
+		offset += mod->modnamesz;
+		u = htonl(offset);
+		fwrite(&u, sizeof(u), 1, out);
+		offset += strlen(mod_get_compressed_path(mod)) + 1;
+		u = htonl(dep_offset);
+		fwrite(&u, sizeof(u), 1, out);
+		u = htonl(mod->n_all_deps);
+		fwrite(&u, sizeof(u), 1, out);
+		dep_offset += mod->n_all_deps * sizeof(uint32_t);
+	}
+
+	for (i = 0; i < n; i++) {
+		const struct mod *mod = sorted[i];
+
+		for (j = 0; j < mod->n_all_deps; j++) {
+			u = htonl(ids[mod->all_deps[j]->idx]);
+			fwrite(&u, sizeof(u), 1, out);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		const char *path = mod_get_compressed_path(sorted[i]);
+
+		fwrite(sorted[i]->modname, 1, sorted[i]->modnamesz, out);
+		fwrite(path, 1, strlen(path) + 1, out);
+	}
+
+out:
+	if (err < 0)
+		ERR("modules.dep.ids.bin: %s\n", strerror(-err));
+	free(sorted);
+	free(ids);
+	return err;
+}
+
+static int output_aliases(struct depmod *depmod, FILE *out)
+{
+	size_t i;
+
+	fputs("# Aliases extracted from modules themselves.\n", out);
+
+	for (i = 0; i < depmod->modules.count; i++) {
+		const struct mod *mod = depmod->modules.array[i];
+		struct kmod_list *l;
+
+		kmod_list_foreach(l, mod->info_list) {
+			const char *key = kmod_module_info_get_key(l);
+			const char *value = kmod_module_info_get_value(l);
+
+			if (!streq(key, "alias"))
+				continue;
+
+			fprintf(out, "alias %s %s\n", value, mod->modname);
+		}
+	}
+
+	return 0;
+}
+
+static int output_aliases_index(struct depmod *depmod, FILE *out, bool delta)
+{
+	struct index *idx;
+	size_t i;
+	int err;
+
+	if (out == stdout)
+		return 0;
+
+	idx = index_create();
+	if (idx == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < depmod->modules.count; i++) {
+		const struct mod *mod = depmod->modules.array[i];
+		struct kmod_list *l;
+
+		if (delta && !mod_in_delta(depmod, mod))
+			continue;
+
+		kmod_list_foreach(l, mod->info_list) {
+			const char *key = kmod_module_info_get_key(l);
+			const char *value = kmod_module_info_get_value(l);
+			char buf[PATH_MAX];
+			const char *alias;
+			int duplicate;
+
+			if (!streq(key, "alias"))
+				continue;
+
+			if (alias_normalize(value, buf, NULL) < 0) {
+				WRN("Unmatched bracket in %s\n", value);
+				continue;
 			}
-		} else if (relnewlen > se->len && relnewpath[se->len] == '/' &&
-			 memcmp(se->path, relnewpath, se->len) == 0)
-			newprio = i;
-		else if (reloldlen > se->len && reloldpath[se->len] == '/' &&
-			 memcmp(se->path, reloldpath, se->len) == 0)
-			oldprio = i;
+			alias = buf;
+
+			duplicate = index_insert(idx, alias, mod->modname,
+						 mod->idx);
+			if (duplicate && depmod->cfg->warn_dups)
+				WRN("duplicate module alias:\n%s %s\n",
+				    alias, mod->modname);
+		}
 	}
 
-	if (newprio < 0)
-		newprio = bprio;
-	if (oldprio < 0)
-		oldprio = bprio;
+	err = index_write_trie(depmod, idx, out, delta, true);
+	index_destroy(idx);
 
-	DBG("priorities: built-in: %d, old: %d, new: %d\n",
-	    bprio, oldprio, newprio);
+	return err;
+}
 
-	return newprio <= oldprio;
+static int output_aliases_bin(struct depmod *depmod, FILE *out)
+{
+	return output_aliases_index(depmod, out, false);
+}
+
+static int output_aliases_delta_bin(struct depmod *depmod, FILE *out)
+{
+	return output_aliases_index(depmod, out, true);
+}
+
+static int output_softdeps(struct depmod *depmod, FILE *out)
+{
+	size_t i;
+
+	fputs("# Soft dependencies extracted from modules themselves.\n", out);
+
+	for (i = 0; i < depmod->modules.count; i++) {
+		const struct mod *mod = depmod->modules.array[i];
+		struct kmod_list *l;
+
+		kmod_list_foreach(l, mod->info_list) {
+			const char *key = kmod_module_info_get_key(l);
+			const char *value = kmod_module_info_get_value(l);
+
+			if (!streq(key, "softdep"))
+				continue;
+
+			fprintf(out, "softdep %s %s\n", mod->modname, value);
+		}
+	}
+
+	return 0;
 }
 
-static int depmod_modules_search_file(struct depmod *depmod, size_t baselen, size_t namelen, const char *path)
+/*
+ * The softdeps of modules.softdep keyed by module name, so libkmod can look
+ * them up instead of parsing the text file as configuration. Priorities keep
+ * the order of modules.softdep: only the first line of a module is used.
+ */
+static int output_softdeps_bin(struct depmod *depmod, FILE *out)
 {
-	struct kmod_module *kmod;
-	struct mod *mod;
-	const char *relpath;
-	char modname[PATH_MAX];
-	size_t modnamelen;
-	int err;
+	struct index *idx;
+	unsigned int n = 0;
+	size_t i;
 
-	if (!path_ends_with_kmod_ext(path + baselen, namelen))
+	if (out == stdout)
 		return 0;
 
-	if (path_to_modname(path, modname, &modnamelen) == NULL) {
-		ERR("could not get modname from path %s\n", path);
-		return -EINVAL;
-	}
+	idx = index_create();
+	if (idx == NULL)
+		return -ENOMEM;
 
-	relpath = path + depmod->cfg->dirnamelen + 1;
-	DBG("try %s (%s)\n", relpath, modname);
+	for (i = 0; i < depmod->modules.count; i++) {
+		const struct mod *mod = depmod->modules.array[i];
+		struct kmod_list *l;
 
-	mod = hash_find(depmod->modules_by_name, modname);
-	if (mod == NULL)
-		goto add;
+		kmod_list_foreach(l, mod->info_list) {
+			const char *key = kmod_module_info_get_key(l);
+			const char *value = kmod_module_info_get_value(l);
 
-	if (depmod_module_is_higher_priority(depmod, mod, baselen,
-						namelen, modnamelen, path)) {
-		DBG("Ignored lower priority: %s, higher: %s\n",
-		    path, mod->path);
-		return 0;
-	}
+			if (!streq(key, "softdep"))
+				continue;
 
-	DBG("Replace lower priority %s with new module %s\n",
-	    mod->relpath, relpath);
-	err = depmod_module_del(depmod, mod);
-	if (err < 0) {
-		ERR("could not del module %s: %s\n", mod->path, strerror(-err));
-		return err;
+			index_insert(idx, mod->modname, value, n++);
+		}
 	}
 
-add:
-	err = kmod_module_new_from_path(depmod->ctx, path, &kmod);
-	if (err < 0) {
-		ERR("could not create module %s: %s\n", path, strerror(-err));
-		return err;
-	}
+	index_write(idx, out, depmod->cfg->index_version, true);
+	index_destroy(idx);
 
-	err = depmod_module_add(depmod, kmod);
-	if (err < 0) {
-		ERR("could not add module %s: %s\n",
-		    path, strerror(-err));
-		kmod_module_unref(kmod);
-		return err;
-	}
 	return 0;
 }
 
-static bool should_exclude_dir(const struct cfg *cfg, const char *name)
+static int output_symbols(struct depmod *depmod, FILE *out)
 {
-	struct cfg_exclude *exc;
+	struct hash_iter iter;
+	const void *v;
 
-	if (name[0] == '.' && (name[1] == '\0' ||
-			(name[1] == '.' && name[2] == '\0')))
-		return true;
+	fputs("# Aliases for symbols, used by symbol_request().\n", out);
 
-	if (streq(name, "build") || streq(name, "source"))
-		return true;
+	hash_iter_init(depmod->symbols, &iter);
 
-	for (exc = cfg->excludes; exc != NULL; exc = exc->next) {
-		if (streq(name, exc->exclude_dir))
-			return true;
+	while (hash_iter_next(&iter, NULL, &v)) {
+		const struct symbol *sym = v;
+		if (sym->owner == NULL)
+			continue;
+
+		fprintf(out, "alias symbol:%s %s\n",
+					sym->name, sym->owner->modname);
 	}
 
-	return false;
+	return 0;
 }
 
-static int depmod_modules_search_dir(struct depmod *depmod, DIR *d, size_t baselen, struct scratchbuf *s_path)
+static int output_symbols_index(struct depmod *depmod, FILE *out, bool delta)
 {
-	struct dirent *de;
-	int err = 0, dfd = dirfd(d);
-	char *path;
+	struct index *idx;
+	char alias[1024];
+	_cleanup_(scratchbuf_release) struct scratchbuf salias =
+		SCRATCHBUF_INITIALIZER(alias);
+	size_t baselen = sizeof("symbol:") - 1;
+	struct hash_iter iter;
+	const void *v;
+	int ret = 0;
 
-	while ((de = readdir(d)) != NULL) {
-		const char *name = de->d_name;
-		size_t namelen;
-		uint8_t is_dir;
+	if (out == stdout)
+		return 0;
 
-		if (should_exclude_dir(depmod->cfg, name))
-			continue;
+	idx = index_create();
+	if (idx == NULL)
+		return -ENOMEM;
 
-		namelen = strlen(name);
-		if (scratchbuf_alloc(s_path, baselen + namelen + 2) < 0) {
-			err = -ENOMEM;
-			ERR("No memory\n");
-			continue;
-		}
+	memcpy(alias, "symbol:", baselen);
 
-		path = scratchbuf_str(s_path);
-		memcpy(path + baselen, name, namelen + 1);
+	hash_iter_init(depmod->symbols, &iter);
 
-		if (de->d_type == DT_REG)
-			is_dir = 0;
-		else if (de->d_type == DT_DIR)
-			is_dir = 1;
-		else {
-			struct stat st;
-			if (fstatat(dfd, name, &st, 0) < 0) {
-				ERR("fstatat(%d, %s): %m\n", dfd, name);
-				continue;
-			} else if (S_ISREG(st.st_mode))
-				is_dir = 0;
-			else if (S_ISDIR(st.st_mode))
-				is_dir = 1;
-			else {
-				ERR("unsupported file type %s: %o\n",
-				    path, st.st_mode & S_IFMT);
-				continue;
-			}
-		}
+	while (hash_iter_next(&iter, NULL, &v)) {
+		int duplicate;
+		const struct symbol *sym = v;
+		size_t len;
 
-		if (is_dir) {
-			int fd;
-			DIR *subdir;
-			fd = openat(dfd, name, O_RDONLY);
-			if (fd < 0) {
-				ERR("openat(%d, %s, O_RDONLY): %m\n",
-				    dfd, name);
-				continue;
-			}
-			subdir = fdopendir(fd);
-			if (subdir == NULL) {
-				ERR("fdopendir(%d): %m\n", fd);
-				close(fd);
-				continue;
-			}
-			path[baselen + namelen] = '/';
-			path[baselen + namelen + 1] = '\0';
-			err = depmod_modules_search_dir(depmod, subdir,
-							baselen + namelen + 1,
-							s_path);
-			closedir(subdir);
-		} else {
-			err = depmod_modules_search_file(depmod, baselen,
-							 namelen, path);
-		}
+		if (sym->owner == NULL)
+			continue;
+		if (delta && !mod_in_delta(depmod, sym->owner))
+			continue;
 
-		if (err < 0) {
-			path[baselen + namelen] = '\0';
-			ERR("failed %s: %s\n", path, strerror(-err));
-			err = 0; /* ignore errors */
-		}
-	}
-	return err;
-}
+		len = strlen(sym->name);
 
-static int depmod_modules_search_path(struct depmod *depmod,
-				      const char *path)
-{
-	char buf[256];
-	_cleanup_(scratchbuf_release) struct scratchbuf s_path_buf =
-		SCRATCHBUF_INITIALIZER(buf);
-	char *path_buf;
-	DIR *d;
-	size_t baselen;
-	int err;
+		if (scratchbuf_alloc(&salias, baselen + len + 1) < 0) {
+			ret = -ENOMEM;
+			goto err_scratchbuf;
+		}
+		memcpy(scratchbuf_str(&salias) + baselen, sym->name, len + 1);
+		duplicate = index_insert(idx, alias, sym->owner->modname,
+							sym->owner->idx);
 
-	d = opendir(path);
-	if (d == NULL) {
-		err = -errno;
-		ERR("could not open directory %s: %m\n", path);
-		return err;
+		if (duplicate && depmod->cfg->warn_dups)
+			WRN("duplicate module syms:\n%s %s\n",
+						alias, sym->owner->modname);
 	}
 
-	baselen = strlen(path);
+	ret = index_write_trie(depmod, idx, out, delta, false);
 
-	if (scratchbuf_alloc(&s_path_buf, baselen + 2) < 0) {
-		err = -ENOMEM;
-		goto out;
-	}
-	path_buf = scratchbuf_str(&s_path_buf);
+err_scratchbuf:
+	index_destroy(idx);
 
-	memcpy(path_buf, path, baselen);
-	path_buf[baselen] = '/';
-	baselen++;
-	path_buf[baselen] = '\0';
+	if (ret < 0)
+		ERR("output symbols: %s\n", strerror(-ret));
 
-	err = depmod_modules_search_dir(depmod, d, baselen, &s_path_buf);
-out:
-	closedir(d);
-	return err;
+	return ret;
 }
 
-static int depmod_modules_search(struct depmod *depmod)
+static int output_symbols_bin(struct depmod *depmod, FILE *out)
 {
-	int err;
-	struct cfg_external *ext;
-
-	err = depmod_modules_search_path(depmod, depmod->cfg->dirname);
-	if (err < 0)
-		return err;
-
-	for (ext = depmod->cfg->externals; ext != NULL; ext = ext->next) {
-		err = depmod_modules_search_path(depmod, ext->path);
-		if (err < 0 && err == -ENOENT)
-			/* ignore external dir absense */
-			continue;
-	}
-
-	return 0;
+	return output_symbols_index(depmod, out, false);
 }
 
-static int mod_cmp(const void *pa, const void *pb) {
-	const struct mod *a = *(const struct mod **)pa;
-	const struct mod *b = *(const struct mod **)pb;
-	return a->sort_idx - b->sort_idx;
+static int output_symbols_delta_bin(struct depmod *depmod, FILE *out)
+{
+	return output_symbols_index(depmod, out, true);
 }
 
-static int depmod_modules_build_array(struct depmod *depmod)
+static int symbol_cmp_name(const void *pa, const void *pb)
 {
-	struct hash_iter module_iter;
-	const void *v;
-	int err;
-
-	hash_iter_init(depmod->modules_by_name, &module_iter);
-	while (hash_iter_next(&module_iter, NULL, &v)) {
-		struct mod *mod = (struct mod *) v;
-		mod->idx = depmod->modules.count;
-		err = array_append(&depmod->modules, mod);
-		if (err < 0)
-			return err;
-	}
+	const struct symbol *a = *(const struct symbol **)pa;
+	const struct symbol *b = *(const struct symbol **)pb;
 
-	return 0;
+	return strcmp(a->name, b->name);
 }
 
-static FILE *dfdopen(const char *dname, const char *filename, int flags,
-		     const char *mode)
+/*
+ * The symbols of modules.symbols.bin with their CRCs, in a hash table laid
+ * out like the literals of the matcher section, for kmod_resolve_symbols()
+ * to check each one with a single probe. See libkmod/libkmod-index.c.
+ */
+static int output_symbols_hash_bin(struct depmod *depmod, FILE *out)
 {
-	int fd, dfd;
-	FILE *ret;
-
-	dfd = open(dname, O_RDONLY);
-	if (dfd < 0) {
-		WRN("could not open directory %s: %m\n", dname);
-		return NULL;
-	}
-
-	fd = openat(dfd, filename, flags);
-	if (fd < 0) {
-		WRN("could not open %s at %s: %m\n", filename, dname);
-		ret = NULL;
-	} else {
-		ret = fdopen(fd, mode);
-		if (!ret) {
-			WRN("could not associate stream with %s: %m\n", filename);
-			close(fd);
-		}
+	const struct symbol **syms;
+	uint32_t *table = NULL, *owners = NULL;
+	uint32_t size, n = 0, u, next;
+	struct hash_iter iter;
+	const void *v;
+	uint64_t end;
+	size_t i;
+	int err = 0;
+
+	if (out == stdout)
+		return 0;
+
+	syms = malloc(sizeof(*syms) * (hash_get_count(depmod->symbols) + 1));
+	owners = calloc(depmod->modules.count + 1, sizeof(*owners));
+	if (syms == NULL || owners == NULL) {
+		err = -ENOMEM;
+		goto out;
 	}
-	close(dfd);
-	return ret;
-}
 
+	hash_iter_init(depmod->symbols, &iter);
+	while (hash_iter_next(&iter, NULL, &v)) {
+		const struct symbol *sym = v;
 
+		if (sym->owner != NULL)
+			syms[n++] = sym;
+	}
+	/* the layout doesn't depend on the order of the symbols hash */
+	qsort(syms, n, sizeof(*syms), symbol_cmp_name);
 
-static void depmod_modules_sort(struct depmod *depmod)
-{
-	char line[PATH_MAX];
-	const char *order_file = "modules.order";
-	FILE *fp;
-	unsigned idx = 0, total = 0;
+	size = index_matcher_table_size(n);
+	table = calloc(2 * size + 1, sizeof(uint32_t));
+	if (table == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
 
-	fp = dfdopen(depmod->cfg->dirname, order_file, O_RDONLY, "r");
-	if (fp == NULL)
-		return;
+	/* the entries, then the name of each module owning some, once */
+	end = 4 * sizeof(uint32_t) + 2 * size * sizeof(uint32_t);
+	for (i = 0; i < n; i++) {
+		uint32_t hash = FNV1A_32_INIT;
+		const char *c;
 
-	while (fgets(line, sizeof(line), fp) != NULL) {
-		size_t len = strlen(line);
-		idx++;
-		if (len == 0)
-			continue;
-		if (line[len - 1] != '\n') {
-			ERR("%s/%s:%u corrupted line misses '\\n'\n",
-				depmod->cfg->dirname, order_file, idx);
-			goto corrupted;
+		for (c = syms[i]->name; *c != '\0'; c++)
+			hash = fnv1a_32_step(hash, *c);
+
+		if (end > UINT32_MAX) {
+			err = -EFBIG;
+			goto out;
 		}
+		index_matcher_table_add(table, size, hash, end);
+		end += c - syms[i]->name + 1 + 3 * sizeof(uint32_t);
 	}
-	total = idx + 1;
-	idx = 0;
-	fseek(fp, 0, SEEK_SET);
-	while (fgets(line, sizeof(line), fp) != NULL) {
-		size_t len = strlen(line);
-		struct mod *mod;
+	next = end;
+	for (i = 0; i < n; i++) {
+		const struct mod *owner = syms[i]->owner;
 
-		idx++;
-		if (len == 0)
+		if (owners[owner->idx] != 0)
 			continue;
-		line[len - 1] = '\0';
+		owners[owner->idx] = end;
+		end += owner->modnamesz;
+	}
+	if (end > UINT32_MAX) {
+		err = -EFBIG;
+		goto out;
+	}
 
-		mod = hash_find(depmod->modules_by_uncrelpath, line);
-		if (mod == NULL)
-			continue;
-		mod->sort_idx = idx - total;
+	u = htonl(INDEX_SYMHASH_MAGIC);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(INDEX_SYMHASH_VERSION);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(size);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(n);
+	fwrite(&u, sizeof(u), 1, out);
+	fwrite(table, sizeof(uint32_t), 2 * size, out);
+
+	for (i = 0; i < n; i++) {
+		const struct symbol *sym = syms[i];
+
+		fwrite(sym->name, 1, strlen(sym->name) + 1, out);
+		u = htonl(owners[sym->owner->idx]);
+		fwrite(&u, sizeof(u), 1, out);
+		u = htonl(sym->crc >> 32);
+		fwrite(&u, sizeof(u), 1, out);
+		u = htonl(sym->crc & 0xffffffff);
+		fwrite(&u, sizeof(u), 1, out);
 	}
 
-	array_sort(&depmod->modules, mod_cmp);
-	for (idx = 0; idx < depmod->modules.count; idx++) {
-		struct mod *m = depmod->modules.array[idx];
-		m->idx = idx;
+	/* owners[] were given in the order they are first seen */
+	for (i = 0; i < n; i++) {
+		const struct mod *owner = syms[i]->owner;
+
+		if (owners[owner->idx] != next)
+			continue;
+		fwrite(owner->modname, 1, owner->modnamesz, out);
+		next += owner->modnamesz;
 	}
 
-corrupted:
-	fclose(fp);
+out:
+	if (err < 0)
+		ERR("modules.symbols.hash.bin: %s\n", strerror(-err));
+	free(syms);
+	free(owners);
+	free(table);
+	return err;
 }
 
-static int depmod_symbol_add(struct depmod *depmod, const char *name,
-					bool prefix_skipped, uint64_t crc,
-					const struct mod *owner)
+static int output_builtin_bin(struct depmod *depmod, FILE *out)
 {
-	size_t namelen;
-	int err;
-	struct symbol *sym;
+	FILE *in;
+	struct index *idx;
+	char line[PATH_MAX], modname[PATH_MAX];
 
-	if (!prefix_skipped && (name[0] == depmod->cfg->sym_prefix))
-		name++;
+	if (out == stdout)
+		return 0;
 
-	namelen = strlen(name) + 1;
-	sym = malloc(sizeof(struct symbol) + namelen);
-	if (sym == NULL)
+	in = dfdopen(depmod->cfg->dirname, "modules.builtin", O_RDONLY, "r");
+	if (in == NULL)
+		return 0;
+
+	idx = index_create();
+	if (idx == NULL) {
+		fclose(in);
 		return -ENOMEM;
+	}
 
-	sym->owner = (struct mod *)owner;
-	sym->crc = crc;
-	memcpy(sym->name, name, namelen);
+	while (fgets(line, sizeof(line), in) != NULL) {
+		if (!isalpha(line[0])) {
+			ERR("Invalid modules.builtin line: %s\n", line);
+			continue;
+		}
 
-	err = hash_add(depmod->symbols, sym->name, sym);
-	if (err < 0) {
-		free(sym);
-		return err;
+		path_to_modname(line, modname, NULL);
+		index_insert(idx, modname, "", 0);
 	}
 
-	DBG("add %p sym=%s, owner=%p %s\n", sym, sym->name, owner,
-	    owner != NULL ? owner->path : "");
+	index_write(idx, out, depmod->cfg->index_version, false);
+	index_destroy(idx);
+	fclose(in);
 
 	return 0;
 }
 
-static struct symbol *depmod_symbol_find(const struct depmod *depmod,
-							const char *name)
+/*
+ * Pack the binary indexes written so far into modules.bin, so libkmod can
+ * map them all at once. Must run after the indexes it copies are written,
+ * in place or, with --sync, in depmod->pending.
+ */
+static int output_bundle_bin(struct depmod *depmod, FILE *out)
 {
-	if (name[0] == '.') /* PPC64 needs this: .foo == foo */
-		name++;
-	if (name[0] == depmod->cfg->sym_prefix)
-		name++;
-	return hash_find(depmod->symbols, name);
-}
+	struct {
+		uint32_t type;
+		const char *name;
+		FILE *in;
+		uint32_t size;
+	} sections[] = {
+		{ KMOD_INDEX_MODULES_DEP, "modules.dep.bin" },
+		{ KMOD_INDEX_MODULES_ALIAS, "modules.alias.bin" },
+		{ KMOD_INDEX_MODULES_SYMBOL, "modules.symbols.bin" },
+		{ KMOD_INDEX_MODULES_BUILTIN_ALIAS, "modules.builtin.alias.bin" },
+		{ KMOD_INDEX_MODULES_BUILTIN, "modules.builtin.bin" },
+	};
+	uint32_t u, offset, count = 0;
+	char buf[BUFSIZ];
+	size_t i, n;
+	int err = 0;
 
-static int depmod_load_modules(struct depmod *depmod)
-{
-	struct mod **itr, **itr_end;
+	if (out == stdout)
+		return 0;
 
-	DBG("load symbols (%zd modules)\n", depmod->modules.count);
+	for (i = 0; i < ARRAY_SIZE(sections); i++) {
+		const char *name = NULL;
+		struct stat st;
 
-	itr = (struct mod **)depmod->modules.array;
-	itr_end = itr + depmod->modules.count;
-	for (; itr < itr_end; itr++) {
-		struct mod *mod = *itr;
-		struct kmod_list *l, *list = NULL;
-		int err = kmod_module_get_symbols(mod->kmod, &list);
-		if (err < 0) {
-			if (err == -ENODATA)
-				DBG("ignoring %s: no symbols\n", mod->path);
-			else
-				ERR("failed to load symbols from %s: %s\n",
-						mod->path, strerror(-err));
-			goto load_info;
-		}
-		kmod_list_foreach(l, list) {
-			const char *name = kmod_module_symbol_get_symbol(l);
-			uint64_t crc = kmod_module_symbol_get_crc(l);
-			depmod_symbol_add(depmod, name, false, crc, mod);
+		if (depmod->pending != NULL)
+			name = hash_find(depmod->pending, sections[i].name);
+		if (name == NULL)
+			name = sections[i].name;
+
+		sections[i].in = dfdopen(depmod->cfg->outdirname, name,
+							O_RDONLY, "rb");
+		if (sections[i].in == NULL)
+			continue;
+
+		if (fstat(fileno(sections[i].in), &st) < 0 || st.st_size == 0 ||
+		    st.st_size > UINT32_MAX) {
+			fclose(sections[i].in);
+			sections[i].in = NULL;
+			continue;
 		}
-		kmod_module_symbols_free_list(list);
 
-load_info:
-		kmod_module_get_info(mod->kmod, &mod->info_list);
-		kmod_module_get_dependency_symbols(mod->kmod,
-						   &mod->dep_sym_list);
-		kmod_module_unref(mod->kmod);
-		mod->kmod = NULL;
+		sections[i].size = st.st_size;
+		count++;
 	}
 
-	DBG("loaded symbols (%zd modules, %u symbols)\n",
-	    depmod->modules.count, hash_get_count(depmod->symbols));
+	u = htonl(INDEX_BUNDLE_MAGIC);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(INDEX_BUNDLE_VERSION);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(count);
+	fwrite(&u, sizeof(u), 1, out);
 
-	return 0;
-}
+	offset = 3 * sizeof(uint32_t) + count * 3 * sizeof(uint32_t);
+	for (i = 0; i < ARRAY_SIZE(sections); i++) {
+		if (sections[i].in == NULL)
+			continue;
 
-static int depmod_load_module_dependencies(struct depmod *depmod, struct mod *mod)
-{
-	const struct cfg *cfg = depmod->cfg;
-	struct kmod_list *l;
+		u = htonl(sections[i].type);
+		fwrite(&u, sizeof(u), 1, out);
+		u = htonl(offset);
+		fwrite(&u, sizeof(u), 1, out);
+		u = htonl(sections[i].size);
+		fwrite(&u, sizeof(u), 1, out);
 
-	DBG("do dependencies of %s\n", mod->path);
-	kmod_list_foreach(l, mod->dep_sym_list) {
-		const char *name = kmod_module_dependency_symbol_get_symbol(l);
-		uint64_t crc = kmod_module_dependency_symbol_get_crc(l);
-		int bindtype = kmod_module_dependency_symbol_get_bind(l);
-		struct symbol *sym = depmod_symbol_find(depmod, name);
-		uint8_t is_weak = bindtype == KMOD_SYMBOL_WEAK;
+		if (sections[i].size > UINT32_MAX - offset) {
+			err = -EFBIG;
+			goto out;
+		}
+		offset += sections[i].size;
+	}
 
-		if (sym == NULL) {
-			DBG("%s needs (%c) unknown symbol %s\n",
-			    mod->path, bindtype, name);
-			if (cfg->print_unknown && !is_weak)
-				WRN("%s needs unknown symbol %s\n",
-				    mod->path, name);
+	for (i = 0; i < ARRAY_SIZE(sections); i++) {
+		uint32_t left = sections[i].size;
+
+		if (sections[i].in == NULL)
 			continue;
+
+		while (left > 0 && (n = fread(buf, 1, sizeof(buf), sections[i].in)) > 0) {
+			if (n > left)
+				n = left;
+			fwrite(buf, 1, n, out);
+			left -= n;
 		}
 
-		if (cfg->check_symvers && sym->crc != crc && !is_weak) {
-			DBG("symbol %s (%#"PRIx64") module %s (%#"PRIx64")\n",
-			    sym->name, sym->crc, mod->path, crc);
-			if (cfg->print_unknown)
-				WRN("%s disagrees about version of symbol %s\n",
-				    mod->path, name);
+		if (left > 0) {
+			ERR("%s shrank while copying it to modules.bin\n",
+							sections[i].name);
+			err = -EIO;
+			goto out;
 		}
+	}
 
-		mod_add_dependency(mod, sym);
+out:
+	for (i = 0; i < ARRAY_SIZE(sections); i++) {
+		if (sections[i].in != NULL)
+			fclose(sections[i].in);
 	}
 
-	return 0;
+	return err;
 }
 
-static int depmod_load_dependencies(struct depmod *depmod)
+/*
+ * Map @fd for reading and close it. An empty file is mapped to NULL with
+ * @size 0, which is not an error.
+ */
+static int fdmap(int fd, void **mem, size_t *size)
 {
-	struct mod **itr, **itr_end;
+	struct stat st;
+	int err = 0;
 
-	DBG("load dependencies (%zd modules, %u symbols)\n",
-	    depmod->modules.count, hash_get_count(depmod->symbols));
+	*mem = NULL;
+	*size = 0;
 
-	itr = (struct mod **)depmod->modules.array;
-	itr_end = itr + depmod->modules.count;
-	for (; itr < itr_end; itr++) {
-		struct mod *mod = *itr;
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		goto out;
+	}
 
-		if (mod->dep_sym_list == NULL) {
-			DBG("ignoring %s: no dependency symbols\n", mod->path);
-			continue;
-		}
+	*size = st.st_size;
+	if (*size == 0)
+		goto out;
 
-		depmod_load_module_dependencies(depmod, mod);
+	*mem = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (*mem == MAP_FAILED) {
+		err = -errno;
+		*mem = NULL;
 	}
 
-	DBG("loaded dependencies (%zd modules, %u symbols)\n",
-	    depmod->modules.count, hash_get_count(depmod->symbols));
-
-	return 0;
+out:
+	close(fd);
+	return err;
 }
 
-static int dep_cmp(const void *pa, const void *pb)
+/* like fdmap(), for @filename in @dname */
+static int dfdmap(const char *dname, const char *filename, void **mem,
+							size_t *size)
 {
-	const struct mod *a = *(const struct mod **)pa;
-	const struct mod *b = *(const struct mod **)pb;
-	return a->dep_sort_idx - b->dep_sort_idx;
-}
+	int fd, dfd, err;
 
-static void depmod_sort_dependencies(struct depmod *depmod)
-{
-	struct mod **itr, **itr_end;
-	itr = (struct mod **)depmod->modules.array;
-	itr_end = itr + depmod->modules.count;
-	for (; itr < itr_end; itr++) {
-		struct mod *m = *itr;
-		if (m->deps.count > 1)
-			array_sort(&m->deps, dep_cmp);
+	dfd = open(dname, O_RDONLY);
+	if (dfd < 0) {
+		err = -errno;
+		WRN("could not open directory %s: %m\n", dname);
+		return err;
 	}
-}
-
-struct vertex {
-	struct vertex *parent;
-	struct mod *mod;
-};
-
-static struct vertex *vertex_new(struct mod *mod, struct vertex *parent)
-{
-	struct vertex *v;
-
-	v = malloc(sizeof(*v));
-	if (v == NULL)
-		return NULL;
 
-	v->parent = parent;
-	v->mod = mod;
-	return v;
-}
+	fd = openat(dfd, filename, O_RDONLY | O_CLOEXEC);
+	close(dfd);
+	if (fd < 0) {
+		err = -errno;
+		WRN("could not open %s at %s: %m\n", filename, dname);
+		return err;
+	}
 
-static void depmod_list_remove_data(struct kmod_list **list, void *data)
-{
-	struct kmod_list *l;
+	err = fdmap(fd, mem, size);
+	if (err < 0)
+		WRN("could not map %s at %s: %s\n", filename, dname,
+		    strerror(-err));
 
-	l = kmod_list_remove_data(*list, data);
-	*list = l;
+	return err;
 }
 
-static int depmod_report_one_cycle(struct depmod *depmod,
-				   struct vertex *vertex,
-				   struct kmod_list **roots,
-				   struct hash *loop_set)
+static int output_builtin_alias_bin(struct depmod *depmod, FILE *out)
 {
-	const char sep[] = " -> ";
-	size_t sz;
-	char *buf;
-	struct array reverse;
-	int i;
-	int n;
-	struct vertex *v;
-	int rc;
+	const char *p, *end;
+	struct index *idx;
+	size_t size = 0;
+	void *mem = NULL;
 
-	array_init(&reverse, 3);
+	if (out == stdout)
+		return 0;
 
-	sz = 0;
-	for (v = vertex->parent, n = 0;
-	     v != NULL;
-	     v = v->parent, n++) {
+	if (dfdmap(depmod->cfg->dirname, "modules.builtin.modinfo",
+							&mem, &size) < 0)
+		return 0;
 
-		sz += v->mod->modnamesz - 1;
-		array_append(&reverse, v);
-		rc = hash_add(loop_set, v->mod->modname, NULL);
-		if (rc != 0)
-			return rc;
-		/* the hash will be freed where created */
+	idx = index_create();
+	if (idx == NULL) {
+		if (mem != NULL)
+			munmap(mem, size);
+		return -ENOMEM;
 	}
-	sz += vertex->mod->modnamesz - 1;
-
-	buf = malloc(sz + n * strlen(sep) + 1);
 
-	sz = 0;
-	for (i = reverse.count - 1; i >= 0; i--) {
+	/*
+	 * format: modname.key=value\0
+	 * Only aliases are indexed, so each record is just located with
+	 * memchr() unless its key is "alias". A truncated last record is
+	 * ignored.
+	 */
+	p = mem;
+	end = p + size;
+	while (p < end) {
+		const char *rec = p, *dot, *value, *nul;
+		char alias[PATH_MAX];
+		char modname[PATH_MAX];
 		size_t len;
 
-		v = reverse.array[i];
+		nul = memchr(rec, '\0', end - rec);
+		if (nul == NULL)
+			break;
+		p = nul + 1;
 
-		len = v->mod->modnamesz - 1;
-		memcpy(buf + sz, v->mod->modname, len);
-		sz += len;
-		strcpy(buf + sz, sep);
-		sz += strlen(sep);
+		dot = memchr(rec, '.', nul - rec);
+		if (dot == NULL || dot == rec)
+			continue;
 
-		depmod_list_remove_data(roots, v->mod);
+		if ((size_t)(nul - dot) <= strlen(".alias=") ||
+				memcmp(dot, ".alias=", strlen(".alias=")) != 0)
+			continue;
+
+		value = dot + strlen(".alias=");
+		len = dot - rec;
+		if (len >= sizeof(modname) || nul - value >= PATH_MAX) {
+			WRN("Ignoring too long modules.builtin.modinfo entry: %.64s\n",
+			    rec);
+			continue;
+		}
+		memcpy(modname, rec, len);
+		modname[len] = '\0';
+
+		alias[0] = '\0';
+		if (alias_normalize(value, alias, NULL) < 0) {
+			WRN("Unmatched bracket in %s\n", value);
+			continue;
+		}
+
+		index_insert(idx, alias, modname, 0);
 	}
-	strcpy(buf + sz, vertex->mod->modname);
-	ERR("Cycle detected: %s\n", buf);
 
-	free(buf);
-	array_free_array(&reverse);
+	index_write(idx, out, depmod->cfg->index_version, true);
+	index_destroy(idx);
+	if (mem != NULL)
+		munmap(mem, size);
 
 	return 0;
 }
 
-static int depmod_report_cycles_from_root(struct depmod *depmod,
-					  struct mod *root_mod,
-					  struct kmod_list **roots,
-					  void **stack,
-					  size_t stack_size,
-					  struct hash *loop_set)
+/*
+ * Index each module in modules.builtin.modinfo by the byte range its
+ * records take, so libkmod doesn't have to scan the file to find them.
+ * Records of a module are consecutive; should a module appear more than
+ * once, its first range gets the lowest priority, as a scan would find it.
+ */
+static int output_builtin_modinfo_bin(struct depmod *depmod, FILE *out)
 {
-	struct kmod_list *free_list = NULL; /* struct vertex */
-	struct kmod_list *l;
-	struct vertex *root;
-	struct vertex *vertex;
-	struct vertex *v;
-	struct mod *m;
-	struct mod **itr, **itr_end;
-	size_t is;
-	int ret = -ENOMEM;
+	const char *p, *end, *start = NULL;
+	char modname[PATH_MAX];
+	unsigned int priority = 0;
+	struct index *idx;
+	size_t size = 0, len = 0;
+	void *mem = NULL;
 
-	root = vertex_new(root_mod, NULL);
-	if (root == NULL) {
-		ERR("No memory to report cycles\n");
-		goto out;
-	}
+	if (out == stdout)
+		return 0;
 
-	l = kmod_list_append(free_list, root);
-	if (l == NULL) {
-		ERR("No memory to report cycles\n");
-		goto out;
-	}
-	free_list = l;
+	/* output_builtin_alias_bin() already warned if it's missing */
+	if (snprintf(modname, sizeof(modname), "%s/modules.builtin.modinfo",
+		     depmod->cfg->dirname) >= (int) sizeof(modname) ||
+	    access(modname, F_OK) < 0)
+		return 0;
 
-	is = 0;
-	stack[is++] = (void *)root;
+	if (dfdmap(depmod->cfg->dirname, "modules.builtin.modinfo",
+							&mem, &size) < 0)
+		return 0;
 
-	while (is > 0) {
-		vertex = stack[--is];
-		m = vertex->mod;
-		/*
-		 * because of the topological sort we can start only
-		 * from part of a loop or from a branch after a loop
-		 */
-		if (m->visited && m == root->mod) {
-			int rc;
-			rc = depmod_report_one_cycle(depmod, vertex,
-						     roots, loop_set);
-			if (rc != 0) {
-				ret = rc;
-				goto out;
-			}
-			continue;
+	idx = index_create();
+	if (idx == NULL) {
+		if (mem != NULL)
+			munmap(mem, size);
+		return -ENOMEM;
+	}
+
+	p = mem;
+	end = p + size;
+	while (true) {
+		const char *rec = p, *nul = NULL, *dot = NULL;
+
+		if (p < end)
+			nul = memchr(rec, '\0', end - rec);
+		if (nul != NULL)
+			dot = memchr(rec, '.', nul - rec);
+
+		/* flush the current module on a new name or at the end */
+		if (start != NULL && (dot == NULL || (size_t)(dot - rec) != len ||
+				      memcmp(rec, modname, len) != 0)) {
+			char value[64];
+
+			snprintf(value, sizeof(value), "%zu %zu",
+				 (size_t)(start - (const char *) mem),
+				 (size_t)(rec - start));
+			index_insert(idx, modname, value, priority++);
+			start = NULL;
 		}
 
-		m->visited = true;
-		if (m->deps.count == 0) {
-			/*
-			 * boundary condition: if there is more than one
-			 * single node branch (not a loop), it is
-			 * recognized as a loop by the code above:
-			 * m->visited because more then one,
-			 * m == root->mod since it is a single node.
-			 * So, prevent deeping into the branch second
-			 * time.
-			 */
-			depmod_list_remove_data(roots, m);
+		if (nul == NULL)
+			break;
+		p = nul + 1;
 
+		if (dot == NULL || dot == rec)
 			continue;
-		}
-
-		itr = (struct mod **) m->deps.array;
-		itr_end = itr + m->deps.count;
-		for (; itr < itr_end; itr++) {
-			struct mod *dep = *itr;
-			v = vertex_new(dep, vertex);
-			if (v == NULL) {
-				ERR("No memory to report cycles\n");
-				goto out;
-			}
-			assert(is < stack_size);
-			stack[is++] = v;
 
-			l = kmod_list_append(free_list, v);
-			if (l == NULL) {
-				ERR("No memory to report cycles\n");
-				goto out;
+		if (start == NULL) {
+			len = dot - rec;
+			if (len >= sizeof(modname)) {
+				WRN("Ignoring too long modules.builtin.modinfo entry: %.64s\n",
+				    rec);
+				continue;
 			}
-			free_list = l;
-
+			memcpy(modname, rec, len);
+			modname[len] = '\0';
+			start = rec;
 		}
 	}
-	ret = 0;
 
-out:
-	while (free_list) {
-		v = free_list->data;
-		l = kmod_list_remove(free_list);
-		free_list = l;
-		free(v);
-	}
+	index_write(idx, out, depmod->cfg->index_version, false);
+	index_destroy(idx);
+	if (mem != NULL)
+		munmap(mem, size);
 
-	return ret;
+	return 0;
 }
 
-static void depmod_report_cycles(struct depmod *depmod, uint16_t n_mods,
-				 uint16_t *users)
+/*
+ * The device node a module creates on demand, from its devname: and
+ * char-major- or block-major- aliases. Returns false if it has no devname,
+ * *type is left '\0' if it has no major and minor.
+ */
+static bool mod_get_devname(const struct mod *mod, const char **devname,
+				char *type, unsigned int *major,
+				unsigned int *minor)
 {
-	int num_cyclic = 0;
-	struct kmod_list *roots = NULL; /* struct mod */
 	struct kmod_list *l;
-	size_t n_r; /* local n_roots */
-	int i;
-	int err;
-	_cleanup_free_ void **stack = NULL;
-	struct mod *m;
-	struct mod *root;
-	struct hash *loop_set;
 
-	for (i = 0, n_r = 0; i < n_mods; i++) {
-		if (users[i] <= 0)
+	*devname = NULL;
+	*type = '\0';
+	*major = *minor = 0;
+
+	kmod_list_foreach(l, mod->info_list) {
+		const char *key = kmod_module_info_get_key(l);
+		const char *value = kmod_module_info_get_value(l);
+		unsigned int maj, min;
+
+		if (!streq(key, "alias"))
 			continue;
-		m = depmod->modules.array[i];
-		l = kmod_list_append(roots, m);
-		if (l == NULL) {
-			ERR("No memory to report cycles\n");
-			goto out_list;
+
+		if (strstartswith(value, "devname:"))
+			*devname = value + sizeof("devname:") - 1;
+		else if (sscanf(value, "char-major-%u-%u",
+					&maj, &min) == 2) {
+			*type = 'c';
+			*major = maj;
+			*minor = min;
+		} else if (sscanf(value, "block-major-%u-%u",
+					&maj, &min) == 2) {
+			*type = 'b';
+			*major = maj;
+			*minor = min;
 		}
-		roots = l;
-		n_r++;
-	}
 
-	stack = malloc(n_r * sizeof(void *));
-	if (stack == NULL) {
-		ERR("No memory to report cycles\n");
-		goto out_list;
+		if (*type != '\0' && *devname != NULL)
+			break;
 	}
 
-	loop_set = hash_new(16, NULL);
-	if (loop_set == NULL) {
-		ERR("No memory to report cycles\n");
-		goto out_list;
+	return *devname != NULL;
+}
+
+static int output_devname(struct depmod *depmod, FILE *out)
+{
+	size_t i;
+	bool empty = true;
+
+	for (i = 0; i < depmod->modules.count; i++) {
+		const struct mod *mod = depmod->modules.array[i];
+		const char *devname;
+		unsigned int major, minor;
+		char type;
+
+		if (!mod_get_devname(mod, &devname, &type, &major, &minor))
+			continue;
+
+		if (type != '\0') {
+			if (empty) {
+				fputs("# Device nodes to trigger on-demand module loading.\n",
+				      out);
+				empty = false;
+			}
+			fprintf(out, "%s %s %c%u:%u\n", mod->modname,
+				devname, type, major, minor);
+		} else
+			ERR("Module '%s' has devname (%s) but "
+			    "lacks major and minor information. "
+			    "Ignoring.\n", mod->modname, devname);
 	}
 
-	while (roots != NULL) {
-		root = roots->data;
-		l = kmod_list_remove(roots);
-		roots = l;
-		err = depmod_report_cycles_from_root(depmod,
-						     root,
-						     &roots,
-						     stack, n_r, loop_set);
-		if (err < 0)
-			goto out_hash;
+	return 0;
+}
+
+/*
+ * The entries of modules.devname, for kmod static-nodes to write at boot
+ * without parsing them: after the magic, the version and the number of
+ * entries, each one is its major and minor, its type ('c' or 'b'), then
+ * the module and the device names, NUL-terminated. Integers are
+ * big-endian.
+ */
+static int output_devname_bin(struct depmod *depmod, FILE *out)
+{
+	const char *devname;
+	unsigned int major, minor;
+	uint32_t u, count = 0;
+	char type;
+	size_t i;
+
+	if (out == stdout)
+		return 0;
+
+	for (i = 0; i < depmod->modules.count; i++) {
+		const struct mod *mod = depmod->modules.array[i];
+
+		if (mod_get_devname(mod, &devname, &type, &major, &minor) &&
+							type != '\0')
+			count++;
 	}
 
-	num_cyclic = hash_get_count(loop_set);
-	ERR("Found %d modules in dependency cycles!\n", num_cyclic);
+	u = htonl(INDEX_DEVNAME_MAGIC);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(INDEX_DEVNAME_VERSION);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(count);
+	fwrite(&u, sizeof(u), 1, out);
 
-out_hash:
-	hash_free(loop_set);
-out_list:
-	while (roots != NULL) {
-		/* no need to free data, come from outside */
-		roots = kmod_list_remove(roots);
+	for (i = 0; i < depmod->modules.count; i++) {
+		const struct mod *mod = depmod->modules.array[i];
+
+		if (!mod_get_devname(mod, &devname, &type, &major, &minor) ||
+							type == '\0')
+			continue;
+
+		u = htonl(major);
+		fwrite(&u, sizeof(u), 1, out);
+		u = htonl(minor);
+		fwrite(&u, sizeof(u), 1, out);
+		fputc(type, out);
+		fwrite(mod->modname, 1, mod->modnamesz, out);
+		fwrite(devname, 1, strlen(devname) + 1, out);
 	}
-}
 
-static int depmod_calculate_dependencies(struct depmod *depmod)
-{
-	const struct mod **itrm;
-	uint16_t *users, *roots, *sorted;
-	uint16_t i, n_roots = 0, n_sorted = 0, n_mods = depmod->modules.count;
-	int ret = 0;
+	return 0;
+}
 
-	users = malloc(sizeof(uint16_t) * n_mods * 3);
-	if (users == NULL)
-		return -ENOMEM;
-	roots = users + n_mods;
-	sorted = roots + n_mods;
+struct depfile {
+	const char *name;
+	int (*cb)(struct depmod *depmod, FILE *out);
+};
 
-	DBG("calculate dependencies and ordering (%hu modules)\n", n_mods);
+static const struct depfile depfiles[] = {
+	{ "modules.dep", output_deps },
+	{ "modules.dep.bin", output_deps_bin },
+	{ "modules.dep.ids.bin", output_deps_ids_bin },
+	{ "modules.alias", output_aliases },
+	{ "modules.alias.bin", output_aliases_bin },
+	{ "modules.softdep", output_softdeps },
+	{ "modules.softdep.bin", output_softdeps_bin },
+	{ "modules.symbols", output_symbols },
+	{ "modules.symbols.bin", output_symbols_bin },
+	{ "modules.symbols.hash.bin", output_symbols_hash_bin },
+	{ "modules.builtin.bin", output_builtin_bin },
+	{ "modules.builtin.alias.bin", output_builtin_alias_bin },
+	{ "modules.builtin.modinfo.bin", output_builtin_modinfo_bin },
+	{ "modules.devname", output_devname },
+	{ "modules.devname.bin", output_devname_bin },
+	/* last: packs the indexes above */
+	{ "modules.bin", output_bundle_bin },
+	{ }
+};
 
-	assert(depmod->modules.count < UINT16_MAX);
+assert_cc(sizeof(depfiles) / sizeof(depfiles[0]) <= STATS_FILES_MAX);
 
-	/* populate modules users (how many modules uses it) */
-	itrm = (const struct mod **)depmod->modules.array;
-	for (i = 0; i < n_mods; i++, itrm++) {
-		const struct mod *m = *itrm;
-		users[i] = m->users;
-		if (users[i] == 0) {
-			roots[n_roots] = i;
-			n_roots++;
-		}
-	}
+/*
+ * With --delta, instead of the above: libkmod looks them up first, and
+ * the next full run removes them.
+ */
+static const struct depfile deltafiles[] = {
+	{ "modules.dep.delta.bin", output_deps_delta_bin },
+	{ "modules.alias.delta.bin", output_aliases_delta_bin },
+	/* last, like modules.bin */
+	{ "modules.symbols.delta.bin", output_symbols_delta_bin },
+	{ }
+};
 
-	/* topological sort (outputs modules without users first) */
-	while (n_roots > 0) {
-		const struct mod **itr_dst, **itr_dst_end;
-		struct mod *src;
-		uint16_t src_idx = roots[--n_roots];
+assert_cc(sizeof(deltafiles) <= sizeof(depfiles));
 
-		src = depmod->modules.array[src_idx];
-		src->dep_sort_idx = n_sorted;
-		sorted[n_sorted] = src_idx;
-		n_sorted++;
+struct depfile_tmp {
+	int fd;
+	bool anonymous; /* O_TMPFILE, with no name until it's complete */
+	bool truncated; /* its output failed, it's renamed but reported */
+	bool unchanged; /* same as the file in place, which is kept */
+	char name[NAME_MAX]; /* empty if there is nothing to rename */
+};
 
-		itr_dst = (const struct mod **)src->deps.array;
-		itr_dst_end = itr_dst + src->deps.count;
-		for (; itr_dst < itr_dst_end; itr_dst++) {
-			const struct mod *dst = *itr_dst;
-			uint16_t dst_idx = dst->idx;
-			assert(users[dst_idx] > 0);
-			users[dst_idx]--;
-			if (users[dst_idx] == 0) {
-				roots[n_roots] = dst_idx;
-				n_roots++;
-			}
-		}
-	}
+/*
+ * The output of a file is buffered in one big block rather than BUFSIZ, so
+ * it reaches the kernel in a few large write()s: the indexes and the text
+ * files are made of small records, but are written in a single pass.
+ */
+#define DEPFILE_BUFSIZE (1024 * 1024)
 
-	if (n_sorted < n_mods) {
-		depmod_report_cycles(depmod, n_mods, users);
-		ret = -EINVAL;
-		goto exit;
+/*
+ * Files are written to an unnamed O_TMPFILE when the filesystem supports it,
+ * so that nothing is left behind if depmod dies. Otherwise, or if it can't
+ * be linked, a temporary name is used like before.
+ */
+static int depfile_tmp_open(int dfd, const struct depfile *f,
+				const struct timeval *tv, struct depfile_tmp *tmp)
+{
+	snprintf(tmp->name, sizeof(tmp->name), "%s.%i.%li.%li", f->name,
+				getpid(), tv->tv_usec, tv->tv_sec);
+	tmp->truncated = false;
+	tmp->unchanged = false;
+
+	/* read back to compare it with the file in place */
+#ifdef O_TMPFILE
+	tmp->fd = openat(dfd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+	if (tmp->fd >= 0) {
+		tmp->anonymous = true;
+		return 0;
 	}
+#endif
 
-	depmod_sort_dependencies(depmod);
-
-	DBG("calculated dependencies and ordering (%hu modules)\n", n_mods);
+	tmp->anonymous = false;
+	tmp->fd = openat(dfd, tmp->name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC,
+									0644);
+	if (tmp->fd < 0)
+		return -errno;
 
-exit:
-	free(users);
-	return ret;
+	return 0;
 }
 
-static int depmod_load(struct depmod *depmod)
+/* give a name to an anonymous file, the one it'll be renamed from */
+static int depfile_tmp_link(int dfd, struct depfile_tmp *tmp)
 {
-	int err;
+	char path[64];
 
-	err = depmod_load_modules(depmod);
-	if (err < 0)
-		return err;
+	if (!tmp->anonymous)
+		return 0;
 
-	err = depmod_load_dependencies(depmod);
-	if (err < 0)
-		return err;
+	if (linkat(tmp->fd, "", dfd, tmp->name, AT_EMPTY_PATH) == 0)
+		return 0;
 
-	err = depmod_calculate_dependencies(depmod);
-	if (err < 0)
-		return err;
+	/* AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, the magic link doesn't */
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", tmp->fd);
+	if (linkat(AT_FDCWD, path, dfd, tmp->name, AT_SYMLINK_FOLLOW) == 0)
+		return 0;
 
-	return 0;
+	return -errno;
 }
 
-static size_t mod_count_all_dependencies(const struct mod *mod)
+static void depfile_tmp_unlink(int dfd, const char *dname,
+					const struct depfile_tmp *tmp)
 {
-	size_t i, count = 0;
-	for (i = 0; i < mod->deps.count; i++) {
-		const struct mod *d = mod->deps.array[i];
-		count += 1 + mod_count_all_dependencies(d);
-	}
-	return count;
+	if (tmp->anonymous)
+		return;
+
+	if (unlinkat(dfd, tmp->name, 0) != 0)
+		ERR("unlinkat(%s, %s): %m\n", dname, tmp->name);
 }
 
-static int mod_fill_all_unique_dependencies(const struct mod *mod, const struct mod **deps, size_t n_deps, size_t *last)
+/* drop a complete file that won't be renamed in place */
+static void depfile_tmp_discard(int dfd, const char *dname,
+					struct depfile_tmp *tmp)
 {
-	size_t i;
-	int err = 0;
-	for (i = 0; i < mod->deps.count; i++) {
-		const struct mod *d = mod->deps.array[i];
-		size_t j;
-		uint8_t exists = 0;
+	if (tmp->name[0] == '\0')
+		return;
 
-		for (j = 0; j < *last; j++) {
-			if (deps[j] == d) {
-				exists = 1;
-				break;
-			}
-		}
+	if (unlinkat(dfd, tmp->name, 0) != 0)
+		ERR("unlinkat(%s, %s): %m\n", dname, tmp->name);
+	tmp->name[0] = '\0';
+}
+
+#define DEPFILE_CMP_BUFSIZE (64 * 1024)
+
+static bool depfile_pread(int fd, char *buf, size_t len, off_t pos)
+{
+	while (len > 0) {
+		ssize_t r = pread(fd, buf, len, pos);
 
-		if (exists)
+		if (r < 0 && errno == EINTR)
 			continue;
+		if (r <= 0)
+			return false;
 
-		if (*last >= n_deps)
-			return -ENOSPC;
-		deps[*last] = d;
-		(*last)++;
-		err = mod_fill_all_unique_dependencies(d, deps, n_deps, last);
-		if (err < 0)
-			break;
+		buf += r;
+		len -= r;
+		pos += r;
 	}
-	return err;
+
+	return true;
 }
 
-static const struct mod **mod_get_all_sorted_dependencies(const struct mod *mod, size_t *n_deps)
+/*
+ * Whether the @size bytes written to @fd are those of @name already:
+ * renaming the same content in place would still drop the cached pages of
+ * the old file and make every libkmod context reload its indexes.
+ */
+static bool depfile_unchanged(int dfd, const char *name, int fd, off_t size)
 {
-	const struct mod **deps;
-	size_t last = 0;
+	_cleanup_free_ char *buf = NULL;
+	struct stat st;
+	bool same = false;
+	off_t pos;
+	int ofd;
 
-	*n_deps = mod_count_all_dependencies(mod);
-	if (*n_deps == 0)
-		return NULL;
+	ofd = openat(dfd, name, O_RDONLY | O_CLOEXEC);
+	if (ofd < 0)
+		return false;
 
-	deps = malloc(sizeof(struct mod *) * (*n_deps));
-	if (deps == NULL)
-		return NULL;
+	if (fstat(ofd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size != size)
+		goto out;
 
-	if (mod_fill_all_unique_dependencies(mod, deps, *n_deps, &last) < 0) {
-		free(deps);
-		return NULL;
+	buf = malloc(2 * DEPFILE_CMP_BUFSIZE);
+	if (buf == NULL)
+		goto out;
+
+	for (pos = 0; pos < size; ) {
+		size_t len = DEPFILE_CMP_BUFSIZE;
+
+		if ((off_t) len > size - pos)
+			len = size - pos;
+
+		if (!depfile_pread(ofd, buf, len, pos) ||
+		    !depfile_pread(fd, buf + DEPFILE_CMP_BUFSIZE, len, pos) ||
+		    memcmp(buf, buf + DEPFILE_CMP_BUFSIZE, len) != 0)
+			goto out;
+
+		pos += len;
 	}
+	same = true;
 
-	qsort(deps, last, sizeof(struct mod *), dep_cmp);
-	*n_deps = last;
-	return deps;
+out:
+	close(ofd);
+	return same;
 }
 
-static inline const char *mod_get_compressed_path(const struct mod *mod)
+/*
+ * Write one file to a temporary, named once complete, and with --sync
+ * with its data on disk. tmp->name is left empty if the file is skipped
+ * or if it's the same as the one in place, which is then kept as is.
+ * Returns < 0 on errors that must stop depmod_output(), 0 otherwise.
+ */
+static int depfile_write(struct depmod *depmod, int dfd,
+				const struct depfile *f, const struct timeval *tv,
+				struct depfile_tmp *tmp)
 {
-	if (mod->relpath != NULL)
-		return mod->relpath;
-	return mod->path;
-}
+	const char *dname = depmod->cfg->outdirname;
+	struct stats_time *t = &depmod->stats.files[f - depmod->files].time;
+	struct timespec ts[2];
+	void *buf = NULL;
+	int r, ferr, err;
+	off_t pos;
+	FILE *fp;
 
-static int output_deps(struct depmod *depmod, FILE *out)
-{
-	size_t i;
+	stats_start(t, CLOCK_THREAD_CPUTIME_ID);
 
-	for (i = 0; i < depmod->modules.count; i++) {
-		const struct mod **deps, *mod = depmod->modules.array[i];
-		const char *p = mod_get_compressed_path(mod);
-		size_t j, n_deps;
+	err = depfile_tmp_open(dfd, f, tv, tmp);
+	if (err < 0) {
+		ERR("openat(%s, %s): %s\n", dname, tmp->name, strerror(-err));
+		tmp->name[0] = '\0';
+		return 0;
+	}
 
-		fprintf(out, "%s:", p);
+	fp = fdopen(tmp->fd, "wb");
+	if (fp == NULL) {
+		ERR("fdopen(%d=%s/%s): %m\n", tmp->fd, dname, tmp->name);
+		close(tmp->fd);
+		depfile_tmp_unlink(dfd, dname, tmp);
+		tmp->name[0] = '\0';
+		return 0;
+	}
 
-		if (mod->deps.count == 0)
-			goto end;
+	/* stdio's own buffer is fine too, if there is no memory for this one */
+	if (posix_memalign(&buf, 4096, DEPFILE_BUFSIZE) == 0)
+		setvbuf(fp, buf, _IOFBF, DEPFILE_BUFSIZE);
+	else
+		buf = NULL;
 
-		deps = mod_get_all_sorted_dependencies(mod, &n_deps);
-		if (deps == NULL) {
-			ERR("could not get all sorted dependencies of %s\n", p);
-			goto end;
-		}
+	r = f->cb(depmod, fp);
 
-		for (j = 0; j < n_deps; j++) {
-			const struct mod *d = deps[j];
-			fprintf(out, " %s", mod_get_compressed_path(d));
-		}
-		free(deps);
-	end:
-		putc('\n', out);
+	ferr = fflush(fp) | ferror(fp);
+	pos = ftello(fp);
+
+	if (r >= 0 && !ferr && pos >= 0 &&
+			depfile_unchanged(dfd, f->name, tmp->fd, pos)) {
+		DBG("%s/%s is unchanged, keeping it\n", dname, f->name);
+		tmp->unchanged = true;
+	}
+
+	/*
+	 * All the files of a run get the same mtime, whichever writer ends
+	 * first: libkmod compares optional indexes with the files they are
+	 * derived from to tell if they were left behind by an older depmod.
+	 * An unchanged file keeps its own, so an index derived from one that
+	 * changed without it changing too is just not used.
+	 */
+	ts[0].tv_sec = ts[1].tv_sec = tv->tv_sec;
+	ts[0].tv_nsec = ts[1].tv_nsec = tv->tv_usec * 1000;
+	if (!tmp->unchanged)
+		futimens(tmp->fd, ts);
+
+	/* a truncated file would be renamed with the others: stop here */
+	if (r >= 0 && depmod->cfg->sync && !tmp->unchanged) {
+		if (ferr)
+			r = -ENOSPC;
+		else if (fdatasync(tmp->fd) < 0)
+			r = -errno;
+	}
+
+	if (pos > 0)
+		depmod->stats.files[f - depmod->files].bytes = pos;
+	stats_stop(t, CLOCK_THREAD_CPUTIME_ID);
+
+	if (r < 0 || tmp->unchanged) {
+		fclose(fp);
+		free(buf);
+		depfile_tmp_unlink(dfd, dname, tmp);
+		tmp->name[0] = '\0';
+
+		if (r < 0)
+			ERR("Could not write index '%s': %s\n", f->name,
+								strerror(-r));
+		return r;
 	}
 
+	r = depfile_tmp_link(dfd, tmp);
+	ferr |= fclose(fp);
+	free(buf);
+	if (r < 0) {
+		CRIT("linkat(%s, %s): %s\n", dname, tmp->name, strerror(-r));
+		tmp->name[0] = '\0';
+		return r;
+	}
+
+	tmp->truncated = ferr != 0;
+
 	return 0;
 }
 
-static int output_deps_bin(struct depmod *depmod, FILE *out)
+/* rename a file written by depfile_write() in place */
+static int depfile_commit(int dfd, const char *dname, const struct depfile *f,
+						struct depfile_tmp *tmp)
 {
-	struct index_node *idx;
-	size_t i;
+	int err;
 
-	if (out == stdout)
+	if (tmp->name[0] == '\0')
 		return 0;
 
-	idx = index_create();
-	if (idx == NULL)
-		return -ENOMEM;
+	if (renameat(dfd, tmp->name, dfd, f->name) != 0) {
+		err = -errno;
+		CRIT("renameat(%s, %s, %s, %s): %m\n",
+				dname, tmp->name, dname, f->name);
+		unlinkat(dfd, tmp->name, 0);
+		tmp->name[0] = '\0';
+		return err;
+	}
+	tmp->name[0] = '\0';
 
-	for (i = 0; i < depmod->modules.count; i++) {
-		const struct mod **deps, *mod = depmod->modules.array[i];
-		const char *p = mod_get_compressed_path(mod);
-		char *line;
-		size_t j, n_deps, linepos, linelen, slen;
-		int duplicate;
+	if (tmp->truncated) {
+		err = -ENOSPC;
+		ERR("Could not create index '%s'. Output is truncated: %s\n",
+					f->name, strerror(-err));
+		return err;
+	}
 
-		deps = mod_get_all_sorted_dependencies(mod, &n_deps);
-		if (deps == NULL && n_deps > 0) {
-			ERR("could not get all sorted dependencies of %s\n", p);
-			continue;
-		}
+	return 0;
+}
 
-		linelen = strlen(p) + 1;
-		for (j = 0; j < n_deps; j++) {
-			const struct mod *d = deps[j];
-			linelen += 1 + strlen(mod_get_compressed_path(d));
-		}
+/*
+ * Write one file and, unless they are all renamed at the end with --sync,
+ * rename it in place once complete.
+ */
+static int depmod_output_file(struct depmod *depmod, int dfd,
+				const struct depfile *f, const struct timeval *tv,
+				struct depfile_tmp *tmp)
+{
+	int err;
 
-		line = malloc(linelen + 1);
-		if (line == NULL) {
-			free(deps);
-			ERR("modules.deps.bin: out of memory\n");
-			continue;
-		}
+	err = depfile_write(depmod, dfd, f, tv, tmp);
+	if (err < 0 || depmod->cfg->sync)
+		return err;
 
-		linepos = 0;
-		slen = strlen(p);
-		memcpy(line + linepos, p, slen);
-		linepos += slen;
-		line[linepos] = ':';
-		linepos++;
+	return depfile_commit(dfd, depmod->cfg->outdirname, f, tmp);
+}
 
-		for (j = 0; j < n_deps; j++) {
-			const struct mod *d = deps[j];
-			const char *dp;
+struct depfile_writer {
+	struct depmod *depmod;
+	const struct depfile *f;
+	const struct timeval *tv;
+	struct depfile_tmp *tmp;
+	pthread_t thread;
+	bool started;
+	int dfd;
+	int err;
+};
 
-			line[linepos] = ' ';
-			linepos++;
+static void *depfile_writer_run(void *data)
+{
+	struct depfile_writer *w = data;
 
-			dp = mod_get_compressed_path(d);
-			slen = strlen(dp);
-			memcpy(line + linepos, dp, slen);
-			linepos += slen;
-		}
-		line[linepos] = '\0';
+	w->err = depmod_output_file(w->depmod, w->dfd, w->f, w->tv, w->tmp);
 
-		duplicate = index_insert(idx, mod->modname, line, mod->idx);
-		if (duplicate && depmod->cfg->warn_dups)
-			WRN("duplicate module deps:\n%s\n", line);
-		free(line);
-		free(deps);
+	return NULL;
+}
+
+/*
+ * Each index only reads the finished struct depmod, so with -j the first
+ * @n are all generated at the same time, one thread per file. The first
+ * error is reported in the order of the files either way.
+ */
+static int depmod_output_parallel(struct depmod *depmod, int dfd,
+				const struct timeval *tv,
+				struct depfile_tmp *tmps, size_t n)
+{
+	struct depfile_writer writers[sizeof(depfiles) / sizeof(depfiles[0])];
+	size_t i;
+	int err = 0;
+
+	for (i = 0; i < n; i++) {
+		struct depfile_writer *w = &writers[i];
+
+		*w = (struct depfile_writer) {
+			.depmod = depmod,
+			.f = &depmod->files[i],
+			.tv = tv,
+			.tmp = &tmps[i],
+			.dfd = dfd,
+		};
+
+		w->started = pthread_create(&w->thread, NULL,
+					    depfile_writer_run, w) == 0;
 	}
 
-	index_write(idx, out);
-	index_destroy(idx);
+	for (i = 0; i < n; i++) {
+		struct depfile_writer *w = &writers[i];
 
-	return 0;
+		if (w->started)
+			pthread_join(w->thread, NULL);
+		else
+			depfile_writer_run(w);
+
+		if (err == 0)
+			err = w->err;
+	}
+
+	return err;
 }
 
-static int output_aliases(struct depmod *depmod, FILE *out)
+/*
+ * With --sync, modules.bin packs the temporaries of the indexes, which are
+ * only renamed in place once they are all on disk.
+ */
+static int depmod_output_pending(struct depmod *depmod,
+					struct depfile_tmp *tmps, size_t n)
 {
 	size_t i;
+	int err;
 
-	fputs("# Aliases extracted from modules themselves.\n", out);
-
-	for (i = 0; i < depmod->modules.count; i++) {
-		const struct mod *mod = depmod->modules.array[i];
-		struct kmod_list *l;
-
-		kmod_list_foreach(l, mod->info_list) {
-			const char *key = kmod_module_info_get_key(l);
-			const char *value = kmod_module_info_get_value(l);
+	depmod->pending = hash_new(16, NULL);
+	if (depmod->pending == NULL)
+		return -ENOMEM;
 
-			if (!streq(key, "alias"))
-				continue;
+	for (i = 0; i < n; i++) {
+		if (tmps[i].name[0] == '\0')
+			continue;
 
-			fprintf(out, "alias %s %s\n", value, mod->modname);
-		}
+		err = hash_add(depmod->pending, depmod->files[i].name,
+								tmps[i].name);
+		if (err < 0)
+			return err;
 	}
 
 	return 0;
 }
 
-static int output_aliases_bin(struct depmod *depmod, FILE *out)
+static int depmod_output(struct depmod *depmod, FILE *out)
 {
-	struct index_node *idx;
-	size_t i;
+	struct depfile_tmp tmps[sizeof(depfiles) / sizeof(depfiles[0])];
+	const char *dname = depmod->cfg->outdirname;
+	const struct depfile *itr;
+	size_t i, n = 0;
+	int dfd, err = 0;
+	struct timeval tv;
+
+	depmod->files = depmod->cfg->delta ? deltafiles : depfiles;
+
+	if (out != NULL) {
+		for (itr = depmod->files; itr->name != NULL; itr++)
+			itr->cb(depmod, out);
+		return 0;
+	}
+
+	/* modules.bin, the last one, needs the other indexes */
+	for (itr = depmod->files; itr[1].name != NULL; itr++)
+		n++;
+
+	gettimeofday(&tv, NULL);
+
+	err = mkdir_p(dname, strlen(dname), 0755);
+	if (err < 0) {
+		CRIT("could not create directory %s: %m\n", dname);
+		return err;
+	}
+	dfd = open(dname, O_RDONLY);
+	if (dfd < 0) {
+		err = -errno;
+		CRIT("could not open directory %s: %m\n", dname);
+		return err;
+	}
 
-	if (out == stdout)
-		return 0;
+	for (i = 0; i <= n; i++)
+		tmps[i].name[0] = '\0';
 
-	idx = index_create();
-	if (idx == NULL)
-		return -ENOMEM;
+	if (depmod->cfg->jobs != 1) {
+		err = depmod_output_parallel(depmod, dfd, &tv, tmps, n);
+	} else {
+		for (i = 0; i < n && err == 0; i++)
+			err = depmod_output_file(depmod, dfd,
+						&depmod->files[i], &tv, &tmps[i]);
+	}
 
-	for (i = 0; i < depmod->modules.count; i++) {
-		const struct mod *mod = depmod->modules.array[i];
-		struct kmod_list *l;
+	if (err == 0 && depmod->cfg->sync) {
+		err = depmod_output_pending(depmod, tmps, n);
+		if (err < 0)
+			ERR("could not allocate memory\n");
+	}
 
-		kmod_list_foreach(l, mod->info_list) {
-			const char *key = kmod_module_info_get_key(l);
-			const char *value = kmod_module_info_get_value(l);
-			char buf[PATH_MAX];
-			const char *alias;
-			int duplicate;
+	if (err == 0)
+		err = depmod_output_file(depmod, dfd, &depmod->files[n], &tv,
+								&tmps[n]);
 
-			if (!streq(key, "alias"))
-				continue;
+	hash_free(depmod->pending);
+	depmod->pending = NULL;
 
-			if (alias_normalize(value, buf, NULL) < 0) {
-				WRN("Unmatched bracket in %s\n", value);
-				continue;
-			}
-			alias = buf;
+	/*
+	 * Everything is on disk: the renames make the whole set visible,
+	 * or on errors none of it and the previous files stay.
+	 */
+	if (depmod->cfg->sync) {
+		for (i = 0; i <= n; i++) {
+			if (err == 0)
+				err = depfile_commit(dfd, dname,
+						&depmod->files[i], &tmps[i]);
+			else
+				depfile_tmp_discard(dfd, dname, &tmps[i]);
+		}
+	}
 
-			duplicate = index_insert(idx, alias, mod->modname,
-						 mod->idx);
-			if (duplicate && depmod->cfg->warn_dups)
-				WRN("duplicate module alias:\n%s %s\n",
-				    alias, mod->modname);
+	/* a full run compacts the deltas into the files above */
+	if (err == 0 && !depmod->cfg->delta) {
+		for (itr = deltafiles; itr->name != NULL; itr++) {
+			if (unlinkat(dfd, itr->name, 0) < 0 && errno != ENOENT)
+				ERR("unlinkat(%s, %s): %m\n", dname, itr->name);
 		}
 	}
 
-	index_write(idx, out);
-	index_destroy(idx);
+	if (err == 0 && depmod->cfg->sync && fsync(dfd) < 0) {
+		err = -errno;
+		CRIT("fsync(%s): %m\n", dname);
+	}
 
-	return 0;
+	close(dfd);
+
+	return err;
 }
 
-static int output_softdeps(struct depmod *depmod, FILE *out)
+static void depmod_add_fake_syms(struct depmod *depmod)
 {
-	size_t i;
+	/* __this_module is magic inserted by kernel loader. */
+	depmod_symbol_add(depmod, "__this_module", true, 0, NULL);
+	/* On S390, this is faked up too */
+	depmod_symbol_add(depmod, "_GLOBAL_OFFSET_TABLE_", true, 0, NULL);
+	/* On PowerPC64 ABIv2, .TOC. is more or less _GLOBAL_OFFSET_TABLE_ */
+	if (!depmod_symbol_find(depmod, "TOC."))
+		depmod_symbol_add(depmod, "TOC.", true, 0, NULL);
+}
 
-	fputs("# Soft dependencies extracted from modules themselves.\n", out);
+/* next token delimited by spaces or tabs in [*p, end), like strtok() */
+static const char *symvers_token(const char **p, const char *end, size_t *len)
+{
+	const char *tok = *p;
 
-	for (i = 0; i < depmod->modules.count; i++) {
-		const struct mod *mod = depmod->modules.array[i];
-		struct kmod_list *l;
+	while (tok < end && (*tok == ' ' || *tok == '\t'))
+		tok++;
+	if (tok == end)
+		return NULL;
 
-		kmod_list_foreach(l, mod->info_list) {
-			const char *key = kmod_module_info_get_key(l);
-			const char *value = kmod_module_info_get_value(l);
+	*p = tok;
+	while (*p < end && **p != ' ' && **p != '\t')
+		(*p)++;
+	*len = *p - tok;
 
-			if (!streq(key, "softdep"))
-				continue;
+	return tok;
+}
 
-			fprintf(out, "softdep %s %s\n", mod->modname, value);
-		}
+static int depmod_load_symvers(struct depmod *depmod, const char *filename)
+{
+	const char *p, *end;
+	unsigned int linenum = 0;
+	size_t size;
+	void *mem;
+	int fd, err;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		err = -errno;
+		DBG("load symvers: %s: %m\n", filename);
+		return err;
 	}
+	err = fdmap(fd, &mem, &size);
+	if (err < 0) {
+		DBG("load symvers: %s: %s\n", filename, strerror(-err));
+		return err;
+	}
+	DBG("load symvers: %s\n", filename);
 
-	return 0;
-}
+	/* about one symbol from vmlinux per 64 bytes */
+	hash_reserve(depmod->symbols,
+		     hash_get_count(depmod->symbols) + size / 64);
 
-static int output_symbols(struct depmod *depmod, FILE *out)
-{
-	struct hash_iter iter;
-	const void *v;
+	/* eg. "0xb352177e\tfind_first_bit\tvmlinux\tEXPORT_SYMBOL" */
+	for (p = mem, end = p + size; p < end; linenum++) {
+		const char *line = p, *lineend, *ver, *sym, *where;
+		size_t verlen, symlen, wherelen;
+		char verbuf[32], *verend;
+		uint64_t crc;
 
-	fputs("# Aliases for symbols, used by symbol_request().\n", out);
+		/* the newline is part of the last token, as with fgets() */
+		lineend = memchr(line, '\n', end - line);
+		lineend = lineend != NULL ? lineend + 1 : end;
+		p = lineend;
 
-	hash_iter_init(depmod->symbols, &iter);
+		ver = symvers_token(&line, lineend, &verlen);
+		sym = symvers_token(&line, lineend, &symlen);
+		where = symvers_token(&line, lineend, &wherelen);
+		if (!ver || !sym || !where)
+			continue;
 
-	while (hash_iter_next(&iter, NULL, &v)) {
-		const struct symbol *sym = v;
-		if (sym->owner == NULL)
+		if (wherelen != strlen("vmlinux") ||
+				memcmp(where, "vmlinux", wherelen) != 0)
 			continue;
 
-		fprintf(out, "alias symbol:%s %s\n",
-					sym->name, sym->owner->modname);
+		if (verlen >= sizeof(verbuf))
+			goto invalid_version;
+		memcpy(verbuf, ver, verlen);
+		verbuf[verlen] = '\0';
+
+		crc = strtoull(verbuf, &verend, 16);
+		if (verend[0] != '\0')
+			goto invalid_version;
+
+		depmod_symbol_add_len(depmod, sym, symlen, false, crc, NULL);
+		continue;
+
+	invalid_version:
+		ERR("%s:%u Invalid symbol version %.*s\n",
+		    filename, linenum + 1, (int)verlen, ver);
 	}
+	depmod_add_fake_syms(depmod);
+
+	DBG("loaded symvers: %s\n", filename);
 
+	if (mem != NULL)
+		munmap(mem, size);
 	return 0;
 }
 
-static int output_symbols_bin(struct depmod *depmod, FILE *out)
+static int depmod_load_system_map(struct depmod *depmod, const char *filename)
 {
-	struct index_node *idx;
-	char alias[1024];
-	_cleanup_(scratchbuf_release) struct scratchbuf salias =
-		SCRATCHBUF_INITIALIZER(alias);
-	size_t baselen = sizeof("symbol:") - 1;
-	struct hash_iter iter;
-	const void *v;
-	int ret = 0;
-
-	if (out == stdout)
-		return 0;
+	const char ksymstr[] = "__ksymtab_";
+	const size_t ksymstr_len = sizeof(ksymstr) - 1;
+	const char *p, *end;
+	unsigned int linenum = 0;
+	size_t size;
+	void *mem;
+	int fd, err;
 
-	idx = index_create();
-	if (idx == NULL)
-		return -ENOMEM;
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		err = -errno;
+		DBG("load System.map: %s: %m\n", filename);
+		return err;
+	}
+	err = fdmap(fd, &mem, &size);
+	if (err < 0) {
+		DBG("load System.map: %s: %s\n", filename, strerror(-err));
+		return err;
+	}
+	DBG("load System.map: %s\n", filename);
 
-	memcpy(alias, "symbol:", baselen);
+	/* __ksymtab_ entries are a small part of the file */
+	hash_reserve(depmod->symbols,
+		     hash_get_count(depmod->symbols) + size / 256);
 
-	hash_iter_init(depmod->symbols, &iter);
+	/* eg. c0294200 R __ksymtab_devfs_alloc_devnum */
+	for (p = mem, end = p + size; p < end; linenum++) {
+		const char *line = p, *lineend, *sym;
 
-	while (hash_iter_next(&iter, NULL, &v)) {
-		int duplicate;
-		const struct symbol *sym = v;
-		size_t len;
+		lineend = memchr(line, '\n', end - line);
+		p = lineend != NULL ? lineend + 1 : end;
+		if (lineend == NULL)
+			lineend = end;
 
-		if (sym->owner == NULL)
+		sym = memchr(line, ' ', lineend - line);
+		if (sym != NULL)
+			sym = memchr(sym + 1, ' ', lineend - sym - 1);
+		if (sym == NULL) {
+			ERR("%s:%u: invalid line: %.*s\n", filename,
+			    linenum + 1, (int)(lineend - line), line);
 			continue;
-
-		len = strlen(sym->name);
-
-		if (scratchbuf_alloc(&salias, baselen + len + 1) < 0) {
-			ret = -ENOMEM;
-			goto err_scratchbuf;
 		}
-		memcpy(scratchbuf_str(&salias) + baselen, sym->name, len + 1);
-		duplicate = index_insert(idx, alias, sym->owner->modname,
-							sym->owner->idx);
+		sym++;
 
-		if (duplicate && depmod->cfg->warn_dups)
-			WRN("duplicate module syms:\n%s %s\n",
-						alias, sym->owner->modname);
-	}
+		/* skip prefix */
+		if (sym < lineend && sym[0] == depmod->cfg->sym_prefix)
+			sym++;
 
-	index_write(idx, out);
+		/* Covers gpl-only and normal symbols. */
+		if ((size_t)(lineend - sym) < ksymstr_len ||
+				memcmp(sym, ksymstr, ksymstr_len) != 0)
+			continue;
 
-err_scratchbuf:
-	index_destroy(idx);
+		sym += ksymstr_len;
+		depmod_symbol_add_len(depmod, sym, lineend - sym, true, 0, NULL);
+	}
+	depmod_add_fake_syms(depmod);
 
-	if (ret < 0)
-		ERR("output symbols: %s\n", strerror(-ret));
+	DBG("loaded System.map: %s\n", filename);
 
-	return ret;
+	if (mem != NULL)
+		munmap(mem, size);
+	return 0;
 }
 
-static int output_builtin_bin(struct depmod *depmod, FILE *out)
+
+/*
+ * Subdirectories whose path, relative to the module dir at @rootlen, is in
+ * @known are skipped: they are checked on their own from the stamp file.
+ */
+static int depfile_up_to_date_dir(DIR *d, time_t mtime, size_t baselen, char *path,
+				  const struct hash *known, size_t rootlen)
 {
-	FILE *in;
-	struct index_node *idx;
-	char line[PATH_MAX], modname[PATH_MAX];
+	struct dirent *de;
+	int err = 1, dfd = dirfd(d);
 
-	if (out == stdout)
-		return 0;
+	while ((de = readdir(d)) != NULL) {
+		const char *name = de->d_name;
+		size_t namelen;
+		struct stat st;
 
-	in = dfdopen(depmod->cfg->dirname, "modules.builtin", O_RDONLY, "r");
-	if (in == NULL)
-		return 0;
+		if (name[0] == '.' && (name[1] == '\0' ||
+				       (name[1] == '.' && name[2] == '\0')))
+			continue;
+		if (streq(name, "build") || streq(name, "source"))
+			continue;
+		namelen = strlen(name);
+		if (baselen + namelen + 2 >= PATH_MAX) {
+			path[baselen] = '\0';
+			ERR("path is too long %s%s\n", path, name);
+			continue;
+		}
 
-	idx = index_create();
-	if (idx == NULL) {
-		fclose(in);
-		return -ENOMEM;
-	}
+		if (fstatat(dfd, name, &st, 0) < 0) {
+			ERR("fstatat(%d, %s): %m\n", dfd, name);
+			continue;
+		}
 
-	while (fgets(line, sizeof(line), in) != NULL) {
-		if (!isalpha(line[0])) {
-			ERR("Invalid modules.builtin line: %s\n", line);
+		if (S_ISDIR(st.st_mode)) {
+			int fd;
+			DIR *subdir;
+			memcpy(path + baselen, name, namelen + 1);
+			if (known != NULL && hash_find(known, path + rootlen))
+				continue;
+			if (baselen + namelen + 2 + NAME_MAX >= PATH_MAX) {
+				ERR("directory path is too long %s\n", path);
+				continue;
+			}
+			fd = openat(dfd, name, O_RDONLY);
+			if (fd < 0) {
+				ERR("openat(%d, %s, O_RDONLY): %m\n",
+				    dfd, name);
+				continue;
+			}
+			subdir = fdopendir(fd);
+			if (subdir == NULL) {
+				ERR("fdopendir(%d): %m\n", fd);
+				close(fd);
+				continue;
+			}
+			path[baselen + namelen] = '/';
+			path[baselen + namelen + 1] = '\0';
+			err = depfile_up_to_date_dir(subdir, mtime,
+						     baselen + namelen + 1,
+						     path, known, rootlen);
+			closedir(subdir);
+		} else if (S_ISREG(st.st_mode)) {
+			if (!path_ends_with_kmod_ext(name, namelen))
+				continue;
+
+			memcpy(path + baselen, name, namelen + 1);
+			err = st.st_mtime <= mtime;
+			if (err == 0) {
+				DBG("%s %"PRIu64" is newer than %"PRIu64"\n",
+				    path, (uint64_t)st.st_mtime,
+				    (uint64_t)mtime);
+			}
+		} else {
+			ERR("unsupported file type %s: %o\n",
+			    path, st.st_mode & S_IFMT);
 			continue;
 		}
-
-		path_to_modname(line, modname, NULL);
-		index_insert(idx, modname, "", 0);
+
+		if (err == 0)
+			break; /* outdated! */
+		else if (err < 0) {
+			path[baselen + namelen] = '\0';
+			ERR("failed %s: %s\n", path, strerror(-err));
+			err = 1; /* ignore errors */
+		}
 	}
 
-	index_write(idx, out);
-	index_destroy(idx);
-	fclose(in);
-
-	return 0;
+	return err;
 }
 
-static int flush_stream(FILE *in, int endchar)
+/* check the directories that changed since the stamp file was written */
+static int depfile_stamps_check(struct cache_reader r, int dfd,
+				const struct hash *known, time_t mtime,
+				const char *dirname)
 {
-	size_t i = 0;
-	int c;
+	char path[PATH_MAX];
+	size_t rootlen = strlen(dirname) + 1;
 
-	for (c = fgetc(in);
-	     c != EOF && c != endchar && c != '\0';
-	     c = fgetc(in))
-		;
+	memcpy(path, dirname, rootlen - 1);
+	path[rootlen - 1] = '/';
 
-	return c == endchar ? i : 0;
-}
+	while (r.p < r.end) {
+		const char *relpath;
+		uint64_t mstamp, nlink;
+		struct stat st;
+		size_t baselen;
+		uint32_t len;
+		DIR *d;
+		int fd, err;
+
+		/* already validated */
+		if ((relpath = cache_read_str(&r, &len)) == NULL ||
+				!cache_read(&r, &mstamp, sizeof(mstamp)) ||
+				!cache_read(&r, &nlink, sizeof(nlink)))
+			return 0;
 
-static int flush_stream_to(FILE *in, int endchar, char *dst, size_t dst_sz)
-{
-	size_t i = 0;
-	int c;
+		fd = openat(dfd, len ? relpath : ".",
+				O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) {
+			DBG("%s/%s is gone\n", dirname, relpath);
+			return 0;
+		}
+
+		if (fstat(fd, &st) == 0 && stat_mstamp(&st) == mstamp &&
+						st.st_nlink == nlink) {
+			close(fd);
+			continue;
+		}
+
+		baselen = rootlen + len;
+		if (baselen + 1 + NAME_MAX >= PATH_MAX) {
+			close(fd);
+			return 0;
+		}
+		memcpy(path + rootlen, relpath, len);
+		if (len > 0)
+			path[baselen++] = '/';
+		path[baselen] = '\0';
 
-	for (c = fgetc(in);
-	     c != EOF && c != endchar && c != '\0' && i < dst_sz;
-	     c = fgetc(in))
-		dst[i++] = c;
+		d = fdopendir(fd);
+		if (d == NULL) {
+			close(fd);
+			return 0;
+		}
 
-	if (i == dst_sz) {
-		WRN("Could not flush stream: %d. Partial content: %.*s\n",
-		    ENOSPC, (int) dst_sz, dst);
-		i--;
+		DBG("%s changed, checking its modules\n", path);
+		err = depfile_up_to_date_dir(d, mtime, baselen, path, known,
+					     rootlen);
+		closedir(d);
+		if (err != 1)
+			return err < 0 ? 0 : err;
 	}
 
-	return c == endchar ? i : 0;
+	return 1;
 }
 
-static int output_builtin_alias_bin(struct depmod *depmod, FILE *out)
+/* uptodate: 1, outdated: 0, no usable stamp file: < 0 */
+static int depfile_stamps_up_to_date(int dfd, const char *dirname,
+						const struct stat *dep_st)
 {
-	FILE *in;
-	struct index_node *idx;
-	int ret;
-
-	if (out == stdout)
-		return 0;
+	struct cache_reader r, records;
+	const char *version;
+	uint64_t stamp[3];
+	struct hash *known;
+	struct stat st;
+	uint32_t magic, len;
+	void *mem;
+	int fd, err = -EINVAL;
 
-	in = dfdopen(depmod->cfg->dirname, "modules.builtin.modinfo", O_RDONLY, "r");
-	if (in == NULL)
-		return 0;
+	fd = openat(dfd, DEPMOD_STAMP_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
 
-	idx = index_create();
-	if (idx == NULL) {
-		fclose(in);
-		return -ENOMEM;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return -EINVAL;
 	}
 
-	/* format: modname.key=value\0 */
-	while (!feof(in) && !ferror(in)) {
-		char alias[PATH_MAX];
-		char modname[PATH_MAX];
-		char value[PATH_MAX];
-		size_t len;
-
-		len = flush_stream_to(in, '.', modname, sizeof(modname));
-		modname[len] = '\0';
-		if (!len)
-			continue;
-
-		len = flush_stream_to(in, '=', value, sizeof(value));
-		value[len] = '\0';
-		if (!streq(value, "alias")) {
-			flush_stream(in, '\0');
-			continue;
-		}
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return -errno;
 
-		len = flush_stream_to(in, '\0', value, sizeof(value));
-		value[len] = '\0';
-		if (!len)
-			continue;
+	known = hash_new(64, NULL);
+	if (known == NULL)
+		goto out;
 
-		alias[0] = '\0';
-		if (alias_normalize(value, alias, NULL) < 0) {
-			WRN("Unmatched bracket in %s\n", value);
-			continue;
-		}
+	r.p = mem;
+	r.end = r.p + st.st_size;
+
+	if (!cache_read(&r, &magic, sizeof(magic)) ||
+			magic != DEPMOD_STAMP_MAGIC ||
+			(version = cache_read_str(&r, &len)) == NULL ||
+			!streq(version, VERSION) ||
+			!cache_read(&r, stamp, sizeof(stamp)) ||
+			stamp[0] != (uint64_t) dep_st->st_ino ||
+			stamp[1] != (uint64_t) dep_st->st_size ||
+			stamp[2] != stat_mstamp(dep_st))
+		goto out;
 
-		index_insert(idx, alias, modname, 0);
-	}
+	/* validate everything and collect the paths before the checks */
+	records = r;
+	while (r.p < r.end) {
+		const char *relpath;
+		uint64_t v[2];
 
-	if (ferror(in)) {
-		ret = -EINVAL;
-	} else {
-		index_write(idx, out);
-		ret = 0;
+		if ((relpath = cache_read_str(&r, &len)) == NULL ||
+				!cache_read(&r, v, sizeof(v)) ||
+				hash_add_len(known, relpath, len, relpath) < 0)
+			goto out;
 	}
 
-	index_destroy(idx);
-	fclose(in);
+	err = depfile_stamps_check(records, dfd, known, dep_st->st_mtime,
+								dirname);
 
-	return ret;
+out:
+	if (err < 0)
+		DBG("ignoring %s/%s\n", dirname, DEPMOD_STAMP_FILE);
+	hash_free(known);
+	munmap(mem, st.st_size);
+	return err;
 }
 
-static int output_devname(struct depmod *depmod, FILE *out)
+/* uptodate: 1, outdated: 0, errors < 0 */
+static int depfile_up_to_date(const char *dirname)
 {
-	size_t i;
-	bool empty = true;
+	char path[PATH_MAX];
+	DIR *d = opendir(dirname);
+	struct stat st;
+	size_t baselen;
+	int err;
+	if (d == NULL) {
+		err = -errno;
+		ERR("could not open directory %s: %m\n", dirname);
+		return err;
+	}
 
-	for (i = 0; i < depmod->modules.count; i++) {
-		const struct mod *mod = depmod->modules.array[i];
-		struct kmod_list *l;
-		const char *devname = NULL;
-		char type = '\0';
-		unsigned int major = 0, minor = 0;
+	if (fstatat(dirfd(d), "modules.dep", &st, 0) != 0) {
+		err = -errno;
+		ERR("could not fstatat(%s, modules.dep): %m\n", dirname);
+		closedir(d);
+		return err;
+	}
 
-		kmod_list_foreach(l, mod->info_list) {
-			const char *key = kmod_module_info_get_key(l);
-			const char *value = kmod_module_info_get_value(l);
-			unsigned int maj, min;
+	err = depfile_stamps_up_to_date(dirfd(d), dirname, &st);
+	if (err >= 0) {
+		closedir(d);
+		return err;
+	}
 
-			if (!streq(key, "alias"))
-				continue;
+	baselen = strlen(dirname);
+	memcpy(path, dirname, baselen);
+	path[baselen] = '/';
+	baselen++;
+	path[baselen] = '\0';
 
-			if (strstartswith(value, "devname:"))
-				devname = value + sizeof("devname:") - 1;
-			else if (sscanf(value, "char-major-%u-%u",
-						&maj, &min) == 2) {
-				type = 'c';
-				major = maj;
-				minor = min;
-			} else if (sscanf(value, "block-major-%u-%u",
-						&maj, &min) == 2) {
-				type = 'b';
-				major = maj;
-				minor = min;
-			}
+	err = depfile_up_to_date_dir(d, st.st_mtime, baselen, path, NULL, 0);
+	closedir(d);
+	return err;
+}
 
-			if (type != '\0' && devname != NULL)
-				break;
-		}
+static int is_version_number(const char *version)
+{
+	unsigned int d1, d2;
+	return (sscanf(version, "%u.%u", &d1, &d2) == 2);
+}
 
-		if (devname != NULL) {
-			if (type != '\0') {
-				if (empty) {
-					fputs("# Device nodes to trigger on-demand module loading.\n",
-					      out);
-					empty = false;
-				}
-				fprintf(out, "%s %s %c%u:%u\n", mod->modname,
-					devname, type, major, minor);
-                        } else
-				ERR("Module '%s' has devname (%s) but "
-				    "lacks major and minor information. "
-				    "Ignoring.\n", mod->modname, devname);
-		}
+static void stats_json_str(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(fp, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			fprintf(fp, "\\u%04x", *str);
+		else
+			fputc(*str, fp);
 	}
+	fputc('"', fp);
+}
 
-	return 0;
+static void stats_json_time(FILE *fp, const struct stats_time *t)
+{
+	fprintf(fp, "\"wall_ns\":%"PRIu64",\"cpu_ns\":%"PRIu64,
+		t->wall, t->cpu);
 }
 
-static int depmod_output(struct depmod *depmod, FILE *out)
+static void stats_text_line(FILE *fp, const char *name,
+				const struct stats_time *t, uint64_t bytes)
 {
-	static const struct depfile {
-		const char *name;
-		int (*cb)(struct depmod *depmod, FILE *out);
-	} *itr, depfiles[] = {
-		{ "modules.dep", output_deps },
-		{ "modules.dep.bin", output_deps_bin },
-		{ "modules.alias", output_aliases },
-		{ "modules.alias.bin", output_aliases_bin },
-		{ "modules.softdep", output_softdeps },
-		{ "modules.symbols", output_symbols },
-		{ "modules.symbols.bin", output_symbols_bin },
-		{ "modules.builtin.bin", output_builtin_bin },
-		{ "modules.builtin.alias.bin", output_builtin_alias_bin },
-		{ "modules.devname", output_devname },
-		{ }
-	};
-	const char *dname = depmod->cfg->outdirname;
-	int dfd, err = 0;
-	struct timeval tv;
+	fprintf(fp, "  %-28s %10.3f %10.3f", name, t->wall / 1e6, t->cpu / 1e6);
+	if (bytes > 0)
+		fprintf(fp, " %12"PRIu64, bytes);
+	fputc('\n', fp);
+}
 
-	gettimeofday(&tv, NULL);
+/*
+ * Printed as a whole on stderr, so that the reports of kernels running at
+ * the same time don't mix. Json is one object per kernel and per line.
+ */
+static void depmod_stats_print(const struct depmod *depmod,
+						enum stats_format format)
+{
+	const struct depmod_stats *st = &depmod->stats;
+	const char *kversion = depmod->cfg->kversion;
+	unsigned int n_symbols = hash_get_count(depmod->symbols);
+	uint64_t written = 0;
+	char *report = NULL;
+	size_t i, size;
+	FILE *fp;
 
-	if (out != NULL)
-		dfd = -1;
-	else {
-		err = mkdir_p(dname, strlen(dname), 0755);
-		if (err < 0) {
-			CRIT("could not create directory %s: %m\n", dname);
-			return err;
+	fp = open_memstream(&report, &size);
+	if (fp == NULL)
+		return;
+
+	for (i = 0; depmod->files[i].name != NULL; i++)
+		written += st->files[i].bytes;
+
+	if (format == STATS_JSON) {
+		fputs("{\"kernel\":", fp);
+		stats_json_str(fp, kversion);
+		fprintf(fp, ",\"modules\":%zu,\"modules_read\":%"PRIu64
+			",\"symbols\":%u,\"phases\":{",
+			depmod->modules.count, st->modules_read, n_symbols);
+		fputs("\"search\":{", fp);
+		stats_json_time(fp, &st->search);
+		fputs("},\"load\":{", fp);
+		stats_json_time(fp, &st->load);
+		fprintf(fp, ",\"bytes_read\":%"PRIu64"},\"dependencies\":{",
+			st->bytes_read);
+		stats_json_time(fp, &st->deps);
+		fputs("},\"output\":{", fp);
+		stats_json_time(fp, &st->output);
+		fprintf(fp, ",\"bytes_written\":%"PRIu64"}},\"files\":{",
+			written);
+		for (i = 0; depmod->files[i].name != NULL; i++) {
+			fprintf(fp, "%s\"%s\":{", i > 0 ? "," : "",
+				depmod->files[i].name);
+			stats_json_time(fp, &st->files[i].time);
+			fprintf(fp, ",\"bytes\":%"PRIu64"}",
+				st->files[i].bytes);
 		}
-		dfd = open(dname, O_RDONLY);
-		if (dfd < 0) {
-			err = -errno;
-			CRIT("could not open directory %s: %m\n", dname);
-			return err;
+		fputs("}}\n", fp);
+	} else {
+		fprintf(fp, "depmod %s: %zu modules, %"PRIu64" read, %u symbols\n",
+			kversion, depmod->modules.count, st->modules_read,
+			n_symbols);
+		fprintf(fp, "  %-28s %10s %10s %12s\n",
+			"phase", "wall ms", "cpu ms", "bytes");
+		stats_text_line(fp, "search", &st->search, 0);
+		stats_text_line(fp, "load", &st->load, st->bytes_read);
+		stats_text_line(fp, "dependencies", &st->deps, 0);
+		stats_text_line(fp, "output", &st->output, written);
+		for (i = 0; depmod->files[i].name != NULL; i++) {
+			char name[NAME_MAX];
+
+			snprintf(name, sizeof(name), "  %s",
+							depmod->files[i].name);
+			stats_text_line(fp, name, &st->files[i].time,
+					st->files[i].bytes);
 		}
 	}
 
-	for (itr = depfiles; itr->name != NULL; itr++) {
-		FILE *fp = out;
-		char tmp[NAME_MAX] = "";
-		int r, ferr;
-
-		if (fp == NULL) {
-			int flags = O_CREAT | O_EXCL | O_WRONLY;
-			int mode = 0644;
-			int fd;
-
-			snprintf(tmp, sizeof(tmp), "%s.%i.%li.%li", itr->name, getpid(),
-					tv.tv_usec, tv.tv_sec);
-			fd = openat(dfd, tmp, flags, mode);
-			if (fd < 0) {
-				ERR("openat(%s, %s, %o, %o): %m\n",
-				    dname, tmp, flags, mode);
-				continue;
-			}
-			fp = fdopen(fd, "wb");
-			if (fp == NULL) {
-				ERR("fdopen(%d=%s/%s): %m\n", fd, dname, tmp);
-				close(fd);
-				continue;
-			}
-		}
+	if (fclose(fp) == 0)
+		fputs(report, stderr);
+	free(report);
+}
 
-		r = itr->cb(depmod, fp);
-		if (fp == out)
-			continue;
+/* what do_depmod() was told, for each kernel */
+struct depmod_opts {
+	const char *root;
+	const char *out_root;
+	const struct cfg_lines *cfg_lines;
+	const char *system_map;
+	const char *module_symvers;
+	FILE *out;
+	bool all;
+	bool maybe_all;
+	char **paths; /* of the modules to use instead of all */
+	int n_paths;
+	struct depmod_shared *shared;
+};
 
-		ferr = ferror(fp) | fclose(fp);
+static int depmod_run(const struct depmod_opts *opts, struct cfg *cfg)
+{
+	const char *null_kmod_config = NULL;
+	struct kmod_ctx *ctx;
+	struct depmod depmod;
+	bool all = opts->all;
+	int err, i;
 
-		if (r < 0) {
-			if (unlinkat(dfd, tmp, 0) != 0)
-				ERR("unlinkat(%s, %s): %m\n", dname, tmp);
+	memset(&depmod, 0, sizeof(depmod));
 
-			ERR("Could not write index '%s': %s\n", itr->name,
-								strerror(-r));
-			err = -errno;
-			break;
-		}
+	cfg->dirnamelen = snprintf(cfg->dirname, PATH_MAX,
+				   "%s/lib/modules/%s",
+				   opts->root ?: "", cfg->kversion);
 
-		if (renameat(dfd, tmp, dfd, itr->name) != 0) {
-			err = -errno;
-			CRIT("renameat(%s, %s, %s, %s): %m\n",
-					dname, tmp, dname, itr->name);
-			break;
-		}
+	cfg->outdirnamelen = snprintf(cfg->outdirname, PATH_MAX,
+				      "%s/lib/modules/%s",
+				      opts->out_root ?: (opts->root ?: ""),
+				      cfg->kversion);
 
-		if (ferr) {
-			err = -ENOSPC;
-			ERR("Could not create index '%s'. Output is truncated: %s\n",
-						itr->name, strerror(-err));
-			break;
-		}
+	if (opts->maybe_all) {
+		if (opts->out == stdout)
+			return 0;
+		/* ignore up-to-date errors (< 0) */
+		if (depfile_up_to_date(cfg->dirname) == 1)
+			return 0;
+		all = true;
 	}
 
-	if (dfd >= 0)
-		close(dfd);
+	/* the deltas are of all the modules, and only written to files */
+	if (cfg->delta && (!all || opts->out != NULL)) {
+		CRIT("--delta needs all the modules and can't be used with -n\n");
+		return -EINVAL;
+	}
 
-	return err;
-}
+	if (cfg->compress && cfg->index_version < 3) {
+		CRIT("--compress-indexes can't be used with --index-version=2\n");
+		return -EINVAL;
+	}
 
-static void depmod_add_fake_syms(struct depmod *depmod)
-{
-	/* __this_module is magic inserted by kernel loader. */
-	depmod_symbol_add(depmod, "__this_module", true, 0, NULL);
-	/* On S390, this is faked up too */
-	depmod_symbol_add(depmod, "_GLOBAL_OFFSET_TABLE_", true, 0, NULL);
-	/* On PowerPC64 ABIv2, .TOC. is more or less _GLOBAL_OFFSET_TABLE_ */
-	if (!depmod_symbol_find(depmod, "TOC."))
-		depmod_symbol_add(depmod, "TOC.", true, 0, NULL);
-}
+	ctx = kmod_new(cfg->dirname, &null_kmod_config);
+	if (ctx == NULL) {
+		CRIT("kmod_new(\"%s\", {NULL}) failed: %m\n", cfg->dirname);
+		return -ENOMEM;
+	}
 
-static int depmod_load_symvers(struct depmod *depmod, const char *filename)
-{
-	char line[10240];
-	FILE *fp;
-	unsigned int linenum = 0;
+	log_setup_kmod_log(ctx, verbose);
 
-	fp = fopen(filename, "r");
-	if (fp == NULL) {
-		int err = -errno;
-		DBG("load symvers: %s: %m\n", filename);
+	err = depmod_init(&depmod, cfg, ctx);
+	if (err < 0) {
+		CRIT("depmod_init: %s\n", strerror(-err));
+		kmod_unref(ctx);
 		return err;
 	}
-	DBG("load symvers: %s\n", filename);
-
-	/* eg. "0xb352177e\tfind_first_bit\tvmlinux\tEXPORT_SYMBOL" */
-	while (fgets(line, sizeof(line), fp) != NULL) {
-		const char *ver, *sym, *where;
-		char *verend;
-		uint64_t crc;
-
-		linenum++;
-
-		ver = strtok(line, " \t");
-		sym = strtok(NULL, " \t");
-		where = strtok(NULL, " \t");
-		if (!ver || !sym || !where)
-			continue;
-
-		if (!streq(where, "vmlinux"))
-			continue;
+	depmod.cache.shared = opts->shared;
 
-		crc = strtoull(ver, &verend, 16);
-		if (verend[0] != '\0') {
-			ERR("%s:%u Invalid symbol version %s: %m\n",
-			    filename, linenum, ver);
-			continue;
+	if (opts->module_symvers != NULL) {
+		err = depmod_load_symvers(&depmod, opts->module_symvers);
+		if (err < 0) {
+			CRIT("could not load %s: %s\n", opts->module_symvers,
+			     strerror(-err));
+			goto out;
 		}
-
-		depmod_symbol_add(depmod, sym, false, crc, NULL);
+	} else if (opts->system_map != NULL) {
+		err = depmod_load_system_map(&depmod, opts->system_map);
+		if (err < 0) {
+			CRIT("could not load %s: %s\n", opts->system_map,
+			     strerror(-err));
+			goto out;
+		}
+	} else if (cfg->print_unknown) {
+		WRN("-e needs -E or -F\n");
+		cfg->print_unknown = 0;
 	}
-	depmod_add_fake_syms(depmod);
 
-	DBG("loaded symvers: %s\n", filename);
+	if (all) {
+		err = cfg_load(cfg, opts->cfg_lines);
+		if (err < 0) {
+			CRIT("could not load configuration files\n");
+			goto out;
+		}
+		stats_start(&depmod.stats.search, CLOCK_PROCESS_CPUTIME_ID);
+		if (opts->out == NULL)
+			depmod_stamps_scan(&depmod);
 
-	fclose(fp);
-	return 0;
-}
+		err = depmod_modules_search(&depmod);
+		stats_stop(&depmod.stats.search, CLOCK_PROCESS_CPUTIME_ID);
+		if (err < 0) {
+			CRIT("could not search modules: %s\n", strerror(-err));
+			goto out;
+		}
+	} else {
+		for (i = 0; i < opts->n_paths; i++) {
+			const char *path = opts->paths[i];
+			struct kmod_module *mod;
 
-static int depmod_load_system_map(struct depmod *depmod, const char *filename)
-{
-	const char ksymstr[] = "__ksymtab_";
-	const size_t ksymstr_len = sizeof(ksymstr) - 1;
-	char line[10240];
-	FILE *fp;
-	unsigned int linenum = 0;
+			if (path[0] != '/') {
+				CRIT("%s: not absolute path.\n", path);
+				err = -EINVAL;
+				goto out;
+			}
+
+			err = kmod_module_new_from_path(depmod.ctx, path, &mod);
+			if (err < 0) {
+				CRIT("could not create module %s: %s\n",
+				     path, strerror(-err));
+				goto out;
+			}
 
-	fp = fopen(filename, "r");
-	if (fp == NULL) {
-		int err = -errno;
-		DBG("load System.map: %s: %m\n", filename);
-		return err;
+			err = depmod_module_add(&depmod, mod, NULL);
+			if (err < 0) {
+				CRIT("could not add module %s: %s\n",
+				     path, strerror(-err));
+				kmod_module_unref(mod);
+				goto out;
+			}
+		}
 	}
-	DBG("load System.map: %s\n", filename);
 
-	/* eg. c0294200 R __ksymtab_devfs_alloc_devnum */
-	while (fgets(line, sizeof(line), fp) != NULL) {
-		char *p, *end;
+	err = depmod_modules_build_array(&depmod);
+	if (err < 0) {
+		CRIT("could not build module array: %s\n",
+		     strerror(-err));
+		goto out;
+	}
 
-		linenum++;
+	/* the cache must not lose the modules not given this time */
+	depmod.update_cache = all && opts->out == NULL;
 
-		p = strchr(line, ' ');
-		if (p == NULL)
-			goto invalid_syntax;
-		p++;
-		p = strchr(p, ' ');
-		if (p == NULL)
-			goto invalid_syntax;
-		p++;
+	depmod_modules_sort(&depmod);
+	err = depmod_load(&depmod);
+	if (err < 0)
+		goto out;
 
-		/* skip prefix */
-		if (p[0] == depmod->cfg->sym_prefix)
-			p++;
+	if (cfg->delta) {
+		err = depmod_delta_scan(&depmod);
+		if (err < 0) {
+			CRIT("could not compare with the last full run: %s\n",
+							strerror(-err));
+			goto out;
+		}
+	}
 
-		/* Covers gpl-only and normal symbols. */
-		if (strncmp(p, ksymstr, ksymstr_len) != 0)
-			continue;
+	stats_start(&depmod.stats.output, CLOCK_PROCESS_CPUTIME_ID);
+	err = depmod_output(&depmod, opts->out);
+	stats_stop(&depmod.stats.output, CLOCK_PROCESS_CPUTIME_ID);
+	if (err >= 0 && depmod.update_cache)
+		depmod_stamps_write(&depmod);
+	if (err >= 0 && cfg->stats != STATS_NONE)
+		depmod_stats_print(&depmod, cfg->stats);
 
-		end = strchr(p, '\n');
-		if (end != NULL)
-			*end = '\0';
+out:
+	depmod_shutdown(&depmod);
+	return err;
+}
 
-		depmod_symbol_add(depmod, p + ksymstr_len, true, 0, NULL);
-		continue;
+struct depmod_batch {
+	const struct depmod_opts *opts;
+	struct cfg *cfgs;
+	int *errs;
+	size_t count;
+	size_t next;
+};
 
-	invalid_syntax:
-		ERR("%s:%u: invalid line: %s\n", filename, linenum, line);
-	}
-	depmod_add_fake_syms(depmod);
+static void *depmod_batch_worker(void *data)
+{
+	struct depmod_batch *batch = data;
+	size_t i;
 
-	DBG("loaded System.map: %s\n", filename);
+	while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED))
+							< batch->count)
+		batch->errs[i] = depmod_run(batch->opts, &batch->cfgs[i]);
 
-	fclose(fp);
-	return 0;
+	return NULL;
 }
 
-
-static int depfile_up_to_date_dir(DIR *d, time_t mtime, size_t baselen, char *path)
+/*
+ * Run depmod for each of @kversions with the same options and configuration,
+ * @jobs kernels at a time. The jobs are split between them, so that the
+ * kernels together don't use more threads than a single kernel would.
+ */
+static int depmod_run_batch(struct depmod_opts *opts, const struct cfg *base,
+			    const char * const *kversions, size_t count)
 {
-	struct dirent *de;
-	int err = 1, dfd = dirfd(d);
+	struct depmod_shared shared;
+	struct depmod_batch batch = {
+		.opts = opts,
+		.count = count,
+	};
+	unsigned int jobs = base->jobs, n_threads, i, n = 0;
+	pthread_t *threads = NULL;
+	int err;
 
-	while ((de = readdir(d)) != NULL) {
-		const char *name = de->d_name;
-		size_t namelen;
-		struct stat st;
+	if (opts->out == stdout || opts->module_symvers != NULL ||
+			opts->system_map != NULL) {
+		CRIT("-n, -E and -F take a single kernel version\n");
+		return -EINVAL;
+	}
 
-		if (name[0] == '.' && (name[1] == '\0' ||
-				       (name[1] == '.' && name[2] == '\0')))
-			continue;
-		if (streq(name, "build") || streq(name, "source"))
-			continue;
-		namelen = strlen(name);
-		if (baselen + namelen + 2 >= PATH_MAX) {
-			path[baselen] = '\0';
-			ERR("path is too long %s%s\n", path, name);
-			continue;
-		}
+	err = depmod_shared_init(&shared);
+	if (err < 0) {
+		CRIT("depmod_shared_init: %s\n", strerror(-err));
+		return err;
+	}
+	opts->shared = &shared;
 
-		if (fstatat(dfd, name, &st, 0) < 0) {
-			ERR("fstatat(%d, %s): %m\n", dfd, name);
-			continue;
-		}
+	batch.cfgs = calloc(count, sizeof(struct cfg));
+	batch.errs = calloc(count, sizeof(int));
+	if (batch.cfgs == NULL || batch.errs == NULL) {
+		CRIT("out of memory\n");
+		err = -ENOMEM;
+		goto out;
+	}
 
-		if (S_ISDIR(st.st_mode)) {
-			int fd;
-			DIR *subdir;
-			memcpy(path + baselen, name, namelen + 1);
-			if (baselen + namelen + 2 + NAME_MAX >= PATH_MAX) {
-				ERR("directory path is too long %s\n", path);
-				continue;
-			}
-			fd = openat(dfd, name, O_RDONLY);
-			if (fd < 0) {
-				ERR("openat(%d, %s, O_RDONLY): %m\n",
-				    dfd, name);
-				continue;
-			}
-			subdir = fdopendir(fd);
-			if (subdir == NULL) {
-				ERR("fdopendir(%d): %m\n", fd);
-				close(fd);
-				continue;
-			}
-			path[baselen + namelen] = '/';
-			path[baselen + namelen + 1] = '\0';
-			err = depfile_up_to_date_dir(subdir, mtime,
-						     baselen + namelen + 1,
-						     path);
-			closedir(subdir);
-		} else if (S_ISREG(st.st_mode)) {
-			if (!path_ends_with_kmod_ext(name, namelen))
-				continue;
+	if (jobs == 0) {
+		long nproc = sysconf(_SC_NPROCESSORS_ONLN);
 
-			memcpy(path + baselen, name, namelen + 1);
-			err = st.st_mtime <= mtime;
-			if (err == 0) {
-				DBG("%s %"PRIu64" is newer than %"PRIu64"\n",
-				    path, (uint64_t)st.st_mtime,
-				    (uint64_t)mtime);
-			}
-		} else {
-			ERR("unsupported file type %s: %o\n",
-			    path, st.st_mode & S_IFMT);
-			continue;
-		}
+		jobs = nproc > 0 ? (unsigned int) nproc : 1;
+	}
+	n_threads = jobs < count ? jobs : count;
 
-		if (err == 0)
-			break; /* outdated! */
-		else if (err < 0) {
-			path[baselen + namelen] = '\0';
-			ERR("failed %s: %s\n", path, strerror(-err));
-			err = 1; /* ignore errors */
+	for (i = 0; i < count; i++) {
+		batch.cfgs[i] = *base;
+		batch.cfgs[i].kversion = kversions[i];
+		batch.cfgs[i].jobs = jobs / n_threads;
+	}
+
+	if (n_threads > 1)
+		threads = malloc(sizeof(*threads) * (n_threads - 1));
+	if (threads != NULL) {
+		for (; n < n_threads - 1; n++) {
+			if (pthread_create(&threads[n], NULL,
+					   depmod_batch_worker, &batch) != 0) {
+				WRN("could not start thread, using %u: %m\n",
+				    n + 1);
+				break;
+			}
 		}
 	}
 
-	return err;
-}
+	depmod_batch_worker(&batch);
 
-/* uptodate: 1, outdated: 0, errors < 0 */
-static int depfile_up_to_date(const char *dirname)
-{
-	char path[PATH_MAX];
-	DIR *d = opendir(dirname);
-	struct stat st;
-	size_t baselen;
-	int err;
-	if (d == NULL) {
-		err = -errno;
-		ERR("could not open directory %s: %m\n", dirname);
-		return err;
-	}
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
 
-	if (fstatat(dirfd(d), "modules.dep", &st, 0) != 0) {
-		err = -errno;
-		ERR("could not fstatat(%s, modules.dep): %m\n", dirname);
-		closedir(d);
-		return err;
+	for (i = 0; i < count; i++) {
+		if (batch.errs[i] < 0) {
+			ERR("%s: failed\n", kversions[i]);
+			err = batch.errs[i];
+		}
+		cfg_free(&batch.cfgs[i]);
 	}
 
-	baselen = strlen(dirname);
-	memcpy(path, dirname, baselen);
-	path[baselen] = '/';
-	baselen++;
-	path[baselen] = '\0';
-
-	err = depfile_up_to_date_dir(d, st.st_mtime, baselen, path);
-	closedir(d);
+out:
+	free(batch.cfgs);
+	free(batch.errs);
+	depmod_shared_free(&shared);
+	opts->shared = NULL;
 	return err;
 }
 
-static int is_version_number(const char *version)
-{
-	unsigned int d1, d2;
-	return (sscanf(version, "%u.%u", &d1, &d2) == 2);
-}
-
 static int do_depmod(int argc, char *argv[])
 {
-	FILE *out = NULL;
-	int err = 0, all = 0, maybe_all = 0, n_config_paths = 0;
+	int err = 0, n_config_paths = 0;
 	_cleanup_free_ char *root = NULL;
 	_cleanup_free_ char *out_root = NULL;
 	_cleanup_free_ const char **config_paths = NULL;
-	const char *system_map = NULL;
-	const char *module_symvers = NULL;
-	const char *null_kmod_config = NULL;
+	_cleanup_free_ const char **kversions = NULL;
+	size_t n_kversions = 0;
+	struct cfg_lines cfg_lines;
+	struct depmod_opts opts;
 	struct utsname un;
-	struct kmod_ctx *ctx = NULL;
 	struct cfg cfg;
-	struct depmod depmod;
 
 	memset(&cfg, 0, sizeof(cfg));
-	memset(&depmod, 0, sizeof(depmod));
+	memset(&opts, 0, sizeof(opts));
+	memset(&cfg_lines, 0, sizeof(cfg_lines));
+	cfg.jobs = 1;
 
 	for (;;) {
 		int c, idx = 0;
@@ -2928,10 +6854,10 @@ static int do_depmod(int argc, char *argv[])
 			break;
 		switch (c) {
 		case 'a':
-			all = 1;
+			opts.all = true;
 			break;
 		case 'A':
-			maybe_all = 1;
+			opts.maybe_all = true;
 			break;
 		case 'b':
 			if (root)
@@ -2957,11 +6883,11 @@ static int do_depmod(int argc, char *argv[])
 			break;
 		}
 		case 'E':
-			module_symvers = optarg;
+			opts.module_symvers = optarg;
 			cfg.check_symvers = 1;
 			break;
 		case 'F':
-			system_map = optarg;
+			opts.system_map = optarg;
 			break;
 		case 'e':
 			cfg.print_unknown = 1;
@@ -2970,7 +6896,7 @@ static int do_depmod(int argc, char *argv[])
 			verbose++;
 			break;
 		case 'n':
-			out = stdout;
+			opts.out = stdout;
 			break;
 		case 'P':
 			if (optarg[1] != '\0') {
@@ -2982,6 +6908,51 @@ static int do_depmod(int argc, char *argv[])
 		case 'w':
 			cfg.warn_dups = 1;
 			break;
+		case 'j': {
+			char *end;
+			unsigned long jobs;
+
+			errno = 0;
+			jobs = strtoul(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' ||
+			    jobs > UINT_MAX) {
+				CRIT("invalid number of jobs: %s\n", optarg);
+				goto cmdline_failed;
+			}
+			cfg.jobs = jobs;
+			break;
+		}
+		case 1:
+			if (!streq(optarg, "2") && !streq(optarg, "3")) {
+				CRIT("unsupported index version: %s\n", optarg);
+				goto cmdline_failed;
+			}
+			cfg.index_version = optarg[0] - '0';
+			break;
+		case 2:
+			if (optarg == NULL || streq(optarg, "text"))
+				cfg.stats = STATS_TEXT;
+			else if (streq(optarg, "json"))
+				cfg.stats = STATS_JSON;
+			else {
+				CRIT("unsupported stats format: %s\n", optarg);
+				goto cmdline_failed;
+			}
+			break;
+		case 3:
+			cfg.sync = 1;
+			break;
+		case 4:
+			cfg.delta = 1;
+			break;
+		case 5:
+#ifdef ENABLE_ZLIB
+			cfg.compress = 1;
+			break;
+#else
+			CRIT("--compress-indexes needs depmod built with zlib\n");
+			goto cmdline_failed;
+#endif
 		case 'u':
 		case 'q':
 		case 'r':
@@ -3008,139 +6979,71 @@ static int do_depmod(int argc, char *argv[])
 		}
 	}
 
-	if (optind < argc) {
-		if (!is_version_number(argv[optind])) {
-			ERR("Bad version passed %s\n", argv[optind]);
-			goto cmdline_failed;
-		}
-		cfg.kversion = argv[optind];
-		optind++;
-	} else {
-		if (uname(&un) < 0) {
-			CRIT("uname() failed: %s\n", strerror(errno));
-			goto cmdline_failed;
-		}
-		cfg.kversion = un.release;
-	}
-
-	cfg.dirnamelen = snprintf(cfg.dirname, PATH_MAX,
-				  "%s/lib/modules/%s",
-				  root ?: "", cfg.kversion);
-
-	cfg.outdirnamelen = snprintf(cfg.outdirname, PATH_MAX,
-				     "%s/lib/modules/%s",
-				     out_root ?: (root ?: ""), cfg.kversion);
+	/*
+	 * An older libkmod rejects v3 indexes and resolves nothing, so they
+	 * are only written on request. Compressed ones are v3 anyway.
+	 */
+	if (cfg.index_version == 0)
+		cfg.index_version = cfg.compress ? INDEX_VERSION_MAJOR : 2;
 
-	if (optind == argc)
-		all = 1;
+	opts.root = root;
+	opts.out_root = out_root;
 
-	if (maybe_all) {
-		if (out == stdout)
-			goto done;
-		/* ignore up-to-date errors (< 0) */
-		if (depfile_up_to_date(cfg.dirname) == 1)
-			goto done;
-		all = 1;
-	}
+	/* before the threads of a batch start, and for the configuration */
+	log_set_priority(verbose);
 
-	ctx = kmod_new(cfg.dirname, &null_kmod_config);
-	if (ctx == NULL) {
-		CRIT("kmod_new(\"%s\", {NULL}) failed: %m\n", cfg.dirname);
+	if (optind < argc && !is_version_number(argv[optind])) {
+		ERR("Bad version passed %s\n", argv[optind]);
 		goto cmdline_failed;
 	}
 
-	log_setup_kmod_log(ctx, verbose);
-
-	err = depmod_init(&depmod, &cfg, ctx);
-	if (err < 0) {
-		CRIT("depmod_init: %s\n", strerror(-err));
-		goto depmod_init_failed;
+	/* module paths are absolute, so they can't be taken for versions */
+	kversions = malloc(sizeof(char *) * (argc - optind + 1));
+	if (kversions == NULL) {
+		fputs("Error: out-of-memory\n", stderr);
+		goto cmdline_failed;
 	}
-	ctx = NULL; /* owned by depmod */
+	while (optind < argc && argv[optind][0] != '/' &&
+					is_version_number(argv[optind]))
+		kversions[n_kversions++] = argv[optind++];
 
-	if (module_symvers != NULL) {
-		err = depmod_load_symvers(&depmod, module_symvers);
-		if (err < 0) {
-			CRIT("could not load %s: %s\n", module_symvers,
-			     strerror(-err));
-			goto cmdline_failed;
-		}
-	} else if (system_map != NULL) {
-		err = depmod_load_system_map(&depmod, system_map);
-		if (err < 0) {
-			CRIT("could not load %s: %s\n", system_map,
-			     strerror(-err));
+	if (n_kversions == 0) {
+		if (uname(&un) < 0) {
+			CRIT("uname() failed: %s\n", strerror(errno));
 			goto cmdline_failed;
 		}
-	} else if (cfg.print_unknown) {
-		WRN("-e needs -E or -F\n");
-		cfg.print_unknown = 0;
+		kversions[n_kversions++] = un.release;
 	}
 
-	if (all) {
-		err = cfg_load(&cfg, config_paths);
+	opts.paths = argv + optind;
+	opts.n_paths = argc - optind;
+	if (opts.n_paths == 0)
+		opts.all = true;
+	else if (n_kversions > 1) {
+		CRIT("modules can only be given with a single kernel version\n");
+		goto cmdline_failed;
+	}
+
+	if (opts.all || opts.maybe_all) {
+		err = cfg_lines_read(&cfg_lines, config_paths);
 		if (err < 0) {
 			CRIT("could not load configuration files\n");
-			goto cmdline_modules_failed;
-		}
-		err = depmod_modules_search(&depmod);
-		if (err < 0) {
-			CRIT("could not search modules: %s\n", strerror(-err));
-			goto cmdline_modules_failed;
-		}
-	} else {
-		int i;
-
-		for (i = optind; i < argc; i++) {
-			const char *path = argv[i];
-			struct kmod_module *mod;
-
-			if (path[0] != '/') {
-				CRIT("%s: not absolute path.\n", path);
-				goto cmdline_modules_failed;
-			}
-
-			err = kmod_module_new_from_path(depmod.ctx, path, &mod);
-			if (err < 0) {
-				CRIT("could not create module %s: %s\n",
-				     path, strerror(-err));
-				goto cmdline_modules_failed;
-			}
-
-			err = depmod_module_add(&depmod, mod);
-			if (err < 0) {
-				CRIT("could not add module %s: %s\n",
-				     path, strerror(-err));
-				kmod_module_unref(mod);
-				goto cmdline_modules_failed;
-			}
+			goto cmdline_failed;
 		}
 	}
+	opts.cfg_lines = &cfg_lines;
 
-	err = depmod_modules_build_array(&depmod);
-	if (err < 0) {
-		CRIT("could not build module array: %s\n",
-		     strerror(-err));
-		goto cmdline_modules_failed;
+	if (n_kversions > 1)
+		err = depmod_run_batch(&opts, &cfg, kversions, n_kversions);
+	else {
+		cfg.kversion = kversions[0];
+		err = depmod_run(&opts, &cfg);
+		cfg_free(&cfg);
 	}
 
-	depmod_modules_sort(&depmod);
-	err = depmod_load(&depmod);
-	if (err < 0)
-		goto cmdline_modules_failed;
-
-	err = depmod_output(&depmod, out);
-
-done:
-	depmod_shutdown(&depmod);
-	cfg_free(&cfg);
+	cfg_lines_free(&cfg_lines);
 	return err >= 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 
-cmdline_modules_failed:
-	depmod_shutdown(&depmod);
-depmod_init_failed:
-	if (ctx != NULL)
-		kmod_unref(ctx);
 cmdline_failed:
 	cfg_free(&cfg);
 	return EXIT_FAILURE;
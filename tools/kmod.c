@@ -42,6 +42,11 @@ static const struct kmod_cmd *kmod_cmds[] = {
 	&kmod_cmd_help,
 	&kmod_cmd_list,
 	&kmod_cmd_static_nodes,
+	&kmod_cmd_config_compile,
+	&kmod_cmd_server,
+	&kmod_cmd_closure,
+	&kmod_cmd_profile,
+	&kmod_cmd_audit,
 
 #ifdef ENABLE_EXPERIMENTAL
 	&kmod_cmd_insert,
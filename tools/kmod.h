@@ -37,6 +37,21 @@ extern const struct kmod_cmd kmod_cmd_compat_depmod;
 extern const struct kmod_cmd kmod_cmd_insert;
 extern const struct kmod_cmd kmod_cmd_list;
 extern const struct kmod_cmd kmod_cmd_static_nodes;
+extern const struct kmod_cmd kmod_cmd_config_compile;
+extern const struct kmod_cmd kmod_cmd_server;
+extern const struct kmod_cmd kmod_cmd_closure;
+extern const struct kmod_cmd kmod_cmd_profile;
+extern const struct kmod_cmd kmod_cmd_audit;
 extern const struct kmod_cmd kmod_cmd_remove;
 
+struct kmod_ctx;
+
+#define KMOD_SERVER_SOCKET "/run/kmod/server.sock"
+
+/* server.c */
+int server_forward_modprobe(int argc, char *argv[], const char *env_options);
+
+/* modprobe.c */
+int modprobe_serve(struct kmod_ctx *ctx, int argc, char *argv[]);
+
 #include "log.h"
@@ -140,9 +140,16 @@ void log_printf(int prio, const char *fmt, ...)
 		exit(EXIT_FAILURE);
 }
 
-void log_setup_kmod_log(struct kmod_ctx *ctx, int priority)
+void log_set_priority(int priority)
 {
 	log_priority = priority;
+}
+
+void log_setup_kmod_log(struct kmod_ctx *ctx, int priority)
+{
+	/* depmod sets up the contexts of several kernels from threads */
+	if (log_priority != priority)
+		log_priority = priority;
 
 	kmod_set_log_priority(ctx, log_priority);
 	kmod_set_log_fn(ctx, log_kmod, NULL);
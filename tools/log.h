@@ -33,5 +33,7 @@ void log_printf(int prio, const char *fmt, ...) _printf_format_(2, 3);
 #define INF(...) log_printf(LOG_INFO, __VA_ARGS__)
 #define DBG(...) log_printf(LOG_DEBUG, __VA_ARGS__)
 
+void log_set_priority(int priority);
+
 struct kmod_ctx;
 void log_setup_kmod_log(struct kmod_ctx *ctx, int priority);
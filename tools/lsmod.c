@@ -46,7 +46,7 @@ static int do_lsmod(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	err = kmod_module_new_from_loaded(ctx, &list);
+	err = kmod_module_new_from_loaded_snapshot(ctx, &list);
 	if (err < 0) {
 		fprintf(stderr, "Error: could not get list of modules: %s\n",
 			strerror(-err));
@@ -20,13 +20,16 @@
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
+#include <unistd.h>
 
+#include <shared/array.h>
 #include <shared/util.h>
 
 #include <libkmod/libkmod.h>
@@ -36,6 +39,9 @@
 static char separator = '\n';
 static const char *field = NULL;
 
+/* modules queued to be shown by several threads, see modinfo_batch_run() */
+static struct array *batch;
+
 struct param {
 	struct param *next;
 	const char *name;
@@ -118,7 +124,7 @@ static int process_parm(const char *key, const char *value, struct param **param
 	return 0;
 }
 
-static int modinfo_params_do(const struct kmod_list *list)
+static int modinfo_params_do(FILE *out, const struct kmod_list *list)
 {
 	const struct kmod_list *l;
 	struct param *params = NULL;
@@ -140,17 +146,17 @@ static int modinfo_params_do(const struct kmod_list *list)
 		params = p->next;
 
 		if (p->param == NULL)
-			printf("%.*s: (%.*s)%c",
+			fprintf(out, "%.*s: (%.*s)%c",
 			       p->namelen, p->name, p->typelen, p->type,
 			       separator);
 		else if (p->type != NULL)
-			printf("%.*s:%.*s (%.*s)%c",
+			fprintf(out, "%.*s:%.*s (%.*s)%c",
 			       p->namelen, p->name,
 			       p->paramlen, p->param,
 			       p->typelen, p->type,
 			       separator);
 		else
-			printf("%.*s:%.*s%c",
+			fprintf(out, "%.*s:%.*s%c",
 			       p->namelen, p->name,
 			       p->paramlen, p->param,
 			       separator);
@@ -168,7 +174,49 @@ end:
 	return err;
 }
 
-static int modinfo_do(struct kmod_module *mod)
+/* don't decode the signature if the field asked for can't come from it */
+static unsigned int info_flags(void)
+{
+	static const char *const sig_fields[] = {
+		"sig_id", "signer", "sig_key", "sig_hashalgo", "signature",
+	};
+	size_t i;
+
+	if (field == NULL)
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(sig_fields); i++) {
+		if (streq(field, sig_fields[i]))
+			return 0;
+	}
+
+	return KMOD_INFO_NO_SIGNATURE;
+}
+
+/* a single field of a module file, read in place without copying the list */
+static int modinfo_field_do(FILE *out, struct kmod_module *mod)
+{
+	const char *key, *value;
+	size_t pos = 0, keylen, valuelen, fieldlen = strlen(field);
+	int err;
+
+	while ((err = kmod_module_get_info_next(mod, &pos, &key, &keylen,
+						&value, &valuelen)) > 0) {
+		if (keylen == fieldlen && memcmp(key, field, keylen) == 0)
+			fprintf(out, "%.*s%c", (int) valuelen, value,
+								separator);
+	}
+
+	if (err < 0) {
+		ERR("could not get modinfo from '%s': %s\n",
+			kmod_module_get_name(mod), strerror(-err));
+		return err;
+	}
+
+	return 0;
+}
+
+static int modinfo_do(FILE *out, struct kmod_module *mod)
 {
 	struct kmod_list *l, *list = NULL;
 	struct param *params = NULL;
@@ -179,22 +227,27 @@ static int modinfo_do(struct kmod_module *mod)
 
 	if (is_builtin) {
 		if (field == NULL)
-			printf("%-16s%s%c", "name:",
+			fprintf(out, "%-16s%s%c", "name:",
 			       kmod_module_get_name(mod), separator);
 		else if (field != NULL && streq(field, "name"))
-			printf("%s%c", kmod_module_get_name(mod), separator);
+			fprintf(out, "%s%c", kmod_module_get_name(mod),
+								separator);
 		filename = "(builtin)";
 	}
 
 	if (field != NULL && streq(field, "filename")) {
-		printf("%s%c", filename, separator);
+		fprintf(out, "%s%c", filename, separator);
 		return 0;
 	} else if (field == NULL) {
-		printf("%-16s%s%c", "filename:",
+		fprintf(out, "%-16s%s%c", "filename:",
 		       filename, separator);
 	}
 
-	err = kmod_module_get_info(mod, &list);
+	if (field != NULL && !is_builtin && !streq(field, "parm") &&
+				info_flags() == KMOD_INFO_NO_SIGNATURE)
+		return modinfo_field_do(out, mod);
+
+	err = kmod_module_get_info_flags(mod, info_flags(), &list);
 	if (err < 0) {
 		if (is_builtin && err == -ENOENT) {
 			/*
@@ -209,7 +262,7 @@ static int modinfo_do(struct kmod_module *mod)
 	}
 
 	if (field != NULL && streq(field, "parm")) {
-		err = modinfo_params_do(list);
+		err = modinfo_params_do(out, list);
 		goto end;
 	}
 
@@ -222,7 +275,7 @@ static int modinfo_do(struct kmod_module *mod)
 			if (!streq(field, key))
 				continue;
 			/* filtered output contains no key, just value */
-			printf("%s%c", value, separator);
+			fprintf(out, "%s%c", value, separator);
 			continue;
 		}
 
@@ -234,12 +287,13 @@ static int modinfo_do(struct kmod_module *mod)
 		}
 
 		if (separator == '\0') {
-			printf("%s=%s%c", key, value, separator);
+			fprintf(out, "%s=%s%c", key, value, separator);
 			continue;
 		}
 
 		keylen = strlen(key);
-		printf("%s:%-*s%s%c", key, 15 - keylen, "", value, separator);
+		fprintf(out, "%s:%-*s%s%c", key, 15 - keylen, "", value,
+								separator);
 	}
 
 	if (field != NULL)
@@ -250,17 +304,17 @@ static int modinfo_do(struct kmod_module *mod)
 		params = p->next;
 
 		if (p->param == NULL)
-			printf("%-16s%.*s:%.*s%c", "parm:",
+			fprintf(out, "%-16s%.*s:%.*s%c", "parm:",
 			       p->namelen, p->name, p->typelen, p->type,
 			       separator);
 		else if (p->type != NULL)
-			printf("%-16s%.*s:%.*s (%.*s)%c", "parm:",
+			fprintf(out, "%-16s%.*s:%.*s (%.*s)%c", "parm:",
 			       p->namelen, p->name,
 			       p->paramlen, p->param,
 			       p->typelen, p->type,
 			       separator);
 		else
-			printf("%-16s%.*s:%.*s%c",
+			fprintf(out, "%-16s%.*s:%.*s%c",
 			       "parm:",
 			       p->namelen, p->name,
 			       p->paramlen, p->param,
@@ -280,6 +334,20 @@ end:
 	return err;
 }
 
+static int modinfo_module(struct kmod_module *mod)
+{
+	if (batch == NULL)
+		return modinfo_do(stdout, mod);
+
+	if (array_append(batch, kmod_module_ref(mod)) < 0) {
+		kmod_module_unref(mod);
+		ERR("Out of memory!\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
 static int modinfo_path_do(struct kmod_ctx *ctx, const char *path)
 {
 	struct kmod_module *mod;
@@ -288,7 +356,7 @@ static int modinfo_path_do(struct kmod_ctx *ctx, const char *path)
 		ERR("Module file %s not found.\n", path);
 		return err;
 	}
-	err = modinfo_do(mod);
+	err = modinfo_module(mod);
 	kmod_module_unref(mod);
 	return err;
 }
@@ -304,7 +372,7 @@ static int modinfo_name_do(struct kmod_ctx *ctx, const char *name)
 		return err < 0 ? err : -ENOENT;
 	}
 
-	err = modinfo_do(mod);
+	err = modinfo_module(mod);
 	kmod_module_unref(mod);
 
 	return err;
@@ -327,7 +395,7 @@ static int modinfo_alias_do(struct kmod_ctx *ctx, const char *alias)
 
 	kmod_list_foreach(l, list) {
 		struct kmod_module *mod = kmod_module_get_module(l);
-		int r = modinfo_do(mod);
+		int r = modinfo_module(mod);
 		kmod_module_unref(mod);
 		if (r < 0)
 			err = r;
@@ -336,7 +404,161 @@ static int modinfo_alias_do(struct kmod_ctx *ctx, const char *alias)
 	return err;
 }
 
-static const char cmdopts_s[] = "adlpn0mF:k:b:Vh";
+struct modinfo_job {
+	struct kmod_module *mod;
+	char *out;
+	size_t outsize;
+	int err;
+};
+
+struct modinfo_batch {
+	struct modinfo_job *jobs;
+	size_t count;
+	size_t next;
+};
+
+/* Show @job->mod into a buffer of its own and release the module */
+static void modinfo_job_run(struct modinfo_job *job)
+{
+	FILE *fp;
+
+	fp = open_memstream(&job->out, &job->outsize);
+	if (fp == NULL) {
+		job->err = -errno;
+		ERR("could not show '%s': %m\n",
+					kmod_module_get_name(job->mod));
+	} else {
+		job->err = modinfo_do(fp, job->mod);
+		if (fclose(fp) != 0 && job->err >= 0)
+			job->err = -ENOMEM;
+	}
+
+	kmod_module_unref(job->mod);
+	job->mod = NULL;
+}
+
+static void *modinfo_batch_worker(void *data)
+{
+	struct modinfo_batch *b = data;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED))
+								< b->count) {
+		if (b->jobs[i].mod != NULL)
+			modinfo_job_run(&b->jobs[i]);
+	}
+
+	return NULL;
+}
+
+/*
+ * Show the modules queued in @batch from @n_jobs threads, the calling one
+ * included, then print what each of them wrote in the order they were
+ * queued, so the output doesn't depend on the number of jobs. libkmod is
+ * safe to use from several threads as long as each module is only handled
+ * by one of them; builtin modules are shown first, from here, since their
+ * information comes from the indexes of the context.
+ */
+static int modinfo_batch_run(unsigned int n_jobs)
+{
+	struct modinfo_batch b = {
+		.count = batch->count,
+	};
+	pthread_t *threads = NULL;
+	unsigned int i, n = 0;
+	int err = 0;
+
+	b.jobs = calloc(b.count, sizeof(*b.jobs));
+	if (b.jobs == NULL) {
+		ERR("Out of memory!\n");
+		for (i = 0; i < batch->count; i++)
+			kmod_module_unref(batch->array[i]);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < b.count; i++) {
+		b.jobs[i].mod = batch->array[i];
+		if (kmod_module_get_path(b.jobs[i].mod) == NULL)
+			modinfo_job_run(&b.jobs[i]);
+	}
+
+	if (n_jobs > b.count)
+		n_jobs = b.count;
+	if (n_jobs > 1)
+		threads = malloc(sizeof(*threads) * (n_jobs - 1));
+	if (threads != NULL) {
+		for (; n < n_jobs - 1; n++) {
+			if (pthread_create(&threads[n], NULL,
+					   modinfo_batch_worker, &b) != 0)
+				break;
+		}
+	}
+
+	modinfo_batch_worker(&b);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	for (i = 0; i < b.count; i++) {
+		struct modinfo_job *job = &b.jobs[i];
+
+		if (job->outsize > 0)
+			fwrite(job->out, 1, job->outsize, stdout);
+		free(job->out);
+		if (job->err < 0)
+			err = job->err;
+	}
+
+	free(b.jobs);
+
+	return err;
+}
+
+/* every module of the kernel, in the order of modules.dep */
+static int modinfo_all_do(struct kmod_ctx *ctx)
+{
+	const char *dirname = kmod_get_dirname(ctx);
+	char path[PATH_MAX], *line = NULL;
+	size_t linesz = 0;
+	ssize_t len;
+	FILE *fp;
+	int err = 0;
+
+	snprintf(path, sizeof(path), "%s/modules.dep", dirname);
+	fp = fopen(path, "re");
+	if (fp == NULL) {
+		ERR("could not open %s: %m\n", path);
+		return -errno;
+	}
+
+	while ((len = getline(&line, &linesz, fp)) > 0) {
+		char *colon = strchr(line, ':');
+		int r;
+
+		if (colon == NULL)
+			continue;
+		*colon = '\0';
+
+		if (line[0] == '/')
+			r = modinfo_path_do(ctx, line);
+		else if (snprintf(path, sizeof(path), "%s/%s", dirname,
+						line) >= (int) sizeof(path))
+			r = -ENAMETOOLONG;
+		else
+			r = modinfo_path_do(ctx, path);
+
+		if (r < 0)
+			err = r;
+	}
+
+	free(line);
+	fclose(fp);
+
+	return err;
+}
+
+static const char cmdopts_s[] = "adlpn0mAF:k:b:j:Vh";
 static const struct option cmdopts[] = {
 	{"author", no_argument, 0, 'a'},
 	{"description", no_argument, 0, 'd'},
@@ -345,9 +567,11 @@ static const struct option cmdopts[] = {
 	{"filename", no_argument, 0, 'n'},
 	{"null", no_argument, 0, '0'},
 	{"modname", no_argument, 0, 'm'},
+	{"all", no_argument, 0, 'A'},
 	{"field", required_argument, 0, 'F'},
 	{"set-version", required_argument, 0, 'k'},
 	{"basedir", required_argument, 0, 'b'},
+	{"jobs", required_argument, 0, 'j'},
 	{"version", no_argument, 0, 'V'},
 	{"help", no_argument, 0, 'h'},
 	{NULL, 0, 0, 0}
@@ -357,6 +581,7 @@ static void help(void)
 {
 	printf("Usage:\n"
 		"\t%s [options] <modulename|filename> [args]\n"
+		"\t%s [options] --all\n"
 		"Options:\n"
 		"\t-a, --author                Print only 'author'\n"
 		"\t-d, --description           Print only 'description'\n"
@@ -365,12 +590,15 @@ static void help(void)
 		"\t-n, --filename              Print only 'filename'\n"
 		"\t-0, --null                  Use \\0 instead of \\n\n"
 		"\t-m, --modname               Handle argument as module name instead of alias or filename\n"
+		"\t-A, --all                   Show all the modules of the kernel\n"
 		"\t-F, --field=FIELD           Print only provided FIELD\n"
 		"\t-k, --set-version=VERSION   Use VERSION instead of `uname -r`\n"
 		"\t-b, --basedir=DIR           Use DIR as filesystem root for /lib/modules\n"
+		"\t-j, --jobs=N                Read up to N modules at once, 0 for one\n"
+		"\t                            per CPU\n"
 		"\t-V, --version               Show version\n"
 		"\t-h, --help                  Show this help\n",
-		program_invocation_short_name);
+		program_invocation_short_name, program_invocation_short_name);
 }
 
 static bool is_module_filename(const char *name)
@@ -393,6 +621,9 @@ static int do_modinfo(int argc, char *argv[])
 	const char *root = NULL;
 	const char *null_config = NULL;
 	bool arg_is_modname = false;
+	bool all_modules = false;
+	unsigned long jobs = 1;
+	struct array mods;
 	int i, err;
 
 	for (;;) {
@@ -422,6 +653,9 @@ static int do_modinfo(int argc, char *argv[])
 		case 'm':
 			arg_is_modname = true;
 			break;
+		case 'A':
+			all_modules = true;
+			break;
 		case 'F':
 			field = optarg;
 			break;
@@ -431,6 +665,18 @@ static int do_modinfo(int argc, char *argv[])
 		case 'b':
 			root = optarg;
 			break;
+		case 'j': {
+			char *end;
+
+			errno = 0;
+			jobs = strtoul(optarg, &end, 10);
+			if (errno != 0 || *end != '\0' || end == optarg ||
+							jobs > UINT_MAX) {
+				ERR("invalid number of jobs: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
 		case 'h':
 			help();
 			return EXIT_SUCCESS;
@@ -446,7 +692,10 @@ static int do_modinfo(int argc, char *argv[])
 		}
 	}
 
-	if (optind >= argc) {
+	if (all_modules && optind < argc) {
+		ERR("unexpected argument '%s' with --all.\n", argv[optind]);
+		return EXIT_FAILURE;
+	} else if (!all_modules && optind >= argc) {
 		ERR("missing module or filename.\n");
 		return EXIT_FAILURE;
 	}
@@ -473,7 +722,17 @@ static int do_modinfo(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	err = 0;
+	if (jobs == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		jobs = n > 0 ? (unsigned long) n : 1;
+	}
+	if (jobs > 1) {
+		array_init(&mods, 256);
+		batch = &mods;
+	}
+
+	err = all_modules ? modinfo_all_do(ctx) : 0;
 	for (i = optind; i < argc; i++) {
 		const char *name = argv[i];
 		int r;
@@ -489,6 +748,15 @@ static int do_modinfo(int argc, char *argv[])
 			err = r;
 	}
 
+	if (batch != NULL) {
+		int r = modinfo_batch_run(jobs);
+
+		if (r < 0)
+			err = r;
+		array_free_array(batch);
+		batch = NULL;
+	}
+
 	kmod_unref(ctx);
 	return err >= 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
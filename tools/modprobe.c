@@ -19,19 +19,25 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
+#include <linux/netlink.h>
 
 #include <shared/array.h>
+#include <shared/hash.h>
 #include <shared/util.h>
 #include <shared/macro.h>
 
@@ -58,6 +64,12 @@ static int strip_vermagic = 0;
 static int remove_holders = 0;
 static unsigned long long wait_msec = 0;
 static int quiet_inuse = 0;
+static int parallel = 0;
+/* warm context of the kmod server, when serving one of its requests */
+static struct kmod_ctx *server_ctx = NULL;
+/* --profile: where a record of each module inserted is appended */
+static const char *profile_path = NULL;
+static int profile_fd = -1;
 
 static const char cmdopts_s[] = "arw:RibfDcnC:d:S:sqvVh";
 static const struct option cmdopts[] = {
@@ -76,6 +88,8 @@ static const struct option cmdopts[] = {
 	{"force", no_argument, 0, 'f'},
 	{"force-modversion", no_argument, 0, 2},
 	{"force-vermagic", no_argument, 0, 1},
+	{"parallel", no_argument, 0, 7},
+	{"profile", required_argument, 0, 8},
 
 	{"show-depends", no_argument, 0, 'D'},
 	{"showconfig", no_argument, 0, 'c'},
@@ -127,6 +141,13 @@ static void help(void)
 		"\t                            --force-vermagic\n"
 		"\t    --force-modversion      Ignore module's version\n"
 		"\t    --force-vermagic        Ignore module's version magic\n"
+		"\t    --parallel              Insert independent dependencies\n"
+		"\t                            concurrently. With -a, also insert\n"
+		"\t                            all modules as a single graph.\n"
+		"\t                            With -r, remove independent\n"
+		"\t                            modules concurrently\n"
+		"\t    --profile=FILE          Append the time spent on each module\n"
+		"\t                            inserted to FILE, see kmod profile\n"
 		"\n"
 		"Query Options:\n"
 		"\t-R, --resolve-alias         Only lookup and print alias and exit\n"
@@ -313,12 +334,10 @@ static int command_do(struct kmod_module *module, const char *type,
 	if (dry_run)
 		goto end;
 
-	setenv("MODPROBE_MODULE", modname, 1);
-	ret = system(cmd);
-	unsetenv("MODPROBE_MODULE");
-	if (ret == -1 || WEXITSTATUS(ret)) {
+	ret = run_command(cmd, modname);
+	if (ret < 0 || WEXITSTATUS(ret)) {
 		LOG("Error running %s command for %s\n", type, modname);
-		if (ret != -1)
+		if (ret >= 0)
 			ret = -WEXITSTATUS(ret);
 	}
 
@@ -327,12 +346,122 @@ end:
 	return ret;
 }
 
+/*
+ * Listen to the uevents the kernel sends when a module or a driver binding
+ * goes away: that's when the references keeping a module busy are dropped,
+ * so there's no need to sleep for the whole backoff interval. Failing to
+ * open the socket isn't an error, the caller just falls back to sleeping.
+ */
+static int uevent_open(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		DBG("could not open uevent socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		DBG("could not bind uevent socket: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * A kernel uevent is "ACTION@DEVPATH" followed by NUL-separated KEY=VALUE
+ * pairs. Removals and unbinds may release a reference to a module, as does
+ * anything happening to another module (e.g. one of its holders).
+ */
+static bool uevent_may_release(const char *buf, size_t len)
+{
+	const char *p, *end = buf + len;
+
+	if (strstartswith(buf, "remove@") || strstartswith(buf, "unbind@"))
+		return true;
+
+	for (p = buf; p < end; p += strlen(p) + 1) {
+		if (streq(p, "SUBSYSTEM=module"))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Sleep until @until_msec, or until an event that may have made the module
+ * removable arrives on @fd. Returns 0 in both cases.
+ */
+static int uevent_wait_until(int fd, unsigned long long until_msec)
+{
+	char buf[4096];
+
+	if (fd < 0)
+		return sleep_until_msec(until_msec);
+
+	for (;;) {
+		unsigned long long t = now_msec();
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		bool release = false;
+		ssize_t len;
+		int r;
+
+		if (t >= until_msec)
+			return 0;
+
+		t = until_msec - t;
+		r = poll(&pfd, 1, t > INT_MAX ? INT_MAX : (int) t);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (r == 0)
+			return 0;
+
+		for (;;) {
+			struct sockaddr_nl src;
+			socklen_t srclen = sizeof(src);
+
+			len = recvfrom(fd, buf, sizeof(buf) - 1, 0,
+				       (struct sockaddr *) &src, &srclen);
+			if (len < 0)
+				break;
+
+			/* only trust the kernel */
+			if (src.nl_pid != 0)
+				continue;
+
+			buf[len] = '\0';
+			if (uevent_may_release(buf, len))
+				release = true;
+		}
+
+		/* we lost events: just assume one of them was ours */
+		if (errno == ENOBUFS)
+			release = true;
+		else if (errno != EAGAIN && errno != EINTR)
+			return -errno;
+
+		if (release)
+			return 0;
+	}
+}
+
 static int rmmod_do_remove_module(struct kmod_module *mod)
 {
 	const char *modname = kmod_module_get_name(mod);
 	unsigned long long interval_msec = 0, t0_msec = 0,
-		      tend_msec = 0;
-	int flags = 0, err;
+		      tend_msec = 0, until_msec = 0;
+	int flags = 0, err, ufd = -1;
 
 	SHOW("rmmod %s\n", modname);
 
@@ -354,17 +483,29 @@ static int rmmod_do_remove_module(struct kmod_module *mod)
 				LOG("Module %s is not in kernel.\n", modname);
 			break;
 		} else if (err == -EAGAIN && wait_msec) {
-			unsigned long long until_msec;
-
 			if (!t0_msec) {
 				t0_msec = now_msec();
 				tend_msec = t0_msec + wait_msec;
 				interval_msec = 1;
+
+				/*
+				 * Retry once right away: the module may have
+				 * become free before we started listening.
+				 */
+				ufd = uevent_open();
+				if (ufd >= 0)
+					continue;
 			}
 
-			until_msec = get_backoff_delta_msec(t0_msec, tend_msec,
-							  &interval_msec);
-			err = sleep_until_msec(until_msec);
+			/*
+			 * After an early wakeup keep the current deadline, so
+			 * the backoff only grows when it actually expires.
+			 */
+			if (now_msec() >= until_msec)
+				until_msec = get_backoff_delta_msec(t0_msec,
+								    tend_msec,
+								    &interval_msec);
+			err = uevent_wait_until(ufd, until_msec);
 
 			if (!t0_msec)
 				err = -ENOTSUP;
@@ -379,6 +520,9 @@ static int rmmod_do_remove_module(struct kmod_module *mod)
 		}
 	} while (interval_msec);
 
+	if (ufd >= 0)
+		close(ufd);
+
 	if (err < 0 && wait_msec)
 		ERR("could not remove '%s': %s\n", modname, strerror(-err));
 
@@ -533,10 +677,591 @@ static int rmmod(struct kmod_ctx *ctx, const char *alias)
 	return err;
 }
 
+/*
+ * modprobe -r --parallel: the walk of rmmod_do_module() is done up front,
+ * on a snapshot of the loaded modules, and only records what it would
+ * remove, in the order it would remove it. Each module gets a single node,
+ * which waits for everything the serial walk removes before it through
+ * the module's post softdeps and holders. A failure flows along the edges
+ * as it would in the serial walk: a holder that can't be removed fails the
+ * modules it holds, and a module that can't be removed skips its unused
+ * dependencies and pre softdeps. The checks that depend on what was removed
+ * before, the refcnt ones, are done when a node runs.
+ *
+ * Remove commands may remove anything: their nodes run alone, after
+ * everything before them and before everything after.
+ */
+#define RMMOD_EDGE_WAIT		0x1
+#define RMMOD_EDGE_SKIP		0x2
+#define RMMOD_EDGE_FAIL		0x4
+
+struct rmmod_node {
+	struct kmod_module *mod;
+	unsigned int idx;
+	const char *cmd;
+	/* a dependency removed only if it's not used anymore */
+	bool unused;
+	bool top;
+	bool dispatched;
+	unsigned int n_waiting;
+	int cause;
+	int err;
+};
+
+struct rmmod_edge {
+	unsigned int from, to;
+	unsigned char kind;
+};
+
+struct rmmod_plan {
+	struct array nodes;
+	/* module name to its node, or to the plan itself while it's walked */
+	struct hash *by_name;
+	struct rmmod_edge *edges;
+	size_t n_edges, edges_size;
+	int last_barrier;
+	/* edges[to * n + from], filled from the list before running */
+	unsigned char *matrix;
+
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t finished;
+	unsigned int *queue, queue_head, queue_tail;
+	unsigned int *done, done_head, done_tail;
+	bool exit;
+};
+
+static int rmmod_plan_edge(struct rmmod_plan *plan, unsigned int from,
+					unsigned int to, unsigned char kind)
+{
+	if (plan->n_edges == plan->edges_size) {
+		size_t size = plan->edges_size ? plan->edges_size * 2 : 64;
+		struct rmmod_edge *edges;
+
+		edges = realloc(plan->edges, size * sizeof(*edges));
+		if (edges == NULL)
+			return -ENOMEM;
+		plan->edges = edges;
+		plan->edges_size = size;
+	}
+
+	plan->edges[plan->n_edges].from = from;
+	plan->edges[plan->n_edges].to = to;
+	plan->edges[plan->n_edges].kind = kind;
+	plan->n_edges++;
+
+	return 0;
+}
+
+static int rmmod_plan_add(struct rmmod_plan *plan, struct kmod_module *mod,
+				const char *cmd, bool unused, int *idx)
+{
+	unsigned int i, n = plan->nodes.count;
+	struct rmmod_node *node;
+	int err;
+
+	node = calloc(1, sizeof(*node));
+	if (node == NULL)
+		return -ENOMEM;
+
+	node->mod = kmod_module_ref(mod);
+	node->idx = n;
+	node->cmd = cmd;
+	node->unused = unused;
+
+	if (array_append(&plan->nodes, node) < 0) {
+		kmod_module_unref(node->mod);
+		free(node);
+		return -ENOMEM;
+	}
+
+	err = hash_add(plan->by_name, kmod_module_get_name(mod), node);
+	if (err < 0)
+		return err;
+
+	if (cmd != NULL) {
+		for (i = plan->last_barrier < 0 ? 0 : plan->last_barrier;
+								i < n; i++) {
+			err = rmmod_plan_edge(plan, i, n, RMMOD_EDGE_WAIT);
+			if (err < 0)
+				return err;
+		}
+		plan->last_barrier = n;
+	} else if (plan->last_barrier >= 0) {
+		err = rmmod_plan_edge(plan, plan->last_barrier, n,
+							RMMOD_EDGE_WAIT);
+		if (err < 0)
+			return err;
+	}
+
+	*idx = n;
+
+	return 0;
+}
+
+static int rmmod_plan_module(struct rmmod_plan *plan, struct kmod_module *mod,
+						int flags, int *idx);
+
+/* the modules of @list in reverse order, with their failures ignored */
+static int rmmod_plan_modlist(struct rmmod_plan *plan, struct kmod_list *list)
+{
+	struct kmod_list *l;
+
+	kmod_list_foreach_reverse(l, list) {
+		struct kmod_module *m = kmod_module_get_module(l);
+		int idx, r;
+
+		r = rmmod_plan_module(plan, m, RMMOD_FLAG_IGNORE_BUILTIN, &idx);
+		kmod_module_unref(m);
+		if (r == -ENOMEM)
+			return r;
+	}
+
+	return 0;
+}
+
+/* the walk of rmmod_do_module(), see above */
+static int rmmod_plan_module(struct rmmod_plan *plan, struct kmod_module *mod,
+						int flags, int *idx)
+{
+	const char *modname = kmod_module_get_name(mod);
+	struct kmod_list *pre = NULL, *post = NULL, *l;
+	struct array holders;
+	const char *cmd = NULL;
+	struct rmmod_node *node;
+	unsigned int i, start;
+	int err;
+
+	*idx = -1;
+
+	node = hash_find(plan->by_name, modname);
+	if (node == (void *) plan)
+		return 0;
+	if (node != NULL) {
+		*idx = node->idx;
+		return 0;
+	}
+
+	array_init(&holders, 4);
+
+	if (!ignore_commands) {
+		err = kmod_module_get_softdeps(mod, &pre, &post);
+		if (err < 0) {
+			WRN("could not get softdeps of '%s': %s\n",
+						modname, strerror(-err));
+			return err;
+		}
+
+		cmd = kmod_module_get_remove_commands(mod);
+	}
+
+	if (!cmd && !ignore_loaded) {
+		int state = kmod_module_get_initstate(mod);
+
+		if (state < 0) {
+			if (first_time) {
+				LOG("Module %s is not in kernel.\n", modname);
+				err = -ENOENT;
+			} else {
+				err = 0;
+			}
+			goto error;
+		} else if (state == KMOD_MODULE_BUILTIN) {
+			if (flags & RMMOD_FLAG_IGNORE_BUILTIN) {
+				err = 0;
+			} else {
+				LOG("Module %s is builtin.\n", modname);
+				err = -ENOENT;
+			}
+			goto error;
+		}
+	}
+
+	err = hash_add(plan->by_name, modname, plan);
+	if (err < 0)
+		goto error;
+
+	start = plan->nodes.count;
+
+	/* 1. @mod's post-softdeps in reverse order */
+	err = rmmod_plan_modlist(plan, post);
+	if (err < 0)
+		goto error_walked;
+
+	/* 2. Other modules holding @mod */
+	if (flags & RMMOD_FLAG_REMOVE_HOLDERS) {
+		struct kmod_list *list = kmod_module_get_holders(mod);
+
+		kmod_list_foreach_reverse(l, list) {
+			struct kmod_module *m = kmod_module_get_module(l);
+			int h;
+
+			err = rmmod_plan_module(plan, m,
+						RMMOD_FLAG_IGNORE_BUILTIN, &h);
+			kmod_module_unref(m);
+			if (err == 0 && h >= 0 &&
+				array_append(&holders, (void *) (long) h) < 0)
+				err = -ENOMEM;
+			if (err < 0)
+				break;
+		}
+		kmod_module_unref_list(list);
+		if (err < 0)
+			goto error_walked;
+	}
+
+	/* 3. @mod itself, after all of the above */
+	err = rmmod_plan_add(plan, mod, cmd, false, idx);
+	if (err < 0)
+		goto error;
+
+	for (i = start; i < (unsigned int) *idx && err == 0; i++)
+		err = rmmod_plan_edge(plan, i, *idx, RMMOD_EDGE_WAIT);
+	for (i = 0; i < holders.count && err == 0; i++)
+		err = rmmod_plan_edge(plan, (long) holders.array[i], *idx,
+					RMMOD_EDGE_WAIT | RMMOD_EDGE_FAIL);
+	if (err < 0)
+		goto error;
+
+	/* 4. Other modules that may become unused */
+	if (!cmd) {
+		struct kmod_list *deps = kmod_module_get_dependencies(mod);
+
+		kmod_list_foreach(l, deps) {
+			struct kmod_module *dep = kmod_module_get_module(l);
+			int d;
+
+			if (hash_find(plan->by_name,
+					kmod_module_get_name(dep)) == NULL)
+				err = rmmod_plan_add(plan, dep, NULL, true, &d);
+			kmod_module_unref(dep);
+			if (err < 0)
+				break;
+		}
+		kmod_module_unref_list(deps);
+		if (err < 0)
+			goto error;
+	}
+
+	/* 5. @mod's pre-softdeps in reverse order */
+	err = rmmod_plan_modlist(plan, pre);
+	if (err < 0)
+		goto error;
+
+	/* 4. and 5. are skipped if @mod can't be removed */
+	for (i = *idx + 1; i < plan->nodes.count && err == 0; i++)
+		err = rmmod_plan_edge(plan, *idx, i,
+					RMMOD_EDGE_WAIT | RMMOD_EDGE_SKIP);
+	goto error;
+
+error_walked:
+	hash_del(plan->by_name, modname);
+error:
+	array_free_array(&holders);
+	kmod_module_unref_list(pre);
+	kmod_module_unref_list(post);
+
+	return err;
+}
+
+/* the walk of rmmod(): stops at the first module of @alias that fails */
+static int rmmod_plan_alias(struct rmmod_plan *plan, struct kmod_ctx *ctx,
+							const char *alias)
+{
+	struct kmod_list *l, *list = NULL;
+	int prev = -1, err;
+
+	err = kmod_module_new_from_lookup(ctx, alias, &list);
+	if (err < 0)
+		return err;
+
+	if (list == NULL) {
+		LOG("Module %s not found.\n", alias);
+		err = -ENOENT;
+	}
+
+	kmod_list_foreach(l, list) {
+		struct kmod_module *mod = kmod_module_get_module(l);
+		int flags = remove_holders ? RMMOD_FLAG_REMOVE_HOLDERS : 0;
+		unsigned int i, start = plan->nodes.count;
+		int idx;
+
+		err = rmmod_plan_module(plan, mod, flags, &idx);
+		kmod_module_unref(mod);
+		if (err < 0)
+			break;
+		if (idx < 0)
+			continue;
+
+		((struct rmmod_node *) plan->nodes.array[idx])->top = true;
+		for (i = start; prev >= 0 && i < plan->nodes.count; i++) {
+			err = rmmod_plan_edge(plan, prev, i,
+					RMMOD_EDGE_WAIT | RMMOD_EDGE_SKIP);
+			if (err < 0)
+				break;
+		}
+		prev = idx;
+	}
+
+	kmod_module_unref_list(list);
+	return err;
+}
+
+/* Steps 3 and 4 of rmmod_do_module() for the node */
+static int rmmod_node_run(struct rmmod_node *node)
+{
+	struct kmod_module *mod = node->mod;
+
+	if (node->cmd != NULL)
+		return command_do(mod, "remove", node->cmd, NULL);
+
+	if (node->unused) {
+		if (kmod_module_get_refcnt(mod) == 0)
+			rmmod_do_remove_module(mod);
+		return 0;
+	}
+
+	if (!ignore_loaded && !wait_msec) {
+		int usage = kmod_module_get_refcnt(mod);
+
+		if (usage > 0) {
+			if (!quiet_inuse)
+				LOG("Module %s is in use.\n",
+						kmod_module_get_name(mod));
+			return -EBUSY;
+		}
+	}
+
+	return rmmod_do_remove_module(mod);
+}
+
+static void *rmmod_plan_worker(void *data)
+{
+	struct rmmod_plan *plan = data;
+
+	pthread_mutex_lock(&plan->lock);
+
+	for (;;) {
+		struct rmmod_node *node;
+		unsigned int i;
+		int err;
+
+		while (!plan->exit && plan->queue_head == plan->queue_tail)
+			pthread_cond_wait(&plan->queued, &plan->lock);
+
+		if (plan->queue_head == plan->queue_tail)
+			break;
+
+		i = plan->queue[plan->queue_head++];
+		node = plan->nodes.array[i];
+		pthread_mutex_unlock(&plan->lock);
+
+		err = rmmod_node_run(node);
+
+		pthread_mutex_lock(&plan->lock);
+		node->err = err;
+		plan->done[plan->done_tail++] = i;
+		pthread_cond_signal(&plan->finished);
+	}
+
+	pthread_mutex_unlock(&plan->lock);
+
+	return NULL;
+}
+
+static void rmmod_plan_finish(struct rmmod_plan *plan, unsigned int i)
+{
+	const struct rmmod_node *node = plan->nodes.array[i];
+	unsigned int j, n = plan->nodes.count;
+
+	for (j = i + 1; j < n; j++) {
+		unsigned char kind = plan->matrix[j * n + i];
+		struct rmmod_node *next = plan->nodes.array[j];
+
+		if (kind == 0)
+			continue;
+
+		next->n_waiting--;
+		if (node->err < 0 && next->cause == 0 &&
+				(kind & (RMMOD_EDGE_SKIP | RMMOD_EDGE_FAIL)))
+			next->cause = node->err;
+	}
+}
+
+static int rmmod_plan_run(struct rmmod_plan *plan)
+{
+	unsigned int i, n = plan->nodes.count;
+	unsigned int n_workers = 0, n_running = 0, n_done = 0;
+	pthread_t *workers = NULL;
+	long jobs = 0;
+	size_t k;
+
+	plan->matrix = calloc((size_t) n * n, 1);
+	plan->queue = calloc(n, sizeof(*plan->queue));
+	plan->done = calloc(n, sizeof(*plan->done));
+	if (plan->matrix == NULL || plan->queue == NULL || plan->done == NULL)
+		return -ENOMEM;
+
+	for (k = 0; k < plan->n_edges; k++) {
+		const struct rmmod_edge *e = &plan->edges[k];
+		unsigned char *kind = &plan->matrix[e->to * n + e->from];
+
+		if (*kind == 0)
+			((struct rmmod_node *) plan->nodes.array[e->to])->n_waiting++;
+		*kind |= e->kind;
+	}
+
+	/* the output of a dry run is in the order of the serial walk */
+	if (!dry_run) {
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (jobs > (long) n)
+			jobs = n;
+	}
+
+	if (jobs > 1) {
+		workers = malloc(sizeof(*workers) * jobs);
+		if (workers == NULL)
+			return -ENOMEM;
+	}
+
+	pthread_mutex_init(&plan->lock, NULL);
+	pthread_cond_init(&plan->queued, NULL);
+	pthread_cond_init(&plan->finished, NULL);
+
+	/* with no worker at all, remove from this thread */
+	for (; workers != NULL && n_workers < jobs; n_workers++) {
+		if (pthread_create(&workers[n_workers], NULL,
+					rmmod_plan_worker, plan) != 0)
+			break;
+	}
+
+	pthread_mutex_lock(&plan->lock);
+
+	while (n_done < n) {
+		bool progress = false;
+
+		for (i = 0; i < n; i++) {
+			struct rmmod_node *node = plan->nodes.array[i];
+
+			if (node->dispatched || node->n_waiting > 0)
+				continue;
+
+			node->dispatched = true;
+			progress = true;
+
+			if (node->cause < 0) {
+				node->err = node->cause;
+			} else if (n_workers > 0 && node->cmd == NULL) {
+				plan->queue[plan->queue_tail++] = i;
+				n_running++;
+				pthread_cond_signal(&plan->queued);
+				continue;
+			} else {
+				pthread_mutex_unlock(&plan->lock);
+				node->err = rmmod_node_run(node);
+				pthread_mutex_lock(&plan->lock);
+			}
+
+			rmmod_plan_finish(plan, i);
+			n_done++;
+		}
+
+		if (progress)
+			continue;
+		if (n_running == 0)
+			break;
+
+		while (plan->done_head == plan->done_tail)
+			pthread_cond_wait(&plan->finished, &plan->lock);
+
+		while (plan->done_head < plan->done_tail) {
+			rmmod_plan_finish(plan, plan->done[plan->done_head++]);
+			n_running--;
+			n_done++;
+		}
+	}
+
+	plan->exit = true;
+	pthread_cond_broadcast(&plan->queued);
+	pthread_mutex_unlock(&plan->lock);
+
+	for (i = 0; i < n_workers; i++)
+		pthread_join(workers[i], NULL);
+
+	pthread_cond_destroy(&plan->finished);
+	pthread_cond_destroy(&plan->queued);
+	pthread_mutex_destroy(&plan->lock);
+	free(workers);
+
+	return 0;
+}
+
+static int rmmod_all_parallel(struct kmod_ctx *ctx, char **args, int nargs)
+{
+	struct rmmod_plan plan = { .last_barrier = -1 };
+	struct kmod_list *loaded = NULL;
+	int i, r, err = 0;
+
+	array_init(&plan.nodes, 64);
+	plan.by_name = hash_new(64, NULL);
+	if (plan.by_name == NULL)
+		return -ENOMEM;
+
+	/* the walk answers from the snapshot, the removals drop it */
+	r = kmod_module_new_from_loaded_snapshot(ctx, &loaded);
+	if (r < 0)
+		WRN("could not read the loaded modules: %s\n", strerror(-r));
+
+	for (i = 0; i < nargs; i++) {
+		r = rmmod_plan_alias(&plan, ctx, args[i]);
+		if (r == -ENOMEM) {
+			err = r;
+			goto finish;
+		}
+		if (r < 0)
+			err = r;
+	}
+
+	if (plan.nodes.count > 0) {
+		r = rmmod_plan_run(&plan);
+		if (r < 0) {
+			err = r;
+			goto finish;
+		}
+	}
+
+	for (i = 0; i < (int) plan.nodes.count; i++) {
+		const struct rmmod_node *node = plan.nodes.array[i];
+
+		if (node->top && node->err < 0)
+			err = node->err;
+	}
+
+finish:
+	for (i = 0; i < (int) plan.nodes.count; i++) {
+		struct rmmod_node *node = plan.nodes.array[i];
+
+		kmod_module_unref(node->mod);
+		free(node);
+	}
+	array_free_array(&plan.nodes);
+	hash_free(plan.by_name);
+	kmod_module_unref_list(loaded);
+	free(plan.edges);
+	free(plan.matrix);
+	free(plan.queue);
+	free(plan.done);
+
+	return err;
+}
+
 static int rmmod_all(struct kmod_ctx *ctx, char **args, int nargs)
 {
 	int i, err = 0;
 
+	if (parallel)
+		return rmmod_all_parallel(ctx, args, nargs);
+
 	for (i = 0; i < nargs; i++) {
 		int r = rmmod(ctx, args[i]);
 		if (r < 0)
@@ -570,6 +1295,86 @@ static void print_action(struct kmod_module *m, bool install,
 		printf("insmod %s %s\n", kmod_module_get_path(m), options);
 }
 
+/*
+ * The module being inserted, for its record in the profile: the probe list
+ * is inserted in order, so each module ends when the next one's action is
+ * shown and the last one when the probe returns.
+ */
+static struct {
+	struct kmod_ctx *ctx;
+	struct kmod_module *mod;
+	unsigned long long mark;
+	unsigned long long start;
+	unsigned long long resolve_usec;
+	uint64_t decompress_usec;
+	uint64_t insert_usec;
+} profile;
+
+static uint64_t profile_stat(enum kmod_stat stat)
+{
+	uint64_t value = 0;
+
+	kmod_get_stat(profile.ctx, stat, &value);
+
+	return value;
+}
+
+/*
+ * One line per module, written at once so concurrent modprobes don't mix
+ * their records: start time and module name, then the time to resolve it,
+ * to decompress it, in (f)init_module() and in total, in microseconds,
+ * and the result.
+ */
+static void profile_end(int err)
+{
+	char line[PATH_MAX];
+	unsigned long long now;
+	int len;
+
+	if (profile.mod == NULL)
+		return;
+
+	now = now_usec();
+	len = snprintf(line, sizeof(line), "%llu %s %llu %llu %llu %llu %d\n",
+		profile.start, kmod_module_get_name(profile.mod),
+		profile.resolve_usec,
+		(unsigned long long) (profile_stat(KMOD_STAT_DECOMPRESS_USEC) -
+						profile.decompress_usec),
+		(unsigned long long) (profile_stat(KMOD_STAT_INSERT_USEC) -
+						profile.insert_usec),
+		now - profile.start, err);
+	if (len > 0 && (size_t) len < sizeof(line) &&
+					write(profile_fd, line, len) != len)
+		ERR("could not write to %s: %m\n", profile_path);
+
+	kmod_module_unref(profile.mod);
+	profile.mod = NULL;
+	profile.mark = now;
+}
+
+static void profile_begin(struct kmod_module *m)
+{
+	bool first = profile.mod == NULL;
+
+	profile_end(0);
+
+	profile.mod = kmod_module_ref(m);
+	profile.start = now_usec();
+	/* the lookup and the probe list are done before the first action */
+	profile.resolve_usec = first ? profile.start - profile.mark : 0;
+	profile.decompress_usec = profile_stat(KMOD_STAT_DECOMPRESS_USEC);
+	profile.insert_usec = profile_stat(KMOD_STAT_INSERT_USEC);
+}
+
+static void profile_action(struct kmod_module *m, bool install,
+							const char *options)
+{
+	profile_begin(m);
+
+	if (do_show || verbose > DEFAULT_VERBOSE)
+		print_action(m, install, options);
+}
+
 static int insmod_insert(struct kmod_module *mod, int flags,
 				const char *extra_options)
 {
@@ -577,7 +1382,9 @@ static int insmod_insert(struct kmod_module *mod, int flags,
 	void (*show)(struct kmod_module *m, bool install,
 						const char *options) = NULL;
 
-	if (do_show || verbose > DEFAULT_VERBOSE)
+	if (profile_fd >= 0)
+		show = &profile_action;
+	else if (do_show || verbose > DEFAULT_VERBOSE)
 		show = &print_action;
 
 	if (lookup_only)
@@ -586,6 +1393,9 @@ static int insmod_insert(struct kmod_module *mod, int flags,
 		err = kmod_module_probe_insert_module(mod, flags,
 				extra_options, NULL, NULL, show);
 
+	if (profile_fd >= 0)
+		profile_end(err);
+
 	if (err >= 0)
 		/* ignore flag return values such as a mod being blacklisted */
 		err = 0;
@@ -611,12 +1421,42 @@ static int insmod_insert(struct kmod_module *mod, int flags,
 	return err;
 }
 
+static int insmod_flags(void)
+{
+	int flags = 0;
+
+	if (strip_modversion || force)
+		flags |= KMOD_PROBE_FORCE_MODVERSION;
+	if (strip_vermagic || force)
+		flags |= KMOD_PROBE_FORCE_VERMAGIC;
+	if (ignore_commands)
+		flags |= KMOD_PROBE_IGNORE_COMMAND;
+	if (ignore_loaded)
+		flags |= KMOD_PROBE_IGNORE_LOADED;
+	if (dry_run)
+		flags |= KMOD_PROBE_DRY_RUN;
+
+	flags |= KMOD_PROBE_APPLY_BLACKLIST_ALIAS_ONLY;
+
+	if (use_blacklist)
+		flags |= KMOD_PROBE_APPLY_BLACKLIST;
+	if (first_time)
+		flags |= KMOD_PROBE_FAIL_ON_LOADED;
+	if (parallel)
+		flags |= KMOD_PROBE_PARALLEL;
+
+	return flags;
+}
+
 static int insmod(struct kmod_ctx *ctx, const char *alias,
 						const char *extra_options)
 {
 	struct kmod_list *l, *list = NULL;
 	struct kmod_module *mod = NULL;
-	int err, flags = 0;
+	int err, flags;
+
+	profile.ctx = ctx;
+	profile.mark = now_usec();
 
 	if (strncmp(alias, "/", 1) == 0 || strncmp(alias, "./", 2) == 0) {
 		err = kmod_module_new_from_path(ctx, alias, &mod);
@@ -634,23 +1474,7 @@ static int insmod(struct kmod_ctx *ctx, const char *alias,
 		}
 	}
 
-	if (strip_modversion || force)
-		flags |= KMOD_PROBE_FORCE_MODVERSION;
-	if (strip_vermagic || force)
-		flags |= KMOD_PROBE_FORCE_VERMAGIC;
-	if (ignore_commands)
-		flags |= KMOD_PROBE_IGNORE_COMMAND;
-	if (ignore_loaded)
-		flags |= KMOD_PROBE_IGNORE_LOADED;
-	if (dry_run)
-		flags |= KMOD_PROBE_DRY_RUN;
-
-	flags |= KMOD_PROBE_APPLY_BLACKLIST_ALIAS_ONLY;
-
-	if (use_blacklist)
-		flags |= KMOD_PROBE_APPLY_BLACKLIST;
-	if (first_time)
-		flags |= KMOD_PROBE_FAIL_ON_LOADED;
+	flags = insmod_flags();
 
 	/* If module is loaded from path */
 	if (mod != NULL) {
@@ -667,10 +1491,86 @@ static int insmod(struct kmod_ctx *ctx, const char *alias,
 	return err;
 }
 
+/*
+ * Resolve all the arguments first so their probe lists are inserted
+ * together: modules shared by several of them are inserted only once and
+ * the insertions of different arguments can run concurrently.
+ */
+static int insmod_all_parallel(struct kmod_ctx *ctx, char **args, int nargs)
+{
+	struct array mods;
+	void (*show)(struct kmod_module *m, bool install,
+						const char *options) = NULL;
+	int i, r, err = 0;
+
+	array_init(&mods, 64);
+
+	for (i = 0; i < nargs; i++) {
+		struct kmod_list *l, *list = NULL;
+		struct kmod_module *mod;
+		const char *alias = args[i];
+
+		if (strncmp(alias, "/", 1) == 0 || strncmp(alias, "./", 2) == 0) {
+			r = kmod_module_new_from_path(ctx, alias, &mod);
+			if (r < 0) {
+				LOG("Failed to get module from path %s: %s\n",
+					alias, strerror(-r));
+				err = -ENOENT;
+				continue;
+			}
+
+			if (array_append(&mods, mod) < 0) {
+				kmod_module_unref(mod);
+				err = -ENOMEM;
+				goto finish;
+			}
+			continue;
+		}
+
+		r = kmod_module_new_from_lookup(ctx, alias, &list);
+		if (list == NULL || r < 0) {
+			LOG("Module %s not found in directory %s\n", alias,
+				ctx ? kmod_get_dirname(ctx) : "(missing)");
+			err = -ENOENT;
+			continue;
+		}
+
+		kmod_list_foreach(l, list) {
+			mod = kmod_module_get_module(l);
+			if (array_append(&mods, mod) < 0) {
+				kmod_module_unref(mod);
+				kmod_module_unref_list(list);
+				err = -ENOMEM;
+				goto finish;
+			}
+		}
+		kmod_module_unref_list(list);
+	}
+
+	if (do_show || verbose > DEFAULT_VERBOSE)
+		show = &print_action;
+
+	/* failures are reported by libkmod, with the module's name */
+	r = kmod_module_probe_insert_modules(
+			(struct kmod_module * const *) mods.array, mods.count,
+			insmod_flags(), NULL, NULL, show);
+	if (r < 0)
+		err = r;
+
+finish:
+	for (i = 0; i < (int) mods.count; i++)
+		kmod_module_unref(mods.array[i]);
+	array_free_array(&mods);
+	return err;
+}
+
 static int insmod_all(struct kmod_ctx *ctx, char **args, int nargs)
 {
 	int i, err = 0;
 
+	if (parallel && !lookup_only)
+		return insmod_all_parallel(ctx, args, nargs);
+
 	for (i = 0; i < nargs; i++) {
 		int r = insmod(ctx, args[i], NULL);
 		if (r < 0)
@@ -830,6 +1730,9 @@ static int do_modprobe(int argc, char **orig_argv)
 	struct kmod_ctx *ctx;
 	char **args = NULL, **argv;
 	const char **config_paths = NULL;
+	const char *env = getenv("MODPROBE_OPTIONS");
+	_cleanup_free_ char *env_options = env != NULL ? strdup(env) : NULL;
+	int orig_argc = argc;
 	int nargs = 0, n_config_paths = 0;
 	char dirname_buf[PATH_MAX];
 	const char *dirname = NULL;
@@ -910,6 +1813,12 @@ static int do_modprobe(int argc, char **orig_argv)
 		case 6:
 			do_show_exports = 1;
 			break;
+		case 7:
+			parallel = 1;
+			break;
+		case 8:
+			profile_path = optarg;
+			break;
 		case 'n':
 			dry_run = 1;
 			break;
@@ -978,6 +1887,17 @@ static int do_modprobe(int argc, char **orig_argv)
 
 	log_open(use_syslog);
 
+	/*
+	 * A profile that can't be written must not keep modules from loading.
+	 * With --parallel, insertions overlap and can't be told apart.
+	 */
+	if (profile_path != NULL && !dry_run && !parallel) {
+		profile_fd = open(profile_path,
+				O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+		if (profile_fd < 0)
+			ERR("could not open %s: %m\n", profile_path);
+	}
+
 	if (!do_show_config) {
 		if (nargs == 0) {
 			ERR("missing parameters. See -h.\n");
@@ -1004,7 +1924,24 @@ static int do_modprobe(int argc, char **orig_argv)
 		dirname = dirname_buf;
 	}
 
-	ctx = kmod_new(dirname, config_paths);
+	/*
+	 * With the default module directory and configuration, the kmod
+	 * server given in KMOD_SERVER_SOCKET does the work from its context
+	 * if it's running and accepts the request
+	 */
+	if (dirname == NULL && config_paths == NULL && server_ctx == NULL) {
+		int status = server_forward_modprobe(orig_argc, orig_argv,
+								env_options);
+		if (status >= 0) {
+			err = status == EXIT_SUCCESS ? 0 : -1;
+			goto done;
+		}
+	}
+
+	if (dirname == NULL && config_paths == NULL && server_ctx != NULL)
+		ctx = kmod_ref(server_ctx);
+	else
+		ctx = kmod_new(dirname, config_paths);
 	if (!ctx) {
 		ERR("kmod_new() failed!\n");
 		err = -1;
@@ -1013,7 +1950,8 @@ static int do_modprobe(int argc, char **orig_argv)
 
 	log_setup_kmod_log(ctx, verbose);
 
-	kmod_load_resources(ctx);
+	if (ctx != server_ctx)
+		kmod_load_resources(ctx);
 
 	if (do_show_config)
 		err = show_config(ctx);
@@ -1039,6 +1977,11 @@ static int do_modprobe(int argc, char **orig_argv)
 done:
 	log_close();
 
+	if (profile_fd >= 0) {
+		close(profile_fd);
+		profile_fd = -1;
+	}
+
 	if (argv != orig_argv)
 		free(argv);
 
@@ -1047,6 +1990,17 @@ done:
 	return err >= 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
+/* Run modprobe in a child of the kmod server, with its context */
+int modprobe_serve(struct kmod_ctx *ctx, int argc, char *argv[])
+{
+	server_ctx = ctx;
+
+	/* the server parsed its own command line with getopt() */
+	optind = 0;
+
+	return do_modprobe(argc, argv);
+}
+
 const struct kmod_cmd kmod_cmd_compat_modprobe = {
 	.name = "modprobe",
 	.cmd = do_modprobe,
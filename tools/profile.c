@@ -0,0 +1,241 @@
+/*
+ * kmod-profile - sum up the records of modprobe --profile per module
+ *
+ * Copyright (C) 2026  kmod contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <shared/array.h>
+#include <shared/hash.h>
+#include <shared/macro.h>
+#include <shared/util.h>
+
+#include "kmod.h"
+
+static const char cmdopts_s[] = "n:h";
+static const struct option cmdopts[] = {
+	{"top", required_argument, 0, 'n'},
+	{"help", no_argument, 0, 'h'},
+	{ }
+};
+
+struct profile_entry {
+	unsigned long long resolve_usec;
+	unsigned long long decompress_usec;
+	unsigned long long insert_usec;
+	unsigned long long total_usec;
+	unsigned int loads;
+	unsigned int failures;
+	char name[];
+};
+
+static void help(void)
+{
+	printf("Usage:\n"
+	       "\t%s profile [options] [file...]\n"
+	       "\n"
+	       "kmod profile sums up the records written by modprobe --profile, read\n"
+	       "from the given files or the standard input, per module: the modules\n"
+	       "taking the most time in total come first.\n"
+	       "\n"
+	       "Options:\n"
+	       "\t-n, --top=N                 Only show the first N modules\n"
+	       "\t-h, --help                  show this help\n",
+	       program_invocation_short_name);
+}
+
+static int profile_add(struct hash *modules, const char *name,
+			unsigned long long resolve,
+			unsigned long long decompress,
+			unsigned long long insert,
+			unsigned long long total, int result)
+{
+	struct profile_entry *e = hash_find(modules, name);
+
+	if (e == NULL) {
+		size_t namelen = strlen(name) + 1;
+		int err;
+
+		e = calloc(1, sizeof(*e) + namelen);
+		if (e == NULL)
+			return -ENOMEM;
+		memcpy(e->name, name, namelen);
+
+		err = hash_add(modules, e->name, e);
+		if (err < 0) {
+			free(e);
+			return err;
+		}
+	}
+
+	e->resolve_usec += resolve;
+	e->decompress_usec += decompress;
+	e->insert_usec += insert;
+	e->total_usec += total;
+	e->loads++;
+	if (result < 0)
+		e->failures++;
+
+	return 0;
+}
+
+static int profile_read(struct hash *modules, FILE *fp, const char *fn)
+{
+	char line[PATH_MAX];
+	unsigned int n = 0;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		unsigned long long start, resolve, decompress, insert, total;
+		char name[PATH_MAX];
+		int result, err;
+
+		n++;
+		if (sscanf(line, "%llu %4095s %llu %llu %llu %llu %d", &start,
+				name, &resolve, &decompress, &insert, &total,
+				&result) != 7) {
+			ERR("%s:%u: ignoring bad line\n", fn, n);
+			continue;
+		}
+
+		err = profile_add(modules, name, resolve, decompress, insert,
+							total, result);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+static int entry_cmp(const void *pa, const void *pb)
+{
+	const struct profile_entry *a = *(const struct profile_entry **) pa;
+	const struct profile_entry *b = *(const struct profile_entry **) pb;
+
+	if (a->total_usec != b->total_usec)
+		return a->total_usec < b->total_usec ? 1 : -1;
+
+	return strcmp(a->name, b->name);
+}
+
+static void profile_print(struct hash *modules, unsigned long top)
+{
+	struct hash_iter iter;
+	const void *v;
+	struct array entries;
+	size_t i;
+
+	array_init(&entries, 64);
+
+	hash_iter_init(modules, &iter);
+	while (hash_iter_next(&iter, NULL, &v)) {
+		if (array_append(&entries, v) < 0) {
+			ERR("could not allocate memory\n");
+			goto finish;
+		}
+	}
+	array_sort(&entries, entry_cmp);
+
+	printf("%-24s %5s %5s %10s %10s %10s %10s\n", "module", "loads",
+		"fails", "resolve", "decompress", "insert", "total (ms)");
+
+	for (i = 0; i < entries.count && (top == 0 || i < top); i++) {
+		const struct profile_entry *e = entries.array[i];
+
+		printf("%-24s %5u %5u %10.3f %10.3f %10.3f %10.3f\n", e->name,
+			e->loads, e->failures, e->resolve_usec / 1000.0,
+			e->decompress_usec / 1000.0, e->insert_usec / 1000.0,
+			e->total_usec / 1000.0);
+	}
+
+finish:
+	array_free_array(&entries);
+}
+
+static int do_profile(int argc, char *argv[])
+{
+	struct hash *modules;
+	unsigned long top = 0;
+	int i, err = 0;
+
+	for (;;) {
+		int c, idx = 0;
+		char *end;
+
+		c = getopt_long(argc, argv, cmdopts_s, cmdopts, &idx);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'n':
+			top = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0') {
+				ERR("invalid number of modules: '%s'\n",
+									optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'h':
+			help();
+			return EXIT_SUCCESS;
+		case '?':
+			return EXIT_FAILURE;
+		default:
+			ERR("Unexpected getopt_long() value '%c'.\n", c);
+			return EXIT_FAILURE;
+		}
+	}
+
+	modules = hash_new(256, free);
+	if (modules == NULL) {
+		ERR("could not allocate memory\n");
+		return EXIT_FAILURE;
+	}
+
+	if (optind >= argc)
+		err = profile_read(modules, stdin, "<stdin>");
+
+	for (i = optind; i < argc && err >= 0; i++) {
+		FILE *fp = fopen(argv[i], "re");
+
+		if (fp == NULL) {
+			err = -errno;
+			ERR("could not open %s: %s\n", argv[i], strerror(-err));
+			break;
+		}
+		err = profile_read(modules, fp, argv[i]);
+		fclose(fp);
+	}
+
+	if (err >= 0)
+		profile_print(modules, top);
+	else if (err == -ENOMEM)
+		ERR("could not allocate memory\n");
+
+	hash_free(modules);
+
+	return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+const struct kmod_cmd kmod_cmd_profile = {
+	.name = "profile",
+	.cmd = do_profile,
+	.help = "sum up the module load profile of modprobe --profile",
+};
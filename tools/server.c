@@ -0,0 +1,779 @@
+/*
+ * kmod-server - serve modprobe requests from a warm context
+ *
+ * Copyright (C) 2026  kmod contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/capability.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <shared/macro.h>
+#include <shared/strbuf.h>
+#include <shared/util.h>
+
+#include <libkmod/libkmod.h>
+
+#include "kmod.h"
+
+/*
+ * A request is a header followed by the strings of the modprobe argv and then
+ * of its environment, each NUL-terminated. The client's stdin, stdout, stderr
+ * and working directory are passed along with the header, so the request is
+ * served as if modprobe ran in the client. The reply is the exit status of
+ * modprobe, as an int32_t, or a negative errno if the request was refused
+ * before anything was done.
+ */
+#define SERVER_MAGIC 0x6b6d6f64
+#define SERVER_REQUEST_MAX (1024 * 1024)
+
+#ifndef SO_PEERPIDFD
+# define SO_PEERPIDFD 77
+#endif
+
+struct server_request {
+	uint32_t magic;
+	uint32_t argc;
+	uint32_t envc;
+	uint32_t len;
+};
+
+enum {
+	SERVER_FD_STDIN,
+	SERVER_FD_STDOUT,
+	SERVER_FD_STDERR,
+	SERVER_FD_CWD,
+	_SERVER_FD_COUNT,
+};
+
+static volatile sig_atomic_t server_quit;
+
+static const char cmdopts_s[] = "s:t:h";
+static const struct option cmdopts[] = {
+	{"socket", required_argument, 0, 's'},
+	{"idle-timeout", required_argument, 0, 't'},
+	{"help", no_argument, 0, 'h'},
+	{ }
+};
+
+static void help(void)
+{
+	printf("Usage:\n"
+	       "\t%s server [options]\n"
+	       "\n"
+	       "kmod server keeps a libkmod context with the indexes and the\n"
+	       "configuration loaded and serves the modprobe requests made\n"
+	       "through its socket with it.\n"
+	       "\n"
+	       "Options:\n"
+	       "\t-s, --socket=PATH           Listen on PATH instead of " KMOD_SERVER_SOCKET "\n"
+	       "\t-t, --idle-timeout=SECONDS  Exit after SECONDS without requests\n"
+	       "\t-h, --help                  show this help\n",
+	       program_invocation_short_name);
+}
+
+static const char *server_socket_path(void)
+{
+	const char *path = secure_getenv("KMOD_SERVER_SOCKET");
+
+	return path != NULL ? path : KMOD_SERVER_SOCKET;
+}
+
+static int server_socket_addr(const char *path, struct sockaddr_un *addr)
+{
+	size_t len = strlen(path);
+
+	if (len >= sizeof(addr->sun_path))
+		return -ENAMETOOLONG;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, path, len + 1);
+
+	return 0;
+}
+
+/* Only serve, or be served by, processes of the same user, or root */
+static bool server_peer_trusted(int fd, bool accept_root)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return false;
+
+	return cred.uid == geteuid() || (accept_root && cred.uid == 0);
+}
+
+/* Whether process @pid, 0 being the caller, has capability @cap effective */
+static int pid_has_cap(pid_t pid, unsigned int cap, bool *has)
+{
+	struct __user_cap_header_struct hdr = {
+		.version = _LINUX_CAPABILITY_VERSION_3,
+		.pid = pid,
+	};
+	struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+
+	if (cap >= 32 * _LINUX_CAPABILITY_U32S_3)
+		return -EINVAL;
+
+	if (syscall(SYS_capget, &hdr, data) < 0)
+		return -errno;
+
+	*has = data[cap / 32].effective & (UINT32_C(1) << (cap % 32));
+
+	return 0;
+}
+
+/*
+ * A client must also have CAP_SYS_MODULE if the server has it: otherwise a
+ * process that dropped it would get modules loaded and install commands run
+ * by the server. The client is the process that connected: the pid in
+ * SO_PEERCRED is only trusted if its pidfd shows it was still running after
+ * its capabilities were read, so the pid can't have been reused.
+ */
+static bool server_peer_capable(int fd)
+{
+	struct pollfd pfd = { .events = POLLIN };
+	struct ucred cred;
+	socklen_t len;
+	bool has = false, ret;
+
+	if (pid_has_cap(0, CAP_SYS_MODULE, &has) < 0)
+		return false;
+	if (!has)
+		return true;
+
+	len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return false;
+
+	len = sizeof(pfd.fd);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERPIDFD, &pfd.fd, &len) < 0)
+		return false;
+
+	ret = pid_has_cap(cred.pid, CAP_SYS_MODULE, &has) == 0 && has &&
+						poll(&pfd, 1, 0) == 0;
+	close(pfd.fd);
+
+	return ret;
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t r = send(fd, buf, len, MSG_NOSIGNAL);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static int recv_all(int fd, char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t r = recv(fd, buf, len, 0);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (r == 0)
+			return -ECONNRESET;
+		buf += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static bool push_string(struct strbuf *buf, const char *s)
+{
+	strbuf_pushchars(buf, s);
+
+	return strbuf_pushchar(buf, '\0');
+}
+
+/*
+ * Build the request: @env_options is the value MODPROBE_OPTIONS had before
+ * modprobe appended its own options to it, so the server parses the same
+ * command line.
+ */
+static int server_request_build(struct strbuf *buf, struct server_request *req,
+				int argc, char *argv[], const char *env_options)
+{
+	char **e;
+	int i;
+
+	req->magic = SERVER_MAGIC;
+	req->argc = argc;
+	req->envc = 0;
+
+	for (i = 0; i < argc; i++) {
+		if (!push_string(buf, argv[i]))
+			return -ENOMEM;
+	}
+
+	for (e = environ; *e != NULL; e++) {
+		if (strstartswith(*e, "MODPROBE_OPTIONS="))
+			continue;
+		if (!push_string(buf, *e))
+			return -ENOMEM;
+		req->envc++;
+	}
+
+	if (env_options != NULL) {
+		strbuf_pushchars(buf, "MODPROBE_OPTIONS=");
+		if (!push_string(buf, env_options))
+			return -ENOMEM;
+		req->envc++;
+	}
+
+	if (buf->used > SERVER_REQUEST_MAX)
+		return -E2BIG;
+
+	req->len = buf->used;
+
+	return 0;
+}
+
+static int server_request_send(int sk, const struct server_request *req,
+					const struct strbuf *buf, int fds[])
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * _SERVER_FD_COUNT)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {
+		.iov_base = (void *) req,
+		.iov_len = sizeof(*req),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr *cmsg;
+
+	memset(&control, 0, sizeof(control));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * _SERVER_FD_COUNT);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * _SERVER_FD_COUNT);
+
+	while (sendmsg(sk, &msg, MSG_NOSIGNAL) < 0) {
+		if (errno != EINTR)
+			return -errno;
+	}
+
+	return send_all(sk, buf->bytes, buf->used);
+}
+
+/*
+ * Let a running kmod server execute modprobe with @argv, if one is asked
+ * for with KMOD_SERVER_SOCKET. Returns the exit status of modprobe, or < 0
+ * if no server did anything: then the caller does the work itself.
+ */
+int server_forward_modprobe(int argc, char *argv[], const char *env_options)
+{
+	struct sockaddr_un addr;
+	struct server_request req;
+	struct strbuf buf;
+	int fds[_SERVER_FD_COUNT];
+	const char *path;
+	int32_t status;
+	int sk, err, i;
+
+	/* only with a server asked for, an empty path being none */
+	path = secure_getenv("KMOD_SERVER_SOCKET");
+	if (path == NULL || path[0] == '\0')
+		return -ENOENT;
+
+	err = server_socket_addr(path, &addr);
+	if (err < 0)
+		return err;
+
+	for (i = 0; i < SERVER_FD_CWD; i++) {
+		if (fcntl(i, F_GETFD) < 0)
+			return -EBADF;
+		fds[i] = i;
+	}
+
+	sk = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sk < 0)
+		return -errno;
+
+	if (connect(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		err = -errno;
+		close(sk);
+		return err;
+	}
+
+	if (!server_peer_trusted(sk, true)) {
+		close(sk);
+		return -EPERM;
+	}
+
+	fds[SERVER_FD_CWD] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fds[SERVER_FD_CWD] < 0) {
+		err = -errno;
+		close(sk);
+		return err;
+	}
+
+	strbuf_init(&buf);
+	err = server_request_build(&buf, &req, argc, argv, env_options);
+	if (err == 0)
+		err = server_request_send(sk, &req, &buf, fds);
+	strbuf_release(&buf);
+	close(fds[SERVER_FD_CWD]);
+
+	if (err < 0) {
+		close(sk);
+		return err;
+	}
+
+	/* from now on the request may have been served, even partially */
+	err = recv_all(sk, (char *) &status, sizeof(status));
+	close(sk);
+	if (err < 0) {
+		ERR("no reply from kmod server: %s\n", strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	/* refused: nothing was done */
+	if (status < 0)
+		DBG("kmod server refused the request: %s\n",
+						strerror(-status));
+
+	return status;
+}
+
+static int server_request_recv(int sk, struct server_request *req, int fds[])
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * _SERVER_FD_COUNT)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {
+		.iov_base = req,
+		.iov_len = sizeof(*req),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t r;
+
+	do {
+		r = recvmsg(sk, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0)
+		return -errno;
+	if (r == 0)
+		return -ECONNRESET;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+			cmsg->cmsg_type != SCM_RIGHTS ||
+			cmsg->cmsg_len != CMSG_LEN(sizeof(int) * _SERVER_FD_COUNT))
+		return -EBADMSG;
+
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * _SERVER_FD_COUNT);
+
+	if (r != sizeof(*req) || (msg.msg_flags & MSG_CTRUNC) ||
+			req->magic != SERVER_MAGIC ||
+			req->len > SERVER_REQUEST_MAX || req->argc == 0 ||
+			req->argc + (uint64_t) req->envc > req->len) {
+		for (r = 0; r < _SERVER_FD_COUNT; r++)
+			close(fds[r]);
+		return -EBADMSG;
+	}
+
+	return 0;
+}
+
+/* Split @count NUL-terminated strings from @p into a NULL-terminated array */
+static char **server_split_strings(char **p, const char *end, uint32_t count)
+{
+	char **array;
+	uint32_t i;
+
+	array = malloc(sizeof(char *) * (count + 1));
+	if (array == NULL)
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		char *s = *p;
+		char *nul = memchr(s, '\0', end - s);
+
+		if (nul == NULL) {
+			free(array);
+			return NULL;
+		}
+		array[i] = s;
+		*p = nul + 1;
+	}
+	array[i] = NULL;
+
+	return array;
+}
+
+/*
+ * The client's environment: kept here since a setenv() replaces environ
+ * with a copy
+ */
+static char **serve_envp;
+
+/* Run the request read from @sk and exit with the status of modprobe */
+static noreturn void server_serve(struct kmod_ctx *ctx, int sk)
+{
+	struct server_request req;
+	int fds[_SERVER_FD_COUNT];
+	char *payload, *p, **argv;
+	int i, err;
+
+	err = server_request_recv(sk, &req, fds);
+	if (err < 0) {
+		/* not an error if the client just went away */
+		if (err != -ECONNRESET)
+			ERR("invalid request: %s\n", strerror(-err));
+		_exit(EXIT_FAILURE);
+	}
+
+	payload = malloc(req.len);
+	if (payload == NULL || recv_all(sk, payload, req.len) < 0)
+		_exit(EXIT_FAILURE);
+
+	p = payload;
+	argv = server_split_strings(&p, payload + req.len, req.argc);
+	serve_envp = server_split_strings(&p, payload + req.len, req.envc);
+	if (argv == NULL || serve_envp == NULL || p != payload + req.len) {
+		ERR("invalid request: %s\n", strerror(EBADMSG));
+		_exit(EXIT_FAILURE);
+	}
+
+	for (i = SERVER_FD_STDIN; i < SERVER_FD_CWD; i++) {
+		if (dup2(fds[i], i) < 0)
+			_exit(EXIT_FAILURE);
+		close(fds[i]);
+	}
+	if (fchdir(fds[SERVER_FD_CWD]) < 0)
+		_exit(EXIT_FAILURE);
+	close(fds[SERVER_FD_CWD]);
+
+	environ = serve_envp;
+	program_invocation_short_name = basename(argv[0]);
+
+	exit(modprobe_serve(ctx, req.argc, argv));
+}
+
+/*
+ * In a child of the server: modprobe may also exit() on its own, e.g. on
+ * fatal errors, so it runs in its own process and its exit status is sent
+ * from here.
+ */
+static noreturn void server_handle(struct kmod_ctx *ctx, int sk)
+{
+	int32_t status = EXIT_FAILURE;
+	int wstatus;
+	pid_t pid;
+
+	pid = fork();
+	if (pid == 0)
+		server_serve(ctx, sk);
+
+	if (pid < 0) {
+		ERR("fork(): %m\n");
+		_exit(EXIT_FAILURE);
+	}
+
+	while (waitpid(pid, &wstatus, 0) < 0) {
+		if (errno != EINTR)
+			_exit(EXIT_FAILURE);
+	}
+
+	if (WIFEXITED(wstatus))
+		status = WEXITSTATUS(wstatus);
+
+	send_all(sk, (const char *) &status, sizeof(status));
+
+	_exit(EXIT_SUCCESS);
+}
+
+/*
+ * Load everything the requests may need once, here, so the children don't
+ * each do it in their copy of the context.
+ */
+static void server_warm(struct kmod_ctx *ctx)
+{
+	struct kmod_config_iter *(*const get_iter[])(const struct kmod_ctx *) = {
+		kmod_config_get_blacklists,
+		kmod_config_get_install_commands,
+		kmod_config_get_remove_commands,
+		kmod_config_get_aliases,
+		kmod_config_get_options,
+		kmod_config_get_softdeps,
+	};
+	size_t i;
+
+	kmod_load_resources(ctx);
+
+	for (i = 0; i < ARRAY_SIZE(get_iter); i++)
+		kmod_config_iter_free_iter(get_iter[i](ctx));
+}
+
+static struct kmod_ctx *server_ctx_new(void)
+{
+	struct kmod_ctx *ctx;
+
+	ctx = kmod_new(NULL, NULL);
+	if (ctx == NULL)
+		return NULL;
+
+	log_setup_kmod_log(ctx, LOG_ERR);
+	server_warm(ctx);
+
+	return ctx;
+}
+
+/* Pick up new indexes or configuration before serving a request */
+static struct kmod_ctx *server_ctx_refresh(struct kmod_ctx *ctx)
+{
+	switch (kmod_validate_resources(ctx)) {
+	case KMOD_RESOURCES_OK:
+		break;
+	case KMOD_RESOURCES_MUST_RELOAD:
+		kmod_unload_resources(ctx);
+		kmod_load_resources(ctx);
+		break;
+	default:
+		kmod_unref(ctx);
+		ctx = server_ctx_new();
+		if (ctx == NULL)
+			ERR("could not create a new libkmod context\n");
+		break;
+	}
+
+	return ctx;
+}
+
+static int server_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t mask;
+	int sk, err;
+
+	err = server_socket_addr(path, &addr);
+	if (err < 0)
+		return err;
+
+	/* a socket left behind by a previous server, not one still in use */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		sk = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (sk < 0)
+			return -errno;
+		err = connect(sk, (struct sockaddr *) &addr, sizeof(addr));
+		close(sk);
+		if (err == 0)
+			return -EADDRINUSE;
+		unlink(path);
+	}
+
+	err = mkdir_parents(path, 0755);
+	if (err < 0)
+		return err;
+
+	sk = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sk < 0)
+		return -errno;
+
+	/* requests are only accepted from the server's user */
+	mask = umask(0177);
+	err = bind(sk, (struct sockaddr *) &addr, sizeof(addr));
+	umask(mask);
+
+	if (err < 0 || listen(sk, SOMAXCONN) < 0) {
+		err = -errno;
+		close(sk);
+		return err;
+	}
+
+	return sk;
+}
+
+static void server_sig_quit(int sig)
+{
+	server_quit = 1;
+}
+
+static int do_server(int argc, char *argv[])
+{
+	struct sigaction sa = { .sa_handler = server_sig_quit };
+	const char *path = server_socket_path();
+	unsigned long idle_timeout = 0;
+	struct kmod_ctx *ctx;
+	int sk, err = 0;
+
+	for (;;) {
+		int c, idx = 0;
+		char *end;
+
+		c = getopt_long(argc, argv, cmdopts_s, cmdopts, &idx);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 's':
+			path = optarg;
+			break;
+		case 't':
+			idle_timeout = strtoul(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' ||
+					idle_timeout > INT_MAX / 1000) {
+				ERR("invalid idle timeout '%s'\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'h':
+			help();
+			return EXIT_SUCCESS;
+		case '?':
+			return EXIT_FAILURE;
+		default:
+			ERR("Unexpected getopt_long() value '%c'.\n", c);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc) {
+		ERR("Unexpected argument '%s'\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	ctx = server_ctx_new();
+	if (ctx == NULL) {
+		ERR("kmod_new() failed!\n");
+		return EXIT_FAILURE;
+	}
+
+	sk = server_listen(path);
+	if (sk < 0) {
+		ERR("could not listen on %s: %s\n", path, strerror(-sk));
+		kmod_unref(ctx);
+		return EXIT_FAILURE;
+	}
+
+	/* no SA_RESTART: poll() returns so the socket is removed on exit */
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	signal(SIGCHLD, SIG_IGN);
+
+	while (!server_quit) {
+		struct pollfd pfd = { .fd = sk, .events = POLLIN };
+		int conn, r;
+		pid_t pid;
+
+		r = poll(&pfd, 1, idle_timeout > 0 ? (int) idle_timeout * 1000 : -1);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			ERR("poll(): %m\n");
+			break;
+		}
+		if (r == 0)
+			break;
+
+		conn = accept4(sk, NULL, NULL, SOCK_CLOEXEC);
+		if (conn < 0)
+			continue;
+
+		if (!server_peer_trusted(conn, false)) {
+			close(conn);
+			continue;
+		}
+
+		/* the client does the work itself */
+		if (!server_peer_capable(conn)) {
+			int32_t status = -EPERM;
+
+			send_all(conn, (const char *) &status, sizeof(status));
+			close(conn);
+			continue;
+		}
+
+		ctx = ctx != NULL ? server_ctx_refresh(ctx) : server_ctx_new();
+		if (ctx == NULL) {
+			close(conn);
+			continue;
+		}
+
+		fflush(NULL);
+		pid = fork();
+		if (pid == 0) {
+			close(sk);
+			signal(SIGCHLD, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			signal(SIGINT, SIG_DFL);
+			server_handle(ctx, conn);
+		}
+		if (pid < 0)
+			ERR("fork(): %m\n");
+
+		close(conn);
+	}
+
+	close(sk);
+	unlink(path);
+	if (ctx != NULL)
+		kmod_unref(ctx);
+
+	return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+const struct kmod_cmd kmod_cmd_server = {
+	.name = "server",
+	.cmd = do_server,
+	.help = "serve modprobe requests from a warm context",
+};
@@ -20,13 +20,17 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
@@ -35,9 +39,16 @@
 
 #include "kmod.h"
 
+/* see output_devname_bin() in depmod */
+#define DEVNAME_BIN_MAGIC 0xB007F45B
+#define DEVNAME_BIN_VERSION 0x00010000
+#define DEVNAME_BIN_HDR_SIZE (3 * sizeof(uint32_t))
+#define DEVNAME_BIN_ENTRY_MIN (2 * sizeof(uint32_t) + 3)
+
 struct static_nodes_format {
 	const char *name;
-	int (*write)(FILE *, char[], char[], char, unsigned int, unsigned int);
+	int (*write)(FILE *, const char *, const char *, char, unsigned int,
+								unsigned int);
 	const char *description;
 };
 
@@ -59,7 +70,8 @@ static const struct option cmdopts[] = {
 	{ },
 };
 
-static int write_human(FILE *out, char modname[], char devname[], char type, unsigned int maj, unsigned int min)
+static int write_human(FILE *out, const char *modname, const char *devname,
+			char type, unsigned int maj, unsigned int min)
 {
 	int ret;
 
@@ -83,7 +95,8 @@ static const struct static_nodes_format static_nodes_format_human = {
 	.description = "(default) a human readable format. Do not parse.",
 };
 
-static int write_tmpfiles(FILE *out, char modname[], char devname[], char type, unsigned int maj, unsigned int min)
+static int write_tmpfiles(FILE *out, const char *modname, const char *devname,
+			char type, unsigned int maj, unsigned int min)
 {
 	const char *dir;
 	int ret;
@@ -110,7 +123,8 @@ static const struct static_nodes_format static_nodes_format_tmpfiles = {
 	.description = "the tmpfiles.d(5) format used by systemd-tmpfiles.",
 };
 
-static int write_devname(FILE *out, char modname[], char devname[], char type, unsigned int maj, unsigned int min)
+static int write_devname(FILE *out, const char *modname, const char *devname,
+			char type, unsigned int maj, unsigned int min)
 {
 	int ret;
 
@@ -127,6 +141,125 @@ static const struct static_nodes_format static_nodes_format_devname = {
 	.description = "the modules.devname format.",
 };
 
+struct devname_bin {
+	const uint8_t *mem;
+	size_t size;
+	uint32_t count;
+};
+
+static uint32_t devname_bin_u32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return ntohl(v);
+}
+
+/*
+ * Walk the entries of modules.devname.bin, passing them to @format unless
+ * @out is NULL. Returns -EINVAL if the file is corrupt.
+ */
+static int devname_bin_foreach(const struct devname_bin *bin,
+				const struct static_nodes_format *format,
+				FILE *out)
+{
+	const uint8_t *p = bin->mem + DEVNAME_BIN_HDR_SIZE;
+	const uint8_t *end = bin->mem + bin->size;
+	uint32_t i;
+
+	for (i = 0; i < bin->count; i++) {
+		const char *modname, *devname;
+		unsigned int maj, min;
+		size_t len;
+		char type;
+
+		if ((size_t) (end - p) < DEVNAME_BIN_ENTRY_MIN)
+			return -EINVAL;
+
+		maj = devname_bin_u32(p);
+		min = devname_bin_u32(p + sizeof(uint32_t));
+		type = p[2 * sizeof(uint32_t)];
+		p += 2 * sizeof(uint32_t) + 1;
+		if (type != 'c' && type != 'b')
+			return -EINVAL;
+
+		modname = (const char *) p;
+		len = strnlen(modname, end - p);
+		if (len == (size_t) (end - p))
+			return -EINVAL;
+		p += len + 1;
+
+		devname = (const char *) p;
+		len = strnlen(devname, end - p);
+		if (len == (size_t) (end - p))
+			return -EINVAL;
+		p += len + 1;
+
+		if (out != NULL)
+			format->write(out, modname, devname, type, maj, min);
+	}
+
+	return 0;
+}
+
+/*
+ * Map modules.devname.bin and check it whole, so that nothing is written
+ * from it unless it can be written entirely. It's not used if it's older
+ * than modules.devname.
+ */
+static int devname_bin_open(const char *release, struct devname_bin *bin)
+{
+	struct devname_bin b;
+	char path[PATH_MAX];
+	struct stat st;
+	void *mem;
+	int fd, err;
+
+	snprintf(path, sizeof(path), "/lib/modules/%s/modules.devname.bin",
+								release);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	snprintf(path, sizeof(path), "/lib/modules/%s/modules.devname", release);
+	if (!index_is_current(path, stat_mstamp(&st))) {
+		close(fd);
+		return -ESTALE;
+	}
+
+	if ((size_t) st.st_size < DEVNAME_BIN_HDR_SIZE) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	err = -errno;
+	close(fd);
+	if (mem == MAP_FAILED)
+		return err;
+
+	b.mem = mem;
+	b.size = st.st_size;
+	b.count = devname_bin_u32(b.mem + 2 * sizeof(uint32_t));
+
+	if (devname_bin_u32(b.mem) != DEVNAME_BIN_MAGIC ||
+	    devname_bin_u32(b.mem + sizeof(uint32_t)) != DEVNAME_BIN_VERSION ||
+	    devname_bin_foreach(&b, NULL, NULL) < 0) {
+		munmap(mem, b.size);
+		return -EINVAL;
+	}
+
+	*bin = b;
+
+	return 0;
+}
+
 static void help(void)
 {
 	size_t i;
@@ -159,6 +292,7 @@ static int do_static_nodes(int argc, char *argv[])
 	const char *output = "/dev/stdout";
 	FILE *in = NULL, *out = NULL;
 	const struct static_nodes_format *format = &static_nodes_format_human;
+	struct devname_bin bin = { };
 	int r, ret = EXIT_SUCCESS;
 
 	for (;;) {
@@ -212,9 +346,16 @@ static int do_static_nodes(int argc, char *argv[])
 		goto finish;
 	}
 
+	/* the binary table needs no parsing, when it's there */
+	r = devname_bin_open(kernel.release, &bin);
+	if (r == -EINVAL)
+		fprintf(stderr, "Warning: /lib/modules/%s/modules.devname.bin is corrupt - ignoring\n",
+			kernel.release);
+
 	snprintf(modules, sizeof(modules), "/lib/modules/%s/modules.devname", kernel.release);
-	in = fopen(modules, "re");
-	if (in == NULL) {
+	if (bin.mem == NULL)
+		in = fopen(modules, "re");
+	if (bin.mem == NULL && in == NULL) {
 		if (errno == ENOENT) {
 			fprintf(stderr, "Warning: /lib/modules/%s/modules.devname not found - ignoring\n",
 				kernel.release);
@@ -241,6 +382,14 @@ static int do_static_nodes(int argc, char *argv[])
 		goto finish;
 	}
 
+	/* a few nodes: written at once at the end */
+	setvbuf(out, NULL, _IOFBF, 64 * 1024);
+
+	if (bin.mem != NULL) {
+		devname_bin_foreach(&bin, format, out);
+		goto finish;
+	}
+
 	while (fgets(buf, sizeof(buf), in) != NULL) {
 		char modname[PATH_MAX];
 		char devname[PATH_MAX];
@@ -263,6 +412,8 @@ static int do_static_nodes(int argc, char *argv[])
 	}
 
 finish:
+	if (bin.mem != NULL)
+		munmap((void *) bin.mem, bin.size);
 	if (in)
 		fclose(in);
 	if (out)